@@ -0,0 +1,648 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Benchmark harness for qbsp, vis and light
+ *
+ * Compiles a corpus of maps - a few representative ones from testmaps/
+ * and synthetic ones generated here - running each tool as a child
+ * process. For each run it records the wall time, the peak resident set
+ * size and the time spent in each phase, from the map.<tool>timing.json
+ * the tools write with -timing (or, for tools too old to have it, the
+ * "---- Phase ----" headers they log as they go). vis also runs with
+ * -stats and light with -profile, which add portals/sec and rays/sec.
+ *
+ * The results are written to benchmark-results.json and compared against
+ * a baseline from an earlier run; anything slower, bigger or lower
+ * throughput than the baseline by more than the threshold is reported as
+ * a regression, and the exit status is 1. Baselines depend on the machine,
+ * so make one with -update-baseline on the machine that runs the
+ * benchmarks.
+ */
+
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using nlohmann::json;
+
+/* testmaps that compile on their own and cover the tools' main paths */
+static const char *corpus_testmaps[] = {
+    "E1M1-edited-ents",
+    "qbspfeatures",
+    "phongtest2",
+};
+
+static const char *tool_names[] = { "qbsp", "vis", "light" };
+
+struct options_t {
+    std::string tools[3];       // paths, empty to skip that tool
+    std::string mapsdir;
+    std::string workdir = ".";
+    std::string baseline;
+    int repeat = 1;
+    int threads = 0;
+    double threshold = 0.1;
+    bool update_baseline = false;
+    bool synthetic_only = false;
+};
+
+/*
+ * =====================================================================
+ * Synthetic maps
+ * =====================================================================
+ */
+
+static void
+Map_Box(std::ostringstream &out, int x0, int y0, int z0, int x1, int y1, int z1, const char *tex)
+{
+    out << "{\n";
+    out << "( " << x0 << " " << y0 << " " << z0 << " ) ( " << x0 << " " << y0 + 1 << " " << z0 << " ) ( " << x0 << " " << y0 << " " << z0 + 1 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "( " << x0 << " " << y0 << " " << z0 << " ) ( " << x0 << " " << y0 << " " << z0 + 1 << " ) ( " << x0 + 1 << " " << y0 << " " << z0 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "( " << x0 << " " << y0 << " " << z0 << " ) ( " << x0 + 1 << " " << y0 << " " << z0 << " ) ( " << x0 << " " << y0 + 1 << " " << z0 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "( " << x1 << " " << y1 << " " << z1 << " ) ( " << x1 << " " << y1 + 1 << " " << z1 << " ) ( " << x1 + 1 << " " << y1 << " " << z1 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "( " << x1 << " " << y1 << " " << z1 << " ) ( " << x1 + 1 << " " << y1 << " " << z1 << " ) ( " << x1 << " " << y1 << " " << z1 + 1 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "( " << x1 << " " << y1 << " " << z1 << " ) ( " << x1 << " " << y1 << " " << z1 + 1 << " ) ( " << x1 << " " << y1 + 1 << " " << z1 << " ) " << tex << " 0 0 0 1 1\n";
+    out << "}\n";
+}
+
+static void
+Map_Entity(std::ostringstream &out, const char *classname, int x, int y, int z, const char *extra = "")
+{
+    out << "{\n\"classname\" \"" << classname << "\"\n\"origin\" \"" << x << " " << y << " " << z << "\"\n" << extra << "}\n";
+}
+
+/*
+ * A grid of rooms joined by doorways, each with a light: lots of small
+ * leafs and portals, so mostly a vis and qbsp load.
+ */
+static std::string
+Map_Rooms(int grid)
+{
+    const int room = 256, wall = 16, height = 192, door = 64;
+    const int size = grid * room;
+    std::ostringstream out;
+
+    out << "{\n\"classname\" \"worldspawn\"\n";
+    // floor, ceiling and the outer walls
+    Map_Box(out, -wall, -wall, -wall, size + wall, size + wall, 0, "floor");
+    Map_Box(out, -wall, -wall, height, size + wall, size + wall, height + wall, "ceiling");
+    Map_Box(out, -wall, -wall, 0, 0, size + wall, height, "wall");
+    Map_Box(out, size, -wall, 0, size + wall, size + wall, height, "wall");
+    Map_Box(out, 0, -wall, 0, size, 0, height, "wall");
+    Map_Box(out, 0, size, 0, size, size + wall, height, "wall");
+
+    // inner walls with a doorway in the middle of each room's side
+    for (int i = 1; i < grid; i++) {
+        const int w = i * room;
+        for (int j = 0; j < grid; j++) {
+            const int a = j * room, mid = a + room / 2;
+            Map_Box(out, w - wall / 2, a, 0, w + wall / 2, mid - door / 2, height, "wall");
+            Map_Box(out, w - wall / 2, mid + door / 2, 0, w + wall / 2, a + room, height, "wall");
+            Map_Box(out, w - wall / 2, mid - door / 2, door * 2, w + wall / 2, mid + door / 2, height, "wall");
+            Map_Box(out, a, w - wall / 2, 0, mid - door / 2, w + wall / 2, height, "wall");
+            Map_Box(out, mid + door / 2, w - wall / 2, 0, a + room, w + wall / 2, height, "wall");
+            Map_Box(out, mid - door / 2, w - wall / 2, door * 2, mid + door / 2, w + wall / 2, height, "wall");
+        }
+    }
+    out << "}\n";
+
+    Map_Entity(out, "info_player_start", room / 2, room / 2, 32);
+    for (int x = 0; x < grid; x++) {
+        for (int y = 0; y < grid; y++)
+            Map_Entity(out, "light", x * room + room / 2, y * room + room / 2, height - 32, "\"light\" \"300\"\n");
+    }
+    return out.str();
+}
+
+/*
+ * One big hall full of pillars and lights: few portals, but lots of
+ * occluded light rays, so mostly a light load.
+ */
+static std::string
+Map_Pillars(int grid)
+{
+    const int spacing = 192, pillar = 32, wall = 16, height = 384;
+    const int size = grid * spacing;
+    std::ostringstream out;
+
+    out << "{\n\"classname\" \"worldspawn\"\n";
+    Map_Box(out, -wall, -wall, -wall, size + wall, size + wall, 0, "floor");
+    Map_Box(out, -wall, -wall, height, size + wall, size + wall, height + wall, "ceiling");
+    Map_Box(out, -wall, -wall, 0, 0, size + wall, height, "wall");
+    Map_Box(out, size, -wall, 0, size + wall, size + wall, height, "wall");
+    Map_Box(out, 0, -wall, 0, size, 0, height, "wall");
+    Map_Box(out, 0, size, 0, size, size + wall, height, "wall");
+
+    for (int x = 0; x < grid; x++) {
+        for (int y = 0; y < grid; y++) {
+            const int cx = x * spacing + spacing / 2, cy = y * spacing + spacing / 2;
+            Map_Box(out, cx - pillar / 2, cy - pillar / 2, 0, cx + pillar / 2, cy + pillar / 2, height, "pillar");
+        }
+    }
+    out << "}\n";
+
+    Map_Entity(out, "info_player_start", spacing, spacing / 4, 32);
+    for (int x = 0; x + 1 < grid; x++) {
+        for (int y = 0; y + 1 < grid; y++)
+            Map_Entity(out, "light", (x + 1) * spacing, (y + 1) * spacing, 64 + 96 * ((x + y) % 3), "\"light\" \"200\"\n");
+    }
+    return out.str();
+}
+
+/*
+ * =====================================================================
+ * Running the tools
+ * =====================================================================
+ */
+
+struct runresult_t {
+    int status = -1;
+    double seconds = 0;
+    double peak_rss_mb = 0;
+    std::map<std::string, double> phases;
+};
+
+static double
+Benchmark_Now(void)
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double>(now).count();
+}
+
+/*
+ * Splits the child's output into lines as it arrives, timing the phases
+ * between "---- Phase ----" headers (qbsp) and "--- Phase ---" (light).
+ * Headers can follow progress output on the same line.
+ */
+class phasetimer_t {
+    std::string line;
+    std::string current;
+    double current_start = 0;
+    std::ofstream *log;
+public:
+    std::map<std::string, double> phases;
+
+    explicit phasetimer_t(std::ofstream *logfile) : log(logfile) {}
+
+    void add(const char *data, size_t size, double now) {
+        log->write(data, size);
+        for (size_t i = 0; i < size; i++) {
+            if (data[i] == '\n' || data[i] == '\r') {
+                finish_line(now);
+                line.clear();
+            } else {
+                line += data[i];
+            }
+        }
+    }
+
+    void finish(double now) {
+        finish_line(now);
+        if (!current.empty())
+            phases[current] += now - current_start;
+        current.clear();
+    }
+
+private:
+    void finish_line(double now) {
+        static const std::regex header("(-{3,4}) ([A-Za-z_][A-Za-z0-9_]*) \\1");
+        std::smatch match;
+        if (!std::regex_search(line, match, header))
+            return;
+        if (!current.empty())
+            phases[current] += now - current_start;
+        current = match[2];
+        current_start = now;
+    }
+};
+
+#ifdef _WIN32
+static runresult_t
+Benchmark_Spawn(const std::vector<std::string> &args, const std::string &dir, const std::string &logfilename)
+{
+    runresult_t result;
+    std::ofstream logfile(logfilename, std::ios::binary);
+    phasetimer_t timer(&logfile);
+
+    std::string cmdline;
+    for (const std::string &arg : args)
+        cmdline += "\"" + arg + "\" ";
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+    HANDLE readpipe, writepipe;
+    if (!CreatePipe(&readpipe, &writepipe, &sa, 0))
+        Error("CreatePipe failed");
+    SetHandleInformation(readpipe, HANDLE_FLAG_INHERIT, 0);
+
+    STARTUPINFOA si = { sizeof(si) };
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdOutput = writepipe;
+    si.hStdError = writepipe;
+    si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    PROCESS_INFORMATION pi;
+
+    const double start = Benchmark_Now();
+    if (!CreateProcessA(nullptr, &cmdline[0], nullptr, nullptr, TRUE, 0, nullptr, dir.c_str(), &si, &pi))
+        Error("couldn't run %s", args[0].c_str());
+    CloseHandle(writepipe);
+
+    char buffer[4096];
+    DWORD got;
+    while (ReadFile(readpipe, buffer, sizeof(buffer), &got, nullptr) && got > 0)
+        timer.add(buffer, got, Benchmark_Now());
+    CloseHandle(readpipe);
+
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    result.seconds = Benchmark_Now() - start;
+    timer.finish(start + result.seconds);
+
+    DWORD status;
+    GetExitCodeProcess(pi.hProcess, &status);
+    result.status = static_cast<int>(status);
+
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(pi.hProcess, &counters, sizeof(counters)))
+        result.peak_rss_mb = counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+
+    CloseHandle(pi.hThread);
+    CloseHandle(pi.hProcess);
+    result.phases = timer.phases;
+    return result;
+}
+#else
+static runresult_t
+Benchmark_Spawn(const std::vector<std::string> &args, const std::string &dir, const std::string &logfilename)
+{
+    runresult_t result;
+    std::ofstream logfile(logfilename, std::ios::binary);
+    phasetimer_t timer(&logfile);
+
+    std::vector<char *> argv;
+    for (const std::string &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int fds[2];
+    if (pipe(fds))
+        Error("pipe: %s", strerror(errno));
+
+    const double start = Benchmark_Now();
+    const pid_t pid = fork();
+    if (pid < 0)
+        Error("fork: %s", strerror(errno));
+    if (pid == 0) {
+        dup2(fds[1], 1);
+        dup2(fds[1], 2);
+        close(fds[0]);
+        close(fds[1]);
+        if (chdir(dir.c_str()) == 0)
+            execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(fds[1]);
+
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0 || (got < 0 && errno == EINTR)) {
+        if (got > 0)
+            timer.add(buffer, got, Benchmark_Now());
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+        ;
+    result.seconds = Benchmark_Now() - start;
+    timer.finish(start + result.seconds);
+
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+#ifdef __APPLE__
+    result.peak_rss_mb = usage.ru_maxrss / (1024.0 * 1024.0);  // bytes
+#else
+    result.peak_rss_mb = usage.ru_maxrss / 1024.0;              // kilobytes
+#endif
+    result.phases = timer.phases;
+    return result;
+}
+#endif
+
+static json
+LoadJson(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file)
+        return json();
+    try {
+        return json::parse(file);
+    } catch (const json::exception &) {
+        return json();
+    }
+}
+
+/*
+ * Runs one tool on one map, repeat times, and keeps the fastest run.
+ */
+static json
+Benchmark_Tool(const options_t &options, int tool, const std::string &mapname)
+{
+    std::vector<std::string> args = { options.tools[tool], "-timing" };
+    if (tool == 1)
+        args.push_back("-stats");
+    if (tool == 2)
+        args.push_back("-profile");
+    if (tool != 0 && options.threads > 0) {
+        args.push_back("-threads");
+        args.push_back(std::to_string(options.threads));
+    }
+    args.push_back(mapname + (tool == 0 ? ".map" : ".bsp"));
+
+    const std::string logfilename = options.workdir + "/" + mapname + "." + tool_names[tool] + ".benchlog";
+
+    runresult_t best;
+    for (int i = 0; i < std::max(1, options.repeat); i++) {
+        // vis would resume from the state file of the last run
+        if (tool == 1)
+            remove((options.workdir + "/" + mapname + ".vis").c_str());
+
+        runresult_t result = Benchmark_Spawn(args, options.workdir, logfilename);
+        if (result.status != 0) {
+            logprint("%s failed on %s with status %d, see %s\n", tool_names[tool], mapname.c_str(),
+                     result.status, logfilename.c_str());
+            return json();
+        }
+        if (i == 0 || result.seconds < best.seconds)
+            best = result;
+    }
+
+    json j = json::object();
+    j["seconds"] = best.seconds;
+    j["peak_rss_mb"] = best.peak_rss_mb;
+    j["phases"] = best.phases;
+
+    const std::string base = options.workdir + "/" + mapname;
+
+    // the tools' own phase times are more exact than their log headers
+    const json timing = LoadJson(base + "." + tool_names[tool] + "timing.json");
+    if (timing.is_object() && timing.contains("phases")) {
+        json phases = json::object();
+        for (const json &phase : timing["phases"])
+            phases[phase.value("name", "")] = phases.value(phase.value("name", ""), 0.0) + phase.value("seconds", 0.0);
+        j["phases"] = phases;
+    }
+
+    if (tool == 1) {
+        const json stats = LoadJson(base + ".visstats.json");
+        if (stats.is_object() && stats.contains("threads")) {
+            double busy = 0, portals = 0;
+            for (const json &thread : stats["threads"]) {
+                busy += thread.value("busy", 0.0);
+                portals += thread.value("portals", 0.0);
+            }
+            if (busy > 0)
+                j["portals_per_second"] = portals / busy;
+        }
+    } else if (tool == 2) {
+        const json profile = LoadJson(base + ".lightprofile.json");
+        if (profile.is_object() && profile.contains("threads")) {
+            double busy = 0, rays = 0;
+            for (const json &thread : profile["threads"]) {
+                busy += thread.value("busy", 0.0);
+                rays += thread.value("rays", 0.0);
+            }
+            if (busy > 0)
+                j["rays_per_second"] = rays / busy;
+        }
+    }
+
+    logprint("  %-6s %8.3f secs  %8.1f MB", tool_names[tool], best.seconds, best.peak_rss_mb);
+    if (j.contains("portals_per_second"))
+        logprint("  %.0f portals/sec", j["portals_per_second"].get<double>());
+    if (j.contains("rays_per_second"))
+        logprint("  %.0f rays/sec", j["rays_per_second"].get<double>());
+    logprint("\n");
+    return j;
+}
+
+/*
+ * =====================================================================
+ * Baseline comparison
+ * =====================================================================
+ */
+
+/* runs and phases shorter than this in the baseline are too noisy to time */
+#define MIN_SECONDS 0.25
+
+static int
+Benchmark_CompareValue(const std::string &what, double value, double baseline, bool higher_is_better,
+                       double threshold)
+{
+    if (baseline <= 0)
+        return 0;
+    const double change = (value - baseline) / baseline;
+    const bool regressed = higher_is_better ? (change < -threshold) : (change > threshold);
+    if (regressed) {
+        logprint("REGRESSION: %s: %.3f, baseline %.3f (%+.1f%%)\n", what.c_str(), value, baseline, 100.0 * change);
+        return 1;
+    }
+    return 0;
+}
+
+static int
+Benchmark_Compare(const json &results, const json &baseline, double threshold)
+{
+    int regressions = 0;
+
+    for (const auto &map : results["maps"].items()) {
+        if (!baseline["maps"].contains(map.key())) {
+            logprint("%s: not in the baseline\n", map.key().c_str());
+            continue;
+        }
+        const json &basemap = baseline["maps"][map.key()];
+
+        for (const auto &tool : map.value().items()) {
+            if (!basemap.contains(tool.key()) || tool.value().is_null() || basemap[tool.key()].is_null())
+                continue;
+            const json &cur = tool.value();
+            const json &base = basemap[tool.key()];
+            const std::string prefix = map.key() + " " + tool.key();
+
+            regressions += Benchmark_CompareValue(prefix + " peak RSS MB", cur["peak_rss_mb"], base["peak_rss_mb"], false, threshold);
+            if (base["seconds"].get<double>() < MIN_SECONDS)
+                continue;
+            regressions += Benchmark_CompareValue(prefix + " seconds", cur["seconds"], base["seconds"], false, threshold);
+            for (const char *rate : { "rays_per_second", "portals_per_second" }) {
+                if (cur.contains(rate) && base.contains(rate))
+                    regressions += Benchmark_CompareValue(prefix + " " + rate, cur[rate], base[rate], true, threshold);
+            }
+            for (const auto &phase : cur["phases"].items()) {
+                const double basephase = base["phases"].value(phase.key(), 0.0);
+                if (basephase >= MIN_SECONDS)
+                    regressions += Benchmark_CompareValue(prefix + " phase " + phase.key(), phase.value(), basephase, false, threshold);
+            }
+        }
+    }
+
+    if (regressions)
+        logprint("%d regressions against the baseline (threshold %.0f%%)\n", regressions, 100.0 * threshold);
+    else
+        logprint("no regressions against the baseline (threshold %.0f%%)\n", 100.0 * threshold);
+    return regressions;
+}
+
+static void
+PrintUsage(void)
+{
+    printf("usage: benchmark [-qbsp path] [-vis path] [-light path] [-maps testmapsdir] [-work dir]\n"
+           "                 [-repeat n] [-threads n] [-baseline file] [-update-baseline]\n"
+           "                 [-threshold fraction] [-synthetic-only]\n"
+           "\n"
+           "Runs the tools given over the benchmark maps in the work directory, writes\n"
+           "benchmark-results.json there, and compares it against the baseline.\n"
+           "  -repeat n           run each tool n times and keep the fastest (default 1)\n"
+           "  -threads n          passed to vis and light\n"
+           "  -baseline file      compare against (or with -update-baseline, write) this file\n"
+           "  -threshold f        allowed change before it counts as a regression (default 0.1)\n"
+           "  -synthetic-only     only the generated maps, not those from -maps\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    options_t options;
+
+    printf("---- benchmark / ericw-tools " stringify(ERICWTOOLS_VERSION) " ----\n");
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasarg = i + 1 < argc;
+        if (!strcmp(argv[i], "-qbsp") && hasarg) {
+            options.tools[0] = argv[++i];
+        } else if (!strcmp(argv[i], "-vis") && hasarg) {
+            options.tools[1] = argv[++i];
+        } else if (!strcmp(argv[i], "-light") && hasarg) {
+            options.tools[2] = argv[++i];
+        } else if (!strcmp(argv[i], "-maps") && hasarg) {
+            options.mapsdir = argv[++i];
+        } else if (!strcmp(argv[i], "-work") && hasarg) {
+            options.workdir = argv[++i];
+        } else if (!strcmp(argv[i], "-repeat") && hasarg) {
+            options.repeat = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-threads") && hasarg) {
+            options.threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-baseline") && hasarg) {
+            options.baseline = argv[++i];
+        } else if (!strcmp(argv[i], "-threshold") && hasarg) {
+            options.threshold = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-update-baseline")) {
+            options.update_baseline = true;
+        } else if (!strcmp(argv[i], "-synthetic-only")) {
+            options.synthetic_only = true;
+        } else {
+            PrintUsage();
+            exit(1);
+        }
+    }
+
+    if (options.tools[0].empty()) {
+        PrintUsage();
+        Error("-qbsp is required, the other tools work on its output");
+    }
+
+    // write out the corpus
+    std::vector<std::string> maps;
+    if (!options.synthetic_only && !options.mapsdir.empty()) {
+        for (const char *name : corpus_testmaps) {
+            std::ifstream in(options.mapsdir + "/" + name + ".map", std::ios::binary);
+            if (!in) {
+                logprint("WARNING: %s/%s.map not found, skipping\n", options.mapsdir.c_str(), name);
+                continue;
+            }
+            std::ofstream out(options.workdir + "/" + name + ".map", std::ios::binary);
+            out << in.rdbuf();
+            maps.push_back(name);
+        }
+    }
+    const std::pair<const char *, std::string> synthetic[] = {
+        { "synthetic_rooms", Map_Rooms(16) },
+        { "synthetic_pillars", Map_Pillars(12) },
+    };
+    for (const auto &map : synthetic) {
+        std::ofstream out(options.workdir + "/" + map.first + ".map", std::ios::binary);
+        out << map.second;
+        maps.push_back(map.first);
+    }
+
+    json results = json::object();
+    results["repeat"] = options.repeat;
+    results["threads"] = options.threads;
+    json &mapresults = (results.emplace("maps", json::object())).first.value();
+
+    for (const std::string &map : maps) {
+        logprint("%s\n", map.c_str());
+        json &mapresult = mapresults[map];
+        for (int tool = 0; tool < 3; tool++) {
+            if (options.tools[tool].empty())
+                continue;
+            mapresult[tool_names[tool]] = Benchmark_Tool(options, tool, map);
+            if (mapresult[tool_names[tool]].is_null())
+                break;  // the later tools need this one's output
+        }
+    }
+
+    const std::string resultsfile = options.workdir + "/benchmark-results.json";
+    std::ofstream(resultsfile) << results.dump(4);
+    logprint("wrote %s\n", resultsfile.c_str());
+
+    if (options.baseline.empty())
+        return 0;
+
+    if (options.update_baseline) {
+        std::ofstream(options.baseline) << results.dump(4);
+        logprint("wrote baseline %s\n", options.baseline.c_str());
+        return 0;
+    }
+
+    const json baseline = LoadJson(options.baseline);
+    if (!baseline.is_object() || !baseline.contains("maps")) {
+        logprint("no baseline at %s; make one with -update-baseline\n", options.baseline.c_str());
+        return 0;
+    }
+    return Benchmark_Compare(results, baseline, options.threshold) ? 1 : 0;
+}
@@ -20,30 +20,166 @@
 
 #include <common/cmdlib.hh>
 #include <common/bspfile.hh>
+#include <common/batch.hh>
+#include <common/threads.hh>
 
+#include <algorithm>
+#include <functional>
 #include <sstream>
 #include <fstream>
-#include <iomanip>
+#include <string>
+#include <vector>
 #include <fmt/ostream.h>
 #include <nlohmann/json.hpp>
 
 using namespace nlohmann;
 
-static std::string hex_string(const uint8_t* bytes, const size_t count) {
-    std::stringstream str;
-    
-    for (size_t i = 0; i < count; ++i) {
-        fmt::print(str, "{:x}", bytes[i]);
-    }    
+/**
+ * Receives the document as it's produced. Keys must come in sorted order,
+ * the order nlohmann::json's std::map would put them in.
+ */
+class json_writer_t {
+public:
+    virtual ~json_writer_t() = default;
+    virtual void begin_object() = 0;
+    virtual void begin_array() = 0;
+    virtual void end() = 0;
+    virtual void key(const char *name) = 0;
+    virtual void value(const json &j) = 0;
+    /* a string of the bytes in hex, without zero padding (as bspinfo always has) */
+    virtual void hex(const uint8_t *bytes, size_t count) = 0;
+};
 
-    return str.str();
-}
+/**
+ * Writes straight to the output, in exactly the layout dump(4) gives the
+ * equivalent tree, so nothing bigger than one lump element is held in
+ * memory.
+ */
+class json_stream_writer_t : public json_writer_t {
+    std::ostream &out;
+    std::vector<char> closers; /* per open container */
+    std::vector<bool> empty;   /* per open container: nothing written yet */
+    bool afterkey = false;
+
+    void newline(size_t depth) {
+        out << '\n';
+        for (size_t i = 0; i < depth * 4; i++)
+            out << ' ';
+    }
+
+    /* before a key, or a value in an array */
+    void next() {
+        if (afterkey) {
+            afterkey = false;
+            return;
+        }
+        if (empty.empty())
+            return;
+        if (!empty.back())
+            out << ',';
+        empty.back() = false;
+        newline(empty.size());
+    }
+
+    void begin(char opener, char closer) {
+        next();
+        out << opener;
+        closers.push_back(closer);
+        empty.push_back(true);
+    }
+
+public:
+    explicit json_stream_writer_t(std::ostream &stream) : out(stream) { }
+
+    void begin_object() override { begin('{', '}'); }
+    void begin_array() override { begin('[', ']'); }
+
+    void end() override {
+        const bool wasempty = empty.back();
+        const char closer = closers.back();
+        empty.pop_back();
+        closers.pop_back();
+        if (!wasempty)
+            newline(empty.size());
+        out << closer;
+    }
+
+    void key(const char *name) override {
+        next();
+        out << json(name).dump() << ": ";
+        afterkey = true;
+    }
+
+    void value(const json &j) override {
+        next();
+        std::string text = j.dump(4);
+        const std::string indent = "\n" + std::string(empty.size() * 4, ' ');
+        for (size_t pos = 0; (pos = text.find('\n', pos)) != std::string::npos; pos += indent.size())
+            text.replace(pos, 1, indent);
+        out << text;
+    }
+
+    void hex(const uint8_t *bytes, size_t count) override {
+        static const char digits[] = "0123456789abcdef";
+        next();
+        out << '"';
+        char buf[4096];
+        size_t len = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (len + 2 > sizeof(buf)) {
+                out.write(buf, len);
+                len = 0;
+            }
+            if (bytes[i] >= 16)
+                buf[len++] = digits[bytes[i] >> 4];
+            buf[len++] = digits[bytes[i] & 15];
+        }
+        out.write(buf, len);
+        out << '"';
+    }
+};
+
+/**
+ * Builds the document as a json tree, for the binary formats.
+ */
+class json_tree_writer_t : public json_writer_t {
+    std::vector<json *> stack;
+    std::string pendingkey;
+
+    json &insert(json j) {
+        if (stack.empty()) {
+            root = std::move(j);
+            return root;
+        }
+        json &parent = *stack.back();
+        if (parent.is_array())
+            return parent.insert(parent.end(), std::move(j)).value();
+        return parent[pendingkey] = std::move(j);
+    }
+
+public:
+    json root;
+
+    void begin_object() override { stack.push_back(&insert(json::object())); }
+    void begin_array() override { stack.push_back(&insert(json::array())); }
+    void end() override { stack.pop_back(); }
+    void key(const char *name) override { pendingkey = name; }
+    void value(const json &j) override { insert(j); }
+
+    void hex(const uint8_t *bytes, size_t count) override {
+        std::string str;
+        str.reserve(count * 2);
+        for (size_t i = 0; i < count; ++i)
+            str += fmt::format("{:x}", bytes[i]);
+        insert(str);
+    }
+};
 
 /**
- * returns a JSON array of models
+ * writes a JSON array of models
  */
-static json serialzie_bspxbrushlist(const uint8_t* const lumpdata, const size_t lumpsize) {
-    json j = json::array();
+static void serialize_bspxbrushlist(json_writer_t &w, const uint8_t* const lumpdata, const size_t lumpsize) {
+    w.begin_array();
 
     const uint8_t* p = lumpdata;
 
@@ -52,19 +188,16 @@ static json serialzie_bspxbrushlist(const uint8_t* const lumpdata, const size_t
         memcpy(&src_model, p, sizeof(bspxbrushes_permodel));
         p += sizeof(src_model);
 
-        json &model = j.insert(j.end(), json::object()).value();
-        model["ver"] = src_model.ver;
-        model["modelnum"] = src_model.modelnum;
-        model["numbrushes"] = src_model.numbrushes;
-        model["numfaces"] = src_model.numfaces;
-        json &brushes = (model.emplace("brushes", json::array())).first.value();
+        w.begin_object();
+        w.key("brushes");
+        w.begin_array();
 
         for (int32_t i = 0; i < src_model.numbrushes; ++i) {
             bspxbrushes_perbrush src_brush;
             memcpy(&src_brush, p, sizeof(bspxbrushes_perbrush));
             p += sizeof(src_brush);
 
-            json &brush = brushes.insert(brushes.end(), json::object()).value();
+            json brush = json::object();
             brush.push_back({ "mins", json::array({ src_brush.mins[0], src_brush.mins[1], src_brush.mins[2] }) });
             brush.push_back({ "maxs", json::array({ src_brush.maxs[0], src_brush.maxs[1], src_brush.maxs[2] }) });
             brush.push_back({ "contents", src_brush.contents });
@@ -79,271 +212,404 @@ static json serialzie_bspxbrushlist(const uint8_t* const lumpdata, const size_t
                 face.push_back({ "normal", json::array({ src_face.normal[0], src_face.normal[1], src_face.normal[2] }) });
                 face.push_back({ "dist", src_face.dist });
             }
-        }
-    }
-
-    return j;
-}
 
-static void serialize_bsp(const bspdata_t &bspdata, const char *name) {
-    const mbsp_t &bsp = bspdata.data.mbsp;
-
-    json j = json::object();
-
-    if (bsp.nummodels) {
-        json &models = (j.emplace("models", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.nummodels; i++) {
-            json &model = models.insert(models.end(), json::object()).value();
-            auto &src_model = bsp.dmodels[i];
-
-            model.push_back({ "mins", json::array({ src_model.mins[0], src_model.mins[1], src_model.mins[2] }) });
-            model.push_back({ "maxs", json::array({ src_model.maxs[0], src_model.maxs[1], src_model.maxs[2] }) });
-            model.push_back({ "origin", json::array({ src_model.origin[0], src_model.origin[1], src_model.origin[2] }) });
-            model.push_back({ "headnode", json::array({ src_model.headnode[0], src_model.headnode[1], src_model.headnode[2], src_model.headnode[3], src_model.headnode[4], src_model.headnode[5], src_model.headnode[6], src_model.headnode[7] }) });
-            model.push_back({ "visleafs", src_model.visleafs });
-            model.push_back({ "firstface", src_model.firstface });
-            model.push_back({ "numfaces", src_model.numfaces });
+            w.value(brush);
         }
-    }
-    
-    if (bsp.visdatasize) {
-        j["visdata"] = hex_string(bsp.dvisdata, bsp.visdatasize);
-    }
 
-    if (bsp.lightdatasize) {
-        j["lightdata"] = hex_string(bsp.dlightdata, bsp.lightdatasize);
+        w.end();
+        w.key("modelnum");
+        w.value(src_model.modelnum);
+        w.key("numbrushes");
+        w.value(src_model.numbrushes);
+        w.key("numfaces");
+        w.value(src_model.numfaces);
+        w.key("ver");
+        w.value(src_model.ver);
+        w.end();
     }
 
-    if (bsp.entdatasize) {
-        j["entdata"] = std::string(bsp.dentdata, static_cast<size_t>(bsp.entdatasize));
-    }
-
-    if (bsp.numleafs) {
-        json &leafs = (j.emplace("leafs", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numleafs; i++) {
-            json &leaf = leafs.insert(leafs.end(), json::object()).value();
-            auto &src_leaf = bsp.dleafs[i];
-            
-            leaf.push_back({ "contents", src_leaf.contents });
-            leaf.push_back({ "visofs", src_leaf.visofs });
-            leaf.push_back({ "mins", json::array({ src_leaf.mins[0], src_leaf.mins[1], src_leaf.mins[2] }) });
-            leaf.push_back({ "maxs", json::array({ src_leaf.maxs[0], src_leaf.maxs[1], src_leaf.maxs[2] }) });
-            leaf.push_back({ "firstmarksurface", src_leaf.firstmarksurface });
-            leaf.push_back({ "nummarksurfaces", src_leaf.nummarksurfaces });
-            leaf.push_back({ "ambient_level", json::array({ src_leaf.ambient_level[0], src_leaf.ambient_level[1], src_leaf.ambient_level[2], src_leaf.ambient_level[3] }) });
-            leaf.push_back({ "cluster", src_leaf.cluster });
-            leaf.push_back({ "area", src_leaf.area });
-            leaf.push_back({ "firstleafbrush", src_leaf.firstleafbrush });
-            leaf.push_back({ "numleafbrushes", src_leaf.numleafbrushes });
-        }
-    }
-
-    if (bsp.numplanes) {
-        json &planes = (j.emplace("planes", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numplanes; i++) {
-            json &plane = planes.insert(planes.end(), json::object()).value();
-            auto &src_plane = bsp.dplanes[i];
-
-            plane.push_back({ "normal", json::array({ src_plane.normal[0], src_plane.normal[1], src_plane.normal[2] }) });
-            plane.push_back({ "dist", src_plane.dist });
-            plane.push_back({ "type", src_plane.type });
-        }
-    }
-
-    if (bsp.numvertexes) {
-        json &vertexes = (j.emplace("vertexes", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numvertexes; i++) {            
-            auto &src_vertex = bsp.dvertexes[i];
-
-            vertexes.insert(vertexes.end(), json::array({src_vertex.point[0], src_vertex.point[1], src_vertex.point[2]}));
-        }
-    }
+    w.end();
+}
 
-    if (bsp.numnodes) {
-        json &nodes = (j.emplace("nodes", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numnodes; i++) {
-            json &node = nodes.insert(nodes.end(), json::object()).value();
-            auto &src_node = bsp.dnodes[i];
-            
-            node.push_back({ "planenum", src_node.planenum });
-            node.push_back({ "children", json::array({ src_node.children[0], src_node.children[1] }) });
-            node.push_back({ "mins", json::array({ src_node.mins[0], src_node.mins[1], src_node.mins[2] }) });
-            node.push_back({ "maxs", json::array({ src_node.maxs[0], src_node.maxs[1], src_node.maxs[2] }) });
-            node.push_back({ "firstface", src_node.firstface });
-            node.push_back({ "numfaces", src_node.numfaces });
-        }
-    }
+/**
+ * A top-level key of the document: whether the bsp has anything for it,
+ * and how to write it.
+ */
+struct bsplump_writer_t {
+    const char *name;
+    bool present;
+    std::function<void(json_writer_t &, const mbsp_t &, const bspdata_t &)> write;
+};
+
+/* an array of count elements, each made by element(i) */
+template <typename F>
+static void write_array(json_writer_t &w, int32_t count, F element) {
+    w.begin_array();
+    for (int32_t i = 0; i < count; i++)
+        w.value(element(i));
+    w.end();
+}
 
-    if (bsp.numtexinfo) {
-        json &texinfos = (j.emplace("texinfo", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numtexinfo; i++) {
-            json &texinfo = texinfos.insert(texinfos.end(), json::object()).value();
-            auto &src_texinfo = bsp.texinfo[i];
-            
-            texinfo.push_back({ "vecs", json::array({
-                json::array({ src_texinfo.vecs[0][0], src_texinfo.vecs[0][1], src_texinfo.vecs[0][2], src_texinfo.vecs[0][3] }),
-                json::array({ src_texinfo.vecs[1][0], src_texinfo.vecs[1][1], src_texinfo.vecs[1][2], src_texinfo.vecs[1][3] })
-            })});
-            texinfo.push_back({ "flags", src_texinfo.flags.native });
-            texinfo.push_back({ "miptex", src_texinfo.miptex });
-            texinfo.push_back({ "value", src_texinfo.value });
-            texinfo.push_back({ "texture", std::string(src_texinfo.texture) });
-            texinfo.push_back({ "nexttexinfo", src_texinfo.nexttexinfo });
-        }
-    }
+static std::vector<bsplump_writer_t> bsp_lump_writers(const bspdata_t &bspdata) {
+    const mbsp_t &bsp = bspdata.data.mbsp;
 
-    if (bsp.numfaces) {
-        json &faces = (j.emplace("faces", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numfaces; i++) {
-            json &face = faces.insert(faces.end(), json::object()).value();
-            auto &src_face = bsp.dfaces[i];
-            
-            face.push_back({ "planenum", src_face.planenum });
-            face.push_back({ "side", src_face.side });
-            face.push_back({ "firstedge", src_face.firstedge });
-            face.push_back({ "numedges", src_face.numedges });
-            face.push_back({ "texinfo", src_face.texinfo });
-            face.push_back({ "styles", json::array({ src_face.styles[0], src_face.styles[1], src_face.styles[2], src_face.styles[3] }) });
-            face.push_back({ "lightofs", src_face.lightofs });
-
-            // for readibility, also output the actual vertices
-            auto verts = json::array();
-            for (int32_t k = 0; k < src_face.numedges; ++k) {
-                auto se = bsp.dsurfedges[src_face.firstedge + k];
-                uint32_t v = (se < 0) ? bsp.dedges[-se].v[1] : bsp.dedges[se].v[0];
-                auto dv = bsp.dvertexes[v];
-                verts.push_back(json::array({ dv.point[0], dv.point[1], dv.point[2] }));
+    return {
+        { "models", bsp.nummodels > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.nummodels, [&](int32_t i) {
+                json model = json::object();
+                auto &src_model = bsp.dmodels[i];
+
+                model.push_back({ "mins", json::array({ src_model.mins[0], src_model.mins[1], src_model.mins[2] }) });
+                model.push_back({ "maxs", json::array({ src_model.maxs[0], src_model.maxs[1], src_model.maxs[2] }) });
+                model.push_back({ "origin", json::array({ src_model.origin[0], src_model.origin[1], src_model.origin[2] }) });
+                model.push_back({ "headnode", json::array({ src_model.headnode[0], src_model.headnode[1], src_model.headnode[2], src_model.headnode[3], src_model.headnode[4], src_model.headnode[5], src_model.headnode[6], src_model.headnode[7] }) });
+                model.push_back({ "visleafs", src_model.visleafs });
+                model.push_back({ "firstface", src_model.firstface });
+                model.push_back({ "numfaces", src_model.numfaces });
+                return model;
+            });
+        }},
+
+        { "visdata", bsp.visdatasize > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            w.hex(bsp.dvisdata, bsp.visdatasize);
+        }},
+
+        { "lightdata", bsp.lightdatasize > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            w.hex(bsp.dlightdata, bsp.lightdatasize);
+        }},
+
+        { "entdata", bsp.entdatasize > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            w.value(std::string(bsp.dentdata, static_cast<size_t>(bsp.entdatasize)));
+        }},
+
+        { "leafs", bsp.numleafs > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numleafs, [&](int32_t i) {
+                json leaf = json::object();
+                auto &src_leaf = bsp.dleafs[i];
+
+                leaf.push_back({ "contents", src_leaf.contents });
+                leaf.push_back({ "visofs", src_leaf.visofs });
+                leaf.push_back({ "mins", json::array({ src_leaf.mins[0], src_leaf.mins[1], src_leaf.mins[2] }) });
+                leaf.push_back({ "maxs", json::array({ src_leaf.maxs[0], src_leaf.maxs[1], src_leaf.maxs[2] }) });
+                leaf.push_back({ "firstmarksurface", src_leaf.firstmarksurface });
+                leaf.push_back({ "nummarksurfaces", src_leaf.nummarksurfaces });
+                leaf.push_back({ "ambient_level", json::array({ src_leaf.ambient_level[0], src_leaf.ambient_level[1], src_leaf.ambient_level[2], src_leaf.ambient_level[3] }) });
+                leaf.push_back({ "cluster", src_leaf.cluster });
+                leaf.push_back({ "area", src_leaf.area });
+                leaf.push_back({ "firstleafbrush", src_leaf.firstleafbrush });
+                leaf.push_back({ "numleafbrushes", src_leaf.numleafbrushes });
+                return leaf;
+            });
+        }},
+
+        { "planes", bsp.numplanes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numplanes, [&](int32_t i) {
+                json plane = json::object();
+                auto &src_plane = bsp.dplanes[i];
+
+                plane.push_back({ "normal", json::array({ src_plane.normal[0], src_plane.normal[1], src_plane.normal[2] }) });
+                plane.push_back({ "dist", src_plane.dist });
+                plane.push_back({ "type", src_plane.type });
+                return plane;
+            });
+        }},
+
+        { "vertexes", bsp.numvertexes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numvertexes, [&](int32_t i) {
+                auto &src_vertex = bsp.dvertexes[i];
+
+                return json::array({src_vertex.point[0], src_vertex.point[1], src_vertex.point[2]});
+            });
+        }},
+
+        { "nodes", bsp.numnodes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numnodes, [&](int32_t i) {
+                json node = json::object();
+                auto &src_node = bsp.dnodes[i];
+
+                node.push_back({ "planenum", src_node.planenum });
+                node.push_back({ "children", json::array({ src_node.children[0], src_node.children[1] }) });
+                node.push_back({ "mins", json::array({ src_node.mins[0], src_node.mins[1], src_node.mins[2] }) });
+                node.push_back({ "maxs", json::array({ src_node.maxs[0], src_node.maxs[1], src_node.maxs[2] }) });
+                node.push_back({ "firstface", src_node.firstface });
+                node.push_back({ "numfaces", src_node.numfaces });
+                return node;
+            });
+        }},
+
+        { "texinfo", bsp.numtexinfo > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numtexinfo, [&](int32_t i) {
+                json texinfo = json::object();
+                auto &src_texinfo = bsp.texinfo[i];
+
+                texinfo.push_back({ "vecs", json::array({
+                    json::array({ src_texinfo.vecs[0][0], src_texinfo.vecs[0][1], src_texinfo.vecs[0][2], src_texinfo.vecs[0][3] }),
+                    json::array({ src_texinfo.vecs[1][0], src_texinfo.vecs[1][1], src_texinfo.vecs[1][2], src_texinfo.vecs[1][3] })
+                })});
+                texinfo.push_back({ "flags", src_texinfo.flags.native });
+                texinfo.push_back({ "miptex", src_texinfo.miptex });
+                texinfo.push_back({ "value", src_texinfo.value });
+                texinfo.push_back({ "texture", std::string(src_texinfo.texture) });
+                texinfo.push_back({ "nexttexinfo", src_texinfo.nexttexinfo });
+                return texinfo;
+            });
+        }},
+
+        { "faces", bsp.numfaces > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numfaces, [&](int32_t i) {
+                json face = json::object();
+                auto &src_face = bsp.dfaces[i];
+
+                face.push_back({ "planenum", src_face.planenum });
+                face.push_back({ "side", src_face.side });
+                face.push_back({ "firstedge", src_face.firstedge });
+                face.push_back({ "numedges", src_face.numedges });
+                face.push_back({ "texinfo", src_face.texinfo });
+                face.push_back({ "styles", json::array({ src_face.styles[0], src_face.styles[1], src_face.styles[2], src_face.styles[3] }) });
+                face.push_back({ "lightofs", src_face.lightofs });
+
+                // for readibility, also output the actual vertices
+                auto verts = json::array();
+                for (int32_t k = 0; k < src_face.numedges; ++k) {
+                    auto se = bsp.dsurfedges[src_face.firstedge + k];
+                    uint32_t v = (se < 0) ? bsp.dedges[-se].v[1] : bsp.dedges[se].v[0];
+                    auto dv = bsp.dvertexes[v];
+                    verts.push_back(json::array({ dv.point[0], dv.point[1], dv.point[2] }));
+                }
+                face.push_back({ "vertices", verts });
+                return face;
+            });
+        }},
+
+        { "clipnodes", bsp.numclipnodes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numclipnodes, [&](int32_t i) {
+                json clipnode = json::object();
+                auto &src_clipnodes = bsp.dclipnodes[i];
+
+                clipnode.push_back({ "planenum", src_clipnodes.planenum });
+                clipnode.push_back({ "children", json::array({ src_clipnodes.children[0], src_clipnodes.children[1] })});
+                return clipnode;
+            });
+        }},
+
+        { "edges", bsp.numedges > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numedges, [&](int32_t i) {
+                auto &src_edge = bsp.dedges[i];
+
+                return json::array({src_edge.v[0], src_edge.v[1]});
+            });
+        }},
+
+        { "leaffaces", bsp.numleaffaces > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numleaffaces, [&](int32_t i) { return json(bsp.dleaffaces[i]); });
+        }},
+
+        { "surfedges", bsp.numsurfedges > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numsurfedges, [&](int32_t i) { return json(bsp.dsurfedges[i]); });
+        }},
+
+        { "brushsides", bsp.numbrushsides > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numbrushsides, [&](int32_t i) {
+                json brushside = json::object();
+                auto &src_brushside = bsp.dbrushsides[i];
+
+                brushside.push_back({ "planenum", src_brushside.planenum });
+                brushside.push_back({ "texinfo", src_brushside.texinfo });
+                return brushside;
+            });
+        }},
+
+        { "brushes", bsp.numbrushes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numbrushes, [&](int32_t i) {
+                json brush = json::object();
+                auto &src_brush = bsp.dbrushes[i];
+
+                brush.push_back({ "firstside", src_brush.firstside });
+                brush.push_back({ "numsides", src_brush.numsides });
+                brush.push_back({ "contents", src_brush.contents });
+                return brush;
+            });
+        }},
+
+        { "leafbrushes", bsp.numleafbrushes > 0, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            write_array(w, bsp.numleafbrushes, [&](int32_t i) { return json(bsp.dleafbrushes[i]); });
+        }},
+
+        { "bspxentries", bspdata.bspxentries != nullptr, [](json_writer_t &w, const mbsp_t &bsp, const bspdata_t &bspdata) {
+            w.begin_array();
+            for (auto* lump = bspdata.bspxentries; lump; lump = lump->next) {
+                w.begin_object();
+                if (!strcmp(lump->lumpname, "BRUSHLIST")) {
+                    w.key("lumpname");
+                    w.value(std::string(lump->lumpname));
+                    w.key("models");
+                    serialize_bspxbrushlist(w, lump->lumpdata, lump->lumpsize);
+                } else {
+                    // unhandled BSPX lump, just write the raw data
+                    w.key("lumpdata");
+                    w.hex(lump->lumpdata, lump->lumpsize);
+                    w.key("lumpname");
+                    w.value(std::string(lump->lumpname));
+                }
+                w.end();
             }
-            face.push_back({ "vertices", verts });
-        }
-    }
-    
-    if (bsp.numclipnodes) {
-        json &clipnodes = (j.emplace("clipnodes", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numclipnodes; i++) {
-            json &clipnode = clipnodes.insert(clipnodes.end(), json::object()).value();
-            auto &src_clipnodes = bsp.dclipnodes[i];
-
-            clipnode.push_back({ "planenum", src_clipnodes.planenum });
-            clipnode.push_back({ "children", json::array({ src_clipnodes.children[0], src_clipnodes.children[1] })});
-        }
-    }
+            w.end();
+        }},
+    };
+}
 
-    if (bsp.numedges) {
-        json &edges = (j.emplace("edges", json::array())).first.value();
+/* the lump names, for -lumps */
+static std::vector<std::string> lump_names() {
+    bspdata_t empty {};
+    std::vector<std::string> names;
+    for (const bsplump_writer_t &lump : bsp_lump_writers(empty))
+        names.push_back(lump.name);
+    return names;
+}
 
-        for (int32_t i = 0; i < bsp.numedges; i++) {
-            auto &src_edge = bsp.dedges[i];
+static std::string join(const std::vector<std::string> &strings) {
+    std::string result;
+    for (const std::string &str : strings)
+        result += (result.empty() ? "" : ", ") + str;
+    return result;
+}
 
-            edges.insert(edges.end(), json::array({src_edge.v[0], src_edge.v[1]}));
-        }
+static void serialize_bsp(json_writer_t &w, const bspdata_t &bspdata, const std::vector<std::string> &selected) {
+    std::vector<bsplump_writer_t> lumps = bsp_lump_writers(bspdata);
+    std::sort(lumps.begin(), lumps.end(), [](const bsplump_writer_t &a, const bsplump_writer_t &b) {
+        return strcmp(a.name, b.name) < 0;
+    });
+
+    w.begin_object();
+    for (const bsplump_writer_t &lump : lumps) {
+        if (!lump.present)
+            continue;
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), lump.name) == selected.end())
+            continue;
+        w.key(lump.name);
+        lump.write(w, bspdata.data.mbsp, bspdata);
     }
+    w.end();
+}
 
-    if (bsp.numleaffaces) {
-        json &leaffaces = (j.emplace("leaffaces", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numleaffaces; i++) {
-            leaffaces.insert(leaffaces.end(), bsp.dleaffaces[i]);
-        }
-    }
+enum class output_format_t {
+    json,
+    cbor,
+    msgpack
+};
 
-    if (bsp.numsurfedges) {
-        json &surfedges = (j.emplace("surfedges", json::array())).first.value();
+static void write_bsp_info(const bspdata_t &bspdata, const char *name, output_format_t format, const std::vector<std::string> &selected) {
+    std::ofstream out(name, std::fstream::out | std::fstream::trunc | std::fstream::binary);
 
-        for (int32_t i = 0; i < bsp.numsurfedges; i++) {
-            surfedges.insert(surfedges.end(), bsp.dsurfedges[i]);
-        }
+    if (format == output_format_t::json) {
+        json_stream_writer_t w(out);
+        serialize_bsp(w, bspdata, selected);
+        return;
     }
 
-    if (bsp.numbrushsides) {
-        json &brushsides = (j.emplace("brushsides", json::array())).first.value();
-
-        for (int32_t i = 0; i < bsp.numbrushsides; i++) {
-            json &brushside = brushsides.insert(brushsides.end(), json::object()).value();
-            auto &src_brushside = bsp.dbrushsides[i];
+    json_tree_writer_t w;
+    serialize_bsp(w, bspdata, selected);
 
-            brushside.push_back({ "planenum", src_brushside.planenum });
-            brushside.push_back({ "texinfo", src_brushside.texinfo });
-        }
-    }
+    const std::vector<uint8_t> bytes = (format == output_format_t::cbor) ? json::to_cbor(w.root) : json::to_msgpack(w.root);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+}
 
-    if (bsp.numbrushes) {
-        json &brushes = (j.emplace("brushes", json::array())).first.value();
+static void PrintUsage() {
+    printf("usage: bspinfo [-lumps name,name,...] [-cbor | -msgpack] [-threads n] [-list listfile]\n"
+           "               [-report report.json] bspfile [bspfiles]\n"
+           "\n"
+           "Writes the contents of each bspfile to bspfile.json.\n"
+           "  -lumps name,...  only write these lumps, from: %s\n"
+           "  -cbor            write bspfile.cbor instead (CBOR)\n"
+           "  -msgpack         write bspfile.msgpack instead (MessagePack)\n"
+           "  -threads n       files to process at once (default one per core)\n"
+           "  -list listfile   also process the bsps listed in listfile, one per line (- for stdin)\n"
+           "  -report file     write a json summary of every file processed\n"
+           "bspfiles can have wildcards (* and ?) in their file names.\n",
+           join(lump_names()).c_str());
+}
 
-        for (int32_t i = 0; i < bsp.numbrushes; i++) {
-            json &brush = brushes.insert(brushes.end(), json::object()).value();
-            auto &src_brush = bsp.dbrushes[i];
+static void
+BSPInfo_File(const std::string &filename, output_format_t format, const std::vector<std::string> &selected,
+             json &result)
+{
+    bspdata_t bsp;
+    char source[1024];
 
-            brush.push_back({ "firstside", src_brush.firstside });
-            brush.push_back({ "numsides", src_brush.numsides });
-            brush.push_back({ "contents", src_brush.contents });
-        }
-    }
+    logprint("---------------------\n");
+    snprintf(source, sizeof(source) - 16, "%s", filename.c_str());
+    DefaultExtension(source, ".bsp");
+    logprint("%s\n", source);
 
-    if (bsp.numleafbrushes) {
-        json &leafbrushes = (j.emplace("leafbrushes", json::array())).first.value();
+    LoadBSPFile(source, &bsp);
+    PrintBSPFileSizes(&bsp);
+    result["version"] = bsp.version->name;
 
-        for (int32_t i = 0; i < bsp.numleafbrushes; i++) {
-            leafbrushes.push_back(bsp.dleafbrushes[i]);
-        }
+    switch (format) {
+    case output_format_t::json:    strcat(source, ".json"); break;
+    case output_format_t::cbor:    strcat(source, ".cbor"); break;
+    case output_format_t::msgpack: strcat(source, ".msgpack"); break;
     }
+    ConvertBSPFormat(&bsp, &bspver_generic);
 
-    if (bspdata.bspxentries) {
-        json &bspxentries = (j.emplace("bspxentries", json::array())).first.value();
-
-        for (auto* lump = bspdata.bspxentries; lump; lump = lump->next) {
-            json &entry = bspxentries.insert(bspxentries.end(), json::object()).value();
-            entry["lumpname"] = std::string(lump->lumpname);
-
-            if (!strcmp(lump->lumpname, "BRUSHLIST")) {
-                entry["models"] = serialzie_bspxbrushlist(lump->lumpdata, lump->lumpsize);
-            } else {
-                // unhandled BSPX lump, just write the raw data
-                entry["lumpdata"] = hex_string(lump->lumpdata, lump->lumpsize);
-            }
-        }
-    }
+    write_bsp_info(bsp, source, format, selected);
+    result["written"] = source;
 
-    std::ofstream(name, std::fstream::out | std::fstream::trunc | std::fstream::binary) << std::setw(4) <<j;
+    logprint("---------------------\n");
 }
 
 int
 main(int argc, char **argv)
 {
-    bspdata_t bsp;
-    char source[1024];
     int i;
+    output_format_t format = output_format_t::json;
+    std::vector<std::string> selected;
+    std::vector<std::string> files;
+    const char *reportfile = nullptr;
 
     printf("---- bspinfo / ericw-tools " stringify(ERICWTOOLS_VERSION) " ----\n");
-    if (argc == 1) {
-        printf("usage: bspinfo bspfile [bspfiles]\n");
-        exit(1);
-    }
-
-    for (i = 1; i < argc; i++) {
-        printf("---------------------\n");
-        strcpy(source, argv[i]);
-        DefaultExtension(source, ".bsp");
-        printf("%s\n", source);
 
-        LoadBSPFile(source, &bsp);
-        PrintBSPFileSizes(&bsp);
-
-        strcat(source, ".json");
-        ConvertBSPFormat(&bsp, &bspver_generic);
+    numthreads = GetDefaultThreads();
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-lumps") && i + 1 < argc) {
+            const std::vector<std::string> valid = lump_names();
+            std::stringstream list(argv[++i]);
+            std::string name;
+            while (std::getline(list, name, ',')) {
+                if (name.empty())
+                    continue;
+                if (std::find(valid.begin(), valid.end(), name) == valid.end())
+                    Error("unknown lump \"%s\" (valid lumps: %s)", name.c_str(), join(valid).c_str());
+                selected.push_back(name);
+            }
+        } else if (!strcmp(argv[i], "-cbor")) {
+            format = output_format_t::cbor;
+        } else if (!strcmp(argv[i], "-msgpack")) {
+            format = output_format_t::msgpack;
+        } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            numthreads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-list") && i + 1 < argc) {
+            Batch_AddList(&files, argv[++i]);
+        } else if (!strcmp(argv[i], "-report") && i + 1 < argc) {
+            reportfile = argv[++i];
+        } else {
+            PrintUsage();
+            exit(1);
+        }
+    }
 
-        serialize_bsp(bsp, source);
+    for (; i < argc; i++)
+        Batch_AddFiles(&files, argv[i]);
 
-        printf("---------------------\n");
+    if (files.empty()) {
+        PrintUsage();
+        exit(1);
     }
 
-    return 0;
+    const int failed = Batch_Run(files, [&](const std::string &file, json &result) {
+        BSPInfo_File(file, format, selected, result);
+    }, reportfile);
+
+    return failed ? 1 : 0;
 }
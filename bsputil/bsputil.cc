@@ -27,7 +27,10 @@
 #include <common/bspfile.hh>
 #include <common/bsputils.hh>
 #include <common/mathlib.hh>
+#include <common/batch.hh>
+#include <common/threads.hh>
 
+#include "compare.h"
 #include "decompile.h"
 
 #include <map>
@@ -126,7 +129,7 @@ PrintModelInfo(const mbsp_t *bsp)
 
     for (i = 0; i < bsp->nummodels; i++) {
         const dmodel_t *dmodel = &bsp->dmodels[i];
-        printf("model %3d: %5d faces (firstface = %d)\n",
+        logprint("model %3d: %5d faces (firstface = %d)\n",
                i, dmodel->numfaces, dmodel->firstface);
     }
 }
@@ -158,7 +161,7 @@ CheckBSPFacesPlanar(const mbsp_t *bsp)
             const float dist = DotProduct(plane.normal, point) - plane.dist;
 
             if (dist < -PLANE_ON_EPSILON || dist > PLANE_ON_EPSILON)
-                printf("WARNING: face %d, point %d off plane by %f\n",
+                logprint("WARNING: face %d, point %d off plane by %f\n",
                        (int)(face - bsp->dfaces), j, dist);
         }
     }
@@ -212,11 +215,11 @@ static void PrintNodeHeights(const mbsp_t *bsp)
         if (level != current_level)
         {
             current_level = level;
-            printf("\nNode heights at level %d: ", level);
+            logprint("\nNode heights at level %d: ", level);
         }
     
         // print the level of this node
-        printf("%d, ", cache.at(node));
+        logprint("%d, ", cache.at(node));
         
         // add child nodes to the bfs
         if (level < maxlevel) {
@@ -228,7 +231,7 @@ static void PrintNodeHeights(const mbsp_t *bsp)
             }
         }
     }
-    printf("\n");
+    logprint("\n");
 }
 
 static void
@@ -249,39 +252,39 @@ CheckBSPFile(const mbsp_t *bsp)
 
         /* texinfo bounds check */
         if (face->texinfo < 0)
-            printf("warning: face %d has negative texinfo (%d)\n",
+            logprint("warning: face %d has negative texinfo (%d)\n",
                    i, face->texinfo);
         if (face->texinfo >= bsp->numtexinfo)
-            printf("warning: face %d has texinfo out of range (%d >= %d)\n",
+            logprint("warning: face %d has texinfo out of range (%d >= %d)\n",
                    i, face->texinfo, bsp->numtexinfo);
         referenced_texinfos.insert(face->texinfo);
         
         /* planenum bounds check */
         if (face->planenum < 0)
-            printf("warning: face %d has negative planenum (%d)\n",
+            logprint("warning: face %d has negative planenum (%d)\n",
                    i, face->planenum);
         if (face->planenum >= bsp->numplanes)
-            printf("warning: face %d has planenum out of range (%d >= %d)\n",
+            logprint("warning: face %d has planenum out of range (%d >= %d)\n",
                    i, face->planenum, bsp->numplanes);
         referenced_planenums.insert(face->planenum);
 
         /* lightofs check */
         if (face->lightofs < -1)
-            printf("warning: face %d has negative light offset (%d)\n",
+            logprint("warning: face %d has negative light offset (%d)\n",
                    i, face->lightofs);
         if (face->lightofs >= bsp->lightdatasize)
-            printf("warning: face %d has light offset out of range "
+            logprint("warning: face %d has light offset out of range "
                    "(%d >= %d)\n", i, face->lightofs, bsp->lightdatasize);
 
         /* edge check */
         if (face->firstedge < 0)
-            printf("warning: face %d has negative firstedge (%d)\n",
+            logprint("warning: face %d has negative firstedge (%d)\n",
                    i, face->firstedge);
         if (face->numedges < 3)
-            printf("warning: face %d has < 3 edges (%d)\n",
+            logprint("warning: face %d has < 3 edges (%d)\n",
                    i, face->numedges);
         if (face->firstedge + face->numedges > bsp->numsurfedges)
-            printf("warning: face %d has edges out of range (%d..%d >= %d)\n",
+            logprint("warning: face %d has edges out of range (%d..%d >= %d)\n",
                    i, face->firstedge, face->firstedge + face->numedges - 1,
                    bsp->numsurfedges);
         
@@ -298,7 +301,7 @@ CheckBSPFile(const mbsp_t *bsp)
         for (j = 0; j < 2; j++) {
             const uint32_t vertex = edge->v[j];
             if (vertex > bsp->numvertexes)
-                printf("warning: edge %d has vertex %d out range "
+                logprint("warning: edge %d has vertex %d out range "
                        "(%d >= %d)\n", i, j, vertex, bsp->numvertexes);
             referenced_vertexes.insert(vertex);
         }
@@ -308,9 +311,9 @@ CheckBSPFile(const mbsp_t *bsp)
     for (i = 0; i < bsp->numsurfedges; i++) {
         const int edgenum = bsp->dsurfedges[i];
         if (!edgenum)
-            printf("warning: surfedge %d has zero value!\n", i);
+            logprint("warning: surfedge %d has zero value!\n", i);
         if (abs(edgenum) >= bsp->numedges)
-            printf("warning: surfedge %d is out of range (abs(%d) >= %d)\n",
+            logprint("warning: surfedge %d is out of range (abs(%d) >= %d)\n",
                    i, edgenum, bsp->numedges);
     }
 
@@ -318,7 +321,7 @@ CheckBSPFile(const mbsp_t *bsp)
     for (i = 0; i < bsp->numleaffaces; i++) {
         const uint32_t surfnum = bsp->dleaffaces[i];
         if (surfnum >= bsp->numfaces)
-            printf("warning: marksurface %d is out of range (%d >= %d)\n",
+            logprint("warning: marksurface %d is out of range (%d >= %d)\n",
                    i, surfnum, bsp->numfaces);
     }
 
@@ -328,14 +331,14 @@ CheckBSPFile(const mbsp_t *bsp)
         const uint32_t endmarksurface =
             leaf->firstmarksurface + leaf->nummarksurfaces;
         if (endmarksurface > bsp->numleaffaces)
-            printf("warning: leaf %d has marksurfaces out of range "
+            logprint("warning: leaf %d has marksurfaces out of range "
                    "(%d..%d >= %d)\n", i, leaf->firstmarksurface,
                    endmarksurface - 1, bsp->numleaffaces);
         if (leaf->visofs < -1)
-            printf("warning: leaf %d has negative visdata offset (%d)\n",
+            logprint("warning: leaf %d has negative visdata offset (%d)\n",
                    i, leaf->visofs);
         if (leaf->visofs >= bsp->visdatasize)
-            printf("warning: leaf %d has visdata offset out of range "
+            logprint("warning: leaf %d has visdata offset out of range "
                    "(%d >= %d)\n", i, leaf->visofs, bsp->visdatasize);
     }
 
@@ -347,15 +350,15 @@ CheckBSPFile(const mbsp_t *bsp)
         for (j = 0; j < 2; j++) {
             const int32_t child = node->children[j];
             if (child >= 0 && child >= bsp->numnodes)
-                printf("warning: node %d has child %d (node) out of range "
+                logprint("warning: node %d has child %d (node) out of range "
                        "(%d >= %d)\n", i, j, child, bsp->numnodes);
             if (child < 0 && -child - 1 >= bsp->numleafs)
-                printf("warning: node %d has child %d (leaf) out of range "
+                logprint("warning: node %d has child %d (leaf) out of range "
                        "(%d >= %d)\n", i, j, -child - 1, bsp->numleafs);
         }
         
         if (node->children[0] == node->children[1]) {
-            printf("warning: node %d has both children %d\n", i, node->children[0]);
+            logprint("warning: node %d has both children %d\n", i, node->children[0]);
         }
         
         referenced_planenums.insert(node->planenum);
@@ -368,15 +371,15 @@ CheckBSPFile(const mbsp_t *bsp)
         for (int j = 0; j < 2; j++) {
             const int32_t child = clipnode->children[j];
             if (child >= 0 && child >= bsp->numclipnodes)
-                printf("warning: clipnode %d has child %d (clipnode) out of range "
+                logprint("warning: clipnode %d has child %d (clipnode) out of range "
                        "(%d >= %d)\n", i, j, child, bsp->numclipnodes);
             if (child < 0 && child < CONTENTS_MIN)
-                printf("warning: clipnode %d has invalid contents (%d) for child %d\n",
+                logprint("warning: clipnode %d has invalid contents (%d) for child %d\n",
                        i, child, j);
         }
         
         if (clipnode->children[0] == clipnode->children[1]) {
-            printf("warning: clipnode %d has both children %d\n", i, clipnode->children[0]);
+            logprint("warning: clipnode %d has both children %d\n", i, clipnode->children[0]);
         }
         
         referenced_planenums.insert(clipnode->planenum);
@@ -393,7 +396,7 @@ CheckBSPFile(const mbsp_t *bsp)
             }
         }
         if (num_unreferenced_texinfo)
-            printf("warning: %d texinfos are unreferenced\n", num_unreferenced_texinfo);
+            logprint("warning: %d texinfos are unreferenced\n", num_unreferenced_texinfo);
     }
     
     /* unreferenced planes */
@@ -405,7 +408,7 @@ CheckBSPFile(const mbsp_t *bsp)
             }
         }
         if (num_unreferenced_planes)
-            printf("warning: %d planes are unreferenced\n", num_unreferenced_planes);
+            logprint("warning: %d planes are unreferenced\n", num_unreferenced_planes);
     }
     
     /* unreferenced vertices */
@@ -417,7 +420,7 @@ CheckBSPFile(const mbsp_t *bsp)
             }
         }
         if (num_unreferenced_vertexes)
-            printf("warning: %d vertexes are unreferenced\n", num_unreferenced_vertexes);
+            logprint("warning: %d vertexes are unreferenced\n", num_unreferenced_vertexes);
     }
     
     /* tree balance */
@@ -431,12 +434,12 @@ CheckBSPFile(const mbsp_t *bsp)
             visofs_set.insert(leaf->visofs);
         }
     }
-    printf("%d unique visdata offsets for %d leafs\n",
+    logprint("%d unique visdata offsets for %d leafs\n",
            static_cast<int>(visofs_set.size()), bsp->numleafs);
-    printf("%d visleafs in world model\n", bsp->dmodels[0].visleafs);
+    logprint("%d visleafs in world model\n", bsp->dmodels[0].visleafs);
     
     /* unique lightstyles */
-    printf("%d lightstyles used:\n", static_cast<int>(used_lightstyles.size()));
+    logprint("%d lightstyles used:\n", static_cast<int>(used_lightstyles.size()));
     {
         std::vector<int> v;
         for (uint8_t style : used_lightstyles) {
@@ -444,11 +447,11 @@ CheckBSPFile(const mbsp_t *bsp)
         }
         std::sort(v.begin(), v.end());
         for (int style : v) {
-            printf("\t%d\n", style);
+            logprint("\t%d\n", style);
         }
     }
     
-    printf("world mins: %f %f %f maxs: %f %f %f\n",
+    logprint("world mins: %f %f %f maxs: %f %f %f\n",
            bsp->dmodels[0].mins[0],
            bsp->dmodels[0].mins[1],
            bsp->dmodels[0].mins[2],
@@ -458,9 +461,9 @@ CheckBSPFile(const mbsp_t *bsp)
 }
 
 static void
-CompareBSPFiles(const mbsp_t *refBsp, const mbsp_t *bsp)
+CompareBSPFaces(const mbsp_t *refBsp, const mbsp_t *bsp)
 {
-    printf("comparing %d with %d faces\n", refBsp->numfaces, bsp->numfaces);
+    logprint("comparing %d with %d faces\n", refBsp->numfaces, bsp->numfaces);
 
     const dmodel_t *world = BSP_GetWorldModel(bsp);
     const dmodel_t *refWorld = BSP_GetWorldModel(refBsp);
@@ -480,7 +483,7 @@ CompareBSPFiles(const mbsp_t *refBsp, const mbsp_t *bsp)
         // Search for a face in bsp touching refFaceCentroid.
         auto* matchedFace = BSP_FindFaceAtPoint(bsp, world, wantedPoint, wantedNormal);
         if (matchedFace == nullptr) {
-            printf("couldn't find a face at %f %f %f normal %f %f %f\n",
+            logprint("couldn't find a face at %f %f %f normal %f %f %f\n",
                     wantedPoint[0], wantedPoint[1], wantedPoint[2],
                     wantedNormal[0], wantedNormal[1], wantedNormal[2]);
         }
@@ -490,7 +493,7 @@ CompareBSPFiles(const mbsp_t *refBsp, const mbsp_t *bsp)
 //        if (refFaceSelfCheck == refFace) {
 //            matches ++;
 //        } else {
-//            printf("not match at %f %f %f wanted %p got %p\n", wantedPoint[0], wantedPoint[1], wantedPoint[2], refFace, refFaceSelfCheck);
+//            logprint("not match at %f %f %f wanted %p got %p\n", wantedPoint[0], wantedPoint[1], wantedPoint[2], refFace, refFaceSelfCheck);
 //            Face_DebugPrint(refBsp, refFace);
 //            Face_DebugPrint(refBsp, refFaceSelfCheck);
 //            notmat++;
@@ -508,7 +511,7 @@ FindFaces(const mbsp_t *bsp, const vec3_t pos, const vec3_t normal)
         const bsp2_dface_t* face = BSP_FindFaceAtPoint(bsp, model, pos, normal);
 
         if (face != nullptr) {
-            printf("model %d face %d: texture '%s' texinfo %d\n",
+            logprint("model %d face %d: texture '%s' texinfo %d\n",
                 i, static_cast<int>(face - bsp->dfaces), 
                 Face_TextureName(bsp, face),
                 face->texinfo);
@@ -517,86 +520,99 @@ FindFaces(const mbsp_t *bsp, const vec3_t pos, const vec3_t normal)
 }
 
 
-int
-main(int argc, char **argv)
+/* set when --compare finds differences, for the exit status */
+static bool bspsDiffer = false;
+
+/*
+ * Runs the operations in opv on one bsp. Returns the last file written,
+ * or an empty string if it only printed things.
+ */
+static std::string
+BSPUtil_File(const char *filename, int opc, char **opv)
 {
     bspdata_t bspdata;
     mbsp_t *const bsp = &bspdata.data.mbsp;
     char source[1024];
+    std::string written;
+    compare_options compareOptions;
     FILE *f;
     int i, err;
 
-    printf("---- bsputil / ericw-tools " stringify(ERICWTOOLS_VERSION) " ----\n");
-    if (argc == 1) {
-        printf("usage: bsputil [--extract-entities] [--extract-textures] [--convert bsp29|bsp2|bsp2rmq|q2bsp] [--check] [--modelinfo]\n"
-               "[--check] [--compare otherbsp] [--findfaces x y z nx ny nz] [--settexinfo facenum texinfonum]\n"
-               "[--decompile] [--decompile-geomonly] bspfile\n");
-        exit(1);
-    }
-
-    strcpy(source, argv[argc - 1]);
+    snprintf(source, sizeof(source) - 32, "%s", filename);
     DefaultExtension(source, ".bsp");
-    printf("---------------------\n");
-    printf("%s\n", source);
+    logprint("---------------------\n");
+    logprint("%s\n", source);
 
     LoadBSPFile(source, &bspdata);
 
     ConvertBSPFormat(&bspdata, &bspver_generic);
 
-    for (i = 0; i < argc - 1; i++) {
-        if (!strcmp(argv[i], "--compare")) {
+    for (i = 0; i < opc; i++) {
+        if (!strcmp(opv[i], "--tolerance")) {
             i++;
-            if (i == argc - 1) {
-                Error("--compare requires two arguments");
+            if (i == opc) {
+                Error("--tolerance requires an argument");
+            }
+            compareOptions.epsilon = atof(opv[i]);
+        } else if (!strcmp(opv[i], "--compare") || !strcmp(opv[i], "--compare-faces")) {
+            const bool faces = !strcmp(opv[i], "--compare-faces");
+            i++;
+            if (i == opc) {
+                Error("%s requires two arguments", opv[i - 1]);
             }
             // Load the reference BSP
 
             char refbspname[1024];
             bspdata_t refbspdata;
-            strcpy(refbspname, argv[i]);
+            strcpy(refbspname, opv[i]);
             DefaultExtension(refbspname, ".bsp");
             LoadBSPFile(refbspname, &refbspdata);
             ConvertBSPFormat(&refbspdata, &bspver_generic);
 
-            printf("comparing reference bsp %s with test bsp %s\n", refbspname, source);
+            logprint("comparing reference bsp %s with test bsp %s\n", refbspname, source);
 
-            CompareBSPFiles(&refbspdata.data.mbsp,
-                            &bspdata.data.mbsp);
+            if (faces) {
+                CompareBSPFaces(&refbspdata.data.mbsp,
+                                &bspdata.data.mbsp);
+            } else if (CompareBSPLumps(&refbspdata, &bspdata, compareOptions)) {
+                bspsDiffer = true;
+            }
 
             break;
-        } else if (!strcmp(argv[i], "--convert")) {
+        } else if (!strcmp(opv[i], "--convert")) {
             i++;
-            if (!(i < argc - 1)) {
+            if (!(i < opc)) {
                 Error("--convert requires an argument");
             }
 
             const bspversion_t *fmt = nullptr;
 
             for (const bspversion_t *bspver : bspversions) {
-                if (!strcmp(argv[i], bspver->short_name)) {
+                if (!strcmp(opv[i], bspver->short_name)) {
                     fmt = bspver;
                     break;
                 }
             }
 
             if (!fmt) {
-                Error("Unsupported format %s", argv[i]);
+                Error("Unsupported format %s", opv[i]);
             }
 
             ConvertBSPFormat(&bspdata, fmt);
             
             StripExtension(source);
             strcat(source, "-");
-            strcat(source, argv[i]);
+            strcat(source, opv[i]);
             strcat(source, ".bsp");
             
             WriteBSPFile(source, &bspdata);
+            written = source;
             
-        } else if (!strcmp(argv[i], "--extract-entities")) {
+        } else if (!strcmp(opv[i], "--extract-entities")) {
             unsigned int crc = CRC_Block((unsigned char *)bsp->dentdata, bsp->entdatasize - 1);
             StripExtension(source);
             DefaultExtension(source, ".ent");
-            printf("-> writing %s [CRC: %04x]... ", source, crc);
+            logprint("-> writing %s [CRC: %04x]... ", source, crc);
 
             f = fopen(source, "wb");
             if (!f)
@@ -610,11 +626,12 @@ main(int argc, char **argv)
             if (err)
                 Error("%s", strerror(errno));
 
-            printf("done.\n");
-        } else if (!strcmp(argv[i], "--extract-textures")) {
+            logprint("done.\n");
+            written = source;
+        } else if (!strcmp(opv[i], "--extract-textures")) {
             StripExtension(source);
             DefaultExtension(source, ".wad");
-            printf("-> writing %s... ", source);
+            logprint("-> writing %s... ", source);
 
             f = fopen(source, "wb");
             if (!f)
@@ -626,48 +643,48 @@ main(int argc, char **argv)
             if (err)
                 Error("%s", strerror(errno));
 
-            printf("done.\n");
-        } else if (!strcmp(argv[i], "--check")) {
-            printf("Beginning BSP data check...\n");
+            logprint("done.\n");
+            written = source;
+        } else if (!strcmp(opv[i], "--check")) {
+            logprint("Beginning BSP data check...\n");
             CheckBSPFile(bsp);
             CheckBSPFacesPlanar(bsp);
-            printf("Done.\n");
-        } else if (!strcmp(argv[i], "--modelinfo")) {
+            logprint("Done.\n");
+        } else if (!strcmp(opv[i], "--modelinfo")) {
             PrintModelInfo(bsp);
-        } else if (!strcmp(argv[i], "--findfaces")) {
+        } else if (!strcmp(opv[i], "--findfaces")) {
             // (i + 1) ... (i + 6) = x y z nx ny nz
-            // i + 7 = bsp file
 
-            if (i + 7 >= argc) {
+            if (i + 6 >= opc) {
                Error("--findfaces requires 6 arguments");
             }
 
             try {
                 const vec3_t pos = {
-                    std::stof(argv[i + 1]),
-                    std::stof(argv[i + 2]),
-                    std::stof(argv[i + 3])
+                    std::stof(opv[i + 1]),
+                    std::stof(opv[i + 2]),
+                    std::stof(opv[i + 3])
                 };
                 const vec3_t normal = {
-                    std::stof(argv[i + 4]),
-                    std::stof(argv[i + 5]),
-                    std::stof(argv[i + 6])
+                    std::stof(opv[i + 4]),
+                    std::stof(opv[i + 5]),
+                    std::stof(opv[i + 6])
                 };
                 FindFaces(bsp, pos, normal);
             } catch (const std::exception&) {
-                printf("Error reading position/normal\n");
+                logprint("Error reading position/normal\n");
             }
-            return 0;
-        } else if (!strcmp(argv[i], "--settexinfo")) {
+            return written;
+        } else if (!strcmp(opv[i], "--settexinfo")) {
             // (i + 1) facenum
             // (i + 2) texinfonum
 
-            if (i + 2 >= argc) {
+            if (i + 2 >= opc) {
                Error("--settexinfo requires 2 arguments");
             }
 
-            const int fnum       = std::stoi(argv[i + 1]);
-            const int texinfonum = std::stoi(argv[i + 2]);
+            const int fnum       = std::stoi(opv[i + 1]);
+            const int texinfonum = std::stoi(opv[i + 2]);
 
             bsp2_dface_t* face = BSP_GetFace(bsp, fnum);
             face->texinfo = texinfonum;
@@ -676,14 +693,28 @@ main(int argc, char **argv)
 
             // Overwrite source bsp!
             WriteBSPFile(source, &bspdata);
+            written = source;
 
-            return 0;
-        } else if (!strcmp(argv[i], "--decompile") || !strcmp(argv[i], "--decompile-geomonly")) {
-            const bool geomOnly = !strcmp(argv[i], "--decompile-geomonly");
+            return written;
+        } else if (!strcmp(opv[i], "--compress-bspx") || !strcmp(opv[i], "--decompress-bspx")) {
+            // LoadBSPFile has already unpacked any compressed lumps
+            if (!strcmp(opv[i], "--compress-bspx")) {
+                logprint("compressed %d BSPX lumps\n", BSPX_CompressLumps(&bspdata));
+            }
+
+            ConvertBSPFormat(&bspdata, bspdata.loadversion);
+
+            // Overwrite source bsp!
+            WriteBSPFile(source, &bspdata);
+            written = source;
+
+            return written;
+        } else if (!strcmp(opv[i], "--decompile") || !strcmp(opv[i], "--decompile-geomonly")) {
+            const bool geomOnly = !strcmp(opv[i], "--decompile-geomonly");
 
             StripExtension(source);
             DefaultExtension(source, "-decompile.map");
-            printf("-> writing %s... ", source);
+            logprint("-> writing %s... ", source);
 
             f = fopen(source, "w");
             if (!f)
@@ -695,12 +726,95 @@ main(int argc, char **argv)
             DecompileBSP(bsp, options, f);
 
             fclose(f);
-            printf("done.\n");
-            return 0;
+            logprint("done.\n");
+            return source;
+        }
+    }
+
+    logprint("---------------------\n");
+
+    return written;
+}
+
+static void
+PrintUsage(void)
+{
+    printf("usage: bsputil [--extract-entities] [--extract-textures] [--convert bsp29|bsp2|bsp2rmq|q2bsp] [--check] [--modelinfo]\n"
+           "[--check] [--tolerance eps] [--compare otherbsp] [--compare-faces otherbsp] [--findfaces x y z nx ny nz]\n"
+           "[--settexinfo facenum texinfonum]\n"
+           "[--decompile] [--decompile-geomonly] [--compress-bspx] [--decompress-bspx] bspfile\n"
+           "\n"
+           "batch mode, running the operations over many bsps in parallel:\n"
+           "bsputil [operations] --batch [--threads n] [--list listfile] [--report report.json] bspfile [bspfiles]\n"
+           "  --threads n      files to process at once (default one per core)\n"
+           "  --list listfile  also process the bsps listed in listfile, one per line (- for stdin)\n"
+           "  --report file    write a json summary of every file processed\n"
+           "bspfiles can have wildcards (* and ?) in their file names. --compare, --compare-faces,\n"
+           "--findfaces and --settexinfo only work on a single bsp.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int i;
+
+    printf("---- bsputil / ericw-tools " stringify(ERICWTOOLS_VERSION) " ----\n");
+    if (argc == 1) {
+        PrintUsage();
+        exit(1);
+    }
+
+    int batch = 0;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--batch")) {
+            batch = i;
+            break;
+        }
+    }
+
+    if (!batch) {
+        BSPUtil_File(argv[argc - 1], argc - 1, argv);
+        return bspsDiffer ? 1 : 0;
+    }
+
+    /* the operations before --batch, the files after it */
+    const int opc = batch - 1;
+    char **opv = argv + 1;
+    for (i = 0; i < opc; i++) {
+        if (!strcmp(opv[i], "--compare") || !strcmp(opv[i], "--compare-faces") || !strcmp(opv[i], "--findfaces")
+            || !strcmp(opv[i], "--settexinfo"))
+            Error("%s can't be used with --batch", opv[i]);
+    }
+
+    std::vector<std::string> files;
+    const char *reportfile = nullptr;
+    numthreads = GetDefaultThreads();
+
+    for (i = batch + 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            numthreads = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--list") && i + 1 < argc) {
+            Batch_AddList(&files, argv[++i]);
+        } else if (!strcmp(argv[i], "--report") && i + 1 < argc) {
+            reportfile = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            PrintUsage();
+            exit(1);
+        } else {
+            Batch_AddFiles(&files, argv[i]);
         }
     }
 
-    printf("---------------------\n");
+    if (files.empty()) {
+        PrintUsage();
+        exit(1);
+    }
+
+    const int failed = Batch_Run(files, [opc, opv](const std::string &file, nlohmann::json &result) {
+        const std::string written = BSPUtil_File(file.c_str(), opc, opv);
+        if (!written.empty())
+            result["written"] = written;
+    }, reportfile);
 
-    return 0;
+    return failed ? 1 : 0;
 }
@@ -0,0 +1,260 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include "compare.h"
+
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "tbb/parallel_for.h"
+
+namespace {
+
+/*
+ * Element comparisons. Lumps without floats are compared bytewise; the
+ * structs in mbsp_t have no padding, so that's the same as comparing
+ * each field.
+ */
+
+template<typename T>
+bool ElementsEqual(const T &a, const T &b, float)
+{
+    return !memcmp(&a, &b, sizeof(T));
+}
+
+bool FloatsEqual(const float *a, const float *b, int count, float epsilon)
+{
+    for (int i = 0; i < count; i++) {
+        if (!(std::fabs(a[i] - b[i]) <= epsilon))
+            return false;
+    }
+    return true;
+}
+
+bool ElementsEqual(const dmodelh2_t &a, const dmodelh2_t &b, float epsilon)
+{
+    return FloatsEqual(a.mins, b.mins, 3, epsilon)
+        && FloatsEqual(a.maxs, b.maxs, 3, epsilon)
+        && FloatsEqual(a.origin, b.origin, 3, epsilon)
+        && !memcmp(a.headnode, b.headnode, sizeof(a.headnode))
+        && a.visleafs == b.visleafs
+        && a.firstface == b.firstface
+        && a.numfaces == b.numfaces;
+}
+
+bool ElementsEqual(const mleaf_t &a, const mleaf_t &b, float epsilon)
+{
+    return a.contents == b.contents
+        && a.visofs == b.visofs
+        && FloatsEqual(a.mins, b.mins, 3, epsilon)
+        && FloatsEqual(a.maxs, b.maxs, 3, epsilon)
+        && a.firstmarksurface == b.firstmarksurface
+        && a.nummarksurfaces == b.nummarksurfaces
+        && !memcmp(a.ambient_level, b.ambient_level, sizeof(a.ambient_level))
+        && a.cluster == b.cluster
+        && a.area == b.area
+        && a.firstleafbrush == b.firstleafbrush
+        && a.numleafbrushes == b.numleafbrushes;
+}
+
+bool ElementsEqual(const dplane_t &a, const dplane_t &b, float epsilon)
+{
+    return FloatsEqual(a.normal, b.normal, 3, epsilon)
+        && FloatsEqual(&a.dist, &b.dist, 1, epsilon)
+        && a.type == b.type;
+}
+
+bool ElementsEqual(const dvertex_t &a, const dvertex_t &b, float epsilon)
+{
+    return FloatsEqual(a.point, b.point, 3, epsilon);
+}
+
+bool ElementsEqual(const bsp2_dnode_t &a, const bsp2_dnode_t &b, float epsilon)
+{
+    return a.planenum == b.planenum
+        && a.children[0] == b.children[0]
+        && a.children[1] == b.children[1]
+        && FloatsEqual(a.mins, b.mins, 3, epsilon)
+        && FloatsEqual(a.maxs, b.maxs, 3, epsilon)
+        && a.firstface == b.firstface
+        && a.numfaces == b.numfaces;
+}
+
+bool ElementsEqual(const gtexinfo_t &a, const gtexinfo_t &b, float epsilon)
+{
+    return FloatsEqual(&a.vecs[0][0], &b.vecs[0][0], 8, epsilon)
+        && a.flags == b.flags
+        && a.miptex == b.miptex
+        && a.value == b.value
+        && !memcmp(a.texture, b.texture, sizeof(a.texture))
+        && a.nexttexinfo == b.nexttexinfo;
+}
+
+struct lumpcompare_t {
+    std::string name;
+    size_t refcount, count;     // elements
+    std::string_view refbytes, bytes;
+    bool refpresent = true, present = true;
+    /* counts the elements that differ, up to the shorter lump's length */
+    std::function<size_t(size_t *first)> drilldown;
+
+    bool identical = false;
+    size_t differing = 0;
+    size_t first = 0;
+};
+
+template<typename T>
+lumpcompare_t MakeLump(const char *name, const T *ref, int refcount, const T *data, int count, float epsilon)
+{
+    lumpcompare_t lump;
+    lump.name = name;
+    lump.refcount = refcount;
+    lump.count = count;
+    lump.refbytes = std::string_view(reinterpret_cast<const char *>(ref), sizeof(T) * refcount);
+    lump.bytes = std::string_view(reinterpret_cast<const char *>(data), sizeof(T) * count);
+    lump.drilldown = [=](size_t *first) {
+        size_t differing = 0;
+        const size_t n = std::min(refcount, count);
+        for (size_t i = 0; i < n; i++) {
+            if (!ElementsEqual(ref[i], data[i], epsilon)) {
+                if (!differing)
+                    *first = i;
+                differing++;
+            }
+        }
+        return differing;
+    };
+    return lump;
+}
+
+const bspxentry_t *FindBSPX(const bspdata_t *bspdata, const char *name)
+{
+    for (const bspxentry_t *x = bspdata->bspxentries; x; x = x->next) {
+        if (!strcmp(x->lumpname, name))
+            return x;
+    }
+    return nullptr;
+}
+
+void AddBSPXLump(std::vector<lumpcompare_t> *lumps, const char *name, const bspxentry_t *ref, const bspxentry_t *x)
+{
+    static const uint8_t empty = 0;
+
+    lumpcompare_t lump = MakeLump(name, ref ? ref->lumpdata : &empty, ref ? static_cast<int>(ref->lumpsize) : 0,
+                                  x ? x->lumpdata : &empty, x ? static_cast<int>(x->lumpsize) : 0, 0.0f);
+    lump.name = std::string("BSPX ") + name;
+    lump.refpresent = (ref != nullptr);
+    lump.present = (x != nullptr);
+    lumps->push_back(std::move(lump));
+}
+
+} // namespace
+
+int
+CompareBSPLumps(const bspdata_t *refBspdata, const bspdata_t *bspdata, const compare_options& options)
+{
+    const mbsp_t *ref = &refBspdata->data.mbsp;
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    const float eps = options.epsilon;
+
+    std::vector<lumpcompare_t> lumps;
+    lumps.push_back(MakeLump("models", ref->dmodels, ref->nummodels, bsp->dmodels, bsp->nummodels, eps));
+    lumps.push_back(MakeLump("visdata", ref->dvisdata, ref->visdatasize, bsp->dvisdata, bsp->visdatasize, eps));
+    lumps.push_back(MakeLump("lightdata", ref->dlightdata, ref->lightdatasize, bsp->dlightdata, bsp->lightdatasize, eps));
+    lumps.push_back(MakeLump("texdata", reinterpret_cast<const uint8_t *>(ref->dtexdata), ref->texdatasize,
+                             reinterpret_cast<const uint8_t *>(bsp->dtexdata), bsp->texdatasize, eps));
+    lumps.push_back(MakeLump("rgbatexdata", reinterpret_cast<const uint8_t *>(ref->drgbatexdata), ref->rgbatexdatasize,
+                             reinterpret_cast<const uint8_t *>(bsp->drgbatexdata), bsp->rgbatexdatasize, eps));
+    lumps.push_back(MakeLump("entdata", ref->dentdata, ref->entdatasize, bsp->dentdata, bsp->entdatasize, eps));
+    lumps.push_back(MakeLump("leafs", ref->dleafs, ref->numleafs, bsp->dleafs, bsp->numleafs, eps));
+    lumps.push_back(MakeLump("planes", ref->dplanes, ref->numplanes, bsp->dplanes, bsp->numplanes, eps));
+    lumps.push_back(MakeLump("vertexes", ref->dvertexes, ref->numvertexes, bsp->dvertexes, bsp->numvertexes, eps));
+    lumps.push_back(MakeLump("nodes", ref->dnodes, ref->numnodes, bsp->dnodes, bsp->numnodes, eps));
+    lumps.push_back(MakeLump("texinfo", ref->texinfo, ref->numtexinfo, bsp->texinfo, bsp->numtexinfo, eps));
+    lumps.push_back(MakeLump("faces", ref->dfaces, ref->numfaces, bsp->dfaces, bsp->numfaces, eps));
+    lumps.push_back(MakeLump("clipnodes", ref->dclipnodes, ref->numclipnodes, bsp->dclipnodes, bsp->numclipnodes, eps));
+    lumps.push_back(MakeLump("edges", ref->dedges, ref->numedges, bsp->dedges, bsp->numedges, eps));
+    lumps.push_back(MakeLump("leaffaces", ref->dleaffaces, ref->numleaffaces, bsp->dleaffaces, bsp->numleaffaces, eps));
+    lumps.push_back(MakeLump("leafbrushes", ref->dleafbrushes, ref->numleafbrushes, bsp->dleafbrushes, bsp->numleafbrushes, eps));
+    lumps.push_back(MakeLump("surfedges", ref->dsurfedges, ref->numsurfedges, bsp->dsurfedges, bsp->numsurfedges, eps));
+    lumps.push_back(MakeLump("areas", ref->dareas, ref->numareas, bsp->dareas, bsp->numareas, eps));
+    lumps.push_back(MakeLump("areaportals", ref->dareaportals, ref->numareaportals, bsp->dareaportals, bsp->numareaportals, eps));
+    lumps.push_back(MakeLump("brushes", ref->dbrushes, ref->numbrushes, bsp->dbrushes, bsp->numbrushes, eps));
+    lumps.push_back(MakeLump("brushsides", ref->dbrushsides, ref->numbrushsides, bsp->dbrushsides, bsp->numbrushsides, eps));
+    lumps.push_back(MakeLump("pop", ref->dpop, sizeof(ref->dpop), bsp->dpop, sizeof(bsp->dpop), eps));
+
+    // BSPX lumps by name, including those only one of the files has
+    for (const bspxentry_t *x = refBspdata->bspxentries; x; x = x->next)
+        AddBSPXLump(&lumps, x->lumpname, x, FindBSPX(bspdata, x->lumpname));
+    for (const bspxentry_t *x = bspdata->bspxentries; x; x = x->next) {
+        if (!FindBSPX(refBspdata, x->lumpname))
+            AddBSPXLump(&lumps, x->lumpname, nullptr, x);
+    }
+
+    // the lumps vary a lot in size, so hand them out one at a time
+    tbb::parallel_for(static_cast<size_t>(0), lumps.size(), [&](size_t i) {
+        lumpcompare_t &lump = lumps[i];
+        lump.identical = (lump.refbytes == lump.bytes);
+        if (!lump.identical)
+            lump.differing = lump.drilldown(&lump.first);
+    });
+
+    int differ = 0;
+    for (const lumpcompare_t &lump : lumps) {
+        if (lump.identical) {
+            logprint("%-20s identical (%d)\n", lump.name.c_str(), static_cast<int>(lump.count));
+            continue;
+        }
+        if (lump.refpresent && lump.present && lump.refcount == lump.count && !lump.differing) {
+            logprint("%-20s equal within %g (%d)\n", lump.name.c_str(), eps, static_cast<int>(lump.count));
+            continue;
+        }
+
+        differ++;
+        if (!lump.refpresent || !lump.present) {
+            logprint("%-20s only in the %s bsp\n", lump.name.c_str(), lump.present ? "test" : "reference");
+            continue;
+        }
+
+        std::string counts;
+        if (lump.refcount != lump.count)
+            counts = std::to_string(lump.refcount) + " vs " + std::to_string(lump.count) + ", ";
+        else
+            counts = std::to_string(lump.count) + ", ";
+
+        if (lump.differing) {
+            logprint("%-20s DIFFERENT: %s%d differ, first at %d\n", lump.name.c_str(), counts.c_str(),
+                     static_cast<int>(lump.differing), static_cast<int>(lump.first));
+        } else {
+            logprint("%-20s DIFFERENT: %sthe first %d are equal\n", lump.name.c_str(), counts.c_str(),
+                     static_cast<int>(std::min(lump.refcount, lump.count)));
+        }
+    }
+
+    logprint("%d of %d lumps differ\n", differ, static_cast<int>(lumps.size()));
+    return differ;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <common/bspfile.hh>
+
+struct compare_options {
+    /**
+     * Largest difference allowed between floats (plane normals and
+     * distances, vertexes, bounds, texture vectors) for them to count
+     * as equal.
+     */
+    float epsilon = 0;
+};
+
+/**
+ * Checks each lump of both bsps (converted to the generic format) and
+ * their BSPX lumps in parallel, bytewise, then compares only the lumps
+ * that aren't identical element by element, printing the element counts,
+ * how many differ and the first that does.
+ *
+ * Returns the number of lumps that differ.
+ */
+int CompareBSPLumps(const bspdata_t *refBsp, const bspdata_t *bsp, const compare_options& options);
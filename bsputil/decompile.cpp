@@ -37,6 +37,7 @@
 #include <fmt/format.h>
 
 #include "tbb/parallel_for.h"
+#include "tbb/parallel_invoke.h"
 
 // texturing
 
@@ -589,8 +590,15 @@ SplitDifferentTexturedPartsOfBrush_R(const mbsp_t *bsp, const decomp_brush_t& br
 
             auto [front, back] = brush.clipToPlane(qvec3d(split.xyz()), split[3]);
 
-            SplitDifferentTexturedPartsOfBrush_R(bsp, front, out);
-            SplitDifferentTexturedPartsOfBrush_R(bsp, back, out);
+            // the halves are independent; split them in parallel, keeping front before back
+            std::vector<decomp_brush_t> backBrushes;
+            tbb::parallel_invoke(
+                [&]() { SplitDifferentTexturedPartsOfBrush_R(bsp, front, out); },
+                [&]() { SplitDifferentTexturedPartsOfBrush_R(bsp, back, &backBrushes); });
+
+            out->insert(out->end(),
+                        std::make_move_iterator(backBrushes.begin()),
+                        std::make_move_iterator(backBrushes.end()));
             return;
         }
     }
@@ -659,7 +667,7 @@ DecompileLeafTask(const mbsp_t *bsp, const leaf_decompile_task& task)
 
     auto reducedPlanes = RemoveRedundantPlanes(task.allPlanes);
     if (reducedPlanes.empty()) {
-        printf("warning, skipping empty brush\n");
+        logprint("warning, skipping empty brush\n");
         return "";
     }
 
@@ -786,17 +794,19 @@ AddMapBoundsToStack(std::vector<decomp_plane_t>* planestack, const mbsp_t *bsp,
     }
 }
 
-static void
-DecompileEntity(const mbsp_t *bsp, const decomp_options& options, FILE* file, const entdict_t& dict, bool isWorld)
+/**
+ * The entity's key/values, with "model" "*NNN" stripped.
+ *
+ * @param modelNum set to the entity's brush model, or -1 if it has none
+ */
+static std::string
+DecompileEntityKeys(const entdict_t& dict, bool isWorld, int *modelNum)
 {
     // we use -1 to indicate it's not a brush model
-    int modelNum = -1;
-    if (isWorld) {
-        modelNum = 0;
-    }
+    *modelNum = isWorld ? 0 : -1;
 
-    // First, print the key/values for this entity
-    fprintf(file, "{\n");
+    fmt::memory_buffer file;
+    fmt::format_to(file, "{{\n");
     for (const auto& keyValue : dict) {
         if (keyValue.first == "model"
             && !keyValue.second.empty()
@@ -807,53 +817,77 @@ DecompileEntity(const mbsp_t *bsp, const decomp_options& options, FILE* file, co
             std::string modelNumString = keyValue.second;
             modelNumString.erase(0, 1); // erase first character
 
-            modelNum = atoi(modelNumString.c_str());
+            *modelNum = atoi(modelNumString.c_str());
             continue;
         }
 
-        fprintf(file, "\"%s\" \"%s\"\n", keyValue.first.c_str(), keyValue.second.c_str());
+        fmt::format_to(file, "\"{}\" \"{}\"\n", keyValue.first, keyValue.second);
     }
 
-    // Print brushes if any
-    if (modelNum >= 0) {
-        const dmodelh2_t* model = &bsp->dmodels[modelNum];
-
-        // start with hull0 of the model
-        const bsp2_dnode_t* headnode = BSP_GetNode(bsp, model->headnode[0]);
-
-        // recursively visit the nodes to gather up a list of leafs to decompile
-        std::vector<decomp_plane_t> stack;
-        std::vector<leaf_decompile_task> tasks;
-        AddMapBoundsToStack(&stack, bsp, headnode);
-        DecompileNode(&stack, bsp, headnode, &tasks);
+    return fmt::to_string(file);
+}
 
-        // decompile the leafs in parallel
-        std::vector<std::string> leafStrings;
-        leafStrings.resize(tasks.size());
-        tbb::parallel_for(static_cast<size_t>(0), tasks.size(), [&](const size_t i) {
-            if (options.geometryOnly) {
-                leafStrings[i] = DecompileLeafTaskGeometryOnly(bsp, tasks[i]);
-            } else {
-                leafStrings[i] = DecompileLeafTask(bsp, tasks[i]);
-            }
-        });
+/**
+ * Gathers the leafs of hull0 of the model to decompile
+ */
+static void
+GatherModelTasks(const mbsp_t *bsp, int modelNum, std::vector<leaf_decompile_task>* tasks)
+{
+    const dmodelh2_t* model = &bsp->dmodels[modelNum];
 
-        // finally print out the leafs
-        for (auto& leafString : leafStrings) {
-            fprintf(file, "%s", leafString.c_str());
-        }
-    }
+    // start with hull0 of the model
+    const bsp2_dnode_t* headnode = BSP_GetNode(bsp, model->headnode[0]);
 
-    fprintf(file, "}\n");
+    // recursively visit the nodes to gather up a list of leafs to decompile
+    std::vector<decomp_plane_t> stack;
+    AddMapBoundsToStack(&stack, bsp, headnode);
+    DecompileNode(&stack, bsp, headnode, tasks);
 }
 
+/**
+ * The leafs of every brush entity are decompiled in one parallel pass, so
+ * the many small bmodels balance out the world's few expensive leafs.
+ * Each leaf decompiles to its own string; the strings are written in
+ * entity, then leaf order, so the output doesn't depend on scheduling.
+ */
 void
 DecompileBSP(const mbsp_t *bsp, const decomp_options& options, FILE* file)
 {
     auto entdicts = EntData_Parse(bsp->dentdata);
 
+    // tasks[entityTasks[i], entityTasks[i + 1]) are the leafs of entity i
+    std::vector<std::string> entityKeys(entdicts.size());
+    std::vector<size_t> entityTasks;
+    std::vector<leaf_decompile_task> tasks;
+
     for (size_t i = 0; i < entdicts.size(); ++i) {
         // entity 0 is implicitly worldspawn (model 0)
-        DecompileEntity(bsp, options, file, entdicts[i], i == 0);
+        int modelNum;
+        entityKeys[i] = DecompileEntityKeys(entdicts[i], i == 0, &modelNum);
+
+        entityTasks.push_back(tasks.size());
+        if (modelNum >= 0) {
+            GatherModelTasks(bsp, modelNum, &tasks);
+        }
+    }
+    entityTasks.push_back(tasks.size());
+
+    // decompile the leafs in parallel
+    std::vector<std::string> leafStrings(tasks.size());
+    tbb::parallel_for(static_cast<size_t>(0), tasks.size(), [&](const size_t i) {
+        if (options.geometryOnly) {
+            leafStrings[i] = DecompileLeafTaskGeometryOnly(bsp, tasks[i]);
+        } else {
+            leafStrings[i] = DecompileLeafTask(bsp, tasks[i]);
+        }
+    });
+
+    // finally print out the entities and their leafs
+    for (size_t i = 0; i < entdicts.size(); ++i) {
+        fwrite(entityKeys[i].data(), 1, entityKeys[i].size(), file);
+        for (size_t j = entityTasks[i]; j < entityTasks[i + 1]; ++j) {
+            fwrite(leafStrings[j].data(), 1, leafStrings[j].size(), file);
+        }
+        fprintf(file, "}\n");
     }
 }
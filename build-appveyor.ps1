@@ -25,6 +25,12 @@ if ( $? -eq $false ) {
   throw "testqbsp failed to build"
 }
 
+msbuild /target:testvis /p:Configuration=Release /p:Platform=$cmakePlatform /logger:"C:\Program Files\AppVeyor\BuildAgent\Appveyor.MSBuildLogger.dll" ericw-tools.sln
+
+if ( $? -eq $false ) {
+  throw "testvis failed to build"
+}
+
 msbuild /p:Configuration=Release /p:Platform=$cmakePlatform /logger:"C:\Program Files\AppVeyor\BuildAgent\Appveyor.MSBuildLogger.dll" PACKAGE.vcxproj
 
 if ( $? -eq $false ) {
@@ -43,6 +49,12 @@ if ( $? -eq $false ) {
   throw "testqbsp failed"
 }
 
+.\vis\Release\testvis.exe
+
+if ( $? -eq $false ) {
+  throw "testvis failed"
+}
+
 $env:Path += ";$(pwd)\qbsp\Release;$(pwd)\vis\Release;$(pwd)\light\Release;$(pwd)\bspinfo\Release;$(pwd)\bsputil\Release"
 
 cd ..\testmaps
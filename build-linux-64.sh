@@ -24,11 +24,13 @@ cmake .. -DCMAKE_BUILD_TYPE=Release -DCMAKE_PREFIX_PATH="$EMBREE_CMAKE_DIR;$TBB_
 make -j8 VERBOSE=1 || exit 1
 make -j8 VERBOSE=1 testlight || exit 1
 make -j8 VERBOSE=1 testqbsp || exit 1
+make -j8 VERBOSE=1 testvis || exit 1
 cpack || exit 1
 
 # run tests
 ./light/testlight || exit 1
 ./qbsp/testqbsp || exit 1
+./vis/testvis || exit 1
 
 # check rpath
 readelf -d ./light/light
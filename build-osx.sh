@@ -36,6 +36,7 @@ cmake .. -DCMAKE_BUILD_TYPE=Release -DCMAKE_PREFIX_PATH="$EMBREE_CMAKE_DIR;$TBB_
 make -j8 || exit 1
 make -j8 testlight || exit 1
 make -j8 testqbsp || exit 1
+make -j8 testvis || exit 1
 cpack || exit 1
 
 # print shared libraries used
@@ -48,6 +49,7 @@ otool -L ./bsputil/bsputil
 # run tests
 ./light/testlight || exit 1
 ./qbsp/testqbsp || exit 1
+./vis/testvis || exit 1
 
 # run regression tests
 cd ..
@@ -0,0 +1,218 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#include <common/batch.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+#include <common/threads.hh>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+
+#include "tbb/global_control.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_arena.h"
+
+using nlohmann::json;
+
+/* * matches any run of characters, ? any one character */
+static bool
+Batch_WildcardMatch(const char *pattern, const char *name)
+{
+    if (*pattern == '*') {
+        for (; ; name++) {
+            if (Batch_WildcardMatch(pattern + 1, name))
+                return true;
+            if (!*name)
+                return false;
+        }
+    }
+    if (!*name)
+        return !*pattern;
+    if (*pattern != '?' && *pattern != *name)
+        return false;
+    return Batch_WildcardMatch(pattern + 1, name + 1);
+}
+
+/*
+ * =============
+ * Batch_AddFiles
+ *
+ * Shells on Windows don't expand wildcards, and on other systems a quoted
+ * pattern gets around the command line length limit, so expand them here.
+ * Only the last path component can have wildcards.
+ * =============
+ */
+void
+Batch_AddFiles(std::vector<std::string> *files, const char *pattern)
+{
+    const std::string path = pattern;
+    const size_t slash = path.find_last_of("/\\");
+    const std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+
+    if (name.find_first_of("*?") == std::string::npos) {
+        files->push_back(path);
+        return;
+    }
+
+    const std::string dir = (slash == std::string::npos) ? "" : path.substr(0, slash + 1);
+    std::vector<std::string> matches;
+    std::error_code err;
+    for (const auto &entry : std::filesystem::directory_iterator(dir.empty() ? "." : dir, err)) {
+        const std::string filename = entry.path().filename().string();
+        if (entry.is_regular_file(err) && Batch_WildcardMatch(name.c_str(), filename.c_str()))
+            matches.push_back(dir + filename);
+    }
+    if (err)
+        Error("couldn't list %s: %s", dir.empty() ? "." : dir.c_str(), err.message().c_str());
+    if (matches.empty())
+        logprint("WARNING: no files match %s\n", pattern);
+
+    std::sort(matches.begin(), matches.end());
+    files->insert(files->end(), matches.begin(), matches.end());
+}
+
+void
+Batch_AddList(std::vector<std::string> *files, const char *listfile)
+{
+    std::ifstream file;
+    const bool usestdin = !strcmp(listfile, "-");
+    if (!usestdin) {
+        file.open(listfile);
+        if (!file)
+            Error("Error opening %s: %s", listfile, strerror(errno));
+    }
+    std::istream &in = usestdin ? std::cin : file;
+
+    std::string line;
+    while (std::getline(in, line)) {
+        /* trim, including the \r of CRLF lists */
+        const size_t first = line.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            continue;
+        const size_t last = line.find_last_not_of(" \t\r\n");
+        Batch_AddFiles(files, line.substr(first, last - first + 1).c_str());
+    }
+}
+
+/* logprint truncates its lines, so hand it the text in pieces */
+static void
+Batch_Print(const std::string &text)
+{
+    const size_t piece = 512;
+    for (size_t i = 0; i < text.size(); i += piece)
+        logprint("%s", text.substr(i, piece).c_str());
+}
+
+/*
+ * =============
+ * Batch_Run
+ * =============
+ */
+int
+Batch_Run(const std::vector<std::string> &files, const batchfunc_t &func, const char *reportfile)
+{
+    struct batchfile_t {
+        bool done = false;
+        std::string output;
+        json result;
+    };
+
+    /* a single file runs just as the tool always has */
+    if (files.size() == 1 && !reportfile) {
+        json result = json::object();
+        func(files[0], result);
+        return 0;
+    }
+
+    std::vector<batchfile_t> results(files.size());
+    std::mutex print_lock;
+    size_t next_print = 0;
+    const double start = I_FloatTime();
+
+    /* not RunThreadsOn, as its progress dots would land among the outputs */
+    tbb::global_control parallelism(tbb::global_control::max_allowed_parallelism, numthreads);
+    tbb::task_arena arena(numthreads);
+    arena.execute([&]() {
+        tbb::parallel_for(static_cast<size_t>(0), files.size(), [&](size_t i) {
+            batchfile_t &file = results[i];
+            const double filestart = I_FloatTime();
+
+            file.result = json::object();
+            file.result["file"] = files[i];
+
+            /*
+             * Isolated so that a thread waiting on this file's nested parallel
+             * work doesn't pick up another file's and log into this buffer.
+             */
+            tbb::this_task_arena::isolate([&]() {
+                log_capture_t capture(&file.output);
+                error_trap_t trap;
+                try {
+                    func(files[i], file.result);
+                    file.result["ok"] = true;
+                } catch (const std::exception &e) {
+                    file.result["ok"] = false;
+                    file.result["error"] = e.what();
+                }
+            });
+            file.result["seconds"] = I_FloatTime() - filestart;
+
+            /* print every file that's finished, up to the first that isn't */
+            std::lock_guard<std::mutex> lock(print_lock);
+            file.done = true;
+            for (; next_print < results.size() && results[next_print].done; next_print++)
+                Batch_Print(results[next_print].output);
+        });
+    });
+
+    int failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!results[i].result["ok"].get<bool>()) {
+            logprint("FAILED: %s: %s\n", files[i].c_str(),
+                     results[i].result["error"].get<std::string>().c_str());
+            failed++;
+        }
+    }
+    logprint("%d files, %d failed, %.3f seconds\n", static_cast<int>(files.size()), failed,
+             I_FloatTime() - start);
+
+    if (reportfile) {
+        json report = json::object();
+        report["files"] = json::array();
+        for (batchfile_t &file : results) {
+            file.result["log"] = std::move(file.output);
+            report["files"].push_back(std::move(file.result));
+        }
+        report["failed"] = failed;
+        report["seconds"] = I_FloatTime() - start;
+
+        std::ofstream out(reportfile);
+        if (!out)
+            Error("Error opening %s: %s", reportfile, strerror(errno));
+        /* the output can have non-UTF-8 text from the bsp */
+        out << report.dump(4, ' ', false, json::error_handler_t::replace);
+        logprint("wrote %s\n", reportfile);
+    }
+
+    return failed;
+}
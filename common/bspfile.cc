@@ -20,11 +20,32 @@
 #include <common/cmdlib.hh>
 #include <common/mathlib.hh>
 #include <common/bspfile.hh>
+#include <common/threads.hh>
 #include <cstdint>
 #include <limits.h>
+#include <vector>
+#include <atomic>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <fmt/format.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
+#include "tbb/parallel_invoke.h"
+#include "tbb/task_group.h"
+
 struct gamedef_generic_t : public gamedef_t {
     gamedef_generic_t()
     {
@@ -568,6 +589,8 @@ BSPVersionSupported(int32_t ident, int32_t version, const bspversion_t **out_ver
  * =========================================================================
  */
 
+#ifdef __BIG_ENDIAN__
+
 typedef enum { TO_DISK, TO_CPU } swaptype_t;
 
 static void
@@ -1377,6 +1400,8 @@ SwapBSPFile(bspdata_t *bspdata, swaptype_t swap)
     Error("Unsupported BSP version: %d", bspdata->version);
 }
 
+#endif /* __BIG_ENDIAN__ */
+
 /*
  * =========================================================================
  * BSP Format Conversion (ver. 29 <-> MBSP)
@@ -1667,25 +1692,24 @@ by ORing together all the PVS visible from a leaf
 static std::vector<uint8_t> CalcPHS(int32_t portalclusters, const uint8_t *visdata, int *visdatasize, int32_t bitofs[][2])
 {
     const int32_t leafbytes = (portalclusters + 7) >> 3;
-    const int32_t leaflongs = leafbytes / sizeof(long);
+    // only whole longs of each row are ORed in, as in the original PHS code
+    const int32_t orbytes = (leafbytes / sizeof(long)) * sizeof(long);
     std::vector<uint8_t> compressed_phs;
-    uint8_t *uncompressed = (uint8_t *) calloc(1, leafbytes);
-    uint8_t *uncompressed_2 = (uint8_t *) calloc(1, leafbytes);
-    uint8_t *compressed = (uint8_t *) calloc(1, leafbytes * 2);
-    uint8_t *uncompressed_orig = (uint8_t *) calloc(1, leafbytes);
 
     printf ("Building PHS...\n");
 
-    int32_t count = 0;
-    for (int32_t i = 0; i < portalclusters; i++)
-    {
-        const uint8_t *scan = &visdata[bitofs[i][DVIS_PVS]];
-
-        DecompressRow(scan, leafbytes, uncompressed);
-        memset(uncompressed_orig, 0, leafbytes);
-        memcpy(uncompressed_orig, uncompressed, leafbytes);
+    // every row is ORed in many times, so decompress each one just once
+    std::vector<uint8_t> pvs(static_cast<size_t>(portalclusters) * leafbytes);
+    RunThreadsOn(0, portalclusters, 64, [&](int i, int thread) {
+        DecompressRow(&visdata[bitofs[i][DVIS_PVS]], leafbytes, &pvs[static_cast<size_t>(i) * leafbytes]);
+    });
 
-        scan = uncompressed_orig;
+    std::vector<std::vector<uint8_t>> rows(portalclusters);
+    std::vector<int32_t> counts(portalclusters);
+    RunThreadsOn(0, portalclusters, 16, [&](int i, int thread) {
+        const uint8_t *scan = &pvs[static_cast<size_t>(i) * leafbytes];
+        std::vector<uint8_t> uncompressed(scan, scan + leafbytes);
+        std::vector<uint8_t> compressed(leafbytes * 2);
 
         for (int32_t j = 0; j < leafbytes; j++)
         {
@@ -1700,33 +1724,32 @@ static std::vector<uint8_t> CalcPHS(int32_t portalclusters, const uint8_t *visda
                 int32_t index = ((j<<3)+k);
                 if (index >= portalclusters)
                     Error ("Bad bit in PVS");	// pad bits should be 0
-                const uint8_t *src_compressed = &visdata[bitofs[index][DVIS_PVS]];
-                DecompressRow(src_compressed, leafbytes, uncompressed_2);
-                const long *src = (long *) uncompressed_2;
-                long *dest = (long *) uncompressed;
-                for (int32_t l = 0; l < leaflongs; l++)
-                    ((long *)uncompressed)[l] |= src[l];
+                const uint8_t *src = &pvs[static_cast<size_t>(index) * leafbytes];
+                for (int32_t l = 0; l < orbytes; l++)
+                    uncompressed[l] |= src[l];
             }
         }
+        int32_t count = 0;
         for (int32_t j = 0; j < portalclusters; j++)
             if (uncompressed[j>>3] & (1<<(j&7)) )
                 count++;
+        counts[i] = count;
 
         //
         // compress the bit string
         //
-        int32_t j = CompressRow (uncompressed, leafbytes, compressed);
+        int32_t len = CompressRow (uncompressed.data(), leafbytes, compressed.data());
+        rows[i].assign(compressed.data(), compressed.data() + len);
+    });
 
+    int32_t count = 0;
+    for (int32_t i = 0; i < portalclusters; i++)
+    {
+        count += counts[i];
         bitofs[i][DVIS_PHS] = compressed_phs.size();
-
-        compressed_phs.insert(compressed_phs.end(), compressed, compressed + j);
+        compressed_phs.insert(compressed_phs.end(), rows[i].begin(), rows[i].end());
     }
 
-    free(uncompressed);
-    free(uncompressed_2);
-    free(compressed);
-    free(uncompressed_orig);
-
     printf ("Average clusters hearable: %i\n", count / portalclusters);
 
     return compressed_phs;
@@ -2029,7 +2052,7 @@ Q2BSPtoM_Texinfo(const q2_texinfo_t *dtexinfosq2, int numtexinfos) {
     gtexinfo_t *newdata, *dtexinfo2;
     int i, j, k;
     
-    newdata = dtexinfo2 = static_cast<gtexinfo_t *>(malloc(numtexinfos * sizeof(*dtexinfo2)));
+    newdata = dtexinfo2 = static_cast<gtexinfo_t *>(calloc(numtexinfos, sizeof(*dtexinfo2)));
     
     for (i = 0; i < numtexinfos; i++, dtexinfoq2++, dtexinfo2++) {
         for (j = 0; j < 2; j++)
@@ -2524,81 +2547,28 @@ BSP2to2rmq_Nodes(const bsp2_dnode_t *dnodes2, int numnodes) {
  * =========================================================================
  */
 
-static void *CopyArray(const void *in, int numelems, size_t elemsize)
+/*
+ * Hands a lump over to the converted bsp when both formats share its layout,
+ * instead of copying it. The source is cleared so the Free* afterwards
+ * leaves it alone.
+ */
+template <typename T>
+static T *MoveArray(T *&in)
 {
-    void *out = (void *)calloc(numelems, elemsize);
-    memcpy(out, in, numelems * elemsize);
+    T *out = in;
+    in = nullptr;
     return out;
 }
 
-static dmodelh2_t *H2_CopyModels(const dmodelh2_t *dmodels, int nummodels)
-{
-    return (dmodelh2_t *)CopyArray(dmodels, nummodels, sizeof(*dmodels));
-}
-
-static uint8_t *BSP29_CopyVisData(const uint8_t *dvisdata, int visdatasize)
-{
-    return (uint8_t *)CopyArray(dvisdata, visdatasize, 1);
-}
-
-static uint8_t *BSP29_CopyLightData(const uint8_t *dlightdata, int lightdatasize)
-{
-    return (uint8_t *)CopyArray(dlightdata, lightdatasize, 1);
-}
-
-static dmiptexlump_t *BSP29_CopyTexData(const dmiptexlump_t *dtexdata, int texdatasize)
-{
-    return (dmiptexlump_t *)CopyArray(dtexdata, texdatasize, 1);
-}
-
-static char *BSP29_CopyEntData(const char *dentdata, int entdatasize)
-{
-    return (char *)CopyArray(dentdata, entdatasize, 1);
-}
-
-static dplane_t *BSP29_CopyPlanes(const dplane_t *dplanes, int numplanes)
-{
-    return (dplane_t *)CopyArray(dplanes, numplanes, sizeof(*dplanes));
-}
-
-static dvertex_t *BSP29_CopyVertexes(const dvertex_t *dvertexes, int numvertexes)
-{
-    return (dvertex_t *)CopyArray(dvertexes, numvertexes, sizeof(*dvertexes));
-}
-
-static texinfo_t *BSP29_CopyTexinfo(const texinfo_t *texinfo, int numtexinfo)
-{
-    return (texinfo_t *)CopyArray(texinfo, numtexinfo, sizeof(*texinfo));
-}
-
-static int32_t *BSP29_CopySurfedges(const int32_t *surfedges, int numsurfedges)
-{
-    return (int32_t *)CopyArray(surfedges, numsurfedges, sizeof(*surfedges));
-}
-
-static bsp2_dface_t *BSP2_CopyFaces(const bsp2_dface_t *dfaces, int numfaces)
-{
-    return (bsp2_dface_t *)CopyArray(dfaces, numfaces, sizeof(*dfaces));
-}
-
-static bsp2_dclipnode_t *BSP2_CopyClipnodes(const bsp2_dclipnode_t *dclipnodes, int numclipnodes)
-{
-    return (bsp2_dclipnode_t *)CopyArray(dclipnodes, numclipnodes, sizeof(*dclipnodes));
-}
-
-static bsp2_dedge_t *BSP2_CopyEdges(const bsp2_dedge_t *dedges, int numedges)
-{
-    return (bsp2_dedge_t *)CopyArray(dedges, numedges, sizeof(*dedges));
-}
-
-static uint32_t *BSP2_CopyMarksurfaces(const uint32_t *marksurfaces, int nummarksurfaces)
-{
-    return (uint32_t *)CopyArray(marksurfaces, nummarksurfaces, sizeof(*marksurfaces));
-}
-
-static bsp2_dnode_t *BSP2_CopyNodes(const bsp2_dnode_t *dnodes, int numnodes)
+/*
+ * Releases a source lump as soon as it has been converted, so a conversion
+ * only ever holds one lump in both formats at once.
+ */
+template <typename T>
+static void FreeArray(T *&in)
 {
-    return (bsp2_dnode_t *)CopyArray(dnodes, numnodes, sizeof(*dnodes));
+    free(in);
+    in = nullptr;
 }
 
 static uint32_t *Q2BSPtoM_CopyLeafBrushes(const uint16_t *leafbrushes, int count)
@@ -2629,26 +2599,6 @@ static uint16_t *MBSPtoQ2_CopyLeafBrushes(const uint32_t *leafbrushes, int count
     return newdata;
 }
 
-static uint32_t *Q2BSP_Qbism_CopyLeafBrushes(const uint32_t *leafbrushes, int count)
-{
-    return (uint32_t *)CopyArray(leafbrushes, count, sizeof(*leafbrushes));
-}
-
-static darea_t *Q2BSP_CopyAreas(const darea_t *areas, int count)
-{
-    return (darea_t *)CopyArray(areas, count, sizeof(*areas));
-}
-
-static dareaportal_t *Q2BSP_CopyAreaPortals(const dareaportal_t *areaportals, int count)
-{
-    return (dareaportal_t *)CopyArray(areaportals, count, sizeof(*areaportals));
-}
-
-static dbrush_t *Q2BSP_CopyBrushes(const dbrush_t *brushes, int count)
-{
-    return (dbrush_t *)CopyArray(brushes, count, sizeof(*brushes));
-}
-
 static q2_dbrushside_qbism_t *Q2BSPtoM_CopyBrushSides(const dbrushside_t *dbrushsides, int count)
 {
     const dbrushside_t *brushside = dbrushsides;
@@ -2665,11 +2615,6 @@ static q2_dbrushside_qbism_t *Q2BSPtoM_CopyBrushSides(const dbrushside_t *dbrush
     return newdata;
 }
 
-static q2_dbrushside_qbism_t *Q2BSP_Qbism_CopyBrushSides(const q2_dbrushside_qbism_t *brushsides, int count)
-{
-    return (q2_dbrushside_qbism_t *)CopyArray(brushsides, count, sizeof(*brushsides));
-}
-
 static dbrushside_t *MBSPtoQ2_CopyBrushSides(const q2_dbrushside_qbism_t *dbrushsides, int count)
 {
     const q2_dbrushside_qbism_t *brushside = dbrushsides;
@@ -2879,25 +2824,51 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (bspdata->version == &bspver_h2) {
-                mbsp->dmodels = H2_CopyModels(bsp29->dmodels_h2, bsp29->nummodels);
+                mbsp->dmodels = MoveArray(bsp29->dmodels_h2);
             } else {
                 mbsp->dmodels = BSPQ1toH2_Models(bsp29->dmodels_q, bsp29->nummodels);
+                FreeArray(bsp29->dmodels_q);
             }
-            mbsp->dvisdata = BSP29_CopyVisData(bsp29->dvisdata, bsp29->visdatasize);
-            mbsp->dlightdata = BSP29_CopyLightData(bsp29->dlightdata, bsp29->lightdatasize);
-            mbsp->dtexdata = BSP29_CopyTexData(bsp29->dtexdata, bsp29->texdatasize);
-            mbsp->dentdata = BSP29_CopyEntData(bsp29->dentdata, bsp29->entdatasize);
-            mbsp->dleafs = BSP29toM_Leafs(bsp29->dleafs, bsp29->numleafs);
-            mbsp->dplanes = BSP29_CopyPlanes(bsp29->dplanes, bsp29->numplanes);
-            mbsp->dvertexes = BSP29_CopyVertexes(bsp29->dvertexes, bsp29->numvertexes);
-            mbsp->dnodes = BSP29to2_Nodes(bsp29->dnodes, bsp29->numnodes);
-            mbsp->texinfo = BSP29toM_Texinfo(bsp29->texinfo, bsp29->numtexinfo);
-            mbsp->dfaces = BSP29to2_Faces(bsp29->dfaces, bsp29->numfaces);
-            mbsp->dclipnodes = BSP29to2_Clipnodes(bsp29->dclipnodes, bsp29->numclipnodes);
-            mbsp->dedges = BSP29to2_Edges(bsp29->dedges, bsp29->numedges);
-            mbsp->dleaffaces = BSP29to2_Marksurfaces(bsp29->dmarksurfaces, bsp29->nummarksurfaces);
-            mbsp->dsurfedges = BSP29_CopySurfedges(bsp29->dsurfedges, bsp29->numsurfedges);
-        
+            mbsp->dvisdata = MoveArray(bsp29->dvisdata);
+            mbsp->dlightdata = MoveArray(bsp29->dlightdata);
+            mbsp->dtexdata = MoveArray(bsp29->dtexdata);
+            mbsp->dentdata = MoveArray(bsp29->dentdata);
+            mbsp->dplanes = MoveArray(bsp29->dplanes);
+            mbsp->dvertexes = MoveArray(bsp29->dvertexes);
+            mbsp->dsurfedges = MoveArray(bsp29->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                mbsp->dleafs = BSP29toM_Leafs(bsp29->dleafs, bsp29->numleafs);
+                FreeArray(bsp29->dleafs);
+            });
+            group.run([&]() {
+                mbsp->dnodes = BSP29to2_Nodes(bsp29->dnodes, bsp29->numnodes);
+                FreeArray(bsp29->dnodes);
+            });
+            group.run([&]() {
+                mbsp->texinfo = BSP29toM_Texinfo(bsp29->texinfo, bsp29->numtexinfo);
+                FreeArray(bsp29->texinfo);
+            });
+            group.run([&]() {
+                mbsp->dfaces = BSP29to2_Faces(bsp29->dfaces, bsp29->numfaces);
+                FreeArray(bsp29->dfaces);
+            });
+            group.run([&]() {
+                mbsp->dclipnodes = BSP29to2_Clipnodes(bsp29->dclipnodes, bsp29->numclipnodes);
+                FreeArray(bsp29->dclipnodes);
+            });
+            group.run([&]() {
+                mbsp->dedges = BSP29to2_Edges(bsp29->dedges, bsp29->numedges);
+                FreeArray(bsp29->dedges);
+            });
+            group.run([&]() {
+                mbsp->dleaffaces = BSP29to2_Marksurfaces(bsp29->dmarksurfaces, bsp29->nummarksurfaces);
+                FreeArray(bsp29->dmarksurfaces);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeBSP29(bsp29);
         
@@ -2934,28 +2905,58 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
             mbsp->numbrushsides = q2bsp->numbrushsides;
         
             // copy or convert data
-            mbsp->dmodels = Q2BSPtoM_Models(q2bsp->dmodels, q2bsp->nummodels);
-            mbsp->dlightdata = BSP29_CopyLightData(q2bsp->dlightdata, q2bsp->lightdatasize);
-            mbsp->dentdata = BSP29_CopyEntData(q2bsp->dentdata, q2bsp->entdatasize);
-            mbsp->dleafs = Q2BSPtoM_Leafs(q2bsp->dleafs, q2bsp->numleafs);
-            mbsp->dplanes = BSP29_CopyPlanes(q2bsp->dplanes, q2bsp->numplanes);
-            mbsp->dvertexes = BSP29_CopyVertexes(q2bsp->dvertexes, q2bsp->numvertexes);
-            mbsp->dnodes = Q2BSPto2_Nodes(q2bsp->dnodes, q2bsp->numnodes);
-            mbsp->texinfo = Q2BSPtoM_Texinfo(q2bsp->texinfo, q2bsp->numtexinfo);
-            mbsp->dfaces = Q2BSPto2_Faces(q2bsp->dfaces, q2bsp->numfaces);
-            mbsp->dedges = BSP29to2_Edges(q2bsp->dedges, q2bsp->numedges);
-            mbsp->dleaffaces = BSP29to2_Marksurfaces(q2bsp->dleaffaces, q2bsp->numleaffaces);
-            mbsp->dleafbrushes = Q2BSPtoM_CopyLeafBrushes(q2bsp->dleafbrushes, q2bsp->numleafbrushes);
-            mbsp->dsurfedges = BSP29_CopySurfedges(q2bsp->dsurfedges, q2bsp->numsurfedges);
+            mbsp->dlightdata = MoveArray(q2bsp->dlightdata);
+            mbsp->dentdata = MoveArray(q2bsp->dentdata);
+            mbsp->dplanes = MoveArray(q2bsp->dplanes);
+            mbsp->dvertexes = MoveArray(q2bsp->dvertexes);
+            mbsp->dsurfedges = MoveArray(q2bsp->dsurfedges);
+            mbsp->dareas = MoveArray(q2bsp->dareas);
+            mbsp->dareaportals = MoveArray(q2bsp->dareaportals);
+            mbsp->dbrushes = MoveArray(q2bsp->dbrushes);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                mbsp->dmodels = Q2BSPtoM_Models(q2bsp->dmodels, q2bsp->nummodels);
+                FreeArray(q2bsp->dmodels);
+            });
+            group.run([&]() {
+                mbsp->dleafs = Q2BSPtoM_Leafs(q2bsp->dleafs, q2bsp->numleafs);
+                FreeArray(q2bsp->dleafs);
+            });
+            group.run([&]() {
+                mbsp->dnodes = Q2BSPto2_Nodes(q2bsp->dnodes, q2bsp->numnodes);
+                FreeArray(q2bsp->dnodes);
+            });
+            group.run([&]() {
+                mbsp->texinfo = Q2BSPtoM_Texinfo(q2bsp->texinfo, q2bsp->numtexinfo);
+                FreeArray(q2bsp->texinfo);
+            });
+            group.run([&]() {
+                mbsp->dfaces = Q2BSPto2_Faces(q2bsp->dfaces, q2bsp->numfaces);
+                FreeArray(q2bsp->dfaces);
+            });
+            group.run([&]() {
+                mbsp->dedges = BSP29to2_Edges(q2bsp->dedges, q2bsp->numedges);
+                FreeArray(q2bsp->dedges);
+            });
+            group.run([&]() {
+                mbsp->dleaffaces = BSP29to2_Marksurfaces(q2bsp->dleaffaces, q2bsp->numleaffaces);
+                FreeArray(q2bsp->dleaffaces);
+            });
+            group.run([&]() {
+                mbsp->dleafbrushes = Q2BSPtoM_CopyLeafBrushes(q2bsp->dleafbrushes, q2bsp->numleafbrushes);
+                FreeArray(q2bsp->dleafbrushes);
+            });
+            group.run([&]() {
+                mbsp->dbrushsides = Q2BSPtoM_CopyBrushSides(q2bsp->dbrushsides, q2bsp->numbrushsides);
+                FreeArray(q2bsp->dbrushsides);
+            });
+            group.wait();
 
             mbsp->dvisdata = Q2BSPtoM_CopyVisData(q2bsp->dvis, q2bsp->visdatasize, &mbsp->visdatasize, mbsp->dleafs, mbsp->numleafs);
-        
-            mbsp->dareas = Q2BSP_CopyAreas(q2bsp->dareas, q2bsp->numareas);
-            mbsp->dareaportals = Q2BSP_CopyAreaPortals(q2bsp->dareaportals, q2bsp->numareaportals);
-        
-            mbsp->dbrushes = Q2BSP_CopyBrushes(q2bsp->dbrushes, q2bsp->numbrushes);
-            mbsp->dbrushsides = Q2BSPtoM_CopyBrushSides(q2bsp->dbrushsides, q2bsp->numbrushsides);
-        
+            FreeArray(q2bsp->dvis);
+            
             /* Free old data */
             FreeQ2BSP(q2bsp);
         
@@ -2992,28 +2993,43 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
             mbsp->numbrushsides = q2bsp->numbrushsides;
         
             // copy or convert data
-            mbsp->dmodels = Q2BSPtoM_Models(q2bsp->dmodels, q2bsp->nummodels);
-            mbsp->dlightdata = BSP29_CopyLightData(q2bsp->dlightdata, q2bsp->lightdatasize);
-            mbsp->dentdata = BSP29_CopyEntData(q2bsp->dentdata, q2bsp->entdatasize);
-            mbsp->dleafs = Q2BSP_QBSPtoM_Leafs(q2bsp->dleafs, q2bsp->numleafs);
-            mbsp->dplanes = BSP29_CopyPlanes(q2bsp->dplanes, q2bsp->numplanes);
-            mbsp->dvertexes = BSP29_CopyVertexes(q2bsp->dvertexes, q2bsp->numvertexes);
-            mbsp->dnodes = BSP2_CopyNodes(q2bsp->dnodes, q2bsp->numnodes);
-            mbsp->texinfo = Q2BSPtoM_Texinfo(q2bsp->texinfo, q2bsp->numtexinfo);
-            mbsp->dfaces = Q2BSP_QBSPto2_Faces(q2bsp->dfaces, q2bsp->numfaces);
-            mbsp->dedges = BSP2_CopyEdges(q2bsp->dedges, q2bsp->numedges);
-            mbsp->dleaffaces = BSP2_CopyMarksurfaces(q2bsp->dleaffaces, q2bsp->numleaffaces);
-            mbsp->dleafbrushes = Q2BSP_Qbism_CopyLeafBrushes(q2bsp->dleafbrushes, q2bsp->numleafbrushes);
-            mbsp->dsurfedges = BSP29_CopySurfedges(q2bsp->dsurfedges, q2bsp->numsurfedges);
-            
+            mbsp->dlightdata = MoveArray(q2bsp->dlightdata);
+            mbsp->dentdata = MoveArray(q2bsp->dentdata);
+            mbsp->dplanes = MoveArray(q2bsp->dplanes);
+            mbsp->dvertexes = MoveArray(q2bsp->dvertexes);
+            mbsp->dnodes = MoveArray(q2bsp->dnodes);
+            mbsp->dedges = MoveArray(q2bsp->dedges);
+            mbsp->dleaffaces = MoveArray(q2bsp->dleaffaces);
+            mbsp->dleafbrushes = MoveArray(q2bsp->dleafbrushes);
+            mbsp->dsurfedges = MoveArray(q2bsp->dsurfedges);
+            mbsp->dareas = MoveArray(q2bsp->dareas);
+            mbsp->dareaportals = MoveArray(q2bsp->dareaportals);
+            mbsp->dbrushes = MoveArray(q2bsp->dbrushes);
+            mbsp->dbrushsides = MoveArray(q2bsp->dbrushsides);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                mbsp->dmodels = Q2BSPtoM_Models(q2bsp->dmodels, q2bsp->nummodels);
+                FreeArray(q2bsp->dmodels);
+            });
+            group.run([&]() {
+                mbsp->dleafs = Q2BSP_QBSPtoM_Leafs(q2bsp->dleafs, q2bsp->numleafs);
+                FreeArray(q2bsp->dleafs);
+            });
+            group.run([&]() {
+                mbsp->texinfo = Q2BSPtoM_Texinfo(q2bsp->texinfo, q2bsp->numtexinfo);
+                FreeArray(q2bsp->texinfo);
+            });
+            group.run([&]() {
+                mbsp->dfaces = Q2BSP_QBSPto2_Faces(q2bsp->dfaces, q2bsp->numfaces);
+                FreeArray(q2bsp->dfaces);
+            });
+            group.wait();
+
             mbsp->dvisdata = Q2BSPtoM_CopyVisData(q2bsp->dvis, q2bsp->visdatasize, &mbsp->visdatasize, mbsp->dleafs, mbsp->numleafs);
-        
-            mbsp->dareas = Q2BSP_CopyAreas(q2bsp->dareas, q2bsp->numareas);
-            mbsp->dareaportals = Q2BSP_CopyAreaPortals(q2bsp->dareaportals, q2bsp->numareaportals);
-        
-            mbsp->dbrushes = Q2BSP_CopyBrushes(q2bsp->dbrushes, q2bsp->numbrushes);
-            mbsp->dbrushsides = Q2BSP_Qbism_CopyBrushSides(q2bsp->dbrushsides, q2bsp->numbrushsides);
-        
+            FreeArray(q2bsp->dvis);
+            
             /* Free old data */
             FreeQ2BSP_QBSP(q2bsp);
         
@@ -3048,25 +3064,39 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (bspdata->version == &bspver_h2bsp2rmq) {
-                mbsp->dmodels = H2_CopyModels(bsp2rmq->dmodels_h2, bsp2rmq->nummodels);
+                mbsp->dmodels = MoveArray(bsp2rmq->dmodels_h2);
             } else {
                 mbsp->dmodels = BSPQ1toH2_Models(bsp2rmq->dmodels_q, bsp2rmq->nummodels);
+                FreeArray(bsp2rmq->dmodels_q);
             }
-            mbsp->dvisdata = BSP29_CopyVisData(bsp2rmq->dvisdata, bsp2rmq->visdatasize);
-            mbsp->dlightdata = BSP29_CopyLightData(bsp2rmq->dlightdata, bsp2rmq->lightdatasize);
-            mbsp->dtexdata = BSP29_CopyTexData(bsp2rmq->dtexdata, bsp2rmq->texdatasize);
-            mbsp->dentdata = BSP29_CopyEntData(bsp2rmq->dentdata, bsp2rmq->entdatasize);
-            mbsp->dleafs = BSP2rmqtoM_Leafs(bsp2rmq->dleafs, bsp2rmq->numleafs);
-            mbsp->dplanes = BSP29_CopyPlanes(bsp2rmq->dplanes, bsp2rmq->numplanes);
-            mbsp->dvertexes = BSP29_CopyVertexes(bsp2rmq->dvertexes, bsp2rmq->numvertexes);
-            mbsp->dnodes = BSP2rmqto2_Nodes(bsp2rmq->dnodes, bsp2rmq->numnodes);
-            mbsp->texinfo = BSP29toM_Texinfo(bsp2rmq->texinfo, bsp2rmq->numtexinfo);
-            mbsp->dfaces = BSP2_CopyFaces(bsp2rmq->dfaces, bsp2rmq->numfaces);
-            mbsp->dclipnodes = BSP2_CopyClipnodes(bsp2rmq->dclipnodes, bsp2rmq->numclipnodes);
-            mbsp->dedges = BSP2_CopyEdges(bsp2rmq->dedges, bsp2rmq->numedges);
-            mbsp->dleaffaces = BSP2_CopyMarksurfaces(bsp2rmq->dmarksurfaces, bsp2rmq->nummarksurfaces);
-            mbsp->dsurfedges = BSP29_CopySurfedges(bsp2rmq->dsurfedges, bsp2rmq->numsurfedges);
-        
+            mbsp->dvisdata = MoveArray(bsp2rmq->dvisdata);
+            mbsp->dlightdata = MoveArray(bsp2rmq->dlightdata);
+            mbsp->dtexdata = MoveArray(bsp2rmq->dtexdata);
+            mbsp->dentdata = MoveArray(bsp2rmq->dentdata);
+            mbsp->dplanes = MoveArray(bsp2rmq->dplanes);
+            mbsp->dvertexes = MoveArray(bsp2rmq->dvertexes);
+            mbsp->dfaces = MoveArray(bsp2rmq->dfaces);
+            mbsp->dclipnodes = MoveArray(bsp2rmq->dclipnodes);
+            mbsp->dedges = MoveArray(bsp2rmq->dedges);
+            mbsp->dleaffaces = MoveArray(bsp2rmq->dmarksurfaces);
+            mbsp->dsurfedges = MoveArray(bsp2rmq->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                mbsp->dleafs = BSP2rmqtoM_Leafs(bsp2rmq->dleafs, bsp2rmq->numleafs);
+                FreeArray(bsp2rmq->dleafs);
+            });
+            group.run([&]() {
+                mbsp->dnodes = BSP2rmqto2_Nodes(bsp2rmq->dnodes, bsp2rmq->numnodes);
+                FreeArray(bsp2rmq->dnodes);
+            });
+            group.run([&]() {
+                mbsp->texinfo = BSP29toM_Texinfo(bsp2rmq->texinfo, bsp2rmq->numtexinfo);
+                FreeArray(bsp2rmq->texinfo);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeBSP2RMQ(bsp2rmq);
         
@@ -3101,25 +3131,36 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (bspdata->version == &bspver_h2bsp2) {
-                mbsp->dmodels = H2_CopyModels(bsp2->dmodels_h2, bsp2->nummodels);
+                mbsp->dmodels = MoveArray(bsp2->dmodels_h2);
             } else {
                 mbsp->dmodels = BSPQ1toH2_Models(bsp2->dmodels_q, bsp2->nummodels);
+                FreeArray(bsp2->dmodels_q);
             }
-            mbsp->dvisdata = BSP29_CopyVisData(bsp2->dvisdata, bsp2->visdatasize);
-            mbsp->dlightdata = BSP29_CopyLightData(bsp2->dlightdata, bsp2->lightdatasize);
-            mbsp->dtexdata = BSP29_CopyTexData(bsp2->dtexdata, bsp2->texdatasize);
-            mbsp->dentdata = BSP29_CopyEntData(bsp2->dentdata, bsp2->entdatasize);
-            mbsp->dleafs = BSP2toM_Leafs(bsp2->dleafs, bsp2->numleafs);
-            mbsp->dplanes = BSP29_CopyPlanes(bsp2->dplanes, bsp2->numplanes);
-            mbsp->dvertexes = BSP29_CopyVertexes(bsp2->dvertexes, bsp2->numvertexes);
-            mbsp->dnodes = BSP2_CopyNodes(bsp2->dnodes, bsp2->numnodes);
-            mbsp->texinfo = BSP29toM_Texinfo(bsp2->texinfo, bsp2->numtexinfo);
-            mbsp->dfaces = BSP2_CopyFaces(bsp2->dfaces, bsp2->numfaces);
-            mbsp->dclipnodes = BSP2_CopyClipnodes(bsp2->dclipnodes, bsp2->numclipnodes);
-            mbsp->dedges = BSP2_CopyEdges(bsp2->dedges, bsp2->numedges);
-            mbsp->dleaffaces = BSP2_CopyMarksurfaces(bsp2->dmarksurfaces, bsp2->nummarksurfaces);
-            mbsp->dsurfedges = BSP29_CopySurfedges(bsp2->dsurfedges, bsp2->numsurfedges);
-        
+            mbsp->dvisdata = MoveArray(bsp2->dvisdata);
+            mbsp->dlightdata = MoveArray(bsp2->dlightdata);
+            mbsp->dtexdata = MoveArray(bsp2->dtexdata);
+            mbsp->dentdata = MoveArray(bsp2->dentdata);
+            mbsp->dplanes = MoveArray(bsp2->dplanes);
+            mbsp->dvertexes = MoveArray(bsp2->dvertexes);
+            mbsp->dnodes = MoveArray(bsp2->dnodes);
+            mbsp->dfaces = MoveArray(bsp2->dfaces);
+            mbsp->dclipnodes = MoveArray(bsp2->dclipnodes);
+            mbsp->dedges = MoveArray(bsp2->dedges);
+            mbsp->dleaffaces = MoveArray(bsp2->dmarksurfaces);
+            mbsp->dsurfedges = MoveArray(bsp2->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                mbsp->dleafs = BSP2toM_Leafs(bsp2->dleafs, bsp2->numleafs);
+                FreeArray(bsp2->dleafs);
+            });
+            group.run([&]() {
+                mbsp->texinfo = BSP29toM_Texinfo(bsp2->texinfo, bsp2->numtexinfo);
+                FreeArray(bsp2->texinfo);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeBSP2(bsp2);
         
@@ -3138,23 +3179,16 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
             bsp29_t *bsp29 = &bspdata->data.bsp29;
             mbsp_t *mbsp = &bspdata->data.mbsp;
         
-            // validate that the conversion is possible
-            if (!MBSPto29_Leafs_Validate(mbsp->dleafs, mbsp->numleafs)) {
-                return false;
-            }
-            if (!BSP2to29_Nodes_Validate(mbsp->dnodes, mbsp->numnodes)) {
-                return false;
-            }
-            if (!BSP2to29_Faces_Validate(mbsp->dfaces, mbsp->numfaces)) {
-                return false;
-            }
-            if (!BSP2to29_Clipnodes_Validate(mbsp->dclipnodes, mbsp->numclipnodes)) {
-                return false;
-            }
-            if (!BSP2to29_Edges_Validate(mbsp->dedges, mbsp->numedges)) {
-                return false;
-            }
-            if (!BSP2to29_Marksurfaces_Validate(mbsp->dleaffaces, mbsp->numleaffaces)) {
+            // validate that the conversion is possible; the lumps are checked concurrently
+            std::atomic<bool> valid { true };
+            tbb::parallel_invoke(
+                [&]() { if (!MBSPto29_Leafs_Validate(mbsp->dleafs, mbsp->numleafs)) valid = false; },
+                [&]() { if (!BSP2to29_Nodes_Validate(mbsp->dnodes, mbsp->numnodes)) valid = false; },
+                [&]() { if (!BSP2to29_Faces_Validate(mbsp->dfaces, mbsp->numfaces)) valid = false; },
+                [&]() { if (!BSP2to29_Clipnodes_Validate(mbsp->dclipnodes, mbsp->numclipnodes)) valid = false; },
+                [&]() { if (!BSP2to29_Edges_Validate(mbsp->dedges, mbsp->numedges)) valid = false; },
+                [&]() { if (!BSP2to29_Marksurfaces_Validate(mbsp->dleaffaces, mbsp->numleaffaces)) valid = false; });
+            if (!valid) {
                 return false;
             }
 
@@ -3180,25 +3214,51 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (to_version == &bspver_h2) {
-                bsp29->dmodels_h2 = H2_CopyModels(mbsp->dmodels, mbsp->nummodels);
+                bsp29->dmodels_h2 = MoveArray(mbsp->dmodels);
             } else {
                 bsp29->dmodels_q = BSPH2toQ1_Models(mbsp->dmodels, mbsp->nummodels);
+                FreeArray(mbsp->dmodels);
             }
-            bsp29->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-            bsp29->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-            bsp29->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-            bsp29->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
-            bsp29->dleafs = MBSPto29_Leafs(mbsp->dleafs, mbsp->numleafs);
-            bsp29->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-            bsp29->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-            bsp29->dnodes = BSP2to29_Nodes(mbsp->dnodes, mbsp->numnodes);
-            bsp29->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-            bsp29->dfaces = BSP2to29_Faces(mbsp->dfaces, mbsp->numfaces);
-            bsp29->dclipnodes = BSP2to29_Clipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
-            bsp29->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
-            bsp29->dmarksurfaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-            bsp29->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
-        
+            bsp29->dvisdata = MoveArray(mbsp->dvisdata);
+            bsp29->dlightdata = MoveArray(mbsp->dlightdata);
+            bsp29->dtexdata = MoveArray(mbsp->dtexdata);
+            bsp29->dentdata = MoveArray(mbsp->dentdata);
+            bsp29->dplanes = MoveArray(mbsp->dplanes);
+            bsp29->dvertexes = MoveArray(mbsp->dvertexes);
+            bsp29->dsurfedges = MoveArray(mbsp->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                bsp29->dleafs = MBSPto29_Leafs(mbsp->dleafs, mbsp->numleafs);
+                FreeArray(mbsp->dleafs);
+            });
+            group.run([&]() {
+                bsp29->dnodes = BSP2to29_Nodes(mbsp->dnodes, mbsp->numnodes);
+                FreeArray(mbsp->dnodes);
+            });
+            group.run([&]() {
+                bsp29->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
+                FreeArray(mbsp->texinfo);
+            });
+            group.run([&]() {
+                bsp29->dfaces = BSP2to29_Faces(mbsp->dfaces, mbsp->numfaces);
+                FreeArray(mbsp->dfaces);
+            });
+            group.run([&]() {
+                bsp29->dclipnodes = BSP2to29_Clipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
+                FreeArray(mbsp->dclipnodes);
+            });
+            group.run([&]() {
+                bsp29->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
+                FreeArray(mbsp->dedges);
+            });
+            group.run([&]() {
+                bsp29->dmarksurfaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
+                FreeArray(mbsp->dleaffaces);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeMBSP(mbsp);
         
@@ -3238,27 +3298,57 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
             q2bsp->numbrushsides = mbsp->numbrushsides;
         
             // copy or convert data
-            q2bsp->dmodels = MBSPtoQ2_Models(mbsp->dmodels, mbsp->nummodels);
             q2bsp->dvis = MBSPtoQ2_CopyVisData(mbsp->dvisdata, &q2bsp->visdatasize, mbsp->numleafs, mbsp->dleafs);
-            q2bsp->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-            q2bsp->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
-            q2bsp->dleafs = MBSPtoQ2_Leafs(mbsp->dleafs, mbsp->numleafs);
-            q2bsp->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-            q2bsp->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-            q2bsp->dnodes = BSP2toQ2_Nodes(mbsp->dnodes, mbsp->numnodes);
-            q2bsp->texinfo = MBSPtoQ2_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-            q2bsp->dfaces = BSP2toQ2_Faces(mbsp->dfaces, mbsp->numfaces);
-            q2bsp->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
-            q2bsp->dleaffaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-            q2bsp->dleafbrushes = MBSPtoQ2_CopyLeafBrushes(mbsp->dleafbrushes, mbsp->numleafbrushes);
-            q2bsp->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
-        
-            q2bsp->dareas = Q2BSP_CopyAreas(mbsp->dareas, mbsp->numareas);
-            q2bsp->dareaportals = Q2BSP_CopyAreaPortals(mbsp->dareaportals, mbsp->numareaportals);
-        
-            q2bsp->dbrushes = Q2BSP_CopyBrushes(mbsp->dbrushes, mbsp->numbrushes);
-            q2bsp->dbrushsides = MBSPtoQ2_CopyBrushSides(mbsp->dbrushsides, mbsp->numbrushsides);
-        
+            FreeArray(mbsp->dvisdata);
+            q2bsp->dlightdata = MoveArray(mbsp->dlightdata);
+            q2bsp->dentdata = MoveArray(mbsp->dentdata);
+            q2bsp->dplanes = MoveArray(mbsp->dplanes);
+            q2bsp->dvertexes = MoveArray(mbsp->dvertexes);
+            q2bsp->dsurfedges = MoveArray(mbsp->dsurfedges);
+            q2bsp->dareas = MoveArray(mbsp->dareas);
+            q2bsp->dareaportals = MoveArray(mbsp->dareaportals);
+            q2bsp->dbrushes = MoveArray(mbsp->dbrushes);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                q2bsp->dmodels = MBSPtoQ2_Models(mbsp->dmodels, mbsp->nummodels);
+                FreeArray(mbsp->dmodels);
+            });
+            group.run([&]() {
+                q2bsp->dleafs = MBSPtoQ2_Leafs(mbsp->dleafs, mbsp->numleafs);
+                FreeArray(mbsp->dleafs);
+            });
+            group.run([&]() {
+                q2bsp->dnodes = BSP2toQ2_Nodes(mbsp->dnodes, mbsp->numnodes);
+                FreeArray(mbsp->dnodes);
+            });
+            group.run([&]() {
+                q2bsp->texinfo = MBSPtoQ2_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
+                FreeArray(mbsp->texinfo);
+            });
+            group.run([&]() {
+                q2bsp->dfaces = BSP2toQ2_Faces(mbsp->dfaces, mbsp->numfaces);
+                FreeArray(mbsp->dfaces);
+            });
+            group.run([&]() {
+                q2bsp->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
+                FreeArray(mbsp->dedges);
+            });
+            group.run([&]() {
+                q2bsp->dleaffaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
+                FreeArray(mbsp->dleaffaces);
+            });
+            group.run([&]() {
+                q2bsp->dleafbrushes = MBSPtoQ2_CopyLeafBrushes(mbsp->dleafbrushes, mbsp->numleafbrushes);
+                FreeArray(mbsp->dleafbrushes);
+            });
+            group.run([&]() {
+                q2bsp->dbrushsides = MBSPtoQ2_CopyBrushSides(mbsp->dbrushsides, mbsp->numbrushsides);
+                FreeArray(mbsp->dbrushsides);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeMBSP(mbsp);
         
@@ -3295,27 +3385,42 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
             q2bsp->numbrushsides = mbsp->numbrushsides;
         
             // copy or convert data
-            q2bsp->dmodels = MBSPtoQ2_Models(mbsp->dmodels, mbsp->nummodels);
             q2bsp->dvis = MBSPtoQ2_CopyVisData(mbsp->dvisdata, &q2bsp->visdatasize, mbsp->numleafs, mbsp->dleafs);
-            q2bsp->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-            q2bsp->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
-            q2bsp->dleafs = MBSPtoQ2_Qbism_Leafs(mbsp->dleafs, mbsp->numleafs);
-            q2bsp->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-            q2bsp->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-            q2bsp->dnodes = BSP2_CopyNodes(mbsp->dnodes, mbsp->numnodes);
-            q2bsp->texinfo = MBSPtoQ2_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-            q2bsp->dfaces = BSP2toQ2_Qbism_Faces(mbsp->dfaces, mbsp->numfaces);
-            q2bsp->dedges = BSP2_CopyEdges(mbsp->dedges, mbsp->numedges);
-            q2bsp->dleaffaces = BSP2_CopyMarksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-            q2bsp->dleafbrushes = Q2BSP_Qbism_CopyLeafBrushes(mbsp->dleafbrushes, mbsp->numleafbrushes);
-            q2bsp->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
-        
-            q2bsp->dareas = Q2BSP_CopyAreas(mbsp->dareas, mbsp->numareas);
-            q2bsp->dareaportals = Q2BSP_CopyAreaPortals(mbsp->dareaportals, mbsp->numareaportals);
-        
-            q2bsp->dbrushes = Q2BSP_CopyBrushes(mbsp->dbrushes, mbsp->numbrushes);
-            q2bsp->dbrushsides = Q2BSP_Qbism_CopyBrushSides(mbsp->dbrushsides, mbsp->numbrushsides);
-        
+            FreeArray(mbsp->dvisdata);
+            q2bsp->dlightdata = MoveArray(mbsp->dlightdata);
+            q2bsp->dentdata = MoveArray(mbsp->dentdata);
+            q2bsp->dplanes = MoveArray(mbsp->dplanes);
+            q2bsp->dvertexes = MoveArray(mbsp->dvertexes);
+            q2bsp->dnodes = MoveArray(mbsp->dnodes);
+            q2bsp->dedges = MoveArray(mbsp->dedges);
+            q2bsp->dleaffaces = MoveArray(mbsp->dleaffaces);
+            q2bsp->dleafbrushes = MoveArray(mbsp->dleafbrushes);
+            q2bsp->dsurfedges = MoveArray(mbsp->dsurfedges);
+            q2bsp->dareas = MoveArray(mbsp->dareas);
+            q2bsp->dareaportals = MoveArray(mbsp->dareaportals);
+            q2bsp->dbrushes = MoveArray(mbsp->dbrushes);
+            q2bsp->dbrushsides = MoveArray(mbsp->dbrushsides);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                q2bsp->dmodels = MBSPtoQ2_Models(mbsp->dmodels, mbsp->nummodels);
+                FreeArray(mbsp->dmodels);
+            });
+            group.run([&]() {
+                q2bsp->dleafs = MBSPtoQ2_Qbism_Leafs(mbsp->dleafs, mbsp->numleafs);
+                FreeArray(mbsp->dleafs);
+            });
+            group.run([&]() {
+                q2bsp->texinfo = MBSPtoQ2_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
+                FreeArray(mbsp->texinfo);
+            });
+            group.run([&]() {
+                q2bsp->dfaces = BSP2toQ2_Qbism_Faces(mbsp->dfaces, mbsp->numfaces);
+                FreeArray(mbsp->dfaces);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeMBSP(mbsp);
         
@@ -3350,25 +3455,39 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (to_version == &bspver_h2bsp2rmq) {
-                bsp2rmq->dmodels_h2 = H2_CopyModels(mbsp->dmodels, mbsp->nummodels);
+                bsp2rmq->dmodels_h2 = MoveArray(mbsp->dmodels);
             } else {
                 bsp2rmq->dmodels_q = BSPH2toQ1_Models(mbsp->dmodels, mbsp->nummodels);
+                FreeArray(mbsp->dmodels);
             }
-            bsp2rmq->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-            bsp2rmq->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-            bsp2rmq->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-            bsp2rmq->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
-            bsp2rmq->dleafs = MBSPto2rmq_Leafs(mbsp->dleafs, mbsp->numleafs);
-            bsp2rmq->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-            bsp2rmq->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-            bsp2rmq->dnodes = BSP2to2rmq_Nodes(mbsp->dnodes, mbsp->numnodes);
-            bsp2rmq->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-            bsp2rmq->dfaces = BSP2_CopyFaces(mbsp->dfaces, mbsp->numfaces);
-            bsp2rmq->dclipnodes = BSP2_CopyClipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
-            bsp2rmq->dedges = BSP2_CopyEdges(mbsp->dedges, mbsp->numedges);
-            bsp2rmq->dmarksurfaces = BSP2_CopyMarksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-            bsp2rmq->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
-        
+            bsp2rmq->dvisdata = MoveArray(mbsp->dvisdata);
+            bsp2rmq->dlightdata = MoveArray(mbsp->dlightdata);
+            bsp2rmq->dtexdata = MoveArray(mbsp->dtexdata);
+            bsp2rmq->dentdata = MoveArray(mbsp->dentdata);
+            bsp2rmq->dplanes = MoveArray(mbsp->dplanes);
+            bsp2rmq->dvertexes = MoveArray(mbsp->dvertexes);
+            bsp2rmq->dfaces = MoveArray(mbsp->dfaces);
+            bsp2rmq->dclipnodes = MoveArray(mbsp->dclipnodes);
+            bsp2rmq->dedges = MoveArray(mbsp->dedges);
+            bsp2rmq->dmarksurfaces = MoveArray(mbsp->dleaffaces);
+            bsp2rmq->dsurfedges = MoveArray(mbsp->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                bsp2rmq->dleafs = MBSPto2rmq_Leafs(mbsp->dleafs, mbsp->numleafs);
+                FreeArray(mbsp->dleafs);
+            });
+            group.run([&]() {
+                bsp2rmq->dnodes = BSP2to2rmq_Nodes(mbsp->dnodes, mbsp->numnodes);
+                FreeArray(mbsp->dnodes);
+            });
+            group.run([&]() {
+                bsp2rmq->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
+                FreeArray(mbsp->texinfo);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeMBSP(mbsp);
         
@@ -3403,25 +3522,36 @@ ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version)
         
             // copy or convert data
             if (to_version == &bspver_h2bsp2) {
-                bsp2->dmodels_h2 = H2_CopyModels(mbsp->dmodels, mbsp->nummodels);
+                bsp2->dmodels_h2 = MoveArray(mbsp->dmodels);
             } else {
                 bsp2->dmodels_q = BSPH2toQ1_Models(mbsp->dmodels, mbsp->nummodels);
+                FreeArray(mbsp->dmodels);
             }
-            bsp2->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-            bsp2->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-            bsp2->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-            bsp2->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
-            bsp2->dleafs = MBSPto2_Leafs(mbsp->dleafs, mbsp->numleafs);
-            bsp2->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-            bsp2->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-            bsp2->dnodes = BSP2_CopyNodes(mbsp->dnodes, mbsp->numnodes);
-            bsp2->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-            bsp2->dfaces = BSP2_CopyFaces(mbsp->dfaces, mbsp->numfaces);
-            bsp2->dclipnodes = BSP2_CopyClipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
-            bsp2->dedges = BSP2_CopyEdges(mbsp->dedges, mbsp->numedges);
-            bsp2->dmarksurfaces = BSP2_CopyMarksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-            bsp2->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
-        
+            bsp2->dvisdata = MoveArray(mbsp->dvisdata);
+            bsp2->dlightdata = MoveArray(mbsp->dlightdata);
+            bsp2->dtexdata = MoveArray(mbsp->dtexdata);
+            bsp2->dentdata = MoveArray(mbsp->dentdata);
+            bsp2->dplanes = MoveArray(mbsp->dplanes);
+            bsp2->dvertexes = MoveArray(mbsp->dvertexes);
+            bsp2->dnodes = MoveArray(mbsp->dnodes);
+            bsp2->dfaces = MoveArray(mbsp->dfaces);
+            bsp2->dclipnodes = MoveArray(mbsp->dclipnodes);
+            bsp2->dedges = MoveArray(mbsp->dedges);
+            bsp2->dmarksurfaces = MoveArray(mbsp->dleaffaces);
+            bsp2->dsurfedges = MoveArray(mbsp->dsurfedges);
+
+            // the remaining lumps need converting; each task owns its own lump
+            tbb::task_group group;
+            group.run([&]() {
+                bsp2->dleafs = MBSPto2_Leafs(mbsp->dleafs, mbsp->numleafs);
+                FreeArray(mbsp->dleafs);
+            });
+            group.run([&]() {
+                bsp2->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
+                FreeArray(mbsp->texinfo);
+            });
+            group.wait();
+            
             /* Free old data */
             FreeMBSP(mbsp);
         
@@ -3682,6 +3812,17 @@ void BSPX_AddLump(bspdata_t *bspdata, const char *xname, const void *xdata, size
         }
         return;
     }
+
+    //ericw -- make a copy
+    uint8_t *xdata_copy = (uint8_t*) malloc(xsize);
+    memcpy(xdata_copy, xdata, xsize);
+    
+    BSPX_AddLumpOwned(bspdata, xname, xdata_copy, xsize);
+}
+
+void BSPX_AddLumpOwned(bspdata_t *bspdata, const char *xname, void *xdata, size_t xsize)
+{
+    bspxentry_t *e;
     for (e = bspdata->bspxentries; e; e = e->next)
     {
         if (!strcmp(e->lumpname, xname))
@@ -3696,11 +3837,8 @@ void BSPX_AddLump(bspdata_t *bspdata, const char *xname, const void *xdata, size
         bspdata->bspxentries = e;
     }
 
-    //ericw -- make a copy
-    uint8_t *xdata_copy = (uint8_t*) malloc(xsize);
-    memcpy(xdata_copy, xdata, xsize);
-    
-    e->lumpdata = xdata_copy;
+    free(const_cast<uint8_t *>(e->lumpdata));
+    e->lumpdata = static_cast<const uint8_t *>(xdata);
     e->lumpsize = xsize;
 }
 const void *BSPX_GetLump(bspdata_t *bspdata, const char *xname, size_t *xsize)
@@ -3725,6 +3863,97 @@ const void *BSPX_GetLump(bspdata_t *bspdata, const char *xname, size_t *xsize)
     }
 }
 
+static const char BSPX_ZLIB_PREFIX[] = "zlib:";
+static constexpr size_t BSPX_ZLIB_PREFIX_LEN = sizeof(BSPX_ZLIB_PREFIX) - 1;
+
+static bool
+BSPX_IsCompressed(const bspxentry_t *e)
+{
+    return !strncmp(e->lumpname, BSPX_ZLIB_PREFIX, BSPX_ZLIB_PREFIX_LEN);
+}
+
+/*
+ * =============
+ * BSPX_CompressLumps
+ * Lumps that don't shrink, or whose name won't fit with the prefix, are
+ * left as they are.
+ * =============
+ */
+int
+BSPX_CompressLumps(bspdata_t *bspdata)
+{
+#ifdef HAVE_ZLIB
+    int packed = 0;
+
+    for (bspxentry_t *e = bspdata->bspxentries; e; e = e->next) {
+        if (BSPX_IsCompressed(e))
+            continue;
+        if (BSPX_ZLIB_PREFIX_LEN + strnlen(e->lumpname, sizeof(e->lumpname)) >= sizeof(e->lumpname))
+            continue;
+
+        uLongf zsize = compressBound(e->lumpsize);
+        uint8_t *zdata = static_cast<uint8_t *>(malloc(4 + zsize));
+        if (compress2(zdata + 4, &zsize, e->lumpdata, e->lumpsize, Z_BEST_COMPRESSION) != Z_OK
+            || 4 + zsize >= e->lumpsize) {
+            free(zdata);
+            continue;
+        }
+        const uint32_t rawsize = LittleLong(static_cast<uint32_t>(e->lumpsize));
+        memcpy(zdata, &rawsize, 4);
+
+        char name[sizeof(e->lumpname)];
+        snprintf(name, sizeof(name), "%s%s", BSPX_ZLIB_PREFIX, e->lumpname);
+        strcpy(e->lumpname, name);
+        free(const_cast<uint8_t *>(e->lumpdata));
+        e->lumpdata = zdata;
+        e->lumpsize = 4 + zsize;
+        packed++;
+    }
+    return packed;
+#else
+    Error("BSPX lump compression requires a build with zlib");
+    return 0;
+#endif
+}
+
+/*
+ * =============
+ * BSPX_DecompressLumps
+ * =============
+ */
+int
+BSPX_DecompressLumps(bspdata_t *bspdata)
+{
+    int unpacked = 0;
+
+    for (bspxentry_t *e = bspdata->bspxentries; e; e = e->next) {
+        if (!BSPX_IsCompressed(e))
+            continue;
+#ifdef HAVE_ZLIB
+        uint32_t rawsize;
+        if (e->lumpsize < 4)
+            Error("compressed BSPX lump %s is truncated", e->lumpname);
+        memcpy(&rawsize, e->lumpdata, 4);
+        rawsize = LittleLong(rawsize);
+
+        uLongf size = rawsize;
+        uint8_t *data = static_cast<uint8_t *>(malloc(rawsize ? rawsize : 1));
+        if (uncompress(data, &size, e->lumpdata + 4, e->lumpsize - 4) != Z_OK || size != rawsize)
+            Error("compressed BSPX lump %s is corrupt", e->lumpname);
+
+        memmove(e->lumpname, e->lumpname + BSPX_ZLIB_PREFIX_LEN,
+                sizeof(e->lumpname) - BSPX_ZLIB_PREFIX_LEN);
+        free(const_cast<uint8_t *>(e->lumpdata));
+        e->lumpdata = data;
+        e->lumpsize = rawsize;
+        unpacked++;
+#else
+        printf("WARNING: can't decompress BSPX lump %s without zlib support\n", e->lumpname);
+#endif
+    }
+    return unpacked;
+}
+
 /*
  * =============
  * LoadBSPFile
@@ -3741,9 +3970,28 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
     
     logprint("LoadBSPFile: '%s'\n", filename);
     
-    /* load the file header */
-    uint8_t *file_data;
-    uint32_t flen = LoadFilePak(filename, &file_data);
+    /* map the file where we can, so only the lumps we copy get read */
+    uint8_t *file_data = nullptr;
+    uint32_t flen = 0;
+    bool mapped = false;
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            /* private mapping; the header is swapped in place below */
+            void *map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                file_data = static_cast<uint8_t *>(map);
+                flen = st.st_size;
+                mapped = true;
+            }
+        }
+        close(fd);
+    }
+#endif
+    if (!mapped)
+        flen = LoadFilePak(filename, &file_data);
 
     /* transfer the header data to these variables */
     int numlumps;
@@ -3960,7 +4208,7 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
                 uint32_t len = LittleLong(xlump[xlumps].filelen);
                 void *lumpdata = malloc(len);
                 memcpy(lumpdata, (const uint8_t*)header + ofs, len);
-                BSPX_AddLump(bspdata, xlump[xlumps].lumpname, lumpdata, len);
+                BSPX_AddLumpOwned(bspdata, xlump[xlumps].lumpname, lumpdata, len);
             }
         }
         else
@@ -3969,12 +4217,22 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
                 printf("invalid bspx header\n");
         }
     }
+
+    /* engines that don't know the zlib: lumps just skip them; we unpack them here */
+    BSPX_DecompressLumps(bspdata);
     
     /* everything has been copied out */
-    free(file_data);
+#ifndef _WIN32
+    if (mapped)
+        munmap(file_data, flen);
+    else
+#endif
+        free(file_data);
 
-    /* swap everything */
+    /* swap everything; the lumps are already in cpu order on little-endian hosts */
+#ifdef __BIG_ENDIAN__
     SwapBSPFile(bspdata, TO_CPU);
+#endif
 }
 
 /* ========================================================================= */
@@ -3989,8 +4247,23 @@ typedef struct {
     };
     
     FILE *file;
+    uint32_t ofs; /* current write offset, instead of an ftell per lump */
 } bspfile_t;
 
+/* output buffer for WriteBSPFile, so lumps go out in large writes */
+static constexpr size_t BSPFILE_WRITE_BUFFER = 1 << 20;
+
+static void
+WriteBSPData(bspfile_t *bspfile, const void *data, size_t size)
+{
+    static const uint8_t pad[4] = {0};
+
+    SafeWrite(bspfile->file, data, size);
+    if (size % 4)
+        SafeWrite(bspfile->file, pad, 4 - (size % 4));
+    bspfile->ofs += (size + 3) & ~3;
+}
+
 static void
 AddLump(bspfile_t *bspfile, int lumpnum, const void *data, int count)
 {
@@ -4008,20 +4281,18 @@ AddLump(bspfile_t *bspfile, int lumpnum, const void *data, int count)
 
     size = lumpspec->size * count;
 
-    uint8_t pad[4] = {0};
     lump_t *lump = &lumps[lumpnum];
     
-    lump->fileofs = LittleLong(ftell(bspfile->file));
+    lump->fileofs = LittleLong(bspfile->ofs);
     lump->filelen = LittleLong(size);
-    SafeWrite(bspfile->file, data, size);
-    if (size % 4)
-        SafeWrite(bspfile->file, pad, 4 - (size % 4));
+    WriteBSPData(bspfile, data, size);
 }
 
 /*
  * =============
  * WriteBSPFile
- * Swaps the bsp file in place, so it should not be referenced again
+ * The bsp is left usable afterwards; big-endian hosts swap it to disk
+ * order for the write and back again.
  * =============
  */
 void
@@ -4030,7 +4301,9 @@ WriteBSPFile(const char *filename, bspdata_t *bspdata)
     bspfile_t bspfile;
     memset(&bspfile, 0, sizeof(bspfile));
 
+#ifdef __BIG_ENDIAN__
     SwapBSPFile(bspdata, TO_DISK);
+#endif
 
     bspfile.version = bspdata->version;
 
@@ -4044,11 +4317,14 @@ WriteBSPFile(const char *filename, bspdata_t *bspdata)
     logprint("Writing %s as BSP version %s\n", filename, BSPVersionString(bspdata->version));
     bspfile.file = SafeOpenWrite(filename);
 
+    std::vector<char> writebuffer(BSPFILE_WRITE_BUFFER);
+    setvbuf(bspfile.file, writebuffer.data(), _IOFBF, writebuffer.size());
+
     /* Save header space, updated after adding the lumps */
     if (bspfile.version->version != NO_VERSION) {
-    	SafeWrite(bspfile.file, &bspfile.q2header, sizeof(bspfile.q2header));
+        WriteBSPData(&bspfile, &bspfile.q2header, sizeof(bspfile.q2header));
     } else {
-        SafeWrite(bspfile.file, &bspfile.q1header, sizeof(bspfile.q1header));
+        WriteBSPData(&bspfile, &bspfile.q1header, sizeof(bspfile.q1header));
     }
 
     if (bspdata->version == &bspver_q1 ||
@@ -4179,7 +4455,7 @@ WriteBSPFile(const char *filename, bspdata_t *bspdata)
         bspxentry_t *x; 
         bspx_lump_t xlumps[64];
         uint32_t l;
-        uint32_t bspxheader = ftell(bspfile.file);
+        uint32_t bspxheader = bspfile.ofs;
         if (bspxheader & 3)
             Error("BSPX header is misaligned");
         xheader.id[0] = 'B';
@@ -4193,18 +4469,15 @@ WriteBSPFile(const char *filename, bspdata_t *bspdata)
         if (xheader.numlumps > sizeof(xlumps)/sizeof(xlumps[0]))        /*eep*/
             xheader.numlumps = sizeof(xlumps)/sizeof(xlumps[0]);
 
-        SafeWrite(bspfile.file, &xheader, sizeof(xheader));
-        SafeWrite(bspfile.file, xlumps, xheader.numlumps * sizeof(xlumps[0]));
+        WriteBSPData(&bspfile, &xheader, sizeof(xheader));
+        WriteBSPData(&bspfile, xlumps, xheader.numlumps * sizeof(xlumps[0]));
 
         for (x = bspdata->bspxentries, l = 0; x && l < xheader.numlumps; x = x->next, l++)
         {
-            uint8_t pad[4] = {0};
             xlumps[l].filelen = LittleLong(x->lumpsize);
-            xlumps[l].fileofs = LittleLong(ftell(bspfile.file));
+            xlumps[l].fileofs = LittleLong(bspfile.ofs);
             strncpy(xlumps[l].lumpname, x->lumpname, sizeof(xlumps[l].lumpname));
-            SafeWrite(bspfile.file, x->lumpdata, x->lumpsize);
-            if (x->lumpsize % 4)
-                SafeWrite(bspfile.file, pad, 4 - (x->lumpsize % 4));
+            WriteBSPData(&bspfile, x->lumpdata, x->lumpsize);
         }
 
         fseek(bspfile.file, bspxheader, SEEK_SET);
@@ -4222,6 +4495,67 @@ WriteBSPFile(const char *filename, bspdata_t *bspdata)
     }
     
     fclose(bspfile.file);
+
+#ifdef __BIG_ENDIAN__
+    SwapBSPFile(bspdata, TO_CPU);
+#endif
+}
+
+/*
+ * =============
+ * FreeBSPData
+ * Only one of the formats holds data at a time, the others are null.
+ * =============
+ */
+void
+FreeBSPData(bspdata_t *bspdata)
+{
+    bsp29_t *b29 = &bspdata->data.bsp29;
+    FreeArray(b29->dmodels_q); FreeArray(b29->dmodels_h2); FreeArray(b29->dvisdata); FreeArray(b29->dlightdata);
+    FreeArray(b29->dtexdata); FreeArray(b29->dentdata); FreeArray(b29->dleafs); FreeArray(b29->dplanes);
+    FreeArray(b29->dvertexes); FreeArray(b29->dnodes); FreeArray(b29->texinfo); FreeArray(b29->dfaces);
+    FreeArray(b29->dclipnodes); FreeArray(b29->dedges); FreeArray(b29->dmarksurfaces); FreeArray(b29->dsurfedges);
+
+    bsp2rmq_t *b2rmq = &bspdata->data.bsp2rmq;
+    FreeArray(b2rmq->dmodels_q); FreeArray(b2rmq->dmodels_h2); FreeArray(b2rmq->dvisdata); FreeArray(b2rmq->dlightdata);
+    FreeArray(b2rmq->dtexdata); FreeArray(b2rmq->dentdata); FreeArray(b2rmq->dleafs); FreeArray(b2rmq->dplanes);
+    FreeArray(b2rmq->dvertexes); FreeArray(b2rmq->dnodes); FreeArray(b2rmq->texinfo); FreeArray(b2rmq->dfaces);
+    FreeArray(b2rmq->dclipnodes); FreeArray(b2rmq->dedges); FreeArray(b2rmq->dmarksurfaces); FreeArray(b2rmq->dsurfedges);
+
+    bsp2_t *b2 = &bspdata->data.bsp2;
+    FreeArray(b2->dmodels_q); FreeArray(b2->dmodels_h2); FreeArray(b2->dvisdata); FreeArray(b2->dlightdata);
+    FreeArray(b2->dtexdata); FreeArray(b2->dentdata); FreeArray(b2->dleafs); FreeArray(b2->dplanes);
+    FreeArray(b2->dvertexes); FreeArray(b2->dnodes); FreeArray(b2->texinfo); FreeArray(b2->dfaces);
+    FreeArray(b2->dclipnodes); FreeArray(b2->dedges); FreeArray(b2->dmarksurfaces); FreeArray(b2->dsurfedges);
+
+    q2bsp_t *q2 = &bspdata->data.q2bsp;
+    FreeArray(q2->dmodels); FreeArray(q2->dvis); FreeArray(q2->dlightdata); FreeArray(q2->dentdata);
+    FreeArray(q2->dleafs); FreeArray(q2->dplanes); FreeArray(q2->dvertexes); FreeArray(q2->dnodes);
+    FreeArray(q2->texinfo); FreeArray(q2->dfaces); FreeArray(q2->dedges); FreeArray(q2->dleaffaces);
+    FreeArray(q2->dleafbrushes); FreeArray(q2->dsurfedges); FreeArray(q2->dareas); FreeArray(q2->dareaportals);
+    FreeArray(q2->dbrushes); FreeArray(q2->dbrushsides);
+
+    q2bsp_qbism_t *qbism = &bspdata->data.q2bsp_qbism;
+    FreeArray(qbism->dmodels); FreeArray(qbism->dvis); FreeArray(qbism->dlightdata); FreeArray(qbism->dentdata);
+    FreeArray(qbism->dleafs); FreeArray(qbism->dplanes); FreeArray(qbism->dvertexes); FreeArray(qbism->dnodes);
+    FreeArray(qbism->texinfo); FreeArray(qbism->dfaces); FreeArray(qbism->dedges); FreeArray(qbism->dleaffaces);
+    FreeArray(qbism->dleafbrushes); FreeArray(qbism->dsurfedges); FreeArray(qbism->dareas); FreeArray(qbism->dareaportals);
+    FreeArray(qbism->dbrushes); FreeArray(qbism->dbrushsides);
+
+    mbsp_t *m = &bspdata->data.mbsp;
+    FreeArray(m->dmodels); FreeArray(m->dvisdata); FreeArray(m->dlightdata); FreeArray(m->dtexdata);
+    FreeArray(m->drgbatexdata); FreeArray(m->dentdata); FreeArray(m->dleafs); FreeArray(m->dplanes);
+    FreeArray(m->dvertexes); FreeArray(m->dnodes); FreeArray(m->texinfo); FreeArray(m->dfaces);
+    FreeArray(m->dclipnodes); FreeArray(m->dedges); FreeArray(m->dleaffaces); FreeArray(m->dleafbrushes);
+    FreeArray(m->dsurfedges); FreeArray(m->dareas); FreeArray(m->dareaportals); FreeArray(m->dbrushes);
+    FreeArray(m->dbrushsides);
+
+    while (bspdata->bspxentries) {
+        bspxentry_t *e = bspdata->bspxentries;
+        bspdata->bspxentries = e->next;
+        free(const_cast<uint8_t *>(e->lumpdata));
+        free(e);
+    }
 }
 
 /* ========================================================================= */
@@ -4373,6 +4707,29 @@ PrintBSPFileSizes(const bspdata_t *bspdata)
     }
 }
 
+/*
+ * Length of the run of zero bytes at the start of p, up to max. Scans 16
+ * bytes at a time where the target has SSE2.
+ */
+static inline int
+ZeroRunLength(const uint8_t *p, const int max)
+{
+    int n = 0;
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128i zero = _mm_setzero_si128();
+    for (; n + 16 <= max; n += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + n));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            break;
+    }
+#endif
+    while (n < max && !p[n])
+        n++;
+
+    return n;
+}
+
 /*
   ===============
   CompressRow
@@ -4390,14 +4747,9 @@ CompressRow(const uint8_t *vis, const int numbytes, uint8_t *out)
         if (vis[i])
             continue;
 
-        rep = 1;
-        for (i++; i < numbytes; i++)
-            if (vis[i] || rep == 255)
-                break;
-            else
-                rep++;
+        rep = ZeroRunLength(&vis[i], std::min(numbytes - i, 255));
         *dst++ = rep;
-        i--;
+        i += rep - 1;
     }
 
     return dst - out;
@@ -4430,10 +4782,7 @@ DecompressRow (const uint8_t *in, const int numbytes, uint8_t *decompressed)
 		if (!c)
 			Error ("DecompressVis: 0 repeat");
 		in += 2;
-		while (c)
-		{
-			*out++ = 0;
-			c--;
-		}
+		memset(out, 0, c);
+		out += c;
 	} while (out - decompressed < row);
 }
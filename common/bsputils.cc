@@ -314,6 +314,73 @@ bool Light_PointInWorld(const mbsp_t *bsp, const vec3_t point)
     return Light_PointInSolid(bsp, &bsp->dmodels[0], point);
 }
 
+static void Light_PointsInSolid_r(const mbsp_t *bsp, const int nodenum, const std::vector<qvec3f> &points,
+                                  const std::vector<int> &indices, uint8_t *insolid)
+{
+    if (nodenum < 0) {
+        const mleaf_t *leaf = BSP_GetLeafFromNodeNum(bsp, nodenum);
+        
+        bool solid;
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            solid = (leaf->contents & Q2_CONTENTS_SOLID) != 0;
+        } else {
+            solid = (leaf->contents == CONTENTS_SOLID || leaf->contents == CONTENTS_SKY);
+        }
+        
+        if (solid) {
+            for (const int i : indices)
+                insolid[i] = 1;
+        }
+        return;
+    }
+    
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+    const dplane_t *plane = &bsp->dplanes[node->planenum];
+    
+    // points too close to the plane go down both sides, like Light_PointInSolid_r
+    std::vector<int> front, back;
+    for (const int i : indices) {
+        vec3_t point;
+        glm_to_vec3_t(points[i], point);
+        const vec_t dist = Plane_Dist(point, plane);
+        
+        if (!(dist < -0.1))
+            front.push_back(i);
+        if (!(dist > 0.1))
+            back.push_back(i);
+    }
+    
+    if (!front.empty())
+        Light_PointsInSolid_r(bsp, node->children[0], points, front, insolid);
+    if (!back.empty())
+        Light_PointsInSolid_r(bsp, node->children[1], points, back, insolid);
+}
+
+// Tests hull 0 of the given model for points[i] for each i in indices,
+// walking the tree once for all of them
+void Light_PointsInSolid(const mbsp_t *bsp, const dmodel_t *model, const std::vector<qvec3f> &points,
+                         const std::vector<int> &indices, uint8_t *insolid)
+{
+    // fast bounds check
+    std::vector<int> inside;
+    inside.reserve(indices.size());
+    for (const int i : indices) {
+        vec3_t point;
+        glm_to_vec3_t(points[i], point);
+        
+        bool outside = false;
+        for (int j = 0; j < 3; ++j) {
+            if (point[j] < model->mins[j] || point[j] > model->maxs[j])
+                outside = true;
+        }
+        if (!outside)
+            inside.push_back(i);
+    }
+    
+    if (!inside.empty())
+        Light_PointsInSolid_r(bsp, model->headnode[0], points, inside, insolid);
+}
+
 static const bsp2_dface_t *BSP_FindFaceAtPoint_r(const mbsp_t *bsp, const int nodenum, const vec3_t point, const vec3_t wantedNormal)
 {
     if (nodenum < 0) {
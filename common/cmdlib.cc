@@ -29,6 +29,11 @@
 #include <windows.h>
 #endif
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
 #ifdef LINUX
 #include <sys/time.h>
 #include <unistd.h>
@@ -37,7 +42,11 @@
 
 #include <stdint.h>
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 
 #define PATHSEPERATOR '/'
 
@@ -57,19 +66,35 @@ char archivedir[1024];
  * For abnormal program terminations
  * =================
  */
+static thread_local bool error_trapped = false;
+
+error_trap_t::error_trap_t() : previous(error_trapped)
+{
+    error_trapped = true;
+}
+
+error_trap_t::~error_trap_t()
+{
+    error_trapped = previous;
+}
+
 [[noreturn]] void
 Error(const char *error, ...)
 {
     va_list argptr;
+    char message[1024];
+
+    va_start(argptr, error);
+    q_vsnprintf(message, sizeof(message), error, argptr);
+    va_end(argptr);
 
     /* Using lockless prints so we can error out while holding the lock */
     InterruptThreadProgress__();
     logprint_locked__("************ ERROR ************\n");
+    logprint_locked__("%s\n", message);
 
-    va_start(argptr, error);
-    logvprint(error, argptr);
-    va_end(argptr);
-    logprint_locked__("\n");
+    if (error_trapped)
+        throw error_exception_t(message);
     exit(1);
 }
 
@@ -599,6 +624,121 @@ typedef struct {
         unsigned int length;
 } pakfile_t;
 
+/*
+ * Each pak is opened once per process: the archive is mapped (or read in
+ * whole where it can't be) and its directory is hashed by name, so later
+ * lookups don't touch the disk. The mappings live until exit.
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    std::unordered_map<std::string, std::pair<uint32_t, uint32_t>> files;  /* name -> offset, length */
+} pakarchive_t;
+
+static std::mutex pak_lock;
+static std::unordered_map<std::string, std::unique_ptr<pakarchive_t>> pak_cache;
+
+static bool
+Pak_MapFile(const char *pakname, const uint8_t **data, size_t *size)
+{
+#ifdef WIN32
+    HANDLE file = CreateFileA(pakname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER filesize;
+    bool ok = GetFileSizeEx(file, &filesize) != 0;
+    *data = nullptr;
+    *size = ok ? static_cast<size_t>(filesize.QuadPart) : 0;
+    if (ok && *size) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            *data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+        }
+        ok = (*data != nullptr);
+    }
+    CloseHandle(file);
+    return ok;
+#else
+    int fd = open(pakname, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    bool ok = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    *data = nullptr;
+    *size = ok ? static_cast<size_t>(st.st_size) : 0;
+    if (ok && *size) {
+        void *map = mmap(nullptr, *size, PROT_READ, MAP_SHARED, fd, 0);
+        ok = (map != MAP_FAILED);
+        if (ok)
+            *data = static_cast<const uint8_t *>(map);
+    }
+    close(fd);
+    return ok;
+#endif
+}
+
+/* the cached archive, nullptr if pakname can't be opened; a file that isn't a pak has no entries */
+static const pakarchive_t *
+Pak_Open(const char *pakname)
+{
+    std::lock_guard<std::mutex> lock(pak_lock);
+
+    auto it = pak_cache.find(pakname);
+    if (it != pak_cache.end())
+        return it->second.get();
+
+    const uint8_t *data;
+    size_t size;
+    if (!Pak_MapFile(pakname, &data, &size))
+        return nullptr;
+
+    std::unique_ptr<pakarchive_t> pak(new pakarchive_t { data, size, {} });
+    pakheader_t header;
+    if (size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        const size_t tableofs = LittleLong(header.tableofs);
+        size_t numfiles = LittleLong(header.numfiles) / sizeof(pakfile_t);
+
+        if (!strncmp(header.magic, "PACK", 4) && tableofs <= size) {
+            numfiles = qmin(numfiles, (size - tableofs) / sizeof(pakfile_t));
+            pak->files.reserve(numfiles);
+            for (size_t i = 0; i < numfiles; i++) {
+                pakfile_t file;
+                memcpy(&file, data + tableofs + i * sizeof(file), sizeof(file));
+                const uint32_t offset = LittleLong(file.offset);
+                const uint32_t length = LittleLong(file.length);
+                if (offset > size || length > size - offset)
+                    continue;
+                /* the first entry of a name wins, as the old linear scan did */
+                pak->files.emplace(std::string(file.name, strnlen(file.name, sizeof(file.name))),
+                                   std::make_pair(offset, length));
+            }
+        }
+    }
+
+    const pakarchive_t *result = pak.get();
+    pak_cache.emplace(pakname, std::move(pak));
+    return result;
+}
+
+const uint8_t *
+Pak_FileView(const char *pakname, const char *innerfile, int *length)
+{
+    const pakarchive_t *pak = Pak_Open(pakname);
+    if (!pak)
+        return nullptr;
+
+    auto it = pak->files.find(innerfile);
+    if (it == pak->files.end())
+        return nullptr;
+
+    *length = static_cast<int>(it->second.second);
+    return pak->data + it->second.first;
+}
+
 /*
  * ==============
  * LoadFilePak
@@ -627,51 +767,27 @@ LoadFilePak(char *filename, void *destptr)
             if (*e == '/')
             {
                 *e = 0;
-                file = fopen(filename, "rb");
-                if (file)
+                if (Pak_Open(filename))
                 {
-                    uint8_t **bufferptr = static_cast<uint8_t **>(destptr);
-                    pakheader_t header;
-                    unsigned int i;
                     const char *innerfile = e+1;
-                    length = -1;
-                    SafeRead(file, &header, sizeof(header));
-
-                    header.numfiles = LittleLong(header.numfiles) / sizeof(pakfile_t);
-                    header.tableofs = LittleLong(header.tableofs);
-
-                    if (!strncmp(header.magic, "PACK", 4))
-                    {
-                        pakfile_t *files = static_cast<pakfile_t *>(malloc(header.numfiles * sizeof(*files)));
-//                      printf("%s: %u files\n", pakfilename, header.numfiles);
-                        fseek(file, header.tableofs, SEEK_SET);
-                        SafeRead(file, files, header.numfiles * sizeof(*files));
-
-                        for (i = 0; i < header.numfiles; i++)
-                        {
-                                if (!strcmp(files[i].name, innerfile))
-                                {
-                                        fseek(file, files[i].offset, SEEK_SET);
-                                        *bufferptr = static_cast<uint8_t*>(malloc(files[i].length + 1));
-                                        SafeRead(file, *bufferptr, files[i].length);
-                                        length = files[i].length;
-                                        break;
-                                }
-                        }
-                        free(files);
-                    }
-
-                    fclose(file);
-                    if (length < 0)
+                    const uint8_t *view = Pak_FileView(filename, innerfile, &length);
+                    if (!view)
                         Error("Unable to find %s inside %s", innerfile, filename);
 
+                    /* callers own and patch the buffer, so it's still a copy */
+                    *bufferptr = static_cast<uint8_t*>(malloc(length + 1));
+                    if (!*bufferptr)
+                        Error("%s: allocation of %i bytes failed.", __func__, length);
+                    memcpy(*bufferptr, view, length);
+                    (*bufferptr)[length] = 0;
+
                     while(e > filename)
                         if (*--e == '/')
                         {
-                            strcpy(e+1, innerfile);
+                            memmove(e+1, innerfile, strlen(innerfile) + 1);
                             return length;
                         }
-                    strcpy(filename, innerfile);
+                    memmove(filename, innerfile, strlen(innerfile) + 1);
                     return length;
                 }
                 *e = '/';
@@ -803,7 +919,7 @@ StrippedExtension(const std::string& path) {
             return path;             /* no extension */
     }
     if (length)
-        result = result.substr(0, static_cast<size_t>(length - 1));
+        result = result.substr(0, static_cast<size_t>(length));
 
     return result;
 }
@@ -917,10 +1033,6 @@ ParseNum(char *str)
  * ============================================================================
  */
 
-#ifdef _SGI_SOURCE
-#define __BIG_ENDIAN__
-#endif
-
 #ifdef __BIG_ENDIAN__
 
 short
@@ -1125,6 +1237,18 @@ unsigned short CRC_Block (const unsigned char *start, int count)
     return crc;
 }
 
+/* 64-bit FNV-1a */
+void
+FNV_HashBytes(uint64_t *hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+    for (size_t i = 0; i < size; i++) {
+        *hash ^= bytes[i];
+        *hash *= 1099511628211ULL;
+    }
+}
+
 /* ========================================================================= */
 
 /*
@@ -0,0 +1,188 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#include <common/compilecache.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <string.h>
+
+#include <chrono>
+#include <filesystem>
+#include <random>
+
+namespace fs = std::filesystem;
+
+std::string compilecachedir;
+
+/* options that don't change the output, and how many values each takes */
+static const struct {
+    const char *name;
+    int numvalues;
+} neutraloptions[] = {
+    { "-threads", 1 },
+    { "-cachedir", 1 },
+    { "-membudget", 1 },
+    { "-timing", 0 },
+    { "-timingtrace", 0 },
+    { "-profile", 0 },
+    { "-stats", 0 },
+    { "-v", 0 },
+    { "-vv", 0 },
+    { "-verbose", 0 },
+    { "-noverbose", 0 },
+    { "-nopercent", 0 },
+    { "-quiet", 0 },
+};
+
+static std::string
+CompileCache_EntryName(const char *tool, uint64_t key)
+{
+    char name[64];
+    q_snprintf(name, sizeof(name), "%s-%016llx", tool, static_cast<unsigned long long>(key));
+    return (fs::path(compilecachedir) / name).string();
+}
+
+uint64_t
+CompileCache_Begin(const char *tool)
+{
+    uint64_t key = FNV_HASH_INIT;
+    const char *version = stringify(ERICWTOOLS_VERSION);
+    FNV_HashBytes(&key, tool, strlen(tool) + 1);
+    FNV_HashBytes(&key, version, strlen(version) + 1);
+    return key;
+}
+
+void
+CompileCache_HashFile(uint64_t *key, const char *filename)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        FNV_HashBytes(key, "missing", 8);
+        return;
+    }
+
+    uint8_t buffer[65536];
+    uint64_t size = 0;
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        FNV_HashBytes(key, buffer, count);
+        size += count;
+    }
+    fclose(f);
+
+    FNV_HashBytes(key, &size, sizeof(size));
+}
+
+void
+CompileCache_HashArgs(uint64_t *key, const std::vector<std::string> &args)
+{
+    for (size_t i = 0; i < args.size(); i++) {
+        bool neutral = false;
+        for (const auto &option : neutraloptions) {
+            if (!Q_strcasecmp(args[i].c_str(), option.name)) {
+                i += option.numvalues;
+                neutral = true;
+                break;
+            }
+        }
+        if (!neutral)
+            FNV_HashBytes(key, args[i].c_str(), args[i].size() + 1);
+    }
+}
+
+/*
+ * ==================
+ * CompileCache_Restore
+ * ==================
+ */
+bool
+CompileCache_Restore(const char *tool, uint64_t key, const std::string &basename,
+                     const std::vector<std::string> &extensions)
+{
+    const std::string entry = CompileCache_EntryName(tool, key);
+    std::error_code err;
+
+    if (!fs::is_directory(entry, err))
+        return false;
+
+    int numfiles = 0;
+    for (const auto &file : fs::directory_iterator(entry, err)) {
+        const std::string dest = basename + file.path().extension().string();
+        if (!fs::copy_file(file.path(), dest, fs::copy_options::overwrite_existing, err)) {
+            logprint("WARNING: compile cache: can't copy %s to %s (%s), compiling instead\n",
+                     file.path().string().c_str(), dest.c_str(), err.message().c_str());
+            return false;
+        }
+        numfiles++;
+    }
+    if (err || !numfiles)
+        return false;
+
+    /* e.g. a .prt from an older compile, when this one had none */
+    for (const std::string &extension : extensions) {
+        if (!fs::exists(fs::path(entry) / ("out" + extension), err))
+            fs::remove(basename + extension, err);
+    }
+
+    logprint("compile cache: restored %d files from %s\n", numfiles, entry.c_str());
+    return true;
+}
+
+/*
+ * ==================
+ * CompileCache_Store
+ * ==================
+ */
+void
+CompileCache_Store(const char *tool, uint64_t key, const std::string &basename,
+                   const std::vector<std::string> &extensions)
+{
+    const std::string entry = CompileCache_EntryName(tool, key);
+    std::error_code err;
+
+    if (fs::is_directory(entry, err))
+        return;
+
+    /* another machine may be storing the same key */
+    std::random_device random;
+    const std::string tmpentry = entry + ".tmp" + std::to_string(random());
+
+    fs::create_directories(tmpentry, err);
+    for (const std::string &extension : extensions) {
+        const std::string source = basename + extension;
+        if (err || !fs::exists(source))
+            continue;
+        fs::copy_file(source, fs::path(tmpentry) / ("out" + extension), err);
+    }
+    if (!err) {
+        fs::rename(tmpentry, entry, err);
+        if (err && fs::is_directory(entry)) {
+            fs::remove_all(tmpentry, err);
+            return;
+        }
+    }
+
+    if (err) {
+        logprint("WARNING: compile cache: can't store %s (%s)\n", entry.c_str(), err.message().c_str());
+        fs::remove_all(tmpentry, err);
+        return;
+    }
+    logprint("compile cache: stored %s\n", entry.c_str());
+}
@@ -149,7 +149,7 @@ EntData_Parse(const char *entdata)
             entity.set(keystr, valstring);
         }
         
-        result.push_back(entity);
+        result.push_back(std::move(entity));
     }
     
     return result;
@@ -21,9 +21,28 @@
  * common/log.c
  */
 
+/*
+ * Log lines are queued and written by a background thread, so threads
+ * that log (vis -v, light's warnings) don't wait on console and file I/O.
+ * The queue is Vyukov's intrusive MPSC queue: producers only do an atomic
+ * exchange and a store, and the writer thread is the only consumer. The
+ * writer flushes stdout and the log file whenever it runs out of lines.
+ *
+ * Without a log file open (before init_log, after close_log) lines are
+ * written synchronously under a lock of their own.
+ */
+
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include <common/log.hh>
 #include <common/threads.hh>
@@ -36,54 +55,281 @@
 static FILE *logfile;
 static bool log_ok;
 
+#define LOG_FILE    1
+#define LOG_SCREEN  2
+
+struct lognode_t {
+    std::atomic<lognode_t *> next { nullptr };
+    std::string text;
+    int dest = LOG_FILE | LOG_SCREEN;
+};
+
+/* producers push at the head, the writer pops at the tail */
+static lognode_t log_stub;
+static std::atomic<lognode_t *> log_head { &log_stub };
+static lognode_t *log_tail = &log_stub;
+
+/* lines pushed, and lines written and flushed, for log_flush */
+static std::atomic<uint64_t> log_pushed { 0 };
+static std::atomic<uint64_t> log_flushed { 0 };
+
+/* the writer waits on log_wake when there's nothing to write */
+static std::mutex log_wake_lock;
+static std::condition_variable log_wake;
+static std::atomic<bool> log_sleeping { false };
+static std::atomic<bool> log_stop { false };
+/* never destroyed: exit() may run while it's still alive */
+static std::atomic<std::thread *> log_thread { nullptr };
+/* log_line calls that may be pushing to the queue */
+static std::atomic<int> log_producers { 0 };
+
+/* synchronous output, when there's no writer thread */
+static std::mutex log_sync_lock;
+
+static void
+log_write(const char *line, int dest)
+{
+    // print to log file
+    if (log_ok && (dest & LOG_FILE))
+        fputs(line, logfile);
+
+    if (!(dest & LOG_SCREEN))
+        return;
+
+    // print to stdout
+    fputs(line, stdout);
+
+    // print to windows console
+#ifdef _WIN32
+    OutputDebugStringA(line);
+#endif
+}
+
+static void
+log_push(lognode_t *node)
+{
+    lognode_t *prev = log_head.exchange(node);
+    prev->next.store(node, std::memory_order_release);
+    log_pushed++;
+
+    if (log_sleeping.load()) {
+        /* taking the lock orders this against the writer going to sleep */
+        { std::lock_guard<std::mutex> lock(log_wake_lock); }
+        log_wake.notify_one();
+    }
+}
+
+/* writer thread only; null if the queue is empty or a push is half done */
+static lognode_t *
+log_pop(void)
+{
+    lognode_t *tail = log_tail;
+    lognode_t *next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &log_stub) {
+        if (!next)
+            return nullptr;
+        log_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+        log_tail = next;
+        return tail;
+    }
+    if (tail != log_head.load())
+        return nullptr;
+
+    /* tail is the last node; put the stub behind it so it can be popped */
+    log_stub.next.store(nullptr, std::memory_order_relaxed);
+    lognode_t *prev = log_head.exchange(&log_stub);
+    prev->next.store(&log_stub, std::memory_order_release);
+
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+        log_tail = next;
+        return tail;
+    }
+    return nullptr;
+}
+
+static void
+log_thread_main(void)
+{
+    uint64_t written = 0;
+
+    for (;;) {
+        /* log_stop_thread writes what's left, so busy producers can't keep us here */
+        if (log_stop.load())
+            return;
+
+        lognode_t *node = log_pop();
+        if (node) {
+            log_write(node->text.c_str(), node->dest);
+            delete node;
+            written++;
+            continue;
+        }
+
+        if (written != log_pushed.load()) {
+            /* a push is half done */
+            std::this_thread::yield();
+            continue;
+        }
+
+        if (log_ok)
+            fflush(logfile);
+        fflush(stdout);
+        log_flushed.store(written);
+
+        std::unique_lock<std::mutex> lock(log_wake_lock);
+        log_sleeping.store(true);
+        log_wake.wait(lock, [written]() { return log_pushed.load() != written || log_stop.load(); });
+        log_sleeping.store(false);
+    }
+}
+
+static void
+log_stop_thread(void)
+{
+    std::thread *thread = log_thread.load();
+    if (!thread)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(log_wake_lock);
+        log_stop.store(true);
+    }
+    log_wake.notify_one();
+    thread->join();
+    delete thread;
+
+    /*
+     * Lines pushed after the writer's last look are still queued. New lines
+     * wait on the sync lock until those are out, and once the pushes in
+     * flight have finished, the queue can be emptied here.
+     */
+    std::lock_guard<std::mutex> lock(log_sync_lock);
+    log_thread.store(nullptr);
+    while (log_producers.load())
+        std::this_thread::yield();
+
+    lognode_t *node;
+    while ((node = log_pop())) {
+        log_write(node->text.c_str(), node->dest);
+        delete node;
+    }
+    if (log_ok)
+        fflush(logfile);
+    fflush(stdout);
+    log_flushed.store(log_pushed.load());
+    log_stop.store(false);
+}
+
 void
 init_log(const char *filename)
 {
+    static bool registered = false;
+
+    log_stop_thread();
+
+    /* the last session's writer wrote everything pushed; a new writer counts from 0 */
+    log_pushed.store(0);
+    log_flushed.store(0);
+
+    /* so lines logged right before exit(), e.g. by Error, still get out */
+    if (!registered) {
+        atexit(log_stop_thread);
+        registered = true;
+    }
+
+    /* other threads may be writing synchronously */
+    std::lock_guard<std::mutex> lock(log_sync_lock);
     log_ok = false;
     if ((logfile = fopen(filename, "w")))
         log_ok = true;
+    log_thread.store(new std::thread(log_thread_main));
 }
 
 void
 close_log()
 {
+    log_stop_thread();
+
+    std::lock_guard<std::mutex> lock(log_sync_lock);
     if (log_ok)
         fclose(logfile);
+    log_ok = false;
+}
+
+void
+log_flush(void)
+{
+    if (!log_thread.load()) {
+        std::lock_guard<std::mutex> lock(log_sync_lock);
+        fflush(stdout);
+        return;
+    }
+
+    const uint64_t target = log_pushed.load();
+    while (log_flushed.load() < target)
+        std::this_thread::yield();
+}
+
+static thread_local std::string *log_capture;
+
+log_capture_t::log_capture_t(std::string *buffer) : previous(log_capture)
+{
+    log_capture = buffer;
+}
+
+log_capture_t::~log_capture_t()
+{
+    log_capture = previous;
 }
 
 static void
-logvprint_locked__(const char *fmt, va_list args)
+log_line(const char *line, int dest)
 {
-    va_list log_args;
-    char line[1024];
+    if (log_capture && (dest & LOG_SCREEN)) {
+        log_capture->append(line);
+        return;
+    }
 
-    va_copy(log_args, args);
-    q_vsnprintf(line, sizeof(line), fmt, args);
-    va_end(log_args);
+    /* counted before looking, so log_stop_thread can wait for the push */
+    log_producers++;
+    if (log_thread.load()) {
+        lognode_t *node = new lognode_t;
+        node->text = line;
+        node->dest = dest;
+        log_push(node);
+        log_producers--;
+        return;
+    }
+    log_producers--;
 
-    // print to log file
-    if (log_ok) {
-        fprintf(logfile, "%s", line);
+    std::lock_guard<std::mutex> lock(log_sync_lock);
+    log_write(line, dest);
+    if (log_ok && (dest & LOG_FILE))
         fflush(logfile);
-    }
-    
-    // print to stdout
-    printf("%s", line);
-    fflush(stdout);
+    if (dest & LOG_SCREEN)
+        fflush(stdout);
+}
 
-    // print to windows console
-#ifdef _WIN32
-    OutputDebugStringA(line);
-#endif
+static void
+logvprint_locked__(const char *fmt, va_list args)
+{
+    char line[1024];
+
+    q_vsnprintf(line, sizeof(line), fmt, args);
+    log_line(line, LOG_FILE | LOG_SCREEN);
 }
 
 void
 logvprint(const char *fmt, va_list args)
 {
-    ThreadLock();
     InterruptThreadProgress__();
     logvprint_locked__(fmt, args);
-    ThreadUnlock();
 }
 
 void
@@ -99,12 +345,23 @@ logprint_locked__(const char *fmt, ...)
 void logprint_silent(const char *fmt, ...)
 {
     va_list args;
+    char line[1024];
 
-    ThreadLock();
     va_start(args, fmt);
-    vfprintf(logfile, fmt, args);
+    q_vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    log_line(line, LOG_FILE);
+}
+
+void logprint_screen(const char *fmt, ...)
+{
+    va_list args;
+    char line[1024];
+
+    va_start(args, fmt);
+    q_vsnprintf(line, sizeof(line), fmt, args);
     va_end(args);
-    ThreadUnlock();
+    log_line(line, LOG_SCREEN);
 }
 
 void
@@ -112,10 +369,8 @@ logprint(const char *fmt, ...)
 {
     va_list args;
 
-    ThreadLock();
     InterruptThreadProgress__();
     va_start(args, fmt);
     logvprint_locked__(fmt, args);
     va_end(args);
-    ThreadUnlock();
 }
@@ -0,0 +1,106 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#include <common/memstats.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <stdlib.h>
+
+#include <vector>
+
+#ifdef _WIN32
+#define PSAPI_VERSION 2         // GetProcessMemoryInfo from kernel32, no psapi.lib
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+int64_t membudget = 0;
+
+#define MEM_MB (1024.0 * 1024.0)
+
+/* a function, so counters in other files can register during static init */
+static std::vector<const memcounter_t *> &
+Mem_Counters(void)
+{
+    static std::vector<const memcounter_t *> counters;
+    return counters;
+}
+
+memcounter_t::memcounter_t(const char *countername)
+    : name(countername)
+{
+    Mem_Counters().push_back(this);
+}
+
+void
+Mem_SetBudget(const char *megabytes)
+{
+    const int64_t mb = megabytes ? atoll(megabytes) : 0;
+    if (mb <= 0)
+        Error("-membudget needs a size in megabytes");
+
+    membudget = mb * 1024 * 1024;
+}
+
+int64_t
+Mem_PeakRSS(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return static_cast<int64_t>(counters.PeakWorkingSetSize);
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<int64_t>(usage.ru_maxrss);         // bytes
+#else
+    return static_cast<int64_t>(usage.ru_maxrss) * 1024;  // kilobytes
+#endif
+#endif
+}
+
+/*
+  ==============
+  Mem_Report
+  ==============
+*/
+void
+Mem_Report(void)
+{
+    const int64_t peakrss = Mem_PeakRSS();
+
+    if (membudget)
+        logprint("memory: %.1f MB peak resident, budget %.0f MB\n", peakrss / MEM_MB, membudget / MEM_MB);
+    else
+        logprint("memory: %.1f MB peak resident\n", peakrss / MEM_MB);
+
+    for (const memcounter_t *counter : Mem_Counters()) {
+        if (counter->highwater())
+            logprint("  %-28s %8.1f MB peak\n", counter->counterName(), counter->highwater() / MEM_MB);
+    }
+
+    if (membudget && peakrss > membudget)
+        logprint("WARNING: the peak resident size went over -membudget by %.1f MB\n", (peakrss - membudget) / MEM_MB);
+}
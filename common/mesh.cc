@@ -24,10 +24,12 @@
 
 #include <common/mathlib.hh>
 
+#include <algorithm>
 #include <iterator>
-#include <set>
 #include <map>
 
+#include "tbb/parallel_for.h"
+
 using namespace std;
 
 // FIXME: Remove
@@ -97,6 +99,9 @@ mesh_t buildMesh(const vector<vector<qvec3f>> &faces)
 mesh_t buildMeshFromBSP(const mbsp_t *bsp)
 {
     mesh_t res;
+    res.verts.reserve(bsp->numvertexes);
+    res.faces.resize(bsp->numfaces);
+    res.faceplanes.reserve(bsp->numfaces);
     for (int i=0; i<bsp->numvertexes; i++) {
         const dvertex_t *vert = &bsp->dvertexes[i];
         res.verts.emplace_back(vert->point[0],
@@ -108,12 +113,11 @@ mesh_t buildMeshFromBSP(const mbsp_t *bsp)
         const bsp2_dface_t *f = &bsp->dfaces[i];
         
         // grab face verts
-        std::vector<vertnum_t> face;
+        meshface_t &face = res.faces[i];
+        face.resize(f->numedges);
         for (int j=0; j<f->numedges; j++){
-            int vnum = Face_VertexAtIndex(bsp, f, j);
-            face.push_back(vnum);
+            face[j] = Face_VertexAtIndex(bsp, f, j);
         }
-        res.faces.push_back(face);
         
         // grab exact plane
         const qplane3f plane = Face_Plane_E(bsp, f);
@@ -155,6 +159,7 @@ aabb3f mesh_face_bbox(const mesh_t &mesh, facenum_t facenum)
 static octree_t<vertnum_t> build_vert_octree(const mesh_t &mesh)
 {
     std::vector<std::pair<aabb3f, vertnum_t>> vertBboxNumPairs;
+    vertBboxNumPairs.reserve(mesh.verts.size());
 
     for (int i=0; i<mesh.verts.size(); i++) {
         const qvec3f vert = mesh.verts[i];
@@ -190,8 +195,8 @@ void face_InsertVertIfNeeded(mesh_t &mesh, facenum_t fnum, vertnum_t vnum)
     
     // N.B. we will modify the `face` std::vector within this loop
     for (int i=0; i<face.size(); i++) {
-        const qvec3f v0 = mesh.verts.at(i);
-        const qvec3f v1 = mesh.verts.at((i+1)%face.size());
+        const qvec3f v0 = mesh.verts.at(face[i]);
+        const qvec3f v1 = mesh.verts.at(face[(i+1)%face.size()]);
         
         // does `potentialVertPos` lie on the line between `v0` and `v1`?
         float distToLine = DistToLine(qToG(v0), qToG(v1), qToG(potentialVertPos));
@@ -215,15 +220,9 @@ void face_InsertVertIfNeeded(mesh_t &mesh, facenum_t fnum, vertnum_t vnum)
     return;
 }
 
-template<class T>
-static set<T> vecToSet(const vector<T> &vec) {
-    set<T> res;
-    for (const auto &item : vec) {
-        res.insert(item);
-    }
-    return res;
-}
-
+/**
+ * Only changes face `i`, so faces can be cleaned up in parallel.
+ */
 void cleanupFace(mesh_t &mesh,
                  facenum_t i,
                  const octree_t<vertnum_t> &vertoctree) {
@@ -231,12 +230,15 @@ void cleanupFace(mesh_t &mesh,
     aabb3f facebbox = mesh_face_bbox(mesh, i);
     facebbox = facebbox.grow(qvec3f(1,1,1));
     
-    const set<vertnum_t> face_vert_set = vecToSet(mesh.faces.at(i));
-    const vector<vertnum_t> nearbyverts = vertoctree.queryTouchingBBox(facebbox);
+    static thread_local vector<vertnum_t> nearbyverts;
+    nearbyverts.clear();
+    vertoctree.queryTouchingBBox(facebbox, nearbyverts);
     
+    const meshface_t &face = mesh.faces.at(i);
     for (vertnum_t vnum : nearbyverts) {
-        // skip verts that are already on the face
-        if (face_vert_set.find(vnum) != face_vert_set.end()) {
+        // skip verts that are already on the face; faces are short, and
+        // nearbyverts has no repeats, so the ones inserted don't matter
+        if (std::find(face.begin(), face.end(), vnum) != face.end()) {
             continue;
         }
         
@@ -249,7 +251,7 @@ void cleanupMesh(mesh_t &mesh)
 {
     const octree_t<vertnum_t> vertoctree = build_vert_octree(mesh);
     
-    for (int i=0; i<mesh.faces.size(); i++) {
+    tbb::parallel_for(0, static_cast<int>(mesh.faces.size()), [&](int i) {
         cleanupFace(mesh, i, vertoctree);
-    }
+    });
 }
@@ -153,13 +153,12 @@ polylib::WindingBounds (const winding_t *w, vec3_t mins, vec3_t maxs)
  * BaseWindingForPlane
  * =================
  */
-polylib::winding_t *
-polylib::BaseWindingForPlane(const vec3_t normal, const float dist)
+static void
+FillBaseWinding(const vec3_t normal, const float dist, polylib::winding_t *w)
 {
     int i, x;
     vec_t max, v;
     vec3_t org, vright, vup;
-    winding_t *w;
 
     /* find the major axis */
     max = -VECT_MAX;
@@ -197,7 +196,6 @@ polylib::BaseWindingForPlane(const vec3_t normal, const float dist)
     VectorScale(vright, 10e6, vright);
 
     /* project a really big axis aligned box onto the plane */
-    w = AllocWinding(4);
 
     VectorSubtract(org, vright, w->p[0]);
     VectorAdd(w->p[0], vup, w->p[0]);
@@ -212,10 +210,22 @@ polylib::BaseWindingForPlane(const vec3_t normal, const float dist)
     VectorSubtract(w->p[3], vup, w->p[3]);
 
     w->numpoints = 4;
+}
 
+polylib::winding_t *
+polylib::BaseWindingForPlane(const vec3_t normal, const float dist)
+{
+    winding_t *w = AllocWinding(4);
+    FillBaseWinding(normal, dist, w);
     return w;
 }
 
+void
+polylib::BaseWindingForPlaneBuf(const vec3_t normal, const float dist, winding_buf_t *out)
+{
+    FillBaseWinding(normal, dist, out->get());
+}
+
 /*
  * ==================
  * CopyWinding
@@ -240,25 +250,29 @@ polylib::CopyWinding(const winding_t * w)
     return c;
 }
 
+void
+polylib::CopyWindingBuf(const winding_t * w, winding_buf_t * out)
+{
+    if (w->numpoints > MAX_POINTS_ON_WINDING)
+        Error("%s: MAX_POINTS_ON_WINDING", __func__);
+    if (w == out->get())
+        return;
+
+    out->numpoints = w->numpoints;
+    memcpy(out->p, w->p, w->numpoints * sizeof(w->p[0]));
+}
+
 
 /*
- * =============
- * ClipWinding
- * =============
+ * The two halves of ClipWinding. ClassifyWinding finds each point's side;
+ * dists and sides need room for in->numpoints + 1.
  */
-void
-polylib::ClipWinding(const winding_t * in, const vec3_t normal, vec_t dist,
-            winding_t ** front, winding_t ** back)
+static void
+ClassifyWinding(const polylib::winding_t *in, const vec3_t normal, vec_t dist,
+                vec_t *dists, int *sides, int counts[3])
 {
-    vec_t dists[MAX_POINTS_ON_WINDING + 4];
-    int sides[MAX_POINTS_ON_WINDING + 4];
-    int counts[3];
     vec_t dot;
-    int i, j;
-    const vec_t *p1, *p2;
-    vec3_t mid;
-    winding_t *f, *b;
-    int maxpts;
+    int i;
 
     counts[0] = counts[1] = counts[2] = 0;
 
@@ -278,42 +292,45 @@ polylib::ClipWinding(const winding_t * in, const vec3_t normal, vec_t dist,
     }
     sides[i] = sides[0];
     dists[i] = dists[0];
+}
 
-    *front = *back = NULL;
-
-    if (!counts[0]) {
-        *back = CopyWinding(in);
-        return;
-    }
-    if (!counts[1]) {
-        *front = CopyWinding(in);
-        return;
-    }
-
-    maxpts = in->numpoints + 4; /* can't use counts[0]+2 because */
-    /* of fp grouping errors         */
+/*
+ * Splits a winding that has points on both sides into f and b, which are
+ * empty and have room for maxpts points each.
+ */
+static inline void
+AddWindingPoint(polylib::winding_t *w, const vec3_t point, int maxpts)
+{
+    if (w->numpoints == maxpts)
+        Error("SplitWinding: points exceeded estimate");
+    VectorCopy(point, w->p[w->numpoints]);
+    w->numpoints++;
+}
 
-    *front = f = AllocWinding(maxpts);
-    *back = b = AllocWinding(maxpts);
+static void
+SplitWinding(const polylib::winding_t *in, const vec3_t normal, vec_t dist,
+             const vec_t *dists, const int *sides,
+             polylib::winding_t *f, polylib::winding_t *b, int maxpts)
+{
+    vec_t dot;
+    int i, j;
+    const vec_t *p1, *p2;
+    vec3_t mid;
 
     for (i = 0; i < in->numpoints; i++) {
         p1 = in->p[i];
 
         if (sides[i] == SIDE_ON) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
-            VectorCopy(p1, b->p[b->numpoints]);
-            b->numpoints++;
+            AddWindingPoint(f, p1, maxpts);
+            AddWindingPoint(b, p1, maxpts);
             continue;
         }
 
         if (sides[i] == SIDE_FRONT) {
-            VectorCopy(p1, f->p[f->numpoints]);
-            f->numpoints++;
+            AddWindingPoint(f, p1, maxpts);
         }
         if (sides[i] == SIDE_BACK) {
-            VectorCopy(p1, b->p[b->numpoints]);
-            b->numpoints++;
+            AddWindingPoint(b, p1, maxpts);
         }
 
         if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
@@ -332,19 +349,95 @@ polylib::ClipWinding(const winding_t * in, const vec3_t normal, vec_t dist,
                 mid[j] = p1[j] + dot * (p2[j] - p1[j]);
         }
 
-        VectorCopy(mid, f->p[f->numpoints]);
-        f->numpoints++;
-        VectorCopy(mid, b->p[b->numpoints]);
-        b->numpoints++;
+        AddWindingPoint(f, mid, maxpts);
+        AddWindingPoint(b, mid, maxpts);
     }
 
-    if (f->numpoints > maxpts || b->numpoints > maxpts)
-        Error("%s: points exceeded estimate", __func__);
     if (f->numpoints > MAX_POINTS_ON_WINDING
         || b->numpoints > MAX_POINTS_ON_WINDING)
         Error("%s: MAX_POINTS_ON_WINDING", __func__);
 }
 
+/*
+ * =============
+ * ClipWinding
+ * =============
+ */
+void
+polylib::ClipWinding(const winding_t * in, const vec3_t normal, vec_t dist,
+            winding_t ** front, winding_t ** back)
+{
+    vec_t dists[MAX_POINTS_ON_WINDING + 4];
+    int sides[MAX_POINTS_ON_WINDING + 4];
+    int counts[3];
+    int maxpts;
+
+    ClassifyWinding(in, normal, dist, dists, sides, counts);
+
+    *front = *back = NULL;
+
+    if (!counts[0]) {
+        *back = CopyWinding(in);
+        return;
+    }
+    if (!counts[1]) {
+        *front = CopyWinding(in);
+        return;
+    }
+
+    maxpts = in->numpoints + 4; /* can't use counts[0]+2 because */
+    /* of fp grouping errors         */
+
+    *front = AllocWinding(maxpts);
+    *back = AllocWinding(maxpts);
+
+    SplitWinding(in, normal, dist, dists, sides, *front, *back, maxpts);
+}
+
+/*
+ * =============
+ * ClipWindingBuf
+ *
+ * ClipWinding into caller-provided buffers. A side with nothing on it
+ * gets numpoints 0; either buffer may be NULL to discard that side. in
+ * may be one of the buffers.
+ * =============
+ */
+void
+polylib::ClipWindingBuf(const winding_t * in, const vec3_t normal, vec_t dist,
+                        winding_buf_t * front, winding_buf_t * back)
+{
+    vec_t dists[MAX_POINTS_ON_WINDING + 4];
+    int sides[MAX_POINTS_ON_WINDING + 4];
+    int counts[3];
+    winding_buf_t temp[2];
+
+    if (in->numpoints > MAX_POINTS_ON_WINDING)
+        Error("%s: MAX_POINTS_ON_WINDING", __func__);
+
+    ClassifyWinding(in, normal, dist, dists, sides, counts);
+
+    if (!counts[0] || !counts[1]) {
+        winding_buf_t *all = counts[0] ? front : back;
+        winding_buf_t *none = counts[0] ? back : front;
+        if (all)
+            CopyWindingBuf(in, all);
+        if (none)
+            none->numpoints = 0;
+        return;
+    }
+
+    /* split into a temporary for a discarded side, or the one in is in */
+    winding_buf_t *f = (front && front->get() != in) ? front : &temp[0];
+    winding_buf_t *b = (back && back->get() != in) ? back : &temp[1];
+    f->numpoints = b->numpoints = 0;
+    SplitWinding(in, normal, dist, dists, sides, f->get(), b->get(), MAX_POINTS_ON_WINDING);
+
+    if (front && f != front)
+        CopyWindingBuf(f->get(), front);
+    if (back && b != back)
+        CopyWindingBuf(b->get(), back);
+}
 
 /*
  * =================
@@ -475,21 +568,74 @@ void	polylib::DiceWinding (winding_t *w, vec_t subdiv, save_winding_fn_t save_fn
     DiceWinding(o2, subdiv, save_fn, userinfo);
 }
 
+/*
+ =============
+ DiceWindingBuf
+
+ DiceWinding without the allocations or the recursion: the chunks are
+ appended to out, in the order DiceWinding passes them to save_fn. w
+ isn't freed. Keep out between calls and it stops allocating too.
+ =============
+ */
+void polylib::DiceWindingBuf (const winding_t *w, vec_t subdiv, std::vector<winding_buf_t> *out)
+{
+    /* the pieces still to look at, the next one on top */
+    static thread_local std::vector<winding_buf_t> stack;
+    vec3_t	mins, maxs;
+    vec3_t	split;
+    vec_t	dist;
+    int		i;
+
+    stack.resize(1);
+    CopyWindingBuf(w, &stack[0]);
+
+    while (!stack.empty()) {
+        winding_buf_t &top = stack.back();
+        if (!top.numpoints) {
+            stack.pop_back();
+            continue;
+        }
+
+        WindingBounds (top.get(), mins, maxs);
+        for (i=0 ; i<3 ; i++)
+            if (floor((mins[i]+1)/subdiv) < floor((maxs[i]-1)/subdiv))
+                break;
+        if (i == 3)
+        {
+            // no splitting needed
+            out->push_back(top);
+            stack.pop_back();
+            continue;
+        }
+
+        //
+        // split the winding, the front piece goes on top to be diced first
+        //
+        VectorCopy (vec3_origin, split);
+        split[i] = 1;
+        dist = subdiv*(1+floor((mins[i]+1)/subdiv));
+
+        stack.emplace_back();
+        winding_buf_t &back = stack[stack.size() - 2];
+        winding_buf_t &front = stack.back();
+        ClipWindingBuf (back.get(), split, dist, &front, &back);
+    }
+}
+
 /*
  =============
  WindingFromFace
  From q2 tools
  =============
  */
-polylib::winding_t *polylib::WindingFromFace (const mbsp_t *bsp, const bsp2_dface_t *f)
+static void
+FillWindingFromFace (const mbsp_t *bsp, const bsp2_dface_t *f, polylib::winding_t *w)
 {
     int			i;
     int			se;
     dvertex_t	*dv;
     int			v;
-    winding_t	*w;
     
-    w = AllocWinding (f->numedges);
     w->numpoints = f->numedges;
     
     for (i=0 ; i<f->numedges ; i++)
@@ -506,11 +652,24 @@ polylib::winding_t *polylib::WindingFromFace (const mbsp_t *bsp, const bsp2_dfac
         }
     }
     
-    RemoveColinearPoints (w);
-    
+    polylib::RemoveColinearPoints (w);
+}
+
+polylib::winding_t *polylib::WindingFromFace (const mbsp_t *bsp, const bsp2_dface_t *f)
+{
+    winding_t *w = AllocWinding (f->numedges);
+    FillWindingFromFace (bsp, f, w);
     return w;
 }
 
+void polylib::WindingFromFaceBuf (const mbsp_t *bsp, const bsp2_dface_t *f, winding_buf_t *out)
+{
+    if (f->numedges > MAX_POINTS_ON_WINDING)
+        Error("%s: face %d has %d edges, more than MAX_POINTS_ON_WINDING", __func__,
+              static_cast<int>(f - bsp->dfaces), f->numedges);
+    FillWindingFromFace (bsp, f, out->get());
+}
+
 polylib::winding_edges_t *
 polylib::AllocWindingEdges(const winding_t *w)
 {
@@ -147,3 +147,29 @@ std::string qv::to_string(const qvec<3,float> &v1)
     ss << v1[0] << " " << v1[1] << " " << v1[2];
     return ss.str();
 }
+
+void qv::transformPoints(const qmat4x4f &m, const qvec3f *in, qvec3f *out, size_t count)
+{
+#ifdef QVEC_SIMD_LOAD
+    const qvec4f_simd_t col0 = QVEC_SIMD_LOAD(&m.m_values[0]);
+    const qvec4f_simd_t col1 = QVEC_SIMD_LOAD(&m.m_values[4]);
+    const qvec4f_simd_t col2 = QVEC_SIMD_LOAD(&m.m_values[8]);
+    const qvec4f_simd_t col3 = QVEC_SIMD_LOAD(&m.m_values[12]);
+
+    for (size_t i = 0; i < count; i++) {
+        // the same sums as m * qvec4f(in[i], 1)
+        qvec4f_simd_t res = QVEC_SIMD_ZERO();
+        res = QVEC_SIMD_ADD(res, QVEC_SIMD_MUL(col0, QVEC_SIMD_SPLAT(in[i][0])));
+        res = QVEC_SIMD_ADD(res, QVEC_SIMD_MUL(col1, QVEC_SIMD_SPLAT(in[i][1])));
+        res = QVEC_SIMD_ADD(res, QVEC_SIMD_MUL(col2, QVEC_SIMD_SPLAT(in[i][2])));
+        res = QVEC_SIMD_ADD(res, col3);
+
+        float point[4];
+        QVEC_SIMD_STORE(point, res);
+        out[i] = qvec3f(point[0], point[1], point[2]);
+    }
+#else
+    for (size_t i = 0; i < count; i++)
+        out[i] = (m * qvec4f(in[i], 1.0f)).xyz();
+#endif
+}
@@ -1,26 +1,80 @@
 /* common/threads.c */
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <common/cmdlib.hh>
 #include <common/log.hh>
 #include <common/threads.hh>
 
-/*
- * FIXME - Temporary hack while trying to get qbsp to use the common
- *         thread/logging code.  Error() would normally be defined in
- *         either common/cmdlib.h or qbsp/qbsp.h.
- */
-[[noreturn]] void Error(const char *error, ...)
-    __attribute__((format(printf,1,2),noreturn));
+#include "tbb/global_control.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+#include "tbb/task_scheduler_observer.h"
 
 /* Make the locks no-ops if we aren't running threads */
 static bool threads_active = false;
+static std::mutex crit;
 
-static int dispatch;
+/*
+ * Work items are handed out with an atomic counter, so threads only
+ * contend on a lock when there is a progress dot to print. The progress
+ * dots have a lock of their own, separate from ThreadLock, and the log
+ * doesn't lock at all (see log.cc).
+ */
+static std::atomic<int> dispatch;
 static int workcount;
-static int oldpercent = -1;
+static std::atomic<int> oldpercent { -1 };
+static std::mutex progress_lock;
+
+/*
+ * Hands out the next chunk of work items, [return value, *chunkend).
+ * grainsize > 0 gives fixed size chunks; otherwise chunks are a share
+ * of the remaining work, shrinking towards one item as the run ends.
+ */
+static int
+DispatchChunk(int grainsize, int *chunkend)
+{
+    int chunk = grainsize;
+
+    if (chunk <= 0) {
+        const int remaining = workcount - dispatch.load(std::memory_order_relaxed);
+        chunk = std::max(1, remaining / (2 * numthreads));
+    }
+
+    const int ret = dispatch.fetch_add(chunk, std::memory_order_relaxed);
+
+    if (ret >= workcount)
+        return -1;
+
+    *chunkend = std::min(ret + chunk, workcount);
+    return ret;
+}
+
+static void
+UpdateThreadProgress(int done)
+{
+    const int percent = 50 * done / workcount;
+
+    if (oldpercent.load(std::memory_order_relaxed) < percent) {
+        std::lock_guard<std::mutex> lock(progress_lock);
+        while (oldpercent.load(std::memory_order_relaxed) < percent) {
+            const int p = ++oldpercent;
+            logprint_locked__("%c", (p % 5) ? '.' : '0' + (p / 5));
+        }
+    }
+}
 
 /*
  * =============
@@ -30,20 +84,13 @@ static int oldpercent = -1;
 int
 GetThreadWork_Locked__(void)
 {
-    int ret;
-    int percent;
+    int end;
+    const int ret = DispatchChunk(1, &end);
 
-    if (dispatch == workcount)
+    if (ret == -1)
         return -1;
 
-    percent = 50 * dispatch / workcount;
-    while (oldpercent < percent) {
-        oldpercent++;
-        logprint_locked__("%c", (oldpercent % 5) ? '.' : '0' + (oldpercent / 5));
-    }
-
-    ret = dispatch;
-    dispatch++;
+    UpdateThreadProgress(ret);
 
     return ret;
 }
@@ -51,11 +98,13 @@ GetThreadWork_Locked__(void)
 int
 GetThreadWork(void)
 {
-    int ret;
+    int end;
+    const int ret = DispatchChunk(1, &end);
 
-    ThreadLock();
-    ret = GetThreadWork_Locked__();
-    ThreadUnlock();
+    if (ret == -1)
+        return -1;
+
+    UpdateThreadProgress(ret);
 
     return ret;
 }
@@ -63,118 +112,285 @@ GetThreadWork(void)
 void
 InterruptThreadProgress__(void)
 {
+    if (oldpercent.load(std::memory_order_relaxed) == -1)
+        return;
+
+    std::lock_guard<std::mutex> lock(progress_lock);
     if (oldpercent != -1) {
         logprint_locked__("\\\n");
         oldpercent = -1;
     }
 }
 
+void
+ThreadLock(void)
+{
+    if (threads_active)
+        crit.lock();
+}
+
+void
+ThreadUnlock(void)
+{
+    if (threads_active)
+        crit.unlock();
+}
+
 /*
- * ===================================================================
- *                              WIN32
- * ===================================================================
+ * The worker pool lives from the first RunThreadsOn call (or
+ * InitThreadPool) until ShutdownThreadPool, so the worker threads are
+ * created once and reused by every compile stage.
  */
-#ifdef USE_WIN32THREADS
-#define HAVE_THREADS
+static std::unique_ptr<tbb::global_control> pool_parallelism;
+static std::unique_ptr<tbb::task_arena> pool_arena;
+static int pool_threads;
 
-#include <windows.h>
+/*
+ * =============
+ * InitThreadPool
+ *
+ * (Re)creates the pool if it doesn't exist yet or numthreads has changed
+ * since it was created.
+ * =============
+ */
+void
+InitThreadPool(void)
+{
+    if (pool_arena && pool_threads == numthreads)
+        return;
 
-int numthreads = 1;
-CRITICAL_SECTION crit;
+    ShutdownThreadPool();
+
+    /* allow more workers than TBB's default of one per core if asked for */
+    pool_parallelism = std::make_unique<tbb::global_control>(
+        tbb::global_control::max_allowed_parallelism, numthreads);
+    pool_arena = std::make_unique<tbb::task_arena>(numthreads);
+    pool_arena->initialize();
+    pool_threads = numthreads;
+}
 
 void
-LowerProcessPriority(void)
+ShutdownThreadPool(void)
 {
-    SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
+    if (pool_arena) {
+        pool_arena->terminate();
+        pool_arena.reset();
+    }
+    pool_parallelism.reset();
+    pool_threads = 0;
 }
 
-int
-GetDefaultThreads(void)
+/*
+ * =============
+ * RunWorkers
+ *
+ * Runs numthreads copies of worker on the pool's task arena, passing each
+ * its thread index. TBB's scheduler keeps a task deque per worker and
+ * idle workers steal from the others, so work spawned from inside with
+ * tbb::parallel_for / tbb::task_group is balanced across the same set
+ * of threads.
+ * =============
+ */
+static void
+RunWorkers(int start, int workcnt, const std::function<void(int)> &worker)
 {
-    SYSTEM_INFO info;
+    InitThreadPool();
 
-    GetSystemInfo(&info);
+    dispatch = start;
+    workcount = workcnt;
+    oldpercent = -1;
 
-    return info.dwNumberOfProcessors;
+    threads_active = true;
+
+    pool_arena->execute([&]() {
+        tbb::task_group group;
+        for (int i = 0; i < numthreads; i++)
+            group.run([&worker, i]() { worker(i); });
+        group.wait();
+    });
+
+    threads_active = false;
+    oldpercent = -1;
+
+    logprint("\n");
 }
 
+/*
+ * =============
+ * RunThreadsOn
+ * =============
+ */
 void
-ThreadLock(void)
+RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
 {
-    if (threads_active)
-        EnterCriticalSection(&crit);
+    RunWorkers(start, workcnt, [&](int thread) { func(arg); });
 }
 
 void
-ThreadUnlock(void)
+RunThreadsOn(int start, int workcnt, int grainsize, const std::function<void(int, int)> &func)
 {
-    if (threads_active)
-        LeaveCriticalSection(&crit);
+    RunWorkers(start, workcnt, [&](int thread) {
+        int i, end;
+        while ((i = DispatchChunk(grainsize, &end)) != -1) {
+            UpdateThreadProgress(i);
+            for (; i < end; i++)
+                func(i, thread);
+        }
+    });
 }
 
-using functype = void *(*)(void *);
+/*
+ * Thread placement. The platform sections below provide these; each
+ * Error()s if it can't.
+ */
+static std::vector<int> AllowedCPUs(void);          /* the CPUs this process may run on */
+static std::vector<int> NumaNodeCPUs(int node);     /* empty if there's no such node */
+static void RestrictProcessTo(const std::vector<int> &cpus);
+static void PinCurrentThread(int cpu);
 
-struct threadInfo {
-    functype func;
-    void *arg;
+/*
+ * Pins each thread the first time it runs TBB work: the pool's workers
+ * when the arena starts them, the main thread when it joins. Observing
+ * every arena also covers tools that use TBB's implicit one, like qbsp.
+ */
+class pinning_observer_t : public tbb::task_scheduler_observer {
+    std::vector<int> cpus;
+    std::atomic<int> nextcpu { 0 };
+public:
+    explicit pinning_observer_t(std::vector<int> allowed) : cpus(std::move(allowed)) {
+        observe(true);
+    }
+    ~pinning_observer_t() {
+        observe(false);
+    }
+    void on_scheduler_entry(bool worker) override {
+        static thread_local bool pinned = false;
+        if (pinned)
+            return;
+        pinned = true;
+        PinCurrentThread(cpus[nextcpu.fetch_add(1) % cpus.size()]);
+    }
 };
 
-// necessary for calling convention reasons
-DWORD WINAPI ThreadWrapper(LPVOID lpParam) {
-    threadInfo* info = (threadInfo*)lpParam;
-    info->func(info->arg);
-    return 0;
+static std::unique_ptr<pinning_observer_t> pinning_observer;
+
+void
+BindToNumaNode(int node)
+{
+    const std::vector<int> cpus = NumaNodeCPUs(node);
+    if (cpus.empty())
+        Error("-numanode %d: there's no such NUMA node", node);
+
+    RestrictProcessTo(cpus);
+
+    /* the tool's default is every CPU, not just this node's */
+    if (numthreads == GetDefaultThreads())
+        numthreads = static_cast<int>(cpus.size());
+
+    logprint("bound to NUMA node %d, %d CPUs\n", node, static_cast<int>(cpus.size()));
+}
+
+void
+PinThreads(void)
+{
+    if (pinning_observer)
+        return;
+
+    /* after BindToNumaNode, if it was called, so these are the node's */
+    std::vector<int> cpus = AllowedCPUs();
+    if (cpus.empty())
+        Error("-pinthreads: can't find which CPUs this process may use");
+
+    pinning_observer = std::make_unique<pinning_observer_t>(std::move(cpus));
+}
+
+bool
+ThreadsPinned(void)
+{
+    return pinning_observer != nullptr;
 }
 
 /*
- * =============
- * RunThreadsOn
- * =============
+ * ===================================================================
+ *                              WIN32
+ * ===================================================================
  */
+#ifdef USE_WIN32THREADS
+#define HAVE_THREADS
+
+#include <windows.h>
+
+int numthreads = 1;
+
 void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+LowerProcessPriority(void)
 {
-    uintptr_t i; /* avoid warning due to cast for the CreateThread API */
-    DWORD *threadid;
-    HANDLE *threadhandle;
-
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
+    SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
+}
 
-    threadid = static_cast<DWORD *>(malloc(sizeof(*threadid) * numthreads));
-    threadhandle = static_cast<HANDLE *>(malloc(sizeof(*threadhandle) * numthreads));
+int
+GetDefaultThreads(void)
+{
+    SYSTEM_INFO info;
 
-    if (!threadid || !threadhandle)
-        Error("Failed to allocate memory for threads");
+    GetSystemInfo(&info);
 
-    threadInfo info;
-    info.func = func;
-    info.arg = arg;
+    return info.dwNumberOfProcessors;
+}
 
-    /* run threads in parallel */
-    InitializeCriticalSection(&crit);
-    threads_active = true;
-    for (i = 0; i < numthreads; i++) {
-        threadhandle[i] = CreateThread(NULL,
-                                       0,
-                                       ThreadWrapper,
-                                       (LPVOID)&info,
-                                       0,
-                                       &threadid[i]);
+static std::vector<int>
+AllowedCPUs(void)
+{
+    DWORD_PTR processmask, systemmask;
+    std::vector<int> cpus;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processmask, &systemmask))
+        return cpus;
+    for (int i = 0; i < static_cast<int>(sizeof(processmask) * 8); i++) {
+        if (processmask & (static_cast<DWORD_PTR>(1) << i))
+            cpus.push_back(i);
     }
+    return cpus;
+}
 
-    for (i = 0; i < numthreads; i++)
-        WaitForSingleObject(threadhandle[i], INFINITE);
-
-    threads_active = false;
-    oldpercent = -1;
-    DeleteCriticalSection(&crit);
+static std::vector<int>
+NumaNodeCPUs(int node)
+{
+    GROUP_AFFINITY affinity;
+    ULONG highest;
+    std::vector<int> cpus;
+
+    if (node < 0 || !GetNumaHighestNodeNumber(&highest) || static_cast<ULONG>(node) > highest)
+        return cpus;
+    if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity))
+        return cpus;
+    /* the affinity masks below only reach the first processor group */
+    if (affinity.Group != 0)
+        Error("-numanode %d: the node is in processor group %d, only group 0 is supported",
+              node, affinity.Group);
+
+    for (int i = 0; i < static_cast<int>(sizeof(affinity.Mask) * 8); i++) {
+        if (affinity.Mask & (static_cast<KAFFINITY>(1) << i))
+            cpus.push_back(i);
+    }
+    return cpus;
+}
 
-    logprint("\n");
+static void
+RestrictProcessTo(const std::vector<int> &cpus)
+{
+    DWORD_PTR mask = 0;
+    for (const int cpu : cpus)
+        mask |= static_cast<DWORD_PTR>(1) << cpu;
+    if (!SetProcessAffinityMask(GetCurrentProcess(), mask))
+        Error("can't set the process affinity (error %lu)", GetLastError());
+}
 
-    free(threadhandle);
-    free(threadid);
+static void
+PinCurrentThread(int cpu)
+{
+    if (!SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu))
+        Error("can't pin a thread to CPU %d (error %lu)", cpu, GetLastError());
 }
 
 #endif /* USE_WIN32THREADS */
@@ -188,11 +404,13 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
 #ifdef USE_PTHREADS
 #define HAVE_THREADS
 
-#include <pthread.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 int numthreads = 1;
-pthread_mutex_t *my_mutex;
 
 void
 LowerProcessPriority(void)
@@ -216,84 +434,83 @@ GetDefaultThreads(void)
     return threads;
 }
 
-void
-ThreadLock(void)
+#ifdef __linux__
+static std::vector<int>
+AllowedCPUs(void)
 {
-    if (threads_active)
-        pthread_mutex_lock(my_mutex);
+    cpu_set_t set;
+    std::vector<int> cpus;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set))
+            cpus.push_back(i);
+    }
+    return cpus;
 }
 
-void
-ThreadUnlock(void)
+/* from sysfs, a list like "0-7,16-23" */
+static std::vector<int>
+NumaNodeCPUs(int node)
 {
-    if (threads_active)
-        pthread_mutex_unlock(my_mutex);
+    char path[256];
+    std::vector<int> cpus;
+
+    if (node < 0)
+        return cpus;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return cpus;
+
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (int i = first; i <= last && i < CPU_SETSIZE; i++)
+            cpus.push_back(i);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return cpus;
 }
 
-
-/*
- * =============
- * RunThreadsOn
- * =============
- */
-void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+static void
+RestrictProcessTo(const std::vector<int> &cpus)
 {
-    pthread_t *threads;
-    pthread_mutexattr_t mattrib;
-    pthread_attr_t attrib;
-    int status;
-    int i;
-
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
-
-    status = pthread_mutexattr_init(&mattrib);
-    if (status)
-        Error("pthread_mutexattr_init failed");
-
-    my_mutex = static_cast<pthread_mutex_t *>(malloc(sizeof(*my_mutex)));
-    if (!my_mutex)
-        Error("failed to allocate memory for thread mutex");
-    status = pthread_mutex_init(my_mutex, &mattrib);
-    if (status)
-        Error("pthread_mutex_init failed");
-
-    status = pthread_attr_init(&attrib);
-    if (status)
-        Error("pthread_attr_init failed");
-
-    threads = static_cast<pthread_t *>(malloc(sizeof(*threads) * numthreads));
-    if (!threads)
-        Error("failed to allocate memory for threads");
-
-    threads_active = true;
-
-    for (i = 0; i < numthreads; i++) {
-        status = pthread_create(&threads[i], &attrib, func, arg);
-        if (status)
-            Error("pthread_create failed");
-    }
-
-    for (i = 0; i < numthreads; i++) {
-        status = pthread_join(threads[i], NULL);
-        if (status)
-            Error("pthread_join failed");
-    }
-
-    threads_active = false;
-    oldpercent = -1;
-
-    status = pthread_mutex_destroy(my_mutex);
-    if (status)
-        Error("pthread_mutex_destroy failed");
-
-    free(threads);
-    free(my_mutex);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus)
+        CPU_SET(cpu, &set);
+    /* threads made from now on inherit it; the tools haven't started any yet */
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        Error("can't set the process affinity (%s)", strerror(errno));
+}
 
-    logprint("\n");
+static void
+PinCurrentThread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    const int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+        Error("can't pin a thread to CPU %d (%s)", cpu, strerror(err));
 }
+#else
+/* macOS has no thread affinity, only hints */
+static std::vector<int> AllowedCPUs(void) { return {}; }
+static std::vector<int> NumaNodeCPUs(int node) { Error("-numanode isn't supported on this platform"); }
+static void RestrictProcessTo(const std::vector<int> &cpus) {}
+static void PinCurrentThread(int cpu) {}
+#endif
 
 #endif /* USE_PTHREADS */
 
@@ -307,24 +524,12 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
 
 int numthreads = 1;
 
-void ThreadLock(void) {}
-void ThreadUnlock(void) {}
+void LowerProcessPriority(void) {}
+int GetDefaultThreads(void) { return 1; }
 
-/*
- * =============
- * RunThreadsOn
- * =============
- */
-void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
-{
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
-
-    func(arg);
-
-    logprint("\n");
-}
+static std::vector<int> AllowedCPUs(void) { return {}; }
+static std::vector<int> NumaNodeCPUs(int node) { Error("-numanode needs a build with threads"); }
+static void RestrictProcessTo(const std::vector<int> &cpus) {}
+static void PinCurrentThread(int cpu) {}
 
 #endif
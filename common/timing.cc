@@ -0,0 +1,286 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+/*
+ * Each thread records into its own timingthread_t, found through a
+ * thread_local pointer, and the threads' records are only merged by
+ * Timing_Finish, once the work is done.
+ */
+
+#include <common/timing.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+using nlohmann::json;
+
+bool timingenabled = false;
+bool timingtrace = false;
+
+typedef struct {
+    const char *name;
+    int item;
+    int depth;
+    double start, end;
+} timingevent_t;
+
+typedef struct {
+    const char *name;
+    int64_t count;
+} timingcounter_t;
+
+typedef struct {
+    int depth;
+    std::vector<timingevent_t> events;
+    std::vector<timingcounter_t> counters;
+} timingthread_t;
+
+static std::mutex timing_lock;
+static std::vector<std::unique_ptr<timingthread_t>> timing_threads;
+static thread_local timingthread_t *timing_thread = nullptr;
+static const char *timing_tool = "";
+static double timing_starttime;
+
+double
+Timing_Now(void)
+{
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double>(now).count();
+}
+
+static timingthread_t *
+Timing_Thread(void)
+{
+    if (!timing_thread) {
+        std::lock_guard<std::mutex> lock(timing_lock);
+        timing_threads.push_back(std::make_unique<timingthread_t>());
+        timing_thread = timing_threads.back().get();
+    }
+    return timing_thread;
+}
+
+/*
+  ==============
+  Timing_Start
+  ==============
+*/
+void
+Timing_Start(const char *tool)
+{
+    if (timingtrace)
+        timingenabled = true;
+    if (!timingenabled)
+        return;
+
+    timing_tool = tool;
+    timing_starttime = Timing_Now();
+    Timing_Thread(); /* the calling thread is the first row of the trace */
+}
+
+timingscope_t::timingscope_t(const char *scopename, int scopeitem)
+    : name(scopename), item(scopeitem), start(0)
+{
+    if (!timingenabled)
+        return;
+
+    Timing_Thread()->depth++;
+    start = Timing_Now();
+}
+
+timingscope_t::~timingscope_t()
+{
+    if (!timingenabled || !start)
+        return;
+
+    const double end = Timing_Now();
+    timingthread_t *thread = Timing_Thread();
+    thread->depth--;
+    thread->events.push_back({ name, item, thread->depth, start, end });
+}
+
+void
+Timing_Event(const char *name, int item, double start, double end)
+{
+    if (!timingenabled)
+        return;
+
+    timingthread_t *thread = Timing_Thread();
+    thread->events.push_back({ name, item, thread->depth, start, end });
+}
+
+void
+Timing_Count(const char *counter, int64_t count)
+{
+    if (!timingenabled)
+        return;
+
+    timingthread_t *thread = Timing_Thread();
+    for (timingcounter_t &c : thread->counters) {
+        if (c.name == counter || !strcmp(c.name, counter)) {
+            c.count += count;
+            return;
+        }
+    }
+    thread->counters.push_back({ counter, count });
+}
+
+static void
+Timing_WriteJson(const json &j, const char *source, const char *suffix)
+{
+    char filename[1024];
+    q_snprintf(filename, sizeof(filename), "%s", source);
+    StripExtension(filename);
+    q_snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), ".%s%s", timing_tool, suffix);
+
+    FILE *f = SafeOpenWrite(filename);
+    const std::string text = j.dump(1);
+    SafeWrite(f, text.c_str(), text.size());
+    fclose(f);
+
+    logprint("timing: wrote %s\n", filename);
+}
+
+/* every event, a row per thread */
+static json
+Timing_ChromeTrace(void)
+{
+    const auto micros = [](double t) { return static_cast<int64_t>((t - timing_starttime) * 1e6); };
+
+    json events = json::array();
+    for (size_t i = 0; i < timing_threads.size(); i++) {
+        const int tid = static_cast<int>(i);
+        events.push_back({ {"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", tid},
+                           {"args", { {"name", i ? "thread " + std::to_string(i) : std::string("main")} }} });
+
+        for (const timingevent_t &event : timing_threads[i]->events) {
+            json e = { {"name", event.name}, {"ph", "X"}, {"ts", micros(event.start)},
+                       {"dur", micros(event.end) - micros(event.start)}, {"pid", 1}, {"tid", tid} };
+            if (event.item >= 0)
+                e["args"] = { {"item", event.item} };
+            events.push_back(std::move(e));
+        }
+    }
+
+    json j = json::object();
+    j["traceEvents"] = events;
+    j["displayTimeUnit"] = "ms";
+    return j;
+}
+
+/*
+  ==============
+  Timing_Finish
+  ==============
+*/
+void
+Timing_Finish(const char *source)
+{
+    if (!timingenabled)
+        return;
+
+    std::lock_guard<std::mutex> lock(timing_lock);
+
+    const double elapsed = Timing_Now() - timing_starttime;
+
+    struct phase_t {
+        const timingevent_t *event;
+        int thread;
+    };
+    struct total_t {
+        int64_t count = 0;
+        double seconds = 0;
+        bool items = false;
+    };
+    std::vector<phase_t> phases;
+    std::map<std::string, total_t> totals;
+    std::map<std::string, int64_t> counters;
+
+    for (size_t i = 0; i < timing_threads.size(); i++) {
+        for (const timingevent_t &event : timing_threads[i]->events) {
+            if (event.item < 0)
+                phases.push_back({ &event, static_cast<int>(i) });
+
+            total_t &total = totals[event.name];
+            total.count++;
+            total.seconds += event.end - event.start;
+            total.items |= (event.item >= 0);
+        }
+        for (const timingcounter_t &counter : timing_threads[i]->counters)
+            counters[counter.name] += counter.count;
+    }
+    std::sort(phases.begin(), phases.end(), [](const phase_t &a, const phase_t &b) {
+        return a.event->start < b.event->start;
+    });
+
+    logprint("timing: phases:\n");
+    for (const phase_t &phase : phases) {
+        logprint("  %*s%-*s %8.3f secs\n", 2 * phase.event->depth, "", 28 - 2 * phase.event->depth,
+                 phase.event->name, phase.event->end - phase.event->start);
+    }
+    for (const auto &total : totals) {
+        if (total.second.items) {
+            logprint("timing: totals:\n");
+            break;
+        }
+    }
+    for (const auto &total : totals) {
+        if (total.second.items) {
+            logprint("  %-28s %8.3f secs in %lld\n", total.first.c_str(), total.second.seconds,
+                     static_cast<long long>(total.second.count));
+        }
+    }
+    if (!counters.empty())
+        logprint("timing: counters:\n");
+    for (const auto &counter : counters)
+        logprint("  %-28s %8lld\n", counter.first.c_str(), static_cast<long long>(counter.second));
+
+    json j = json::object();
+    j["tool"] = timing_tool;
+    j["version"] = stringify(ERICWTOOLS_VERSION);
+    j["elapsed"] = elapsed;
+    j["threads"] = timing_threads.size();
+
+    json &phasesjson = (j.emplace("phases", json::array())).first.value();
+    for (const phase_t &phase : phases) {
+        phasesjson.push_back({ {"name", phase.event->name}, {"start", phase.event->start - timing_starttime},
+                               {"seconds", phase.event->end - phase.event->start},
+                               {"depth", phase.event->depth}, {"thread", phase.thread} });
+    }
+
+    json &totalsjson = (j.emplace("totals", json::object())).first.value();
+    for (const auto &total : totals)
+        totalsjson[total.first] = { {"count", total.second.count}, {"seconds", total.second.seconds} };
+
+    j["counters"] = counters;
+
+    Timing_WriteJson(j, source, "timing.json");
+    if (timingtrace)
+        Timing_WriteJson(Timing_ChromeTrace(), source, "trace.json");
+}
@@ -0,0 +1,53 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#ifndef __COMMON_BATCH_HH__
+#define __COMMON_BATCH_HH__
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+/*
+ * Batch mode for bspinfo and bsputil: runs one tool over many bsps in a
+ * single process, a file per worker thread (-threads, default one per
+ * core).
+ *
+ * Each file's screen output is collected and printed in one piece, in the
+ * order the files were given, so the output reads as if they were run one
+ * after another. An Error() while processing a file fails only that file.
+ */
+
+/* adds a file name, expanding wildcards (* and ?) in its last component */
+void Batch_AddFiles(std::vector<std::string> *files, const char *pattern);
+/* adds each line of a text file ("-" for stdin), as Batch_AddFiles */
+void Batch_AddList(std::vector<std::string> *files, const char *listfile);
+
+/*
+ * Calls func for each file; it can add its own results to the file's
+ * entry in the report. If reportfile isn't null, writes a json report
+ * there with every file's entry, output, time and error if it failed.
+ * Returns the number of files that failed.
+ */
+typedef std::function<void(const std::string &file, nlohmann::json &result)> batchfunc_t;
+int Batch_Run(const std::vector<std::string> &files, const batchfunc_t &func, const char *reportfile);
+
+#endif /* __COMMON_BATCH_HH__ */
@@ -483,6 +483,10 @@ struct surfflags_t {
     constexpr bool operator>(const surfflags_t &other) const {
         return as_tuple() > other.as_tuple();
     }
+
+    constexpr bool operator==(const surfflags_t &other) const {
+        return as_tuple() == other.as_tuple();
+    }
 };
 
 // header before tightly packed surfflags_t[num_texinfo]
@@ -1175,13 +1179,25 @@ constexpr const bspversion_t *const bspversions[] = {
 
 void LoadBSPFile(char *filename, bspdata_t *bspdata);       //returns the filename as contained inside a bsp
 void WriteBSPFile(const char *filename, bspdata_t *bspdata);
+/* frees the lumps and bspx lumps, in whichever format bspdata is */
+void FreeBSPData(bspdata_t *bspdata);
 void PrintBSPFileSizes(const bspdata_t *bspdata);
 /**
  * Returns false if the conversion failed.
  */
 bool ConvertBSPFormat(bspdata_t *bspdata, const bspversion_t *to_version);
 void BSPX_AddLump(bspdata_t *bspdata, const char *xname, const void *xdata, size_t xsize);
+/* like BSPX_AddLump, but takes xdata, which must come from malloc, instead of copying it */
+void BSPX_AddLumpOwned(bspdata_t *bspdata, const char *xname, void *xdata, size_t xsize);
 const void *BSPX_GetLump(bspdata_t *bspdata, const char *xname, size_t *xsize);
+/**
+ * Compressed BSPX lumps are stored under "zlib:<lumpname>", as the
+ * little-endian uncompressed size followed by a zlib stream. Compress
+ * returns the number of lumps it packed; LoadBSPFile decompresses
+ * transparently, so the rest of the tools only ever see raw lumps.
+ */
+int BSPX_CompressLumps(bspdata_t *bspdata);
+int BSPX_DecompressLumps(bspdata_t *bspdata);
 
 void
 DecompressRow (const uint8_t *in, const int numbytes, uint8_t *decompressed);
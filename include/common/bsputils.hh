@@ -23,6 +23,7 @@
 #include <common/bspfile.hh>
 #include <common/mathlib.hh>
 #include <string>
+#include <vector>
 
 #include <common/qvec.hh>
 
@@ -55,6 +56,13 @@ const dmodel_t *BSP_DModelForModelString(const mbsp_t *bsp, const std::string &s
 vec_t Plane_Dist(const vec3_t point, const dplane_t *plane);
 bool Light_PointInSolid(const mbsp_t *bsp, const dmodel_t *model, const vec3_t point);
 bool Light_PointInWorld(const mbsp_t *bsp, const vec3_t point);
+/**
+ * Light_PointInSolid for a batch of points: sets insolid[i] to 1 for each i in
+ * `indices` with points[i] in solid, leaving the other entries alone. The
+ * tree is walked once for the whole batch instead of once per point.
+ */
+void Light_PointsInSolid(const mbsp_t *bsp, const dmodel_t *model, const std::vector<qvec3f> &points,
+                         const std::vector<int> &indices, uint8_t *insolid);
 /**
  * Searches for a face touching a point and facing a certain way.
  * Sometimes (water, sky?) there will be 2 overlapping candidates facing opposite ways, the provided normal
@@ -30,6 +30,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string>
+#include <stdexcept>
 #include <common/log.hh>
 #include <common/qvec.hh> // FIXME: For qmax/qmin
 
@@ -83,6 +84,23 @@ double I_FloatTime(void);
 
 [[noreturn]] void Error(const char *error, ...)
     __attribute__((format(printf,1,2),noreturn));
+
+/*
+ * While an error_trap_t is alive on a thread, Error() on that thread logs
+ * as usual and then throws an error_exception_t with the message instead
+ * of exiting, so the batch modes can fail one file and carry on.
+ */
+class error_exception_t : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class error_trap_t {
+    bool previous;
+public:
+    error_trap_t();
+    ~error_trap_t();
+};
 int CheckParm(const char *check);
 
 FILE *SafeOpenWrite(const char *filename);
@@ -91,6 +109,12 @@ void SafeRead(FILE *f, void *buffer, int count);
 void SafeWrite(FILE *f, const void *buffer, int count);
 
 int LoadFilePak(char *filename, void *destptr);
+/*
+ * A read-only view of innerfile inside the pak at pakname, nullptr if either
+ * is missing. Paks are opened and indexed once and stay mapped until exit,
+ * so the view never needs freeing; safe to call from any thread.
+ */
+const uint8_t *Pak_FileView(const char *pakname, const char *innerfile, int *length);
 int LoadFile(const char *filename, void *destptr);
 void SaveFile(const char *filename, const void *buffer, int count);
 
@@ -107,6 +131,10 @@ void ExtractFileExtension(char *path, char *dest);
 
 int ParseNum(char *str);
 
+#ifdef _SGI_SOURCE
+#define __BIG_ENDIAN__
+#endif
+
 short BigShort(short l);
 short LittleShort(short l);
 int BigLong(int l);
@@ -127,6 +155,10 @@ void CRC_ProcessByte(unsigned short *crcvalue, uint8_t data);
 unsigned short CRC_Value(unsigned short crcvalue);
 unsigned short CRC_Block (const unsigned char *start, int count);
 
+#define FNV_HASH_INIT 14695981039346656037ULL
+/* continues a 64-bit FNV-1a hash; start *hash at FNV_HASH_INIT */
+void FNV_HashBytes(uint64_t *hash, const void *data, size_t size);
+
 void CreatePath(char *path);
 void Q_CopyFile(const char *from, char *to);
 
@@ -140,6 +172,7 @@ static inline void Q_assert_(bool success, const char *expr, const char *file, i
 {
     if (!success) {
         logprint("%s:%d: Q_assert(%s) failed.\n", file, line, expr);
+        log_flush();
         assert(0);
         exit(1);
     }
@@ -0,0 +1,68 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+
+#ifndef __COMMON_COMPILECACHE_HH__
+#define __COMMON_COMPILECACHE_HH__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Compile cache (-cachedir dir), shared by qbsp, vis and light.
+ *
+ * A tool hashes everything its output depends on into a key: the tools'
+ * version, the options that change the output and the contents of its
+ * input files. The outputs are stored in dir under the key, and a later
+ * run with the same key copies them back and skips the work. Entries are
+ * written under a temporary name and renamed into place, so the dir can
+ * be shared by machines running at the same time, e.g. CI runners with a
+ * network share.
+ */
+
+extern std::string compilecachedir;     /* empty when the cache is off */
+
+/* the start of a key for tool, covering the tools' version */
+uint64_t CompileCache_Begin(const char *tool);
+
+/* adds a file's contents; a missing file hashes differently from an empty one */
+void CompileCache_HashFile(uint64_t *key, const char *filename);
+
+/*
+ * adds the options, less the ones that only change how a tool runs
+ * (-threads, -timing, -cachedir, ...); leave out the file names, so the
+ * same map compiled in another directory still hits
+ */
+void CompileCache_HashArgs(uint64_t *key, const std::vector<std::string> &args);
+
+/*
+ * copies a stored entry's files to basename + their extensions, and removes
+ * basename + any of extensions (what CompileCache_Store was given) that the
+ * entry doesn't have; false if there's no entry
+ */
+bool CompileCache_Restore(const char *tool, uint64_t key, const std::string &basename,
+                          const std::vector<std::string> &extensions);
+
+/* stores basename + each extension that exists; failing to store only warns */
+void CompileCache_Store(const char *tool, uint64_t key, const std::string &basename,
+                        const std::vector<std::string> &extensions);
+
+#endif /* __COMMON_COMPILECACHE_HH__ */
@@ -30,12 +30,17 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+#include <string>
+
 #ifndef __GNUC__
 #define __attribute__(x)
 #endif
 
+/* Log lines are written by a background thread from init_log to close_log */
 void init_log(const char *filename);
 void close_log();
+/* Waits until everything logged so far is written out */
+void log_flush(void);
 
 /* Print to screen and to log file */
 void logprint(const char *fmt, ...)
@@ -47,6 +52,21 @@ void logvprint(const char *fmt, va_list args)
 void logprint_silent(const char *fmt, ...)
     __attribute__((format(printf,1,2)));
 
+/* Print only to the screen, in order with the logged lines */
+void logprint_screen(const char *fmt, ...)
+    __attribute__((format(printf,1,2)));
+
+/*
+ * While alive, this thread's screen output is appended to *buffer instead
+ * of being printed, so a batch can print each file's output in one piece
+ */
+class log_capture_t {
+    std::string *previous;
+public:
+    explicit log_capture_t(std::string *buffer);
+    ~log_capture_t();
+};
+
 /* Only called from the threads code */
 void logprint_locked__(const char *fmt, ...)
     __attribute__((format(printf,1,2)));
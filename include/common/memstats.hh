@@ -0,0 +1,72 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#ifndef __COMMON_MEMSTATS_HH__
+#define __COMMON_MEMSTATS_HH__
+
+#include <stdint.h>
+
+#include <atomic>
+
+/*
+ * Memory accounting, shared by qbsp, vis and light.
+ *
+ * A memcounter_t counts the bytes one subsystem holds and keeps their
+ * high-water mark. It's an atomic, so count whole buffers (a portal's
+ * leafbits, a thread's scratch), not every small allocation. Mem_Report
+ * logs each counter's peak and the process's peak resident size.
+ *
+ * -membudget n sets membudget to n megabytes. Where a tool has a lower
+ * memory way of doing something it takes it under a budget, and
+ * Mem_Report warns if the peak went over.
+ */
+
+extern int64_t membudget;       /* bytes, 0 for no budget */
+
+class memcounter_t {
+    const char *name;
+    std::atomic<int64_t> bytes { 0 };
+    std::atomic<int64_t> peak { 0 };
+public:
+    /* construct as a static, the counter is listed by Mem_Report */
+    explicit memcounter_t(const char *countername);
+
+    void add(int64_t n) {
+        const int64_t now = bytes.fetch_add(n, std::memory_order_relaxed) + n;
+        int64_t highest = peak.load(std::memory_order_relaxed);
+        while (now > highest && !peak.compare_exchange_weak(highest, now, std::memory_order_relaxed))
+            ;
+    }
+    void sub(int64_t n) { bytes.fetch_sub(n, std::memory_order_relaxed); }
+
+    int64_t current() const { return bytes.load(std::memory_order_relaxed); }
+    int64_t highwater() const { return peak.load(std::memory_order_relaxed); }
+    const char *counterName() const { return name; }
+};
+
+/* the budget given to -membudget, in megabytes; Error()s unless it's a positive number */
+void Mem_SetBudget(const char *megabytes);
+
+/* the process's peak resident size in bytes, 0 if the platform doesn't say */
+int64_t Mem_PeakRSS(void);
+
+/* logs the counters' peaks and the peak resident size against the budget */
+void Mem_Report(void);
+
+#endif /* __COMMON_MEMSTATS_HH__ */
@@ -0,0 +1,270 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#ifndef __COMMON_MICROBENCH_HH__
+#define __COMMON_MICROBENCH_HH__
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Micro-benchmarks for the bench* programs, along the lines of Google
+ * Benchmark but small enough to live in a header:
+ *
+ *     MICROBENCH(CompressRow)
+ *     {
+ *         ...setup, not timed...
+ *         while (state.keepRunning())
+ *             Microbench_DoNotOptimize(CompressRow(row, numbytes, out));
+ *         state.setItemsProcessed(numbytes);
+ *     }
+ *
+ *     int main(int argc, const char **argv)
+ *     {
+ *         return Microbench_Main(argc, argv);
+ *     }
+ *
+ * Each benchmark is run with more iterations until it takes -mintime
+ * seconds, best of -repeat, and reported as nanoseconds per iteration.
+ * -json writes the results along with the compiler and the vector
+ * instructions the build targets, so runs from different compilers and
+ * machines can be compared.
+ */
+
+class microbench_state_t {
+public:
+    explicit microbench_state_t(int64_t iterations) : m_iterations(iterations), m_remaining(iterations) {}
+
+    /* true until the loop has run the iterations asked for; the first call starts the clock */
+    bool keepRunning() {
+        if (m_remaining == m_iterations)
+            m_start = std::chrono::steady_clock::now();
+        if (m_remaining > 0) {
+            m_remaining--;
+            return true;
+        }
+        m_stop = std::chrono::steady_clock::now();
+        return false;
+    }
+
+    int64_t iterations() const { return m_iterations; }
+
+    /* items (bytes, rays, points...) one iteration handles, for items/s */
+    void setItemsProcessed(int64_t items) { m_items = items; }
+    int64_t itemsProcessed() const { return m_items; }
+
+    /* seconds the keepRunning() loop took */
+    double elapsed() const { return std::chrono::duration<double>(m_stop - m_start).count(); }
+
+private:
+    int64_t m_iterations, m_remaining;
+    int64_t m_items = 0;
+    std::chrono::steady_clock::time_point m_start, m_stop;
+};
+
+typedef std::function<void(microbench_state_t &state)> microbenchfunc_t;
+
+struct microbench_t {
+    const char *name;
+    microbenchfunc_t func;
+};
+
+inline std::vector<microbench_t> &
+Microbench_List()
+{
+    static std::vector<microbench_t> list;
+    return list;
+}
+
+struct microbench_register_t {
+    microbench_register_t(const char *name, microbenchfunc_t func) {
+        Microbench_List().push_back({ name, std::move(func) });
+    }
+};
+
+#define MICROBENCH(name)                                                       \
+    static void Bench_##name(microbench_state_t &state);                       \
+    static microbench_register_t bench_register_##name(#name, Bench_##name);   \
+    static void Bench_##name(microbench_state_t &state)
+
+/* keeps the compiler from dropping a result nothing reads */
+#if defined(__GNUC__)
+template<typename T>
+inline void Microbench_DoNotOptimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+#else
+inline const volatile void *microbench_sink;
+template<typename T>
+inline void Microbench_DoNotOptimize(const T &value)
+{
+    microbench_sink = static_cast<const volatile void *>(&value);
+}
+#endif
+
+inline const char *
+Microbench_Compiler()
+{
+#if defined(__clang__)
+    return "clang " __clang_version__;
+#elif defined(__GNUC__)
+    return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+    static char name[32];
+    snprintf(name, sizeof(name), "msvc %d", _MSC_FULL_VER);
+    return name;
+#else
+    return "unknown";
+#endif
+}
+
+/* the widest vector instructions the build was allowed to use */
+inline const char *
+Microbench_ISA()
+{
+#if defined(__AVX512F__)
+    return "avx512";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__AVX__)
+    return "avx";
+#elif defined(__SSE4_2__)
+    return "sse4.2";
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+inline int
+Microbench_Main(int argc, const char **argv)
+{
+    const char *filter = nullptr;
+    const char *jsonfile = nullptr;
+    double mintime = 0.5;
+    int repeat = 3;
+    bool list = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "-mintime") && i + 1 < argc) {
+            mintime = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-repeat") && i + 1 < argc) {
+            repeat = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-json") && i + 1 < argc) {
+            jsonfile = argv[++i];
+        } else if (!strcmp(argv[i], "-list")) {
+            list = true;
+        } else {
+            printf("usage: %s [-filter substring] [-mintime seconds] [-repeat n] [-json file] [-list]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct result_t {
+        const char *name;
+        int64_t iterations;
+        double ns, itemspersec;
+    };
+    std::vector<result_t> results;
+
+    printf("compiler: %s\nisa: %s\n\n", Microbench_Compiler(), Microbench_ISA());
+    if (!list)
+        printf("%-36s %12s %14s %14s\n", "benchmark", "iterations", "ns/iter", "items/s");
+
+    for (const microbench_t &bench : Microbench_List()) {
+        if (filter && !strstr(bench.name, filter))
+            continue;
+        if (list) {
+            printf("%s\n", bench.name);
+            continue;
+        }
+
+        result_t best { bench.name, 0, 0, 0 };
+        for (int r = 0; r < repeat; r++) {
+            /* grow the iteration count until a run takes long enough to time */
+            int64_t iterations = 1;
+            for (;;) {
+                microbench_state_t state(iterations);
+                bench.func(state);
+                const double elapsed = state.elapsed();
+
+                if (elapsed >= mintime || iterations >= INT64_C(1000000000)) {
+                    const double ns = elapsed * 1e9 / iterations;
+                    if (!best.iterations || ns < best.ns) {
+                        best.iterations = iterations;
+                        best.ns = ns;
+                        best.itemspersec = (state.itemsProcessed() && elapsed > 0)
+                            ? state.itemsProcessed() * static_cast<double>(iterations) / elapsed : 0;
+                    }
+                    break;
+                }
+
+                const double scale = (elapsed > 0) ? mintime * 1.4 / elapsed : 100;
+                iterations = std::max(iterations + 1, static_cast<int64_t>(iterations * std::min(scale, 100.0)));
+            }
+        }
+
+        if (best.itemspersec)
+            printf("%-36s %12lld %14.1f %14.4g\n", best.name, static_cast<long long>(best.iterations), best.ns, best.itemspersec);
+        else
+            printf("%-36s %12lld %14.1f\n", best.name, static_cast<long long>(best.iterations), best.ns);
+        fflush(stdout);
+        results.push_back(best);
+    }
+
+    if (jsonfile) {
+        FILE *f = fopen(jsonfile, "w");
+        if (!f) {
+            printf("couldn't open %s: %s\n", jsonfile, strerror(errno));
+            return 1;
+        }
+        /* benchmark names are identifiers and the context has no quotes, so nothing to escape */
+        fprintf(f, "{\n    \"context\": {\n");
+        fprintf(f, "        \"compiler\": \"%s\",\n", Microbench_Compiler());
+        fprintf(f, "        \"isa\": \"%s\",\n", Microbench_ISA());
+        fprintf(f, "        \"mintime\": %g,\n        \"repeat\": %d\n    },\n", mintime, repeat);
+        fprintf(f, "    \"benchmarks\": [");
+        for (size_t i = 0; i < results.size(); i++) {
+            fprintf(f, "%s\n        { \"name\": \"%s\", \"iterations\": %lld, \"ns_per_iteration\": %.3f, \"items_per_second\": %.6g }",
+                    i ? "," : "", results[i].name, static_cast<long long>(results[i].iterations), results[i].ns,
+                    results[i].itemspersec);
+        }
+        fprintf(f, "\n    ]\n}\n");
+        fclose(f);
+        printf("\nwrote %s\n", jsonfile);
+    }
+
+    return 0;
+}
+
+#endif /* __COMMON_MICROBENCH_HH__ */
@@ -22,9 +22,9 @@
 
 #include <common/aabb.hh>
 
+#include <algorithm>
 #include <utility> // for std::pair
 #include <vector>
-#include <set>
 #include <cassert>
 
 static inline aabb3f bboxOctant(const aabb3f &box, int i)
@@ -51,138 +51,133 @@ static inline aabb3f bboxOctant(const aabb3f &box, int i)
     return aabb3f(mins, maxs);
 }
 
-#define MAX_OCTREE_DEPTH 3
+/*
+ * A static octree over boxed objects, built once by makeOctree.
+ *
+ * A node is split while it holds more than OCTREE_LEAF_OBJECTS objects,
+ * up to OCTREE_MAX_DEPTH, so the depth follows how densely the objects
+ * are packed. Splitting stops early where it doesn't separate anything,
+ * e.g. where every object covers the whole node.
+ *
+ * The nodes are one array with each node's 8 children next to each
+ * other, and each leaf's objects are a range of one array of indices into
+ * the objects.
+ */
+#define OCTREE_LEAF_OBJECTS 16
+#define OCTREE_MAX_DEPTH 8
 
 using octree_nodeid = int;
 
-template <typename T>
-class octree_node_t {
-public:
-    int m_depth;
+struct octree_node_t {
     aabb3f m_bbox;
-    bool m_leafNode;
-    std::vector<std::pair<aabb3f, T>> m_leafObjects; // only nonempty if m_leafNode
-    octree_nodeid m_children[8]; // only use if !m_leafNode
-    
-    octree_node_t(const aabb3f &box, const int depth) :
-        m_depth(depth),
+    octree_nodeid m_firstChild; // -1 for a leaf, otherwise 8 nodes starting here
+    int m_firstObject;          // leafs: range in octree_t::m_leafObjects
+    int m_numObjects;
+
+    octree_node_t(const aabb3f &box) :
         m_bbox(box),
-        m_leafNode(true),
-        m_leafObjects()
-        {
-            assert(m_depth <= MAX_OCTREE_DEPTH);
-        }
+        m_firstChild(-1),
+        m_firstObject(0),
+        m_numObjects(0) {}
 };
 
 template <typename T>
 class octree_t {
 private:
-    std::vector<octree_node_t<T>> m_nodes;
+    std::vector<octree_node_t> m_nodes;
+    std::vector<std::pair<aabb3f, T>> m_objects;
+    std::vector<int> m_leafObjects;
 
-    /**
-     * helper for toNode().
-     *
-     * creates the ith octant child of `thisNode`, and adds it to the end of `octree`.
-     * returns the nodeid.
-     */
-    octree_nodeid createChild(octree_nodeid thisNode, int i) {
-        octree_node_t<T> *node = &m_nodes[thisNode];
-        
-        const aabb3f childBox = bboxOctant(node->m_bbox, i);
-        octree_node_t<T> newNode(childBox, node->m_depth + 1);
-        
-        m_nodes.push_back(newNode); // invalidates `node` reference
-        return static_cast<int>(m_nodes.size() - 1);
-    }
-    
-    void toNode(octree_nodeid thisNode) {
-        octree_nodeid newNodeIds[8];
-        for (int i=0; i<8; i++) {
-            newNodeIds[i] = createChild(thisNode, i);
-        }
-        
-        octree_node_t<T> *node = &m_nodes[thisNode];
-        assert(node->m_leafNode);
-        assert(node->m_leafObjects.empty()); // we always convert leafs to nodes before adding anything
-        for (int i=0; i<8; i++) {
-            node->m_children[i] = newNodeIds[i];
-        }
-        node->m_leafNode = false;
-    }
-    
-    void queryTouchingBBox(octree_nodeid thisNode, const aabb3f &query, std::set<T> &dest) const {
-        const octree_node_t<T> *node = &m_nodes[thisNode];
-        
-        if (node->m_leafNode) {
-            // Test all objects
-            for (const auto &boxObjPair : node->m_leafObjects) {
-                if (!query.disjoint(boxObjPair.first)) {
-                    dest.insert(boxObjPair.second);
+    void build(octree_nodeid thisNode, const std::vector<int> &objects, int depth) {
+        if (objects.size() > OCTREE_LEAF_OBJECTS && depth < OCTREE_MAX_DEPTH) {
+            std::vector<int> childObjects[8];
+            bool separates = false;
+
+            for (int i=0; i<8; i++) {
+                const aabb3f childBox = bboxOctant(m_nodes[thisNode].m_bbox, i);
+                for (const int object : objects) {
+                    if (!childBox.disjoint(m_objects[object].first))
+                        childObjects[i].push_back(object);
                 }
+                separates |= (childObjects[i].size() < objects.size());
             }
-            return;
-        }
-        
-        // Test all children that intersect the query
-        for (int i=0; i<8; i++) {
-            const octree_nodeid child_i_index = node->m_children[i];
-            const octree_node_t<T> *child_i_node = &m_nodes[child_i_index];
-            
-            const aabb3f::intersection_t intersection = query.intersectWith(child_i_node->m_bbox);
-            if (intersection.valid) {
-                queryTouchingBBox(child_i_index, intersection.bbox, dest);
-            }
-        }
-    }
-    
-    void insert(octree_nodeid thisNode, const aabb3f &objBox, const T &obj) {
-        octree_node_t<T> *node = &m_nodes[thisNode];
-        assert(node->m_bbox.contains(objBox));
-        
-        if (node->m_leafNode && node->m_depth < MAX_OCTREE_DEPTH) {
-            toNode(thisNode);
-            // N.B.: `node` pointer was invalidated
-            node = &m_nodes[thisNode];
-        }
-        
-        if (node->m_leafNode) {
-            node->m_leafObjects.push_back(std::make_pair(objBox, obj));
-            return;
-        }
-        
-        // inserting into a non-leaf node
-        for (int i=0; i<8; i++) {
-            const octree_nodeid child_i_index = node->m_children[i];
-            octree_node_t<T> *child_i_node = &m_nodes[child_i_index];
-            const aabb3f::intersection_t intersection = objBox.intersectWith(child_i_node->m_bbox);
-            if (intersection.valid) {
-                insert(child_i_index, intersection.bbox, obj);
-                
-                // N.B.: `node` pointer was invalidated
-                node = &m_nodes[thisNode];
+
+            if (separates) {
+                const octree_nodeid firstChild = static_cast<octree_nodeid>(m_nodes.size());
+                for (int i=0; i<8; i++) {
+                    m_nodes.emplace_back(bboxOctant(m_nodes[thisNode].m_bbox, i)); // invalidates node pointers
+                }
+                m_nodes[thisNode].m_firstChild = firstChild;
+
+                for (int i=0; i<8; i++) {
+                    build(firstChild + i, childObjects[i], depth + 1);
+                }
+                return;
             }
         }
+
+        octree_node_t &node = m_nodes[thisNode];
+        node.m_firstObject = static_cast<int>(m_leafObjects.size());
+        node.m_numObjects = static_cast<int>(objects.size());
+        m_leafObjects.insert(m_leafObjects.end(), objects.begin(), objects.end());
     }
-    
+
 public:
-    void insert(const aabb3f &objBox, const T &obj) {
-        insert(0, objBox, obj);
+    /**
+     * Use makeOctree.
+     */
+    octree_t(const aabb3f &box, std::vector<std::pair<aabb3f, T>> objects) :
+        m_objects(std::move(objects))
+    {
+        m_nodes.emplace_back(box);
+
+        std::vector<int> all(m_objects.size());
+        for (size_t i=0; i<all.size(); i++)
+            all[i] = static_cast<int>(i);
+        build(0, all, 0);
     }
-    
-    std::vector<T> queryTouchingBBox(const aabb3f &query) const {
-        std::set<T> res;
-        queryTouchingBBox(0, query, res);
-        
-        std::vector<T> res_vec;
-        res_vec.reserve(res.size()); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/performance-inefficient-vector-operation.html
-        for (const auto &item : res) {
-            res_vec.push_back(item);
+
+    /**
+     * Appends to dest the objects whose boxes touch query, in ascending
+     * order, each once. Only the appended part is sorted.
+     */
+    void queryTouchingBBox(const aabb3f &query, std::vector<T> &dest) const {
+        const size_t start = dest.size();
+
+        // a node's children are pushed together, so this bounds the stack
+        octree_nodeid stack[8 * OCTREE_MAX_DEPTH + 1];
+        int stacksize = 0;
+
+        if (!query.disjoint(m_nodes[0].m_bbox))
+            stack[stacksize++] = 0;
+
+        while (stacksize) {
+            const octree_node_t &node = m_nodes[stack[--stacksize]];
+
+            if (node.m_firstChild == -1) {
+                for (int i=0; i<node.m_numObjects; i++) {
+                    const std::pair<aabb3f, T> &object = m_objects[m_leafObjects[node.m_firstObject + i]];
+                    if (!query.disjoint(object.first))
+                        dest.push_back(object.second);
+                }
+                continue;
+            }
+
+            for (int i=0; i<8; i++) {
+                if (!query.disjoint(m_nodes[node.m_firstChild + i].m_bbox))
+                    stack[stacksize++] = node.m_firstChild + i;
+            }
         }
-        return res_vec;
+
+        // objects in more than one leaf were found more than once
+        std::sort(dest.begin() + start, dest.end());
+        dest.erase(std::unique(dest.begin() + start, dest.end()), dest.end());
     }
-    
-    octree_t(const aabb3f &box) {
-        this->m_nodes.push_back(octree_node_t<T>(box, 0));
+
+    std::vector<T> queryTouchingBBox(const aabb3f &query) const {
+        std::vector<T> res;
+        queryTouchingBBox(query, res);
+        return res;
     }
 };
 
@@ -190,8 +185,7 @@ template <typename T>
 octree_t<T> makeOctree(const std::vector<std::pair<aabb3f, T>> &objects)
 {
     if (objects.empty()) {
-        octree_t<T> empty{aabb3f{qvec3f(), qvec3f()}};
-        return empty;
+        return octree_t<T>(aabb3f{qvec3f(), qvec3f()}, {});
     }
     
     // take bbox of objects
@@ -200,11 +194,7 @@ octree_t<T> makeOctree(const std::vector<std::pair<aabb3f, T>> &objects)
         box = box.unionWith(pr.first);
     }
     
-    octree_t<T> res(box);
-    for (const auto &pr : objects) {
-        res.insert(pr.first, pr.second);
-    }
-    return res;
+    return octree_t<T>(box, objects);
 }
 
 #endif /* __COMMON_OCTREE_HH__ */
@@ -6,6 +6,8 @@
 #include <common/mathlib.hh>
 #include <common/bspfile.hh>
 
+#include <vector>
+
 namespace polylib {
 
 typedef struct {
@@ -21,6 +23,20 @@ typedef struct {
 #define MAX_POINTS_ON_WINDING 64
 #define ON_EPSILON 0.1f //mxd. Changed from 0.1 to silence compiler warning
 
+/*
+ * A winding with room for MAX_POINTS_ON_WINDING points inline, for the
+ * *Buf functions below, which work in caller-provided buffers instead of
+ * allocating. get() gives the winding_t for the other functions; none of
+ * them may free it.
+ */
+struct winding_buf_t {
+    int numpoints;
+    vec3_t p[MAX_POINTS_ON_WINDING];
+
+    winding_t *get() { return reinterpret_cast<winding_t *>(this); }
+    const winding_t *get() const { return reinterpret_cast<const winding_t *>(this); }
+};
+
 winding_t *AllocWinding(int points);
 vec_t WindingArea(const winding_t * w);
 void WindingCenter(const winding_t * w, vec3_t center);
@@ -30,14 +46,20 @@ void ClipWinding(const winding_t * in, const vec3_t normal, vec_t dist,
 winding_t *ChopWinding(winding_t * in, vec3_t normal, vec_t dist);
 winding_t *CopyWinding(const winding_t * w);
 winding_t *BaseWindingForPlane(const vec3_t normal, float dist);
+void ClipWindingBuf(const winding_t * in, const vec3_t normal, vec_t dist,
+                    winding_buf_t * front, winding_buf_t * back);
+void CopyWindingBuf(const winding_t * w, winding_buf_t * out);
+void BaseWindingForPlaneBuf(const vec3_t normal, float dist, winding_buf_t * out);
 void CheckWinding(const winding_t * w);
 void WindingPlane(const winding_t * w, vec3_t normal, vec_t *dist);
 void RemoveColinearPoints(winding_t * w);
 
 typedef void (*save_winding_fn_t)(winding_t *w, void *userinfo);
 void DiceWinding (winding_t *w, vec_t subdiv, save_winding_fn_t save_fn, void *userinfo);
+void DiceWindingBuf (const winding_t *w, vec_t subdiv, std::vector<winding_buf_t> *out);
     
 winding_t *WindingFromFace (const mbsp_t *bsp, const bsp2_dface_t *f);
+void WindingFromFaceBuf (const mbsp_t *bsp, const bsp2_dface_t *f, winding_buf_t *out);
 
 winding_edges_t *AllocWindingEdges(const winding_t *w);
 void FreeWindingEdges(winding_edges_t *wi);
@@ -23,6 +23,7 @@
 #include <initializer_list>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <string>
 
 #ifndef qmax // FIXME: Remove this ifdef
@@ -129,6 +130,9 @@ public:
         assert(idx >= 0 && idx < N);
         return v[idx];
     }
+
+    const T *data() const { return v; }
+    T *data() { return v; }
     
     void operator+=(const qvec<N,T> &other) {
         for (int i=0; i<N; i++)
@@ -468,6 +472,67 @@ using qmat4x3f = qmat<4, 3, float>;
 using qmat4x4f = qmat<4, 4, float>;
 
 
+/*
+ * SSE and NEON versions of the 4x4 float operations: matrix * vector,
+ * matrix * matrix and the 4-component dot product. A qmat4x4f column is
+ * four contiguous floats, so it loads as one vector. The sums are taken in
+ * the same order as the generic loops, so the results are the same.
+ */
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+typedef __m128 qvec4f_simd_t;
+#define QVEC_SIMD_LOAD(p)       _mm_loadu_ps(p)
+#define QVEC_SIMD_STORE(p, v)   _mm_storeu_ps(p, v)
+#define QVEC_SIMD_ZERO()        _mm_setzero_ps()
+#define QVEC_SIMD_SPLAT(f)      _mm_set1_ps(f)
+#define QVEC_SIMD_ADD(a, b)     _mm_add_ps(a, b)
+#define QVEC_SIMD_MUL(a, b)     _mm_mul_ps(a, b)
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+typedef float32x4_t qvec4f_simd_t;
+#define QVEC_SIMD_LOAD(p)       vld1q_f32(p)
+#define QVEC_SIMD_STORE(p, v)   vst1q_f32(p, v)
+#define QVEC_SIMD_ZERO()        vdupq_n_f32(0.0f)
+#define QVEC_SIMD_SPLAT(f)      vdupq_n_f32(f)
+#define QVEC_SIMD_ADD(a, b)     vaddq_f32(a, b)
+#define QVEC_SIMD_MUL(a, b)     vmulq_f32(a, b)
+#endif
+
+#ifdef QVEC_SIMD_LOAD
+template <>
+inline qvec4f qmat4x4f::operator*(const qvec4f &vec) const {
+    qvec4f_simd_t res = QVEC_SIMD_ZERO();
+    for (int j=0; j<4; j++) { // for each col
+        res = QVEC_SIMD_ADD(res, QVEC_SIMD_MUL(QVEC_SIMD_LOAD(&m_values[j * 4]), QVEC_SIMD_SPLAT(vec[j])));
+    }
+    qvec4f out;
+    QVEC_SIMD_STORE(out.data(), res);
+    return out;
+}
+
+template <>
+template <>
+inline qmat4x4f qmat4x4f::operator*<4>(const qmat4x4f &other) const {
+    qmat4x4f res(0.0f);
+    for (int j=0; j<4; j++) { // column j of the result is this * column j of other
+        qvec4f_simd_t col = QVEC_SIMD_ZERO();
+        for (int k=0; k<4; k++) {
+            col = QVEC_SIMD_ADD(col, QVEC_SIMD_MUL(QVEC_SIMD_LOAD(&m_values[k * 4]), QVEC_SIMD_SPLAT(other.at(k, j))));
+        }
+        QVEC_SIMD_STORE(&res.m_values[j * 4], col);
+    }
+    return res;
+}
+
+namespace qv {
+    inline float dot(const qvec4f &v1, const qvec4f &v2) {
+        float products[4];
+        QVEC_SIMD_STORE(products, QVEC_SIMD_MUL(QVEC_SIMD_LOAD(v1.data()), QVEC_SIMD_LOAD(v2.data())));
+        return ((products[0] + products[1]) + products[2]) + products[3];
+    }
+};
+#endif
+
 using qmat2x2d = qmat<2, 2, double>;
 using qmat2x3d = qmat<2, 3, double>;
 using qmat2x4d = qmat<2, 4, double>;
@@ -488,6 +553,12 @@ namespace qv {
     qmat4x4d inverse(const qmat4x4d &input);
     
     qmat2x2f inverse(const qmat2x2f &input);
+
+    /**
+     * out[i] = m * (in[i], 1), dropping w. The matrix is loaded once for
+     * the whole array. in and out may be the same array.
+     */
+    void transformPoints(const qmat4x4f &m, const qvec3f *in, qvec3f *out, size_t count);
 };
 
 #endif /* __COMMON_QVEC_HH__ */
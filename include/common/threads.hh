@@ -3,6 +3,8 @@
 #ifndef __COMMON_THREADS_H__
 #define __COMMON_THREADS_H__
 
+#include <functional>
+
 extern int numthreads;
 
 void LowerProcessPriority(void);
@@ -11,6 +13,41 @@ int GetMaxThreads(void); /* returns 0 if no limit specified */
 int GetThreadWork(void);
 int GetThreadWork_Locked__(void); /* caller must take care of locking */
 void RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg);
+/*
+ * Calls func(item, thread) for every item in [start, workcnt), handing
+ * items out in chunks of grainsize (0 = adaptive chunk size). thread is a
+ * stable index in [0, numthreads) for the worker running the item, so it
+ * can be used to pick per-thread scratch buffers.
+ */
+void RunThreadsOn(int start, int workcnt, int grainsize, const std::function<void(int, int)> &func);
+/*
+ * The worker pool is created on first use from numthreads and reused by
+ * later RunThreadsOn calls. Tools can create it up front, and should shut
+ * it down before exiting; both are safe to call more than once.
+ */
+void InitThreadPool(void);
+void ShutdownThreadPool(void);
+/*
+ * Thread placement, for machines with more than one NUMA node.
+ *
+ * BindToNumaNode (-numanode n) restricts the process to one node's CPUs,
+ * so several compiles can run side by side, each on its own node, and
+ * the kernel's first-touch policy keeps their memory there. It's called
+ * while parsing the options, before anything is loaded; unless -threads
+ * changed it, numthreads becomes the node's CPU count.
+ *
+ * PinThreads (-pinthreads) pins every thread that runs TBB work, the
+ * pool's workers and the main thread, to a CPU of its own, in the order
+ * the CPUs are numbered, so a thread keeps its caches and the memory it
+ * touched first stays local. ThreadsPinned lets the tools first-touch
+ * per-item data on the thread that uses it.
+ *
+ * Both Error() where the platform can't do it.
+ */
+void BindToNumaNode(int node);
+void PinThreads(void);
+bool ThreadsPinned(void);
+
 void ThreadLock(void);
 void ThreadUnlock(void);
 
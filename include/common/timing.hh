@@ -0,0 +1,69 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; either version 2 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+ See file, 'COPYING', for details.
+ */
+
+#ifndef __COMMON_TIMING_HH__
+#define __COMMON_TIMING_HH__
+
+#include <stdint.h>
+
+/*
+ * Phase timing (-timing, -timingtrace), shared by qbsp, vis and light.
+ *
+ * timingscope_t times its scope and Timing_Count adds to a named counter.
+ * Both record into the calling thread's own buffers, so workers don't
+ * contend, and when timing is off they cost a branch. Names must be
+ * string literals, they're kept as pointers.
+ *
+ * A scope can be one item of many (a hull, a face) by giving its number;
+ * those are totalled by name. Scopes without one are the phases of the
+ * run and are listed one by one.
+ *
+ * Timing_Finish logs the phases and writes map.<tool>timing.json with the
+ * phases, totals and counters; with -timingtrace it also writes
+ * map.<tool>trace.json, a Chrome trace (chrome://tracing, Perfetto) with
+ * a row per thread.
+ */
+
+extern bool timingenabled;
+extern bool timingtrace;
+
+/* seconds, from a monotonic clock */
+double Timing_Now(void);
+
+/* tool is "qbsp", "vis" or "light", for the file names; call once the command line is parsed */
+void Timing_Start(const char *tool);
+
+class timingscope_t {
+    const char *name;
+    int item;
+    double start;
+public:
+    explicit timingscope_t(const char *scopename, int scopeitem = -1);
+    ~timingscope_t();
+};
+
+/* records a scope timed with Timing_Now() by the caller */
+void Timing_Event(const char *name, int item, double start, double end);
+
+void Timing_Count(const char *counter, int64_t count);
+
+/* logs the phases and writes the json files next to source */
+void Timing_Finish(const char *source);
+
+#endif /* __COMMON_TIMING_HH__ */
@@ -46,9 +46,19 @@ typedef struct {
 // public functions
 
 const std::vector<bouncelight_t> &BounceLights();
+/* indices of bounce lights whose estimated bounds may touch the box, in order */
+std::vector<int> BounceLightsTouchingBounds(const vec3_t mins, const vec3_t maxs);
 const std::vector<int> &BounceLightsForFaceNum(int facenum);
 void MakeTextureColors (const mbsp_t *bsp);
 void MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp);
 void Face_LookupTextureColor (const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t color); //mxd
 
+/* photon map alternative to gathering from every bounce light (-bouncephotons) */
+#define PHOTON_GATHER 64          // photons per irradiance estimate
+#define PHOTON_MAX_RADIUS 256.0f  // furthest a sample looks for them
+void MakePhotonMap (const globalconfig_t &cfg, const mbsp_t *bsp);
+bool PhotonMapActive ();
+/* per-style irradiance in [0,255] at a sample point */
+std::map<int, qvec3f> PhotonMap_Irradiance (const qvec3f &pos, const qvec3f &normal);
+
 #endif /* __LIGHT_BOUNCE_H__ */
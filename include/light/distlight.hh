@@ -0,0 +1,48 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_DISTLIGHT_H__
+#define __LIGHT_DISTLIGHT_H__
+
+#include <light/light.hh>
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/*
+ * Distributed light (-coordinator / -worker), like vis's: jobs of faces
+ * go through files in the bsp's directory, shared with the workers.
+ */
+
+extern bool lightcoordinator;
+extern bool lightworker;
+extern int lightjobsize;        /* faces per job */
+extern int lightjobtimeout;     /* seconds */
+
+/* called by LightWorld in place of lighting every face; costs are LightFace_EstimateCost's */
+void RunLightCoordinator(const mbsp_t *bsp, const globalconfig_t &cfg, const std::vector<int64_t> &costs);
+void RunLightWorker(const mbsp_t *bsp, const globalconfig_t &cfg);
+
+/* light.cc: lights the faces, and moves their lightmaps in and out of files */
+void LightFaces(const mbsp_t *bsp, const std::vector<int> &facenums);
+void SaveFaceLightmaps(const mbsp_t *bsp, const std::vector<int> &facenums, FILE *f);
+void LoadFaceLightmaps(mbsp_t *bsp, const uint8_t *data, size_t size);
+
+#endif /* __LIGHT_DISTLIGHT_H__ */
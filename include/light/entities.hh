@@ -22,6 +22,7 @@
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <common/entdata.h>
@@ -172,6 +173,12 @@ public:
 std::string TargetnameForLightStyle(int style);
 const std::vector<light_t>& GetLights();
 const std::vector<sun_t>& GetSuns();
+/*
+ * Lights whose estimated visible bounds may touch the given box, in
+ * GetLights() order. Without -novisapprox's bounds this is every light;
+ * callers still need CullLight for an exact test.
+ */
+std::vector<const light_t *> LightsTouchingBounds(const vec3_t mins, const vec3_t maxs);
 
 const entdict_t *FindEntDictWithKeyPair(const std::string &key, const std::string &value);
 const char *ValueForKey(const light_t *ent, const char *key);
@@ -182,14 +189,37 @@ std::string WorldValueForKey(const std::string &key);
 
 void LoadEntities(const globalconfig_t &cfg, const mbsp_t *bsp);
 void SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp);
+void ResetEntities(void);
 bool ParseLightsFile(const char *fname);
 void WriteEntitiesToString(const globalconfig_t &cfg, mbsp_t *bsp);
 void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs);
 
 bool EntDict_CheckNoEmptyValues(const mbsp_t *bsp, const entdict_t &entdict);
 
+/*
+ * Lookups over a set of entities, so matching targets to targetnames is a
+ * hash lookup instead of a scan over every entity. Holds pointers into
+ * the entities it was built from; rebuild it if they change.
+ */
+struct entdict_index_t {
+    /// first entity with each "targetname"
+    std::unordered_map<std::string, const entdict_t *> by_targetname;
+    /// first entity with each "model"
+    std::unordered_map<std::string, const entdict_t *> by_model;
+    /// number of entities using each value, under any key
+    std::unordered_map<std::string, int> value_users;
+
+    explicit entdict_index_t(const std::vector<entdict_t> &edicts);
+};
+
+/* an index over the entities LoadEntities parsed */
+entdict_index_t IndexEntDicts();
+
+/* with an index, entity must be one of the entities it was built from */
+bool EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const entdict_index_t &index);
 bool EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts);
 
+bool EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, const entdict_index_t &index);
 bool EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts);
 
 #endif /* __LIGHT_ENTITIES_H__ */
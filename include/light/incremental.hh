@@ -0,0 +1,56 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_INCREMENTAL_H__
+#define __LIGHT_INCREMENTAL_H__
+
+#include <light/light.hh>
+
+#include <vector>
+
+/*
+ * Incremental relighting (-incremental)
+ *
+ * After each run a state file next to the bsp records every light's
+ * settings and estimated bounds (from EstimateLightVisibility), plus
+ * hashes of the geometry, the global settings and the lighting that was
+ * written. On the next run, only faces whose bounds touch the old or new
+ * bounds of a light that changed are relit; every other face's lightmaps
+ * are copied from the previous lighting data, .lit and .lux.
+ *
+ * Anything the per-light diff can't account for falls back to lighting
+ * every face, so the output always matches a full run.
+ */
+
+/* call before the previous .lit is deleted */
+void Incremental_LoadLightFiles(const char *bspfilename);
+/* call after SetupLights and CheckLitNeeded, before LightWorld */
+void Incremental_Setup(bspdata_t *bspdata, globalconfig_t &cfg, const char *statefilename, int argc, const char **argv);
+/*
+ * -region*: relight only the selected faces (indexed by face number) and
+ * copy every other face's lightmaps from the lighting already in the bsp,
+ * .lit and .lux. Call instead of Incremental_Setup.
+ */
+void Incremental_SetupRegion(bspdata_t *bspdata, const std::vector<uint8_t> &selected);
+/* copies the face's previous lightmaps if it isn't affected; returns false if it needs lighting */
+bool Incremental_CopyFace(const mbsp_t *bsp, int facenum);
+/* call once the new lighting is final */
+void Incremental_SaveState(const mbsp_t *bsp);
+
+#endif /* __LIGHT_INCREMENTAL_H__ */
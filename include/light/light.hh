@@ -31,6 +31,7 @@
 #include <light/trace.hh>
 #include <light/settings.hh>
 
+#include <functional>
 #include <vector>
 #include <map>
 #include <set>
@@ -50,7 +51,6 @@
 
 typedef struct {
     vec3_t color;
-    vec3_t direction;
 } lightsample_t;
 
 static inline float LightSample_Brightness(const vec3_t color) {
@@ -92,6 +92,7 @@ class lightmap_t {
 public:
     int style;
     lightsample_t *samples; // malloc'ed array of numpoints   //FIXME: this is stupid, we shouldn't need to allocate extra data here for -extra4
+    vec3_t *directions;     // likewise, the light's direction for the .lux; null unless one is written
 };
 
 using lightmapdict_t = std::vector<lightmap_t>;
@@ -120,6 +121,7 @@ typedef struct {
     vec_t exactmid[2];
     vec3_t midpoint;
     
+    int oversample; // samples per texel in each direction; -extra/-extra4, or 1 for -adaptiveextra's first pass
     int numpoints;
     vec3_t *points; // malloc'ed array of numpoints
     vec3_t *normals; // malloc'ed array of numpoints
@@ -132,6 +134,12 @@ typedef struct {
      */
     vec_t *occlusion; // malloc'ed array of numpoints
     
+    /*
+     points and normals again as separate x, y, z arrays (numpoints floats
+     each, in one malloc'ed block) for LightFace_EntityContribs
+     */
+    float *soa;
+    
     /* for sphere culling */
     vec3_t origin;
     vec_t radius;
@@ -154,6 +162,12 @@ typedef struct {
     raystream_intersection_t *intersection_stream;
     
     lightmapdict_t lightmapsByStyle;
+    
+    /*
+     -adaptiveextra's first pass: per sample, the XOR of a hash of every
+     light and sun that reached it. Empty otherwise.
+     */
+    std::vector<uint32_t> visibility;
 } lightsurf_t;
 
 /* debug */
@@ -191,6 +205,9 @@ extern int softsamples;
 extern const vec3_t vec3_white;
 extern float surflight_subdivide;
 extern int sunsamples;
+extern int skyrays;
+extern int bouncephotons;
+extern int bouncedepth;
 
 extern int dump_facenum;
 extern bool dump_face;
@@ -279,6 +296,7 @@ public:
     lockable_vec_t dirtMode, dirtDepth, dirtScale, dirtGain, dirtAngle;
     
     lockable_bool_t minlightDirt;   // apply dirt to minlight?
+    lockable_bool_t dirtAdaptive;   // trace a subset of dirt rays first, the rest only where needed
     
     /* phong */
     lockable_bool_t phongallowed;
@@ -310,6 +328,10 @@ public:
     lockable_vec_t sun_deviance;
     lockable_vec3_t sky_surface;
     
+    /* light grid (BSPX LIGHTGRID_OCTREE) */
+    lockable_bool_t lightgrid;
+    lockable_vec3_t lightgrid_dist;
+    
     globalconfig_t() :
         scaledist {"dist", 1.0, 0.0f, 100.0f},
         rangescale {"range", 0.5f, 0.0f, 100.0f},
@@ -330,6 +352,7 @@ public:
         dirtGain {"dirtgain", 1.0f, 0.0f, 100.0f},
         dirtAngle {"dirtangle", 88.0f, 0.0f, 90.0f},
         minlightDirt {"minlight_dirt", false},
+        dirtAdaptive {"dirtadaptive", false},
 
         /* phong */
         phongallowed {"phong", true},
@@ -361,7 +384,11 @@ public:
         sunvec          { strings{"sunlight_mangle", "sun_mangle", "sun_angle"}, 0.0f, -90.0f, 0.0f, vec3_transformer_t::MANGLE_TO_VEC },  /* defaults to straight down */
         sun2vec         { "sun2_mangle", 0.0f, -90.0f, 0.0f, vec3_transformer_t::MANGLE_TO_VEC },  /* defaults to straight down */
         sun_deviance    { "sunlight_penumbra", 0.0f, 0.0f, 180.0f },
-        sky_surface     { strings{"sky_surface", "sun_surface"}, 0, 0, 0} /* arghrad surface lights on sky faces */
+        sky_surface     { strings{"sky_surface", "sun_surface"}, 0, 0, 0}, /* arghrad surface lights on sky faces */
+
+        /* light grid */
+        lightgrid       { "lightgrid", false },
+        lightgrid_dist  { "lightgrid_dist", 32.0f, 32.0f, 32.0f }
     {}
     
     settingsdict_t settings() {
@@ -374,7 +401,7 @@ public:
             &compilerstyle_start,
             &globalDirt,
             &dirtMode, &dirtDepth, &dirtScale, &dirtGain, &dirtAngle,
-            &minlightDirt,
+            &minlightDirt, &dirtAdaptive,
             &phongallowed,
             &bounce, &bouncestyled, &bouncescale, &bouncecolorscale,
             &surflightscale, &surflightbouncescale, &surflightsubdivision, //mxd
@@ -391,7 +418,8 @@ public:
             &sunvec,
             &sun2vec,
             &sun_deviance,
-            &sky_surface
+            &sky_surface,
+            &lightgrid, &lightgrid_dist
         }};
     }
 };
@@ -401,12 +429,24 @@ extern uint8_t *lit_filebase;
 extern uint8_t *lux_filebase;
 
 extern int oversample;
+extern qboolean adaptiveextra;
+extern qboolean progressive;
+extern qboolean previewpass; // -progressive's first pass: single sample, no dirt or bounce
 extern int write_litfile;
 extern int write_luxfile;
 extern qboolean onlyents;
 extern qboolean scaledonly;
 extern surfflags_t *extended_texinfo_flags;
 extern qboolean novisapprox;
+extern bool visapproxpvs;
+extern bool visapproxfastrays;
+extern qboolean sortfaces;
+extern qboolean facebatch;
+extern qboolean pointcache;
+extern int embreequality;
+extern qboolean embreecompact;
+extern qboolean embreecache;
+extern qboolean occludercache;
 extern bool nolights;
 extern bool litonly;
 
@@ -418,7 +458,8 @@ extern char mapfilename[1024];
 lockable_setting_t *FindSetting(std::string name);
 void SetGlobalSetting(std::string name, std::string value, bool cmdline);
 void FixupGlobalSettings(void);
-void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size);
+void GetFileSpace(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+                  uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size);
 void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int lightofs);
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 /**
@@ -427,5 +468,19 @@ const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum);
 //bool Leaf_HasSky(const mbsp_t *bsp, const mleaf_t *leaf); //mxd. Missing definition
 int light_main(int argc, const char **argv);
+void LoadForTracing(const char *source, bspdata_t *bspdata);
+
+/*
+ * For tools that run light in-process (lightpreview): called from the
+ * lighting threads as each face's lightmaps are done, before they're
+ * packed into the bsp. rgb is size samples, each of the face's styles'
+ * lightmaps in turn; it's only valid for the call. Faces copied by
+ * -incremental, -litonly relights and the scaled lightmaps of -lmscale
+ * aren't reported. Pass nullptr to stop; that waits for a call in
+ * progress, so the callback's owner can go away after it returns. The
+ * calls are serialized, keep them short.
+ */
+typedef std::function<void(int facenum, const uint8_t *styles, const uint8_t *rgb, int size)> facelitcallback_t;
+void SetFaceLitCallback(facelitcallback_t callback);
 
 #endif /* __LIGHT_LIGHT_H__ */
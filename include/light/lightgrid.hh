@@ -0,0 +1,51 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_LIGHTGRID_H__
+#define __LIGHT_LIGHTGRID_H__
+
+#include <light/light.hh>
+
+/*
+ * Light grid ("_lightgrid" / -lightgrid)
+ *
+ * Light probes on a regular grid over the world, every "_lightgrid_dist"
+ * units, stored as the BSPX "LIGHTGRID_OCTREE" lump so engines can light
+ * entities with a lookup instead of R_LightPoint. Probes in solid are
+ * marked as such, and octree cells that are all solid are left out.
+ *
+ * Lump layout, little endian:
+ *   float step[3]; int32 size[3]; float mins[3]; uint8 numstyles;
+ *   uint32 rootnode; uint32 numnodes; { int32 mid[3]; uint32 child[8]; } nodes[];
+ *   uint32 numleafs; { int32 mins[3]; int32 size[3]; sample_t samples[]; } leafs[];
+ * where a child is a node index, LGNODE_LEAF | a leaf index or
+ * LGNODE_MISSING, the child for grid index p is
+ * (p.x >= mid.x) << 2 | (p.y >= mid.y) << 1 | (p.z >= mid.z), a leaf's
+ * samples are in x, then y, then z order, and a sample is
+ * uint8 count (255 in solid), then { uint8 style; uint8 rgb[3]; } per style.
+ */
+
+#define LGNODE_LEAF     (1u << 31)
+#define LGNODE_MISSING  (1u << 30)
+#define LGLEAF_SIZE     4           // largest leaf, in probes along each axis
+
+/* call after the final LightWorld, before the BSPX lumps are written */
+void LightGrid(const globalconfig_t &cfg, bspdata_t *bspdata);
+
+#endif /* __LIGHT_LIGHTGRID_H__ */
@@ -46,4 +46,13 @@ typedef struct {
 void WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int version);
 void WriteLuxFile(const mbsp_t *bsp, const char *filename, int version);
 
+/*
+ * Writes the .lit (unless litversion is 0) and the .lux (unless luxversion
+ * is 0) on a background thread, so they overlap with writing the .bsp.
+ * They're written from lit_filebase, lux_filebase and facesup, which must
+ * be left alone until FinishLitFiles, which waits for the writer.
+ */
+void StartLitFiles(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int litversion, int luxversion);
+void FinishLitFiles(void);
+
 #endif /* __LIGHT_LITFILE_H__ */
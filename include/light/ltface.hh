@@ -39,6 +39,7 @@
 #include <limits>
 #include <sstream>
 #include <atomic>
+#include <memory>
 
 extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
@@ -77,9 +78,33 @@ void WorldToTexCoord(const vec3_t world, const gtexinfo_t *tex, vec_t coord[2]);
 void PrintFaceInfo(const bsp2_dface_t *face, const mbsp_t *bsp);
 // FIXME: remove light param. add normal param and dir params.
 vec_t GetLightValue(const globalconfig_t &cfg, const light_t *entity, vec_t dist);
+float GetLightDist(const globalconfig_t &cfg, const light_t *entity, vec_t desiredLight);
 std::map<int, qvec3f> GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal);
+/* per-style lighting for a light probe at origin, as if facing each light */
+std::map<int, qvec3f> GetProbeLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin);
 void SetupDirt(globalconfig_t &cfg);
 float DirtAtPoint(const globalconfig_t &cfg, raystream_intersection_t *rs, const vec3_t point, const vec3_t normal, const modelinfo_t *selfshadow);
-void LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg);
+int64_t LightFace_EstimateCost(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup, const globalconfig_t &cfg);
+bool LightFace_Extents(const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t mins, vec3_t maxs, int *numluxels);
+
+/*
+ * A group of nearby faces from one model that are lit together. Lights
+ * are culled once against the bounds of the whole batch, so each face
+ * only loops over the lights that can reach the batch, and the faces
+ * share ray streams instead of allocating their own.
+ */
+class lightbatch_t {
+public:
+    std::vector<int> facenums;
+    std::vector<const light_t *> lights;
+
+    /* shared ray streams, created by LightFace and sized for streamsize points */
+    std::unique_ptr<raystream_occlusion_t> occlusion_stream;
+    std::unique_ptr<raystream_intersection_t> intersection_stream;
+    int streamsize = 0;
+};
+
+std::vector<lightbatch_t> MakeLightingBatches(const mbsp_t *bsp, const facesup_t *faces_sup, const globalconfig_t &cfg);
+void LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg, lightbatch_t *batch = nullptr);
 
 #endif /* __LIGHT_LTFACE_H__ */
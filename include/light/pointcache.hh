@@ -0,0 +1,47 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_POINTCACHE_H__
+#define __LIGHT_POINTCACHE_H__
+
+#include <light/light.hh>
+
+/*
+ * Sample point cache (-pointcache)
+ *
+ * CalcPoints output (sample positions, normals, occluded flags and the
+ * face each sample ended up on) is saved to a file next to the bsp. The
+ * file is keyed by a hash of the geometry and of every setting CalcPoints
+ * depends on, so a rerun on the same geometry with different lights can
+ * copy the points instead of recalculating them.
+ */
+
+/* call after FindModelInfo and LoadExtendedTexinfoFlags */
+void PointCache_Load(const mbsp_t *bsp, const globalconfig_t &cfg, const char *filename);
+/* writes the cache back if any faces were added to it */
+void PointCache_Save(void);
+
+/* fills in surf's points if cached; surf needs numpoints and its arrays allocated */
+bool PointCache_Lookup(int facenum, lightsurf_t *surf);
+void PointCache_Store(int facenum, const lightsurf_t *surf);
+
+/* hash of the geometry and settings the cache is keyed by */
+uint64_t PointCache_Key(const mbsp_t *bsp, const globalconfig_t &cfg);
+
+#endif /* __LIGHT_POINTCACHE_H__ */
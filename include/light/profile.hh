@@ -0,0 +1,49 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_PROFILE_H__
+#define __LIGHT_PROFILE_H__
+
+#include <light/entities.hh>
+#include <common/timing.hh>
+
+/*
+ * Run profiler (-profile)
+ *
+ * Times each face and each light's share of the rays traced for it, and
+ * counts rays per thread. The expensive lights and faces are logged at the
+ * end, and everything is written to map.lightprofile.json. -profile also
+ * turns on -timingtrace (common/timing.hh), which times the phases and
+ * writes the Chrome trace of the phases and faces. Does nothing unless
+ * -profile is given.
+ */
+
+extern qboolean lightprofile;
+
+/* called by the thread that lit the face */
+void Profile_Face(int facenum, double start, double end);
+/* a light's rays for one face, and the time spent tracing and adding them */
+void Profile_LightRays(const light_t *entity, int rays, double seconds);
+/* rays traced for anything else (local minlight, bounce, surface lights) */
+void Profile_Rays(int rays);
+
+/* logs the summary and writes the json files next to source */
+void Profile_Finish(const char *source);
+
+#endif /* __LIGHT_PROFILE_H__ */
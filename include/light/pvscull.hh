@@ -0,0 +1,64 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_PVSCULL_H__
+#define __LIGHT_PVSCULL_H__
+
+#include <light/light.hh>
+#include <light/entities.hh>
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * PVS light culling (-pvscull)
+ *
+ * Uses the vis data in the bsp to skip the faces a light can't see: a
+ * light only lights the world faces in the leafs potentially visible
+ * from the leafs it's in. It's conservative where the vis data doesn't
+ * say anything: bmodel faces aren't in the leafs, and lights with no
+ * vis data (in solid, or an unvised map) light every face as before.
+ * Suns and sky aren't affected.
+ */
+
+extern bool pvscull;
+
+/* the leaf containing point, in the world model */
+int PVS_LeafAtPoint(const mbsp_t *bsp, const vec3_t point);
+
+/*
+ * Marks the leafs in leafnum's PVS (Q1 leafs, Q2 clusters), and leafnum
+ * itself, in visible, which has a byte per leaf. Returns false without
+ * marking anything if the leaf has no vis data.
+ */
+bool PVS_MarkVisibleLeafs(const mbsp_t *bsp, int leafnum, std::vector<uint8_t> *visible);
+
+/*
+ * The bounds of the leafs potentially visible from the leafs touching the
+ * box point +/- radius. Returns false if any of them has no vis data.
+ */
+bool PVS_VisibleBounds(const mbsp_t *bsp, const vec3_t point, vec_t radius, vec3_t mins, vec3_t maxs);
+
+/* call after SetupLights, before LightWorld */
+void PVSCull_Setup(const mbsp_t *bsp);
+
+/* true if the light can't see the face */
+bool PVSCull_LightCulled(const light_t *entity, int facenum);
+
+#endif /* __LIGHT_PVSCULL_H__ */
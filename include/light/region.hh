@@ -0,0 +1,47 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_REGION_H__
+#define __LIGHT_REGION_H__
+
+#include <light/light.hh>
+
+/*
+ * Region relighting (-regionbox, -regionface, -regionmodel, -regionpvs)
+ *
+ * Relights only the faces in the union of the given regions; every other
+ * face keeps the lightmaps already in the bsp, .lit and .lux (copied by
+ * Incremental_CopyFace). Lights outside the region still light it, so
+ * the relit faces come out as they would in a full run.
+ */
+
+/* called while parsing the command line */
+void Region_AddBox(const vec3_t mins, const vec3_t maxs);
+void Region_AddFace(int facenum);
+/* "*N" or the targetname of a brush entity */
+void Region_AddModel(const char *name);
+/* the faces in leafs potentially visible from point */
+void Region_AddPVS(const vec3_t point);
+
+bool Region_Active(void);
+
+/* call after LoadEntities and FindModelInfo, before LightWorld */
+void Region_Setup(bspdata_t *bspdata);
+
+#endif /* __LIGHT_REGION_H__ */
@@ -23,6 +23,31 @@ See file, 'COPYING', for details.
 
 #include <vector>
 
+/*
+ * A node of a surface light's point tree: the mean of count points and
+ * the radius around it that holds them all. Leaves are single points.
+ */
+typedef struct {
+    qvec3f pos;
+    float radius;
+    int count;
+    int children[2];    // -1 for leaves
+} surflightcluster_t;
+
+/* a cluster standing in for its points, as seen from one sample */
+typedef struct {
+    qvec3f pos;
+    int count;
+} surflightemitter_t;
+
+/*
+ * A cluster is used as a single emitter when its radius is at most this
+ * fraction of its distance from the sample, otherwise it's opened up.
+ * The 1/d^2 falloff over the cluster then differs from that at its
+ * center by a few percent on average.
+ */
+#define SURFLIGHT_CLUSTER_ERROR 0.125f
+
 typedef struct {
     vec3_t pos;
     qvec3f surfnormal;
@@ -32,6 +57,7 @@ typedef struct {
      */
     bool omnidirectional;
     std::vector<qvec3f> points;
+    std::vector<surflightcluster_t> clusters;   // tree over points, root first
 
     // Surface light settings...
     float intensity;       // Surface light strength for each point
@@ -44,7 +70,11 @@ typedef struct {
 } surfacelight_t;
 
 const std::vector<surfacelight_t> &SurfaceLights();
+/* indices of surface lights whose estimated bounds may touch the box, in order */
+std::vector<int> SurfaceLightsTouchingBounds(const vec3_t mins, const vec3_t maxs);
 int TotalSurfacelightPoints();
+/* replaces emitters with the clusters of vpl's points to light origin with */
+void SurfaceLight_Emitters(const surfacelight_t &vpl, const qvec3f &origin, std::vector<surflightemitter_t> *emitters);
 const std::vector<int> &SurfaceLightsForFaceNum(int facenum);
 void MakeSurfaceLights (const globalconfig_t &cfg, const mbsp_t *bsp);
 
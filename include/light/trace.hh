@@ -110,6 +110,8 @@ class raystream_occlusion_t : public virtual raystream_common_t {
 public:
     virtual void tracePushedRaysOcclusion(const modelinfo_t *self) = 0;
     virtual bool getPushedRayOccluded(size_t j) = 0;
+    /* the rays pushed from here to the next group, one light's rays to one face, share an occluder cache */
+    virtual void startOccluderGroup() = 0;
 
     virtual ~raystream_occlusion_t() = default;
 };
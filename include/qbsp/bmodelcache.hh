@@ -0,0 +1,52 @@
+/*
+    Copyright (C) 1996-1997  Id Software, Inc.
+    Copyright (C) 1997       Greg Lewis
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef QBSP_BMODELCACHE_HH
+#define QBSP_BMODELCACHE_HH
+
+#include <cstdint>
+
+/*
+ * -incremental: brush models that didn't change since the last
+ * -incremental compile are reused instead of rebuilt.
+ *
+ * What's kept is the tree BuildEntity made for each brush model and hull,
+ * before anything is exported, so a reused model goes through the same
+ * export as a rebuilt one and the bsp comes out the same. The trees are
+ * kept in mapname.bmc, keyed by a hash of the entity's keys, its brushes
+ * and their textures, plus the options. The world is always rebuilt:
+ * filling the outside depends on every entity.
+ */
+
+/* options is a hash of everything outside the entities that changes a build */
+void BModelCache_Load(const char *filename, uint64_t options);
+void BModelCache_Save(const char *filename);
+
+/* 0 if the entity can't be cached */
+uint64_t BModelCache_Key(const mapentity_t *entity);
+
+/* a rebuilt copy of the tree stored for entity->cachekey and hullnum, or nullptr */
+node_t *BModelCache_Find(mapentity_t *entity, int hullnum);
+
+/* stores the tree BuildEntity made; call before ExportEntity, which consumes it */
+void BModelCache_Add(const mapentity_t *entity, int hullnum, const node_t *nodes);
+
+#endif
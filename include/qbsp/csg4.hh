@@ -22,8 +22,6 @@
 #ifndef QBSP_CSG4_HH
 #define QBSP_CSG4_HH
 
-extern int csgmergefaces;
-
 // build surfaces is also used by GatherNodeFaces
 surface_t *BuildSurfaces(const std::map<int, face_t *> &planefaces);
 face_t *NewFaceFromFace(face_t *in);
@@ -25,8 +25,12 @@
 #include <qbsp/parser.hh>
 
 #include <optional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "tbb/concurrent_vector.h"
+
 typedef struct epair_s {
     struct epair_s *next;
     char *key;
@@ -102,6 +106,8 @@ public:
     int firstoutputfacenumber;
     int outputmodelnumber;
 
+    uint64_t cachekey;          // -incremental, see bmodelcache.hh
+
     const mapbrush_t &mapbrush(int i) const;
     
     mapentity_t() :
@@ -117,13 +123,60 @@ public:
     brushes(nullptr),
     numbrushes(0),
     firstoutputfacenumber(-1),
-    outputmodelnumber(-1) {
+    outputmodelnumber(-1),
+    cachekey(0) {
         VectorSet(origin,0,0,0);
         VectorSet(mins,0,0,0);
         VectorSet(maxs,0,0,0);
     }
 };
 
+struct case_insensitive_hash {
+    std::size_t operator()(const std::string &s) const noexcept {
+        std::size_t hash = 0x811c9dc5;
+        constexpr std::size_t prime = 0x1000193;
+
+        for (auto &c : s) {
+            hash ^= tolower(c);
+            hash *= prime;
+        }
+
+        return hash;
+    }
+};
+
+struct case_insensitive_equal {
+    bool operator()(const std::string &l, const std::string &r) const noexcept {
+        return Q_strcasecmp(l.c_str(), r.c_str()) == 0;
+    }
+};
+
+/* hashes the fields mtexinfo_t::operator== compares */
+struct mtexinfo_hash {
+    std::size_t operator()(const mtexinfo_t &texinfo) const noexcept {
+        std::size_t hash = 0x811c9dc5;
+        constexpr std::size_t prime = 0x1000193;
+        auto mix = [&](uint32_t v) {
+            hash ^= v;
+            hash *= prime;
+        };
+
+        for (const auto &vec : texinfo.vecs) {
+            for (float v : vec) {
+                uint32_t bits;
+                v += 0.0f;      // -0 compares equal to 0, so it must hash the same
+                memcpy(&bits, &v, sizeof(bits));
+                mix(bits);
+            }
+        }
+        mix(texinfo.miptex);
+        mix(texinfo.flags.native);
+        mix(texinfo.flags.extended | (texinfo.flags.phong_angle << 8) | (texinfo.flags.minlight << 16) | (texinfo.flags.light_alpha << 24));
+        mix(texinfo.value);
+        return hash;
+    }
+};
+
 struct texdata_t {
     std::string     name;
     int32_t         flags, value;
@@ -134,15 +187,25 @@ typedef struct mapdata_s {
     std::vector<mapface_t> faces;
     std::vector<mapbrush_t> brushes;
     std::vector<mapentity_t> entities;
-    std::vector<qbsp_plane_t> planes;
+    /* planes and texinfos are appended to while the hulls are being built
+       concurrently, so existing elements must never move */
+    tbb::concurrent_vector<qbsp_plane_t> planes;
     std::vector<texdata_t> miptex;
-    std::vector<mtexinfo_t> mtexinfos;
+    /* indices into `miptex` by name, lowest first */
+    std::unordered_map<std::string, std::vector<int>, case_insensitive_hash, case_insensitive_equal> miptex_lookup;
+    tbb::concurrent_vector<mtexinfo_t> mtexinfos;
     
     /* quick lookup for texinfo */
-    std::map<mtexinfo_t, int> mtexinfo_lookup;
+    std::unordered_map<mtexinfo_t, int, mtexinfo_hash> mtexinfo_lookup;
+    
+    /* map from plane hash code to list of indicies in `planes` vector, guarded by FindPlane */
+    std::unordered_map<uint64_t, std::vector<int>> planehash;
     
-    /* map from plane hash code to list of indicies in `planes` vector */
-    std::unordered_map<int, std::vector<int>> planehash;
+    /* map from clipnode hash to indices in `exported_clipnodes`, for -mergeclipnodes */
+    std::unordered_map<uint64_t, std::vector<int>> clipnodehash;
+    
+    /* misc_external_map files parsed so far, as a range of untransformed `brushes` */
+    std::map<std::string, std::pair<int, int>> external_maps;
     
     /* Number of items currently used */
     int numfaces() const { return faces.size(); };
@@ -177,7 +240,8 @@ typedef struct mapdata_s {
     // bspx data
     std::vector<uint8_t> exported_lmshifts;
     bool needslmshifts = false;
-    std::vector<uint8_t> exported_bspxbrushes;
+    uint8_t *exported_bspxbrushes = nullptr;    // from malloc, WriteBSPFile hands it to the lump
+    size_t exported_bspxbrushessize = 0;
 
     // helpers
     const std::string &miptexTextureName(int mt) const {
@@ -239,19 +303,16 @@ void Entity_SortBrushes(mapentity_t *dst);
 
 
 surface_t *CSGFaces(const mapentity_t *entity);
-void PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum);
+void PortalizeWorld(const mapentity_t *entity, node_t *headnode, node_t *outside_node, const int hullnum);
 void TJunc(const mapentity_t *entity, node_t *headnode);
 node_t *SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit);
 int MakeFaceEdges(mapentity_t *entity, node_t *headnode);
+int GetVertex(mapentity_t *entity, const vec3_t in); /* welds to a vertex already emitted */
 void ExportClipNodes(mapentity_t *entity, node_t *headnode, const int hullnum);
 void ExportDrawNodes(mapentity_t *entity, node_t *headnode, int firstface);
 
-struct bspxbrushes_s {
-    std::vector<uint8_t> lumpdata;
-};
-void BSPX_Brushes_Finalize(struct bspxbrushes_s *ctx);
-void BSPX_Brushes_Init(struct bspxbrushes_s *ctx);
-void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *brushes);
+size_t BSPX_Brushes_ModelSize(const brush_t *brushes);
+void BSPX_Brushes_AddModel(uint8_t *out, int modelnum, const brush_t *brushes);
 
 void ExportObj_Faces(const std::string &filesuffix, const std::vector<const face_t *> &faces);
 void ExportObj_Brushes(const std::string &filesuffix, const std::vector<const brush_t *> &brushes);
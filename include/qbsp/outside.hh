@@ -23,6 +23,6 @@
 #define QBSP_OUTSIDE_HH
 
 node_t *PointInLeaf(node_t *node, const vec3_t point);
-bool FillOutside(node_t *node, const int hullnum);
+bool FillOutside(node_t *node, node_t *outside_node, const int hullnum);
 
 #endif
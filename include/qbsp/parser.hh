@@ -46,6 +46,7 @@ typedef struct parser {
 
 bool ParseToken(parser_t *p, int flags);
 void ParserInit(parser_t *p, const char *data);
+double ParseFloatToken(const parser_t *p);
 
 #ifdef __cplusplus
 }
@@ -29,8 +29,8 @@ typedef struct portal_s {
     winding_t *winding;
 } portal_t;
 
-extern node_t outside_node;     // portals outside the world face this
 
 void FreeAllPortals(node_t *node);
+void ReserveHeadnodePlanes(const mapentity_t *entity);
 
 #endif
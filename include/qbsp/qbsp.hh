@@ -134,6 +134,7 @@ enum {
 
 #include <common/cmdlib.hh>
 #include <common/mathlib.hh>
+#include <common/timing.hh>
 #include <qbsp/winding.hh>
 
 using stvecs = std::array<std::array<float, 4>, 2>;
@@ -156,6 +157,10 @@ typedef struct mtexinfo_s {
     constexpr bool operator>(const mtexinfo_s &other) const {
         return as_tuple() > other.as_tuple();
     }
+
+    constexpr bool operator==(const mtexinfo_s &other) const {
+        return as_tuple() == other.as_tuple();
+    }
 } mtexinfo_t;
 
 typedef struct visfacet_s {
@@ -299,11 +304,14 @@ public:
     bool fOmitDetailIllusionary;
     bool fOmitDetailFence;
     bool fForcePRT1;
+    bool fBinaryPRT;
     bool fTestExpand;
     bool fLeakTest;
     bool fContentHack;
     vec_t worldExtent;
     bool fNoThreads;
+    bool fIncremental;
+    bool fMergeClipnodes;
 
     options_t() :
     fNofill(false),
@@ -340,11 +348,14 @@ public:
     fOmitDetailIllusionary(false),
     fOmitDetailFence(false),
     fForcePRT1(false),
+    fBinaryPRT(false),
     fTestExpand(false),
     fLeakTest(false),
     fContentHack(false),
     worldExtent(65536.0f),
-    fNoThreads(false) {}
+    fNoThreads(false),
+    fIncremental(false),
+    fMergeClipnodes(false) {}
 };
 
 extern options_t options;
@@ -27,6 +27,9 @@
 extern std::atomic<int> splitnodes;
 
 void DetailToSolid(node_t *node);
+/* moves a finished tree into one block, returning the new headnode */
+node_t *CompactTree(node_t *headnode);
+void FreeTree(node_t *headnode);
 const char *GetContentsName( const contentflags_t &Contents );
 void DivideFacet(face_t *in, qbsp_plane_t *split, face_t **front, face_t **back);
 void CalcSurfaceInfo(surface_t *surf);
@@ -33,6 +33,21 @@
 extern const char *rgszWarnings[cWarnings];
 
 void *AllocMem(int Type, int cSize, bool fZero);
+void FreeMem(void *pMem);
+
+/* Set on threads building a clipping hull alongside hull 0, drops their
+   stat, progress and percent messages so they don't interleave */
+extern thread_local bool fQuietThread;
+
+/* Message's verbosity on this thread while in scope, in place of
+   options.fVerbose, so hulls built at the same time each keep their own */
+class verbosescope_t {
+public:
+    explicit verbosescope_t(bool verbose);
+    ~verbosescope_t();
+private:
+    int previous;
+};
 
 void Message(int MsgType, ...);
 [[noreturn]] void Error(const char *error, ...)
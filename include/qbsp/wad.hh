@@ -25,6 +25,7 @@
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <string>
 
 // Texture data stored for quick searching
 struct texture_t {
@@ -49,32 +50,15 @@ struct lumpinfo_t {
     char name[16];              // must be null terminated
 };
 
-struct case_insensitive_hash {
-    std::size_t operator()(const std::string &s) const noexcept {
-        std::size_t hash = 0x811c9dc5;
-        constexpr std::size_t prime = 0x1000193;
-
-        for (auto &c : s) {
-            hash ^= tolower(c);
-            hash *= prime;
-        }
-
-        return hash;
-    }
-};
-
-struct case_insensitive_equal {
-    bool operator()(const std::string &l, const std::string &r) const noexcept {
-        return Q_strcasecmp(l.c_str(), r.c_str()) == 0;
-    }
-};
-
 struct wad_t {
     wadinfo_t header;
     int version;
+    bool external = false;          // mips aren't embedded in the bsp
+    bool texturesloaded = false;    // lump sizes and `textures` filled in, see WAD_LoadTextureInfo
     std::unordered_map<std::string, lumpinfo_t, case_insensitive_hash, case_insensitive_equal> lumps;
     std::unordered_map<std::string, texture_t, case_insensitive_hash, case_insensitive_equal> textures;
     FILE *file;
+    std::string path;               // as opened, for the compile cache key
 
     ~wad_t() {
         if (file) {
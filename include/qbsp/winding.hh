@@ -41,8 +41,11 @@ winding_t *CopyWinding(const winding_t *w);
 void CopyWindingInto(winding_t *dest, const winding_t *src); // FIXME: get rid of this
 winding_t *FlipWinding(const winding_t *w);
 winding_t *ClipWinding(winding_t *in, const qbsp_plane_t *split, bool keepon);
+bool ClipWindingInto(const winding_t *in, const qbsp_plane_t *split, bool keepon, winding_t *out);
 void DivideWinding(const winding_t *in, const qbsp_plane_t *split, winding_t **front,
                    winding_t **back);
+void DivideWindingInto(const winding_t *in, const qbsp_plane_t *split, winding_t *front,
+                       winding_t *back);
 void MidpointWinding(const winding_t *w, vec3_t v);
 
 /* Helper function for ClipWinding and it's variants */
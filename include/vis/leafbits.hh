@@ -81,4 +81,143 @@ LeafbitsSize(int numleafs)
 	return sizeof(leafbits_t) + (sizeof(leafblock_t) * numblocks);
 }
 
+/*
+ * Bulk operations over whole leafbits arrays, used by the flow loops.
+ * They work a vector at a time where the target has SSE2, AVX2 or NEON
+ * and finish (or do everything) one leafblock_t at a time otherwise.
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i leafvec_t;
+#define LEAFVEC_LOAD(p)         _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))
+#define LEAFVEC_STORE(p, v)     _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v)
+#define LEAFVEC_ZERO()          _mm256_setzero_si256()
+#define LEAFVEC_AND(a, b)       _mm256_and_si256(a, b)
+#define LEAFVEC_OR(a, b)        _mm256_or_si256(a, b)
+#define LEAFVEC_ANDNOT(a, b)    _mm256_andnot_si256(b, a)  /* a & ~b */
+#define LEAFVEC_ANY(v)          (!_mm256_testz_si256(v, v))
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+typedef __m128i leafvec_t;
+#define LEAFVEC_LOAD(p)         _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))
+#define LEAFVEC_STORE(p, v)     _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v)
+#define LEAFVEC_ZERO()          _mm_setzero_si128()
+#define LEAFVEC_AND(a, b)       _mm_and_si128(a, b)
+#define LEAFVEC_OR(a, b)        _mm_or_si128(a, b)
+#define LEAFVEC_ANDNOT(a, b)    _mm_andnot_si128(b, a)     /* a & ~b */
+#define LEAFVEC_ANY(v)          (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+typedef uint32x4_t leafvec_t;
+#define LEAFVEC_LOAD(p)         vld1q_u32(reinterpret_cast<const uint32_t *>(p))
+#define LEAFVEC_STORE(p, v)     vst1q_u32(reinterpret_cast<uint32_t *>(p), v)
+#define LEAFVEC_ZERO()          vdupq_n_u32(0)
+#define LEAFVEC_AND(a, b)       vandq_u32(a, b)
+#define LEAFVEC_OR(a, b)        vorrq_u32(a, b)
+#define LEAFVEC_ANDNOT(a, b)    vbicq_u32(a, b)            /* a & ~b */
+#define LEAFVEC_ANY(v)          ((vgetq_lane_u64(vreinterpretq_u64_u32(v), 0) | \
+                                  vgetq_lane_u64(vreinterpretq_u64_u32(v), 1)) != 0)
+#endif
+
+#ifdef LEAFVEC_LOAD
+#define LEAFVEC_BLOCKS (static_cast<int>(sizeof(leafvec_t) / sizeof(leafblock_t)))
+#endif
+
+static inline int
+LeafbitsBlocks(int numleafs)
+{
+    return (numleafs + LEAFMASK) >> LEAFSHIFT;
+}
+
+/*
+ * dst = a & b. Returns true if dst has any bits that aren't in seen.
+ */
+static inline bool
+IntersectLeafBits(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b,
+                  const leafblock_t *seen, int numblocks)
+{
+    int i = 0;
+    bool more = false;
+
+#ifdef LEAFVEC_LOAD
+    leafvec_t vmore = LEAFVEC_ZERO();
+    for (; i + LEAFVEC_BLOCKS <= numblocks; i += LEAFVEC_BLOCKS) {
+        const leafvec_t v = LEAFVEC_AND(LEAFVEC_LOAD(a + i), LEAFVEC_LOAD(b + i));
+        LEAFVEC_STORE(dst + i, v);
+        vmore = LEAFVEC_OR(vmore, LEAFVEC_ANDNOT(v, LEAFVEC_LOAD(seen + i)));
+    }
+    more = LEAFVEC_ANY(vmore);
+#endif
+
+    leafblock_t tail = 0;
+    for (; i < numblocks; i++) {
+        dst[i] = a[i] & b[i];
+        tail |= dst[i] & ~seen[i];
+    }
+
+    return more || tail;
+}
+
+/* dst |= src */
+static inline void
+MergeLeafBits(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    int i = 0;
+
+#ifdef LEAFVEC_LOAD
+    for (; i + LEAFVEC_BLOCKS <= numblocks; i += LEAFVEC_BLOCKS)
+        LEAFVEC_STORE(dst + i, LEAFVEC_OR(LEAFVEC_LOAD(dst + i), LEAFVEC_LOAD(src + i)));
+#endif
+
+    for (; i < numblocks; i++)
+        dst[i] |= src[i];
+}
+
+/* Returns true if a has any bits that aren't in b (a & ~b is non-zero) */
+static inline bool
+LeafBitsOutside(const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    int i = 0;
+
+#ifdef LEAFVEC_LOAD
+    /* test a few vectors at a time so an early hit still exits early */
+    for (; i + 4 * LEAFVEC_BLOCKS <= numblocks; i += 4 * LEAFVEC_BLOCKS) {
+        leafvec_t v = LEAFVEC_ANDNOT(LEAFVEC_LOAD(a + i), LEAFVEC_LOAD(b + i));
+        for (int k = 1; k < 4; k++) {
+            const int j = i + k * LEAFVEC_BLOCKS;
+            v = LEAFVEC_OR(v, LEAFVEC_ANDNOT(LEAFVEC_LOAD(a + j), LEAFVEC_LOAD(b + j)));
+        }
+        if (LEAFVEC_ANY(v))
+            return true;
+    }
+#endif
+
+    for (; i < numblocks; i++) {
+        if (a[i] & ~b[i])
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Scalar even with vectors available: the compiler's popcount is a
+ * single instruction where the target has one, which beats doing it
+ * with SSE2/NEON shuffles for arrays this size.
+ */
+static inline int
+CountLeafBits(const leafblock_t *bits, int numblocks)
+{
+    int count = 0;
+
+    for (int i = 0; i < numblocks; i++) {
+#ifdef __GNUC__
+        count += __builtin_popcountl(bits[i]);
+#else
+        for (leafblock_t block = bits[i]; block; block &= block - 1)
+            count++;
+#endif
+    }
+    return count;
+}
+
 #endif /* VIS_LEAFBITS_H */
@@ -19,6 +19,8 @@
 
 // vis.h
 
+#include <vector>
+
 #include <common/cmdlib.hh>
 #include <common/mathlib.hh>
 #include <common/bspfile.hh>
@@ -27,6 +29,8 @@
 #define  PORTALFILE  "PRT1"
 #define  PORTALFILE2 "PRT2"
 #define  PORTALFILEAM "PRT1-AM"
+#define  PORTALFILEBIN "PRTB"     // qbsp -binaryprt
+#define  PORTALFILEBIN_VERSION 1
 #define  ON_EPSILON  0.1
 #define  EQUAL_EPSILON 0.001
 
@@ -43,6 +47,7 @@ typedef struct {
 winding_t *NewWinding(int points);
 winding_t *CopyWinding(const winding_t *w);
 void PlaneFromWinding(const winding_t *w, plane_t *plane);
+void SetWindingSphere(winding_t *w);
 qboolean PlaneCompare(plane_t *p1, plane_t *p2);
 
 typedef enum { pstat_none = 0, pstat_working, pstat_done } pstatus_t;
@@ -53,7 +58,9 @@ typedef struct {
     winding_t *winding;
     pstatus_t status;
     leafbits_t *visbits;
-    leafbits_t *mightsee;
+    leafbits_t *mightsee;       // NULL once done, see packedmight
+    uint8_t *packedmight;       // mightsee of a done portal, compressed
+    int packedmightlen;
     int nummightsee;
     int numcansee;
 } portal_t;
@@ -81,12 +88,26 @@ typedef struct leaf_s {
 
 #define MAX_SEPARATORS MAX_WINDING
 #define STACK_WINDINGS 3        // source, pass and a temp for clipping
+
+/*
+ * Scratch memory for one level of RecursiveLeafFlow. Each thread keeps
+ * an arena of these indexed by recursion depth and reuses it for every
+ * portal it flows, so deep recursion keeps working in the same few
+ * blocks instead of fresh stack frames and a malloc per leaf.
+ */
+typedef struct {
+    winding_t windings[STACK_WINDINGS]; // Fixed size windings
+    leafbits_t *mightsee;
+    size_t mightseesize;        // bytes allocated for mightsee
+} stacklevel_t;
+
 typedef struct pstack_s {
     struct pstack_s *next;
     leaf_t *leaf;
     portal_t *portal;           // portal exiting
+    int depth;
     winding_t *source, *pass;
-    winding_t windings[STACK_WINDINGS]; // Fixed size windings
+    winding_t *windings;        // STACK_WINDINGS, from the thread's arena
     int freewindings[STACK_WINDINGS];
     plane_t portalplane;
     leafbits_t *mightsee;       // bit string
@@ -97,13 +118,29 @@ typedef struct pstack_s {
 winding_t *AllocStackWinding(pstack_t *stack);
 void FreeStackWinding(winding_t *w, pstack_t *stack);
 winding_t *ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split);
+winding_t *ClipToSeperators(const winding_t *source, const plane_t src_pl,
+                            const winding_t *pass, winding_t *target, unsigned int test,
+                            pstack_t *stack);
+
+/* ClipStackWinding calls made on this thread, for -stats */
+extern thread_local int64_t c_clipstackwinding;
 
 typedef struct {
     leafbits_t *leafvis;
     portal_t *base;
     pstack_t pstack_head;
+    int numcansee;
+    int branch;         /* if >= 0, only flow through this portal of the first leaf */
+    int64_t numclips;   /* ClipStackWinding calls, for -stats */
+    int maxdepth;
 } threaddata_t;
 
+/* what flowing one portal took, for -stats */
+typedef struct {
+    int64_t clips;
+    int depth;
+} flowstats_t;
+
 extern int numportals;
 extern int portalleafs;
 extern int portalleafs_real;
@@ -126,6 +163,11 @@ extern qboolean ambientslime;
 extern qboolean ambientlava;
 extern int visdist;
 extern qboolean nostate;
+extern qboolean visincremental;
+extern qboolean viscoordinator;
+extern qboolean visworker;
+extern int jobsize;
+extern int jobtimeout;
 
 extern uint8_t *uncompressed;
 extern int leafbytes;
@@ -136,18 +178,54 @@ extern char sourcefile[1024];
 extern char portalfile[1024];
 extern char statefile[1024];
 extern char statetmpfile[1024];
+extern char visgeometryfile[1024];
 
 void BasePortalVis(void);
 
-void PortalFlow(portal_t *p);
+void PortalFlow(portal_t *p, flowstats_t *stats);
+void QueuePortals(const std::vector<int> &portalnums);
+int PortalsQueued(void);
+void PortalCompleted(portal_t *completed);
+void *LeafThread(void *arg);
 
+void LoadPortals(char *name, mbsp_t *bsp);
 void CalcAmbientSounds(mbsp_t *bsp);
 
 extern double starttime, endtime, statetime;
+extern double stateinterval;
+
+void PackMightsee(portal_t *p);
+void UnpackMightsee(const portal_t *p, leafbits_t *out);
+
+/* bytes held by portal mightsee and visbits, for the high-water mark */
+void CountPortalMemory(int64_t bytes);
+int64_t PortalMemoryPeak(void);
 
 void SaveVisState(void);
 qboolean LoadVisState(void);
+void StartVisJournal(void);
+void StopVisJournal(void);
+void JournalPortal(int portalnum);
+void CheckpointVisState(void);
+
+/* -incremental, see state.cc */
+void LoadIncrementalVisState(void);
+void SavePortalResults(const char *filename, const std::vector<int> &portalnums);
+qboolean LoadPortalResults(const char *filename, std::vector<int> *loaded);
+
+/* throughput statistics (-stats), see visstats.cc */
+extern qboolean visstats;
+void StartVisStats(void);
+void VisStatsPortalFlowed(const portal_t *p, double seconds, const flowstats_t *flow);
+void ReportVisStats(void);
+void FinishVisStats(void);
+
+/* distributed vis, see distvis.cc */
+void RunVisCoordinator(void);
+void RunVisWorker(void);
 
 /* Print winding/leaf info for debugging */
 void LogWinding(const winding_t *w);
 void LogLeaf(const leaf_t *leaf);
+
+int vis_main(int argc, char **argv);
@@ -0,0 +1,150 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Micro-benchmarks for light's shadow rays. They trace against a real
+ * map, so they need one:
+ *
+ *     benchlight -bsp e1m1.bsp [microbench options]
+ *
+ * See include/common/microbench.hh for the other options.
+ */
+
+#include <light/light.hh>
+#include <light/trace.hh>
+#ifdef HAVE_EMBREE
+#include <light/trace_embree.hh>
+#endif
+#include <common/microbench.hh>
+
+#include <array>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#define BENCH_BATCH 1024        // rays per iteration
+
+typedef struct {
+    vec3_t start, stop;
+} benchray_t;
+
+static bspdata_t benchbspdata;
+static std::vector<benchray_t> benchrays;
+
+/*
+ * Rays from just in front of one face's center to just in front of
+ * another's, like the rays from lightmap samples to lights, about half
+ * of which are blocked on a typical map.
+ */
+static void
+BenchMakeRays(const mbsp_t *bsp)
+{
+    std::vector<std::array<vec_t, 3>> points;
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        polylib::winding_t *w = polylib::WindingFromFace(bsp, face);
+        vec3_t center, normal;
+        polylib::WindingCenter(w, center);
+        free(w);
+
+        VectorCopy(bsp->dplanes[face->planenum].normal, normal);
+        if (face->side)
+            VectorInverse(normal);
+        VectorMA(center, 1, normal, center);
+        points.push_back({ center[0], center[1], center[2] });
+    }
+    if (points.size() < 2)
+        Error("%s: the bsp has no faces to trace between", __func__);
+
+    std::mt19937 rng(1234);
+    benchrays.resize(BENCH_BATCH);
+    for (benchray_t &ray : benchrays) {
+        VectorCopy(points[rng() % points.size()].data(), ray.start);
+        VectorCopy(points[rng() % points.size()].data(), ray.stop);
+    }
+}
+
+#ifdef HAVE_EMBREE
+/* one rtcOccluded1 call per ray */
+static void
+Bench_Embree_TestLight(microbench_state_t &state)
+{
+    const modelinfo_t *self = ModelInfoForModel(&benchbspdata.data.mbsp, 0);
+
+    while (state.keepRunning()) {
+        int blocked = 0;
+        for (const benchray_t &ray : benchrays)
+            blocked += Embree_TestLight(ray.start, ray.stop, self).blocked;
+        Microbench_DoNotOptimize(blocked);
+    }
+    state.setItemsProcessed(benchrays.size());
+}
+#endif
+
+/* the same rays traced as one stream, as LightFace does */
+static void
+Bench_OcclusionRayStream(microbench_state_t &state)
+{
+    const modelinfo_t *self = ModelInfoForModel(&benchbspdata.data.mbsp, 0);
+    std::unique_ptr<raystream_occlusion_t> stream(MakeOcclusionRayStream(BENCH_BATCH));
+
+    std::vector<std::array<vec_t, 3>> dirs(benchrays.size());
+    std::vector<vec_t> dists(benchrays.size());
+    for (size_t i = 0; i < benchrays.size(); i++) {
+        VectorSubtract(benchrays[i].stop, benchrays[i].start, dirs[i].data());
+        dists[i] = VectorNormalize(dirs[i].data());
+    }
+
+    while (state.keepRunning()) {
+        stream->clearPushedRays();
+        for (size_t i = 0; i < benchrays.size(); i++)
+            stream->pushRay(static_cast<int>(i), benchrays[i].start, dirs[i].data(), dists[i]);
+        stream->tracePushedRaysOcclusion(self);
+        Microbench_DoNotOptimize(stream->getPushedRayOccluded(0));
+    }
+    state.setItemsProcessed(benchrays.size());
+}
+
+int main(int argc, const char **argv)
+{
+    const char *bspfile = nullptr;
+    std::vector<const char *> args;
+
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-bsp") && i + 1 < argc)
+            bspfile = argv[++i];
+        else
+            args.push_back(argv[i]);
+    }
+
+    if (!bspfile) {
+        printf("usage: %s -bsp file.bsp [microbench options]\n", argv[0]);
+        return 1;
+    }
+
+    LoadForTracing(bspfile, &benchbspdata);
+    BenchMakeRays(&benchbspdata.data.mbsp);
+#ifdef HAVE_EMBREE
+    Microbench_List().push_back({ "Embree_TestLight", Bench_Embree_TestLight });
+#endif
+    Microbench_List().push_back({ "OcclusionRayStream", Bench_OcclusionRayStream });
+
+    return Microbench_Main(static_cast<int>(args.size()), args.data());
+}
@@ -26,17 +26,21 @@
 #include <light/light.hh>
 #include <light/bounce.hh>
 #include <light/ltface.hh>
+#include <light/trace.hh>
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
+#include <common/octree.hh>
 
 #include <memory>
+#include <numeric>
 #include <vector>
 #include <map>
 #include <unordered_map>
 #include <set>
 #include <algorithm>
 #include <mutex>
+#include <random>
 #include <string>
 
 #include <common/qvec.hh>
@@ -48,10 +52,12 @@ mutex radlights_lock;
 map<string, qvec3f> texturecolors;
 static std::vector<bouncelight_t> radlights;
 std::map<int, std::vector<int>> radlightsByFacenum;
+/* indices into radlights by estimated bounds, only built when using visapprox */
+static std::unique_ptr<octree_t<int>> radlights_octree;
 
 class patch_t {
 public:
-    winding_t *w;
+    const winding_t *w;
     vec3_t center;
     vec3_t samplepoint; // 1 unit above center
     plane_t plane;
@@ -59,7 +65,7 @@ public:
 };
 
 static unique_ptr<patch_t>
-MakePatch (const mbsp_t *bsp, const globalconfig_t &cfg, winding_t *w)
+MakePatch (const mbsp_t *bsp, const globalconfig_t &cfg, const winding_t *w)
 {
     unique_ptr<patch_t> p { new patch_t };
     p->w = w;
@@ -83,18 +89,6 @@ struct make_bounce_lights_args_t {
     const globalconfig_t *cfg;
 };
 
-struct save_winding_args_t {
-    vector<unique_ptr<patch_t>> *patches;
-    const mbsp_t *bsp;
-    const globalconfig_t *cfg;
-};
-
-static void SaveWindingFn(winding_t *w, void *userinfo)
-{
-    save_winding_args_t *args = static_cast<save_winding_args_t *>(userinfo);
-    args->patches->push_back(MakePatch(args->bsp, *args->cfg, w));
-}
-
 static bool
 Face_ShouldBounce(const mbsp_t *bsp, const bsp2_dface_t *face)
 {
@@ -134,6 +128,20 @@ Face_LookupTextureColor(const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t colo
     }
 }
 
+/* the colour a face reflects, in [0,255] */
+static void
+Face_BounceColor(const mbsp_t *bsp, const globalconfig_t &cfg, const bsp2_dface_t *face, vec3_t blendedcolor)
+{
+    vec3_t texturecolor;
+    Face_LookupTextureColor(bsp, face, texturecolor);
+    
+    // lerp between gray and the texture color according to `bouncecolorscale`
+    const vec3_t gray = {127, 127, 127};
+    VectorSet(blendedcolor, 0, 0, 0);
+    VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
+    VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
+}
+
 static void
 AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, const vec3_t surfnormal, vec_t area, const bsp2_dface_t *face, const mbsp_t *bsp);
 
@@ -142,6 +150,8 @@ MakeBounceLightsThread (void *arg)
 {
     const mbsp_t *bsp = static_cast<make_bounce_lights_args_t *>(arg)->bsp;
     const globalconfig_t &cfg = *static_cast<make_bounce_lights_args_t *>(arg)->cfg;
+    // reused for every face, the patches point into it
+    vector<winding_buf_t> diced;
     
     while (1) {
         int i = GetThreadWork();
@@ -156,7 +166,9 @@ MakeBounceLightsThread (void *arg)
         
         vector<unique_ptr<patch_t>> patches;
         
-        winding_t *winding = WindingFromFace(bsp, face);
+        winding_buf_t facewinding;
+        WindingFromFaceBuf(bsp, face, &facewinding);
+        const winding_t *winding = facewinding.get();
         // grab some info about the face winding
         const float facearea = WindingArea(winding);
         
@@ -167,13 +179,11 @@ MakeBounceLightsThread (void *arg)
         WindingCenter(winding, facemidpoint);
         VectorMA(facemidpoint, 1, faceplane.normal, facemidpoint); // lift 1 unit
         
-        save_winding_args_t args;
-        args.patches = &patches;
-        args.bsp = bsp;
-        args.cfg = &cfg;
-        
-        DiceWinding(winding, 64.0f, SaveWindingFn, &args);
-        winding = nullptr; // DiceWinding frees winding
+        diced.clear();
+        DiceWindingBuf(winding, 64.0f, &diced);
+        for (const winding_buf_t &piece : diced) {
+            patches.push_back(MakePatch(bsp, cfg, piece.get()));
+        }
         
         // average them, area weighted
         map<int, qvec3f> sum;
@@ -198,14 +208,8 @@ MakeBounceLightsThread (void *arg)
             continue;
         }
     
-        vec3_t texturecolor;
-        Face_LookupTextureColor(bsp, face, texturecolor);
-        
-        // lerp between gray and the texture color according to `bouncecolorscale`
-        const vec3_t gray = {127, 127, 127};
-        vec3_t blendedcolor = {0, 0, 0};
-        VectorMA(blendedcolor, cfg.bouncecolorscale.floatValue(), texturecolor, blendedcolor);
-        VectorMA(blendedcolor, 1-cfg.bouncecolorscale.floatValue(), gray, blendedcolor);
+        vec3_t blendedcolor;
+        Face_BounceColor(bsp, cfg, face, blendedcolor);
         
         // final colors to emit
         map<int, qvec3f> emitcolors;
@@ -269,6 +273,19 @@ const std::vector<bouncelight_t> &BounceLights()
     return radlights;
 }
 
+std::vector<int> BounceLightsTouchingBounds(const vec3_t mins, const vec3_t maxs)
+{
+    if (!radlights_octree) {
+        std::vector<int> result(radlights.size());
+        std::iota(result.begin(), result.end(), 0);
+        return result;
+    }
+
+    /* pad the query, AABBsDisjoint allows a small overlap tolerance */
+    const qvec3f pad(0.01f, 0.01f, 0.01f);
+    return radlights_octree->queryTouchingBBox(aabb3f(vec3_t_to_glm(mins) - pad, vec3_t_to_glm(maxs) + pad));
+}
+
 const std::vector<int> &BounceLightsForFaceNum(int facenum)
 {
     const auto &vec = radlightsByFacenum.find(facenum);
@@ -309,17 +326,28 @@ MakeTextureColors (const mbsp_t *bsp)
     if (!bsp->rgbatexdatasize) //mxd. dtexdata -> drgbatexdata
         return;
     
-    for (int i = 0; i<bsp->drgbatexdata->nummiptex; i++) {
+    const int nummiptex = bsp->drgbatexdata->nummiptex;
+    std::vector<qvec3f> colors(nummiptex);
+
+    RunThreadsOn(0, nummiptex, 1, [&](int i, int thread) {
+        const int ofs = bsp->drgbatexdata->dataofs[i];
+        if (ofs < 0)
+            return;
+
+        const rgba_miptex_t *miptex = (rgba_miptex_t *)((uint8_t *)bsp->drgbatexdata + ofs);
+        colors[i] = Texture_AvgColor(bsp, miptex);
+    });
+
+    for (int i = 0; i<nummiptex; i++) {
         const int ofs = bsp->drgbatexdata->dataofs[i];
         if (ofs < 0)
             continue;
         
         const rgba_miptex_t *miptex = (rgba_miptex_t *)((uint8_t *)bsp->drgbatexdata + ofs);
         const string name { miptex->name };
-        const qvec3f color = Texture_AvgColor(bsp, miptex);
         
-//      printf("%s has color %s\n", name.c_str(), VecStr(color));
-        texturecolors[name] = color;
+//      printf("%s has color %s\n", name.c_str(), VecStr(colors[i]));
+        texturecolors[name] = colors[i];
     }
 }
 
@@ -328,9 +356,310 @@ MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp)
 {
     logprint("--- MakeBounceLights ---\n");
     
+    /* -watch remakes them when the lights change */
+    radlights.clear();
+    radlightsByFacenum.clear();
+    
     make_bounce_lights_args_t args { bsp, &cfg }; //mxd. https://clang.llvm.org/extra/clang-tidy/checks/cppcoreguidelines-pro-type-member-init.html
     
     RunThreadsOn(0, bsp->numfaces, MakeBounceLightsThread, (void *)&args);
 
+    radlights_octree.reset();
+    if (!novisapprox) {
+        std::vector<std::pair<aabb3f, int>> objects;
+        objects.reserve(radlights.size());
+        for (int i = 0; i < static_cast<int>(radlights.size()); i++)
+            objects.emplace_back(aabb3f(vec3_t_to_glm(radlights[i].mins), vec3_t_to_glm(radlights[i].maxs)), i);
+        radlights_octree = std::make_unique<octree_t<int>>(makeOctree(objects));
+    }
+
     logprint("%d bounce lights created\n", static_cast<int>(radlights.size()));
+
+    if (bouncephotons > 0)
+        MakePhotonMap(cfg, bsp);
+}
+
+/*
+ * ============================================================================
+ * PHOTON MAP (-bouncephotons)
+ *
+ * Instead of every sample gathering from every bounce light with an
+ * occlusion ray, the bounce lights shoot photons into the map, photons
+ * that land on bouncing faces are re-emitted for -bouncedepth bounces,
+ * and each sample estimates its indirect light from the photons nearest
+ * to it. Cost follows the photon count rather than samples x bounce lights.
+ * ============================================================================
+ */
+
+struct photon_t {
+    qvec3f pos;
+    qvec3f dir;    // direction of travel
+    qvec3f normal; // of the face it landed on
+    qvec3f power;  // [0,255] irradiance units x area
+    int style;
+};
+
+/* photons stored as an implicit kd-tree: each subrange's median splits it on axis depth % 3 */
+static std::vector<photon_t> photons;
+
+#define PHOTON_BATCH 1024
+
+static void
+PhotonMap_BuildTree(size_t begin, size_t end, int depth)
+{
+    if (end - begin <= 1)
+        return;
+    
+    const int axis = depth % 3;
+    const size_t mid = begin + (end - begin) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end,
+                     [axis](const photon_t &a, const photon_t &b) { return a.pos[axis] < b.pos[axis]; });
+    PhotonMap_BuildTree(begin, mid, depth + 1);
+    PhotonMap_BuildTree(mid + 1, end, depth + 1);
+}
+
+/* cosine-weighted direction around `normal` */
+static qvec3f
+CosineSampleHemisphere(const qvec3f &normal, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    const float r1 = uniform(rng);
+    const float r2 = uniform(rng);
+    const float phi = 2.0f * Q_PI * r1;
+    const float sinTheta = sqrt(r2);
+    const float cosTheta = sqrt(1.0f - r2);
+    
+    const qvec3f helper = (fabs(normal[0]) < 0.9f) ? qvec3f(1, 0, 0) : qvec3f(0, 1, 0);
+    const qvec3f tangent = qv::normalize(qv::cross(normal, helper));
+    const qvec3f bitangent = qv::cross(normal, tangent);
+    
+    return tangent * (cos(phi) * sinTheta) + bitangent * (sin(phi) * sinTheta) + normal * cosTheta;
+}
+
+/* uniform point on a convex polygon, by area-weighted fan triangle */
+static qvec3f
+SamplePolygon(const std::vector<qvec3f> &poly, const std::vector<float> &fanareas, float totalarea, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    float pick = uniform(rng) * totalarea;
+    size_t tri = 0;
+    for (; tri + 1 < fanareas.size(); tri++) {
+        if (pick < fanareas[tri])
+            break;
+        pick -= fanareas[tri];
+    }
+    
+    float u = uniform(rng);
+    float v = uniform(rng);
+    if (u + v > 1.0f) {
+        u = 1.0f - u;
+        v = 1.0f - v;
+    }
+    const qvec3f &p0 = poly[0];
+    return p0 + (poly[tri + 1] - p0) * u + (poly[tri + 2] - p0) * v;
+}
+
+struct photonemitter_t {
+    int vpl;
+    int style;
+    int count;
+};
+
+/*
+ * Shoots one emitter's photons and follows them for -bouncedepth bounces.
+ * Seeded by emitter index, so the map doesn't depend on thread timing.
+ */
+static std::vector<photon_t>
+PhotonMap_Emit(const globalconfig_t &cfg, const mbsp_t *bsp, const photonemitter_t &emitter, int index)
+{
+    std::vector<photon_t> result;
+    std::mt19937 rng(static_cast<uint32_t>(index));
+    
+    const bouncelight_t &vpl = radlights[emitter.vpl];
+    if (vpl.poly.size() < 3)
+        return result;
+    
+    std::vector<float> fanareas;
+    float totalarea = 0;
+    for (size_t i = 2; i < vpl.poly.size(); i++) {
+        fanareas.push_back(GLM_TriangleArea(vpl.poly[0], vpl.poly[i - 1], vpl.poly[i]));
+        totalarea += fanareas.back();
+    }
+    if (totalarea <= 0)
+        return result;
+    
+    /*
+     * bounce lights light a sample with color * area * 255 * bouncescale * cos * cos / dist^2,
+     * i.e. a lambertian emitter of flux pi * color * 255 * bouncescale * area
+     */
+    const qvec3f flux = vpl.colorByStyle.at(emitter.style) * (Q_PI * 255.0f * cfg.bouncescale.floatValue() * vpl.area);
+    
+    struct path_t {
+        qvec3f origin, dir, power;
+    };
+    std::vector<path_t> paths;
+    for (int i = 0; i < emitter.count; i++) {
+        const qvec3f origin = SamplePolygon(vpl.poly, fanareas, totalarea, rng) + vpl.surfnormal;
+        paths.push_back({ origin, CosineSampleHemisphere(vpl.surfnormal, rng), flux / static_cast<float>(emitter.count) });
+    }
+    
+    std::unique_ptr<raystream_intersection_t> rs { MakeIntersectionRayStream(PHOTON_BATCH) };
+    
+    for (int bounce = 0; bounce < bouncedepth && !paths.empty(); bounce++) {
+        std::vector<path_t> next;
+        
+        for (size_t first = 0; first < paths.size(); first += PHOTON_BATCH) {
+            const size_t last = qmin(first + PHOTON_BATCH, paths.size());
+            rs->clearPushedRays();
+            for (size_t i = first; i < last; i++)
+                rs->pushRay(static_cast<int>(i), paths[i].origin, paths[i].dir, MAX_SKY_DIST);
+            rs->tracePushedRaysIntersection(nullptr);
+            
+            for (size_t j = 0; j < rs->numPushedRays(); j++) {
+                if (rs->getPushedRayHitType(j) != hittype_t::SOLID)
+                    continue;
+                const bsp2_dface_t *face = rs->getPushedRayHitFace(j);
+                if (!face)
+                    continue;
+                
+                const path_t &path = paths[rs->getPushedRayPointIndex(j)];
+                qvec3f normal = Face_Normal_E(bsp, face);
+                if (qv::dot(normal, path.dir) > 0)
+                    normal = normal * -1.0f;
+                const qvec3f hit = path.origin + path.dir * rs->getPushedRayHitDist(j);
+                
+                result.push_back({ hit, path.dir, normal, path.power, emitter.style });
+                
+                if (bounce + 1 == bouncedepth || !Face_ShouldBounce(bsp, face))
+                    continue;
+                
+                // reflect what the face doesn't absorb
+                vec3_t blendedcolor;
+                Face_BounceColor(bsp, cfg, face, blendedcolor);
+                qvec3f power = path.power * cfg.bouncescale.floatValue();
+                for (int k = 0; k < 3; k++)
+                    power[k] *= blendedcolor[k] / 255.0f;
+                if (LightSample_Brightness(power) <= 0)
+                    continue;
+                
+                next.push_back({ hit + normal, CosineSampleHemisphere(normal, rng), power });
+            }
+        }
+        paths = std::move(next);
+    }
+    return result;
+}
+
+void
+MakePhotonMap(const globalconfig_t &cfg, const mbsp_t *bsp)
+{
+    logprint("--- MakePhotonMap ---\n");
+    
+    // share the photon budget between bounce light styles by flux
+    std::vector<photonemitter_t> emitters;
+    std::vector<float> weights;
+    double totalweight = 0;
+    for (int i = 0; i < static_cast<int>(radlights.size()); i++) {
+        for (const auto &styleColor : radlights[i].colorByStyle) {
+            const float weight = LightSample_Brightness(styleColor.second) * radlights[i].area;
+            if (weight <= 0)
+                continue;
+            emitters.push_back({ i, styleColor.first, 0 });
+            weights.push_back(weight);
+            totalweight += weight;
+        }
+    }
+    
+    // stochastic rounding keeps the expected count exact for dim emitters
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (size_t i = 0; i < emitters.size(); i++) {
+        const double exact = bouncephotons * weights[i] / totalweight;
+        emitters[i].count = static_cast<int>(exact + uniform(rng));
+    }
+    // each photon carries flux / count, so the rounding mustn't leave bright emitters empty
+    emitters.erase(std::remove_if(emitters.begin(), emitters.end(),
+                                  [](const photonemitter_t &e) { return e.count == 0; }),
+                   emitters.end());
+    
+    std::vector<std::vector<photon_t>> emitted(emitters.size());
+    RunThreadsOn(0, static_cast<int>(emitters.size()), 1, [&](int i, int thread) {
+        emitted[i] = PhotonMap_Emit(cfg, bsp, emitters[i], i);
+    });
+    
+    photons.clear();
+    for (auto &v : emitted)
+        photons.insert(photons.end(), v.begin(), v.end());
+    PhotonMap_BuildTree(0, photons.size(), 0);
+    
+    logprint("%d photons stored from %d emitters\n", static_cast<int>(photons.size()), static_cast<int>(emitters.size()));
+}
+
+bool
+PhotonMapActive()
+{
+    return bouncephotons > 0;
+}
+
+/* k nearest photons as a max-heap of (squared distance, index) */
+static void
+PhotonMap_Nearest(size_t begin, size_t end, int depth, const qvec3f &pos, float maxdist2, size_t k,
+                  std::vector<std::pair<float, size_t>> *heap)
+{
+    if (begin >= end)
+        return;
+    
+    const int axis = depth % 3;
+    const size_t mid = begin + (end - begin) / 2;
+    const photon_t &p = photons[mid];
+    
+    const float delta = pos[axis] - p.pos[axis];
+    const size_t nearbegin = (delta < 0) ? begin : mid + 1;
+    const size_t nearend = (delta < 0) ? mid : end;
+    const size_t farbegin = (delta < 0) ? mid + 1 : begin;
+    const size_t farend = (delta < 0) ? end : mid;
+    
+    PhotonMap_Nearest(nearbegin, nearend, depth + 1, pos, maxdist2, k, heap);
+    
+    const float bound = (heap->size() == k) ? heap->front().first : maxdist2;
+    const float d2 = qv::length2(p.pos - pos);
+    if (d2 < bound) {
+        heap->emplace_back(d2, mid);
+        std::push_heap(heap->begin(), heap->end());
+        if (heap->size() > k) {
+            std::pop_heap(heap->begin(), heap->end());
+            heap->pop_back();
+        }
+    }
+    
+    const float newbound = (heap->size() == k) ? heap->front().first : maxdist2;
+    if (delta * delta < newbound)
+        PhotonMap_Nearest(farbegin, farend, depth + 1, pos, maxdist2, k, heap);
+}
+
+std::map<int, qvec3f>
+PhotonMap_Irradiance(const qvec3f &pos, const qvec3f &normal)
+{
+    std::map<int, qvec3f> result;
+    
+    static thread_local std::vector<std::pair<float, size_t>> heap;
+    heap.clear();
+    PhotonMap_Nearest(0, photons.size(), 0, pos, PHOTON_MAX_RADIUS * PHOTON_MAX_RADIUS, PHOTON_GATHER, &heap);
+    if (heap.empty())
+        return result;
+    
+    // the furthest photon found bounds the gather disc
+    const float radius2 = std::max_element(heap.begin(), heap.end())->first;
+    if (radius2 <= 0)
+        return result;
+    const float scale = 1.0f / (Q_PI * radius2);
+    
+    for (const auto &entry : heap) {
+        const photon_t &p = photons[entry.second];
+        // only photons arriving at this side of a similarly oriented surface
+        if (qv::dot(p.dir, normal) >= 0 || qv::dot(p.normal, normal) < 0.7f)
+            continue;
+        result[p.style] = result[p.style] + p.power * scale;
+    }
+    return result;
 }
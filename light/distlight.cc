@@ -0,0 +1,368 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Distributed light (-coordinator / -worker)
+ *
+ * Every process loads the same bsp with the same options and sets up the
+ * lights, bounce lights and so on itself, then the faces are split into
+ * jobs through files next to the bsp:
+ *
+ *   map.ljobs       number of jobs and the settings key, present while the coordinator runs
+ *   map.ljob<n>     face numbers of job n, waiting to be claimed
+ *   map.ljob<n>.run the same job once claimed (claiming is a rename)
+ *   map.lres<n>     lightmaps of job n's faces, written by whoever ran it
+ *
+ * The jobs are balanced by estimated cost, so each is about as much work
+ * as the others. The coordinator claims jobs too, merges results as they
+ * appear, reruns jobs whose worker seems to have died, and writes the
+ * bsp once every face is lit. Workers exit without writing anything else.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/distlight.hh>
+#include <light/pointcache.hh>
+
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+bool lightcoordinator = false;
+bool lightworker = false;
+int lightjobsize = 256;
+int lightjobtimeout = 600;
+
+static std::string
+JobBaseName(void)
+{
+    char base[1024];
+
+    q_snprintf(base, sizeof(base), "%s", mapfilename);
+    StripExtension(base);
+    return base;
+}
+
+static std::string
+ManifestName(void)
+{
+    return JobBaseName() + ".ljobs";
+}
+
+static std::string
+JobName(int jobnum)
+{
+    return JobBaseName() + ".ljob" + std::to_string(jobnum);
+}
+
+static std::string
+ClaimedJobName(int jobnum)
+{
+    return JobName(jobnum) + ".run";
+}
+
+static std::string
+ResultName(int jobnum)
+{
+    return JobBaseName() + ".lres" + std::to_string(jobnum);
+}
+
+/*
+ * What every process has to agree on to light a face the same way: the
+ * geometry, the settings and the lights. A worker started with different
+ * options would otherwise hand back lightmaps that don't match.
+ */
+static uint64_t
+DistLight_Key(const mbsp_t *bsp, const globalconfig_t &cfg)
+{
+    uint64_t hash = FNV_HASH_INIT;
+    const uint64_t geometry = PointCache_Key(bsp, cfg);
+    FNV_HashBytes(&hash, &geometry, sizeof(geometry));
+
+    const settingsdict_t settings = const_cast<globalconfig_t &>(cfg).settings();
+    for (const lockable_setting_t *setting : settings.allSettings()) {
+        const std::string value = setting->primaryName() + "=" + setting->stringValue();
+        FNV_HashBytes(&hash, value.c_str(), value.size() + 1);
+    }
+    for (const light_t &entity : GetLights()) {
+        FNV_HashBytes(&hash, *entity.origin.vec3Value(), sizeof(vec3_t));
+        FNV_HashBytes(&hash, *entity.color.vec3Value(), sizeof(vec3_t));
+        const float light = entity.light.floatValue();
+        FNV_HashBytes(&hash, &light, sizeof(light));
+    }
+
+    const int options[] = { oversample, write_litfile, write_luxfile, static_cast<int>(GetSuns().size()) };
+    FNV_HashBytes(&hash, options, sizeof(options));
+    return hash;
+}
+
+static void
+WriteTextFile(const std::string &filename, const std::vector<uint64_t> &values)
+{
+    const std::string tmpfile = filename + ".tmp";
+    FILE *f = SafeOpenWrite(tmpfile.c_str());
+    for (const uint64_t value : values)
+        fprintf(f, "%llu\n", static_cast<unsigned long long>(value));
+    if (fclose(f))
+        Error("%s: error writing %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+    if (rename(tmpfile.c_str(), filename.c_str()))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+}
+
+static bool
+ReadTextFile(const std::string &filename, std::vector<uint64_t> *values)
+{
+    FILE *f = fopen(filename.c_str(), "r");
+    unsigned long long value;
+
+    if (!f)
+        return false;
+
+    values->clear();
+    while (fscanf(f, "%llu", &value) == 1)
+        values->push_back(value);
+    fclose(f);
+
+    return true;
+}
+
+/*
+ * Claims a job by renaming it; only one process can win the rename.
+ */
+static bool
+ClaimJob(const mbsp_t *bsp, int jobnum, std::vector<int> *facenums)
+{
+    const std::string claimed = ClaimedJobName(jobnum);
+    std::vector<uint64_t> values;
+
+    if (rename(JobName(jobnum).c_str(), claimed.c_str()))
+        return false;
+    if (!ReadTextFile(claimed, &values))
+        Error("%s: can't read claimed job %s", __func__, claimed.c_str());
+
+    facenums->clear();
+    for (const uint64_t facenum : values) {
+        if (facenum >= static_cast<uint64_t>(bsp->numfaces))
+            Error("%s: %s has invalid face %llu", __func__, claimed.c_str(), static_cast<unsigned long long>(facenum));
+        facenums->push_back(static_cast<int>(facenum));
+    }
+    return true;
+}
+
+static void
+RemoveJobFiles(int numjobs)
+{
+    for (int i = 0; i < numjobs; i++) {
+        remove(JobName(i).c_str());
+        remove(ClaimedJobName(i).c_str());
+        remove(ResultName(i).c_str());
+    }
+    remove(ManifestName().c_str());
+}
+
+static void
+SaveResults(const mbsp_t *bsp, int jobnum, uint64_t key, const std::vector<int> &facenums)
+{
+    const std::string filename = ResultName(jobnum);
+    const std::string tmpfile = filename + ".tmp";
+
+    FILE *f = SafeOpenWrite(tmpfile.c_str());
+    SafeWrite(f, &key, sizeof(key));
+    SaveFaceLightmaps(bsp, facenums, f);
+    if (fclose(f))
+        Error("%s: error writing %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+    if (rename(tmpfile.c_str(), filename.c_str()))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+}
+
+static void
+MergeResults(const mbsp_t *bsp, int jobnum, uint64_t key)
+{
+    uint8_t *data;
+    const int size = LoadFile(ResultName(jobnum).c_str(), &data);
+
+    uint64_t filekey;
+    if (size < static_cast<int>(sizeof(filekey)))
+        Error("%s: results for job %d are truncated", __func__, jobnum);
+    memcpy(&filekey, data, sizeof(filekey));
+    if (filekey != key)
+        Error("%s: job %d was lit with a different bsp or options; workers must use the coordinator's command line",
+              __func__, jobnum);
+
+    LoadFaceLightmaps(const_cast<mbsp_t *>(bsp), data + sizeof(filekey), size - sizeof(filekey));
+    free(data);
+}
+
+/*
+ * Longest processing time first: each face, most expensive first, goes to
+ * the job with the least work so far.
+ */
+static std::vector<std::vector<int>>
+MakeJobs(const mbsp_t *bsp, const std::vector<int64_t> &costs)
+{
+    std::vector<int> order(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&costs](int a, int b) {
+        return costs[a] > costs[b];
+    });
+
+    const int numjobs = (bsp->numfaces + lightjobsize - 1) / lightjobsize;
+    std::vector<std::vector<int>> jobs(numjobs);
+
+    typedef std::pair<int64_t, int> load_t;     // cost so far, job
+    std::priority_queue<load_t, std::vector<load_t>, std::greater<load_t>> loads;
+    for (int i = 0; i < numjobs; i++)
+        loads.push({ 0, i });
+
+    for (const int facenum : order) {
+        load_t load = loads.top();
+        loads.pop();
+        jobs[load.second].push_back(facenum);
+        load.first += std::max<int64_t>(costs[facenum], 1);
+        loads.push(load);
+    }
+
+    /* face order within a job, for locality */
+    for (std::vector<int> &job : jobs)
+        std::sort(job.begin(), job.end());
+    return jobs;
+}
+
+void
+RunLightCoordinator(const mbsp_t *bsp, const globalconfig_t &cfg, const std::vector<int64_t> &costs)
+{
+    std::vector<uint64_t> manifest;
+
+    /* clean up after an earlier, interrupted coordinator */
+    if (ReadTextFile(ManifestName(), &manifest) && !manifest.empty())
+        RemoveJobFiles(static_cast<int>(manifest[0]));
+
+    const uint64_t key = DistLight_Key(bsp, cfg);
+    const std::vector<std::vector<int>> jobs = MakeJobs(bsp, costs);
+    const int numjobs = static_cast<int>(jobs.size());
+    logprint("Distributing %d faces as %d jobs\n", bsp->numfaces, numjobs);
+    if (!numjobs)
+        return;
+
+    for (int i = 0; i < numjobs; i++)
+        WriteTextFile(JobName(i), std::vector<uint64_t>(jobs[i].begin(), jobs[i].end()));
+    WriteTextFile(ManifestName(), { static_cast<uint64_t>(numjobs), key });
+
+    std::vector<bool> done(numjobs, false);
+    std::vector<double> claimseen(numjobs, -1);
+    std::vector<int> facenums;
+    int numdone = 0, numremote = 0;
+
+    while (numdone < numjobs) {
+        bool progress = false;
+
+        for (int i = 0; i < numjobs; i++) {
+            if (done[i] || FileTime(ResultName(i).c_str()) == -1)
+                continue;
+            MergeResults(bsp, i, key);
+            remove(ResultName(i).c_str());
+            remove(ClaimedJobName(i).c_str());
+            done[i] = true;
+            numdone++;
+            numremote++;
+            progress = true;
+        }
+
+        for (int i = 0; i < numjobs && !progress; i++) {
+            if (done[i] || !ClaimJob(bsp, i, &facenums))
+                continue;
+            LightFaces(bsp, facenums);
+            remove(ClaimedJobName(i).c_str());
+            done[i] = true;
+            numdone++;
+            progress = true;
+        }
+
+        const double now = I_FloatTime();
+
+        /* everything left is claimed by workers; rerun any that went quiet */
+        for (int i = 0; i < numjobs && !progress; i++) {
+            if (done[i])
+                continue;
+            if (claimseen[i] < 0) {
+                claimseen[i] = now;
+                continue;
+            }
+            if (now - claimseen[i] < lightjobtimeout)
+                continue;
+
+            logprint("Job %d timed out, running it locally\n", i);
+            LightFaces(bsp, jobs[i]);
+            remove(ClaimedJobName(i).c_str());
+            remove(ResultName(i).c_str());
+            done[i] = true;
+            numdone++;
+            progress = true;
+        }
+
+        if (!progress)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    RemoveJobFiles(numjobs);
+    logprint("Merged %d of %d jobs from workers\n", numremote, numjobs);
+}
+
+void
+RunLightWorker(const mbsp_t *bsp, const globalconfig_t &cfg)
+{
+    std::vector<uint64_t> manifest;
+    std::vector<int> facenums;
+    int numrun = 0;
+
+    if (!ReadTextFile(ManifestName(), &manifest)) {
+        logprint("Waiting for a coordinator to write %s...\n", ManifestName().c_str());
+        while (!ReadTextFile(ManifestName(), &manifest))
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (manifest.size() < 2)
+        Error("%s: %s is incomplete", __func__, ManifestName().c_str());
+
+    const uint64_t key = DistLight_Key(bsp, cfg);
+    if (manifest[1] != key)
+        Error("%s: the coordinator is lighting a different bsp or with different options", __func__);
+
+    const int numjobs = static_cast<int>(manifest[0]);
+    for (int i = 0; i < numjobs; i++) {
+        if (!ClaimJob(bsp, i, &facenums))
+            continue;
+        logprint("Running job %d (%d faces)\n", i, static_cast<int>(facenums.size()));
+        LightFaces(bsp, facenums);
+        SaveResults(bsp, i, key, facenums);
+        numrun++;
+    }
+
+    logprint("Ran %d of %d jobs\n", numrun, numjobs);
+}
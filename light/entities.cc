@@ -19,12 +19,16 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory>
 #include <sstream>
 #include <common/cmdlib.hh>
+#include <common/octree.hh>
 
 #include <light/light.hh>
 #include <light/entities.hh>
 #include <light/ltface.hh>
+#include <light/profile.hh>
+#include <light/pvscull.hh>
 #include <common/bsputils.hh>
 
 using strings = std::vector<std::string>;
@@ -35,10 +39,38 @@ std::vector<sun_t> all_suns;
 std::vector<entdict_t> entdicts;
 static std::vector<entdict_t> radlights;
 
+/* indices into all_lights by estimated bounds, only built when using visapprox */
+static std::unique_ptr<octree_t<int>> light_octree;
+
 const std::vector<light_t>& GetLights() {
     return all_lights;
 }
 
+std::vector<const light_t *> LightsTouchingBounds(const vec3_t mins, const vec3_t maxs)
+{
+    std::vector<const light_t *> result;
+
+    if (!light_octree) {
+        result.reserve(all_lights.size());
+        for (const light_t &entity : all_lights)
+            result.push_back(&entity);
+        return result;
+    }
+
+    /* pad the query, AABBsDisjoint allows a small overlap tolerance */
+    const qvec3f pad(0.01f, 0.01f, 0.01f);
+    const aabb3f query(vec3_t_to_glm(mins) - pad, vec3_t_to_glm(maxs) + pad);
+
+    /* the indices come back sorted, so the lights keep their usual order */
+    static thread_local std::vector<int> indices;
+    indices.clear();
+    light_octree->queryTouchingBBox(query, indices);
+    result.reserve(indices.size());
+    for (const int i : indices)
+        result.push_back(&all_lights[i]);
+    return result;
+}
+
 const std::vector<sun_t>& GetSuns() {
     return all_suns;
 }
@@ -137,16 +169,16 @@ TargetnameForLightStyle(int style)
 static void
 MatchTargets(void)
 {
+    const entdict_index_t index(entdicts);
+
     for (light_t &entity : all_lights) {
         std::string targetstr { ValueForKey(&entity, "target") };
         if (!targetstr.length())
             continue;
         
-        for (const entdict_t &target : entdicts) {
-            if (targetstr == EntDict_StringForKey(target, "targetname")) {
-                entity.targetent = &target;
-                break;
-            }
+        const auto it = index.by_targetname.find(targetstr);
+        if (it != index.by_targetname.end()) {
+            entity.targetent = it->second;
         }
     }
 }
@@ -181,6 +213,31 @@ EntDict_PrettyDescription(const mbsp_t *bsp, const entdict_t &entity)
     return s.str();
 }
 
+entdict_index_t::entdict_index_t(const std::vector<entdict_t> &edicts)
+{
+    std::vector<const std::string *> values;
+
+    for (const entdict_t &entity : edicts) {
+        by_targetname.emplace(entity.get("targetname"), &entity);
+        by_model.emplace(entity.get("model"), &entity);
+
+        // count each entity once per value, even if it uses the value under several keys
+        values.clear();
+        for (const auto &keyval : entity) {
+            values.push_back(&keyval.second);
+        }
+        for (size_t i = 0; i < values.size(); i++) {
+            bool seen = false;
+            for (size_t j = 0; j < i && !seen; j++) {
+                seen = (*values[j] == *values[i]);
+            }
+            if (!seen) {
+                value_users[*values[i]]++;
+            }
+        }
+    }
+}
+
 bool
 EntDict_CheckNoEmptyValues(const mbsp_t *bsp, const entdict_t &entdict)
 {
@@ -201,7 +258,7 @@ EntDict_CheckNoEmptyValues(const mbsp_t *bsp, const entdict_t &entdict)
  * Checks `edicts` for unmatched targets/targetnames and prints warnings
  */
 bool
-EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts)
+EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const entdict_index_t &index)
 {
     bool ok = true;
     
@@ -227,17 +284,8 @@ EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const
             continue;
         }
         
-        bool found = false;
-        for (const entdict_t &target : all_edicts) {
-            if (&target == &entity) {
-                continue;
-            }
-            
-            if (targetVal == EntDict_StringForKey(target, "targetname")) {
-                found = true;
-                break;
-            }
-        }
+        // targetVal isn't this entity's targetname, so any match is another entity
+        const bool found = (index.by_targetname.find(targetVal) != index.by_targetname.end());
         
         if (!found) {
             logprint("WARNING: %s has unmatched \"%s\" (%s)\n",
@@ -252,7 +300,13 @@ EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const
 }
 
 bool
-EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts)
+EntDict_CheckTargetKeysMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts)
+{
+    return EntDict_CheckTargetKeysMatched(bsp, entity, entdict_index_t(all_edicts));
+}
+
+bool
+EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, const entdict_index_t &index)
 {
     // search for "targetname" values such that no entity has a matching "target"
     // accept any key name as a target, so we don't print false positive
@@ -262,23 +316,9 @@ EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, co
     
     const auto targetnameVal = EntDict_StringForKey(entity, "targetname");
     if (targetnameVal.length()) {
-        bool found = false;
-        for (const entdict_t &targetter : all_edicts) {
-            if (&targetter == &entity) {
-                continue;
-            }
-            
-            for (const auto &targetter_keyval : targetter) {
-                if (targetnameVal == targetter_keyval.second) {
-                    found = true;
-                    break;
-                }
-            }
-            
-            if (found) {
-                break;
-            }
-        }
+        // this entity is one of the users of its own targetname
+        const auto it = index.value_users.find(targetnameVal);
+        const bool found = (it != index.value_users.end() && it->second > 1);
         
         if (!found) {
             logprint("WARNING: %s has targetname \"%s\", which is not targeted by anything.\n",
@@ -291,6 +331,12 @@ EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, co
     return ok;
 }
 
+bool
+EntDict_CheckTargetnameKeyMatched(const mbsp_t *bsp, const entdict_t &entity, const std::vector<entdict_t> &all_edicts)
+{
+    return EntDict_CheckTargetnameKeyMatched(bsp, entity, entdict_index_t(all_edicts));
+}
+
 static void
 SetupSpotlights(const globalconfig_t &cfg)
 {
@@ -659,47 +705,6 @@ DuplicateEntity(const light_t &src)
     return entity;
 }
 
-/*
- * =============
- * JitterEntity
- *
- * Creates jittered copies of the light if specified using the "_samples" and "_deviance" keys. 
- *
- * From q3map2
- * =============
- */
-static void
-JitterEntity(const light_t entity)
-{
-    /* jitter the light */
-    for ( int j = 1; j < entity.samples.intValue(); j++ )
-    {
-        /* create a light */
-        light_t light2 = DuplicateEntity(entity);
-        light2.generated = true; // don't write generated light to bsp
-
-        /* jitter it */
-        vec3_t neworigin = {
-            (*entity.origin.vec3Value())[ 0 ] + ( Random() * 2.0f - 1.0f ) * entity.deviance.floatValue(),
-            (*entity.origin.vec3Value())[ 1 ] + ( Random() * 2.0f - 1.0f ) * entity.deviance.floatValue(),
-            (*entity.origin.vec3Value())[ 2 ] + ( Random() * 2.0f - 1.0f ) * entity.deviance.floatValue()
-        };
-        light2.origin.setVec3Value(neworigin);
-        
-        all_lights.push_back(light2);
-    }
-}
-
-static void
-JitterEntities()
-{
-    // We will append to the list during iteration.
-    const size_t starting_size = all_lights.size();
-    for (size_t i=0; i<starting_size; i++) {
-        JitterEntity(all_lights.at(i));
-    }
-}
-
 void Matrix4x4_CM_Projection_Inf(float *proj, float fovx, float fovy, float neard)
 {
     float xmin, xmax, ymin, ymax;
@@ -931,10 +936,13 @@ LoadEntities(const globalconfig_t &cfg, const mbsp_t *bsp)
     entdicts = EntData_Parse(bsp->dentdata);
     
     // Make warnings
-    for (auto &entdict : entdicts) {
-        EntDict_CheckNoEmptyValues(bsp, entdict);
-        EntDict_CheckTargetKeysMatched(bsp, entdict, entdicts);
-        EntDict_CheckTargetnameKeyMatched(bsp, entdict, entdicts);
+    {
+        const entdict_index_t index(entdicts);
+        for (auto &entdict : entdicts) {
+            EntDict_CheckNoEmptyValues(bsp, entdict);
+            EntDict_CheckTargetKeysMatched(bsp, entdict, index);
+            EntDict_CheckTargetnameKeyMatched(bsp, entdict, index);
+        }
     }
 
     /* handle worldspawn */
@@ -1112,18 +1120,28 @@ FixLightsOnFaces(const mbsp_t *bsp)
     }
 }
 
-void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
+#define VISAPPROX_MAX_RAYS      32      // a side of the sphere of rays
+#define VISAPPROX_MIN_RAYS      8
+#define VISAPPROX_FULL_DIST     512     // lights reaching this far get every ray
+
+/*
+ * Traces an n x n sphere of rays from point and bounds where they stop,
+ * grown by 25% in each direction and clipped to the box point +/- reach.
+ * Each thread keeps its ray stream.
+ */
+static void
+EstimateVisibleBounds(const vec3_t point, vec_t reach, int n, vec3_t mins, vec3_t maxs)
 {
-    const int N = 32;
-    const int N2 = N*N;
-    
-    raystream_intersection_t *rs = MakeIntersectionRayStream(N2);
+    static thread_local std::unique_ptr<raystream_intersection_t> rs;
+    if (!rs)
+        rs.reset(MakeIntersectionRayStream(VISAPPROX_MAX_RAYS * VISAPPROX_MAX_RAYS));
+    rs->clearPushedRays();
     
     AABB_Init(mins, maxs, point);
-    for (int x=0; x<N; x++) {
-        for (int y=0; y<N; y++) {
-            const vec_t u1 = static_cast<float>(x) / static_cast<float>(N - 1);
-            const vec_t u2 = static_cast<float>(y) / static_cast<float>(N - 1);
+    for (int x=0; x<n; x++) {
+        for (int y=0; y<n; y++) {
+            const vec_t u1 = static_cast<float>(x) / static_cast<float>(n - 1);
+            const vec_t u2 = static_cast<float>(y) / static_cast<float>(n - 1);
             
             vec3_t dir;
             UniformPointOnSphere(dir, u1, u2);
@@ -1134,7 +1152,7 @@ void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
     
     rs->tracePushedRaysIntersection(nullptr);
     
-    for (int i=0; i<N2; i++) {
+    for (int i=0; i<n*n; i++) {
         const float dist = rs->getPushedRayHitDist(i);
         vec3_t dir;
         rs->getPushedRayDir(i, dir);
@@ -1152,47 +1170,99 @@ void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
     VectorScale(size, 0.25, size);
     AABB_Grow(mins, maxs, size);
     
-    /*
-    logprint("light at %f %f %f has mins %f %f %f maxs %f %f %f\n",
-           point[0],
-           point[1],
-           point[2],
-           mins[0],
-           mins[1],
-           mins[2],
-           maxs[0],
-           maxs[1],
-           maxs[2]);
-    */
+    for (int i = 0; i < 3; i++) {
+        mins[i] = qmax(mins[i], point[i] - reach);
+        maxs[i] = qmin(maxs[i], point[i] + reach);
+    }
+}
+
+void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
+{
+    EstimateVisibleBounds(point, VECT_MAX, VISAPPROX_MAX_RAYS, mins, maxs);
+}
+
+/* how far from its origin the light can be brighter than fadegate; VECT_MAX if it doesn't fade */
+static vec_t
+LightReach(const globalconfig_t &cfg, const light_t *light)
+{
+    // GetLightValue cuts a linear light off at its falloff, whatever its atten
+    if (light->getFormula() == LF_LINEAR && light->falloff.floatValue() > 0)
+        return light->falloff.floatValue() + 1;
     
-    delete rs;
+    const vec_t dist = GetLightDist(cfg, light, fadegate);
+    return (dist >= VECT_MAX) ? VECT_MAX : dist + 1;
 }
 
-static void EstimateLightAABB(light_t *light)
+/*
+ * Lights that fade out nearby have their bounds clipped to that anyway.
+ * With -visapprox fastrays they also trace as few rays as leave about the
+ * same distance between neighbouring rays at the edge of their reach.
+ */
+static void EstimateLightAABB(const globalconfig_t &cfg, const mbsp_t *bsp, light_t *light)
 {
-    EstimateVisibleBoundsAtPoint(*light->origin.vec3Value(), light->mins, light->maxs);
+    const vec_t reach = LightReach(cfg, light);
+    const vec_t *origin = *light->origin.vec3Value();
+    
+    if (!visapproxpvs || !PVS_VisibleBounds(bsp, origin, light->deviance.floatValue() + 1, light->mins, light->maxs)) {
+        int n = VISAPPROX_MAX_RAYS;
+        if (visapproxfastrays) {
+            const vec_t fraction = qmin(reach / VISAPPROX_FULL_DIST, static_cast<vec_t>(1));
+            n = qmax(VISAPPROX_MIN_RAYS, static_cast<int>(ceil(VISAPPROX_MAX_RAYS * fraction)));
+        }
+        EstimateVisibleBounds(origin, reach, n, light->mins, light->maxs);
+    } else {
+        for (int i = 0; i < 3; i++) {
+            light->mins[i] = qmax(light->mins[i], origin[i] - reach);
+            light->maxs[i] = qmin(light->maxs[i], origin[i] + reach);
+        }
+    }
+    
+    // an area light's samples are anywhere in its ball
+    for (int i = 0; i < 3; i++) {
+        light->mins[i] -= light->deviance.floatValue();
+        light->maxs[i] += light->deviance.floatValue();
+    }
 }
 
+struct estimatelightaabb_t {
+    const globalconfig_t *cfg;
+    const mbsp_t *bsp;
+};
+
 static void *EstimateLightAABBThread(void *arg)
 {
+    const estimatelightaabb_t *args = static_cast<const estimatelightaabb_t *>(arg);
+    
     while (1) {
         const int i = GetThreadWork();
         if (i == -1)
             break;
         
-        EstimateLightAABB(&all_lights.at(i));
+        EstimateLightAABB(*args->cfg, args->bsp, &all_lights.at(i));
     }
     return nullptr;
 }
 
-void EstimateLightVisibility(void)
+void EstimateLightVisibility(const globalconfig_t &cfg, const mbsp_t *bsp)
 {
+    light_octree.reset();
+
     if (novisapprox)
         return;
     
     logprint("--- EstimateLightVisibility ---\n");
+    timingscope_t scope("EstimateLightVisibility");
     
-    RunThreadsOn(0, static_cast<int>(all_lights.size()), EstimateLightAABBThread, nullptr);
+    estimatelightaabb_t args { &cfg, bsp };
+    RunThreadsOn(0, static_cast<int>(all_lights.size()), EstimateLightAABBThread, &args);
+
+    std::vector<std::pair<aabb3f, int>> objects;
+    objects.reserve(all_lights.size());
+    for (int i = 0; i < static_cast<int>(all_lights.size()); i++) {
+        const light_t &entity = all_lights[i];
+        objects.emplace_back(aabb3f(vec3_t_to_glm(entity.mins), vec3_t_to_glm(entity.maxs)), i);
+    }
+    light_octree = std::make_unique<octree_t<int>>(makeOctree(objects));
 }
 
 void
@@ -1205,10 +1275,6 @@ SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
              
     logprint("SetupLights: %d after surface lights\n", static_cast<int>(all_lights.size()));
     
-    JitterEntities();
-                      
-    logprint("SetupLights: %d after jittering\n", static_cast<int>(all_lights.size()));
-    
     const size_t final_lightcount = all_lights.size();
     
     MatchTargets();
@@ -1216,7 +1282,7 @@ SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
     SetupSuns(cfg);
     SetupSkyDomes(cfg);
     FixLightsOnFaces(bsp);
-    EstimateLightVisibility();
+    EstimateLightVisibility(cfg, bsp);
     
     logprint("Final count: %d lights, %d suns in use.\n",
              static_cast<int>(all_lights.size()),
@@ -1247,6 +1313,11 @@ const entdict_t *FindEntDictWithKeyPair(const std::string &key, const std::strin
     return nullptr;
 }
 
+entdict_index_t IndexEntDicts()
+{
+    return entdict_index_t(entdicts);
+}
+
 void
 EntDict_VectorForKey(const entdict_t &ent, const std::string &key, vec3_t vec)
 {
@@ -1616,3 +1687,18 @@ static void MakeSurfaceLights(const mbsp_t *bsp)
         printf("wrote surface lights to '%s'\n", surflights_dump_filename);
     }
 }
+
+/*
+ * Forgets what LoadEntities and SetupLights made, so they can run again
+ * on new entity data (-watch). The lights.rad templates are kept.
+ */
+void
+ResetEntities(void)
+{
+    all_lights.clear();
+    all_suns.clear();
+    entdicts.clear();
+    surfacelight_templates.clear();
+    lightstyleForTargetname.clear();
+    light_octree.reset();
+}
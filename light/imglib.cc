@@ -225,23 +225,21 @@ typedef struct _TargaHeader {
     unsigned char	pixel_size, attributes;
 } TargaHeader;
 
-int
-fgetLittleShort(FILE *f)
-{
-    const uint8_t b1 = fgetc(f);
-    const uint8_t b2 = fgetc(f);
-    return static_cast<short>(b1 + b2 * 256);
-}
-
-int
-fgetLittleLong(FILE *f)
-{
-    const uint8_t b1 = fgetc(f);
-    const uint8_t b2 = fgetc(f);
-    const uint8_t b3 = fgetc(f);
-    const uint8_t b4 = fgetc(f);
-    return b1 + (b2 << 8) + (b3 << 16) + (b4 << 24);
-}
+/// reads a TGA that was loaded in one go; reads past the end give 0xff, like getc()'s EOF did
+struct tgareader_t {
+    const uint8_t *data;
+    int len;
+    int pos;
+
+    uint8_t getc() {
+        return pos < len ? data[pos++] : 0xff;
+    }
+    int getLittleShort() {
+        const uint8_t b1 = getc();
+        const uint8_t b2 = getc();
+        return static_cast<short>(b1 + b2 * 256);
+    }
+};
 
 /*
 =============
@@ -255,33 +253,39 @@ LoadTGA(const char *filename, uint8_t **pixels, int *width, int *height)
     int				row, column;
     TargaHeader		targa_header;
 
-    FILE *fin = fopen(filename, "rb");
-    if (!fin) {
+    if (FileTime(filename) == -1) {
         logprint("LoadTGA: Failed to load '%s'. File does not exist.\n", filename);
         return false; //mxd
     }
 
-    targa_header.id_length = fgetc(fin);
-    targa_header.colormap_type = fgetc(fin);
-    targa_header.image_type = fgetc(fin);
-
-    targa_header.colormap_index = fgetLittleShort(fin);
-    targa_header.colormap_length = fgetLittleShort(fin);
-    targa_header.colormap_size = fgetc(fin);
-    targa_header.x_origin = fgetLittleShort(fin);
-    targa_header.y_origin = fgetLittleShort(fin);
-    targa_header.width = fgetLittleShort(fin);
-    targa_header.height = fgetLittleShort(fin);
-    targa_header.pixel_size = fgetc(fin);
-    targa_header.attributes = fgetc(fin);
+    // one read of the whole file, rather than a getc() per byte
+    uint8_t *raw;
+    const int len = LoadFile(filename, &raw);
+    tgareader_t fin { raw, len, 0 };
+
+    targa_header.id_length = fin.getc();
+    targa_header.colormap_type = fin.getc();
+    targa_header.image_type = fin.getc();
+
+    targa_header.colormap_index = fin.getLittleShort();
+    targa_header.colormap_length = fin.getLittleShort();
+    targa_header.colormap_size = fin.getc();
+    targa_header.x_origin = fin.getLittleShort();
+    targa_header.y_origin = fin.getLittleShort();
+    targa_header.width = fin.getLittleShort();
+    targa_header.height = fin.getLittleShort();
+    targa_header.pixel_size = fin.getc();
+    targa_header.attributes = fin.getc();
 
     if (targa_header.image_type != 2 && targa_header.image_type != 10) {
         logprint("LoadTGA: Failed to load '%s'. Only type 2 and 10 targa RGB images supported.\n", filename);
+        free(raw);
         return false; //mxd
     }
 
     if (targa_header.colormap_type != 0 || (targa_header.pixel_size != 32 && targa_header.pixel_size != 24)) {
         logprint("LoadTGA: Failed to load '%s'. Only 32 or 24 bit images supported (no colormaps).\n", filename);
+        free(raw);
         return false; //mxd
     }
 
@@ -297,38 +301,23 @@ LoadTGA(const char *filename, uint8_t **pixels, int *width, int *height)
     uint8_t *targa_rgba = static_cast<uint8_t*>(malloc(numPixels * 4));
     *pixels = targa_rgba;
 
-    if (targa_header.id_length != 0)
-        fseek(fin, targa_header.id_length, SEEK_CUR);  // skip TARGA image comment
+    fin.pos += targa_header.id_length;  // skip TARGA image comment
+
+    // pixel_size was checked above, so every pixel is either 24 or 32 bits
+    const bool hasalpha = (targa_header.pixel_size == 32);
 
     if (targa_header.image_type == 2) {  // Uncompressed, RGB images
         for (row = rows - 1; row >= 0; row--) {
             pixbuf = targa_rgba + row * columns * 4;
             for (column = 0; column < columns; column++) {
-                unsigned char red, green, blue, alphabyte;
-                switch (targa_header.pixel_size) {
-                case 24:
-                    blue = getc(fin);
-                    green = getc(fin);
-                    red = getc(fin);
-                    *pixbuf++ = red;
-                    *pixbuf++ = green;
-                    *pixbuf++ = blue;
-                    *pixbuf++ = 255;
-                    break;
-                case 32:
-                    blue = getc(fin);
-                    green = getc(fin);
-                    red = getc(fin);
-                    alphabyte = getc(fin);
-                    *pixbuf++ = red;
-                    *pixbuf++ = green;
-                    *pixbuf++ = blue;
-                    *pixbuf++ = alphabyte;
-                    break;
-                default:
-                    logprint("LoadTGA: unsupported pixel size: %i\n", targa_header.pixel_size); //mxd
-                    return false;
-                }
+                const unsigned char blue = fin.getc();
+                const unsigned char green = fin.getc();
+                const unsigned char red = fin.getc();
+                const unsigned char alphabyte = hasalpha ? fin.getc() : 255;
+                *pixbuf++ = red;
+                *pixbuf++ = green;
+                *pixbuf++ = blue;
+                *pixbuf++ = alphabyte;
             }
         }
     } else if (targa_header.image_type == 10) {   // Runlength encoded RGB images
@@ -336,26 +325,13 @@ LoadTGA(const char *filename, uint8_t **pixels, int *width, int *height)
         for (row = rows - 1; row >= 0; row--) {
             pixbuf = targa_rgba + row * columns * 4;
             for (column = 0; column<columns; ) {
-                const unsigned char packetHeader = getc(fin);
+                const unsigned char packetHeader = fin.getc();
                 const unsigned char packetSize = 1 + (packetHeader & 0x7f);
                 if (packetHeader & 0x80) {        // run-length packet
-                    switch (targa_header.pixel_size) {
-                    case 24:
-                        blue = getc(fin);
-                        green = getc(fin);
-                        red = getc(fin);
-                        alphabyte = 255;
-                        break;
-                    case 32:
-                        blue = getc(fin);
-                        green = getc(fin);
-                        red = getc(fin);
-                        alphabyte = getc(fin);
-                        break;
-                    default:
-                        logprint("LoadTGA: unsupported pixel size: %i\n", targa_header.pixel_size); //mxd
-                        return false;
-                    }
+                    blue = fin.getc();
+                    green = fin.getc();
+                    red = fin.getc();
+                    alphabyte = hasalpha ? fin.getc() : 255;
 
                     for (j = 0; j<packetSize; j++) {
                         *pixbuf++ = red;
@@ -374,30 +350,14 @@ LoadTGA(const char *filename, uint8_t **pixels, int *width, int *height)
                     }
                 } else {                         // non run-length packet
                     for (j = 0; j<packetSize; j++) {
-                        switch (targa_header.pixel_size) {
-                        case 24:
-                            blue = getc(fin);
-                            green = getc(fin);
-                            red = getc(fin);
-                            *pixbuf++ = red;
-                            *pixbuf++ = green;
-                            *pixbuf++ = blue;
-                            *pixbuf++ = 255;
-                            break;
-                        case 32:
-                            blue = getc(fin);
-                            green = getc(fin);
-                            red = getc(fin);
-                            alphabyte = getc(fin);
-                            *pixbuf++ = red;
-                            *pixbuf++ = green;
-                            *pixbuf++ = blue;
-                            *pixbuf++ = alphabyte;
-                            break;
-                        default:
-                            logprint("LoadTGA: unsupported pixel size: %i\n", targa_header.pixel_size); //mxd
-                            return false;
-                        }
+                        blue = fin.getc();
+                        green = fin.getc();
+                        red = fin.getc();
+                        alphabyte = hasalpha ? fin.getc() : 255;
+                        *pixbuf++ = red;
+                        *pixbuf++ = green;
+                        *pixbuf++ = blue;
+                        *pixbuf++ = alphabyte;
                         column++;
                         if (column == columns) { // pixel packet run spans across rows
                             column = 0;
@@ -414,7 +374,7 @@ LoadTGA(const char *filename, uint8_t **pixels, int *width, int *height)
         }
     }
 
-    fclose(fin);
+    free(raw);
 
     return true; //mxd
 }
@@ -579,26 +539,27 @@ LoadTextures(mbsp_t *bsp)
     }
 
     // Step 3: load and convert to miptex_t, store texturename indices...
+    const std::vector<std::pair<std::string, std::string>> texturefiles(texturenames.begin(), texturenames.end());
     std::map<std::string, int> indicesbytexturename;
-    std::vector<rgba_miptex_t*> tex_mips{};
-    std::vector<uint8_t*> tex_bytes{};
+    // nullptrs keep the texture indices in case of load problems...
+    std::vector<rgba_miptex_t*> tex_mips(texturefiles.size(), nullptr);
+    std::vector<uint8_t*> tex_bytes(texturefiles.size(), nullptr);
     const int miptexsize = sizeof(rgba_miptex_t);
-    int counter = 0;
 
-    for (auto pair : texturenames) {
-        // Store texturename index...
-        indicesbytexturename[std::string{ pair.first }] = counter++;
+    for (int i = 0; i < static_cast<int>(texturefiles.size()); i++)
+        indicesbytexturename[texturefiles[i].first] = i;
+
+    // each texture decodes independently, and a big TGA costs far more than a WAL,
+    // so hand them out one at a time
+    RunThreadsOn(0, static_cast<int>(texturefiles.size()), 1, [&](int i, int thread) {
+        const auto &pair = texturefiles[i];
 
-        // Add nullptrs to keep texture index in case of load problems...
-        tex_mips.push_back(nullptr);
-        tex_bytes.push_back(nullptr);
-        
         // Find file extension
         const int dpos = pair.second.rfind('.');
         if (dpos == -1) {
             if (!pair.second.empty()) // Missing texture warning was already displayed
                 logprint("WARNING: unexpected texture filename: '%s'\n", pair.second.c_str());
-            continue;
+            return;
         }
         const std::string ext = pair.second.substr(dpos + 1);
 
@@ -608,13 +569,13 @@ LoadTextures(mbsp_t *bsp)
 
         if (string_iequals(ext, "tga")) {
             if (!LoadTGA(pair.second.c_str(), &pixels, &width, &height)) 
-                continue;
+                return;
         } else if (string_iequals(ext, "wal")) {
             if (!LoadWAL(pair.second.c_str(), &pixels, &width, &height)) 
-                continue;
+                return;
         } else {
             logprint("WARNING: unsupported image format: '%s'\n", pair.second.c_str());
-            continue;
+            return;
         }
 
         // Create rgba_miptex_t...
@@ -625,9 +586,9 @@ LoadTextures(mbsp_t *bsp)
         tex->offset = miptexsize;
 
         // Replace nullptrs with actual data...
-        tex_mips[tex_mips.size() - 1] = tex;
-        tex_bytes[tex_bytes.size() - 1] = pixels;
-    }
+        tex_mips[i] = tex;
+        tex_bytes[i] = pixels;
+    });
 
     // Sanity checks...
     Q_assert(tex_mips.size() == tex_bytes.size());
@@ -655,20 +616,16 @@ ConvertTextures(mbsp_t *bsp)
     logprint("--- ConvertTextures ---\n");
 
     std::map<int, std::string> texturenamesbyindex;
-    std::vector<rgba_miptex_t*> tex_mips{};
-    std::vector<uint8_t*> tex_bytes{};
+    // nullptrs pad the missing textures to keep offsets...
+    std::vector<rgba_miptex_t*> tex_mips(bsp->dtexdata->nummiptex, nullptr);
+    std::vector<uint8_t*> tex_bytes(bsp->dtexdata->nummiptex, nullptr);
     const int miptexsize = sizeof(rgba_miptex_t);
 
     // Step 1: store texture data and RGBA bytes in temporary arrays...
-    for (int i = 0; i < bsp->dtexdata->nummiptex; i++) {
+    RunThreadsOn(0, bsp->dtexdata->nummiptex, 0, [&](int i, int thread) {
         const int ofs = bsp->dtexdata->dataofs[i];
-
-        // Pad to keep offsets...
-        if (ofs < 0) {
-            tex_mips.push_back(nullptr);
-            tex_bytes.push_back(nullptr);
-            continue;
-        }
+        if (ofs < 0)
+            return;
 
         miptex_t *miptex = (miptex_t *)((uint8_t *)bsp->dtexdata + ofs);
 
@@ -679,9 +636,6 @@ ConvertTextures(mbsp_t *bsp)
         tex->height = miptex->height;
         tex->offset = miptexsize;
 
-        // Store texturename index...
-        texturenamesbyindex[i] = std::string{ tex->name };
-
         // Convert to RGBA
         const int numpalpixels = tex->width * tex->height;
         uint8_t *pixels = static_cast<uint8_t*>(malloc(numpalpixels * 4)); //RGBA
@@ -696,8 +650,14 @@ ConvertTextures(mbsp_t *bsp)
         }
 
         // Store...
-        tex_mips.push_back(tex);
-        tex_bytes.push_back(pixels);
+        tex_mips[i] = tex;
+        tex_bytes[i] = pixels;
+    });
+
+    // Store texturename indices...
+    for (int i = 0; i < bsp->dtexdata->nummiptex; i++) {
+        if (tex_mips[i])
+            texturenamesbyindex[i] = std::string{ tex_mips[i]->name };
     }
 
     // Sanity checks...
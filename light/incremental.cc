@@ -0,0 +1,575 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/incremental.hh>
+#include <light/litfile.hh>
+#include <light/ltface.hh>
+#include <light/pointcache.hh>
+
+#include <common/bsputils.hh>
+#include <common/cmdlib.hh>
+
+#define INCREMENTAL_VERSION ('L' << 24 | 'I' << 16 | 'S' << 8 | '1')
+
+/* local build artifact, so native byte order like the point cache */
+typedef struct {
+    uint32_t version;
+    uint32_t numlights;
+    uint64_t key;           // geometry and global settings
+    uint64_t lightdatakey;  // bsp lighting lump
+    uint64_t litkey;        // .lit / RGBLIGHTING data
+    uint64_t luxkey;        // .lux / LIGHTINGDIR data
+} dlightstate_t;
+
+typedef struct {
+    uint64_t signature;
+    int32_t sun;
+    float mins[3];
+    float maxs[3];
+} dlightstatelight_t;
+
+static bool incremental_active = false;     // copying unaffected faces this run
+static std::string state_filename;
+static dlightstate_t state;
+static std::vector<dlightstatelight_t> state_lights;
+
+/* previous lighting, copied out before LightWorld replaces it */
+static std::vector<uint8_t> old_lightdata;
+static std::vector<uint8_t> old_litdata;
+static std::vector<uint8_t> old_luxdata;
+static std::vector<uint8_t> old_litfile;
+static std::vector<uint8_t> old_luxfile;
+
+static std::vector<uint8_t> face_affected;
+static std::vector<int> face_luxels;
+
+template <typename T>
+static void
+Hash_Value(uint64_t *hash, const T &value)
+{
+    FNV_HashBytes(hash, &value, sizeof(value));
+}
+
+static void
+Hash_String(uint64_t *hash, const std::string &str)
+{
+    // include the terminator so consecutive strings can't run together
+    FNV_HashBytes(hash, str.c_str(), str.size() + 1);
+}
+
+static void
+Hash_Settings(uint64_t *hash, const settingsdict_t &settings)
+{
+    for (const lockable_setting_t *setting : settings.allSettings()) {
+        Hash_String(hash, setting->primaryName());
+        Hash_String(hash, setting->stringValue());
+    }
+}
+
+static uint64_t
+Hash_Data(const uint8_t *data, size_t size)
+{
+    uint64_t hash = FNV_HASH_INIT;
+    Hash_Value(&hash, static_cast<uint64_t>(size));
+    FNV_HashBytes(&hash, data, size);
+    return hash;
+}
+
+/* everything besides the lights that the lighting of any face depends on */
+static uint64_t
+Incremental_Key(const mbsp_t *bsp, globalconfig_t &cfg, int argc, const char **argv)
+{
+    uint64_t hash = FNV_HASH_INIT;
+
+    Hash_Value(&hash, PointCache_Key(bsp, cfg));
+
+    // the options, less the thread count and the bsp name
+    for (int i = 1; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "-threads")) {
+            i++;
+            continue;
+        }
+        Hash_String(&hash, argv[i]);
+    }
+
+    Hash_Settings(&hash, cfg.settings());
+    for (int i = 0; i < bsp->nummodels; i++) {
+        modelinfo_t *info = const_cast<modelinfo_t *>(ModelInfoForModel(bsp, i));
+        Hash_Settings(&hash, info->settings());
+    }
+
+    Hash_Value(&hash, write_litfile);
+    Hash_Value(&hash, write_luxfile);
+
+    return hash;
+}
+
+static dlightstatelight_t
+Incremental_LightState(const light_t &entity)
+{
+    dlightstatelight_t dlight;
+    uint64_t hash = FNV_HASH_INIT;
+
+    Hash_Settings(&hash, const_cast<light_t &>(entity).settings());
+
+    // stringValue() rounds, and these are computed from other entities
+    Hash_Value(&hash, *entity.origin.vec3Value());
+    Hash_Value(&hash, *entity.color.vec3Value());
+    Hash_Value(&hash, entity.light.floatValue());
+    Hash_Value(&hash, entity.spotlight);
+    Hash_Value(&hash, entity.spotvec);
+    Hash_Value(&hash, entity.spotfalloff);
+    Hash_Value(&hash, entity.spotfalloff2);
+    Hash_Value(&hash, entity.projectionmatrix);
+
+    dlight.signature = hash;
+    dlight.sun = entity.sun.boolValue() ? 1 : 0;
+    for (int i = 0; i < 3; i++) {
+        dlight.mins[i] = entity.mins[i];
+        dlight.maxs[i] = entity.maxs[i];
+    }
+    return dlight;
+}
+
+static void
+Incremental_ReadLightFile(const char *bspfilename, const char *ext, std::vector<uint8_t> *data)
+{
+    char filename[1024];
+    litheader_t header;
+
+    data->clear();
+
+    q_snprintf(filename, sizeof(filename) - 4, "%s", bspfilename);
+    StripExtension(filename);
+    DefaultExtension(filename, ext);
+
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return;
+
+    if (fread(&header.v1, sizeof(header.v1), 1, f) == 1
+        && !memcmp(header.v1.ident, "QLIT", 4)
+        && LittleLong(header.v1.version) == LIT_VERSION) {
+        uint8_t buffer[8192];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            data->insert(data->end(), buffer, buffer + count);
+    }
+
+    fclose(f);
+}
+
+void
+Incremental_LoadLightFiles(const char *bspfilename)
+{
+    Incremental_ReadLightFile(bspfilename, ".lit", &old_litfile);
+    Incremental_ReadLightFile(bspfilename, ".lux", &old_luxfile);
+}
+
+/*
+ * Picks the previous .lit or .lux data out of the bspx lump or the file,
+ * whichever matches what the last run wrote.
+ */
+static bool
+Incremental_FindOldData(bspdata_t *bspdata, const char *lumpname, const std::vector<uint8_t> &file,
+                        uint64_t key, std::vector<uint8_t> *data)
+{
+    size_t lumpsize;
+    const uint8_t *lump = static_cast<const uint8_t *>(BSPX_GetLump(bspdata, lumpname, &lumpsize));
+
+    if (lump && Hash_Data(lump, lumpsize) == key) {
+        data->assign(lump, lump + lumpsize);
+        return true;
+    }
+    if (!file.empty() && Hash_Data(file.data(), file.size()) == key) {
+        *data = file;
+        return true;
+    }
+    return false;
+}
+
+static bool
+Incremental_LoadState(const char *filename, uint64_t key)
+{
+    FILE *infile = fopen(filename, "rb");
+    if (!infile) {
+        logprint("Incremental: no light state %s, lighting every face\n", filename);
+        return false;
+    }
+
+    fseek(infile, 0, SEEK_END);
+    const long filesize = ftell(infile);
+    fseek(infile, 0, SEEK_SET);
+
+    if (fread(&state, sizeof(state), 1, infile) != 1 || state.version != INCREMENTAL_VERSION) {
+        logprint("Incremental: light state %s is not valid, lighting every face\n", filename);
+        fclose(infile);
+        return false;
+    }
+    if (state.key != key) {
+        logprint("Incremental: geometry or settings changed, lighting every face\n");
+        fclose(infile);
+        return false;
+    }
+
+    /* truncated, e.g. by an interrupted run; it's only a cache, so light everything */
+    const uint64_t lightsbytes = static_cast<uint64_t>(state.numlights) * sizeof(dlightstatelight_t);
+    if (lightsbytes > static_cast<uint64_t>(filesize) - sizeof(state)) {
+        logprint("Incremental: light state %s is not valid, lighting every face\n", filename);
+        fclose(infile);
+        return false;
+    }
+    state_lights.resize(state.numlights);
+    if (fread(state_lights.data(), sizeof(dlightstatelight_t), state_lights.size(), infile) != state_lights.size()) {
+        logprint("Incremental: light state %s is not valid, lighting every face\n", filename);
+        state_lights.clear();
+        fclose(infile);
+        return false;
+    }
+    fclose(infile);
+    return true;
+}
+
+/*
+ * Reasons the old lightmaps can't be reused as they are.
+ */
+static const char *
+Incremental_CantCopy(bspdata_t *bspdata)
+{
+    if (litonly || scaledonly || write_litfile == ~0)
+        return "-litonly, -novanilla and -lit2 aren't supported";
+    if (BSPX_GetLump(bspdata, "LMSHIFT", NULL))
+        return "per-face lightmap scales aren't supported";
+    return nullptr;
+}
+
+/*
+ * Reasons the per-light diff can't tell which faces changed, or the old
+ * lightmaps can't be reused as they are.
+ */
+static const char *
+Incremental_Unsupported(bspdata_t *bspdata, const globalconfig_t &cfg)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+
+    if (novisapprox)
+        return "-novisapprox leaves lights without bounds";
+    if (cfg.bounce.boolValue())
+        return "bounce lighting depends on every light";
+    if (bsp->loadversion->game->id == GAME_QUAKE_II)
+        return "surface lights depend on texture files";
+    if (debugmode != debugmode_none)
+        return "debug modes aren't supported";
+    return Incremental_CantCopy(bspdata);
+}
+
+/* the lightmaps Incremental_CopyFace would copy must be within the old data */
+static bool
+Incremental_OldLightmapFits(const mbsp_t *bsp, int facenum)
+{
+    const bsp2_dface_t *face = &bsp->dfaces[facenum];
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+    const bool needlit = !rgb && write_litfile;
+
+    int numstyles = 0;
+    while (numstyles < MAXLIGHTMAPS && face->styles[numstyles] != 255)
+        numstyles++;
+    if (face->lightofs == -1 || numstyles == 0)
+        return true;
+
+    const size_t size = static_cast<size_t>(face_luxels[facenum]) * numstyles;
+    const size_t ofs = face->lightofs;
+    return rgb
+        ? (ofs + 3 * size <= old_lightdata.size()
+           && (!write_luxfile || ofs + 3 * size <= old_luxdata.size()))
+        : (ofs + size <= old_lightdata.size()
+           && (!needlit || 3 * (ofs + size) <= old_litdata.size())
+           && (!write_luxfile || 3 * (ofs + size) <= old_luxdata.size()));
+}
+
+void
+Incremental_Setup(bspdata_t *bspdata, globalconfig_t &cfg, const char *statefilename, int argc, const char **argv)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+
+    logprint("--- Incremental_Setup ---\n");
+
+    incremental_active = false;
+    state_filename = statefilename;
+    const uint64_t key = Incremental_Key(bsp, cfg, argc, argv);
+
+    const char *unsupported = Incremental_Unsupported(bspdata, cfg);
+    if (unsupported) {
+        logprint("Incremental: %s, lighting every face\n", unsupported);
+        state.key = key;
+        return;
+    }
+
+    if (!Incremental_LoadState(statefilename, key)) {
+        state.key = key;
+        return;
+    }
+
+    /* make sure the lighting on disk is the lighting the state describes */
+    if (Hash_Data(bsp->dlightdata, bsp->lightdatasize) != state.lightdatakey) {
+        logprint("Incremental: lighting was changed by another run, lighting every face\n");
+        return;
+    }
+    old_lightdata.assign(bsp->dlightdata, bsp->dlightdata + bsp->lightdatasize);
+
+    const bool needlit = !rgb && write_litfile;
+    if (needlit && !Incremental_FindOldData(bspdata, "RGBLIGHTING", old_litfile, state.litkey, &old_litdata)) {
+        logprint("Incremental: previous .lit data not found, lighting every face\n");
+        return;
+    }
+    if (write_luxfile && !Incremental_FindOldData(bspdata, "LIGHTINGDIR", old_luxfile, state.luxkey, &old_luxdata)) {
+        logprint("Incremental: previous .lux data not found, lighting every face\n");
+        return;
+    }
+    old_litfile.clear();
+    old_luxfile.clear();
+
+    /* multiset difference of the old and new light lists */
+    std::vector<dlightstatelight_t> new_lights;
+    for (const light_t &entity : GetLights())
+        new_lights.push_back(Incremental_LightState(entity));
+
+    auto bysignature = [](const dlightstatelight_t &a, const dlightstatelight_t &b) {
+        return a.signature < b.signature;
+    };
+    std::vector<dlightstatelight_t> old_sorted = state_lights;
+    std::vector<dlightstatelight_t> new_sorted = new_lights;
+    std::sort(old_sorted.begin(), old_sorted.end(), bysignature);
+    std::sort(new_sorted.begin(), new_sorted.end(), bysignature);
+
+    std::vector<dlightstatelight_t> changed;
+    std::set_symmetric_difference(old_sorted.begin(), old_sorted.end(),
+                                  new_sorted.begin(), new_sorted.end(),
+                                  std::back_inserter(changed), bysignature);
+
+    for (const dlightstatelight_t &dlight : changed) {
+        if (dlight.sun) {
+            logprint("Incremental: a sun light changed, lighting every face\n");
+            return;
+        }
+    }
+
+    face_affected.assign(bsp->numfaces, 0);
+    face_luxels.assign(bsp->numfaces, 0);
+
+    int numaffected = 0;
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        vec3_t mins, maxs;
+
+        if (!LightFace_Extents(bsp, face, mins, maxs, &face_luxels[i]))
+            continue;
+
+        for (const dlightstatelight_t &dlight : changed) {
+            vec3_t lightmins, lightmaxs;
+            for (int j = 0; j < 3; j++) {
+                lightmins[j] = dlight.mins[j];
+                lightmaxs[j] = dlight.maxs[j];
+            }
+            if (!AABBsDisjoint(lightmins, lightmaxs, mins, maxs)) {
+                face_affected[i] = 1;
+                break;
+            }
+        }
+        if (face_affected[i]) {
+            numaffected++;
+            continue;
+        }
+        if (!Incremental_OldLightmapFits(bsp, i)) {
+            logprint("Incremental: face %d's old lightmap is out of range, lighting every face\n", i);
+            return;
+        }
+    }
+
+    logprint("Incremental: %d lights changed, relighting %d of %d faces\n",
+             static_cast<int>(changed.size()), numaffected, bsp->numfaces);
+    incremental_active = true;
+}
+
+/*
+ * Picks the current .lit or .lux data out of the bspx lump or the file.
+ * There's no light state to check it against, so it only has to be the
+ * size the bsp's lighting implies.
+ */
+static bool
+Incremental_FindCurrentData(bspdata_t *bspdata, const char *lumpname, const std::vector<uint8_t> &file,
+                            size_t size, std::vector<uint8_t> *data)
+{
+    size_t lumpsize;
+    const uint8_t *lump = static_cast<const uint8_t *>(BSPX_GetLump(bspdata, lumpname, &lumpsize));
+
+    if (lump && lumpsize == size) {
+        data->assign(lump, lump + lumpsize);
+        return true;
+    }
+    if (file.size() == size) {
+        *data = file;
+        return true;
+    }
+    return false;
+}
+
+void
+Incremental_SetupRegion(bspdata_t *bspdata, const std::vector<uint8_t> &selected)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+
+    logprint("--- Incremental_SetupRegion ---\n");
+
+    Q_assert(selected.size() == static_cast<size_t>(bsp->numfaces));
+    incremental_active = false;
+
+    const char *unsupported = Incremental_CantCopy(bspdata);
+    if (unsupported) {
+        logprint("Region: %s, lighting every face\n", unsupported);
+        return;
+    }
+    if (!bsp->lightdatasize) {
+        logprint("Region: the bsp has no lighting to keep, lighting every face\n");
+        return;
+    }
+    old_lightdata.assign(bsp->dlightdata, bsp->dlightdata + bsp->lightdatasize);
+
+    const size_t rgbsize = 3 * static_cast<size_t>(bsp->lightdatasize);
+    if (!rgb && write_litfile
+        && !Incremental_FindCurrentData(bspdata, "RGBLIGHTING", old_litfile, rgbsize, &old_litdata)) {
+        logprint("Region: no .lit data matching the bsp's lighting, lighting every face\n");
+        return;
+    }
+    if (write_luxfile
+        && !Incremental_FindCurrentData(bspdata, "LIGHTINGDIR", old_luxfile, rgbsize, &old_luxdata)) {
+        logprint("Region: no .lux data matching the bsp's lighting, lighting every face\n");
+        return;
+    }
+    old_litfile.clear();
+    old_luxfile.clear();
+
+    face_affected = selected;
+    face_luxels.assign(bsp->numfaces, 0);
+
+    int numaffected = 0;
+    for (int i = 0; i < bsp->numfaces; i++) {
+        vec3_t mins, maxs;
+        if (!LightFace_Extents(bsp, &bsp->dfaces[i], mins, maxs, &face_luxels[i]))
+            continue;
+
+        if (face_affected[i]) {
+            numaffected++;
+            continue;
+        }
+        if (!Incremental_OldLightmapFits(bsp, i)) {
+            logprint("Region: face %d's lightmap is out of range, lighting every face\n", i);
+            return;
+        }
+    }
+
+    logprint("Region: relighting %d of %d faces\n", numaffected, bsp->numfaces);
+    incremental_active = true;
+}
+
+bool
+Incremental_CopyFace(const mbsp_t *bsp, int facenum)
+{
+    if (!incremental_active || face_affected[facenum])
+        return false;
+
+    bsp2_dface_t *face = BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum);
+
+    int numstyles = 0;
+    while (numstyles < MAXLIGHTMAPS && face->styles[numstyles] != 255)
+        numstyles++;
+
+    if (face->lightofs == -1 || numstyles == 0) {
+        face->lightofs = -1;
+        for (int i = 0; i < MAXLIGHTMAPS; i++)
+            face->styles[i] = 255;
+        return true;
+    }
+
+    const int size = face_luxels[facenum] * numstyles;
+    const int ofs = face->lightofs;
+    uint8_t *out, *lit, *lux;
+    GetFileSpace(bsp, face, nullptr, &out, &lit, &lux, size);
+
+    if (bsp->loadversion->game->has_rgb_lightmap) {
+        // lightofs indexes the rgb data, which the lux data lines up with
+        memcpy(lit, old_lightdata.data() + ofs, 3 * size);
+        if (!old_luxdata.empty())
+            memcpy(lux, old_luxdata.data() + ofs, 3 * size);
+    } else {
+        memcpy(out, old_lightdata.data() + ofs, size);
+        if (!old_litdata.empty())
+            memcpy(lit, old_litdata.data() + 3 * ofs, 3 * size);
+        if (!old_luxdata.empty())
+            memcpy(lux, old_luxdata.data() + 3 * ofs, 3 * size);
+    }
+    return true;
+}
+
+void
+Incremental_SaveState(const mbsp_t *bsp)
+{
+    if (state_filename.empty())
+        return;
+
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+
+    // hash what light_main writes out: the lighting lump, .lit and .lux data
+    state.version = INCREMENTAL_VERSION;
+    state.numlights = static_cast<uint32_t>(GetLights().size());
+    state.lightdatakey = Hash_Data(bsp->dlightdata, bsp->lightdatasize);
+    state.litkey = rgb ? 0 : Hash_Data(lit_filebase, bsp->lightdatasize * 3);
+    state.luxkey = Hash_Data(lux_filebase, bsp->lightdatasize * 3);
+
+    const std::string tmpfile = state_filename + ".tmp";
+    FILE *outfile = SafeOpenWrite(tmpfile.c_str());
+
+    SafeWrite(outfile, &state, sizeof(state));
+    for (const light_t &entity : GetLights()) {
+        const dlightstatelight_t dlight = Incremental_LightState(entity);
+        SafeWrite(outfile, &dlight, sizeof(dlight));
+    }
+
+    if (fclose(outfile))
+        Error("%s: error writing %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+
+    remove(state_filename.c_str());
+    if (rename(tmpfile.c_str(), state_filename.c_str()))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+
+    logprint("Saved light state to %s\n", state_filename.c_str());
+}
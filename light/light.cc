@@ -21,6 +21,7 @@
 #include <cassert>
 #include <cstdio>
 #include <iostream>
+#include <numeric>
 
 #include <light/light.hh>
 #include <light/phong.hh>
@@ -29,6 +30,15 @@
 #include <light/imglib.hh> //mxd
 #include <light/entities.hh>
 #include <light/ltface.hh>
+#include <light/incremental.hh>
+#include <light/region.hh>
+#include <light/lightgrid.hh>
+#include <light/pvscull.hh>
+#include <light/distlight.hh>
+#include <light/profile.hh>
+#include <light/pointcache.hh>
+#include <common/memstats.hh>
+#include <common/compilecache.hh>
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
@@ -45,7 +55,19 @@
 #include <set>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
 #include <string>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 #include <common/qvec.hh>
 
@@ -61,32 +83,38 @@ int softsamples = 0;
 const vec3_t vec3_white = { 255, 255, 255 };
 float surflight_subdivide = 128.0f;
 int sunsamples = 64;
+int skyrays = 0;
+int bouncephotons = 0;
+int bouncedepth = 1;
 qboolean scaledonly = false;
 
 qboolean surflight_dump = false;
 
 static facesup_t *faces_sup;    //lit2/bspx stuff
 
-/// start of lightmap data
+/// lightmap data, packed in face order once lighting is done
 uint8_t *filebase;
-/// offset of start of free space after data (should be kept a multiple of 4)
-static int file_p;
-/// offset of end of free space for lightmap data
-static int file_end;
-
-/// start of litfile data
+/// litfile data, 3 bytes for each byte of filebase
 uint8_t *lit_filebase;
-/// offset of start of free space after litfile data (should be kept a multiple of 12)
-static int lit_file_p;
-/// offset of end of space for litfile data
-static int lit_file_end;
-
-/// start of luxfile data
+/// luxfile data, laid out like lit_filebase
 uint8_t *lux_filebase;
-/// offset of start of free space after luxfile data (should be kept a multiple of 12)
-static int lux_file_p;
-/// offset of end of space for luxfile data
-static int lux_file_end;
+
+/// lightmaps a face's lighting thread wrote, waiting for CommitLightmaps
+struct facelightmaps_t {
+    /// the face's own lightmaps: size greyscale bytes, then 3 * size lit bytes, then 3 * size lux bytes
+    std::vector<uint8_t> face;
+    /// the same for its scaled (faces_sup) lightmaps, when they are lit separately
+    std::vector<uint8_t> facesup;
+    /// the scaled lightmaps are just the face's own
+    bool sharesup = false;
+};
+static std::vector<facelightmaps_t> face_lightmaps;
+static memcounter_t facelightmapmem("face lightmaps");
+
+/// SetFaceLitCallback's callback, and the lock that lets it be cleared safely
+static facelitcallback_t facelitcallback;
+static std::mutex facelitcallback_lock;
+static std::atomic<bool> facelitcallbackset { false };
 
 std::vector<modelinfo_t *> modelinfo;
 std::vector<const modelinfo_t *> tracelist;
@@ -95,10 +123,26 @@ std::vector<const modelinfo_t *> shadowworldonlylist;
 std::vector<const modelinfo_t *> switchableshadowlist;
 
 int oversample = 1;
+qboolean adaptiveextra = false;
+qboolean progressive = false;
+qboolean previewpass = false;
 int write_litfile = 0;  /* 0 for none, 1 for .lit, 2 for bspx, 3 for both */
 int write_luxfile = 0;  /* 0 for none, 1 for .lux, 2 for bspx, 3 for both */
 qboolean onlyents = false;
 qboolean novisapprox = false;
+bool visapproxpvs = false;
+bool visapproxfastrays = false;
+qboolean sortfaces = true;
+qboolean facebatch = false;
+static qboolean sharelightmaps = true;
+qboolean pointcache = false;
+int embreequality = 2;
+qboolean embreecompact = false;
+qboolean embreecache = false;
+qboolean occludercache = false;
+qboolean incremental = false;
+static bool watch = false;
+static bool bouncelights_made = false;  /* for the current lights */
 bool nolights = false;
 bool debug_highlightseams = false;
 debugmode_t debugmode = debugmode_none;
@@ -172,39 +216,27 @@ PrintOptionsSummary(void)
 }
 
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
+ * Return space for a face's lightmap, colourmap and deluxemap. Each face
+ * is lit by a single thread, so this needs no lock; the face's lightofs
+ * is set when CommitLightmaps packs everything in face order.
  *
  * size is the number of greyscale pixels = number of bytes to allocate
  * and return in *lightdata
  */
 void
-GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size)
+GetFileSpace(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup,
+             uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size)
 {
-    ThreadLock();
-
-    *lightdata = filebase + file_p;
-    *colordata = lit_filebase + lit_file_p;
-    *deluxdata = lux_filebase + lux_file_p;
-
-    // if size isn't a multiple of 4, round up to the next multiple of 4
-    if ((size % 4) != 0) {
-        size += (4 - (size % 4));
-    }
-
-    // increment the next writing offsets, aligning them to 4 uint8_t boundaries (file_p)
-    // and 12-uint8_t boundaries (lit_file_p/lux_file_p)
-    file_p += size;
-    lit_file_p += 3 * size;
-    lux_file_p += 3 * size;
-
-    ThreadUnlock();
+    facelightmaps_t &lightmaps = face_lightmaps.at(Face_GetNum(bsp, face));
+    std::vector<uint8_t> &data = facesup ? lightmaps.facesup : lightmaps.face;
 
-    if (file_p > file_end)
-        Error("%s: overrun", __func__);
+    const int64_t before = data.size();
+    data.assign(7 * static_cast<size_t>(size), 0);
+    facelightmapmem.add(static_cast<int64_t>(data.size()) - before);
 
-    if (lit_file_p > lit_file_end)
-        Error("%s: overrun", __func__);
+    *lightdata = data.data();
+    *colordata = data.data() + size;
+    *deluxdata = data.data() + 4 * size;
 }
 
 /**
@@ -224,7 +256,7 @@ void GetFileSpace_PreserveOffsetInBsp(uint8_t **lightdata, uint8_t **colordata,
         *deluxdata = lux_filebase + (lightofs * 3);
     }
 
-    // NOTE: file_p et. al. are not updated, since we're not dynamically allocating the lightmaps
+    // NOTE: nothing is staged for CommitLightmaps, since we're not dynamically allocating the lightmaps
 }
 
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum)
@@ -250,54 +282,201 @@ const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum)
     return modelinfo.at(i);
 }
 
-static void *
-LightThread(void *arg)
+static void
+LightThread(const mbsp_t *bsp, int facenum, lightbatch_t *batch = nullptr)
 {
-    const mbsp_t *bsp = (const mbsp_t *)arg;
-
 #ifdef HAVE_EMBREE
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 //    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 #endif
 
-    while (1) {
-        const int facenum = GetThreadWork();
-        if (facenum == -1)
-            break;
+    bsp2_dface_t *f = const_cast<bsp2_dface_t*>(BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum));
 
-        bsp2_dface_t *f = const_cast<bsp2_dface_t*>(BSP_GetFace(const_cast<mbsp_t *>(bsp), facenum));
-        
-        /* Find the correct model offset */
-        const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
-        if (face_modelinfo == NULL) {
-            // ericw -- silenced this warning becasue is causes spam when "skip" faces are used
-            //logprint("warning: no model has face %d\n", facenum);
-            continue;
+    /* Find the correct model offset */
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
+    if (face_modelinfo == NULL) {
+        // ericw -- silenced this warning becasue is causes spam when "skip" faces are used
+        //logprint("warning: no model has face %d\n", facenum);
+        return;
+    }
+
+    if (Incremental_CopyFace(bsp, facenum))
+        return;
+
+    const double start = timingenabled ? Timing_Now() : 0;
+
+    if (!faces_sup)
+        LightFace(bsp, f, nullptr, cfg_static, batch);
+    else if (scaledonly)
+    {
+        f->lightofs = -1;
+        f->styles[0] = 255;
+        LightFace(bsp, f, faces_sup + facenum, cfg_static, batch);
+    }
+    else if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
+    {
+        LightFace(bsp, f, nullptr, cfg_static, batch);
+        face_lightmaps[facenum].sharesup = true;
+        for (int i = 0; i < MAXLIGHTMAPS; i++)
+            faces_sup[facenum].styles[i] = f->styles[i];
+    }
+    else
+    {
+        LightFace(bsp, f, nullptr, cfg_static, batch);
+        LightFace(bsp, f, faces_sup + facenum, cfg_static, batch);
+    }
+
+    if (timingenabled) {
+        const double end = Timing_Now();
+        Timing_Event("LightFace", facenum, start, end);
+        Profile_Face(facenum, start, end);
+    }
+
+    if (facelitcallbackset.load(std::memory_order_relaxed) && !scaledonly) {
+        const std::vector<uint8_t> &data = face_lightmaps[facenum].face;
+        if (!data.empty()) {
+            const int size = static_cast<int>(data.size() / 7);
+            std::lock_guard<std::mutex> lock(facelitcallback_lock);
+            if (facelitcallback)
+                facelitcallback(facenum, f->styles, data.data() + size, size);
         }
-        
-        if (!faces_sup)
-            LightFace(bsp, f, nullptr, cfg_static);
-        else if (scaledonly)
-        {
-            f->lightofs = -1;
-            f->styles[0] = 255;
-            LightFace(bsp, f, faces_sup + facenum, cfg_static);
+    }
+}
+
+static void
+LightBatchThread(const mbsp_t *bsp, lightbatch_t *batch)
+{
+    for (int facenum : batch->facenums)
+        LightThread(bsp, facenum, batch);
+
+    /* done with this batch, don't keep its ray streams around */
+    batch->occlusion_stream.reset();
+    batch->intersection_stream.reset();
+    batch->streamsize = 0;
+}
+
+static std::vector<int64_t>
+FaceCosts(const mbsp_t *bsp)
+{
+    std::vector<int64_t> costs(bsp->numfaces);
+    RunThreadsOn(0, bsp->numfaces, 0, [bsp, &costs](int facenum, int thread) {
+        const facesup_t *facesup = faces_sup ? faces_sup + facenum : nullptr;
+        costs[facenum] = LightFace_EstimateCost(bsp, BSP_GetFace(bsp, facenum), facesup, cfg_static);
+    });
+    return costs;
+}
+
+/*
+ * Returns the face numbers ordered most expensive first, so a few huge
+ * faces hit by every light don't end up as the last items of the run with
+ * the remaining workers idle.
+ */
+static std::vector<int>
+SortFacesByCost(const mbsp_t *bsp)
+{
+    logprint("--- SortFacesByCost ---\n");
+
+    const std::vector<int64_t> costs = FaceCosts(bsp);
+
+    std::vector<int> order(bsp->numfaces);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&costs](int a, int b) {
+        return costs[a] > costs[b];
+    });
+    return order;
+}
+
+/*
+ * Lights just these faces, for a -coordinator or -worker job.
+ */
+void
+LightFaces(const mbsp_t *bsp, const std::vector<int> &facenums)
+{
+    RunThreadsOn(0, static_cast<int>(facenums.size()), 1, [bsp, &facenums](int i, int thread) {
+        LightThread(bsp, facenums[i]);
+    });
+}
+
+/*
+ * A job's results, in the worker's byte order: for each face its styles
+ * and lightofs (only -1 or not matters, the offsets are picked when the
+ * coordinator commits), the same for its faces_sup entry, then the
+ * lightmap buffers LightThread left for CommitLightmaps.
+ */
+typedef struct {
+    int32_t facenum;
+    int32_t lightofs, suplightofs;
+    uint32_t facesize, facesupsize;
+    uint8_t styles[MAXLIGHTMAPS], supstyles[MAXLIGHTMAPS];
+    uint8_t sharesup;
+    uint8_t pad[3];
+} facelightmapsheader_t;
+
+void
+SaveFaceLightmaps(const mbsp_t *bsp, const std::vector<int> &facenums, FILE *f)
+{
+    for (const int facenum : facenums) {
+        const bsp2_dface_t *face = BSP_GetFace(bsp, facenum);
+        const facelightmaps_t &lightmaps = face_lightmaps.at(facenum);
+
+        facelightmapsheader_t header {};
+        header.facenum = facenum;
+        header.lightofs = face->lightofs;
+        header.suplightofs = faces_sup ? faces_sup[facenum].lightofs : -1;
+        header.facesize = static_cast<uint32_t>(lightmaps.face.size());
+        header.facesupsize = static_cast<uint32_t>(lightmaps.facesup.size());
+        for (int i = 0; i < MAXLIGHTMAPS; i++) {
+            header.styles[i] = face->styles[i];
+            header.supstyles[i] = faces_sup ? faces_sup[facenum].styles[i] : 255;
         }
-        else if (faces_sup[facenum].lmscale == face_modelinfo->lightmapscale)
-        {
-            LightFace(bsp, f, nullptr, cfg_static);
-            faces_sup[facenum].lightofs = f->lightofs;
+        header.sharesup = lightmaps.sharesup;
+
+        SafeWrite(f, &header, sizeof(header));
+        SafeWrite(f, lightmaps.face.data(), lightmaps.face.size());
+        SafeWrite(f, lightmaps.facesup.data(), lightmaps.facesup.size());
+    }
+}
+
+void
+LoadFaceLightmaps(mbsp_t *bsp, const uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+
+    while (pos < size) {
+        facelightmapsheader_t header;
+        if (size - pos < sizeof(header))
+            Error("%s: truncated face header", __func__);
+        memcpy(&header, data + pos, sizeof(header));
+        pos += sizeof(header);
+
+        if (header.facenum < 0 || header.facenum >= bsp->numfaces)
+            Error("%s: invalid face %d", __func__, header.facenum);
+        if (size - pos < static_cast<size_t>(header.facesize) + header.facesupsize)
+            Error("%s: truncated lightmaps for face %d", __func__, header.facenum);
+        if ((header.facesupsize || header.sharesup) && !faces_sup)
+            Error("%s: face %d has scaled lightmaps, but this run doesn't", __func__, header.facenum);
+
+        bsp2_dface_t *face = BSP_GetFace(bsp, header.facenum);
+        facelightmaps_t &lightmaps = face_lightmaps.at(header.facenum);
+        const int64_t before = lightmaps.face.size() + lightmaps.facesup.size();
+
+        face->lightofs = header.lightofs;
+        for (int i = 0; i < MAXLIGHTMAPS; i++)
+            face->styles[i] = header.styles[i];
+        if (faces_sup) {
+            faces_sup[header.facenum].lightofs = header.suplightofs;
             for (int i = 0; i < MAXLIGHTMAPS; i++)
-                faces_sup[facenum].styles[i] = f->styles[i];
+                faces_sup[header.facenum].styles[i] = header.supstyles[i];
         }
-        else
-        {
-            LightFace(bsp, f, nullptr, cfg_static);
-            LightFace(bsp, f, faces_sup + facenum, cfg_static);
-        }
-    }
 
-    return NULL;
+        lightmaps.face.assign(data + pos, data + pos + header.facesize);
+        pos += header.facesize;
+        lightmaps.facesup.assign(data + pos, data + pos + header.facesupsize);
+        pos += header.facesupsize;
+        lightmaps.sharesup = header.sharesup;
+
+        facelightmapmem.add(static_cast<int64_t>(lightmaps.face.size() + lightmaps.facesup.size()) - before);
+    }
 }
 
 static void
@@ -341,6 +520,7 @@ FindModelInfo(const mbsp_t *bsp, const char *lmscaleoverride)
     modelinfo.push_back(world);
     tracelist.push_back(world);
     
+    const entdict_index_t entindex = IndexEntDicts();
     for (int i = 1; i < bsp->nummodels; i++) {
         modelinfo_t *info = new modelinfo_t { bsp, &bsp->dmodels[i], lightmapscale };
         modelinfo.push_back(info);
@@ -350,7 +530,8 @@ FindModelInfo(const mbsp_t *bsp, const char *lmscaleoverride)
         ss << "*" << i;
         std::string modelname = ss.str();
         
-        const entdict_t *entdict = FindEntDictWithKeyPair("model", modelname);
+        const auto entit = entindex.by_model.find(modelname);
+        const entdict_t *entdict = (entit != entindex.by_model.end()) ? entit->second : nullptr;
         if (entdict == nullptr)
             Error("%s: Couldn't find entity for model %s.\n", __func__,
                   modelname.c_str());
@@ -377,6 +558,157 @@ FindModelInfo(const mbsp_t *bsp, const char *lmscaleoverride)
     Q_assert(modelinfo.size() == bsp->nummodels);
 }
 
+static uint8_t *
+AllocLightmapData(size_t size)
+{
+    uint8_t *data = (uint8_t *)calloc(size ? size : 1, 1);
+    if (!data)
+        Error("%s: allocation of %zu bytes failed.", __func__, size);
+    return data;
+}
+
+/* a block of packed lightmap data another face's lightmaps can point at */
+struct lightmapblock_t {
+    const std::vector<uint8_t> *data;   // the facelightmaps_t buffer it's from
+    size_t size;                        // greyscale bytes, may be a prefix of the buffer's styles
+    size_t ofs;                         // where the buffer is packed
+};
+
+/* the greyscale, lit and lux bytes of the first size greyscale bytes of data */
+static uint64_t
+LightmapBlock_Hash(const std::vector<uint8_t> &data, size_t size)
+{
+    const size_t fullsize = data.size() / 7;
+    uint64_t hash = FNV_HASH_INIT;
+    FNV_HashBytes(&hash, data.data(), size);
+    FNV_HashBytes(&hash, data.data() + fullsize, 3 * size);
+    FNV_HashBytes(&hash, data.data() + 4 * fullsize, 3 * size);
+    return hash;
+}
+
+static bool
+LightmapBlock_Equal(const lightmapblock_t &block, const std::vector<uint8_t> &data)
+{
+    const size_t size = data.size() / 7;
+    const size_t fullsize = block.data->size() / 7;
+    const uint8_t *other = block.data->data();
+    return block.size == size
+        && !memcmp(other, data.data(), size)
+        && !memcmp(other + fullsize, data.data() + size, 3 * size)
+        && !memcmp(other + 4 * fullsize, data.data() + 4 * size, 3 * size);
+}
+
+static int
+CountStyles(const uint8_t *styles)
+{
+    int numstyles = 0;
+    while (numstyles < MAXLIGHTMAPS && styles[numstyles] != 255)
+        numstyles++;
+    return numstyles;
+}
+
+/*
+ * =============
+ * CommitLightmaps
+ *
+ * Packs the lightmaps the lighting threads wrote into exactly sized
+ * filebase / lit_filebase / lux_filebase buffers, in face order, and
+ * points each face's lightofs at its data. Returns the greyscale size.
+ *
+ * Lightmaps identical to ones already packed (all black, or all minlight,
+ * faces are common) point at the existing data instead, including the
+ * leading styles of a face with several. Engines only read a face's own
+ * styles from its lightofs, so they can't tell the difference.
+ * =============
+ */
+static int
+CommitLightmaps(mbsp_t *bsp)
+{
+    const bool rgb = bsp->loadversion->game->has_rgb_lightmap;
+
+    // each face's greyscale data starts on a 4 byte boundary (12 for lit/lux)
+    const auto padded = [](size_t size) {
+        return (size + 3) & ~static_cast<size_t>(3);
+    };
+
+    /* first pick each buffer's offset, sharing the ones seen before */
+    std::unordered_multimap<uint64_t, lightmapblock_t> blocks;
+    std::vector<std::pair<const std::vector<uint8_t> *, size_t>> packed;
+    size_t total = 0;
+    int numshared = 0;
+    size_t sharedsize = 0;
+
+    const auto place = [&](const std::vector<uint8_t> &data, const uint8_t *styles) {
+        const size_t size = data.size() / 7;
+
+        if (sharelightmaps) {
+            const auto range = blocks.equal_range(LightmapBlock_Hash(data, size));
+            for (auto it = range.first; it != range.second; ++it) {
+                if (LightmapBlock_Equal(it->second, data)) {
+                    numshared++;
+                    sharedsize += size;
+                    return it->second.ofs;
+                }
+            }
+        }
+
+        const size_t ofs = total;
+        total += padded(size);
+        packed.emplace_back(&data, ofs);
+
+        if (!sharelightmaps)
+            return ofs;
+
+        // the whole buffer, and its leading styles if it has several
+        const int numstyles = CountStyles(styles);
+        if (numstyles > 1 && size % numstyles == 0) {
+            const size_t stylesize = size / numstyles;
+            for (int i = 1; i < numstyles; i++)
+                blocks.emplace(LightmapBlock_Hash(data, i * stylesize), lightmapblock_t { &data, i * stylesize, ofs });
+        }
+        blocks.emplace(LightmapBlock_Hash(data, size), lightmapblock_t { &data, size, ofs });
+        return ofs;
+    };
+    const auto lightofs = [rgb](size_t ofs) {
+        return static_cast<int>(rgb ? 3 * ofs : ofs);
+    };
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        facelightmaps_t &lightmaps = face_lightmaps[i];
+        bsp2_dface_t *face = BSP_GetFace(bsp, i);
+
+        if (!lightmaps.face.empty())
+            face->lightofs = lightofs(place(lightmaps.face, face->styles));
+        if (!lightmaps.facesup.empty())
+            faces_sup[i].lightofs = lightofs(place(lightmaps.facesup, faces_sup[i].styles));
+        else if (lightmaps.sharesup)
+            faces_sup[i].lightofs = face->lightofs;
+    }
+
+    /* then copy out the buffers that weren't shared */
+    // the .lit/.lux writers take lightdatasize * 3 bytes, which for rgb games is already the rgb size
+    const size_t litsize = rgb ? 9 * total : 3 * total;
+    filebase = AllocLightmapData(total);
+    lit_filebase = AllocLightmapData(litsize);
+    lux_filebase = AllocLightmapData(litsize);
+
+    for (const auto &entry : packed) {
+        const std::vector<uint8_t> &data = *entry.first;
+        const size_t size = data.size() / 7;
+        const size_t ofs = entry.second;
+        memcpy(filebase + ofs, data.data(), size);
+        memcpy(lit_filebase + 3 * ofs, data.data() + size, 3 * size);
+        memcpy(lux_filebase + 3 * ofs, data.data() + 4 * size, 3 * size);
+    }
+
+    if (numshared)
+        logprint("%d lightmaps share data with an identical one, saving %zu luxels\n", numshared, sharedsize);
+
+    std::vector<facelightmaps_t>().swap(face_lightmaps);
+    facelightmapmem.sub(facelightmapmem.current());
+    return static_cast<int>(total);
+}
+
 /*
  * =============
  *  LightWorld
@@ -388,30 +720,21 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     logprint("--- LightWorld ---\n" );
     
     mbsp_t *const bsp = &bspdata->data.mbsp;
+    FinishLitFiles();   /* the last pass's .lit/.lux are written from these */
     free(filebase);
     free(lit_filebase);
     free(lux_filebase);
+    free(faces_sup);
 
-    /* greyscale data stored in a separate buffer */
-    filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING, 1);
-    if (!filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING);
-    file_p = 0;
-    file_end = MAX_MAP_LIGHTING;
-
-    /* litfile data stored in a separate buffer */
-    lit_filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING*3, 1);
-    if (!lit_filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING*3);
-    lit_file_p = 0;
-    lit_file_end = (MAX_MAP_LIGHTING*3);
-
-    /* lux data stored in a separate buffer */
-    lux_filebase = (uint8_t *)calloc(MAX_MAP_LIGHTING*3, 1);
-    if (!lux_filebase)
-        Error("%s: allocation of %i bytes failed.", __func__, MAX_MAP_LIGHTING*3);
-    lux_file_p = 0;
-    lux_file_end = (MAX_MAP_LIGHTING*3);
+    if (litonly) {
+        /* the lightmaps are rewritten in place at the offsets already in the bsp */
+        filebase = AllocLightmapData(bsp->lightdatasize);
+        lit_filebase = AllocLightmapData(3 * bsp->lightdatasize);
+        lux_filebase = AllocLightmapData(3 * bsp->lightdatasize);
+    } else {
+        filebase = lit_filebase = lux_filebase = nullptr;
+        face_lightmaps.assign(bsp->numfaces, facelightmaps_t {});
+    }
 
     if (forcedscale)
         BSPX_AddLump(bspdata, "LMSHIFT", NULL, 0);
@@ -435,27 +758,63 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
         }
     }
 
-    CalculateVertexNormals(bsp);
-    
     const qboolean bouncerequired = cfg_static.bounce.boolValue() && (debugmode == debugmode_none || debugmode == debugmode_bounce || debugmode == debugmode_bouncelights); //mxd
     const qboolean isQuake2map = bsp->loadversion->game->id == GAME_QUAKE_II; //mxd
 
-    if (bouncerequired || isQuake2map) {
-        MakeTextureColors(bsp);
-        if (isQuake2map)   MakeSurfaceLights(cfg_static, bsp);
-        if (bouncerequired) MakeBounceLights(cfg_static, bsp);
+    /* once per map, -progressive and -watch call LightWorld again */
+    static bool prepared = false;
+    if (!prepared) {
+        {
+            timingscope_t scope("CalculateVertexNormals");
+            CalculateVertexNormals(bsp);
+        }
+        
+        if (bouncerequired || isQuake2map) {
+            timingscope_t scope("MakeTextureColors");
+            MakeTextureColors(bsp);
+            if (isQuake2map)   MakeSurfaceLights(cfg_static, bsp);
+        }
+        prepared = true;
     }
     
-#if 0
-    lightbatchthread_info_t info;
-    info.all_batches = MakeLightingBatches(bsp);
-    info.all_contribFaces = MakeContributingFaces(bsp);
-    info.bsp = bsp;
-    RunThreadsOn(0, info.all_batches.size(), LightBatchThread, &info);
-#else
-    logprint("--- LightThread ---\n"); //mxd
-    RunThreadsOn(0, bsp->numfaces, LightThread, bsp);
-#endif
+    /* bounce lights are lit by the lights, so they're remade when those change */
+    if (bouncerequired && !bouncelights_made) {
+        timingscope_t scope("MakeBounceLights");
+        MakeBounceLights(cfg_static, bsp);
+        bouncelights_made = true;
+    }
+    
+    {
+        timingscope_t scope("LightThread");
+        if (lightcoordinator) {
+            logprint("--- RunLightCoordinator ---\n");
+            RunLightCoordinator(bsp, cfg_static, FaceCosts(bsp));
+        } else if (lightworker) {
+            logprint("--- RunLightWorker ---\n");
+            RunLightWorker(bsp, cfg_static);
+        } else if (facebatch) {
+            std::vector<lightbatch_t> batches = MakeLightingBatches(bsp, faces_sup, cfg_static);
+
+            logprint("--- LightBatchThread ---\n");
+            RunThreadsOn(0, static_cast<int>(batches.size()), 1, [bsp, &batches](int i, int thread) {
+                LightBatchThread(bsp, &batches[i]);
+            });
+        } else if (sortfaces && numthreads > 1) {
+            const std::vector<int> order = SortFacesByCost(bsp);
+
+            logprint("--- LightThread ---\n"); //mxd
+            // the expensive faces come first, so hand them out one at a time
+            RunThreadsOn(0, bsp->numfaces, 1, [bsp, &order](int i, int thread) {
+                LightThread(bsp, order[i]);
+            });
+        } else {
+            logprint("--- LightThread ---\n"); //mxd
+            // many faces are rejected almost immediately, so hand them out in adaptive chunks
+            RunThreadsOn(0, bsp->numfaces, 0, [bsp](int facenum, int thread) {
+                LightThread(bsp, facenum);
+            });
+        }
+    }
 
     if (bouncerequired || isQuake2map) { //mxd. Print some extra stats...
         logprint("Indirect lights: %i bounce lights, %i surface lights (%i light points) in use.\n",
@@ -468,13 +827,16 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
 
     // Transfer greyscale lightmap (or color lightmap for Q2/HL) to the bsp and update lightdatasize
     if (!litonly) {
+        timingscope_t scope("CommitLightmaps");
+        const int size = CommitLightmaps(bsp);
+
         free(bsp->dlightdata);
         if (bsp->loadversion->game->has_rgb_lightmap) {
-            bsp->lightdatasize = lit_file_p;
+            bsp->lightdatasize = 3 * size;
             bsp->dlightdata = (uint8_t *)malloc(bsp->lightdatasize);
             memcpy(bsp->dlightdata, lit_filebase, bsp->lightdatasize);
         } else {
-            bsp->lightdatasize = file_p;
+            bsp->lightdatasize = size;
             bsp->dlightdata = (uint8_t *)malloc(bsp->lightdatasize);
             memcpy(bsp->dlightdata, filebase, bsp->lightdatasize);
         }
@@ -500,6 +862,99 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     }
 }
 
+/*
+ * =============
+ * WriteLightingOutputs
+ *
+ * After LightWorld: attaches the lighting BSPX lumps and starts writing
+ * the .lit/.lux files in the background; FinishLitFiles waits for them.
+ * Returns false for lit2-only output, where nothing else gets written.
+ * =============
+ */
+static bool
+WriteLightingOutputs(bspdata_t *bspdata, const char *source)
+{
+    timingscope_t scope("WriteLightingOutputs");
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    
+    /*invalidate any bspx lighting info early*/
+    BSPX_AddLump(bspdata, "RGBLIGHTING", NULL, 0);
+    BSPX_AddLump(bspdata, "LIGHTINGDIR", NULL, 0);
+
+    if (write_litfile == ~0)
+    {
+        StartLitFiles(bsp, faces_sup, source, 2, 0);
+        return false;
+    }
+    
+    /*fixme: add a new per-surface offset+lmscale lump for compat/versitility?*/
+    if (write_litfile & 2)
+        BSPX_AddLump(bspdata, "RGBLIGHTING", lit_filebase, bsp->lightdatasize*3);
+    if (write_luxfile & 2)
+        BSPX_AddLump(bspdata, "LIGHTINGDIR", lux_filebase, bsp->lightdatasize*3);
+    if ((write_litfile & 1) || (write_luxfile & 1))
+        StartLitFiles(bsp, faces_sup, source, (write_litfile & 1) ? LIT_VERSION : 0, (write_luxfile & 1) ? LIT_VERSION : 0);
+    return true;
+}
+
+/*
+ * =============
+ * WriteBSPCopy
+ *
+ * Writes the lighting and entities to source in copy, a bsp loaded from
+ * it and converted to the generic format. The bsp being lit can't be
+ * converted back to its own format while it's still in use, as it is
+ * after -progressive's preview pass and all along with -watch. Frees copy.
+ * =============
+ */
+static void
+WriteBSPCopy(const globalconfig_t &cfg, bspdata_t *bspdata, bspdata_t *copy, const bspversion_t *version, const char *source)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    mbsp_t *copybsp = &copy->data.mbsp;
+    Q_assert(copybsp->numfaces == bsp->numfaces);
+    
+    for (int i = 0; i < bsp->numfaces; i++) {
+        copybsp->dfaces[i].lightofs = bsp->dfaces[i].lightofs;
+        for (int j = 0; j < MAXLIGHTMAPS; j++)
+            copybsp->dfaces[i].styles[j] = bsp->dfaces[i].styles[j];
+    }
+    
+    free(copybsp->dlightdata);
+    copybsp->lightdatasize = bsp->lightdatasize;
+    copybsp->dlightdata = (uint8_t *)malloc(bsp->lightdatasize);
+    memcpy(copybsp->dlightdata, bsp->dlightdata, bsp->lightdatasize);
+    
+    /* -novanilla + internal lighting = no grey lightmap */
+    if (scaledonly && (write_litfile & 2))
+        copybsp->lightdatasize = 0;
+    
+    /* the lumps LightWorld and WriteLightingOutputs manage; the data stays owned by bspdata */
+    for (const char *lumpname : { "LMSHIFT", "LMSTYLE", "LMOFFSET", "RGBLIGHTING", "LIGHTINGDIR" }) {
+        size_t size;
+        const void *data = BSPX_GetLump(bspdata, lumpname, &size);
+        BSPX_AddLump(copy, lumpname, data, size);
+    }
+    
+    WriteEntitiesToString(cfg, copybsp);
+    ConvertBSPFormat(copy, version);
+    WriteBSPFile(source, copy);
+    FreeBSPData(copy);
+}
+
+/* -progressive: the preview pass's lighting, written over the input */
+static void
+WritePreviewBSP(const globalconfig_t &cfg, bspdata_t *bspdata, char *source)
+{
+    bspdata_t preview {};
+    LoadBSPFile(source, &preview);
+    const bspversion_t *version = preview.version;
+    ConvertBSPFormat(&preview, &bspver_generic);
+    
+    WriteBSPCopy(cfg, bspdata, &preview, version, source);
+    logprint("Wrote preview lighting to %s\n", source);
+}
+
 static void
 LoadExtendedTexinfoFlags(const char *sourcefilename, const mbsp_t *bsp)
 {
@@ -734,6 +1189,48 @@ static void CheckLitNeeded(const globalconfig_t &cfg)
     }
 }
 
+/*
+ * The bsp, entities included, the files light reads alongside it and the
+ * options; argc is the index of the bsp's name. Only Quake and Hexen II
+ * bsps carry all of their textures, so only those are cached.
+ */
+static uint64_t
+CompileCacheKey(const char *source, int argc, const char **argv)
+{
+    const std::string base = StrippedExtension(source);
+    uint64_t key = CompileCache_Begin("light");
+
+    CompileCache_HashArgs(&key, std::vector<std::string>(argv + 1, argv + argc));
+    for (int i = 1; i + 1 < argc; i++) {
+        if (!strcmp(argv[i], "-radlights"))
+            CompileCache_HashFile(&key, argv[i + 1]);
+    }
+    CompileCache_HashFile(&key, source);
+    CompileCache_HashFile(&key, "lights.rad");
+    CompileCache_HashFile(&key, (base + ".rad").c_str());
+    CompileCache_HashFile(&key, (base + ".texinfo").c_str());
+    return key;
+}
+
+/* the files this run writes, by extension */
+static std::vector<std::string>
+CompileCacheOutputs(void)
+{
+    if (write_litfile == ~0)
+        return { ".lit" };
+    if (onlyents)
+        return { ".bsp" };
+
+    std::vector<std::string> outputs;
+    if (!litonly)
+        outputs.push_back(".bsp");
+    if (write_litfile & 1)
+        outputs.push_back(".lit");
+    if (write_luxfile & 1)
+        outputs.push_back(".lux");
+    return outputs;
+}
+
 static void PrintLight(const light_t &light)
 {
     bool first = true;
@@ -770,15 +1267,46 @@ static void PrintUsage()
 "\n"
 "Performance options:\n"
 "  -threads n          set the number of threads\n"
+"  -nosortfaces        light faces in index order instead of most expensive first\n"
+"  -facebatch          light nearby faces in batches, culling lights once per batch\n"
+"  -pvscull            skip the faces a light can't see according to the bsp's vis data\n"
+"  -pointcache         reuse sample points saved by a previous run on the same geometry\n"
+"  -embreequality n    ray tracing scene build quality, 0 (fastest build) to 2 (default)\n"
+"  -embreecompact      build a smaller, slower to trace ray tracing scene\n"
+"  -membudget mb       keep to mb megabytes where possible (implies -embreecompact)\n"
+"  -numanode n         run on the CPUs of NUMA node n only\n"
+"  -pinthreads         pin each thread to a CPU of its own\n"
+"  -embreecache        reuse the ray tracing geometry saved by a previous run on the same geometry\n"
+"  -occludercache      try each light's recent occluders before tracing its shadow rays (experimental)\n"
+"  -incremental        only relight faces near lights changed since the last -incremental run\n"
+"  -watch              stay running and relight the map when the bsp is rewritten\n"
+"  -coordinator        split the faces into jobs that -worker runs on other machines can share\n"
+"  -worker             run jobs for a -coordinator lighting the same bsp, then exit\n"
+"  -jobsize n          faces per -coordinator job, default 256\n"
+"  -jobtimeout n       seconds before a worker's job is run again, default 600\n"
+"  -regionbox x1 y1 z1 x2 y2 z2  only relight faces touching this box\n"
+"  -regionface n       only relight this face\n"
+"  -regionmodel name   only relight this brush entity, by \"*n\" or targetname\n"
+"  -regionpvs x y z    only relight faces potentially visible from this point\n"
 "  -extra              2x supersampling\n"
 "  -extra4             4x supersampling, slowest, use for final compile\n"
+"  -adaptiveextra      only supersample faces crossed by a shadow edge\n"
+"  -progressive        write a quick preview lighting first, then the full quality lighting\n"
 "  -gate n             cutoff lights at this brightness level\n"
 "  -sunsamples n       set samples for _sunlight2, default 64\n"
+"  -skyrays n          trace n rays per sample for sky domes and penumbras instead of one per sun\n"
+"  -bouncephotons n    gather bounced light from a map of n photons instead of every bounce light\n"
+"  -bouncedepth n      number of bounces the photons make, default 1\n"
 "  -surflight_subdivide  surface light subdivision size\n"
+"  -profile            time the phases, faces and lights, write map.lightprofile.json and map.lighttrace.json\n"
+"  -timing             time the phases, write map.lighttiming.json\n"
+"  -timingtrace        -timing, and write a trace of the phases and faces to map.lighttrace.json\n"
+"  -cachedir dir       reuse the output of an earlier run on the same bsp with the same options stored in dir\n"
 "\n"
 "Output format options:\n"
 "  -lit                write .lit file\n"
 "  -onlyents           only update entities\n"
+"  -nosharelightmaps   give every face its own lightmap data, even if identical to another's\n"
 "\n"
 "Postprocessing options:\n"
 "  -soft [n]           blurs the lightmap, n=blur radius in samples\n"
@@ -789,6 +1317,8 @@ static void PrintUsage()
 "  -bouncedebug        only save bounced lighting to the lightmap\n"
 "  -surflight_dump     dump surface lights to a .map file\n"
 "  -novisapprox        disable approximate visibility culling of lights\n"
+"  -visapprox pvs      take the lights' visible bounds from the bsp's vis data instead of tracing rays\n"
+"  -visapprox fastrays trace fewer rays for the visible bounds of lights that fade out nearby\n"
 "\n"
 "Experimental options:\n"
 "  -lit2               write .lit2 file\n"
@@ -927,6 +1457,208 @@ static const char *ParseString(int *i_inout, int argc, const char **argv)
     return result;
 }
 
+/*
+ * ==================
+ * LoadForTracing
+ *
+ * Loads source and sets up what tracing rays against it needs (textures
+ * for fences, entities, model shadow flags and the trace scene), the same
+ * way light_main does, without lighting anything. For benchlight.
+ * ==================
+ */
+void
+LoadForTracing(const char *source, bspdata_t *bspdata)
+{
+    mbsp_t *const bsp = &bspdata->data.mbsp;
+    char filename[1024];
+
+    q_snprintf(filename, sizeof(filename), "%s", source);
+    DefaultExtension(filename, ".bsp");
+    LoadBSPFile(filename, bspdata);
+    ConvertBSPFormat(bspdata, &bspver_generic);
+
+    SetQdirFromPath(GetBaseDirName(bspdata), filename);
+    LoadPalette(bspdata);
+    LoadOrConvertTextures(bsp);
+
+    LoadExtendedTexinfoFlags(filename, bsp);
+    LoadEntities(cfg_static, bsp);
+    FindModelInfo(bsp, NULL);
+    MakeTnodes(bsp);
+}
+
+/*
+ * ============================================================================
+ * WATCH MODE (-watch)
+ *
+ * After lighting the map, light stays resident with the ray tracing
+ * scene, vertex normals and textures loaded, and polls the bsp. When it's
+ * rewritten with only the light entities changed (qbsp -onlyents after an
+ * editor save), the lights are set up again and -incremental relights
+ * the faces they touch. Anything else changing needs those caches rebuilt,
+ * so light restarts itself with the same command line.
+ * ============================================================================
+ */
+
+#define WATCH_POLL_MS 250
+
+/* changes whenever the file is rewritten */
+static std::string
+Watch_FileStamp(const char *filename)
+{
+    std::error_code err;
+    const auto time = std::filesystem::last_write_time(filename, err);
+    if (err)
+        return std::string();
+    const auto size = std::filesystem::file_size(filename, err);
+    if (err)
+        return std::string();
+    return std::to_string(time.time_since_epoch().count()) + ":" + std::to_string(size);
+}
+
+/* the entities besides lights, which the resident caches depend on (worldspawn, bmodels) */
+static uint64_t
+Watch_EntityKey(const mbsp_t *bsp)
+{
+    uint64_t hash = FNV_HASH_INIT;
+    for (const entdict_t &entdict : EntData_Parse(bsp->dentdata)) {
+        if (EntDict_StringForKey(entdict, "classname").compare(0, 5, "light") == 0)
+            continue;
+        for (const auto &epair : entdict) {
+            FNV_HashBytes(&hash, epair.first.c_str(), epair.first.size() + 1);
+            FNV_HashBytes(&hash, epair.second.c_str(), epair.second.size() + 1);
+        }
+        FNV_HashBytes(&hash, "}", 1);
+    }
+    return hash;
+}
+
+static uint64_t watch_entitykey;
+
+[[noreturn]] static void
+Watch_Restart(int argc, const char **argv)
+{
+    logprint("Watch: restarting light\n");
+    close_log();
+
+    std::vector<char *> args;
+    for (int i = 0; i < argc; i++)
+        args.push_back(const_cast<char *>(argv[i]));
+    args.push_back(nullptr);
+#ifdef _WIN32
+    _execvp(args[0], args.data());
+#else
+    execvp(args[0], args.data());
+#endif
+    Error("-watch: couldn't restart %s (%s)", argv[0], strerror(errno));
+}
+
+/* the light_main steps that depend on the lights, then the output */
+static void
+Watch_Relight(globalconfig_t &cfg, bspdata_t *bspdata, bspdata_t *incoming, const bspversion_t *version,
+              const std::string &stamp, char *source, const char *lmscaleoverride, int argc, const char **argv)
+{
+    mbsp_t *const bsp = &bspdata->data.mbsp;
+    const double start = I_FloatTime();
+    
+    /* the new entities; everything else is unchanged */
+    free(bsp->dentdata);
+    bsp->entdatasize = incoming->data.mbsp.entdatasize;
+    bsp->dentdata = static_cast<char *>(malloc(bsp->entdatasize));
+    memcpy(bsp->dentdata, incoming->data.mbsp.dentdata, bsp->entdatasize);
+    
+    ResetEntities();
+    LoadEntities(cfg, bsp);
+    if (lmscaleoverride)
+        SetWorldKeyValue("_lightmap_scale", lmscaleoverride);
+    SetupLights(cfg, bsp);
+    if (!bsp->loadversion->game->has_rgb_lightmap)
+        CheckLitNeeded(cfg);
+    PVSCull_Setup(bsp);
+    
+    char statefile[1024];
+    q_snprintf(statefile, sizeof(statefile), "%s", source);
+    StripExtension(statefile);
+    DefaultExtension(statefile, ".lst");
+    Incremental_LoadLightFiles(source);
+    Incremental_Setup(bspdata, cfg, statefile, argc, argv);
+    
+    bouncelights_made = false;
+    LightWorld(bspdata, !!lmscaleoverride);
+    
+    if (cfg.lightgrid.boolValue() && !litonly) {
+        timingscope_t scope("LightGrid");
+        LightGrid(cfg, bspdata);
+    }
+    
+    bool written = false;
+    if (WriteLightingOutputs(bspdata, source)) {
+        Incremental_SaveState(bsp);
+        
+        /* if it was saved again meanwhile, that's relit next instead */
+        if (!litonly && Watch_FileStamp(source) == stamp) {
+            WriteBSPCopy(cfg, bspdata, incoming, version, source);
+            written = true;
+        }
+    }
+    if (!written)
+        FreeBSPData(incoming);
+    
+    logprint("Watch: relit in %5.3f seconds\n", I_FloatTime() - start);
+}
+
+static void
+WatchBSP(globalconfig_t &cfg, bspdata_t *bspdata, char *source, const char *lmscaleoverride, int argc, const char **argv)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    const uint64_t geometrykey = PointCache_Key(bsp, cfg);
+    std::string stamp = Watch_FileStamp(source);
+    
+    for (;;) {
+        logprint("Watch: waiting for %s to change\n", source);
+        
+        /* changed, and then unchanged for a poll, so qbsp has finished writing it */
+        std::string newstamp;
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MS));
+            newstamp = Watch_FileStamp(source);
+        } while (newstamp.empty() || newstamp == stamp);
+        do {
+            stamp = newstamp;
+            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MS));
+            newstamp = Watch_FileStamp(source);
+        } while (newstamp != stamp);
+        
+        bspdata_t incoming {};
+        LoadBSPFile(source, &incoming);
+        const bspversion_t *version = incoming.version;
+        ConvertBSPFormat(&incoming, &bspver_generic);
+        const mbsp_t *incomingbsp = &incoming.data.mbsp;
+        
+        if (incomingbsp->numfaces != bsp->numfaces || incomingbsp->numtexinfo != bsp->numtexinfo
+            || PointCache_Key(incomingbsp, cfg) != geometrykey) {
+            logprint("Watch: the geometry changed\n");
+            Watch_Restart(argc, argv);
+        }
+        if (Watch_EntityKey(incomingbsp) != watch_entitykey) {
+            logprint("Watch: worldspawn or a brush entity changed\n");
+            Watch_Restart(argc, argv);
+        }
+        
+        logprint("--- Watch: relighting %s ---\n", source);
+        Watch_Relight(cfg, bspdata, &incoming, version, stamp, source, lmscaleoverride, argc, argv);
+        stamp = Watch_FileStamp(source);
+    }
+}
+
+void
+SetFaceLitCallback(facelitcallback_t callback)
+{
+    std::lock_guard<std::mutex> lock(facelitcallback_lock);
+    facelitcallbackset = static_cast<bool>(callback);
+    facelitcallback = std::move(callback);
+}
+
 /*
  * ==================
  * main
@@ -956,12 +1688,98 @@ light_main(int argc, const char **argv)
     for (i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-threads")) {
             numthreads = ParseInt(&i, argc, argv);
+        } else if (!strcmp(argv[i], "-nosortfaces")) {
+            sortfaces = false;
+            logprint("Face cost sorting disabled\n");
+        } else if (!strcmp(argv[i], "-facebatch")) {
+            facebatch = true;
+            logprint("Face batching enabled\n");
+        } else if (!strcmp(argv[i], "-profile")) {
+            lightprofile = true;
+            timingtrace = true;
+            logprint("Profiling enabled\n");
+        } else if (!strcmp(argv[i], "-timing")) {
+            timingenabled = true;
+            logprint("Phase timing enabled\n");
+        } else if (!strcmp(argv[i], "-timingtrace")) {
+            timingtrace = true;
+            logprint("Phase timing enabled, with a trace\n");
+        } else if (!strcmp(argv[i], "-cachedir")) {
+            compilecachedir = ParseString(&i, argc, argv);
+            logprint("Compile cache in %s\n", compilecachedir.c_str());
+        } else if (!strcmp(argv[i], "-pointcache")) {
+            pointcache = true;
+            logprint("Sample point cache enabled\n");
+        } else if (!strcmp(argv[i], "-embreequality")) {
+            embreequality = ParseInt(&i, argc, argv);
+            if (embreequality < 0 || embreequality > 2)
+                Error("-embreequality must be 0, 1 or 2");
+        } else if (!strcmp(argv[i], "-pvscull")) {
+            pvscull = true;
+            logprint("PVS light culling enabled\n");
+        } else if (!strcmp(argv[i], "-embreecompact")) {
+            embreecompact = true;
+            logprint("Compact ray tracing scene enabled\n");
+        } else if (!strcmp(argv[i], "-membudget")) {
+            Mem_SetBudget(i + 1 < argc ? argv[++i] : nullptr);
+            logprint("Memory budget %s MB\n", argv[i]);
+        } else if (!strcmp(argv[i], "-numanode")) {
+            BindToNumaNode(ParseInt(&i, argc, argv));
+        } else if (!strcmp(argv[i], "-pinthreads")) {
+            PinThreads();
+            logprint("Thread pinning enabled\n");
+        } else if (!strcmp(argv[i], "-embreecache")) {
+            embreecache = true;
+            logprint("Ray tracing geometry cache enabled\n");
+        } else if (!strcmp(argv[i], "-occludercache")) {
+            occludercache = true;
+            logprint("Shadow ray occluder cache disabled\n");
+        } else if (!strcmp(argv[i], "-incremental")) {
+            incremental = true;
+            logprint("Incremental relighting enabled\n");
+        } else if (!strcmp(argv[i], "-watch")) {
+            watch = true;
+            incremental = true;
+            logprint("Watch mode enabled\n");
+        } else if (!strcmp(argv[i], "-coordinator")) {
+            lightcoordinator = true;
+            logprint("Coordinating distributed lighting\n");
+        } else if (!strcmp(argv[i], "-worker")) {
+            lightworker = true;
+            logprint("Running as a distributed lighting worker\n");
+        } else if (!strcmp(argv[i], "-jobsize")) {
+            lightjobsize = ParseInt(&i, argc, argv);
+            if (lightjobsize < 1)
+                Error("-jobsize needs a positive number of faces");
+        } else if (!strcmp(argv[i], "-jobtimeout")) {
+            lightjobtimeout = ParseInt(&i, argc, argv);
+            if (lightjobtimeout < 1)
+                Error("-jobtimeout needs a positive number of seconds");
+        } else if (!strcmp(argv[i], "-regionbox")) {
+            vec3_t mins, maxs;
+            ParseVec3(mins, &i, argc, argv);
+            ParseVec3(maxs, &i, argc, argv);
+            Region_AddBox(mins, maxs);
+        } else if (!strcmp(argv[i], "-regionface")) {
+            Region_AddFace(ParseInt(&i, argc, argv));
+        } else if (!strcmp(argv[i], "-regionmodel")) {
+            Region_AddModel(ParseString(&i, argc, argv));
+        } else if (!strcmp(argv[i], "-regionpvs")) {
+            vec3_t point;
+            ParseVec3(point, &i, argc, argv);
+            Region_AddPVS(point);
         } else if (!strcmp(argv[i], "-extra")) {
             oversample = 2;
             logprint("extra 2x2 sampling enabled\n");
         } else if (!strcmp(argv[i], "-extra4")) {
             oversample = 4;
             logprint("extra 4x4 sampling enabled\n");
+        } else if (!strcmp(argv[i], "-adaptiveextra")) {
+            adaptiveextra = true;
+        } else if (!strcmp(argv[i], "-progressive")) {
+            progressive = true;
+            logprint("Progressive mode enabled, writing a preview before the full lighting\n");
+            logprint("adaptive extra sampling enabled\n");
         } else if (!strcmp(argv[i], "-gate")) {
             fadegate = ParseVec(&i, argc, argv);
             if (fadegate > 1) {
@@ -1022,6 +1840,18 @@ light_main(int argc, const char **argv)
             sunsamples = ParseInt(&i, argc, argv);
             sunsamples = qmin(qmax(sunsamples, 8), 2048);
             logprint( "Using sunsamples of %d\n", sunsamples);
+        } else if ( !strcmp( argv[ i ], "-skyrays" ) ) {
+            skyrays = ParseInt(&i, argc, argv);
+            skyrays = qmax(skyrays, 0);
+            logprint( "Using %d sky rays per sample\n", skyrays);
+        } else if ( !strcmp( argv[ i ], "-bouncephotons" ) ) {
+            bouncephotons = ParseInt(&i, argc, argv);
+            bouncephotons = qmax(bouncephotons, 0);
+            logprint( "Using a photon map of %d photons for bounced light\n", bouncephotons);
+        } else if ( !strcmp( argv[ i ], "-bouncedepth" ) ) {
+            bouncedepth = ParseInt(&i, argc, argv);
+            bouncedepth = qmin(qmax(bouncedepth, 1), 8);
+            logprint( "Photons bounce %d times\n", bouncedepth);
         } else if ( !strcmp( argv[ i ], "-onlyents" ) ) {
             onlyents = true;
             logprint( "Onlyents mode enabled\n" );
@@ -1037,6 +1867,14 @@ light_main(int argc, const char **argv)
         } else if ( !strcmp( argv[ i ], "-novisapprox" ) ) {
             novisapprox = true;
             logprint( "Skipping approximate light visibility\n" );
+        } else if ( !strcmp( argv[ i ], "-visapprox" ) ) {
+            const char *mode = ParseString(&i, argc, argv);
+            visapproxpvs = !Q_strcasecmp(mode, "pvs");
+            visapproxfastrays = !Q_strcasecmp(mode, "fastrays");
+            if (!visapproxpvs && !visapproxfastrays && Q_strcasecmp(mode, "rays"))
+                Error("-visapprox: expected \"rays\", \"fastrays\" or \"pvs\", got \"%s\"", mode);
+            logprint( "Approximate light visibility from %s\n",
+                      visapproxpvs ? "the vis data" : visapproxfastrays ? "fewer traced rays" : "traced rays" );
         } else if ( !strcmp( argv[ i ], "-nolights" ) ) {
             nolights = true;
             logprint( "Skipping all light entities (sunlight / minlight only)\n" );
@@ -1061,6 +1899,9 @@ light_main(int argc, const char **argv)
         } else if (!strcmp(argv[i], "-arghradcompat")) { //mxd
             logprint("Arghrad entity keys conversion enabled\n");
             arghradcompat = true;
+        } else if (!strcmp(argv[i], "-nosharelightmaps")) {
+            sharelightmaps = false;
+            logprint("Identical lightmaps won't share data\n");
         } else if (!strcmp(argv[i], "-litonly")) {
             logprint("-litonly specified; .bsp file will not be modified\n");
             litonly = true;
@@ -1105,6 +1946,19 @@ light_main(int argc, const char **argv)
         exit(1);
     }
 
+    if (watch && (progressive || onlyents || Region_Active() || write_litfile == ~0))
+        Error("-watch can't be combined with -progressive, -onlyents, -lit2 or the -region options");
+    if (progressive && incremental)
+        Error("-progressive can't be combined with -incremental");
+    if (!compilecachedir.empty() && (incremental || watch || lightworker || Region_Active()))
+        Error("-cachedir can't be combined with -incremental, -watch, -worker or the -region options");
+    if (lightcoordinator && lightworker)
+        Error("-coordinator and -worker are separate processes");
+    if ((lightcoordinator || lightworker) && (incremental || progressive || litonly || onlyents || Region_Active()))
+        Error("-coordinator and -worker can't be combined with -incremental, -watch, -progressive, -litonly, -onlyents or the -region options");
+    if (Region_Active() && incremental)
+        Error("-region options can't be combined with -incremental");
+
     if (debugmode != debugmode_none) {
         write_litfile |= 1;
     }
@@ -1112,6 +1966,12 @@ light_main(int argc, const char **argv)
     if (numthreads > 1)
         logprint("running with %d threads\n", numthreads);
 
+    /* the ray tracing scene is often the biggest allocation */
+    if (membudget && !embreecompact) {
+        embreecompact = true;
+        logprint("Compact ray tracing scene enabled for -membudget\n");
+    }
+
     if (write_litfile == ~0)
         logprint("generating lit2 output only.\n");
     else
@@ -1141,12 +2001,15 @@ light_main(int argc, const char **argv)
     }
 
     start = I_FloatTime();
+    Timing_Start("light");
 
     strcpy(source, argv[i]);
     strcpy(mapfilename, argv[i]);
     
     // delete previous litfile
     if (!onlyents) {
+        if (incremental || Region_Active())
+            Incremental_LoadLightFiles(source);
         StripExtension(source);
         DefaultExtension(source, ".lit");
         remove(source);
@@ -1166,6 +2029,23 @@ light_main(int argc, const char **argv)
 
     loadversion = bspdata.version;
     ConvertBSPFormat(&bspdata, &bspver_generic);
+    if (watch)
+        watch_entitykey = Watch_EntityKey(bsp);
+
+    uint64_t cachekey = 0;
+    if (!compilecachedir.empty()) {
+        if (loadversion->game->id == GAME_QUAKE_II || loadversion->game->id == GAME_HALF_LIFE) {
+            logprint("Compile cache not used, this game's textures aren't in the bsp\n");
+            compilecachedir.clear();
+        } else {
+            cachekey = CompileCacheKey(source, i, argv);
+            if (CompileCache_Restore("light", cachekey, StrippedExtension(source), CompileCacheOutputs())) {
+                Timing_Finish(source);
+                close_log();
+                return 0;
+            }
+        }
+    }
 
     //mxd. Use 1.0 rangescale as a default to better match with qrad3/arghrad
     if ((loadversion->game->id == GAME_QUAKE_II) && !cfg.rangescale.isChanged())
@@ -1180,7 +2060,10 @@ light_main(int argc, const char **argv)
     LoadOrConvertTextures(bsp);
 
     LoadExtendedTexinfoFlags(source, bsp);
-    LoadEntities(cfg, bsp);
+    {
+        timingscope_t scope("LoadEntities");
+        LoadEntities(cfg, bsp);
+    }
 
     PrintOptionsSummary();
     
@@ -1202,7 +2085,10 @@ light_main(int argc, const char **argv)
         return 0;
     }
     
-    SetupLights(cfg, bsp);
+    {
+        timingscope_t scope("SetupLights");
+        SetupLights(cfg, bsp);
+    }
     
     //PrintLights();
     
@@ -1212,48 +2098,108 @@ light_main(int argc, const char **argv)
             CheckLitNeeded(cfg);
         }
         SetupDirt(cfg);
+        PVSCull_Setup(bsp);
+        
+        if (pointcache) {
+            StripExtension(source);
+            DefaultExtension(source, ".lpc");
+            PointCache_Load(bsp, cfg, source);
+            StripExtension(source);
+            DefaultExtension(source, ".bsp");
+        }
+        
+        if (incremental) {
+            StripExtension(source);
+            DefaultExtension(source, ".lst");
+            Incremental_Setup(&bspdata, cfg, source, argc, argv);
+            StripExtension(source);
+            DefaultExtension(source, ".bsp");
+        }
+        
+        if (Region_Active())
+            Region_Setup(&bspdata);
+        
+        if (progressive) {
+            /* a quick pass the engine can load straight away, then the real one */
+            logprint("--- Progressive preview pass ---\n");
+            const bool dirt = dirt_in_use;
+            dirt_in_use = false;
+            previewpass = true;
+            
+            LightWorld(&bspdata, !!lmscaleoverride);
+            if (WriteLightingOutputs(&bspdata, source) && !litonly)
+                WritePreviewBSP(cfg, &bspdata, source);
+            
+            previewpass = false;
+            dirt_in_use = dirt;
+            logprint("--- Progressive full quality pass ---\n");
+        }
         
         LightWorld(&bspdata, !!lmscaleoverride);
+        PointCache_Save();
         
-        /*invalidate any bspx lighting info early*/
-        BSPX_AddLump(&bspdata, "RGBLIGHTING", NULL, 0);
-        BSPX_AddLump(&bspdata, "LIGHTINGDIR", NULL, 0);
-
-        if (write_litfile == ~0)
-        {
-            WriteLitFile(bsp, faces_sup, source, 2);
-            return 0;   //run away before any files are written
+        if (lightworker) {
+            /* the coordinator writes the bsp */
+            Profile_Finish(source);
+            Mem_Report();
+            Timing_Finish(source);
+            ShutdownThreadPool();
+            return 0;
         }
-        else
+        
+        if (cfg.lightgrid.boolValue() && !litonly) {
+            timingscope_t scope("LightGrid");
+            LightGrid(cfg, &bspdata);
+        }
+        
+        if (!WriteLightingOutputs(&bspdata, source))
         {
-            /*fixme: add a new per-surface offset+lmscale lump for compat/versitility?*/
-            if (write_litfile & 1)
-                WriteLitFile(bsp, faces_sup, source, LIT_VERSION);
-            if (write_litfile & 2)
-                BSPX_AddLump(&bspdata, "RGBLIGHTING", lit_filebase, bsp->lightdatasize*3);
-            if (write_luxfile & 1)
-                WriteLuxFile(bsp, source, LIT_VERSION);
-            if (write_luxfile & 2)
-                BSPX_AddLump(&bspdata, "LIGHTINGDIR", lux_filebase, bsp->lightdatasize*3);
+            FinishLitFiles();
+            Profile_Finish(source);
+            Mem_Report();
+            Timing_Finish(source);
+            ShutdownThreadPool();
+            if (!compilecachedir.empty())
+                CompileCache_Store("light", cachekey, StrippedExtension(source), CompileCacheOutputs());
+            return 0;   //run away before any files are written
         }
-    }
 
-    /* -novanilla + internal lighting = no grey lightmap */
-    if (scaledonly && (write_litfile & 2))
-        bsp->lightdatasize = 0;
+        if (incremental)
+            Incremental_SaveState(bsp);
+    }
 
 #if 0
     ExportObj(source, bsp);
 #endif
     
-    WriteEntitiesToString(cfg, bsp);
-    /* Convert data format back if necessary */
-    ConvertBSPFormat(&bspdata, loadversion);
+    if (watch) {
+        /* the bsp stays resident, so the output is written through a copy */
+        if (!litonly) {
+            timingscope_t scope("WriteBSPFile");
+            bspdata_t copy {};
+            LoadBSPFile(source, &copy);
+            ConvertBSPFormat(&copy, &bspver_generic);
+            WriteBSPCopy(cfg, &bspdata, &copy, loadversion, source);
+        }
+    } else {
+        /* -novanilla + internal lighting = no grey lightmap */
+        if (scaledonly && (write_litfile & 2))
+            bsp->lightdatasize = 0;
+        
+        WriteEntitiesToString(cfg, bsp);
+        /* Convert data format back if necessary */
+        ConvertBSPFormat(&bspdata, loadversion);
 
-    if (!litonly) {
-        WriteBSPFile(source, &bspdata);
+        if (!litonly) {
+            timingscope_t scope("WriteBSPFile");
+            WriteBSPFile(source, &bspdata);
+        }
     }
 
+    FinishLitFiles();
+    if (!compilecachedir.empty())
+        CompileCache_Store("light", cachekey, StrippedExtension(source), CompileCacheOutputs());
+
     end = I_FloatTime();
     logprint("%5.3f seconds elapsed\n", end - start);
     logprint("\n");
@@ -1268,6 +2214,18 @@ light_main(int argc, const char **argv)
              static_cast<double>(total_bounce_rays) / static_cast<double>(total_samplepoints),
              static_cast<double>(total_bounce_ray_hits) / static_cast<double>(total_samplepoints));
     logprint("%d empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    Timing_Count("light rays", total_light_rays);
+    Timing_Count("surface light rays", total_surflight_rays);
+    Timing_Count("bounce rays", total_bounce_rays);
+    Timing_Count("sample points", total_samplepoints);
+    Profile_Finish(source);
+    Mem_Report();
+    Timing_Finish(source);
+    
+    if (watch)
+        WatchBSP(cfg, &bspdata, source, lmscaleoverride, argc, argv);
+    
+    ShutdownThreadPool();
     close_log();
     
     return 0;
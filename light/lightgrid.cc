@@ -0,0 +1,310 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/bounce.hh>
+#include <light/lightgrid.hh>
+#include <light/ltface.hh>
+
+#include <common/bsputils.hh>
+#include <common/threads.hh>
+
+#define LIGHTGRID_MAXSTYLES 4
+
+typedef struct {
+    bool occluded;
+    uint8_t numstyles;
+    uint8_t styles[LIGHTGRID_MAXSTYLES];
+    uint8_t rgb[LIGHTGRID_MAXSTYLES][3];
+} lightgridsample_t;
+
+typedef struct {
+    int32_t mid[3];
+    uint32_t child[8];
+} lightgridnode_t;
+
+typedef struct {
+    int32_t mins[3];
+    int32_t size[3];
+} lightgridleaf_t;
+
+typedef struct {
+    vec3_t mins;
+    vec3_t step;
+    int size[3];
+    std::vector<lightgridsample_t> samples;
+    std::vector<lightgridnode_t> nodes;
+    std::vector<lightgridleaf_t> leafs;
+} lightgrid_t;
+
+/* BSPX_AddLump keeps a pointer, so the lump has to outlive LightGrid */
+static std::vector<uint8_t> lightgrid_lump;
+
+static const lightgridsample_t &
+LightGrid_Sample(const lightgrid_t &grid, int x, int y, int z)
+{
+    return grid.samples[(z * grid.size[1] + y) * grid.size[0] + x];
+}
+
+/* same scaling as LightFace_ScaleAndClamp, so probes match the lightmaps */
+static void
+LightGrid_ScaleAndClamp(const globalconfig_t &cfg, qvec3f color, uint8_t out[3])
+{
+    for (int c = 0; c < 3; c++) {
+        color[c] = qmax(color[c], 0.0f) * cfg.rangescale.floatValue();
+        color[c] = pow(color[c] / 255.0f, 1.0 / cfg.lightmapgamma.floatValue()) * 255.0f;
+    }
+    const float maxcolor = qmax(color[0], qmax(color[1], color[2]));
+    if (maxcolor > 255.0f)
+        color *= 255.0f / maxcolor;
+    for (int c = 0; c < 3; c++)
+        out[c] = static_cast<uint8_t>(qmin(255.0f, color[c] + 0.5f));
+}
+
+static void
+LightGrid_CalcSample(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, lightgridsample_t *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+
+    if (Light_PointInSolid(bsp, &bsp->dmodels[0], origin)) {
+        sample->occluded = true;
+        return;
+    }
+
+    std::map<int, qvec3f> lightbystyle = GetProbeLighting(bsp, cfg, origin);
+
+    /* bounce, as the average over the six axis-aligned directions */
+    if (PhotonMapActive()) {
+        const qvec3f pos = vec3_t_to_glm(origin);
+        for (int axis = 0; axis < 3; axis++) {
+            for (int sign = -1; sign <= 1; sign += 2) {
+                qvec3f normal(0);
+                normal[axis] = static_cast<float>(sign);
+                for (const auto &styleColor : PhotonMap_Irradiance(pos, normal))
+                    lightbystyle[styleColor.first] += styleColor.second / 6.0f;
+            }
+        }
+    }
+
+    /* world minlight */
+    const float minlight = cfg.minlight.floatValue();
+    if (minlight > 0) {
+        const qvec3f mincolor = vec3_t_to_glm(*cfg.minlight_color.vec3Value()) * (minlight / 255.0f);
+        qvec3f &color = lightbystyle[0];
+        if (cfg.addminlight.boolValue())
+            color += mincolor;
+        else
+            color = qv::max(color, mincolor);
+    }
+
+    /* std::map keeps the styles sorted, so style 0 always makes the cut */
+    for (const auto &styleColor : lightbystyle) {
+        if (sample->numstyles == LIGHTGRID_MAXSTYLES)
+            break;
+        uint8_t rgb[3];
+        LightGrid_ScaleAndClamp(cfg, styleColor.second, rgb);
+        if (styleColor.first != 0 && !rgb[0] && !rgb[1] && !rgb[2])
+            continue;
+
+        const int i = sample->numstyles++;
+        sample->styles[i] = static_cast<uint8_t>(styleColor.first);
+        memcpy(sample->rgb[i], rgb, 3);
+    }
+}
+
+static bool
+LightGrid_AllOccluded(const lightgrid_t &grid, const int mins[3], const int size[3])
+{
+    for (int z = mins[2]; z < mins[2] + size[2]; z++)
+        for (int y = mins[1]; y < mins[1] + size[1]; y++)
+            for (int x = mins[0]; x < mins[0] + size[0]; x++)
+                if (!LightGrid_Sample(grid, x, y, z).occluded)
+                    return false;
+    return true;
+}
+
+/*
+ * Returns the child reference for the box: LGNODE_MISSING when every probe
+ * in it is solid, a leaf once it is at most LGLEAF_SIZE along each axis,
+ * otherwise a node split at the middle of the box.
+ */
+static uint32_t
+LightGrid_BuildOctree_r(lightgrid_t *grid, const int mins[3], const int size[3], bool isroot)
+{
+    if (!size[0] || !size[1] || !size[2])
+        return LGNODE_MISSING;
+    if (!isroot && LightGrid_AllOccluded(*grid, mins, size))
+        return LGNODE_MISSING;
+
+    if (!isroot && size[0] <= LGLEAF_SIZE && size[1] <= LGLEAF_SIZE && size[2] <= LGLEAF_SIZE) {
+        lightgridleaf_t leaf;
+        for (int i = 0; i < 3; i++) {
+            leaf.mins[i] = mins[i];
+            leaf.size[i] = size[i];
+        }
+        grid->leafs.push_back(leaf);
+        return LGNODE_LEAF | static_cast<uint32_t>(grid->leafs.size() - 1);
+    }
+
+    const uint32_t nodenum = static_cast<uint32_t>(grid->nodes.size());
+    grid->nodes.emplace_back();
+
+    int32_t mid[3];
+    for (int i = 0; i < 3; i++)
+        mid[i] = mins[i] + size[i] / 2;
+
+    uint32_t children[8];
+    for (int i = 0; i < 8; i++) {
+        int childmins[3], childsize[3];
+        for (int axis = 0; axis < 3; axis++) {
+            const bool upper = (i >> (2 - axis)) & 1;
+            childmins[axis] = upper ? mid[axis] : mins[axis];
+            childsize[axis] = upper ? (mins[axis] + size[axis] - mid[axis]) : (mid[axis] - mins[axis]);
+        }
+        children[i] = LightGrid_BuildOctree_r(grid, childmins, childsize, false);
+    }
+
+    /* nodes may have grown during the recursion */
+    lightgridnode_t &node = grid->nodes[nodenum];
+    memcpy(node.mid, mid, sizeof(mid));
+    memcpy(node.child, children, sizeof(children));
+    return nodenum;
+}
+
+static void
+LightGrid_WriteInt(std::vector<uint8_t> *out, int32_t value)
+{
+    const int32_t v = LittleLong(value);
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&v);
+    out->insert(out->end(), p, p + sizeof(v));
+}
+
+static void
+LightGrid_WriteFloat(std::vector<uint8_t> *out, float value)
+{
+    const float v = LittleFloat(value);
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&v);
+    out->insert(out->end(), p, p + sizeof(v));
+}
+
+static void
+LightGrid_WriteLump(const lightgrid_t &grid, uint32_t rootnode, std::vector<uint8_t> *out)
+{
+    int maxstyles = 0;
+    for (const lightgridsample_t &sample : grid.samples)
+        maxstyles = qmax(maxstyles, static_cast<int>(sample.numstyles));
+
+    out->clear();
+    for (int i = 0; i < 3; i++)
+        LightGrid_WriteFloat(out, grid.step[i]);
+    for (int i = 0; i < 3; i++)
+        LightGrid_WriteInt(out, grid.size[i]);
+    for (int i = 0; i < 3; i++)
+        LightGrid_WriteFloat(out, grid.mins[i]);
+    out->push_back(static_cast<uint8_t>(maxstyles));
+
+    LightGrid_WriteInt(out, rootnode);
+    LightGrid_WriteInt(out, static_cast<int32_t>(grid.nodes.size()));
+    for (const lightgridnode_t &node : grid.nodes) {
+        for (int i = 0; i < 3; i++)
+            LightGrid_WriteInt(out, node.mid[i]);
+        for (int i = 0; i < 8; i++)
+            LightGrid_WriteInt(out, static_cast<int32_t>(node.child[i]));
+    }
+
+    LightGrid_WriteInt(out, static_cast<int32_t>(grid.leafs.size()));
+    for (const lightgridleaf_t &leaf : grid.leafs) {
+        for (int i = 0; i < 3; i++)
+            LightGrid_WriteInt(out, leaf.mins[i]);
+        for (int i = 0; i < 3; i++)
+            LightGrid_WriteInt(out, leaf.size[i]);
+
+        for (int z = leaf.mins[2]; z < leaf.mins[2] + leaf.size[2]; z++) {
+            for (int y = leaf.mins[1]; y < leaf.mins[1] + leaf.size[1]; y++) {
+                for (int x = leaf.mins[0]; x < leaf.mins[0] + leaf.size[0]; x++) {
+                    const lightgridsample_t &sample = LightGrid_Sample(grid, x, y, z);
+                    if (sample.occluded) {
+                        out->push_back(0xff);
+                        continue;
+                    }
+                    out->push_back(sample.numstyles);
+                    for (int i = 0; i < sample.numstyles; i++) {
+                        out->push_back(sample.styles[i]);
+                        out->insert(out->end(), sample.rgb[i], sample.rgb[i] + 3);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * =============
+ * LightGrid
+ * =============
+ */
+void
+LightGrid(const globalconfig_t &cfg, bspdata_t *bspdata)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+    const dmodel_t *world = &bsp->dmodels[0];
+    lightgrid_t grid;
+
+    logprint("--- LightGrid ---\n");
+
+    const vec_t *dist = *cfg.lightgrid_dist.vec3Value();
+    for (int i = 0; i < 3; i++) {
+        if (dist[i] <= 0)
+            Error("_lightgrid_dist must be positive (got %s)", VecStr(dist).c_str());
+        grid.step[i] = dist[i];
+        grid.mins[i] = world->mins[i];
+        grid.size[i] = static_cast<int>(floor((world->maxs[i] - world->mins[i]) / dist[i])) + 1;
+    }
+
+    const int numpoints = grid.size[0] * grid.size[1] * grid.size[2];
+    logprint("%d x %d x %d probes, every (%s) units\n", grid.size[0], grid.size[1], grid.size[2], VecStr(dist).c_str());
+
+    grid.samples.resize(numpoints);
+    RunThreadsOn(0, numpoints, 0, [&](int i, int thread) {
+        const int x = i % grid.size[0];
+        const int y = (i / grid.size[0]) % grid.size[1];
+        const int z = i / (grid.size[0] * grid.size[1]);
+        vec3_t origin;
+        origin[0] = grid.mins[0] + x * grid.step[0];
+        origin[1] = grid.mins[1] + y * grid.step[1];
+        origin[2] = grid.mins[2] + z * grid.step[2];
+        LightGrid_CalcSample(bsp, cfg, origin, &grid.samples[i]);
+    });
+
+    const int mins[3] = {0, 0, 0};
+    const uint32_t rootnode = LightGrid_BuildOctree_r(&grid, mins, grid.size, true);
+
+    LightGrid_WriteLump(grid, rootnode, &lightgrid_lump);
+    logprint("%d nodes, %d leafs, %d bytes\n",
+             static_cast<int>(grid.nodes.size()), static_cast<int>(grid.leafs.size()),
+             static_cast<int>(lightgrid_lump.size()));
+
+    BSPX_AddLump(bspdata, "LIGHTGRID_OCTREE", lightgrid_lump.data(), lightgrid_lump.size());
+}
@@ -23,8 +23,18 @@
 #include <common/bspfile.hh>
 #include <common/cmdlib.hh>
 
-void
-WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int version)
+#include <string>
+#include <thread>
+
+/* the .lit/.lux writer started by StartLitFiles */
+static std::thread litwriter;
+
+/*
+ * These take the face and sample counts rather than the bsp, as the bsp
+ * may be converted to its output format while the writer is running.
+ */
+static void
+WriteLit(int numfaces, int lightdatasize, const facesup_t *facesup, const char *filename, int version)
 {
     FILE *litfile;
     char litname[1024];
@@ -39,8 +49,8 @@ WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int ve
     header.v1.ident[2] = 'I';
     header.v1.ident[3] = 'T';
     header.v1.version = LittleLong(version);
-    header.v2.numsurfs = LittleLong(bsp->numfaces);
-    header.v2.lmsamples = LittleLong(bsp->lightdatasize);
+    header.v2.numsurfs = LittleLong(numfaces);
+    header.v2.lmsamples = LittleLong(lightdatasize);
 
     logprint("Writing %s\n", litname);
     litfile = SafeOpenWrite(litname);
@@ -48,11 +58,11 @@ WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int ve
     if (version == 2)
     {
         unsigned int i, j;
-        unsigned int *offsets = (unsigned int *) malloc(bsp->numfaces * sizeof(*offsets));
-        unsigned short *extents = (unsigned short *) malloc(2*bsp->numfaces * sizeof(*extents));
-        unsigned char *styles = (unsigned char *) malloc(4*bsp->numfaces * sizeof(*styles));
-        unsigned char *shifts = (unsigned char *) malloc(bsp->numfaces * sizeof(*shifts));
-        for (i = 0; i < bsp->numfaces; i++)
+        unsigned int *offsets = (unsigned int *) malloc(numfaces * sizeof(*offsets));
+        unsigned short *extents = (unsigned short *) malloc(2*numfaces * sizeof(*extents));
+        unsigned char *styles = (unsigned char *) malloc(4*numfaces * sizeof(*styles));
+        unsigned char *shifts = (unsigned char *) malloc(numfaces * sizeof(*shifts));
+        for (i = 0; i < numfaces; i++)
         {
             offsets[i] = LittleLong(facesup[i].lightofs);
             styles[i*4+0] = LittleShort(facesup[i].styles[0]);
@@ -67,20 +77,20 @@ WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int ve
             shifts[i] = j;
         }
         SafeWrite(litfile, &header.v2, sizeof(header.v2));
-        SafeWrite(litfile, offsets, bsp->numfaces * sizeof(*offsets));
-        SafeWrite(litfile, extents, 2*bsp->numfaces * sizeof(*extents));
-        SafeWrite(litfile, styles, 4*bsp->numfaces * sizeof(*styles));
-        SafeWrite(litfile, shifts, bsp->numfaces * sizeof(*shifts));
-        SafeWrite(litfile, lit_filebase, bsp->lightdatasize * 3);
-        SafeWrite(litfile, lux_filebase, bsp->lightdatasize * 3);
+        SafeWrite(litfile, offsets, numfaces * sizeof(*offsets));
+        SafeWrite(litfile, extents, 2*numfaces * sizeof(*extents));
+        SafeWrite(litfile, styles, 4*numfaces * sizeof(*styles));
+        SafeWrite(litfile, shifts, numfaces * sizeof(*shifts));
+        SafeWrite(litfile, lit_filebase, lightdatasize * 3);
+        SafeWrite(litfile, lux_filebase, lightdatasize * 3);
     }
     else
-        SafeWrite(litfile, lit_filebase, bsp->lightdatasize * 3);
+        SafeWrite(litfile, lit_filebase, lightdatasize * 3);
     fclose(litfile);
 }
 
-void
-WriteLuxFile(const mbsp_t *bsp, const char *filename, int version)
+static void
+WriteLux(int lightdatasize, const char *filename, int version)
 {
     FILE *luxfile;
     char luxname[1024];
@@ -98,6 +108,42 @@ WriteLuxFile(const mbsp_t *bsp, const char *filename, int version)
 
     luxfile = SafeOpenWrite(luxname);
     SafeWrite(luxfile, &header.v1, sizeof(header.v1));
-    SafeWrite(luxfile, lux_filebase, bsp->lightdatasize * 3);
+    SafeWrite(luxfile, lux_filebase, lightdatasize * 3);
     fclose(luxfile);
 }
+
+void
+WriteLitFile(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int version)
+{
+    WriteLit(bsp->numfaces, bsp->lightdatasize, facesup, filename, version);
+}
+
+void
+WriteLuxFile(const mbsp_t *bsp, const char *filename, int version)
+{
+    WriteLux(bsp->lightdatasize, filename, version);
+}
+
+void
+StartLitFiles(const mbsp_t *bsp, facesup_t *facesup, const char *filename, int litversion, int luxversion)
+{
+    FinishLitFiles();
+
+    const int numfaces = bsp->numfaces;
+    const int lightdatasize = bsp->lightdatasize;
+    const std::string name = filename;
+
+    litwriter = std::thread([=]() {
+        if (litversion)
+            WriteLit(numfaces, lightdatasize, facesup, name.c_str(), litversion);
+        if (luxversion)
+            WriteLux(lightdatasize, name.c_str(), luxversion);
+    });
+}
+
+void
+FinishLitFiles(void)
+{
+    if (litwriter.joinable())
+        litwriter.join();
+}
@@ -24,6 +24,10 @@
 #include <light/entities.hh>
 #include <light/trace.hh>
 #include <light/ltface.hh>
+#include <light/pointcache.hh>
+#include <light/profile.hh>
+#include <light/pvscull.hh>
+#include <common/memstats.hh>
 
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
@@ -31,6 +35,7 @@
 #include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <numeric>
 
 using namespace std;
 
@@ -356,20 +361,25 @@ public:
     const bsp2_dface_t *m_actualFace;
     qvec3f m_position;
     qvec3f m_interpolatedNormal;
+    /* only unoccluded if m_position isn't in solid; CalcPoints tests a face's samples together */
+    bool m_needsSolidTest;
     
     position_t(qvec3f position)
       : m_unoccluded(false),
         m_actualFace(nullptr),
         m_position(position),
-        m_interpolatedNormal(qvec3f(0,0,0)) {}
+        m_interpolatedNormal(qvec3f(0,0,0)),
+        m_needsSolidTest(false) {}
     
     position_t(const bsp2_dface_t *actualFace,
                qvec3f position,
-               qvec3f interpolatedNormal)
+               qvec3f interpolatedNormal,
+               bool needsSolidTest = false)
         : m_unoccluded(true),
           m_actualFace(actualFace),
           m_position(position),
-          m_interpolatedNormal(interpolatedNormal) {};
+          m_interpolatedNormal(interpolatedNormal),
+          m_needsSolidTest(needsSolidTest) {};
 };
 
 static const float sampleOffPlaneDist = 1.0f;
@@ -656,25 +666,299 @@ PositionSamplePointOnFace(const mbsp_t *bsp,
         pointNormal = qvec3f(plane);
     }
     
-    const bool inSolid = Light_PointInAnySolid(bsp, mi->model, point + modelOffset);
-    if (inSolid) {
-        // Check distance to border
-        const float distanceInside = GLM_EdgePlanes_PointInsideDist(edgeplanes, point);
-        if (distanceInside < 1.0f) {
-            // Point is too close to the border. Try nudging it inside.
-            const auto &shrunk = facecache.pointsShrunkBy1Unit();
-            if (!shrunk.empty()) {
-                const pair<int, qvec3f> closest = GLM_ClosestPointOnPolyBoundary(shrunk, point);
-                const qvec3f newPoint = closest.second + (qvec3f(plane) * sampleOffPlaneDist);
-                if (!Light_PointInAnySolid(bsp, mi->model, newPoint + modelOffset))
-                    return position_t(face, newPoint, pointNormal);
-            }
+    // left to ResolveSolidSamples, see NudgeSamplePoint for what happens if it's in solid
+    return position_t(face, point, pointNormal, true);
+}
+
+/*
+ * For a sample point found in solid: if it's within 1 unit of the face's
+ * border, returns the point nudged inside the face, to try instead.
+ */
+static bool
+NudgeSamplePoint(const mbsp_t *bsp, const bsp2_dface_t *face, const qvec3f &point, qvec3f *nudged)
+{
+    const auto &facecache = FaceCacheForFNum(Face_GetNum(bsp, face));
+    
+    // Check distance to border
+    const float distanceInside = GLM_EdgePlanes_PointInsideDist(facecache.edgePlanes(), point);
+    if (distanceInside >= 1.0f)
+        return false;
+    
+    // Point is too close to the border. Try nudging it inside.
+    const auto &shrunk = facecache.pointsShrunkBy1Unit();
+    if (shrunk.empty())
+        return false;
+    
+    const pair<int, qvec3f> closest = GLM_ClosestPointOnPolyBoundary(shrunk, point);
+    *nudged = closest.second + (qvec3f(facecache.plane()) * sampleOffPlaneDist);
+    return true;
+}
+
+/// Light_PointInAnySolid for several points, `selfs[i]` being the `self` model for points[i]
+static void
+Light_PointsInAnySolid(const mbsp_t *bsp, const std::vector<const dmodel_t *> &selfs,
+                       const std::vector<qvec3f> &points, std::vector<uint8_t> *insolid)
+{
+    insolid->assign(points.size(), 0);
+    
+    std::vector<int> all(points.size());
+    std::iota(all.begin(), all.end(), 0);
+    
+    Light_PointsInSolid(bsp, &bsp->dmodels[0], points, all, insolid->data());
+    
+    for (const auto &modelinfo : tracelist) {
+        // Only mark occluded if the bmodel is fully opaque
+        if (modelinfo->alpha.floatValue() == 1.0f)
+            Light_PointsInSolid(bsp, modelinfo->model, points, all, insolid->data());
+    }
+    
+    // usually all the points share one self model
+    std::vector<const dmodel_t *> done;
+    for (const dmodel_t *self : selfs) {
+        if (self == &bsp->dmodels[0] || std::find(done.begin(), done.end(), self) != done.end())
+            continue;
+        done.push_back(self);
+        
+        std::vector<int> indices;
+        for (int i = 0; i < static_cast<int>(points.size()); i++) {
+            if (selfs[i] == self && !(*insolid)[i])
+                indices.push_back(i);
         }
+        Light_PointsInSolid(bsp, self, points, indices, insolid->data());
+    }
+}
 
-        return position_t(point);
+/*
+ * Finishes PositionSamplePointOnFace for a face's worth of samples: the
+ * ones in solid are nudged inside their face if close to its border, or
+ * else marked occluded.
+ */
+static void
+ResolveSolidSamples(const mbsp_t *bsp, std::vector<position_t> *positions, const qvec3f &modelOffset)
+{
+    std::vector<int> pending;
+    std::vector<qvec3f> points;
+    std::vector<const dmodel_t *> selfs;
+    for (int i = 0; i < static_cast<int>(positions->size()); i++) {
+        const position_t &pos = (*positions)[i];
+        if (!pos.m_needsSolidTest)
+            continue;
+        pending.push_back(i);
+        points.push_back(pos.m_position + modelOffset);
+        selfs.push_back(ModelInfoForFace(bsp, Face_GetNum(bsp, pos.m_actualFace))->model);
+    }
+    if (pending.empty())
+        return;
+    
+    std::vector<uint8_t> insolid;
+    Light_PointsInAnySolid(bsp, selfs, points, &insolid);
+    
+    // second round for the nudged points
+    std::vector<int> nudgedPending;
+    std::vector<qvec3f> nudgedPoints;
+    std::vector<qvec3f> nudgedPositions;
+    std::vector<const dmodel_t *> nudgedSelfs;
+    for (size_t j = 0; j < pending.size(); j++) {
+        position_t &pos = (*positions)[pending[j]];
+        pos.m_needsSolidTest = false;
+        if (!insolid[j])
+            continue;
+        
+        qvec3f nudged;
+        if (NudgeSamplePoint(bsp, pos.m_actualFace, pos.m_position, &nudged)) {
+            nudgedPending.push_back(pending[j]);
+            nudgedPoints.push_back(nudged + modelOffset);
+            nudgedPositions.push_back(nudged);
+            nudgedSelfs.push_back(selfs[j]);
+        } else {
+            pos = position_t(pos.m_position);
+        }
+    }
+    if (nudgedPending.empty())
+        return;
+    
+    Light_PointsInAnySolid(bsp, nudgedSelfs, nudgedPoints, &insolid);
+    for (size_t j = 0; j < nudgedPending.size(); j++) {
+        position_t &pos = (*positions)[nudgedPending[j]];
+        if (insolid[j])
+            pos = position_t(pos.m_position);
+        else
+            pos.m_position = nudgedPositions[j];
+    }
+}
+
+/*
+ * Faces with few samples would otherwise hand Embree a handful of rays per
+ * light; LightFace_Entities keeps pushing lights until a stream holds
+ * about this many rays before tracing.
+ */
+static constexpr int LIGHT_RAY_BATCH = 256;
+
+static int
+LightSurf_StreamSize(int numpoints)
+{
+    return qmax(numpoints, LIGHT_RAY_BATCH);
+}
+
+/*
+ * Per-thread buffers for the face being lit. They grow to the largest
+ * face the thread has seen and are reused, rather than every face
+ * allocating and freeing its own points, lightmaps and ray streams.
+ * Only one lightsurf per thread is alive at a time.
+ */
+static memcounter_t lightsurfmem("lightsurf buffers");
+
+/* bytes a point takes in the per-point buffers below, not counting the samples */
+static constexpr int64_t LIGHTSURF_POINT_BYTES =
+    4 * sizeof(vec3_t) + sizeof(bool) + sizeof(int) + sizeof(vec_t) + 6 * sizeof(float);
+
+/* bytes a point takes in the sample buffers below */
+static inline int64_t
+LightSurf_SampleBytes(size_t numsamples, size_t numdirections)
+{
+    return static_cast<int64_t>(numsamples * sizeof(lightsample_t) + numdirections * sizeof(vec3_t));
+}
+
+/*
+ * Lightmaps only keep the light's direction when there's a .lux, a bspx
+ * LIGHTINGDIR or a -lit2 file to write it to; otherwise a sample is just
+ * its color.
+ */
+static inline bool
+Lightmap_KeepDirections(void)
+{
+    return write_luxfile != 0 || write_litfile == ~0;
+}
+
+struct lightsurf_scratch_t {
+    lightsurf_t surf {};
+    bool inuse = false;
+    
+    int capacity = 0; // points each buffer below holds
+    vec3_t *points = nullptr;
+    vec3_t *normals = nullptr;
+    bool *occluded = nullptr;
+    int *realfacenums = nullptr;
+    vec_t *occlusion = nullptr;
+    float *soa = nullptr;
+    vec3_t *dirtups = nullptr; // LightFace_CalculateDirt
+    vec3_t *dirtrts = nullptr;
+    
+    /* lightmap samples, one buffer per style lit so far, and their directions if they're kept */
+    std::vector<lightsample_t *> samples;
+    std::vector<vec3_t *> directions;
+    size_t samplesused = 0;
+    
+    /* ray streams for faces lit outside a batch */
+    std::unique_ptr<raystream_occlusion_t> occlusion_stream;
+    std::unique_ptr<raystream_intersection_t> intersection_stream;
+    int streamsize = 0;
+    
+    /* WriteSingleLightmap's images */
+    std::vector<qvec4f> image, blurred, rowsums, rowsums_all;
+    std::vector<qvec4f> dirs, outcolors, outdirs;
+    
+    ~lightsurf_scratch_t() {
+        free(points);
+        free(normals);
+        free(occluded);
+        free(realfacenums);
+        free(occlusion);
+        free(soa);
+        free(dirtups);
+        free(dirtrts);
+        for (lightsample_t *buffer : samples)
+            free(buffer);
+        for (vec3_t *buffer : directions)
+            free(buffer);
+        lightsurfmem.sub(capacity * (LIGHTSURF_POINT_BYTES + LightSurf_SampleBytes(samples.size(), directions.size())));
+    }
+};
+
+static thread_local lightsurf_scratch_t lightsurf_scratch;
+
+template <typename T>
+static void
+LightSurf_Regrow(T **buffer, int count)
+{
+    free(*buffer);
+    *buffer = (T *) malloc(count * sizeof(T));
+}
+
+/*
+ * =================
+ * LightSurf_Acquire
+ * Returns the thread's lightsurf, reset to all zeroes
+ * =================
+ */
+static lightsurf_t *
+LightSurf_Acquire()
+{
+    lightsurf_scratch_t &scratch = lightsurf_scratch;
+    Q_assert(!scratch.inuse);
+    scratch.inuse = true;
+    
+    // keep the vectors' storage
+    lightmapdict_t lightmaps = std::move(scratch.surf.lightmapsByStyle);
+    std::vector<uint32_t> visibility = std::move(scratch.surf.visibility);
+    lightmaps.clear();
+    visibility.clear();
+    
+    scratch.surf = lightsurf_t {};
+    scratch.surf.lightmapsByStyle = std::move(lightmaps);
+    scratch.surf.visibility = std::move(visibility);
+    return &scratch.surf;
+}
+
+/*
+ * =================
+ * LightSurf_Reserve
+ * Points the per-sample arrays of the thread's lightsurf at scratch
+ * buffers for surf->numpoints samples, zeroed like fresh calloc'ed ones
+ * =================
+ */
+static void
+LightSurf_Reserve(lightsurf_t *surf)
+{
+    lightsurf_scratch_t &scratch = lightsurf_scratch;
+    Q_assert(surf == &scratch.surf);
+    
+    const int numpoints = surf->numpoints;
+    if (numpoints > scratch.capacity) {
+        LightSurf_Regrow(&scratch.points, numpoints);
+        LightSurf_Regrow(&scratch.normals, numpoints);
+        LightSurf_Regrow(&scratch.occluded, numpoints);
+        LightSurf_Regrow(&scratch.realfacenums, numpoints);
+        LightSurf_Regrow(&scratch.occlusion, numpoints);
+        LightSurf_Regrow(&scratch.soa, 6 * numpoints);
+        LightSurf_Regrow(&scratch.dirtups, numpoints);
+        LightSurf_Regrow(&scratch.dirtrts, numpoints);
+        
+        // no lightmaps are allocated yet, the old sample buffers are too small
+        for (lightsample_t *samples : scratch.samples)
+            free(samples);
+        for (vec3_t *directions : scratch.directions)
+            free(directions);
+        lightsurfmem.add(numpoints * LIGHTSURF_POINT_BYTES
+                         - scratch.capacity * (LIGHTSURF_POINT_BYTES + LightSurf_SampleBytes(scratch.samples.size(), scratch.directions.size())));
+        scratch.samples.clear();
+        scratch.directions.clear();
+        
+        scratch.capacity = numpoints;
     }
     
-    return position_t(face, point, pointNormal);
+    surf->points = scratch.points;
+    surf->normals = scratch.normals;
+    surf->occluded = scratch.occluded;
+    surf->realfacenums = scratch.realfacenums;
+    surf->occlusion = scratch.occlusion;
+    surf->soa = scratch.soa;
+    
+    memset(surf->points, 0, numpoints * sizeof(vec3_t));
+    memset(surf->normals, 0, numpoints * sizeof(vec3_t));
+    memset(surf->occluded, 0, numpoints * sizeof(bool));
+    memset(surf->realfacenums, 0, numpoints * sizeof(int));
+    memset(surf->occlusion, 0, numpoints * sizeof(vec_t));
 }
 
 /*
@@ -696,49 +980,61 @@ CalcPoints(const modelinfo_t *modelinfo, const vec3_t offset, lightsurf_t *surf,
     TexCoordToWorld(surf->exactmid[0], surf->exactmid[1], &surf->texorg, surf->midpoint);
     VectorAdd(surf->midpoint, offset, surf->midpoint);
     
-    surf->width  = (surf->texsize[0] + 1) * oversample;
-    surf->height = (surf->texsize[1] + 1) * oversample;
-    const float starts = (surf->texmins[0] - 0.5 + (0.5 / oversample)) * surf->lightmapscale;
-    const float startt = (surf->texmins[1] - 0.5 + (0.5 / oversample)) * surf->lightmapscale;
-    const float st_step = surf->lightmapscale / oversample;
+    surf->width  = (surf->texsize[0] + 1) * surf->oversample;
+    surf->height = (surf->texsize[1] + 1) * surf->oversample;
+    const float starts = (surf->texmins[0] - 0.5 + (0.5 / surf->oversample)) * surf->lightmapscale;
+    const float startt = (surf->texmins[1] - 0.5 + (0.5 / surf->oversample)) * surf->lightmapscale;
+    const float st_step = surf->lightmapscale / surf->oversample;
 
     /* Allocate surf->points */
     surf->numpoints = surf->width * surf->height;
-    surf->points = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->normals = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->occluded = (bool *)calloc(surf->numpoints, sizeof(bool));
-    surf->realfacenums = (int *)calloc(surf->numpoints, sizeof(int));
+    LightSurf_Reserve(surf);
+    
+    const int facenum = (face - bsp->dfaces);
+    /* the cache holds points at the -extra resolution only */
+    const bool cacheable = (surf->oversample == oversample);
+    if (cacheable && PointCache_Lookup(facenum, surf)) {
+        if (dump_facenum == facenum) {
+            CalcPoints_Debug(surf, bsp);
+        }
+        return;
+    }
     
-    const auto points = GLM_FacePoints(bsp, face);
-    const auto edgeplanes = GLM_MakeInwardFacingEdgePlanes(points);
+    std::vector<position_t> positions;
+    positions.reserve(surf->numpoints);
     
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
-            const int i = t*surf->width + s;
-            vec_t *point = surf->points[i];
-            vec_t *norm = surf->normals[i];
-            int *realfacenum = &surf->realfacenums[i];
-            
             const vec_t us = starts + s * st_step;
             const vec_t ut = startt + t * st_step;
 
+            vec3_t point;
             TexCoordToWorld(us, ut, &surf->texorg, point);
 
             // do this before correcting the point, so we can wrap around the inside of pipes
             const bool phongshaded = (surf->curved && cfg.phongallowed.boolValue());
-            const auto res = CalcPointNormal(bsp, face, vec3_t_to_glm(point), phongshaded, surf->lightmapscale, 0, vec3_t_to_glm(offset));
-            
-            surf->occluded[i] = !res.m_unoccluded;
-            *realfacenum = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
-            glm_to_vec3_t(res.m_position, point);
-            glm_to_vec3_t(res.m_interpolatedNormal, norm);
-            
-            // apply model offset after calling CalcPointNormal
-            VectorAdd(point, offset, point);
+            positions.push_back(CalcPointNormal(bsp, face, vec3_t_to_glm(point), phongshaded, surf->lightmapscale, 0, vec3_t_to_glm(offset)));
         }
     }
     
-    const int facenum = (face - bsp->dfaces);
+    ResolveSolidSamples(bsp, &positions, vec3_t_to_glm(offset));
+    
+    for (int i = 0; i < surf->numpoints; i++) {
+        const position_t &res = positions[i];
+        vec_t *point = surf->points[i];
+        
+        surf->occluded[i] = !res.m_unoccluded;
+        surf->realfacenums[i] = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
+        glm_to_vec3_t(res.m_position, point);
+        glm_to_vec3_t(res.m_interpolatedNormal, surf->normals[i]);
+        
+        // apply model offset after calling CalcPointNormal
+        VectorAdd(point, offset, point);
+    }
+    
+    if (cacheable)
+        PointCache_Store(facenum, surf);
+    
     if (dump_facenum == facenum) {
         CalcPoints_Debug(surf, bsp);
     }
@@ -754,7 +1050,8 @@ Face_IsLiquid(const mbsp_t *bsp, const bsp2_dface_t *face)
 
 static bool
 Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
-               const mbsp_t *bsp, lightsurf_t *lightsurf, facesup_t *facesup)
+               const mbsp_t *bsp, lightsurf_t *lightsurf, facesup_t *facesup,
+               lightbatch_t *batch, int surfoversample)
 {
         /*FIXME: memset can be slow on large datasets*/
 //    memset(lightsurf, 0, sizeof(*lightsurf));
@@ -838,6 +1135,7 @@ Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
     VectorNormalize(lightsurf->tnormal);
 
     /* Set up the surface points */
+    lightsurf->oversample = surfoversample;
     CalcFaceExtents(face, bsp, lightsurf);
     CalcPoints(modelinfo, modelinfo->offset, lightsurf, bsp, face);
     
@@ -853,11 +1151,37 @@ Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
     VectorAdd(lightsurf->mins, modelinfo->offset, lightsurf->mins);
     VectorAdd(lightsurf->maxs, modelinfo->offset, lightsurf->maxs);
     
-    /* Allocate occlusion array */
-    lightsurf->occlusion = (float *) calloc(lightsurf->numpoints, sizeof(float));
+    /* Split points and normals by axis */
+    const int numpoints = lightsurf->numpoints;
+    for (int i = 0; i < numpoints; i++) {
+        for (int j = 0; j < 3; j++) {
+            lightsurf->soa[j * numpoints + i] = lightsurf->points[i][j];
+            lightsurf->soa[(3 + j) * numpoints + i] = lightsurf->normals[i][j];
+        }
+    }
     
-    lightsurf->intersection_stream = MakeIntersectionRayStream(lightsurf->numpoints);
-    lightsurf->occlusion_stream = MakeOcclusionRayStream(lightsurf->numpoints);
+    if (batch) {
+        /* faces in a batch share streams, grown to the largest face so far */
+        const int streamsize = LightSurf_StreamSize(lightsurf->numpoints);
+        if (streamsize > batch->streamsize) {
+            batch->intersection_stream.reset(MakeIntersectionRayStream(streamsize));
+            batch->occlusion_stream.reset(MakeOcclusionRayStream(streamsize));
+            batch->streamsize = streamsize;
+        }
+        lightsurf->intersection_stream = batch->intersection_stream.get();
+        lightsurf->occlusion_stream = batch->occlusion_stream.get();
+    } else {
+        /* likewise the thread's own streams */
+        lightsurf_scratch_t &scratch = lightsurf_scratch;
+        const int streamsize = LightSurf_StreamSize(lightsurf->numpoints);
+        if (streamsize > scratch.streamsize) {
+            scratch.intersection_stream.reset(MakeIntersectionRayStream(streamsize));
+            scratch.occlusion_stream.reset(MakeOcclusionRayStream(streamsize));
+            scratch.streamsize = streamsize;
+        }
+        lightsurf->intersection_stream = scratch.intersection_stream.get();
+        lightsurf->occlusion_stream = scratch.occlusion_stream.get();
+    }
     return true;
 }
 
@@ -865,12 +1189,22 @@ static void
 Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *lightsurf)
 {
     if (lightmap->samples == NULL) {
-        /* first use of this lightmap, allocate the storage for it. */
-        lightmap->samples = (lightsample_t *) calloc(lightsurf->numpoints, sizeof(lightsample_t));
-    } else {
-        /* clear only the data that is going to be merged to it. there's no point clearing more */
-        memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
+        /* first use of this lightmap, take the thread's next sample buffer for it. */
+        lightsurf_scratch_t &scratch = lightsurf_scratch;
+        const bool keepdirections = Lightmap_KeepDirections();
+        if (scratch.samplesused == scratch.samples.size()) {
+            scratch.samples.push_back((lightsample_t *) malloc(scratch.capacity * sizeof(lightsample_t)));
+            if (keepdirections)
+                scratch.directions.push_back((vec3_t *) malloc(scratch.capacity * sizeof(vec3_t)));
+            lightsurfmem.add(scratch.capacity * LightSurf_SampleBytes(1, keepdirections ? 1 : 0));
+        }
+        lightmap->directions = keepdirections ? scratch.directions[scratch.samplesused] : nullptr;
+        lightmap->samples = scratch.samples[scratch.samplesused++];
     }
+    /* clear only the data that is going to be merged to it. there's no point clearing more */
+    memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
+    if (lightmap->directions)
+        memset(lightmap->directions, 0, sizeof(*lightmap->directions)*lightsurf->numpoints);
 }
 
 static const lightmap_t *
@@ -1027,10 +1361,10 @@ GetLightValueWithAngle(const globalconfig_t &cfg, const light_t *entity, const v
 static qboolean LightFace_SampleMipTex(rgba_miptex_t *tex, const float *projectionmatrix, const vec3_t point, float *result); //mxd. miptex_t -> rgba_miptex_t
 
 void
-GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t surfnorm, const vec3_t surfpoint, bool twosided,
+GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t lightorigin, const vec3_t surfnorm, const vec3_t surfpoint, bool twosided,
                 vec3_t color_out, vec3_t surfpointToLightDir_out, vec3_t normalmap_addition_out, float *dist_out)
 {
-    float dist = GetDir(surfpoint, *entity->origin.vec3Value(), surfpointToLightDir_out);
+    float dist = GetDir(surfpoint, lightorigin, surfpointToLightDir_out);
     if (dist < 0.1) {
         // Catch 0 distance between sample point and light (produces infinite brightness / nan's) and causes
         // problems later
@@ -1060,6 +1394,221 @@ GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t s
     *dist_out = dist;
 }
 
+static float
+RadicalInverse(int n, int base)
+{
+    const float invbase = 1.0f / base;
+    float digit = invbase, result = 0;
+    for (; n > 0; n /= base) {
+        result += (n % base) * digit;
+        digit *= invbase;
+    }
+    return result;
+}
+
+/*
+ * ================
+ * AreaLight_SampleOrigin
+ *
+ * "_deviance" and "_samples" make a light a ball of radius _deviance, lit
+ * from _samples points inside it. This is the sample'th of them: the
+ * points are a stratified (Hammersley) set, shifted by rotation, an
+ * offset in [0, 1)^3 that each surface point picks for itself, so that
+ * neighbouring points see different positions and the penumbra is
+ * dithered instead of banded.
+ * ================
+ */
+static void
+AreaLight_SampleOrigin(const light_t *entity, int sample, const float rotation[3], vec3_t out)
+{
+    float u = (sample + 0.5f) / entity->samples.intValue() + rotation[0];
+    float v = RadicalInverse(sample, 2) + rotation[1];
+    float w = RadicalInverse(sample, 3) + rotation[2];
+    u -= floorf(u);
+    v -= floorf(v);
+    w -= floorf(w);
+    
+    // uniform in the ball
+    const float radius = entity->deviance.floatValue() * cbrtf(u);
+    const float z = 1.0f - 2.0f * v;
+    const float r = sqrtf(qmax(0.0f, 1.0f - z * z));
+    const float phi = 2.0f * Q_PI * w;
+    const vec3_t offset { r * cosf(phi), r * sinf(phi), z };
+    VectorMA(*entity->origin.vec3Value(), radius, offset, out);
+}
+
+/* AreaLight_SampleOrigin's rotation for a surface point, hashed from its position */
+static void
+AreaLight_PointRotation(const vec3_t point, float rotation[3])
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 3; i++) {
+        const float f = point[i];
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    for (int i = 0; i < 3; i++) {
+        hash ^= hash >> 15;
+        hash *= 0x2c1b3c6du;
+        hash ^= hash >> 12;
+        hash *= 0x297a2d39u;
+        hash ^= hash >> 15;
+        rotation[i] = (hash >> 8) * (1.0f / 16777216.0f);
+    }
+}
+
+/*
+ * ================
+ * LightFace_EntityContribs
+ *
+ * GetLightContrib's direction, distance and brightness for every sample of
+ * the face at once. The light's settings are read once, and the per-sample
+ * loops only select between results instead of branching, so the compiler
+ * can vectorize them over lightsurf->soa. Results match GetLightContrib
+ * exactly.
+ *
+ * lightorigins, if given, is where the light is for each sample, x y z
+ * arrays of numpoints each, for an area light's samples.
+ * ================
+ */
+struct entitycontribs_t {
+    std::vector<float> dir[3];
+    std::vector<float> dist;
+    std::vector<float> angle;
+    std::vector<float> spotscale;
+    std::vector<float> add;
+};
+
+static void
+LightFace_EntityContribs(const globalconfig_t &cfg, const light_t *entity, const float *lightorigins,
+                         const lightsurf_t *lightsurf, entitycontribs_t *out)
+{
+    const int n = lightsurf->numpoints;
+    for (auto &v : out->dir)
+        v.resize(n);
+    out->dist.resize(n);
+    out->angle.resize(n);
+    out->spotscale.resize(n);
+    out->add.resize(n);
+    
+    const float *px = lightsurf->soa;
+    const float *py = px + n;
+    const float *pz = py + n;
+    const float *nx = pz + n;
+    const float *ny = nx + n;
+    const float *nz = ny + n;
+    float *dx = out->dir[0].data();
+    float *dy = out->dir[1].data();
+    float *dz = out->dir[2].data();
+    float *dist = out->dist.data();
+    float *angles = out->angle.data();
+    float *spotscales = out->spotscale.data();
+    float *add = out->add.data();
+    
+    const vec_t *origin = *entity->origin.vec3Value();
+    const float *lx = lightorigins;
+    const float *ly = lightorigins ? lx + n : nullptr;
+    const float *lz = lightorigins ? ly + n : nullptr;
+    const bool absangle = entity->bleed.boolValue() || lightsurf->twosided;
+    const float anglescale = entity->anglescale.floatValue();
+    const bool spotlight = entity->spotlight;
+    const float spotfalloff = entity->spotfalloff;
+    const float spotfalloff2 = entity->spotfalloff2;
+    const float spotx = entity->spotvec[0];
+    const float spoty = entity->spotvec[1];
+    const float spotz = entity->spotvec[2];
+    
+    /* GetDir and GetLightValueWithAngle's angle and spotlight scale */
+    for (int i = 0; i < n; i++) {
+        float x = (lightorigins ? lx[i] : origin[0]) - px[i];
+        float y = (lightorigins ? ly[i] : origin[1]) - py[i];
+        float z = (lightorigins ? lz[i] : origin[2]) - pz[i];
+        
+        double lengthsq = 0;
+        lengthsq += x * x;
+        lengthsq += y * y;
+        lengthsq += z * z;
+        const float length = (float)sqrt(lengthsq);
+        const float div = (lengthsq == 0) ? 1.0f : length;
+        x /= div;
+        y /= div;
+        z /= div;
+        
+        // Catch 0 distance between sample point and light (produces infinite brightness / nan's)
+        const bool tooclose = length < 0.1;
+        dx[i] = tooclose ? 0.0f : x;
+        dy[i] = tooclose ? 0.0f : y;
+        dz[i] = tooclose ? 1.0f : z;
+        dist[i] = tooclose ? 0.1f : length;
+        
+        float angle = dx[i] * nx[i] + dy[i] * ny[i] + dz[i] * nz[i];
+        angle = (absangle && angle < 0) ? -angle : angle;
+        const bool behind = angle < 0;
+        angle = (1.0 - anglescale) + (anglescale * angle);
+        
+        const float falloff = spotx * dx[i] + spoty * dy[i] + spotz * dz[i];
+        float spotscale = falloff - spotfalloff2;
+        spotscale /= spotfalloff - spotfalloff2;
+        spotscale = 1.0 - spotscale;
+        spotscale = (spotlight && falloff > spotfalloff2) ? spotscale : 1.0f;
+        const bool outsidecone = spotlight && falloff > spotfalloff;
+        
+        // a zero angle stands for GetLightValueWithAngle's early return 0
+        angles[i] = (behind || outsidecone) ? 0.0f : angle;
+        spotscales[i] = spotscale;
+    }
+    
+    /* GetLightValue, with the formula chosen once for the whole face */
+    const float light = entity->light.floatValue();
+    const float lightdistance = entity->falloff.floatValue();
+    const light_formula_t formula = entity->getFormula();
+    const float attenscale = cfg.scaledist.floatValue() * entity->atten.floatValue();
+    
+    if (lightdistance > 0.0f && formula == LF_LINEAR) {
+        for (int i = 0; i < n; i++)
+            add[i] = (lightdistance > dist[i]) ? light * (1.0f - (dist[i] / lightdistance)) : 0.0f;
+    } else {
+        switch (formula) {
+        case LF_INFINITE:
+        case LF_LOCALMIN:
+            for (int i = 0; i < n; i++)
+                add[i] = light;
+            break;
+        case LF_INVERSE:
+            for (int i = 0; i < n; i++) {
+                const vec_t value = attenscale * dist[i];
+                add[i] = light / (value / LF_SCALE);
+            }
+            break;
+        case LF_INVERSE2A:
+            for (int i = 0; i < n; i++) {
+                const vec_t value = attenscale * dist[i] + LF_SCALE;
+                add[i] = light / ((value * value) / (LF_SCALE * LF_SCALE));
+            }
+            break;
+        case LF_INVERSE2:
+            for (int i = 0; i < n; i++) {
+                const vec_t value = attenscale * dist[i];
+                add[i] = light / ((value * value) / (LF_SCALE * LF_SCALE));
+            }
+            break;
+        case LF_LINEAR:
+            for (int i = 0; i < n; i++) {
+                const vec_t value = attenscale * dist[i];
+                add[i] = (light > 0) ? ((light - value > 0) ? light - value : 0)
+                                     : ((light + value < 0) ? light + value : 0);
+            }
+            break;
+        default:
+            Error("Internal error: unknown light formula");
+        }
+    }
+    
+    for (int i = 0; i < n; i++)
+        add[i] = (angles[i] == 0.0f) ? 0.0f : add[i] * angles[i] * spotscales[i];
+}
+
 #define SQR(x) ((x)*(x))
 
 // this is the inverse of GetLightValue
@@ -1099,10 +1648,9 @@ GetLightDist(const globalconfig_t &cfg, const light_t *entity, vec_t desiredLigh
 }
 
 static inline void
-Light_Add(lightsample_t *sample, const vec_t light, const vec3_t color, const vec3_t direction)
+Light_Add(lightsample_t *sample, const vec_t light, const vec3_t color)
 {
     VectorMA(sample->color, light / 255.0f, color, sample->color);
-    VectorMA(sample->direction, light, direction, sample->direction);
 }
 
 static inline void
@@ -1226,9 +1774,13 @@ CullLight(const light_t *entity, const lightsurf_t *lightsurf)
         return true;
     }
     
+    if (pvscull && PVSCull_LightCulled(entity, Face_GetNum(lightsurf->bsp, lightsurf->face))) {
+        return true;
+    }
+    
     vec3_t distvec;
     VectorSubtract(*entity->origin.vec3Value(), lightsurf->origin, distvec);
-    const float dist = VectorLength(distvec) - lightsurf->radius;
+    const float dist = VectorLength(distvec) - lightsurf->radius - entity->deviance.floatValue();
     
     /* light is inside surface bounding sphere => can't cull */
     if (dist < 0) {
@@ -1325,10 +1877,13 @@ static qboolean LightFace_SampleMipTex(rgba_miptex_t *tex, const float *projecti
  *
  * This gathers up how much a patch should bounce back into the level,
  * per-lightstyle.
+ *
+ * Without a normal it's a light probe (-lightgrid) instead: the lighting
+ * a surface facing each light would get, without the bounce scales.
  * ================
  */
-std::map<int, qvec3f>
-GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal)
+static std::map<int, qvec3f>
+GetPointLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal)
 {
     std::map<int, qvec3f> result;
 
@@ -1336,8 +1891,8 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
     for (const surfacelight_t &vpl : SurfaceLights()) {
         // Bounce light falloff. Uses light surface center and intensity based on face area
         vec3_t surfpointToLightDir;
-        const float surfpointToLightDist = qmax(128.0f, GetDir(surfpointToLightDir, vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
-        const float angle = DotProduct(surfpointToLightDir, normal);
+        const float surfpointToLightDist = qmax(128.0f, GetDir(origin, vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
+        const float angle = normal ? DotProduct(surfpointToLightDir, normal) : 1.0f;
         if (angle <= 0) continue;
 
         // Exponential falloff
@@ -1347,7 +1902,7 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
         // Write out the final color
         vec3_t color;
         VectorScale(vpl.color, add, color); // color_out is expected to be in [0..255] range, vpl->color is in [0..1] range.
-        VectorScale(color, cfg.surflightbouncescale.floatValue(), color);
+        VectorScale(color, normal ? cfg.surflightbouncescale.floatValue() : cfg.surflightscale.floatValue(), color);
 
         // NOTE: Skip negative lights, which would make no sense to bounce!
         if (LightSample_Brightness(color) <= fadegate)
@@ -1360,45 +1915,61 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
     }
     
     for (const light_t &entity : GetLights()) {
-        vec3_t surfpointToLightDir;
-        float surfpointToLightDist;
-        vec3_t color, normalcontrib;
-
         if (entity.nostaticlight.boolValue()) {
             continue;
         }
         
         // Skip styled lights if "bouncestyled" setting is off.
-        if (entity.style.intValue() != 0 && !cfg.bouncestyled.boolValue()) {
-            continue;
-        }
-        
-        GetLightContrib(cfg, &entity, normal, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
-        
-        VectorScale(color, entity.bouncescale.floatValue(), color);
-        
-        // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (LightSample_Brightness(color) <= fadegate) {
-            continue;
-        }
-        
-        const hitresult_t hit = TestLight(*entity.origin.vec3Value(), origin, NULL);
-        if (!hit.blocked) {
+        if (normal && entity.style.intValue() != 0 && !cfg.bouncestyled.boolValue()) {
             continue;
         }
         
-        int lightstyle = entity.style.intValue();
-        if (lightstyle == 0) {
-            // switchable shadow only blocks style 0 lights, otherwise switchable lights become always on when shadow is hidden
-            lightstyle = hit.passedSwitchableShadowStyle;
+        // an area light's samples, all from the same unrotated set
+        const float rotation[3] = { 0, 0, 0 };
+        for (int sample = 0; sample < entity.samples.intValue(); sample++) {
+            vec3_t lightorigin;
+            if (entity.samples.intValue() > 1)
+                AreaLight_SampleOrigin(&entity, sample, rotation, lightorigin);
+            else
+                VectorCopy(*entity.origin.vec3Value(), lightorigin);
+            
+            vec3_t surfpointToLightDir;
+            float surfpointToLightDist;
+            vec3_t color, normalcontrib;
+            
+            if (normal) {
+                GetLightContrib(cfg, &entity, lightorigin, normal, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+                VectorScale(color, entity.bouncescale.floatValue(), color);
+            } else {
+                // a probe faces every light
+                vec3_t facing;
+                GetDir(origin, lightorigin, facing);
+                GetLightContrib(cfg, &entity, lightorigin, facing, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+            }
+            
+            // NOTE: Skip negative lights, which would make no sense to bounce!
+            if (LightSample_Brightness(color) <= fadegate) {
+                continue;
+            }
+            
+            const hitresult_t hit = TestLight(lightorigin, origin, NULL);
+            if (!hit.blocked) {
+                continue;
+            }
+            
+            int lightstyle = entity.style.intValue();
+            if (lightstyle == 0) {
+                // switchable shadow only blocks style 0 lights, otherwise switchable lights become always on when shadow is hidden
+                lightstyle = hit.passedSwitchableShadowStyle;
+            }
+            
+            result[lightstyle] += vec3_t_to_glm(color);
         }
-
-        result[lightstyle] += vec3_t_to_glm(color);
     }
     
     for (const sun_t &sun : GetSuns()) {
         // Skip styled lights if "bouncestyled" setting is off.
-        if (sun.style != 0 && !cfg.bouncestyled.boolValue()) {
+        if (normal && sun.style != 0 && !cfg.bouncestyled.boolValue()) {
             continue;
         }
 
@@ -1410,7 +1981,7 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
         VectorCopy(sun.sunvec, originLightDir);
         VectorNormalize(originLightDir);
         
-        vec_t cosangle = DotProduct(originLightDir, normal);
+        vec_t cosangle = normal ? DotProduct(originLightDir, normal) : 1.0;
         if (cosangle < 0) {
             continue;
         }
@@ -1447,21 +2018,41 @@ GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t ori
 }
 
 
+std::map<int, qvec3f>
+GetDirectLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin, const vec3_t normal)
+{
+    return GetPointLighting(bsp, cfg, origin, normal);
+}
+
+std::map<int, qvec3f>
+GetProbeLighting(const mbsp_t *bsp, const globalconfig_t &cfg, const vec3_t origin)
+{
+    return GetPointLighting(bsp, cfg, origin, nullptr);
+}
+
+/* identifies a light or sun, or one of an area light's samples, in lightsurf_t::visibility */
+static inline uint32_t
+VisibilityHash(const void *light, int sample = 0)
+{
+    const uint64_t v = (reinterpret_cast<uintptr_t>(light) + sample) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<uint32_t>(v >> 32);
+}
+
 /*
  * ================
- * LightFace_Entity
+ * LightFace_EntityCulled
+ *
+ * True if the light can't reach the face at all.
  * ================
  */
-static void
-LightFace_Entity(const mbsp_t *bsp,
-                 const light_t *entity,
-                lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static bool
+LightFace_EntityCulled(const light_t *entity, const lightsurf_t *lightsurf)
 {
-    const globalconfig_t &cfg = *lightsurf->cfg;
-    const modelinfo_t *modelinfo = lightsurf->modelinfo;
     const plane_t *plane = &lightsurf->plane;
 
-    const float planedist = DotProduct(*entity->origin.vec3Value(), plane->normal) - plane->dist;
+    // an area light reaches the plane if any of its ball does
+    const float planedist = DotProduct(*entity->origin.vec3Value(), plane->normal) - plane->dist
+        + entity->deviance.floatValue();
 
     /* don't bother with lights behind the surface.
      
@@ -1471,35 +2062,77 @@ LightFace_Entity(const mbsp_t *bsp,
        test in the curved case.
     */
     if (planedist < 0 && !entity->bleed.boolValue() && !lightsurf->curved && !lightsurf->twosided) {
-        return;
+        return true;
     }
 
     /* sphere cull surface and light */
-    if (CullLight(entity, lightsurf)) {
-        return;
-    }
+    return CullLight(entity, lightsurf);
+}
 
-    /*
-     * Check it for real
-     */
+/*
+ * ================
+ * LightFace_EntityPush
+ *
+ * Pushes the rays for one light onto the face's occlusion stream, at most
+ * one per sample point. An area light pushes each of its samples in turn,
+ * sample being which.
+ * ================
+ */
+static void
+LightFace_EntityPush(const light_t *entity, int sample, const lightsurf_t *lightsurf)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
     raystream_occlusion_t *rs = lightsurf->occlusion_stream;
-    rs->clearPushedRays();
+    
+    static thread_local std::vector<float> lightorigins;
+    const float *arealight = nullptr;
+    if (entity->samples.intValue() > 1) {
+        const int n = lightsurf->numpoints;
+        lightorigins.resize(3 * n);
+        for (int i = 0; i < n; i++) {
+            float rotation[3];
+            vec3_t lightorigin;
+            AreaLight_PointRotation(lightsurf->points[i], rotation);
+            AreaLight_SampleOrigin(entity, sample, rotation, lightorigin);
+            for (int k = 0; k < 3; k++)
+                lightorigins[k * n + i] = lightorigin[k];
+        }
+        arealight = lightorigins.data();
+    }
+    
+    static thread_local entitycontribs_t contribs;
+    LightFace_EntityContribs(cfg, entity, arealight, lightsurf, &contribs);
     
     for (int i = 0; i < lightsurf->numpoints; i++) {
         const vec_t *surfpoint = lightsurf->points[i];
-        const vec_t *surfnorm = lightsurf->normals[i];
         
         if (lightsurf->occluded[i])
             continue;
         
-        vec3_t surfpointToLightDir;
-        float surfpointToLightDist;
+        const vec3_t surfpointToLightDir { contribs.dir[0][i], contribs.dir[1][i], contribs.dir[2][i] };
+        const float surfpointToLightDist = contribs.dist[i];
+        const float add = contribs.add[i];
         vec3_t color, normalcontrib;
         
-        GetLightContrib(cfg, entity, surfnorm, surfpoint, lightsurf->twosided, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
- 
-        const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
-        VectorScale(color, occlusion, color);
+        /* write out the final color, as GetLightContrib does */
+        if (entity->projectedmip) {
+            vec3_t col;
+            if (LightFace_SampleMipTex(entity->projectedmip, entity->projectionmatrix, surfpoint, col)) {
+                const auto entcol = *entity->color.vec3Value();
+                for (int k = 0; k < 3; k++)
+                    col[k] *= entcol[k] * (1.0f / 255.0f);
+            }
+            VectorScale(col, add * (1.0f / 255.0f), color);
+        } else {
+            VectorScale(*entity->color.vec3Value(), add * (1.0f / 255.0f), color);
+        }
+        VectorScale(surfpointToLightDir, add, normalcontrib);
+        
+        // Dirt_GetScaleFactor is 1 for unoccluded samples
+        if (lightsurf->occlusion[i] > 0.0f) {
+            const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
+            VectorScale(color, occlusion, color);
+        }
         
         /* Quick distance check first */
         if (fabs(LightSample_Brightness(color)) <= fadegate) {
@@ -1508,16 +2141,26 @@ LightFace_Entity(const mbsp_t *bsp,
         
         rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, color, normalcontrib);
     }
-    
-    // don't need closest hit, just checking for occlusion between light and surface point
-    rs->tracePushedRaysOcclusion(modelinfo);
-    total_light_rays += rs->numPushedRays();
-    
-    int cached_style = entity->style.intValue();
+}
+
+/*
+ * ================
+ * LightFace_EntityResults
+ *
+ * Adds one light's (or area light sample's) unoccluded rays,
+ * [first, first + count) of the traced stream, to the lightmaps.
+ * ================
+ */
+static void
+LightFace_EntityResults(const light_t *entity, int sample, raystream_occlusion_t *rs, int first, int count,
+                        lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    total_light_rays += count;
+    
+    int cached_style = entity->style.intValue();
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
     
-    const int N = rs->numPushedRays();
-    for (int j = 0; j < N; j++) {
+    for (int j = first; j < first + count; j++) {
         if (rs->getPushedRayOccluded(j)) {
             continue;
         }
@@ -1526,6 +2169,9 @@ LightFace_Entity(const mbsp_t *bsp,
         
         int i = rs->getPushedRayPointIndex(j);
         
+        if (!lightsurf->visibility.empty())
+            lightsurf->visibility[i] ^= VisibilityHash(entity, sample);
+        
         // check if we hit a dynamic shadow caster (only applies to style 0 lights)
         //
         // note, this still works even though we're doing an occlusion trace - closest
@@ -1555,26 +2201,98 @@ LightFace_Entity(const mbsp_t *bsp,
         rs->getPushedRayNormalContrib(j, normalcontrib);
 
         VectorAdd(sample->color, color, sample->color);
-        VectorAdd(sample->direction, normalcontrib, sample->direction);
+        if (cached_lightmap->directions)
+            VectorAdd(cached_lightmap->directions[i], normalcontrib, cached_lightmap->directions[i]);
         
         Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
     }
 }
 
+/*
+ * ================
+ * LightFace_Entities
+ *
+ * Lights the face with each of the given lights. Rays for several lights,
+ * and for all of an area light's samples, go to Embree in one trace; the
+ * results are then applied light by light, in the given order, exactly as
+ * if each light had been traced alone.
+ * ================
+ */
+static void
+LightFace_Entities(const std::vector<const light_t *> &entities,
+                   lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    struct pending_t {
+        const light_t *entity;
+        int sample;
+        int first;
+        int count;
+    };
+    std::vector<pending_t> pending;
+    
+    raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+    const int streamsize = LightSurf_StreamSize(lightsurf->numpoints);
+    
+    const auto flush = [&]() {
+        const double tracestart = lightprofile ? Timing_Now() : 0;
+        // don't need closest hit, just checking for occlusion between light and surface point
+        rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+        if (!lightprofile) {
+            for (const pending_t &p : pending) {
+                LightFace_EntityResults(p.entity, p.sample, rs, p.first, p.count, lightsurf, lightmaps);
+            }
+        } else {
+            // each light pays for its share of the trace by ray count
+            const double traceseconds = Timing_Now() - tracestart;
+            const int numrays = static_cast<int>(rs->numPushedRays());
+            for (const pending_t &p : pending) {
+                const double start = Timing_Now();
+                LightFace_EntityResults(p.entity, p.sample, rs, p.first, p.count, lightsurf, lightmaps);
+                const double share = numrays ? traceseconds * p.count / numrays : 0;
+                Profile_LightRays(p.entity, p.count, share + Timing_Now() - start);
+            }
+        }
+        pending.clear();
+        rs->clearPushedRays();
+    };
+    
+    rs->clearPushedRays();
+    for (const light_t *entity : entities) {
+        if (LightFace_EntityCulled(entity, lightsurf)) {
+            continue;
+        }
+        
+        for (int sample = 0; sample < entity->samples.intValue(); sample++) {
+            // each push is at most one ray per sample point
+            if (static_cast<int>(rs->numPushedRays()) + lightsurf->numpoints > streamsize) {
+                flush();
+            }
+            
+            const int first = static_cast<int>(rs->numPushedRays());
+            rs->startOccluderGroup();
+            LightFace_EntityPush(entity, sample, lightsurf);
+            pending.push_back({ entity, sample, first, static_cast<int>(rs->numPushedRays()) - first });
+        }
+    }
+    if (!pending.empty()) {
+        flush();
+    }
+}
+
 /*
  * =============
  * LightFace_Sky
  * =============
  */
 static void
-LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+LightFace_Sky(const sun_t *sun, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
     const plane_t *plane = &lightsurf->plane;
 
     // FIXME: Normalized sun vector should be stored in the sun_t. Also clarify which way the vector points (towards or away..)
-    // FIXME: Much of this is copied/pasted from LightFace_Entity, should probably be merged
+    // FIXME: Much of this is copied/pasted from LightFace_EntityPush, should probably be merged
     vec3_t incoming;
     VectorCopy(sun->sunvec, incoming);
     VectorNormalize(incoming);
@@ -1649,6 +2367,9 @@ LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *li
 
         const int i = rs->getPushedRayPointIndex(j);
         
+        if (!lightsurf->visibility.empty())
+            lightsurf->visibility[i] ^= VisibilityHash(sun);
+        
         // check if we hit a dynamic shadow caster
         int desired_style = sun->style;
         if (desired_style == 0) {
@@ -1668,12 +2389,202 @@ LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *li
         rs->getPushedRayNormalContrib(j, normalcontrib);
         
         VectorAdd(sample->color, color, sample->color);
-        VectorAdd(sample->direction, normalcontrib, sample->direction);
+        if (cached_lightmap->directions)
+            VectorAdd(cached_lightmap->directions[i], normalcontrib, cached_lightmap->directions[i]);
         
         Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
     }
 }
 
+/*
+ * Suns that -skyrays samples stochastically instead of tracing one by one:
+ * the positive suns too faint to get a whole ray per sample on their own,
+ * i.e. sky dome and penumbra suns.
+ */
+struct skysampling_t {
+    std::vector<const sun_t *> suns;
+    std::vector<double> cdf; // running sum of sunlight over suns
+    std::vector<uint8_t> sampled; // indexed like GetSuns()
+    double total = 0;
+};
+
+static skysampling_t
+SkySampling_Build(void)
+{
+    skysampling_t sky;
+    const std::vector<sun_t> &suns = GetSuns();
+    sky.sampled.assign(suns.size(), 0);
+    if (skyrays <= 0)
+        return sky;
+    
+    double positive = 0;
+    for (const sun_t &sun : suns)
+        if (sun.sunlight > 0)
+            positive += sun.sunlight;
+    
+    for (size_t i = 0; i < suns.size(); i++) {
+        const sun_t &sun = suns[i];
+        if (sun.sunlight > 0 && sun.sunlight * skyrays < positive) {
+            sky.suns.push_back(&sun);
+            sky.total += sun.sunlight;
+            sky.cdf.push_back(sky.total);
+        }
+    }
+    
+    // no cheaper than tracing each sun
+    if (static_cast<int>(sky.suns.size()) <= skyrays) {
+        return skysampling_t { {}, {}, std::vector<uint8_t>(suns.size(), 0), 0 };
+    }
+    for (const sun_t *sun : sky.suns)
+        sky.sampled[sun - suns.data()] = 1;
+    return sky;
+}
+
+static const skysampling_t &
+SkySampling(void)
+{
+    static const skysampling_t sky = SkySampling_Build();
+    return sky;
+}
+
+static bool
+SkySampling_Covers(const sun_t *sun)
+{
+    const skysampling_t &sky = SkySampling();
+    return sky.sampled[sun - GetSuns().data()] != 0;
+}
+
+/* deterministic jitter in [0, 1) for stratum k of sample i of a face */
+static float
+SkySampling_Jitter(int facenum, int i, int k)
+{
+    uint32_t h = static_cast<uint32_t>(facenum) * 0x9E3779B1u;
+    h ^= static_cast<uint32_t>(i) * 0x85EBCA6Bu;
+    h ^= static_cast<uint32_t>(k) * 0xC2B2AE35u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+ * =============
+ * LightFace_SkySampled
+ *
+ * -skyrays n: instead of one ray per sun per sample, each sample traces n
+ * stratified rays towards the suns SkySampling covers, chosen with
+ * probability proportional to their sunlight. Each ray carries 1/n of
+ * their combined light, in its sun's colour and style.
+ * =============
+ */
+static void
+LightFace_SkySampled(lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const skysampling_t &sky = SkySampling();
+    if (sky.suns.empty())
+        return;
+    
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    const plane_t *plane = &lightsurf->plane;
+    const int facenum = Face_GetNum(lightsurf->bsp, lightsurf->face);
+    const bool cullbackfacing = !lightsurf->curved && !lightsurf->twosided;
+    const float rayweight = sky.total / skyrays;
+    
+    raystream_intersection_t *rs = lightsurf->intersection_stream;
+    std::vector<const sun_t *> raysuns;
+    
+    for (int k = 0; k < skyrays; k++) {
+        rs->clearPushedRays();
+        raysuns.clear();
+        
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            if (lightsurf->occluded[i])
+                continue;
+            
+            const double u = (k + SkySampling_Jitter(facenum, i, k)) / skyrays * sky.total;
+            const size_t index = qmin(static_cast<size_t>(std::upper_bound(sky.cdf.begin(), sky.cdf.end(), u) - sky.cdf.begin()),
+                                      sky.suns.size() - 1);
+            const sun_t *sun = sky.suns[index];
+            
+            vec3_t incoming;
+            VectorCopy(sun->sunvec, incoming);
+            VectorNormalize(incoming);
+            
+            /* as LightFace_Sky's whole-face test; the ray still counts towards the estimate */
+            if (cullbackfacing && DotProduct(incoming, plane->normal) < -ANGLE_EPSILON)
+                continue;
+            
+            float angle = DotProduct(incoming, lightsurf->normals[i]);
+            if (lightsurf->twosided) {
+                if (angle < 0) {
+                    angle = -angle;
+                }
+            }
+            angle = qmax(0.0f, angle);
+            angle = (1.0 - sun->anglescale) + sun->anglescale * angle;
+            
+            float value = angle * rayweight;
+            if (sun->dirt) {
+                value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+            }
+            
+            vec3_t color, normalcontrib;
+            VectorScale(sun->sunlight_color, value / 255.0, color);
+            VectorScale(sun->sunvec, value, normalcontrib);
+            
+            /* Quick distance check first */
+            if (fabs(LightSample_Brightness(color)) <= fadegate) {
+                continue;
+            }
+            
+            rs->pushRay(i, lightsurf->points[i], incoming, MAX_SKY_DIST, color, normalcontrib);
+            raysuns.push_back(sun);
+        }
+        
+        rs->tracePushedRaysIntersection(modelinfo);
+        
+        const int N = rs->numPushedRays();
+        for (int j = 0; j < N; j++) {
+            if (rs->getPushedRayHitType(j) != hittype_t::SKY) {
+                continue;
+            }
+            
+            const sun_t *sun = raysuns[j];
+            if (!sun->suntexture.empty()) {
+                const bsp2_dface_t *face = rs->getPushedRayHitFace(j);
+                if (sun->suntexture != Face_TextureName(lightsurf->bsp, face)) {
+                    continue;
+                }
+            }
+            
+            const int i = rs->getPushedRayPointIndex(j);
+            
+            if (!lightsurf->visibility.empty())
+                lightsurf->visibility[i] ^= VisibilityHash(sun);
+            
+            int style = sun->style;
+            if (style == 0) {
+                style = rs->getPushedRayDynamicStyle(j);
+            }
+            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+            lightsample_t *sample = &lightmap->samples[i];
+            
+            vec3_t color, normalcontrib;
+            rs->getPushedRayColor(j, color);
+            rs->getPushedRayNormalContrib(j, normalcontrib);
+            
+            VectorAdd(sample->color, color, sample->color);
+            if (lightmap->directions)
+                VectorAdd(lightmap->directions[i], normalcontrib, lightmap->directions[i]);
+            
+            Lightmap_Save(lightmaps, lightsurf, lightmap, style);
+        }
+    }
+}
+
 /*
  * ============
  * LightFace_Min
@@ -1704,7 +2615,7 @@ LightFace_Min(const mbsp_t *bsp, const bsp2_dface_t *face,
             value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
         }
         if (cfg.addminlight.boolValue()) {
-            Light_Add(sample, value, color, vec3_origin);
+            Light_Add(sample, value, color);
         } else {
             Light_ClampMin(sample, value, color);
         }
@@ -1735,48 +2646,61 @@ LightFace_Min(const mbsp_t *bsp, const bsp2_dface_t *face,
         }
         
         raystream_occlusion_t *rs = lightsurf->occlusion_stream;
-        rs->clearPushedRays();
         
         lightmap = Lightmap_ForStyle(lightmaps, entity.style.intValue(), lightsurf);
 
         hit = false;
-        for (int i = 0; i < lightsurf->numpoints; i++) {
-            if (lightsurf->occluded[i])
-                continue;
+        for (int lightsample = 0; lightsample < entity.samples.intValue(); lightsample++) {
+            rs->clearPushedRays();
             
-            const lightsample_t *sample = &lightmap->samples[i];
-            const vec_t *surfpoint = lightsurf->points[i];
-            if (cfg.addminlight.boolValue() || LightSample_Brightness(sample->color) < entity.light.floatValue()) {
-                vec3_t surfpointToLightDir;
-                const vec_t surfpointToLightDist = GetDir(surfpoint, *entity.origin.vec3Value(), surfpointToLightDir);
+            for (int i = 0; i < lightsurf->numpoints; i++) {
+                if (lightsurf->occluded[i])
+                    continue;
                 
-                rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist);
-            }
-        }
-        
-        // local minlight just needs occlusion, not closest hit
-        rs->tracePushedRaysOcclusion(modelinfo);
-        total_light_rays += rs->numPushedRays();
-        
-        const int N = rs->numPushedRays();
-        for (int j = 0; j < N; j++) {
-            if (rs->getPushedRayOccluded(j)) {
-                continue;
+                const lightsample_t *sample = &lightmap->samples[i];
+                const vec_t *surfpoint = lightsurf->points[i];
+                if (cfg.addminlight.boolValue() || LightSample_Brightness(sample->color) < entity.light.floatValue()) {
+                    vec3_t lightorigin;
+                    if (entity.samples.intValue() > 1) {
+                        float rotation[3];
+                        AreaLight_PointRotation(surfpoint, rotation);
+                        AreaLight_SampleOrigin(&entity, lightsample, rotation, lightorigin);
+                    } else {
+                        VectorCopy(*entity.origin.vec3Value(), lightorigin);
+                    }
+                    
+                    vec3_t surfpointToLightDir;
+                    const vec_t surfpointToLightDist = GetDir(surfpoint, lightorigin, surfpointToLightDir);
+                    
+                    rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist);
+                }
             }
             
-            int i = rs->getPushedRayPointIndex(j);
-            vec_t value = entity.light.floatValue();
-            lightsample_t *sample = &lightmap->samples[i];
+            // local minlight just needs occlusion, not closest hit
+            rs->tracePushedRaysOcclusion(modelinfo);
+            total_light_rays += rs->numPushedRays();
+            Profile_Rays(rs->numPushedRays());
             
-            value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], &entity, 0.0 /* TODO: pass distance */, lightsurf);
-            if (cfg.addminlight.boolValue()) {
-                Light_Add(sample, value, *entity.color.vec3Value(), vec3_origin);
-            } else {
-                Light_ClampMin(sample, value, *entity.color.vec3Value());
+            const int N = rs->numPushedRays();
+            for (int j = 0; j < N; j++) {
+                if (rs->getPushedRayOccluded(j)) {
+                    continue;
+                }
+                
+                int i = rs->getPushedRayPointIndex(j);
+                vec_t value = entity.light.floatValue();
+                lightsample_t *sample = &lightmap->samples[i];
+                
+                value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], &entity, 0.0 /* TODO: pass distance */, lightsurf);
+                if (cfg.addminlight.boolValue()) {
+                    Light_Add(sample, value, *entity.color.vec3Value());
+                } else {
+                    Light_ClampMin(sample, value, *entity.color.vec3Value());
+                }
+                
+                hit = true;
+                total_light_ray_hits++;
             }
-
-            hit = true;
-            total_light_ray_hits++;
         }
         
         if (hit) {
@@ -1933,7 +2857,7 @@ GetIndirectLighting (const globalconfig_t &cfg, const bouncelight_t *vpl, const
 // dir: vpl -> sample point direction
 //mxd. returns color in [0,255]
 static qvec3f
-GetSurfaceLighting(const globalconfig_t &cfg, const surfacelight_t *vpl, const qvec3f &dir, const float dist, const qvec3f &normal)
+GetSurfaceLighting(const globalconfig_t &cfg, const surfacelight_t *vpl, const float intensity, const qvec3f &dir, const float dist, const qvec3f &normal)
 {
     qvec3f result{0};
     float dotProductFactor = 1.0f;
@@ -1955,7 +2879,7 @@ GetSurfaceLighting(const globalconfig_t &cfg, const surfacelight_t *vpl, const q
     }
 
     // Get light contribution
-    result = SurfaceLight_ColorAtDist(cfg, vpl->intensity, vec3_t_to_glm(vpl->color), dist);
+    result = SurfaceLight_ColorAtDist(cfg, intensity, vec3_t_to_glm(vpl->color), dist);
 
     // Apply angle scale
     const qvec3f resultscaled = result * dotProductFactor;
@@ -1997,6 +2921,50 @@ SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf)
     return LightSample_Brightness(color) < 0.25f;
 }
 
+/*
+ * ============
+ * LightFace_BouncePhotons
+ *
+ * -bouncephotons: density estimate from the nearest photons at each
+ * sample, no rays traced per face.
+ * ============
+ */
+static void
+LightFace_BouncePhotons(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        
+        const std::map<int, qvec3f> irradiance = PhotonMap_Irradiance(vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
+        
+        for (const auto &styleColor : irradiance) {
+            if (LightSample_Brightness(styleColor.second) < 0.25)
+                continue;
+            
+            vec3_t indirect;
+            glm_to_vec3_t(styleColor.second, indirect);
+            
+            /* Use dirt scaling on the indirect lighting.
+             * Except, not in bouncedebug mode.
+             */
+            if (debugmode != debugmode_bounce) {
+                const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+                VectorScale(indirect, dirtscale, indirect);
+            }
+            
+            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, styleColor.first, lightsurf);
+            lightsample_t *sample = &lightmap->samples[i];
+            VectorAdd(sample->color, indirect, sample->color);
+            
+            // save straight away, an unsaved lightmap would be reused for the next style
+            Lightmap_Save(lightmaps, lightsurf, lightmap, styleColor.first);
+        }
+    }
+}
+
 static void
 LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
@@ -2010,60 +2978,88 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
           || debugmode == debugmode_none))
         return;
     
+    if (previewpass)
+        return;
+    
+    if (PhotonMapActive()) {
+        LightFace_BouncePhotons(lightsurf, lightmaps);
+        return;
+    }
+    
 #if 1
-    for (const bouncelight_t &vpl : BounceLights()) {
+    const std::vector<bouncelight_t> &vpls = BounceLights();
+    std::vector<qvec3f> rayIndirect;
+    for (const int vplnum : BounceLightsTouchingBounds(lightsurf->mins, lightsurf->maxs)) {
+        const bouncelight_t &vpl = vpls[vplnum];
         if (BounceLight_SphereCull(bsp, &vpl, lightsurf))
             continue;
             
-        // FIXME: This will trace the same ray multiple times, once per style,
-        // if the bouncelight is hitting a face with multiple styles.
-        for (const auto &styleColor : vpl.colorByStyle) {
-            bool hit = false;
-            const int style = styleColor.first;
-            const qvec3f &color = styleColor.second;
+        /*
+         * Trace one ray per sample point that any style lights, then
+         * apply the visibility to each style. GetIndirectLighting for
+         * every (ray, style) is kept in rayIndirect, style-minor.
+         */
+        const size_t numstyles = vpl.colorByStyle.size();
+        raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+        rs->clearPushedRays();
+        rayIndirect.clear();
+        
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            if (lightsurf->occluded[i])
+                continue;
             
-            raystream_occlusion_t *rs = lightsurf->occlusion_stream;
-            rs->clearPushedRays();
+            qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
+            const float dist = qv::length(dir);
+            if (dist == 0.0f)
+                continue; // FIXME: nudge or something
+            dir /= dist;
             
-            for (int i = 0; i < lightsurf->numpoints; i++) {
-                if (lightsurf->occluded[i])
-                    continue;
-                
-                qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
-                const float dist = qv::length(dir);
-                if (dist == 0.0f)
-                    continue; // FIXME: nudge or something
-                dir /= dist;
-                
-                const qvec3f indirect = GetIndirectLighting(cfg, &vpl, color, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
-                
-                if (LightSample_Brightness(indirect) < 0.25)
-                    continue;
-                
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(vpl.pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
-                
-                rs->pushRay(i, vplPos, vplDir, dist, vplColor);
+            bool bright = false;
+            const size_t first = rayIndirect.size();
+            for (const auto &styleColor : vpl.colorByStyle) {
+                const qvec3f indirect = GetIndirectLighting(cfg, &vpl, styleColor.second, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
+                if (LightSample_Brightness(indirect) >= 0.25)
+                    bright = true;
+                rayIndirect.push_back(indirect);
             }
             
-            if (!rs->numPushedRays())
+            if (!bright) {
+                rayIndirect.resize(first);
                 continue;
+            }
             
-            total_bounce_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+            vec3_t vplPos, vplDir;
+            glm_to_vec3_t(vpl.pos, vplPos);
+            glm_to_vec3_t(dir, vplDir);
             
+            rs->pushRay(i, vplPos, vplDir, dist);
+        }
+        
+        if (!rs->numPushedRays())
+            continue;
+        
+        total_bounce_rays += rs->numPushedRays();
+        Profile_Rays(rs->numPushedRays());
+        rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+        
+        const int N = rs->numPushedRays();
+        size_t styleindex = 0;
+        for (const auto &styleColor : vpl.colorByStyle) {
+            bool hit = false;
+            const int style = styleColor.first;
             lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
             
-            const int N = rs->numPushedRays();
             for (int j = 0; j < N; j++) {
                 if (rs->getPushedRayOccluded(j))
                     continue;
                 
+                const qvec3f &rayColor = rayIndirect[j * numstyles + styleindex];
+                if (LightSample_Brightness(rayColor) < 0.25)
+                    continue;
+                
                 const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = {0};
-                rs->getPushedRayColor(j, indirect);
+                vec3_t indirect;
+                glm_to_vec3_t(rayColor, indirect);
                 
                 Q_assert(!std::isnan(indirect[0]));
                 
@@ -2085,6 +3081,8 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
             // If this style of this bounce light contributed anything, save.
             if (hit)
                 Lightmap_Save(lightmaps, lightsurf, lightmap, style);
+            
+            styleindex++;
         }
     }
 
@@ -2193,96 +3191,126 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
 #endif
 }
 
-static void //mxd
-LightFace_SurfaceLight(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+/*
+ * Traces the surface light rays pushed so far and adds the unoccluded
+ * ones to the style 0 lightmap.
+ */
+static void
+SurfaceLight_TracePushedRays(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
     const globalconfig_t &cfg = *lightsurf->cfg;
+    raystream_occlusion_t *rs = lightsurf->occlusion_stream;
 
-    for (const surfacelight_t &vpl : SurfaceLights()) {
-        if (SurfaceLight_SphereCull(&vpl, lightsurf))
-            continue;
+    if (!rs->numPushedRays())
+        return;
 
-        raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+    total_surflight_rays += rs->numPushedRays();
+    Profile_Rays(rs->numPushedRays());
+    rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
 
-        for (int c = 0; c < vpl.points.size(); c++) {
-            rs->clearPushedRays();
-            
-            for (int i = 0; i < lightsurf->numpoints; i++) {
-                if (lightsurf->occluded[i])
-                    continue;
+    const int lightmapstyle = 0;
+    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
 
-                const qvec3f lightsurf_pos = vec3_t_to_glm(lightsurf->points[i]);
-                const qvec3f lightsurf_normal = vec3_t_to_glm(lightsurf->normals[i]);
+    bool hit = false;
+    const int numrays = rs->numPushedRays();
+    for (int j = 0; j < numrays; j++) {
+        if (rs->getPushedRayOccluded(j))
+            continue;
 
-                // Push 1 unit behind the surflight (fixes darkening near surflight face on neighbouring faces)
-                qvec3f pos = vpl.points[c] - vpl.surfnormal; 
-                qvec3f dir = lightsurf_pos - pos;
-                float dist = qv::length(dir);
+        const int i = rs->getPushedRayPointIndex(j);
+        vec3_t indirect = { 0 };
+        rs->getPushedRayColor(j, indirect);
 
-                if (dist == 0.0f)
-                    dir = lightsurf_normal;
-                else
-                    dir /= dist;
+        Q_assert(!std::isnan(indirect[0]));
 
-                const qvec3f indirect = GetSurfaceLighting(cfg, &vpl, dir, dist, lightsurf_normal);
-                if (LightSample_Brightness(indirect) < 0.01f) // Each point contributes very little to the final result
-                    continue;
+        // Use dirt scaling on the surface lighting.
+        const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], nullptr, 0.0, lightsurf);
+        VectorScale(indirect, dirtscale, indirect);
 
-                // Push 1 unit in front of the surflight, so embree can properly process it ...
-                pos = vpl.points[c] + vpl.surfnormal;
-                dir = lightsurf_pos - pos;
-                dist = qv::length(dir);
+        lightsample_t *sample = &lightmap->samples[i];
+        VectorAdd(sample->color, indirect, sample->color);
 
-                if (dist == 0.0f)
-                    dir = lightsurf_normal;
-                else
-                    dir /= dist;
+        hit = true;
+        ++total_surflight_ray_hits;
+    }
 
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
+    // If surface light contributed anything, save.
+    if (hit)
+        Lightmap_Save(lightmaps, lightsurf, lightmap, lightmapstyle);
 
-                rs->pushRay(i, vplPos, vplDir, dist, vplColor);
-            }
+    rs->clearPushedRays();
+}
+
+/*
+ * Each sample is lit by clusters of each surface light's points rather
+ * than every point: far from the light a whole cluster is one emitter
+ * with one occlusion ray, and only near it are clusters opened up down
+ * to the single points. Rays from every light are traced together in
+ * batches the size of the ray stream.
+ */
+static void //mxd
+LightFace_SurfaceLight(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    raystream_occlusion_t *rs = lightsurf->occlusion_stream;
+    const size_t streamsize = LightSurf_StreamSize(lightsurf->numpoints);
+    std::vector<surflightemitter_t> emitters;
+
+    rs->clearPushedRays();
+
+    const std::vector<surfacelight_t> &vpls = SurfaceLights();
+    for (const int vplnum : SurfaceLightsTouchingBounds(lightsurf->mins, lightsurf->maxs)) {
+        const surfacelight_t &vpl = vpls[vplnum];
+        if (SurfaceLight_SphereCull(&vpl, lightsurf))
+            continue;
 
-            if (!rs->numPushedRays())
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            if (lightsurf->occluded[i])
                 continue;
 
-            total_surflight_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion(lightsurf->modelinfo);
+            const qvec3f lightsurf_pos = vec3_t_to_glm(lightsurf->points[i]);
+            const qvec3f lightsurf_normal = vec3_t_to_glm(lightsurf->normals[i]);
 
-            const int lightmapstyle = 0;
-            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+            SurfaceLight_Emitters(vpl, lightsurf_pos, &emitters);
 
-            bool hit = false;
-            const int numrays = rs->numPushedRays();
-            for (int j = 0; j < numrays; j++) {
-                if (rs->getPushedRayOccluded(j))
-                    continue;
+            for (const surflightemitter_t &emitter : emitters) {
+                // Push 1 unit behind the surflight (fixes darkening near surflight face on neighbouring faces)
+                qvec3f pos = emitter.pos - vpl.surfnormal;
+                qvec3f dir = lightsurf_pos - pos;
+                float dist = qv::length(dir);
 
-                const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = { 0 };
-                rs->getPushedRayColor(j, indirect);
+                if (dist == 0.0f)
+                    dir = lightsurf_normal;
+                else
+                    dir /= dist;
 
-                Q_assert(!std::isnan(indirect[0]));
+                const qvec3f indirect = GetSurfaceLighting(cfg, &vpl, vpl.intensity * emitter.count, dir, dist, lightsurf_normal);
+                if (LightSample_Brightness(indirect) < 0.01f) // Each point contributes very little to the final result
+                    continue;
 
-                // Use dirt scaling on the surface lighting.
-                const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], nullptr, 0.0, lightsurf);
-                VectorScale(indirect, dirtscale, indirect);
+                // Push 1 unit in front of the surflight, so embree can properly process it ...
+                pos = emitter.pos + vpl.surfnormal;
+                dir = lightsurf_pos - pos;
+                dist = qv::length(dir);
 
-                lightsample_t *sample = &lightmap->samples[i];
-                VectorAdd(sample->color, indirect, sample->color);
+                if (dist == 0.0f)
+                    dir = lightsurf_normal;
+                else
+                    dir /= dist;
 
-                hit = true;
-                ++total_surflight_ray_hits;
-            }
+                vec3_t vplPos, vplDir, vplColor;
+                glm_to_vec3_t(pos, vplPos);
+                glm_to_vec3_t(dir, vplDir);
+                glm_to_vec3_t(indirect, vplColor);
 
-            // If surface light contributed anything, save.
-            if (hit)
-                Lightmap_Save(lightmaps, lightsurf, lightmap, lightmapstyle);
+                if (rs->numPushedRays() == streamsize)
+                    SurfaceLight_TracePushedRays(lightsurf, lightmaps);
+                rs->pushRay(i, vplPos, vplDir, dist, vplColor);
+            }
         }
     }
+
+    SurfaceLight_TracePushedRays(lightsurf, lightmaps);
 }
 
 static void
@@ -2533,9 +3561,19 @@ DirtAtPoint(const globalconfig_t &cfg, raystream_intersection_t *rs, const vec3_
     return occlusion;
 }
 
+/* _dirtadaptive's first pass traces every DIRT_ADAPTIVE_STRIDE'th dirt vector */
+#define DIRT_ADAPTIVE_STRIDE 4
+
 /*
  * ============
  * LightFace_CalculateDirt
+ *
+ * With _dirtadaptive, a first pass traces a quarter of the dirt vectors
+ * from "anchor" samples: every sample, or with -extra/-extra4 the corners
+ * of each lightmap texel. Anchors where those rays all hit or all miss,
+ * and whose neighbouring anchors agree, keep that estimate. The others
+ * trace the remaining vectors. Supersamples between four settled anchors
+ * interpolate them instead of tracing at all.
  * ============
  */
 static void
@@ -2547,27 +3585,32 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
 
     // batch implementation:
 
-    vec3_t *myUps = (vec3_t *) calloc(lightsurf->numpoints, sizeof(vec3_t));
-    vec3_t *myRts = (vec3_t *) calloc(lightsurf->numpoints, sizeof(vec3_t));
+    const int numpoints = lightsurf->numpoints;
+    vec3_t *myUps = lightsurf_scratch.dirtups;
+    vec3_t *myRts = lightsurf_scratch.dirtrts;
     
     // init
-    for (int i = 0; i < lightsurf->numpoints; i++) {
+    for (int i = 0; i < numpoints; i++) {
         lightsurf->occlusion[i] = 0;
     }
     
     // this stuff is just per-point
-    for (int i = 0; i < lightsurf->numpoints; i++) {
+    for (int i = 0; i < numpoints; i++) {
         GetUpRtVecs(lightsurf->normals[i], myUps[i], myRts[i]);
     }
-
-    for (int j=0; j<numDirtVectors; j++) {
+    
+    std::vector<int> numrays(numpoints, 0);
+    std::vector<int> numhits(numpoints, 0);
+    
+    // traces dirt vector j from the samples in `mask`
+    const auto traceDirt = [&](int j, const std::vector<uint8_t> &mask) {
         raystream_intersection_t *rs = lightsurf->intersection_stream;
         rs->clearPushedRays();
         
         // fill in input buffers
         
-        for (int i = 0; i < lightsurf->numpoints; i++) {
-            if (lightsurf->occluded[i])
+        for (int i = 0; i < numpoints; i++) {
+            if (lightsurf->occluded[i] || !mask[i])
                 continue;
             
             vec3_t dirtvec;
@@ -2585,23 +3628,144 @@ LightFace_CalculateDirt(lightsurf_t *lightsurf)
         // accumulate hitdists
         for (int k = 0; k < rs->numPushedRays(); k++) {
             const int i = rs->getPushedRayPointIndex(k);
+            numrays[i]++;
             if (rs->getPushedRayHitType(k) == hittype_t::SOLID) {
                 float dist = rs->getPushedRayHitDist(k);
                 lightsurf->occlusion[i] += qmin(cfg.dirtDepth.floatValue(), dist);
+                numhits[i]++;
             } else {
                 lightsurf->occlusion[i] += cfg.dirtDepth.floatValue();
             }
         }
+    };
+    
+    // samples whose occlusion is interpolated from settled anchors
+    std::vector<uint8_t> interpolated(numpoints, 0);
+    
+    if (!cfg.dirtAdaptive.boolValue()) {
+        const std::vector<uint8_t> all(numpoints, 1);
+        for (int j=0; j<numDirtVectors; j++) {
+            traceDirt(j, all);
+        }
+    } else {
+        const int width = lightsurf->width;
+        const int height = lightsurf->height;
+        const int oversample = lightsurf->oversample;
+        
+        // anchor columns / rows: texel corners, plus the last supersample
+        std::vector<int> as, at;
+        for (int s = 0; s < width; s++)
+            if (s % oversample == 0 || s == width - 1)
+                as.push_back(s);
+        for (int t = 0; t < height; t++)
+            if (t % oversample == 0 || t == height - 1)
+                at.push_back(t);
+        
+        std::vector<uint8_t> anchor(numpoints, 0);
+        for (int t : at)
+            for (int s : as)
+                anchor[t * width + s] = 1;
+        
+        // coarse pass
+        for (int j = 0; j < numDirtVectors; j += DIRT_ADAPTIVE_STRIDE) {
+            traceDirt(j, anchor);
+        }
+        
+        // 0 = unsettled, 1 = all rays missed, 2 = all rays hit
+        std::vector<uint8_t> agreement(numpoints, 0);
+        for (int i = 0; i < numpoints; i++) {
+            if (!anchor[i] || lightsurf->occluded[i])
+                continue;
+            if (numhits[i] == 0)
+                agreement[i] = 1;
+            else if (numhits[i] == numrays[i])
+                agreement[i] = 2;
+        }
+        
+        // an anchor is only settled if its neighbouring anchors agree with it
+        std::vector<uint8_t> refine(numpoints, 0);
+        for (int b = 0; b < static_cast<int>(at.size()); b++) {
+            for (int a = 0; a < static_cast<int>(as.size()); a++) {
+                const int i = at[b] * width + as[a];
+                if (lightsurf->occluded[i])
+                    continue;
+                
+                bool settled = (agreement[i] != 0);
+                for (int db = -1; db <= 1 && settled; db++) {
+                    for (int da = -1; da <= 1 && settled; da++) {
+                        const int nb = b + db, na = a + da;
+                        if (nb < 0 || na < 0 || nb >= static_cast<int>(at.size()) || na >= static_cast<int>(as.size()))
+                            continue;
+                        const int n = at[nb] * width + as[na];
+                        if (!lightsurf->occluded[n] && agreement[n] != agreement[i])
+                            settled = false;
+                    }
+                }
+                refine[i] = !settled;
+            }
+        }
+        
+        // supersamples between four settled anchors are interpolated, the rest are traced fully
+        for (int t = 0; t < height; t++) {
+            for (int s = 0; s < width; s++) {
+                const int i = t * width + s;
+                if (anchor[i] || lightsurf->occluded[i])
+                    continue;
+                
+                const int s0 = (s / oversample) * oversample, s1 = qmin(s0 + oversample, width - 1);
+                const int t0 = (t / oversample) * oversample, t1 = qmin(t0 + oversample, height - 1);
+                const int corners[4] = { t0 * width + s0, t0 * width + s1, t1 * width + s0, t1 * width + s1 };
+                
+                bool usable = true;
+                for (int c : corners) {
+                    if (lightsurf->occluded[c] || refine[c])
+                        usable = false;
+                }
+                
+                if (usable)
+                    interpolated[i] = 1;
+                else
+                    refine[i] = 1;
+            }
+        }
+        
+        for (int j = 0; j < numDirtVectors; j++) {
+            // non-anchor samples being refined haven't had the coarse pass
+            std::vector<uint8_t> mask(numpoints, 0);
+            for (int i = 0; i < numpoints; i++) {
+                if (refine[i] && (!anchor[i] || (j % DIRT_ADAPTIVE_STRIDE) != 0))
+                    mask[i] = 1;
+            }
+            traceDirt(j, mask);
+        }
     }
     
     // process the results.
-    for (int i = 0; i < lightsurf->numpoints; i++) {
-        vec_t avgHitdist = lightsurf->occlusion[i] / (float)numDirtVectors;
+    for (int i = 0; i < numpoints; i++) {
+        if (interpolated[i])
+            continue;
+        // samples that traced nothing (occluded) are fully occluded, as before
+        const int count = (numrays[i] != 0) ? numrays[i] : numDirtVectors;
+        vec_t avgHitdist = lightsurf->occlusion[i] / (float)count;
         lightsurf->occlusion[i] = 1 - (avgHitdist / cfg.dirtDepth.floatValue());
     }
-
-    free(myUps);
-    free(myRts);
+    
+    for (int i = 0; i < numpoints; i++) {
+        if (!interpolated[i])
+            continue;
+        
+        const int width = lightsurf->width;
+        const int oversample = lightsurf->oversample;
+        const int s = i % width, t = i / width;
+        const int s0 = (s / oversample) * oversample, s1 = qmin(s0 + oversample, width - 1);
+        const int t0 = (t / oversample) * oversample, t1 = qmin(t0 + oversample, lightsurf->height - 1);
+        const float fs = (s1 == s0) ? 0.0f : static_cast<float>(s - s0) / (s1 - s0);
+        const float ft = (t1 == t0) ? 0.0f : static_cast<float>(t - t0) / (t1 - t0);
+        
+        const float top = (1 - fs) * lightsurf->occlusion[t0 * width + s0] + fs * lightsurf->occlusion[t0 * width + s1];
+        const float bottom = (1 - fs) * lightsurf->occlusion[t1 * width + s0] + fs * lightsurf->occlusion[t1 * width + s1];
+        lightsurf->occlusion[i] = (1 - ft) * top + ft * bottom;
+    }
 }
 
 // clamps negative values. applies gamma and rangescale. clamps values over 255
@@ -2694,8 +3858,8 @@ DumpFullSizeLightmap(const mbsp_t *bsp, const lightsurf_t *lightsurf)
             }
         }
         
-        const int oversampled_width = (lightsurf->texsize[0] + 1) * oversample;
-        const int oversampled_height = (lightsurf->texsize[1] + 1) * oversample;
+        const int oversampled_width = (lightsurf->texsize[0] + 1) * lightsurf->oversample;
+        const int oversampled_height = (lightsurf->texsize[1] + 1) * lightsurf->oversample;
         
         Q_assert(lightsurf->numpoints == (oversampled_height * oversampled_width));
 
@@ -2738,38 +3902,26 @@ DumpDownscaledLightmap(const mbsp_t *bsp, const bsp2_dface_t *face, int w, int h
     WritePPM(std::string{fname}, w, h, rgbdata.data());
 }
 
-static std::vector<qvec4f>
-LightmapColorsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm)
+static void
+LightmapColorsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm, std::vector<qvec4f> *res)
 {
-    std::vector<qvec4f> res;
+    res->resize(lightsurf->numpoints);
     for (int i=0; i<lightsurf->numpoints; i++) {
         const vec_t *color = lm->samples[i].color;
         const float alpha = lightsurf->occluded[i] ? 0.0f : 1.0f;
-        res.emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
+        (*res)[i] = qvec4f(color[0], color[1], color[2], alpha);
     }
-    return res;
 }
 
-static std::vector<qvec4f>
-LightmapNormalsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm)
+static void
+LightmapNormalsToGLMVector(const lightsurf_t *lightsurf, const lightmap_t *lm, std::vector<qvec4f> *res)
 {
-    std::vector<qvec4f> res;
+    res->resize(lightsurf->numpoints);
     for (int i=0; i<lightsurf->numpoints; i++) {
-        const vec_t *color = lm->samples[i].direction;
+        const vec_t *color = lm->directions[i];
         const float alpha = lightsurf->occluded[i] ? 0.0f : 1.0f;
-        res.emplace_back(color[0], color[1], color[2], alpha); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/modernize-use-emplace.html
+        (*res)[i] = qvec4f(color[0], color[1], color[2], alpha);
     }
-    return res;
-}
-
-static std::vector<qvec4f>
-LightmapToGLMVector(const mbsp_t *bsp, const lightsurf_t *lightsurf)
-{
-    const lightmap_t *lm = Lightmap_ForStyle_ReadOnly(lightsurf, 0);
-    if (lm != nullptr) {
-        return LightmapColorsToGLMVector(lightsurf, lm);
-    }
-    return std::vector<qvec4f>();
 }
 
 static qvec3f
@@ -2803,105 +3955,70 @@ void GLMVector_LinearToGamma(std::vector<qvec3f> &vec) {
 // - If all the samples in the filter kernel have alpha=0, write a sample with alpha=0
 //   (but still average the colors, important so that minlight still works properly
 //    for bmodels that go outside of the world).
-static std::vector<qvec4f>
-IntegerDownsampleImage(const std::vector<qvec4f> &input, int w, int h, int factor)
+static void
+IntegerDownsampleImage(const std::vector<qvec4f> &input, int w, int h, int factor, std::vector<qvec4f> *res)
 {
     Q_assert(factor >= 1);
-    if (factor == 1)
-        return input;
     
     const int outw = w/factor;
     const int outh = h/factor;
+    const float kernelsize = static_cast<float>(factor * factor);
     
-    std::vector<qvec4f> res(static_cast<size_t>(outw * outh));
+    res->resize(static_cast<size_t>(outw * outh));
     
     for (int y=0; y<outh; y++) {
         for (int x=0; x<outw; x++) {
-
-            float totalWeight = 0.0f;
-            qvec3f totalColor(0);
-            
-            // These are only used if all the samples in the kernel have alpha = 0
-            float totalWeightIgnoringOcclusion = 0.0f;
-            qvec3f totalColorIgnoringOcclusion(0);
-            
-            const int extraradius = 0;
-            const int kernelextent = factor + (2 * extraradius);
+            qvec4f total(0);            // opaque samples, alpha is their count
+            qvec4f totalIgnoringOcclusion(0);
             
-            for (int y0 = 0; y0 < kernelextent; y0++) {
-                for (int x0 = 0; x0 < kernelextent; x0++) {
-                    const int x1 = (x * factor) - extraradius + x0;
-                    const int y1 = (y * factor) - extraradius + y0;
-                    
-                    // check if the kernel goes outside of the source image
-                    if (x1 < 0 || x1 >= w)
-                        continue;
-                    if (y1 < 0 || y1 >= h)
-                        continue;
-                    
-                    // read the input sample
-                    const float weight = 1.0f;
-                    const qvec4f inSample = input.at((y1 * w) + x1);
-                    
-                    totalColorIgnoringOcclusion += qvec3f(inSample) * weight;
-                    totalWeightIgnoringOcclusion += weight;
-                    
+            for (int y0 = 0; y0 < factor; y0++) {
+                const qvec4f *row = &input[((y * factor) + y0) * w + (x * factor)];
+                for (int x0 = 0; x0 < factor; x0++) {
+                    const qvec4f &inSample = row[x0];
+                    totalIgnoringOcclusion += inSample;
                     // Occluded sample points don't contribute to the filter
-                    if (inSample[3] == 0.0f)
-                        continue;
-                    
-                    totalColor += qvec3f(inSample) * weight;
-                    totalWeight += weight;
+                    total += inSample * inSample[3];
                 }
             }
             
             const int outIndex = (y * outw) + x;
-            if (totalWeight > 0.0f) {
-                const qvec3f tmp = totalColor / totalWeight;
-                const qvec4f resultColor = qvec4f(tmp[0], tmp[1], tmp[2], 1.0f);
-                res[outIndex] = resultColor;
+            if (total[3] > 0.0f) {
+                const qvec3f tmp = qvec3f(total) / total[3];
+                (*res)[outIndex] = qvec4f(tmp[0], tmp[1], tmp[2], 1.0f);
             } else {
-                const qvec3f tmp = totalColorIgnoringOcclusion / totalWeightIgnoringOcclusion;
-                const qvec4f resultColor = qvec4f(tmp[0], tmp[1], tmp[2], 0.0f);
-                res[outIndex] = resultColor;
+                const qvec3f tmp = qvec3f(totalIgnoringOcclusion) / kernelsize;
+                (*res)[outIndex] = qvec4f(tmp[0], tmp[1], tmp[2], 0.0f);
             }
         }
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
+static void
+FloodFillTransparent(std::vector<qvec4f> *image, int w, int h)
 {
     // transparent pixels take the average of their neighbours.
+    // filled pixels are read back straight away, as they're written in place.
     
-    std::vector<qvec4f> res(input);
+    std::vector<qvec4f> &res = *image;
     
     while (1) {
         int unhandled_pixels = 0;
+        bool any_transparent = false;
         
         for (int y=0; y<h; y++) {
             for (int x=0; x<w; x++) {
                 const int i = (y * w) + x;
-                const qvec4f inSample = res.at(i);
                 
-                if (inSample[3] == 0) {
+                if (res[i][3] == 0) {
+                    any_transparent = true;
+                    
                     // average the neighbouring non-transparent samples
                     
                     int opaque_neighbours = 0;
                     qvec3f neighbours_sum;
-                    for (int y0 = -1; y0 <= 1; y0++) {
-                        for (int x0 = -1; x0 <= 1; x0++) {
-                            const int x1 = x + x0;
-                            const int y1 = y + y0;
-                            
-                            if (x1 < 0 || x1 >= w)
-                                continue;
-                            if (y1 < 0 || y1 >= h)
-                                continue;
-                            
-                            const qvec4f neighbourSample = res.at((y1 * w) + x1);
+                    for (int y1 = qmax(y - 1, 0); y1 <= qmin(y + 1, h - 1); y1++) {
+                        for (int x1 = qmax(x - 1, 0); x1 <= qmin(x + 1, w - 1); x1++) {
+                            const qvec4f &neighbourSample = res[(y1 * w) + x1];
                             if (neighbourSample[3] == 1) {
                                 opaque_neighbours++;
                                 neighbours_sum += qvec3f(neighbourSample);
@@ -2911,7 +4028,7 @@ FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
                     
                     if (opaque_neighbours > 0) {
                         neighbours_sum *= (1.0f / (float)opaque_neighbours);
-                        res.at(i) = qvec4f(neighbours_sum[0], neighbours_sum[1], neighbours_sum[2], 1.0f);
+                        res[i] = qvec4f(neighbours_sum[0], neighbours_sum[1], neighbours_sum[2], 1.0f);
                         
                         // this sample is now opaque
                     } else {
@@ -2923,7 +4040,10 @@ FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
             }
         }
         
-        if (unhandled_pixels == input.size()) {
+        if (!any_transparent)
+            break; // the usual case, nothing occluded
+        
+        if (unhandled_pixels == res.size()) {
             //logprint("FloodFillTransparent: warning, fully transparent lightmap\n");
             fully_transparent_lightmaps++;
             break;
@@ -2932,92 +4052,93 @@ FloodFillTransparent(const std::vector<qvec4f> &input, int w, int h)
         if (unhandled_pixels == 0)
             break; // all done
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-HighlightSeams(const std::vector<qvec4f> &input, int w, int h)
+static void
+HighlightSeams(std::vector<qvec4f> *image)
 {
-    std::vector<qvec4f> res(input);
-
-    for (int y=0; y<h; y++) {
-        for (int x=0; x<w; x++) {
-            const int i = (y * w) + x;
-            const qvec4f inSample = res.at(i);
-            
-            if (inSample[3] == 0) {
-                res.at(i) = qvec4f(255, 0, 0, 1);
-            }
+    for (qvec4f &sample : *image) {
+        if (sample[3] == 0) {
+            sample = qvec4f(255, 0, 0, 1);
         }
     }
-    
-    return res;
 }
 
-static std::vector<qvec4f>
-BoxBlurImage(const std::vector<qvec4f> &input, int w, int h, int radius)
+/*
+ * The box is separable, so this sums each row's window into rowsums and
+ * then sums those down each column, both with running sums: the cost per
+ * pixel doesn't depend on the radius.
+ *
+ * rowsums holds the opaque samples' colors with their count in alpha,
+ * rowsums_all every sample's color. Each window always holds
+ * (2 * radius + 1) samples, since coordinates outside the image are
+ * clamped to its edge.
+ */
+static void
+BoxBlurImage(const std::vector<qvec4f> &input, int w, int h, int radius, std::vector<qvec4f> *res,
+             std::vector<qvec4f> *rowsums, std::vector<qvec4f> *rowsums_all)
 {
-    std::vector<qvec4f> res(input.size());
+    res->resize(input.size());
+    rowsums->resize(input.size());
+    rowsums_all->resize(input.size());
+    
+    // 2017-09-16: this is a hack, but clamping the
+    // x/y instead of discarding the samples outside of the
+    // kernel looks better in some cases:
+    // https://github.com/ericwa/ericw-tools/issues/171
     
     for (int y=0; y<h; y++) {
+        const qvec4f *row = &input[y * w];
+        qvec4f total(0);
+        qvec4f totalIgnoringOcclusion(0);
+        
+        for (int x1 = -radius; x1 <= radius; x1++) {
+            const qvec4f &inSample = row[qclamp(x1, 0, w - 1)];
+            totalIgnoringOcclusion += inSample;
+            total += inSample * inSample[3];
+        }
+        
         for (int x=0; x<w; x++) {
+            (*rowsums)[y * w + x] = total;
+            (*rowsums_all)[y * w + x] = totalIgnoringOcclusion;
             
-            float totalWeight = 0.0f;
-            qvec3f totalColor(0);
-            
-            // These are only used if all the samples in the kernel have alpha = 0
-            float totalWeightIgnoringOcclusion = 0.0f;
-            qvec3f totalColorIgnoringOcclusion(0);
-            
-            for (int y0 = -radius; y0 <= radius; y0++) {
-                for (int x0 = -radius; x0 <= radius; x0++) {
-                    const int x1 = qclamp(x + x0, 0, w - 1);
-                    const int y1 = qclamp(y + y0, 0, h - 1);
-                    
-                    // check if the kernel goes outside of the source image
-                    
-                    // 2017-09-16: this is a hack, but clamping the
-                    // x/y instead of discarding the samples outside of the
-                    // kernel looks better in some cases:
-                    // https://github.com/ericwa/ericw-tools/issues/171
-#if 0
-                    if (x1 < 0 || x1 >= w)
-                        continue;
-                    if (y1 < 0 || y1 >= h)
-                        continue;
-#endif
-                    
-                    // read the input sample
-                    const float weight = 1.0f;
-                    const qvec4f inSample = input.at((y1 * w) + x1);
-                    
-                    totalColorIgnoringOcclusion += qvec3f(inSample) * weight;
-                    totalWeightIgnoringOcclusion += weight;
-                    
-                    // Occluded sample points don't contribute to the filter
-                    if (inSample[3] == 0.0f)
-                        continue;
-                    
-                    totalColor += qvec3f(inSample) * weight;
-                    totalWeight += weight;
-                }
-            }
-            
+            // slide the window one sample right
+            const qvec4f &leaving = row[qmax(x - radius, 0)];
+            const qvec4f &entering = row[qmin(x + radius + 1, w - 1)];
+            totalIgnoringOcclusion += entering - leaving;
+            total += entering * entering[3] - leaving * leaving[3];
+        }
+    }
+    
+    const float kernelsize = static_cast<float>((2 * radius + 1) * (2 * radius + 1));
+    
+    for (int x=0; x<w; x++) {
+        qvec4f total(0);
+        qvec4f totalIgnoringOcclusion(0);
+        
+        for (int y1 = -radius; y1 <= radius; y1++) {
+            const int i = qclamp(y1, 0, h - 1) * w + x;
+            total += (*rowsums)[i];
+            totalIgnoringOcclusion += (*rowsums_all)[i];
+        }
+        
+        for (int y=0; y<h; y++) {
             const int outIndex = (y * w) + x;
-            if (totalWeight > 0.0f) {
-                const qvec3f tmp = totalColor / totalWeight;
-                const qvec4f resultColor = qvec4f(tmp[0], tmp[1], tmp[2], 1.0f);
-                res[outIndex] = resultColor;
+            if (total[3] > 0.0f) {
+                const qvec3f tmp = qvec3f(total) / total[3];
+                (*res)[outIndex] = qvec4f(tmp[0], tmp[1], tmp[2], 1.0f);
             } else {
-                const qvec3f tmp = totalColorIgnoringOcclusion / totalWeightIgnoringOcclusion;
-                const qvec4f resultColor = qvec4f(tmp[0], tmp[1], tmp[2], 0.0f);
-                res[outIndex] = resultColor;
+                const qvec3f tmp = qvec3f(totalIgnoringOcclusion) / kernelsize;
+                (*res)[outIndex] = qvec4f(tmp[0], tmp[1], tmp[2], 0.0f);
             }
+            
+            // slide the window one row down
+            const int leaving = qmax(y - radius, 0) * w + x;
+            const int entering = qmin(y + radius + 1, h - 1) * w + x;
+            total += (*rowsums)[entering] - (*rowsums)[leaving];
+            totalIgnoringOcclusion += (*rowsums_all)[entering] - (*rowsums_all)[leaving];
         }
     }
-    
-    return res;
 }
 
 static void
@@ -3141,23 +4262,9 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
 
     const int size = (lightsurf->texsize[0] + 1) * (lightsurf->texsize[1] + 1);
 
+    // lightofs is filled in once every face is lit, see CommitLightmaps
     uint8_t *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
-
-    int lightofs;
-
-    // Q2/HL native colored lightmaps
-    if (bsp->loadversion->game->has_rgb_lightmap) {
-        lightofs = lit - lit_filebase;
-    } else {
-        lightofs = out - filebase;
-    }
-
-    if (facesup) {
-        facesup->lightofs = lightofs;
-    } else {
-        face->lightofs = lightofs;
-    }
+    GetFileSpace(bsp, face, facesup, &out, &lit, &lux, size * numstyles);
 
     // sanity check that we don't save a lightmap for a non-lightmapped face
     {
@@ -3191,34 +4298,52 @@ WriteSingleLightmap(const mbsp_t *bsp,
                     const int actual_width, const int actual_height,
                     uint8_t *out, uint8_t *lit, uint8_t *lux)
 {
+        const int oversample = lightsurf->oversample;
         const int oversampled_width = actual_width * oversample;
         const int oversampled_height = actual_height * oversample;
 
-        // allocate new float buffers for the output colors and directions
-        // these are the actual output width*height, without oversampling.
+        // float images for the output colors and directions, in the thread's
+        // reused buffers. output_* are the actual output width*height, without oversampling.
+        lightsurf_scratch_t &scratch = lightsurf_scratch;
         
-        std::vector<qvec4f> fullres = LightmapColorsToGLMVector(lightsurf, lm);
+        std::vector<qvec4f> *fullres = &scratch.image;
+        LightmapColorsToGLMVector(lightsurf, lm, fullres);
         
         if (debug_highlightseams) {
-            fullres = HighlightSeams(fullres, oversampled_width, oversampled_height);
+            HighlightSeams(fullres);
         }
         
         // removes all transparent pixels by averaging from adjacent pixels
-        fullres = FloodFillTransparent(fullres, oversampled_width, oversampled_height);
+        FloodFillTransparent(fullres, oversampled_width, oversampled_height);
         
-        if (softsamples > 0) {
-            fullres = BoxBlurImage(fullres, oversampled_width, oversampled_height, softsamples);
+        // faces -adaptiveextra left at base resolution have nothing to soften
+        if (softsamples > 0 && oversample == ::oversample) {
+            BoxBlurImage(*fullres, oversampled_width, oversampled_height, softsamples,
+                         &scratch.blurred, &scratch.rowsums, &scratch.rowsums_all);
+            fullres = &scratch.blurred;
         }
         
-        const std::vector<qvec4f> output_color = IntegerDownsampleImage(fullres, oversampled_width, oversampled_height, oversample);
-        const std::vector<qvec4f> output_dir = (lux ? IntegerDownsampleImage(LightmapNormalsToGLMVector(lightsurf, lm), oversampled_width, oversampled_height, oversample) : *new std::vector<qvec4f>); //mxd. Skip when lux isn't needed
+        const std::vector<qvec4f> *output_color = fullres;
+        const std::vector<qvec4f> *output_dir = nullptr;
+        if (oversample > 1) {
+            IntegerDownsampleImage(*fullres, oversampled_width, oversampled_height, oversample, &scratch.outcolors);
+            output_color = &scratch.outcolors;
+        }
+        if (lux && lm->directions) { //mxd. Skip when lux isn't needed
+            LightmapNormalsToGLMVector(lightsurf, lm, &scratch.dirs);
+            output_dir = &scratch.dirs;
+            if (oversample > 1) {
+                IntegerDownsampleImage(scratch.dirs, oversampled_width, oversampled_height, oversample, &scratch.outdirs);
+                output_dir = &scratch.outdirs;
+            }
+        }
         
         // copy from the float buffers to byte buffers in .bsp / .lit / .lux
         
         for (int t = 0; t < actual_height; t++) {
             for (int s = 0; s < actual_width; s++) {
                 const int sampleindex = (t * actual_width) + s;
-                qvec4f color = output_color.at(sampleindex);
+                const qvec4f &color = (*output_color)[sampleindex];
                 
                 *lit++ = color[0];
                 *lit++ = color[1];
@@ -3236,10 +4361,15 @@ WriteSingleLightmap(const mbsp_t *bsp,
                 if (light > 255) light = 255;
                 *out++ = light;
                 
-                if (lux) {
+                if (lux && !output_dir) {
+                    // no .lux is written, straight out of the surface like a sample no light reached
+                    *lux++ = 128;
+                    *lux++ = 128;
+                    *lux++ = 255;
+                } else if (lux) {
                     vec3_t temp;
                     int v;
-                    const qvec4f &direction = output_dir.at(sampleindex);
+                    const qvec4f &direction = (*output_dir)[sampleindex];
                     temp[0] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->snormal));
                     temp[1] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->tnormal));
                     temp[2] = qv::dot(qvec3f(direction), vec3_t_to_glm(lightsurf->plane.normal));
@@ -3257,77 +4387,323 @@ WriteSingleLightmap(const mbsp_t *bsp,
         }
 }
 
+/* hands the lightsurf's buffers back to the thread for the next face */
 static void LightFaceShutdown(lightsurf_t *lightsurf)
 {
-    for (auto &lm : lightsurf->lightmapsByStyle) {
-        free(lm.samples);
-    }
-    
-    free(lightsurf->points);
-    free(lightsurf->normals);
-    free(lightsurf->occlusion);
-    free(lightsurf->occluded);
-    free(lightsurf->realfacenums);
-    
-    delete lightsurf->occlusion_stream;
-    delete lightsurf->intersection_stream;
+    lightsurf_scratch_t &scratch = lightsurf_scratch;
+    Q_assert(lightsurf == &scratch.surf);
     
-    delete lightsurf;
+    scratch.samplesused = 0;
+    scratch.inuse = false;
 }
 
 /*
- * ============
- * LightFace
- * ============
+ * ================
+ * Face_SkipLighting
+ *
+ * Returns true for faces LightFace never writes a lightmap for.
+ * ================
  */
-void
-LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg)
+static bool
+Face_SkipLighting(const mbsp_t *bsp, const bsp2_dface_t *face)
 {
-    /* Find the correct model offset */
-    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
-    if (modelinfo == nullptr) {
-        return;
-    }    
-    
-    /* One extra lightmap is allocated to simplify handling overflow */
-    
-    if (!litonly) {
-        // if litonly is set we need to preserve the existing lightofs
-
-        /* some surfaces don't need lightmaps */
-        if (facesup)
-        {
-            facesup->lightofs = -1;
-            for (int i = 0; i < MAXLIGHTMAPS; i++)
-                facesup->styles[i] = 255;
-        }
-        else
-        {
-            face->lightofs = -1;
-            for (int i = 0; i < MAXLIGHTMAPS; i++)
-                face->styles[i] = 255;
-        }
-    }
-
     /* don't bother with degenerate faces */
     if (face->numedges < 3)
-        return;
+        return true;
 
     if (!Face_IsLightmapped(bsp, face))
-        return;
+        return true;
 
     const char *texname = Face_TextureName(bsp, face);
 
     /* don't save lightmaps for "trigger" texture */
     if (!Q_strcasecmp(texname, "trigger"))
-        return;
-    
+        return true;
+
     /* don't save lightmaps for "skip" texture */
     if (!Q_strcasecmp(texname, "skip"))
+        return true;
+
+    return false;
+}
+
+/*
+ * ================
+ * LightFace_EstimateCost
+ *
+ * Rough relative cost of lighting a face: its sample count times the
+ * number of lights that survive the same culling LightFace does. Only
+ * used for ordering work, so it skips everything that needs sample points.
+ * ================
+ */
+int64_t
+LightFace_EstimateCost(const mbsp_t *bsp, const bsp2_dface_t *face, const facesup_t *facesup, const globalconfig_t &cfg)
+{
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr || Face_SkipLighting(bsp, face))
+        return 0;
+
+    lightsurf_t lightsurf {};
+    lightsurf.cfg = &cfg;
+    /* the coarser scale never makes extents that LightFace wouldn't accept */
+    lightsurf.lightmapscale = modelinfo->lightmapscale;
+    if (facesup && facesup->lmscale > lightsurf.lightmapscale)
+        lightsurf.lightmapscale = facesup->lmscale;
+
+    CalcFaceExtents(face, bsp, &lightsurf);
+    VectorAdd(lightsurf.origin, modelinfo->offset, lightsurf.origin);
+    VectorAdd(lightsurf.mins, modelinfo->offset, lightsurf.mins);
+    VectorAdd(lightsurf.maxs, modelinfo->offset, lightsurf.maxs);
+
+    const int64_t numsamples = static_cast<int64_t>(lightsurf.texsize[0] + 1) * (lightsurf.texsize[1] + 1);
+
+    /* suns are never culled; the extra one stands in for dirt/minlight */
+    int64_t numlights = 1 + static_cast<int64_t>(GetSuns().size());
+    for (const auto &entity : GetLights()) {
+        if (!CullLight(&entity, &lightsurf))
+            numlights += entity.samples.intValue();
+    }
+    if (cfg.bounce.boolValue()) {
+        const std::vector<bouncelight_t> &vpls = BounceLights();
+        for (const int vplnum : BounceLightsTouchingBounds(lightsurf.mins, lightsurf.maxs)) {
+            if (!BounceLight_SphereCull(bsp, &vpls[vplnum], &lightsurf))
+                numlights++;
+        }
+    }
+
+    return numsamples * numlights;
+}
+
+/*
+ * ================
+ * LightFace_Extents
+ *
+ * The bounds LightFace culls lights against and the number of luxels it
+ * stores per style, at the model's lightmap scale. Returns false for
+ * faces that get no lightmap.
+ * ================
+ */
+bool
+LightFace_Extents(const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t mins, vec3_t maxs, int *numluxels)
+{
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr || Face_SkipLighting(bsp, face))
+        return false;
+
+    lightsurf_t lightsurf {};
+    lightsurf.lightmapscale = modelinfo->lightmapscale;
+
+    CalcFaceExtents(face, bsp, &lightsurf);
+    VectorAdd(lightsurf.mins, modelinfo->offset, mins);
+    VectorAdd(lightsurf.maxs, modelinfo->offset, maxs);
+
+    *numluxels = (lightsurf.texsize[0] + 1) * (lightsurf.texsize[1] + 1);
+    return true;
+}
+
+/*
+ * ================
+ * MakeLightingBatches
+ *
+ * Splits each model's faces into batches by walking its node tree, so
+ * a batch is a subtree (or one node's own faces) of at most
+ * MAX_BATCH_FACES faces. Every face of a model ends up in exactly one
+ * batch, including faces that get no lightmap, since LightFace still
+ * has to reset their lighting info.
+ * ================
+ */
+static constexpr int MAX_BATCH_FACES = 64;
+
+static int
+CountNodeFaces_r(const mbsp_t *bsp, int nodenum, std::vector<int> *counts)
+{
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+    int count = node->numfaces;
+
+    for (int side = 0; side < 2; side++) {
+        if (node->children[side] >= 0)
+            count += CountNodeFaces_r(bsp, node->children[side], counts);
+    }
+
+    (*counts)[nodenum] = count;
+    return count;
+}
+
+static void
+AddNodeFaces_r(const mbsp_t *bsp, int nodenum, std::vector<int> *facenums)
+{
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+
+    for (uint32_t i = 0; i < node->numfaces; i++)
+        facenums->push_back(node->firstface + i);
+
+    for (int side = 0; side < 2; side++) {
+        if (node->children[side] >= 0)
+            AddNodeFaces_r(bsp, node->children[side], facenums);
+    }
+}
+
+static void
+BatchNodeFaces_r(const mbsp_t *bsp, int nodenum, const std::vector<int> &counts,
+                 std::vector<std::vector<int>> *groups)
+{
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+
+    if (counts[nodenum] <= MAX_BATCH_FACES) {
+        groups->emplace_back();
+        AddNodeFaces_r(bsp, nodenum, &groups->back());
         return;
-    
-    /* all good, this face is going to be lightmapped. */
-    lightsurf_t *lightsurf = new lightsurf_t {};
+    }
+
+    /* too many below here; the node's own faces go together, then split the children */
+    for (uint32_t i = 0; i < node->numfaces; i++) {
+        if (i % MAX_BATCH_FACES == 0)
+            groups->emplace_back();
+        groups->back().push_back(node->firstface + i);
+    }
+
+    for (int side = 0; side < 2; side++) {
+        if (node->children[side] >= 0)
+            BatchNodeFaces_r(bsp, node->children[side], counts, groups);
+    }
+}
+
+std::vector<lightbatch_t>
+MakeLightingBatches(const mbsp_t *bsp, const facesup_t *faces_sup, const globalconfig_t &cfg)
+{
+    logprint("--- MakeLightingBatches ---\n");
+
+    std::vector<std::vector<int>> groups;
+    std::vector<bool> batched(bsp->numfaces, false);
+    std::vector<int> counts(bsp->numnodes, 0);
+
+    for (int i = 0; i < bsp->nummodels; i++) {
+        const dmodel_t *model = &bsp->dmodels[i];
+        const int headnode = model->headnode[0];
+        const size_t first = groups.size();
+
+        if (headnode >= 0 && headnode < bsp->numnodes) {
+            CountNodeFaces_r(bsp, headnode, &counts);
+            BatchNodeFaces_r(bsp, headnode, counts, &groups);
+        }
+
+        /* only keep faces belonging to this model, and only once */
+        for (size_t j = first; j < groups.size(); j++) {
+            auto &group = groups[j];
+            group.erase(std::remove_if(group.begin(), group.end(), [&](int facenum) {
+                if (facenum < model->firstface || facenum >= model->firstface + model->numfaces)
+                    return true;
+                if (batched[facenum])
+                    return true;
+                batched[facenum] = true;
+                return false;
+            }), group.end());
+        }
+
+        /* faces the tree doesn't reference are batched in index order */
+        for (int facenum = model->firstface; facenum < model->firstface + model->numfaces; facenum++) {
+            if (batched[facenum])
+                continue;
+            if (groups.size() == first || groups.back().size() >= MAX_BATCH_FACES)
+                groups.emplace_back();
+            groups.back().push_back(facenum);
+            batched[facenum] = true;
+        }
+    }
+
+    std::vector<lightbatch_t> batches;
+    size_t totallights = 0;
+
+    for (auto &group : groups) {
+        if (group.empty())
+            continue;
+
+        /*
+         * Bound the lightmapped faces of the batch. The radius is chosen so
+         * the batch sphere contains each face's bounding sphere, which makes
+         * culling a light for the batch imply CullLight would reject it for
+         * every face in it.
+         */
+        std::vector<lightsurf_t> surfs;
+        for (int facenum : group) {
+            const bsp2_dface_t *face = BSP_GetFace(bsp, facenum);
+            const modelinfo_t *modelinfo = ModelInfoForFace(bsp, facenum);
+            if (modelinfo == nullptr || Face_SkipLighting(bsp, face))
+                continue;
+
+            surfs.emplace_back();
+            lightsurf_t &surf = surfs.back();
+            /* only the world bounds are needed; see LightFace_EstimateCost */
+            surf.lightmapscale = modelinfo->lightmapscale;
+            if (faces_sup && faces_sup[facenum].lmscale > surf.lightmapscale)
+                surf.lightmapscale = faces_sup[facenum].lmscale;
+            CalcFaceExtents(face, bsp, &surf);
+            VectorAdd(surf.origin, modelinfo->offset, surf.origin);
+            VectorAdd(surf.mins, modelinfo->offset, surf.mins);
+            VectorAdd(surf.maxs, modelinfo->offset, surf.maxs);
+        }
+
+        batches.emplace_back();
+        lightbatch_t &batch = batches.back();
+        batch.facenums = std::move(group);
+
+        if (surfs.empty())
+            continue;
+
+        lightsurf_t batchsurf {};
+        batchsurf.cfg = &cfg;
+        ClearBounds(batchsurf.mins, batchsurf.maxs);
+        for (const auto &surf : surfs) {
+            AddPointToBounds(surf.mins, batchsurf.mins, batchsurf.maxs);
+            AddPointToBounds(surf.maxs, batchsurf.mins, batchsurf.maxs);
+        }
+        VectorAdd(batchsurf.mins, batchsurf.maxs, batchsurf.origin);
+        VectorScale(batchsurf.origin, 0.5, batchsurf.origin);
+        for (const auto &surf : surfs) {
+            vec3_t delta;
+            VectorSubtract(surf.origin, batchsurf.origin, delta);
+            batchsurf.radius = std::max(batchsurf.radius, static_cast<vec_t>(VectorLength(delta) + surf.radius));
+        }
+
+        for (const light_t *entity : LightsTouchingBounds(batchsurf.mins, batchsurf.maxs)) {
+            if (!CullLight(entity, &batchsurf))
+                batch.lights.push_back(entity);
+        }
+        totallights += batch.lights.size();
+    }
+
+    logprint("%d faces in %d batches, %.1f lights per batch\n", bsp->numfaces,
+             static_cast<int>(batches.size()),
+             batches.empty() ? 0.0 : static_cast<double>(totallights) / batches.size());
+
+    return batches;
+}
+
+/*
+ * Lights that may reach the face: the batch's light list if there is
+ * one, otherwise those whose estimated bounds touch the face's.
+ */
+static std::vector<const light_t *>
+FaceLights(const lightsurf_t *lightsurf, const lightbatch_t *batch)
+{
+    if (batch)
+        return batch->lights;
+    return LightsTouchingBounds(lightsurf->mins, lightsurf->maxs);
+}
+
+/*
+ * ============
+ * LightFace_Lightsurf
+ *
+ * Runs every lighting pass over an initialized lightsurf. Returns
+ * nullptr if the face has invalid texture axes.
+ * ============
+ */
+static lightsurf_t *
+LightFace_Lightsurf(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg,
+                    lightbatch_t *batch, const modelinfo_t *modelinfo, int surfoversample, bool trackvisibility)
+{
+    lightsurf_t *lightsurf = LightSurf_Acquire();
     lightsurf->cfg = &cfg;
     
     /* if liquid doesn't have the TEX_SPECIAL flag set, the map was qbsp'ed with
@@ -3338,10 +4714,13 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
         lightsurf->twosided = true;
     }
     
-    if (!Lightsurf_Init(modelinfo, face, bsp, lightsurf, facesup)) {
+    if (!Lightsurf_Init(modelinfo, face, bsp, lightsurf, facesup, batch, surfoversample)) {
         /* invalid texture axes */
-        return;
+        LightFaceShutdown(lightsurf);
+        return nullptr;
     }
+    if (trackvisibility)
+        lightsurf->visibility.assign(lightsurf->numpoints, 0);
     lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
 
     /* calculate dirt (ambient occlusion) but don't use it yet */
@@ -3359,22 +4738,26 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
         total_samplepoints += lightsurf->numpoints;
 
         const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+        const std::vector<const light_t *> facelights = FaceLights(lightsurf, batch);
 
         /* positive lights */
         if (!(modelinfo->lightignore.boolValue()
               || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
-            for (const auto &entity : GetLights())
+            std::vector<const light_t *> positive;
+            for (const light_t *entity : facelights)
             {
-                if (entity.getFormula() == LF_LOCALMIN)
+                if (entity->getFormula() == LF_LOCALMIN)
                     continue;
-                if (entity.nostaticlight.boolValue())
+                if (entity->nostaticlight.boolValue())
                     continue;
-                if (entity.light.floatValue() > 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
+                if (entity->light.floatValue() > 0)
+                    positive.push_back(entity);
             }
+            LightFace_Entities(positive, lightsurf, lightmaps);
             for ( const sun_t &sun : GetSuns() )
-                if (sun.sunlight > 0)
+                if (sun.sunlight > 0 && !SkySampling_Covers(&sun))
                     LightFace_Sky (&sun, lightsurf, lightmaps);
+            LightFace_SkySampled(lightsurf, lightmaps);
 
             //mxd. Add surface lights...
             LightFace_SurfaceLight(lightsurf, lightmaps);
@@ -3402,15 +4785,17 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
         /* negative lights */
         if (!(modelinfo->lightignore.boolValue()
               || (extended_flags.extended & TEX_EXFLAG_LIGHTIGNORE) != 0)) {
-            for (const auto &entity : GetLights())
+            std::vector<const light_t *> negative;
+            for (const light_t *entity : facelights)
             {
-                if (entity.getFormula() == LF_LOCALMIN)
+                if (entity->getFormula() == LF_LOCALMIN)
                     continue;
-                if (entity.nostaticlight.boolValue())
+                if (entity->nostaticlight.boolValue())
                     continue;
-                if (entity.light.floatValue() < 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
+                if (entity->light.floatValue() < 0)
+                    negative.push_back(entity);
             }
+            LightFace_Entities(negative, lightsurf, lightmaps);
             for (const sun_t &sun : GetSuns())
                 if (sun.sunlight < 0)
                     LightFace_Sky (&sun, lightsurf, lightmaps);
@@ -3441,7 +4826,117 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     /* Apply gamma, rangescale, and clamp */
     LightFace_ScaleAndClamp(lightsurf, lightmaps);
     
-    WriteLightmaps(bsp, face, facesup, lightsurf, lightmaps);
-    
+    return lightsurf;
+}
+
+/*
+ * ============
+ * LightFace_Release
+ * ============
+ */
+static void
+LightFace_Release(lightsurf_t *lightsurf, const lightbatch_t *batch)
+{
+    /* the streams belong to the batch or the thread */
+    lightsurf->occlusion_stream = nullptr;
+    lightsurf->intersection_stream = nullptr;
     LightFaceShutdown(lightsurf);
 }
+
+/*
+ * ============
+ * LightFace_VisibilityVaries
+ *
+ * True if two neighbouring samples of -adaptiveextra's first pass were
+ * reached by different sets of lights, i.e. a shadow edge crosses the face.
+ * ============
+ */
+static bool
+LightFace_VisibilityVaries(const lightsurf_t *lightsurf)
+{
+    const int width = lightsurf->width;
+    const int height = lightsurf->height;
+    
+    for (int t = 0; t < height; t++) {
+        for (int s = 0; s < width; s++) {
+            const int i = t * width + s;
+            if (lightsurf->occluded[i])
+                continue;
+            
+            if (s + 1 < width && !lightsurf->occluded[i + 1]
+                && lightsurf->visibility[i] != lightsurf->visibility[i + 1])
+                return true;
+            if (t + 1 < height && !lightsurf->occluded[i + width]
+                && lightsurf->visibility[i] != lightsurf->visibility[i + width])
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * ============
+ * LightFace
+ * ============
+ */
+void
+LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg, lightbatch_t *batch)
+{
+    /* Find the correct model offset */
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+    if (modelinfo == nullptr) {
+        return;
+    }    
+    
+    /* One extra lightmap is allocated to simplify handling overflow */
+    
+    if (!litonly) {
+        // if litonly is set we need to preserve the existing lightofs
+
+        /* some surfaces don't need lightmaps */
+        if (facesup)
+        {
+            facesup->lightofs = -1;
+            for (int i = 0; i < MAXLIGHTMAPS; i++)
+                facesup->styles[i] = 255;
+        }
+        else
+        {
+            face->lightofs = -1;
+            for (int i = 0; i < MAXLIGHTMAPS; i++)
+                face->styles[i] = 255;
+        }
+    }
+
+    if (Face_SkipLighting(bsp, face))
+        return;
+    
+    /* all good, this face is going to be lightmapped. */
+    lightsurf_t *lightsurf = nullptr;
+    
+    /*
+     * -adaptiveextra: light at one sample per texel first, and only pay for
+     * -extra/-extra4 if a shadow edge crosses the face.
+     */
+    if (adaptiveextra && oversample > 1 && !previewpass && debugmode == debugmode_none) {
+        lightsurf = LightFace_Lightsurf(bsp, face, facesup, cfg, batch, modelinfo, 1, true);
+        if (!lightsurf)
+            return;
+        if (LightFace_VisibilityVaries(lightsurf)) {
+            LightFace_Release(lightsurf, batch);
+            lightsurf = nullptr;
+        }
+    }
+    
+    if (!lightsurf) {
+        // -progressive's preview is single sample
+        lightsurf = LightFace_Lightsurf(bsp, face, facesup, cfg, batch, modelinfo, previewpass ? 1 : oversample, false);
+        if (!lightsurf)
+            return;
+    }
+    
+    WriteLightmaps(bsp, face, facesup, lightsurf, &lightsurf->lightmapsByStyle);
+    
+    LightFace_Release(lightsurf, batch);
+}
+
@@ -28,6 +28,7 @@
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
 #include <common/mesh.hh>
+#include <common/threads.hh>
 
 #include <memory>
 #include <vector>
@@ -35,6 +36,7 @@
 #include <unordered_map>
 #include <set>
 #include <algorithm>
+#include <functional>
 #include <mutex>
 #include <string>
 
@@ -171,29 +173,71 @@ AngleBetweenPoints(const qvec3f &p1, const qvec3f &p2, const qvec3f &p3)
     return result;
 }
 
+/*
+ * Flat (CSR) adjacency: the values of key k are values[offsets[k]] up to
+ * values[offsets[k + 1]], in the order they were added.
+ */
+template <typename T>
+class adjacency_t {
+public:
+    std::vector<int> offsets; // one per key, plus one
+    std::vector<T> values;
+    
+    const T *begin(int key) const { return values.data() + offsets.at(key); }
+    const T *end(int key) const { return values.data() + offsets.at(key + 1); }
+};
+
+/*
+ * Fills adj with a counting sort. forEach(emit) is run twice and must
+ * make the same emit(key, value) calls both times.
+ */
+template <typename T, typename F>
+static void
+BuildAdjacency(adjacency_t<T> *adj, int numkeys, F forEach)
+{
+    adj->offsets.assign(numkeys + 1, 0);
+    forEach([adj](int key, const T &) { adj->offsets[key + 1]++; });
+    for (int k = 0; k < numkeys; k++)
+        adj->offsets[k + 1] += adj->offsets[k];
+    
+    adj->values.resize(adj->offsets[numkeys]);
+    std::vector<int> cursor(adj->offsets.begin(), adj->offsets.end() - 1);
+    forEach([adj, &cursor](int key, const T &value) { adj->values[cursor[key]++] = value; });
+}
+
+/* one use of the directed edge (key vertex) -> v1 */
+struct edgeuse_t {
+    int v1;
+    const bsp2_dface_t *face;
+};
+
 static bool s_builtPhongCaches;
-static std::map<const bsp2_dface_t *, std::vector<qvec3f>> vertex_normals;
-static std::set<int> interior_verts;
-static map<const bsp2_dface_t *, set<const bsp2_dface_t *>> smoothFaces;
-static map<int, vector<const bsp2_dface_t *>> vertsToFaces;
-static map<int, vector<const bsp2_dface_t *>> planesToFaces;
-static edgeToFaceMap_t EdgeToFaceMap;
+static const mbsp_t *smoothFaces_bsp; // the bsp the caches were built for
+static adjacency_t<qvec3f> vertex_normals; // by face number
+static std::vector<uint8_t> interior_verts; // by vertex number
+static adjacency_t<const bsp2_dface_t *> smoothFaces; // by face number, sorted
+static adjacency_t<const bsp2_dface_t *> vertsToFaces;
+static adjacency_t<const bsp2_dface_t *> planesToFaces;
+static adjacency_t<edgeuse_t> EdgeToFaces; // by first vertex
 static vector<face_cache_t> FaceCache;
 
 vector<const bsp2_dface_t *> FacesUsingVert(int vertnum)
 {
-    const auto &vertsToFaces_const = vertsToFaces;
-    
-    auto it = vertsToFaces_const.find(vertnum);
-    if (it != vertsToFaces_const.end())
-        return it->second;
-    return {};
+    if (vertnum < 0 || vertnum + 1 >= static_cast<int>(vertsToFaces.offsets.size()))
+        return {};
+    return { vertsToFaces.begin(vertnum), vertsToFaces.end(vertnum) };
 }
 
-const edgeToFaceMap_t &GetEdgeToFaceMap()
+vector<const bsp2_dface_t *> FacesUsingEdge(int v0, int v1)
 {
     Q_assert(s_builtPhongCaches);
-    return EdgeToFaceMap;
+    
+    vector<const bsp2_dface_t *> result;
+    for (const edgeuse_t *use = EdgeToFaces.begin(v0); use != EdgeToFaces.end(v0); use++) {
+        if (use->v1 == v1)
+            result.push_back(use->face);
+    }
+    return result;
 }
 
 // Uses `smoothFaces` static var
@@ -201,41 +245,23 @@ bool FacesSmoothed(const bsp2_dface_t *f1, const bsp2_dface_t *f2)
 {
     Q_assert(s_builtPhongCaches);
     
-    const auto &facesIt = smoothFaces.find(f1);
-    if (facesIt == smoothFaces.end())
-        return false;
-    
-    const set<const bsp2_dface_t *> &faceSet = facesIt->second;
-    if (faceSet.find(f2) == faceSet.end())
-        return false;
-    
-    return true;
+    const int f1num = static_cast<int>(f1 - smoothFaces_bsp->dfaces);
+    return std::binary_search(smoothFaces.begin(f1num), smoothFaces.end(f1num), f2);
 }
 
-const std::set<const bsp2_dface_t *> &GetSmoothFaces(const bsp2_dface_t *face)
+face_span_t GetSmoothFaces(const bsp2_dface_t *face)
 {
     Q_assert(s_builtPhongCaches);
     
-    static std::set<const bsp2_dface_t *> empty;
-    const auto it = smoothFaces.find(face);
-    
-    if (it == smoothFaces.end())
-        return empty;
-    
-    return it->second;
+    const int fnum = static_cast<int>(face - smoothFaces_bsp->dfaces);
+    return { smoothFaces.begin(fnum), smoothFaces.end(fnum) };
 }
 
-const std::vector<const bsp2_dface_t *> &GetPlaneFaces(const bsp2_dface_t *face)
+face_span_t GetPlaneFaces(const bsp2_dface_t *face)
 {
     Q_assert(s_builtPhongCaches);
     
-    static std::vector<const bsp2_dface_t *> empty;
-    const auto it = planesToFaces.find(face->planenum);
-    
-    if (it == planesToFaces.end())
-        return empty;
-    
-    return it->second;
+    return { planesToFaces.begin(face->planenum), planesToFaces.end(face->planenum) };
 }
 
 
@@ -273,21 +299,23 @@ const qvec3f GetSurfaceVertexNormal(const mbsp_t *bsp, const bsp2_dface_t *f, co
     Q_assert(s_builtPhongCaches);
     
     // handle degenerate faces
-    const auto it = vertex_normals.find(f);
-    if (it == vertex_normals.end()) {
+    const int fnum = Face_GetNum(bsp, f);
+    const qvec3f *first = vertex_normals.begin(fnum);
+    const qvec3f *last = vertex_normals.end(fnum);
+    if (first == last) {
         return qvec3f(0,0,0);
     }
-    const auto &face_normals_vec = it->second;
-    return face_normals_vec.at(vertindex);
+    Q_assert(vertindex >= 0 && vertindex < last - first);
+    return first[vertindex];
 }
 
 static bool
-FacesOnSamePlane(const std::vector<const bsp2_dface_t *> &faces)
+FacesOnSamePlane(const face_span_t &faces)
 {
     if (faces.empty()) {
         return false;
     }
-    const int32_t planenum = faces.at(0)->planenum;
+    const int32_t planenum = (*faces.begin())->planenum;
     for (auto face : faces) {
         if (face->planenum != planenum) {
             return false;
@@ -304,81 +332,59 @@ Face_EdgeIndexSmoothed(const mbsp_t *bsp, const bsp2_dface_t *f, const int edgei
     const int v0 = Face_VertexAtIndex(bsp, f, edgeindex);
     const int v1 = Face_VertexAtIndex(bsp, f, (edgeindex + 1) % f->numedges);
 
-    auto it = EdgeToFaceMap.find(make_pair(v1, v0));
-    if (it != EdgeToFaceMap.end()) {
-        for (const bsp2_dface_t *neighbour : it->second) {
-            if (neighbour == f) {
-                // Invalid face, e.g. with vertex numbers: [0, 1, 0, 2]
-                continue;
-            }
-
-            const bool sameplane = (neighbour->planenum == f->planenum
-                                    && neighbour->side == f->side);
+    for (const edgeuse_t *use = EdgeToFaces.begin(v1); use != EdgeToFaces.end(v1); use++) {
+        if (use->v1 != v0)
+            continue;
+        
+        const bsp2_dface_t *neighbour = use->face;
+        if (neighbour == f) {
+            // Invalid face, e.g. with vertex numbers: [0, 1, 0, 2]
+            continue;
+        }
 
-            // Check if these faces are smoothed or on the same plane
-            if (!(FacesSmoothed(f, neighbour) || sameplane)) {
-                continue;
-            }
+        const bool sameplane = (neighbour->planenum == f->planenum
+                                && neighbour->side == f->side);
 
-            return neighbour;
-        }
-    }
-    return nullptr;
-    
-#if 0
-    if (smoothFaces.find(f) == smoothFaces.end()) {
-        return nullptr;
-    }
-    
-    int v0 = Face_VertexAtIndex(bsp, f, edgeindex);
-    int v1 = Face_VertexAtIndex(bsp, f, (edgeindex + 1) % f->numedges);
-    
-    const auto &v0_faces = vertsToFaces.at(v0);
-    const auto &v1_faces = vertsToFaces.at(v1);
-    
-    // find a face f2 that has both verts v0 and v1
-    for (auto f2 : v0_faces) {
-        if (f2 == f)
+        // Check if these faces are smoothed or on the same plane
+        if (!(FacesSmoothed(f, neighbour) || sameplane)) {
             continue;
-        if (find(v1_faces.begin(), v1_faces.end(), f2) != v1_faces.end()) {
-            const auto &f_smoothfaces = smoothFaces.at(f);
-            bool smoothed = (f_smoothfaces.find(f2) != f_smoothfaces.end());
-            return smoothed ? f2 : nullptr;
         }
+
+        return neighbour;
     }
     return nullptr;
-#endif
 }
 
-static edgeToFaceMap_t MakeEdgeToFaceMap(const mbsp_t *bsp)
+/* every directed edge of every face, keyed by its first vertex, in face order */
+static void MakeEdgeToFaces(const mbsp_t *bsp)
 {
-    edgeToFaceMap_t result;
-    
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        
-        // walk edges
-        for (int j = 0; j < f->numedges; j++) {
-            const int v0 = Face_VertexAtIndex(bsp, f, j);
-            const int v1 = Face_VertexAtIndex(bsp, f, (j + 1) % f->numedges);
-            
-            if (v0 == v1) {
-                // ad_swampy.bsp has faces with repeated verts...
-                continue;
-            }
+    BuildAdjacency(&EdgeToFaces, bsp->numvertexes, [bsp](const std::function<void(int, const edgeuse_t &)> &emit) {
+        for (int i = 0; i < bsp->numfaces; i++) {
+            const bsp2_dface_t *f = BSP_GetFace(bsp, i);
             
-            const auto edge = make_pair(v0, v1);
-            auto &edgeFacesRef = result[edge];
-            
-            if (find(begin(edgeFacesRef), end(edgeFacesRef), f) != end(edgeFacesRef)) {
+            // walk edges
+            for (int j = 0; j < f->numedges; j++) {
+                const int v0 = Face_VertexAtIndex(bsp, f, j);
+                const int v1 = Face_VertexAtIndex(bsp, f, (j + 1) % f->numedges);
+                
+                if (v0 == v1) {
+                    // ad_swampy.bsp has faces with repeated verts...
+                    continue;
+                }
+                
                 // another sort of degenerate face where the same edge A->B appears more than once on the face
-                continue;
+                bool repeated = false;
+                for (int k = 0; k < j && !repeated; k++) {
+                    repeated = (Face_VertexAtIndex(bsp, f, k) == v0
+                                && Face_VertexAtIndex(bsp, f, (k + 1) % f->numedges) == v1);
+                }
+                if (repeated)
+                    continue;
+                
+                emit(v0, edgeuse_t { v1, f });
             }
-            edgeFacesRef.push_back(f);
         }
-    }
-    
-    return result;
+    });
 }
 
 static vector<qvec3f> Face_VertexNormals(const mbsp_t *bsp, const bsp2_dface_t *face)
@@ -393,11 +399,11 @@ static vector<qvec3f> Face_VertexNormals(const mbsp_t *bsp, const bsp2_dface_t *
 
 static vector<face_cache_t> MakeFaceCache(const mbsp_t *bsp)
 {
-    vector<face_cache_t> result;
-    for (int i=0; i<bsp->numfaces; i++) {
+    vector<face_cache_t> result(bsp->numfaces);
+    RunThreadsOn(0, bsp->numfaces, 0, [bsp, &result](int i, int thread) {
         const bsp2_dface_t *face = BSP_GetFace(bsp, i);
-        result.push_back(face_cache_t{bsp, face, Face_VertexNormals(bsp, face)});
-    }
+        result[i] = face_cache_t{bsp, face, Face_VertexNormals(bsp, face)};
+    });
     return result;
 }
 
@@ -416,79 +422,30 @@ static int Q2_FacePhongValue(const mbsp_t *bsp, const bsp2_dface_t *face) {
     return 0;
 }
 
-void
-CalculateVertexNormals(const mbsp_t *bsp)
+/* returns the faces sharing a vertex with f that f should smooth with, sorted */
+static vector<const bsp2_dface_t *>
+Face_FindSmoothFaces(const mbsp_t *bsp, const bsp2_dface_t *f)
 {
-    logprint("--- %s ---\n", __func__);
-
-    Q_assert(!s_builtPhongCaches);
-    s_builtPhongCaches = true;
+    vector<const bsp2_dface_t *> result;
     
-    EdgeToFaceMap = MakeEdgeToFaceMap(bsp);
+    const auto f_points = GLM_FacePoints(bsp, f);
+    const qvec3f f_norm = Face_Normal_E(bsp, f);
+    const qplane3f f_plane = Face_Plane_E(bsp, f);
     
-    // read _phong and _phong_angle from entities for compatiblity with other qbsp's, at the expense of no
-    // support on func_detail/func_group
-    for (int i=0; i<bsp->nummodels; i++) {
-        const modelinfo_t *info = ModelInfoForModel(bsp, i);
-        const uint8_t phongangle_byte = (uint8_t) qmax(0, qmin(255, (int)rint(info->getResolvedPhongAngle())));
-
-        if (!phongangle_byte)
-            continue;
-        
-        for (int j=info->model->firstface; j < info->model->firstface + info->model->numfaces; j++) {
-            const bsp2_dface_t *f = BSP_GetFace(bsp, j);
-            
-            extended_texinfo_flags[f->texinfo].phong_angle = phongangle_byte;
-        }
-    }
-    
-    // build "plane -> faces" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        planesToFaces[f->planenum].push_back(f);
+    // any face normal within this many degrees can be smoothed with this face
+    const int f_phong_angle = extended_texinfo_flags[f->texinfo].phong_angle;
+    int f_phong_angle_concave = extended_texinfo_flags[f->texinfo].phong_angle_concave;
+    if (f_phong_angle_concave == 0) {
+        f_phong_angle_concave = f_phong_angle;
     }
+    const bool f_wants_phong = (f_phong_angle || f_phong_angle_concave);
     
-    // build "vert index -> faces" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        for (int j = 0; j < f->numedges; j++) {
-            const int v = Face_VertexAtIndex(bsp, f, j);
-            vertsToFaces[v].push_back(f);
-        }
-    }
-    
-    // track "interior" verts, these are in the middle of a face, and mess up normal interpolation
-    for (int i=0; i<bsp->numvertexes; i++) {
-        auto &faces = vertsToFaces[i];
-        if (faces.size() > 1 && FacesOnSamePlane(faces)) {
-            interior_verts.insert(i);
-        }
-    }
-    //printf("CalculateVertexNormals: %d interior verts\n", (int)interior_verts.size());
-    
-    // build the "face -> faces to smooth with" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(const_cast<mbsp_t *>(bsp), i);
-        
-        const auto f_points = GLM_FacePoints(bsp, f);
-        const qvec3f f_norm = Face_Normal_E(bsp, f);
-        const qplane3f f_plane = Face_Plane_E(bsp, f);
-        
-        // any face normal within this many degrees can be smoothed with this face
-        const int f_phong_angle = extended_texinfo_flags[f->texinfo].phong_angle;
-        int f_phong_angle_concave = extended_texinfo_flags[f->texinfo].phong_angle_concave;
-        if (f_phong_angle_concave == 0) {
-            f_phong_angle_concave = f_phong_angle;
-        }
-        const bool f_wants_phong = (f_phong_angle || f_phong_angle_concave);
-        
-        if (!f_wants_phong)
-            continue;
-        
+    if (f_wants_phong) {
         for (int j = 0; j < f->numedges; j++) {
             const int v = Face_VertexAtIndex(bsp, f, j);
             // walk over all faces incident to f (we will walk over neighbours multiple times, doesn't matter)
-            for (const bsp2_dface_t *f2 : vertsToFaces[v]) {
+            for (const bsp2_dface_t *const *it = vertsToFaces.begin(v); it != vertsToFaces.end(v); it++) {
+                const bsp2_dface_t *f2 = *it;
                 if (f2 == f)
                     continue;
                 
@@ -517,23 +474,19 @@ CalculateVertexNormals(const mbsp_t *bsp)
 
                 // check the angle between the face normals
                 if (cosangle >= cosmaxangle) {
-                    smoothFaces[f].insert(f2);
+                    result.push_back(f2);
                 }
             }
         }
     }
     
-    // Q2: build the "face -> faces to smooth with" map
-    for (int i = 0; i < bsp->numfaces; i++) {
-        const bsp2_dface_t *f = BSP_GetFace(const_cast<mbsp_t *>(bsp), i);
-        const int f_phongValue = Q2_FacePhongValue(bsp, f);
-        if (f_phongValue == 0)
-            continue;
-
+    // Q2: smooth with faces that have the same phong value
+    const int f_phongValue = Q2_FacePhongValue(bsp, f);
+    if (f_phongValue != 0) {
         for (int j = 0; j < f->numedges; j++) {
             const int v = Face_VertexAtIndex(bsp, f, j);
-            // walk over all faces incident to f (we will walk over neighbours multiple times, doesn't matter)
-            for (const bsp2_dface_t *f2 : vertsToFaces[v]) {
+            for (const bsp2_dface_t *const *it = vertsToFaces.begin(v); it != vertsToFaces.end(v); it++) {
+                const bsp2_dface_t *f2 = *it;
                 if (f2 == f)
                     continue;
 
@@ -542,92 +495,176 @@ CalculateVertexNormals(const mbsp_t *bsp)
                     continue;
 
                 // we've already checked f_phongValue is nonzero, so smooth these two faces.
-                smoothFaces[f].insert(f2);
+                result.push_back(f2);
             }
         }
     }
+    
+    // faces are in one array, so pointer order is face number order
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
 
-    // finally do the smoothing for each face
-    for (int i = 0; i < bsp->numfaces; i++)
-    {
-        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
-        if (f->numedges < 3) {
-            logprint("%s: face %d is degenerate with %d edges\n", __func__, i, f->numedges);
-            for (int j = 0; j<f->numedges; j++) {
-                vec3_t pt;
-                Face_PointAtIndex(bsp, f, j, pt);
-                logprint("                         vert at %f %f %f\n", pt[0], pt[1], pt[2]);
-            }
-            continue;
-        }
-        
-        const auto &neighboursToSmooth = smoothFaces[f];
-        const qvec3f f_norm = Face_Normal_E(bsp, f); // get the face normal
+/* writes the smoothed normal of each of f's vertices to out */
+static void
+Face_SmoothVertexNormals(const mbsp_t *bsp, const bsp2_dface_t *f, qvec3f *out)
+{
+    const face_span_t neighboursToSmooth = GetSmoothFaces(f);
+    const qvec3f f_norm = Face_Normal_E(bsp, f); // get the face normal
+    
+    // gather up f and neighboursToSmooth
+    std::vector<const bsp2_dface_t *> fPlusNeighbours;
+    fPlusNeighbours.push_back(f);
+    for (auto neighbour : neighboursToSmooth) {
+        fPlusNeighbours.push_back(neighbour);
+    }
+    
+    // global vertex index -> smoothed normal
+    std::map<int, qvec3f> smoothedNormals;
+
+    // walk fPlusNeighbours
+    for (auto f2 : fPlusNeighbours) {
+        const qvec3f f2_norm = Face_Normal_E(bsp, f2);
         
-        // gather up f and neighboursToSmooth
-        std::vector<const bsp2_dface_t *> fPlusNeighbours;
-        fPlusNeighbours.push_back(f);
-        for (auto neighbour : neighboursToSmooth) {
-            fPlusNeighbours.push_back(neighbour);
+        /* now just walk around the surface as a triangle fan */
+        int v1, v2, v3;
+        v1 = Face_VertexAtIndex(bsp, f2, 0);
+        v2 = Face_VertexAtIndex(bsp, f2, 1);
+        for (int j = 2; j < f2->numedges; j++)
+        {
+            v3 = Face_VertexAtIndex(bsp, f2, j);
+            AddTriangleNormals(smoothedNormals, f2_norm, bsp, v1, v2, v3);
+            v2 = v3;
+        }
+    }
+    
+    // normalize vertex normals (NOTE: updates smoothedNormals map)
+    for (auto &pair : smoothedNormals) {
+        const qvec3f vertNormal = pair.second;
+        if (0 == qv::length(vertNormal)) {
+            // this happens when there are colinear vertices, which give zero-area triangles,
+            // so there is no contribution to the normal of the triangle in the middle of the
+            // line. Not really an error, just set it to use the face normal.
+            pair.second = f_norm;
+        }
+        else
+        {
+            pair.second = qv::normalize(vertNormal);
+        }
+    }
+    
+    // sanity check
+    if (neighboursToSmooth.empty()) {
+        for (auto vertIndexNormalPair : smoothedNormals) {
+            Q_assert(GLMVectorCompare(vertIndexNormalPair.second, f_norm, EQUAL_EPSILON));
         }
+    }
+    
+    // now, record all of the smoothed normals that are actually part of `f`
+    for (int j=0; j<f->numedges; j++) {
+        int v = Face_VertexAtIndex(bsp, f, j);
+        Q_assert(smoothedNormals.find(v) != smoothedNormals.end());
         
-        // global vertex index -> smoothed normal
-        std::map<int, qvec3f> smoothedNormals;
+        out[j] = smoothedNormals[v];
+    }
+}
+
+/*
+ * The adjacency is built into flat arrays with counting sorts (in face
+ * order, as the maps these replace kept it), and the per-face smoothing
+ * and face caches are computed in parallel.
+ */
+void
+CalculateVertexNormals(const mbsp_t *bsp)
+{
+    logprint("--- %s ---\n", __func__);
+
+    Q_assert(!s_builtPhongCaches);
+    s_builtPhongCaches = true;
+    smoothFaces_bsp = bsp;
+    
+    MakeEdgeToFaces(bsp);
+    
+    // read _phong and _phong_angle from entities for compatiblity with other qbsp's, at the expense of no
+    // support on func_detail/func_group
+    for (int i=0; i<bsp->nummodels; i++) {
+        const modelinfo_t *info = ModelInfoForModel(bsp, i);
+        const uint8_t phongangle_byte = (uint8_t) qmax(0, qmin(255, (int)rint(info->getResolvedPhongAngle())));
 
-        // walk fPlusNeighbours
-        for (auto f2 : fPlusNeighbours) {
-            const qvec3f f2_norm = Face_Normal_E(bsp, f2);
+        if (!phongangle_byte)
+            continue;
+        
+        for (int j=info->model->firstface; j < info->model->firstface + info->model->numfaces; j++) {
+            const bsp2_dface_t *f = BSP_GetFace(bsp, j);
             
-            /* now just walk around the surface as a triangle fan */
-            int v1, v2, v3;
-            v1 = Face_VertexAtIndex(bsp, f2, 0);
-            v2 = Face_VertexAtIndex(bsp, f2, 1);
-            for (int j = 2; j < f2->numedges; j++)
-            {
-                v3 = Face_VertexAtIndex(bsp, f2, j);
-                AddTriangleNormals(smoothedNormals, f2_norm, bsp, v1, v2, v3);
-                v2 = v3;
-            }
+            extended_texinfo_flags[f->texinfo].phong_angle = phongangle_byte;
         }
-        
-        // normalize vertex normals (NOTE: updates smoothedNormals map)
-        for (auto &pair : smoothedNormals) {
-            const int vertIndex = pair.first;
-            const qvec3f vertNormal = pair.second;
-            if (0 == qv::length(vertNormal)) {
-                // this happens when there are colinear vertices, which give zero-area triangles,
-                // so there is no contribution to the normal of the triangle in the middle of the
-                // line. Not really an error, just set it to use the face normal.
-#if 0
-                logprint("Failed to calculate normal for vertex %d at (%f %f %f)\n",
-                         vertIndex,
-                         bsp->dvertexes[vertIndex].point[0],
-                         bsp->dvertexes[vertIndex].point[1],
-                         bsp->dvertexes[vertIndex].point[2]);
-#endif
-                pair.second = f_norm;
-            }
-            else
-            {
-                pair.second = qv::normalize(vertNormal);
+    }
+    
+    // build "plane -> faces" map
+    BuildAdjacency(&planesToFaces, bsp->numplanes, [bsp](const std::function<void(int, const bsp2_dface_t *const &)> &emit) {
+        for (int i = 0; i < bsp->numfaces; i++) {
+            const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+            emit(f->planenum, f);
+        }
+    });
+    
+    // build "vert index -> faces" map
+    BuildAdjacency(&vertsToFaces, bsp->numvertexes, [bsp](const std::function<void(int, const bsp2_dface_t *const &)> &emit) {
+        for (int i = 0; i < bsp->numfaces; i++) {
+            const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+            for (int j = 0; j < f->numedges; j++) {
+                emit(Face_VertexAtIndex(bsp, f, j), f);
             }
         }
-        
-        // sanity check
-        if (!neighboursToSmooth.size()) {
-            for (auto vertIndexNormalPair : smoothedNormals) {
-                Q_assert(GLMVectorCompare(vertIndexNormalPair.second, f_norm, EQUAL_EPSILON));
+    });
+    
+    // track "interior" verts, these are in the middle of a face, and mess up normal interpolation
+    interior_verts.assign(bsp->numvertexes, 0);
+    for (int i=0; i<bsp->numvertexes; i++) {
+        const face_span_t faces { vertsToFaces.begin(i), vertsToFaces.end(i) };
+        if (faces.size() > 1 && FacesOnSamePlane(faces)) {
+            interior_verts[i] = 1;
+        }
+    }
+    
+    // build the "face -> faces to smooth with" map
+    vector<vector<const bsp2_dface_t *>> faceSmoothFaces(bsp->numfaces);
+    RunThreadsOn(0, bsp->numfaces, 0, [bsp, &faceSmoothFaces](int i, int thread) {
+        faceSmoothFaces[i] = Face_FindSmoothFaces(bsp, BSP_GetFace(bsp, i));
+    });
+    BuildAdjacency(&smoothFaces, bsp->numfaces, [&faceSmoothFaces](const std::function<void(int, const bsp2_dface_t *const &)> &emit) {
+        for (size_t i = 0; i < faceSmoothFaces.size(); i++) {
+            for (const bsp2_dface_t *f2 : faceSmoothFaces[i]) {
+                emit(static_cast<int>(i), f2);
             }
         }
-        
-        // now, record all of the smoothed normals that are actually part of `f`
-        for (int j=0; j<f->numedges; j++) {
-            int v = Face_VertexAtIndex(bsp, f, j);
-            Q_assert(smoothedNormals.find(v) != smoothedNormals.end());
-            
-            vertex_normals[f].push_back(smoothedNormals[v]);
+    });
+    faceSmoothFaces.clear();
+
+    // finally do the smoothing for each face; degenerate ones get no normals
+    vertex_normals.offsets.assign(bsp->numfaces + 1, 0);
+    for (int i = 0; i < bsp->numfaces; i++)
+    {
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        if (f->numedges < 3) {
+            logprint("%s: face %d is degenerate with %d edges\n", __func__, i, f->numedges);
+            for (int j = 0; j<f->numedges; j++) {
+                vec3_t pt;
+                Face_PointAtIndex(bsp, f, j, pt);
+                logprint("                         vert at %f %f %f\n", pt[0], pt[1], pt[2]);
+            }
         }
+        vertex_normals.offsets[i + 1] = vertex_normals.offsets[i] + (f->numedges < 3 ? 0 : f->numedges);
     }
+    vertex_normals.values.resize(vertex_normals.offsets[bsp->numfaces]);
+    RunThreadsOn(0, bsp->numfaces, 0, [bsp](int i, int thread) {
+        const bsp2_dface_t *f = BSP_GetFace(bsp, i);
+        if (f->numedges >= 3) {
+            Face_SmoothVertexNormals(bsp, f, &vertex_normals.values[vertex_normals.offsets[i]]);
+        }
+    });
     
     FaceCache = MakeFaceCache(bsp);
 }
@@ -0,0 +1,312 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/pointcache.hh>
+
+#include <common/cmdlib.hh>
+
+#define POINTCACHE_VERSION ('L' << 24 | 'P' << 16 | 'C' << 8 | '1')
+
+/* the cache is a local build artifact, so it's written in native byte order */
+typedef struct {
+    uint32_t version;
+    uint32_t numentries;
+    uint64_t key;
+} dpointcache_t;
+
+typedef struct {
+    int32_t facenum;
+    float lightmapscale;
+    int32_t numpoints;
+} dpointcacheentry_t;
+
+class pointcache_entry_t {
+public:
+    std::vector<float> points;      // numpoints * 3
+    std::vector<float> normals;     // numpoints * 3
+    std::vector<uint8_t> occluded;
+    std::vector<int32_t> realfacenums;
+};
+
+using pointcache_id_t = std::pair<int, float>; // facenum, lightmapscale
+
+static bool cache_active = false;
+static std::string cache_filename;
+static uint64_t cache_key;
+
+/* read-only once loaded, so lookups don't need the lock */
+static std::map<pointcache_id_t, pointcache_entry_t> loaded_entries;
+
+static std::mutex new_entries_lock;
+static std::map<pointcache_id_t, pointcache_entry_t> new_entries;
+
+template <typename T>
+static void
+Hash_Value(uint64_t *hash, const T &value)
+{
+    FNV_HashBytes(hash, &value, sizeof(value));
+}
+
+/*
+ * Hashes everything CalcPoints (and the phong normals it interpolates)
+ * depends on. Fields light itself rewrites, like face lightofs/styles and
+ * the entity lump, are left out so reruns hit the cache.
+ */
+uint64_t
+PointCache_Key(const mbsp_t *bsp, const globalconfig_t &cfg)
+{
+    uint64_t hash = FNV_HASH_INIT;
+
+    Hash_Value(&hash, bsp->loadversion->game->id);
+
+    FNV_HashBytes(&hash, bsp->dvertexes, sizeof(*bsp->dvertexes) * bsp->numvertexes);
+    FNV_HashBytes(&hash, bsp->dedges, sizeof(*bsp->dedges) * bsp->numedges);
+    FNV_HashBytes(&hash, bsp->dsurfedges, sizeof(*bsp->dsurfedges) * bsp->numsurfedges);
+    FNV_HashBytes(&hash, bsp->dplanes, sizeof(*bsp->dplanes) * bsp->numplanes);
+    FNV_HashBytes(&hash, bsp->dnodes, sizeof(*bsp->dnodes) * bsp->numnodes);
+    FNV_HashBytes(&hash, bsp->dmodels, sizeof(*bsp->dmodels) * bsp->nummodels);
+
+    for (int i = 0; i < bsp->numleafs; i++)
+        Hash_Value(&hash, bsp->dleafs[i].contents);
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        Hash_Value(&hash, face->planenum);
+        Hash_Value(&hash, face->side);
+        Hash_Value(&hash, face->firstedge);
+        Hash_Value(&hash, face->numedges);
+        Hash_Value(&hash, face->texinfo);
+    }
+
+    for (int i = 0; i < bsp->numtexinfo; i++) {
+        const gtexinfo_t *texinfo = &bsp->texinfo[i];
+        Hash_Value(&hash, texinfo->vecs);
+        Hash_Value(&hash, texinfo->flags.native);
+
+        const surfflags_t &flags = extended_texinfo_flags[i];
+        Hash_Value(&hash, flags.native);
+        Hash_Value(&hash, flags.extended);
+        Hash_Value(&hash, flags.phong_angle);
+        Hash_Value(&hash, flags.phong_angle_concave);
+    }
+
+    for (int i = 0; i < bsp->nummodels; i++) {
+        const modelinfo_t *info = ModelInfoForModel(bsp, i);
+        Hash_Value(&hash, info->lightmapscale);
+        Hash_Value(&hash, info->offset);
+        Hash_Value(&hash, info->alpha.floatValue());
+        Hash_Value(&hash, info->getResolvedPhongAngle());
+    }
+
+    /* which bmodels can occlude sample points */
+    for (const modelinfo_t *info : tracelist)
+        Hash_Value(&hash, static_cast<int32_t>(info->model - bsp->dmodels));
+
+    Hash_Value(&hash, oversample);
+    Hash_Value(&hash, cfg.phongallowed.boolValue());
+
+    return hash;
+}
+
+/* false if the file ends early or the entry can't be right */
+static bool
+PointCache_ReadEntry(FILE *infile, long filesize, int numfaces)
+{
+    dpointcacheentry_t dentry;
+    if (fread(&dentry, sizeof(dentry), 1, infile) != 1)
+        return false;
+
+    const long remaining = filesize - ftell(infile);
+    const size_t pointsize = sizeof(float) * 6 + 1 + sizeof(int32_t);
+    if (dentry.numpoints < 0 || static_cast<size_t>(dentry.numpoints) * pointsize > static_cast<size_t>(remaining))
+        return false;
+
+    pointcache_entry_t entry;
+    entry.points.resize(dentry.numpoints * 3);
+    entry.normals.resize(dentry.numpoints * 3);
+    entry.occluded.resize(dentry.numpoints);
+    entry.realfacenums.resize(dentry.numpoints);
+
+    if (fread(entry.points.data(), sizeof(float), entry.points.size(), infile) != entry.points.size()
+        || fread(entry.normals.data(), sizeof(float), entry.normals.size(), infile) != entry.normals.size()
+        || fread(entry.occluded.data(), 1, entry.occluded.size(), infile) != entry.occluded.size()
+        || fread(entry.realfacenums.data(), sizeof(int32_t), entry.realfacenums.size(), infile) != entry.realfacenums.size())
+        return false;
+    for (const int32_t realfacenum : entry.realfacenums) {
+        if (realfacenum < -1 || realfacenum >= numfaces)
+            return false;
+    }
+
+    loaded_entries[std::make_pair(dentry.facenum, dentry.lightmapscale)] = std::move(entry);
+    return true;
+}
+
+void
+PointCache_Load(const mbsp_t *bsp, const globalconfig_t &cfg, const char *filename)
+{
+    cache_active = true;
+    cache_filename = filename;
+    cache_key = PointCache_Key(bsp, cfg);
+    loaded_entries.clear();
+    new_entries.clear();
+
+    FILE *infile = fopen(filename, "rb");
+    if (!infile)
+        return;
+
+    fseek(infile, 0, SEEK_END);
+    const long filesize = ftell(infile);
+    fseek(infile, 0, SEEK_SET);
+
+    dpointcache_t header;
+    if (fread(&header, sizeof(header), 1, infile) != 1
+        || header.version != POINTCACHE_VERSION) {
+        logprint("Sample point cache %s is not valid, will be overwritten\n", filename);
+        fclose(infile);
+        return;
+    }
+    if (header.key != cache_key) {
+        logprint("Sample point cache %s is out of date, will be overwritten\n", filename);
+        fclose(infile);
+        return;
+    }
+
+    for (uint32_t i = 0; i < header.numentries; i++) {
+        if (!PointCache_ReadEntry(infile, filesize, bsp->numfaces)) {
+            /* truncated or garbled, treat it like a missing cache */
+            logprint("Sample point cache %s is not valid, will be overwritten\n", filename);
+            loaded_entries.clear();
+            fclose(infile);
+            return;
+        }
+    }
+
+    fclose(infile);
+
+    logprint("Loaded sample points for %d faces from %s\n",
+             static_cast<int>(loaded_entries.size()), filename);
+}
+
+static void
+PointCache_WriteEntry(FILE *f, const pointcache_id_t &id, const pointcache_entry_t &entry)
+{
+    dpointcacheentry_t dentry;
+    dentry.facenum = id.first;
+    dentry.lightmapscale = id.second;
+    dentry.numpoints = static_cast<int32_t>(entry.occluded.size());
+
+    SafeWrite(f, &dentry, sizeof(dentry));
+    SafeWrite(f, entry.points.data(), sizeof(float) * entry.points.size());
+    SafeWrite(f, entry.normals.data(), sizeof(float) * entry.normals.size());
+    SafeWrite(f, entry.occluded.data(), entry.occluded.size());
+    SafeWrite(f, entry.realfacenums.data(), sizeof(int32_t) * entry.realfacenums.size());
+}
+
+void
+PointCache_Save(void)
+{
+    if (!cache_active || new_entries.empty())
+        return;
+
+    const std::string tmpfile = cache_filename + ".tmp";
+    FILE *outfile = SafeOpenWrite(tmpfile.c_str());
+
+    dpointcache_t header;
+    header.version = POINTCACHE_VERSION;
+    header.numentries = static_cast<uint32_t>(loaded_entries.size() + new_entries.size());
+    header.key = cache_key;
+    SafeWrite(outfile, &header, sizeof(header));
+
+    for (const auto &pair : loaded_entries)
+        PointCache_WriteEntry(outfile, pair.first, pair.second);
+    for (const auto &pair : new_entries)
+        PointCache_WriteEntry(outfile, pair.first, pair.second);
+
+    if (fclose(outfile))
+        Error("%s: error writing %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+
+    remove(cache_filename.c_str());
+    if (rename(tmpfile.c_str(), cache_filename.c_str()))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+
+    logprint("Saved sample points for %d new faces to %s\n",
+             static_cast<int>(new_entries.size()), cache_filename.c_str());
+}
+
+bool
+PointCache_Lookup(int facenum, lightsurf_t *surf)
+{
+    if (!cache_active)
+        return false;
+
+    const auto it = loaded_entries.find(std::make_pair(facenum, surf->lightmapscale));
+    if (it == loaded_entries.end())
+        return false;
+
+    const pointcache_entry_t &entry = it->second;
+    if (entry.occluded.size() != static_cast<size_t>(surf->numpoints))
+        return false;
+
+    for (int i = 0; i < surf->numpoints; i++) {
+        for (int j = 0; j < 3; j++) {
+            surf->points[i][j] = entry.points[i * 3 + j];
+            surf->normals[i][j] = entry.normals[i * 3 + j];
+        }
+        surf->occluded[i] = entry.occluded[i] != 0;
+        surf->realfacenums[i] = entry.realfacenums[i];
+    }
+    return true;
+}
+
+void
+PointCache_Store(int facenum, const lightsurf_t *surf)
+{
+    if (!cache_active)
+        return;
+
+    pointcache_entry_t entry;
+    entry.points.resize(surf->numpoints * 3);
+    entry.normals.resize(surf->numpoints * 3);
+    entry.occluded.resize(surf->numpoints);
+    entry.realfacenums.resize(surf->numpoints);
+
+    for (int i = 0; i < surf->numpoints; i++) {
+        for (int j = 0; j < 3; j++) {
+            entry.points[i * 3 + j] = surf->points[i][j];
+            entry.normals[i * 3 + j] = surf->normals[i][j];
+        }
+        entry.occluded[i] = surf->occluded[i] ? 1 : 0;
+        entry.realfacenums[i] = surf->realfacenums[i];
+    }
+
+    std::lock_guard<std::mutex> lock(new_entries_lock);
+    new_entries[std::make_pair(facenum, surf->lightmapscale)] = std::move(entry);
+}
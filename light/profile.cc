@@ -0,0 +1,238 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Each thread records into its own profile_thread_t, found through a
+ * thread_local pointer, so the per-face and per-light calls don't contend
+ * for a lock; the threads' records are only merged by Profile_Finish.
+ *
+ * Lights are traced in batches (LightFace_Entities), so a light's time is
+ * its share of the batch's trace time by ray count plus the time spent
+ * adding its rays to the lightmaps.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include <light/light.hh>
+#include <light/profile.hh>
+#include <common/log.hh>
+
+using nlohmann::json;
+
+qboolean lightprofile = false;
+
+#define PROFILE_SLOWEST 10  /* lights and faces listed in the final report */
+
+typedef struct {
+    int facenum;
+    double start, end;
+} profileface_t;
+
+typedef struct {
+    int64_t rays;
+    double seconds;
+    int faces;
+} profilelight_t;
+
+typedef struct {
+    int64_t rays;
+    double busy;
+    std::vector<profileface_t> faces;
+    std::vector<profilelight_t> lights; /* indexed like GetLights() */
+} profilethread_t;
+
+static std::mutex profile_lock;
+static std::vector<std::unique_ptr<profilethread_t>> profile_threads;
+static thread_local profilethread_t *profile_thread = nullptr;
+
+static profilethread_t *
+Profile_Thread(void)
+{
+    if (!profile_thread) {
+        std::lock_guard<std::mutex> lock(profile_lock);
+        profile_threads.push_back(std::make_unique<profilethread_t>());
+        profile_thread = profile_threads.back().get();
+    }
+    return profile_thread;
+}
+
+void
+Profile_Face(int facenum, double start, double end)
+{
+    if (!lightprofile)
+        return;
+
+    profilethread_t *thread = Profile_Thread();
+    thread->faces.push_back({ facenum, start, end });
+    thread->busy += end - start;
+}
+
+void
+Profile_LightRays(const light_t *entity, int rays, double seconds)
+{
+    if (!lightprofile)
+        return;
+
+    profilethread_t *thread = Profile_Thread();
+    const size_t index = entity - GetLights().data();
+    if (thread->lights.size() <= index)
+        thread->lights.resize(GetLights().size(), { 0, 0, 0 });
+
+    profilelight_t &light = thread->lights[index];
+    light.rays += rays;
+    light.seconds += seconds;
+    light.faces++;
+    thread->rays += rays;
+}
+
+void
+Profile_Rays(int rays)
+{
+    if (!lightprofile)
+        return;
+
+    Profile_Thread()->rays += rays;
+}
+
+static std::string
+Profile_LightName(const light_t &entity)
+{
+    const vec_t *origin = *entity.origin.vec3Value();
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s at (%.0f %.0f %.0f)", entity.classname(), origin[0], origin[1], origin[2]);
+    return buf;
+}
+
+static void
+Profile_WriteJson(const json &j, const char *source, const char *extension)
+{
+    char filename[1024];
+    strcpy(filename, source);
+    StripExtension(filename);
+    strcat(filename, extension);
+
+    FILE *f = SafeOpenWrite(filename);
+    const std::string text = j.dump(1);
+    SafeWrite(f, text.c_str(), text.size());
+    fclose(f);
+
+    logprint("profile: wrote %s\n", filename);
+}
+
+/*
+  ==============
+  Profile_Finish
+
+  Logs the costliest lights and faces and the per-thread ray rates, and
+  writes the profile file. The phases and the trace are Timing_Finish's.
+  ==============
+*/
+void
+Profile_Finish(const char *source)
+{
+    if (!lightprofile)
+        return;
+
+    std::lock_guard<std::mutex> lock(profile_lock);
+
+    const std::vector<light_t> &lights = GetLights();
+
+    /* merge the threads' records */
+    std::vector<profilelight_t> lightcosts(lights.size(), { 0, 0, 0 });
+    std::vector<profileface_t> faces;
+    double lightseconds = 0;
+    for (const auto &thread : profile_threads) {
+        for (size_t i = 0; i < thread->lights.size() && i < lightcosts.size(); i++) {
+            lightcosts[i].rays += thread->lights[i].rays;
+            lightcosts[i].seconds += thread->lights[i].seconds;
+            lightcosts[i].faces += thread->lights[i].faces;
+            lightseconds += thread->lights[i].seconds;
+        }
+        faces.insert(faces.end(), thread->faces.begin(), thread->faces.end());
+    }
+
+    std::vector<int> lightorder(lights.size());
+    for (size_t i = 0; i < lights.size(); i++)
+        lightorder[i] = static_cast<int>(i);
+    std::sort(lightorder.begin(), lightorder.end(), [&lightcosts](int a, int b) {
+        return lightcosts[a].seconds > lightcosts[b].seconds;
+    });
+    std::sort(faces.begin(), faces.end(), [](const profileface_t &a, const profileface_t &b) {
+        return (a.end - a.start) > (b.end - b.start);
+    });
+
+    logprint("profile: costliest lights (%.3f secs in all lights):\n", lightseconds);
+    double cumulative = 0;
+    for (size_t i = 0; i < lightorder.size() && i < PROFILE_SLOWEST; i++) {
+        const profilelight_t &cost = lightcosts[lightorder[i]];
+        if (!cost.rays)
+            break;
+        cumulative += cost.seconds;
+        logprint("  %s: %.3f secs, %lld rays, %d faces, %.1f%% of light time so far\n",
+                 Profile_LightName(lights[lightorder[i]]).c_str(), cost.seconds,
+                 static_cast<long long>(cost.rays), cost.faces,
+                 lightseconds > 0 ? 100.0 * cumulative / lightseconds : 0.0);
+    }
+
+    logprint("profile: slowest faces:\n");
+    for (size_t i = 0; i < faces.size() && i < PROFILE_SLOWEST; i++)
+        logprint("  face %6d: %.3f secs\n", faces[i].facenum, faces[i].end - faces[i].start);
+
+    logprint("profile: threads:\n");
+    for (size_t i = 0; i < profile_threads.size(); i++) {
+        const profilethread_t &thread = *profile_threads[i];
+        logprint("  thread %2d: %6d faces, %.3f secs busy, %.0f rays/sec\n",
+                 static_cast<int>(i), static_cast<int>(thread.faces.size()), thread.busy,
+                 thread.busy > 0 ? thread.rays / thread.busy : 0.0);
+    }
+
+    json j = json::object();
+
+    json &threads = (j.emplace("threads", json::array())).first.value();
+    for (const auto &thread : profile_threads) {
+        threads.push_back({ {"faces", thread->faces.size()}, {"busy", thread->busy}, {"rays", thread->rays},
+                            {"rays_per_second", thread->busy > 0 ? thread->rays / thread->busy : 0.0} });
+    }
+
+    json &lightsjson = (j.emplace("lights", json::array())).first.value();
+    for (int i : lightorder) {
+        const profilelight_t &cost = lightcosts[i];
+        if (!cost.rays)
+            continue;
+        const vec_t *origin = *lights[i].origin.vec3Value();
+        lightsjson.push_back({ {"light", i}, {"classname", lights[i].classname()},
+                               {"origin", json::array({ origin[0], origin[1], origin[2] })},
+                               {"seconds", cost.seconds}, {"rays", cost.rays}, {"faces", cost.faces} });
+    }
+
+    json &facesjson = (j.emplace("faces", json::array())).first.value();
+    for (const profileface_t &face : faces)
+        facesjson.push_back({ {"face", face.facenum}, {"seconds", face.end - face.start} });
+
+    Profile_WriteJson(j, source, ".lightprofile.json");
+}
@@ -0,0 +1,292 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/pvscull.hh>
+
+#include <common/bsputils.hh>
+#include <common/memstats.hh>
+
+bool pvscull = false;
+
+/*
+ * A row is a bit per leaf. Lights in the same single leaf share one, so
+ * there's about a row per lit room rather than per light.
+ */
+static std::vector<std::vector<uint8_t>> pvs_rows;
+static std::vector<int> pvs_lightrow;           /* per GetLights() entry, -1 = light every face */
+
+/* the leafs each world face is in, from the marksurfaces */
+static std::vector<int> pvs_facefirstleaf;      /* numfaces + 1 */
+static std::vector<int> pvs_faceleafs;
+
+static memcounter_t pvs_memory("light PVS rows");
+
+int
+PVS_LeafAtPoint(const mbsp_t *bsp, const vec3_t point)
+{
+    int nodenum = bsp->dmodels[0].headnode[0];
+    while (nodenum >= 0) {
+        const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+        const vec_t dist = Plane_Dist(point, &bsp->dplanes[node->planenum]);
+        nodenum = node->children[dist >= 0 ? 0 : 1];
+    }
+    return -nodenum - 1;
+}
+
+bool
+PVS_MarkVisibleLeafs(const mbsp_t *bsp, int leafnum, std::vector<uint8_t> *visible)
+{
+    const mleaf_t *leaf = BSP_GetLeaf(bsp, leafnum);
+
+    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+        if (!bsp->visdatasize || leaf->cluster < 0)
+            return false;
+
+        const dvis_t *vis = reinterpret_cast<const dvis_t *>(bsp->dvisdata);
+        std::vector<uint8_t> row((vis->numclusters + 7) >> 3);
+        DecompressRow(bsp->dvisdata + vis->bitofs[leaf->cluster][DVIS_PVS], static_cast<int>(row.size()), row.data());
+
+        for (int i = 0; i < bsp->numleafs; i++) {
+            const int cluster = bsp->dleafs[i].cluster;
+            if (cluster >= 0 && (row[cluster >> 3] & (1 << (cluster & 7))))
+                (*visible)[i] = 1;
+        }
+    } else {
+        if (!bsp->visdatasize || leaf->visofs < 0)
+            return false;
+
+        // the rows start at leaf 1, since leaf 0 is the shared solid leaf
+        const int visleafs = bsp->dmodels[0].visleafs;
+        std::vector<uint8_t> row((visleafs + 7) >> 3);
+        DecompressRow(bsp->dvisdata + leaf->visofs, static_cast<int>(row.size()), row.data());
+
+        for (int i = 0; i < visleafs && i + 1 < bsp->numleafs; i++) {
+            if (row[i >> 3] & (1 << (i & 7)))
+                (*visible)[i + 1] = 1;
+        }
+    }
+
+    (*visible)[leafnum] = 1;
+    return true;
+}
+
+static bool
+PVS_LeafIsSolid(const mbsp_t *bsp, int leafnum)
+{
+    const mleaf_t *leaf = BSP_GetLeaf(bsp, leafnum);
+    if (bsp->loadversion->game->id == GAME_QUAKE_II)
+        return (leaf->contents & Q2_CONTENTS_SOLID) != 0;
+    return leaf->contents == CONTENTS_SOLID;
+}
+
+/* the leafs touching the box center +/- radius */
+static void
+PVS_LeafsInBox(const mbsp_t *bsp, int nodenum, const vec3_t center, vec_t radius, std::vector<int> *leafs)
+{
+    while (nodenum >= 0) {
+        const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+        const dplane_t *plane = &bsp->dplanes[node->planenum];
+        const vec_t dist = Plane_Dist(center, plane);
+        const vec_t extent = radius * (fabs(plane->normal[0]) + fabs(plane->normal[1]) + fabs(plane->normal[2]));
+
+        if (dist >= extent) {
+            nodenum = node->children[0];
+        } else if (dist < -extent) {
+            nodenum = node->children[1];
+        } else {
+            PVS_LeafsInBox(bsp, node->children[0], center, radius, leafs);
+            nodenum = node->children[1];
+        }
+    }
+    leafs->push_back(-nodenum - 1);
+}
+
+static void
+PVS_PackRow(const std::vector<uint8_t> &visible, std::vector<uint8_t> *row)
+{
+    row->assign((visible.size() + 7) >> 3, 0);
+    for (size_t i = 0; i < visible.size(); i++) {
+        if (visible[i])
+            (*row)[i >> 3] |= 1 << (i & 7);
+    }
+}
+
+/*
+ * The row for one light: the union of the PVS of every leaf its source
+ * touches (the ball of an area light, or the point plus an epsilon, so
+ * a light on a leaf boundary sees from both sides). -1 if any of them
+ * has no vis data.
+ */
+static int
+PVS_RowForLight(const mbsp_t *bsp, const light_t *entity, std::map<int, int> *leafrows)
+{
+    const vec_t radius = entity->deviance.floatValue() + 1;
+
+    std::vector<int> leafs;
+    PVS_LeafsInBox(bsp, bsp->dmodels[0].headnode[0], *entity->origin.vec3Value(), radius, &leafs);
+
+    std::vector<int> open;
+    for (int leafnum : leafs) {
+        if (!PVS_LeafIsSolid(bsp, leafnum))
+            open.push_back(leafnum);
+    }
+    if (open.empty())
+        return -1;
+
+    if (open.size() == 1) {
+        const auto it = leafrows->find(open[0]);
+        if (it != leafrows->end())
+            return it->second;
+    }
+
+    std::vector<uint8_t> visible(bsp->numleafs, 0);
+    for (int leafnum : open) {
+        if (!PVS_MarkVisibleLeafs(bsp, leafnum, &visible))
+            return -1;
+    }
+
+    pvs_rows.emplace_back();
+    PVS_PackRow(visible, &pvs_rows.back());
+    pvs_memory.add(pvs_rows.back().size());
+
+    const int rownum = static_cast<int>(pvs_rows.size()) - 1;
+    if (open.size() == 1)
+        (*leafrows)[open[0]] = rownum;
+    return rownum;
+}
+
+bool
+PVS_VisibleBounds(const mbsp_t *bsp, const vec3_t point, vec_t radius, vec3_t mins, vec3_t maxs)
+{
+    if (!bsp->visdatasize)
+        return false;
+
+    std::vector<int> leafs;
+    PVS_LeafsInBox(bsp, bsp->dmodels[0].headnode[0], point, radius, &leafs);
+
+    std::vector<uint8_t> visible(bsp->numleafs, 0);
+    bool open = false;
+    for (int leafnum : leafs) {
+        if (PVS_LeafIsSolid(bsp, leafnum))
+            continue;
+        if (!PVS_MarkVisibleLeafs(bsp, leafnum, &visible))
+            return false;
+        open = true;
+    }
+    if (!open)
+        return false;
+
+    AABB_Init(mins, maxs, point);
+    for (int i = 0; i < bsp->numleafs; i++) {
+        if (!visible[i])
+            continue;
+        const mleaf_t *leaf = BSP_GetLeaf(bsp, i);
+        AABB_Expand(mins, maxs, leaf->mins);
+        AABB_Expand(mins, maxs, leaf->maxs);
+    }
+    return true;
+}
+
+void
+PVSCull_Setup(const mbsp_t *bsp)
+{
+    if (!pvscull)
+        return;
+
+    /* -watch sets up again when the lights change */
+    for (const std::vector<uint8_t> &row : pvs_rows)
+        pvs_memory.sub(row.size());
+    pvs_rows.clear();
+    pvs_lightrow.clear();
+
+    if (!bsp->visdatasize) {
+        logprint("WARNING: -pvscull: the bsp has no vis data, lights won't be culled\n");
+        return;
+    }
+
+    /* invert the marksurfaces, giving each face its leafs */
+    std::vector<int> counts(bsp->numfaces + 1, 0);
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        for (uint32_t k = 0; k < leaf->nummarksurfaces; k++)
+            counts[bsp->dleaffaces[leaf->firstmarksurface + k] + 1]++;
+    }
+    pvs_facefirstleaf.assign(bsp->numfaces + 1, 0);
+    for (int i = 0; i < bsp->numfaces; i++)
+        pvs_facefirstleaf[i + 1] = pvs_facefirstleaf[i] + counts[i + 1];
+
+    pvs_faceleafs.resize(pvs_facefirstleaf[bsp->numfaces]);
+    std::vector<int> fill(pvs_facefirstleaf.begin(), pvs_facefirstleaf.end() - 1);
+    for (int i = 0; i < bsp->numleafs; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        for (uint32_t k = 0; k < leaf->nummarksurfaces; k++)
+            pvs_faceleafs[fill[bsp->dleaffaces[leaf->firstmarksurface + k]]++] = i;
+    }
+
+    const std::vector<light_t> &lights = GetLights();
+    std::map<int, int> leafrows;
+    int unculled = 0;
+
+    pvs_lightrow.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        pvs_lightrow[i] = PVS_RowForLight(bsp, &lights[i], &leafrows);
+        if (pvs_lightrow[i] < 0)
+            unculled++;
+    }
+
+    logprint("PVS culling: %d lights, %d rows, %d lights with no vis data light every face\n",
+             static_cast<int>(lights.size()), static_cast<int>(pvs_rows.size()), unculled);
+}
+
+bool
+PVSCull_LightCulled(const light_t *entity, int facenum)
+{
+    if (pvs_lightrow.empty())
+        return false;
+
+    const std::vector<light_t> &lights = GetLights();
+    const ptrdiff_t lightnum = entity - lights.data();
+    if (lightnum < 0 || lightnum >= static_cast<ptrdiff_t>(pvs_lightrow.size()))
+        return false;
+
+    const int rownum = pvs_lightrow[lightnum];
+    if (rownum < 0)
+        return false;
+
+    /* bmodel faces aren't in any leaf */
+    const int first = pvs_facefirstleaf[facenum];
+    const int last = pvs_facefirstleaf[facenum + 1];
+    if (first == last)
+        return false;
+
+    const std::vector<uint8_t> &row = pvs_rows[rownum];
+    for (int i = first; i < last; i++) {
+        const int leafnum = pvs_faceleafs[i];
+        if (row[leafnum >> 3] & (1 << (leafnum & 7)))
+            return false;
+    }
+    return true;
+}
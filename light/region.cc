@@ -0,0 +1,224 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/incremental.hh>
+#include <light/ltface.hh>
+#include <light/pvscull.hh>
+#include <light/region.hh>
+
+#include <common/bsputils.hh>
+
+typedef struct {
+    vec3_t mins;
+    vec3_t maxs;
+} regionbox_t;
+
+static std::vector<regionbox_t> region_boxes;
+static std::vector<int> region_faces;
+static std::vector<std::string> region_models;
+static std::vector<qvec3d> region_pvspoints;
+
+void
+Region_AddBox(const vec3_t mins, const vec3_t maxs)
+{
+    regionbox_t box;
+    for (int i = 0; i < 3; i++) {
+        box.mins[i] = qmin(mins[i], maxs[i]);
+        box.maxs[i] = qmax(mins[i], maxs[i]);
+    }
+    region_boxes.push_back(box);
+}
+
+void
+Region_AddFace(int facenum)
+{
+    region_faces.push_back(facenum);
+}
+
+void
+Region_AddModel(const char *name)
+{
+    region_models.push_back(name);
+}
+
+void
+Region_AddPVS(const vec3_t point)
+{
+    region_pvspoints.emplace_back(point[0], point[1], point[2]);
+}
+
+bool
+Region_Active(void)
+{
+    return !region_boxes.empty() || !region_faces.empty()
+        || !region_models.empty() || !region_pvspoints.empty();
+}
+
+static void
+Region_SelectModel(const mbsp_t *bsp, int modelnum, std::vector<uint8_t> *selected)
+{
+    const dmodel_t *model = &bsp->dmodels[modelnum];
+    for (int i = 0; i < model->numfaces; i++)
+        (*selected)[model->firstface + i] = 1;
+}
+
+/* brush entities by "*N" or targetname; several can share a targetname */
+static void
+Region_SelectModels(const mbsp_t *bsp, std::vector<uint8_t> *selected)
+{
+    const entdict_index_t entindex = IndexEntDicts();
+
+    for (const std::string &name : region_models) {
+        const dmodel_t *model = BSP_DModelForModelString(bsp, name);
+        if (model) {
+            Region_SelectModel(bsp, static_cast<int>(model - bsp->dmodels), selected);
+            continue;
+        }
+
+        int found = 0;
+        for (int i = 1; i < bsp->nummodels; i++) {
+            const auto entit = entindex.by_model.find("*" + std::to_string(i));
+            if (entit == entindex.by_model.end())
+                continue;
+            if (EntDict_StringForKey(*entit->second, "targetname") != name)
+                continue;
+            Region_SelectModel(bsp, i, selected);
+            found++;
+        }
+        if (!found)
+            Error("-regionmodel: no brush entity is named \"%s\"", name.c_str());
+    }
+}
+
+/*
+ * Marks the leafs in the PVS of the leaf containing point. Without vis
+ * data every leaf is potentially visible.
+ */
+static void
+Region_LeafsVisibleFrom(const mbsp_t *bsp, const vec3_t point, std::vector<uint8_t> *visible)
+{
+    const bool isQuake2map = bsp->loadversion->game->id == GAME_QUAKE_II;
+    const int leafnum = PVS_LeafAtPoint(bsp, point);
+    const mleaf_t *leaf = BSP_GetLeaf(bsp, leafnum);
+
+    const bool solid = isQuake2map ? (leaf->contents & Q2_CONTENTS_SOLID) : (leaf->contents == CONTENTS_SOLID);
+    if (solid)
+        Error("-regionpvs: point (%s) is in solid", VecStr(point).c_str());
+
+    if (!PVS_MarkVisibleLeafs(bsp, leafnum, visible)) {
+        logprint("Region: no vis data at (%s), using every leaf\n", VecStr(point).c_str());
+        visible->assign(visible->size(), 1);
+    }
+}
+
+/*
+ * World faces in the visible leafs, plus the faces of any bmodel whose
+ * bounds touch a visible leaf, since bmodel faces aren't in the leafs.
+ */
+static void
+Region_SelectPVS(const mbsp_t *bsp, std::vector<uint8_t> *selected)
+{
+    std::vector<uint8_t> visible(bsp->numleafs, 0);
+    for (const qvec3d &point : region_pvspoints) {
+        vec3_t pt;
+        glm_to_vec3_t(point, pt);
+        Region_LeafsVisibleFrom(bsp, pt, &visible);
+    }
+
+    for (int i = 0; i < bsp->numleafs; i++) {
+        if (!visible[i])
+            continue;
+        const mleaf_t *leaf = &bsp->dleafs[i];
+        for (uint32_t k = 0; k < leaf->nummarksurfaces; k++)
+            (*selected)[bsp->dleaffaces[leaf->firstmarksurface + k]] = 1;
+    }
+
+    for (int m = 1; m < bsp->nummodels; m++) {
+        const dmodel_t *model = &bsp->dmodels[m];
+        const modelinfo_t *info = ModelInfoForModel(bsp, m);
+        vec3_t mins, maxs;
+        for (int j = 0; j < 3; j++) {
+            mins[j] = model->mins[j] + info->offset[j];
+            maxs[j] = model->maxs[j] + info->offset[j];
+        }
+
+        for (int i = 0; i < bsp->numleafs; i++) {
+            if (!visible[i])
+                continue;
+            const mleaf_t *leaf = &bsp->dleafs[i];
+            vec3_t leafmins, leafmaxs;
+            for (int j = 0; j < 3; j++) {
+                leafmins[j] = leaf->mins[j];
+                leafmaxs[j] = leaf->maxs[j];
+            }
+            if (!AABBsDisjoint(mins, maxs, leafmins, leafmaxs)) {
+                Region_SelectModel(bsp, m, selected);
+                break;
+            }
+        }
+    }
+}
+
+static void
+Region_SelectBoxes(const mbsp_t *bsp, std::vector<uint8_t> *selected)
+{
+    for (int i = 0; i < bsp->numfaces; i++) {
+        vec3_t mins, maxs;
+        int numluxels;
+        if (!LightFace_Extents(bsp, &bsp->dfaces[i], mins, maxs, &numluxels))
+            continue;
+
+        for (const regionbox_t &box : region_boxes) {
+            if (!AABBsDisjoint(box.mins, box.maxs, mins, maxs)) {
+                (*selected)[i] = 1;
+                break;
+            }
+        }
+    }
+}
+
+void
+Region_Setup(bspdata_t *bspdata)
+{
+    const mbsp_t *bsp = &bspdata->data.mbsp;
+
+    logprint("--- Region_Setup ---\n");
+
+    std::vector<uint8_t> selected(bsp->numfaces, 0);
+
+    for (int facenum : region_faces) {
+        if (facenum < 0 || facenum >= bsp->numfaces)
+            Error("-regionface: face %d out of range (the bsp has %d faces)", facenum, bsp->numfaces);
+        selected[facenum] = 1;
+    }
+    if (!region_models.empty())
+        Region_SelectModels(bsp, &selected);
+    if (!region_pvspoints.empty())
+        Region_SelectPVS(bsp, &selected);
+    if (!region_boxes.empty())
+        Region_SelectBoxes(bsp, &selected);
+
+    Incremental_SetupRegion(bspdata, selected);
+}
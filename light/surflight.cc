@@ -18,6 +18,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 See file, 'COPYING', for details.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <iostream>
@@ -29,7 +30,10 @@ See file, 'COPYING', for details.
 
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
+#include <common/octree.hh>
 
+#include <memory>
+#include <numeric>
 #include <vector>
 #include <map>
 #include <mutex>
@@ -43,6 +47,8 @@ using namespace polylib;
 mutex surfacelights_lock;
 std::vector<surfacelight_t> surfacelights;
 std::map<int, std::vector<int>> surfacelightsByFacenum;
+/* indices into surfacelights by estimated bounds, only built when using visapprox */
+static std::unique_ptr<octree_t<int>> surfacelights_octree;
 int total_surflight_points = 0;
 
 struct make_surface_lights_args_t {
@@ -50,18 +56,70 @@ struct make_surface_lights_args_t {
     const globalconfig_t *cfg;
 };
 
-struct save_winding_points_args_t {
-    vector<qvec3f> *points;
-};
+/*
+ * Builds the cluster tree over points[first, first + count), splitting at
+ * the median of the longest axis. Reorders the points.
+ */
+static int
+BuildClusters_r(std::vector<qvec3f> *points, int first, int count, std::vector<surflightcluster_t> *clusters)
+{
+    const int index = static_cast<int>(clusters->size());
+    clusters->push_back({});
+
+    qvec3f mins = (*points)[first], maxs = (*points)[first], sum(0);
+    for (int i = first; i < first + count; i++) {
+        const qvec3f &p = (*points)[i];
+        for (int j = 0; j < 3; j++) {
+            mins[j] = qmin(mins[j], p[j]);
+            maxs[j] = qmax(maxs[j], p[j]);
+        }
+        sum += p;
+    }
+
+    surflightcluster_t cluster;
+    cluster.pos = sum / static_cast<float>(count);
+    cluster.radius = 0;
+    cluster.count = count;
+    cluster.children[0] = cluster.children[1] = -1;
+    for (int i = first; i < first + count; i++)
+        cluster.radius = qmax(cluster.radius, qv::distance(cluster.pos, (*points)[i]));
+
+    if (count > 1) {
+        const qvec3f size = maxs - mins;
+        const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2] ? 1 : 2);
+        const int half = count / 2;
+        std::nth_element(points->begin() + first, points->begin() + first + half, points->begin() + first + count,
+                         [axis](const qvec3f &a, const qvec3f &b) { return a[axis] < b[axis]; });
+
+        cluster.children[0] = BuildClusters_r(points, first, half, clusters);
+        cluster.children[1] = BuildClusters_r(points, first + half, count - half, clusters);
+    }
 
-static void 
-SaveWindingCenterFn(winding_t *w, void *userinfo)
+    (*clusters)[index] = cluster;
+    return index;
+}
+
+void
+SurfaceLight_Emitters(const surfacelight_t &vpl, const qvec3f &origin, std::vector<surflightemitter_t> *emitters)
 {
-    auto *args = static_cast<save_winding_points_args_t *>(userinfo);
+    emitters->clear();
+
+    // a median split tree over < 2^31 points is < 32 deep
+    int stack[64];
+    int stacksize = 0;
+    stack[stacksize++] = 0;
 
-    vec3_t center{};
-    WindingCenter(w, center);
-    args->points->push_back(vec3_t_to_glm(center));
+    while (stacksize) {
+        const surflightcluster_t &cluster = vpl.clusters[stack[--stacksize]];
+
+        if (cluster.children[0] == -1
+            || cluster.radius <= SURFLIGHT_CLUSTER_ERROR * qv::distance(cluster.pos, origin)) {
+            emitters->push_back({ cluster.pos, cluster.count });
+            continue;
+        }
+        stack[stacksize++] = cluster.children[1];
+        stack[stacksize++] = cluster.children[0];
+    }
 }
 
 static void *
@@ -69,6 +127,8 @@ MakeSurfaceLightsThread(void *arg)
 {
     const mbsp_t *bsp = static_cast<make_surface_lights_args_t *>(arg)->bsp;
     const globalconfig_t &cfg = *static_cast<make_surface_lights_args_t *>(arg)->cfg;
+    // reused for every face
+    vector<winding_buf_t> diced;
 
     while (true) {
         const int i = GetThreadWork();
@@ -82,7 +142,9 @@ MakeSurfaceLightsThread(void *arg)
         if (!(info->flags.native & Q2_SURF_LIGHT) || info->value == 0) {
             if (info->flags.native & Q2_SURF_LIGHT) {
                 vec3_t wc;
-                WindingCenter(WindingFromFace(bsp, face), wc);
+                winding_buf_t facewinding;
+                WindingFromFaceBuf(bsp, face, &facewinding);
+                WindingCenter(facewinding.get(), wc);
                 logprint("WARNING: surface light '%s' at [%s] has 0 intensity.\n", Face_TextureName(bsp, face), VecStr(wc).c_str());
             }
             continue;
@@ -97,7 +159,10 @@ MakeSurfaceLightsThread(void *arg)
 
         // Create winding...
         const int numpoints = poly.size();
-        winding_t *winding = AllocWinding(numpoints);
+        if (numpoints > MAX_POINTS_ON_WINDING)
+            Error("%s: face %d has more than MAX_POINTS_ON_WINDING points", __func__, i);
+        winding_buf_t facewinding;
+        winding_t *winding = facewinding.get();
         for (int c = 0; c < numpoints; c++) 
             glm_to_vec3_t(poly.at(c), winding->p[c]);
         winding->numpoints = numpoints;
@@ -110,12 +175,16 @@ MakeSurfaceLightsThread(void *arg)
         VectorMA(facemidpoint, 1, facenormal, facemidpoint); // Lift 1 unit
 
         // Dice winding...
-        vector<qvec3f> points;
-        save_winding_points_args_t args{};
-        args.points = &points;
+        diced.clear();
+        DiceWindingBuf(winding, cfg.surflightsubdivision.floatValue(), &diced);
 
-        DiceWinding(winding, cfg.surflightsubdivision.floatValue(), SaveWindingCenterFn, &args);
-        winding = nullptr; // DiceWinding frees winding
+        vector<qvec3f> points;
+        points.reserve(diced.size());
+        for (const winding_buf_t &piece : diced) {
+            vec3_t center{};
+            WindingCenter(piece.get(), center);
+            points.push_back(vec3_t_to_glm(center));
+        }
         total_surflight_points += points.size();
 
         // Get texture color
@@ -150,6 +219,7 @@ MakeSurfaceLightsThread(void *arg)
         surfacelight_t l;
         l.surfnormal = vec3_t_to_glm(facenormal);
         l.omnidirectional = (info->flags.native & Q2_SURF_SKY) ? true : false;
+        BuildClusters_r(&points, 0, static_cast<int>(points.size()), &l.clusters);
         l.points = points;
         VectorCopy(facemidpoint, l.pos);
 
@@ -181,6 +251,19 @@ const std::vector<surfacelight_t> &SurfaceLights()
     return surfacelights;
 }
 
+std::vector<int> SurfaceLightsTouchingBounds(const vec3_t mins, const vec3_t maxs)
+{
+    if (!surfacelights_octree) {
+        std::vector<int> result(surfacelights.size());
+        std::iota(result.begin(), result.end(), 0);
+        return result;
+    }
+
+    /* pad the query, AABBsDisjoint allows a small overlap tolerance */
+    const qvec3f pad(0.01f, 0.01f, 0.01f);
+    return surfacelights_octree->queryTouchingBBox(aabb3f(vec3_t_to_glm(mins) - pad, vec3_t_to_glm(maxs) + pad));
+}
+
 int TotalSurfacelightPoints()
 {
     return total_surflight_points;
@@ -204,4 +287,13 @@ MakeSurfaceLights(const globalconfig_t &cfg, const mbsp_t *bsp)
 
     make_surface_lights_args_t args { bsp,  &cfg };
     RunThreadsOn(0, bsp->numfaces, MakeSurfaceLightsThread, static_cast<void *>(&args));
+
+    surfacelights_octree.reset();
+    if (!novisapprox) {
+        std::vector<std::pair<aabb3f, int>> objects;
+        objects.reserve(surfacelights.size());
+        for (int i = 0; i < static_cast<int>(surfacelights.size()); i++)
+            objects.emplace_back(aabb3f(vec3_t_to_glm(surfacelights[i].mins), vec3_t_to_glm(surfacelights[i].maxs)), i);
+        surfacelights_octree = std::make_unique<octree_t<int>>(makeOctree(objects));
+    }
 }
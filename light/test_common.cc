@@ -1,9 +1,77 @@
 #include "gtest/gtest.h"
 
 #include <string>
+#include <vector>
 #include <common/cmdlib.hh>
+#include <common/bspfile.hh>
 
 TEST(common, StripFilename) {
     ASSERT_EQ("/home/foo", StrippedFilename("/home/foo/bar.txt"));
     ASSERT_EQ("", StrippedFilename("bar.txt"));
 }
+
+/* a bsp with no geometry, just the two BSPX lumps */
+static void WriteBSPXTestFile(const char *filename, const std::vector<uint8_t> &big,
+                              const std::vector<uint8_t> &small, bool compress, int *packed)
+{
+    bspdata_t bspdata {};
+    bspdata.version = &bspver_q1;
+    BSPX_AddLump(&bspdata, "BIGLUMP", big.data(), big.size());
+    BSPX_AddLump(&bspdata, "SMALLLUMP", small.data(), small.size());
+    *packed = compress ? BSPX_CompressLumps(&bspdata) : 0;
+    WriteBSPFile(filename, &bspdata);
+}
+
+static std::vector<uint8_t> GetBSPXLump(bspdata_t *bspdata, const char *name)
+{
+    size_t size;
+    const uint8_t *data = static_cast<const uint8_t *>(BSPX_GetLump(bspdata, name, &size));
+    if (!data)
+        return {};
+    return std::vector<uint8_t>(data, data + size);
+}
+
+static void CheckBSPXTestFile(const char *filename, const std::vector<uint8_t> &big,
+                              const std::vector<uint8_t> &small)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s", filename);
+
+    bspdata_t bspdata {};
+    LoadBSPFile(path, &bspdata);
+    remove(filename);
+
+    EXPECT_EQ(big, GetBSPXLump(&bspdata, "BIGLUMP"));
+    EXPECT_EQ(small, GetBSPXLump(&bspdata, "SMALLLUMP"));
+    EXPECT_EQ(nullptr, BSPX_GetLump(&bspdata, "zlib:BIGLUMP", nullptr));
+}
+
+static std::vector<uint8_t> RepetitiveLump()
+{
+    std::vector<uint8_t> lump(4096);
+    for (size_t i = 0; i < lump.size(); i++)
+        lump[i] = static_cast<uint8_t>(i % 7);
+    return lump;
+}
+
+TEST(common, BSPXUncompressedLumpsLoad) {
+    const std::vector<uint8_t> big = RepetitiveLump();
+    const std::vector<uint8_t> small {1, 2, 3};
+    int packed;
+
+    WriteBSPXTestFile("test_bspx_raw.bsp", big, small, false, &packed);
+    CheckBSPXTestFile("test_bspx_raw.bsp", big, small);
+}
+
+#ifdef HAVE_ZLIB
+TEST(common, BSPXCompressedLumpsRoundTrip) {
+    const std::vector<uint8_t> big = RepetitiveLump();
+    const std::vector<uint8_t> small {1, 2, 3};
+    int packed;
+
+    // only the big lump shrinks, so the small one is written as it is
+    WriteBSPXTestFile("test_bspx_zlib.bsp", big, small, true, &packed);
+    EXPECT_EQ(1, packed);
+    CheckBSPXTestFile("test_bspx_zlib.bsp", big, small);
+}
+#endif
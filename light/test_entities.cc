@@ -57,9 +57,19 @@ TEST(entities, CheckTargetnameKeyMatched) {
         // bad
         {
             { "targetname", "unmatched" }
+        },
+        {
+            {"target", "targets_self" },
+            {"targetname", "targets_self" }
         }
     };
     EXPECT_TRUE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(0), edicts));
     EXPECT_TRUE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(1), edicts));
     EXPECT_FALSE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(2), edicts));
+    EXPECT_FALSE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(3), edicts));
+
+    // the same checks through one index, as LoadEntities does
+    const entdict_index_t index(edicts);
+    EXPECT_TRUE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(1), index));
+    EXPECT_FALSE(EntDict_CheckTargetnameKeyMatched(nullptr, edicts.at(3), index));
 }
@@ -6,6 +6,7 @@
 #include <algorithm> // for std::sort
 
 #include <common/qvec.hh>
+#include <common/polylib.hh>
 
 #include <common/mesh.hh>
 #include <common/aabb.hh>
@@ -786,6 +787,45 @@ TEST(mathlib, meshFixTJuncs) {
     EXPECT_EQ(poly3, newFaces.at(2));
 }
 
+TEST(mathlib, meshFixTJuncsLaterFace) {
+    // as meshFixTJuncs, but the face to fix isn't the first, so its
+    // vertex numbers aren't 0..3
+    const vector<qvec3f> poly1 {
+        { 0,0,0 },
+        { 0,64,0 },
+        { 64,64,0 },
+        { 64,0,0 }
+    };
+    const vector<qvec3f> poly2 {
+        { 64,32,0 },
+        { 64,64,0 },
+        { 128,64,0 },
+        { 128,32,0 }
+    };
+    const vector<qvec3f> poly3 {
+        { 64,0,0 },
+        { 64,32,0 },
+        { 128,32,0 },
+        { 128,0,0 }
+    };
+
+    mesh_t m = buildMesh({ poly2, poly3, poly1 });
+    cleanupMesh(m);
+
+    const vector<qvec3f> poly1_fixed {
+        { 0,0,0 },
+        { 0,64,0 },
+        { 64,64,0 },
+        { 64,32,0 },
+        { 64,0,0 }
+    };
+
+    const auto newFaces = meshToFaces(m);
+    EXPECT_EQ(poly2, newFaces.at(0));
+    EXPECT_EQ(poly3, newFaces.at(1));
+    EXPECT_EQ(poly1_fixed, newFaces.at(2));
+}
+
 // qvec
 
 TEST(mathlib, qvec_expand) {
@@ -1015,6 +1055,34 @@ TEST(mathlib, octree_basic) {
     }
 }
 
+TEST(mathlib, octree_dense) {
+    std::mt19937 engine(0);
+    std::uniform_int_distribution<> dis(-64, 64);
+
+    // a tight cluster, which needs a deep tree, plus one box over everything
+    vector<pair<aabb3f, int>> objs;
+    for (int i=0; i<5000; i++) {
+        const qvec3f center(dis(engine), dis(engine), dis(engine));
+        objs.push_back(make_pair(aabb3f(center - qvec3f(1,1,1), center + qvec3f(1,1,1)), i));
+    }
+    objs.push_back(make_pair(aabb3f(qvec3f(-4096,-4096,-4096), qvec3f(4096,4096,4096)), 5000));
+
+    const auto octree = makeOctree(objs);
+
+    vector<int> res { -1 }; // queries append
+    for (int i=0; i<static_cast<int>(objs.size()); i += 97) {
+        res.resize(1);
+        octree.queryTouchingBBox(objs[i].first, res);
+
+        vector<int> expected { -1 };
+        for (const auto &obj : objs) {
+            if (!objs[i].first.disjoint(obj.first))
+                expected.push_back(obj.second);
+        }
+        EXPECT_EQ(expected, res);
+    }
+}
+
 TEST(qvec, matrix2x2inv) {
     std::mt19937 engine(0);
     std::uniform_real_distribution<float> dis(-4096, 4096);
@@ -1065,6 +1133,96 @@ TEST(qvec, matrix4x4inv) {
     ASSERT_TRUE(std::isnan(nanMat.at(0, 0)));
 }
 
+TEST(qvec, matrix4x4mul) {
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> dis(-4096, 4096);
+
+    qmat4x4f a, b;
+    qvec4f vec;
+    for (int i=0; i<4; i++) {
+        for (int j=0; j<4; j++) {
+            a.at(i,j) = dis(engine);
+            b.at(i,j) = dis(engine);
+        }
+        vec[i] = dis(engine);
+    }
+
+    // the generic loops' sums, in their order
+    const qvec4f av = a * vec;
+    const qmat4x4f ab = a * b;
+    for (int i=0; i<4; i++) {
+        float expv = 0;
+        for (int k=0; k<4; k++)
+            expv += a.at(i,k) * vec[k];
+        EXPECT_FLOAT_EQ(expv, av[i]);
+
+        for (int j=0; j<4; j++) {
+            float exp = 0;
+            for (int k=0; k<4; k++)
+                exp += a.at(i,k) * b.at(k,j);
+            EXPECT_FLOAT_EQ(exp, ab.at(i,j));
+        }
+    }
+
+    EXPECT_FLOAT_EQ(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2] + vec[3] * vec[3], qv::dot(vec, vec));
+}
+
+TEST(qvec, transformPoints) {
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<float> dis(-4096, 4096);
+
+    qmat4x4f m;
+    for (int i=0; i<3; i++)
+        for (int j=0; j<4; j++)
+            m.at(i,j) = dis(engine);
+
+    std::vector<qvec3f> points(7);
+    for (auto &point : points)
+        point = qvec3f(dis(engine), dis(engine), dis(engine));
+
+    std::vector<qvec3f> out(points.size());
+    qv::transformPoints(m, points.data(), out.data(), points.size());
+    for (size_t i=0; i<points.size(); i++) {
+        const qvec4f exp = m * qvec4f(points[i], 1.0f);
+        EXPECT_EQ(exp.xyz(), out[i]);
+    }
+
+    // in place
+    qv::transformPoints(m, points.data(), points.data(), points.size());
+    EXPECT_EQ(out, points);
+}
+
+static void SaveDicedWinding(polylib::winding_t *w, void *userinfo)
+{
+    static_cast<std::vector<std::vector<qvec3f>> *>(userinfo)->push_back(polylib::GLM_WindingPoints(w));
+    free(w);
+}
+
+TEST(polylib, DiceWindingBuf) {
+    // a 200x130 quad, tilted so each piece is cut on two axes
+    const vec3_t normal = { 0, 0.6, 0.8 };
+    polylib::winding_t *w = polylib::BaseWindingForPlane(normal, 10);
+    const vec3_t clips[4] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 } };
+    const vec_t dists[4] = { -100, -100, -65, -65 };
+    for (int i=0; i<4; i++)
+        w = polylib::ChopWinding(w, const_cast<vec_t *>(clips[i]), dists[i]);
+    ASSERT_NE(nullptr, w);
+
+    std::vector<polylib::winding_buf_t> diced;
+    polylib::DiceWindingBuf(w, 64, &diced);
+
+    // the same pieces as DiceWinding, in the same order
+    std::vector<std::vector<qvec3f>> expected;
+    polylib::DiceWinding(polylib::CopyWinding(w), 64, SaveDicedWinding, &expected);
+    ASSERT_GT(expected.size(), 4u);
+    ASSERT_EQ(expected.size(), diced.size());
+    for (size_t i=0; i<diced.size(); i++) {
+        EXPECT_EQ(expected[i], polylib::GLM_WindingPoints(diced[i].get()));
+    }
+
+    free(w);
+}
+
 TEST(trace, clamp_texcoord_small) {
     // positive
     EXPECT_EQ(0, clamp_texcoord(0.0f, 2));
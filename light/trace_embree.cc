@@ -23,12 +23,16 @@
 #include <light/ltface.hh>
 #include <common/bsputils.hh>
 #include <common/polylib.hh>
+#include <common/memstats.hh>
+#include <common/timing.hh>
 #include <embree3/rtcore.h>
 #include <embree3/rtcore_ray.h>
 #include <vector>
 #include <cassert>
+#include <cerrno>
 #include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 
 #ifdef _MSC_VER
@@ -38,12 +42,33 @@
 using namespace std;
 using namespace polylib;
 
+/* What the filter function needs to know about a triangle, worked out once up front */
+enum trifilterflags_t : uint8_t {
+    TRI_NOMODEL         = 1 << 0, // "skip" face with no associated model
+    TRI_SHADOWWORLDONLY = 1 << 1,
+    TRI_SHADOWSELF      = 1 << 2,
+    TRI_DYNAMIC         = 1 << 3, // switchable shadow caster
+    TRI_FENCE           = 1 << 4,
+    TRI_GLASS           = 1 << 5,
+};
+
+struct trifilter_t {
+    uint8_t flags;
+    int style;   // switchshadstyle, for TRI_DYNAMIC
+    float alpha; // before texture alpha, for TRI_GLASS
+};
+
 class sceneinfo {
 public:
     unsigned geomID;
 
+    /* embree's own buffers: 4 floats a vertex, 3 vertex indices a triangle */
+    const float *vertices = nullptr;
+    const int *triangles = nullptr;
+
     std::vector<const bsp2_dface_t *> triToFace;
     std::vector<const modelinfo_t *> triToModelinfo;
+    std::vector<trifilter_t> triToFilter;
 };
 
 class raystream_embree_common_t;
@@ -84,8 +109,47 @@ Face_Alpha(const modelinfo_t *modelinfo, const bsp2_dface_t *face)
     return modelinfo->alpha.floatValue();
 }
 
+static trifilter_t
+Embree_TriFilter(const mbsp_t *bsp, const modelinfo_t *modelinfo, const bsp2_dface_t *face)
+{
+    trifilter_t f { 0, 0, 1.0f };
+
+    if (!modelinfo) {
+        f.flags |= TRI_NOMODEL;
+        return f;
+    }
+    if (modelinfo->shadowworldonly.boolValue())
+        f.flags |= TRI_SHADOWWORLDONLY;
+    if (modelinfo->shadowself.boolValue())
+        f.flags |= TRI_SHADOWSELF;
+    if (modelinfo->switchableshadow.boolValue()) {
+        f.flags |= TRI_DYNAMIC;
+        f.style = modelinfo->switchshadstyle.intValue();
+    }
+
+    f.alpha = Face_Alpha(modelinfo, face);
+
+    //mxd
+    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+        const int surf_flags = Face_ContentsOrSurfaceFlags(bsp, face);
+        if ((surf_flags & Q2_SURF_TRANSLUCENT) == Q2_SURF_TRANSLUCENT) { // KMQuake 2-specific. Use texture alpha chanel when both flags are set.
+            f.flags |= TRI_FENCE;
+        } else if (surf_flags & Q2_SURF_TRANSLUCENT) {
+            f.flags |= TRI_GLASS;
+            f.alpha = (surf_flags & Q2_SURF_TRANS33 ? 0.66f : 0.33f);
+        }
+    } else {
+        const char *name = Face_TextureName(bsp, face);
+        if (name[0] == '{')
+            f.flags |= TRI_FENCE;
+        if (f.alpha < 1.0f)
+            f.flags |= TRI_GLASS;
+    }
+    return f;
+}
+
 sceneinfo
-CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const bsp2_dface_t *> &faces)
+CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const bsp2_dface_t *> &faces, bool withfilter = false)
 {
     // count triangles
     int numtris = 0;
@@ -124,6 +188,8 @@ CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std:
     
     // fill in triangles
     Triangle* triangles = (Triangle*) rtcSetNewGeometryBuffer(geom_0,RTC_BUFFER_TYPE_INDEX,0,RTC_FORMAT_UINT3,3*sizeof(int),numtris);
+    s.vertices = reinterpret_cast<const float *>(vertices);
+    s.triangles = reinterpret_cast<const int *>(triangles);
     int tri_index = 0;
     for (const bsp2_dface_t *face : faces) {
         if (face->numedges < 3)
@@ -142,6 +208,11 @@ CreateGeometry(const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std:
             s.triToFace.push_back(face);
             s.triToModelinfo.push_back(modelinfo);
         }
+        
+        if (withfilter) {
+            const trifilter_t filter = Embree_TriFilter(bsp, modelinfo, face);
+            s.triToFilter.insert(s.triToFilter.end(), face->numedges - 2, filter);
+        }
     }
     
     
@@ -277,6 +348,7 @@ enum class filtertype_t {
 
 void AddGlassToRay(RTCIntersectContext* context, unsigned rayIndex, float opacity, const vec3_t glasscolor);
 void AddDynamicOccluderToRay(RTCIntersectContext* context, unsigned rayIndex, int style);
+void AddOccluderToRay(RTCIntersectContext* context, unsigned rayIndex, unsigned geomID, unsigned primID);
 
 // called to evaluate transparency
 template<filtertype_t filtertype>
@@ -302,22 +374,24 @@ Embree_FilterFuncN(const struct RTCFilterFunctionNArguments* args)
         }
         
         const unsigned &rayID = RTCRayN_id(ray, N, i);
-        const unsigned &geomID = RTCHitN_geomID(potentialHit, N, i);
         const unsigned &primID = RTCHitN_primID(potentialHit, N, i);
         
         // unpack ray index
         const unsigned rayIndex = rayID;
         
-        const modelinfo_t *source_modelinfo = rsi->self;
-        const modelinfo_t *hit_modelinfo = Embree_LookupModelinfo(geomID, primID);
-        if (!hit_modelinfo) {
+        // only filtergeom has this filter function set
+        const trifilter_t &filter = filtergeom.triToFilter[primID];
+        
+        if (filter.flags & TRI_NOMODEL) {
             // we hit a "skip" face with no associated model
             // reject hit (???)
             valid[i] = INVALID;
             continue;
         }
         
-        if (hit_modelinfo->shadowworldonly.boolValue()) {
+        const modelinfo_t *source_modelinfo = rsi->self;
+        
+        if (filter.flags & TRI_SHADOWWORLDONLY) {
             // we hit "_shadowworldonly" "1" geometry. Ignore the hit unless we are from world.
             if (!source_modelinfo || !source_modelinfo->isWorld()) {
                 // reject hit
@@ -326,22 +400,19 @@ Embree_FilterFuncN(const struct RTCFilterFunctionNArguments* args)
             }
         }
         
-        if (hit_modelinfo->shadowself.boolValue()) {
+        if (filter.flags & TRI_SHADOWSELF) {
             // only casts shadows on itself
-            if (source_modelinfo != hit_modelinfo) {
+            if (source_modelinfo != filtergeom.triToModelinfo[primID]) {
                 // reject hit
                 valid[i] = INVALID;
                 continue;
             }
         }
         
-        if (hit_modelinfo->switchableshadow.boolValue()) {
+        if (filter.flags & TRI_DYNAMIC) {
             // we hit a dynamic shadow caster. reject the hit, but store the
             // info about what we hit.
-            
-            const int style = hit_modelinfo->switchshadstyle.intValue();
-            
-            AddDynamicOccluderToRay(context, rayIndex, style);
+            AddDynamicOccluderToRay(context, rayIndex, filter.style);
             
             // reject hit
             valid[i] = INVALID;
@@ -349,26 +420,14 @@ Embree_FilterFuncN(const struct RTCFilterFunctionNArguments* args)
         }
         
         // test fence textures and glass
-        const bsp2_dface_t *face = Embree_LookupFace(geomID, primID);
-        float alpha = Face_Alpha(hit_modelinfo, face);
-
-        //mxd
-        bool isFence, isGlass;
-        if(bsp_static->loadversion->game->id == GAME_QUAKE_II) {
-            const int surf_flags = Face_ContentsOrSurfaceFlags(bsp_static, face);
-            isFence = ((surf_flags & Q2_SURF_TRANSLUCENT) == Q2_SURF_TRANSLUCENT); // KMQuake 2-specific. Use texture alpha chanel when both flags are set.
-            isGlass = !isFence && (surf_flags & Q2_SURF_TRANSLUCENT);
-            if(isGlass)
-                alpha = (surf_flags & Q2_SURF_TRANS33 ? 0.66f : 0.33f);
-        } else {
-            const char *name = Face_TextureName(bsp_static, face);
-            isFence = (name[0] == '{');
-            isGlass = (alpha < 1.0f);
-        }
+        const bool isFence = (filter.flags & TRI_FENCE) != 0;
+        const bool isGlass = (filter.flags & TRI_GLASS) != 0;
+        float alpha = filter.alpha;
         
         if (isFence || isGlass) {
             vec3_t hitpoint;
             Embree_RayEndpoint(ray, N, i, hitpoint);
+            const bsp2_dface_t *face = filtergeom.triToFace[primID];
             const color_rgba sample = SampleTexture(face, bsp_static, hitpoint); //mxd. Palette index -> color_rgba
         
             if (isGlass) {
@@ -422,6 +481,23 @@ Embree_FilterFuncN(const struct RTCFilterFunctionNArguments* args)
     }
 }
 
+// set on the sky and solid geometry, which always occlude, to note which triangle did
+static void
+Embree_OccluderFuncN(const struct RTCFilterFunctionNArguments* args)
+{
+    const ray_source_info *rsi = static_cast<const ray_source_info *>(args->context);
+    if (rsi->raystream == nullptr)
+        return;
+    
+    for (size_t i=0; i<args->N; i++) {
+        if (args->valid[i] != -1)
+            continue;
+        
+        AddOccluderToRay(args->context, RTCRayN_id(args->ray, args->N, i),
+                         RTCHitN_geomID(args->hit, args->N, i), RTCHitN_primID(args->hit, args->N, i));
+    }
+}
+
 // building faces for skip-textured bmodels
 
 #if 0
@@ -512,32 +588,27 @@ Leaf_MakeFaces(const mbsp_t *bsp, const mleaf_t *leaf, const std::vector<plane_t
         VectorScale(plane.normal, -1, faceplane.normal);
         faceplane.dist = -plane.dist;
         
-        winding_t *winding = BaseWindingForPlane(faceplane.normal, faceplane.dist);
+        // clipped in place, only the finished face is allocated
+        winding_buf_t winding;
+        BaseWindingForPlaneBuf(faceplane.normal, faceplane.dist, &winding);
         
         // clip `winding` by all of the other planes
         for (const plane_t &plane2 : planes) {
             if (&plane2 == &plane)
                 continue;
             
-            winding_t *front = nullptr;
-            winding_t *back = nullptr;
-            
-            // frees winding.
-            ClipWinding(winding, plane2.normal, plane2.dist, &front, &back);
-            
             // discard the back, continue clipping the front part
-            free(back);
-            winding = front;
+            ClipWindingBuf(winding.get(), plane2.normal, plane2.dist, &winding, nullptr);
             
             // check if everything was clipped away
-            if (winding == nullptr)
+            if (!winding.numpoints)
                 break;
         }
         
-        if (winding == nullptr) {
+        if (!winding.numpoints) {
             //logprint("WARNING: winding clipped away\n");
         } else {
-            result.push_back(winding);
+            result.push_back(CopyWinding(winding.get()));
         }
     }
     
@@ -594,13 +665,18 @@ MakeFaces(const mbsp_t *bsp, const dmodel_t *model)
     return result;
 }
 
-void
-Embree_TraceInit(const mbsp_t *bsp)
-{
-    bsp_static = bsp;
-    Q_assert(device == nullptr);
-    
+/* the faces and windings that go into the scene, before any Embree calls */
+struct embreegeom_t {
     std::vector<const bsp2_dface_t *> skyfaces, solidfaces, filterfaces;
+    std::vector<winding_t *> skipwindings;
+};
+
+static void
+Embree_ClassifyFaces(const mbsp_t *bsp, embreegeom_t *geom)
+{
+    std::vector<const bsp2_dface_t *> &skyfaces = geom->skyfaces;
+    std::vector<const bsp2_dface_t *> &solidfaces = geom->solidfaces;
+    std::vector<const bsp2_dface_t *> &filterfaces = geom->filterfaces;
     
     // check all modelinfos
     for (int mi = 0; mi<bsp->nummodels; mi++) {
@@ -693,18 +769,237 @@ Embree_TraceInit(const mbsp_t *bsp)
     }
 
     /* Special handling of skip-textured bmodels */
-    std::vector<winding_t *> skipwindings;
     for (const modelinfo_t *model : tracelist) {
         if (model->model->numfaces == 0) {
             std::vector<winding_t *> windings = MakeFaces(bsp, model->model);
             for (auto &w : windings) {
-                skipwindings.push_back(w);
+                geom->skipwindings.push_back(w);
             }
         }
     }
+}
+
+#define EMBREECACHE_VERSION ('L' << 24 | 'E' << 16 | 'C' << 8 | '1')
+
+/* like the point cache, a local build artifact written in native byte order */
+typedef struct {
+    uint32_t version;
+    uint32_t numskyfaces;
+    uint32_t numsolidfaces;
+    uint32_t numfilterfaces;
+    uint32_t numskipwindings;
+    uint64_t key;
+} dembreecache_t;
+
+template <typename T>
+static void
+Hash_Value(uint64_t *hash, const T &value)
+{
+    FNV_HashBytes(hash, &value, sizeof(value));
+}
+
+/*
+ * Hashes everything Embree_ClassifyFaces depends on: the face geometry and
+ * textures, the node/leaf tree MakeFaces walks for skip bmodels, and the
+ * shadow keys of each model.
+ */
+static uint64_t
+Embree_CacheKey(const mbsp_t *bsp)
+{
+    uint64_t hash = FNV_HASH_INIT;
+
+    Hash_Value(&hash, bsp->loadversion->game->id);
+    Hash_Value(&hash, sizeof(vec_t));
+
+    FNV_HashBytes(&hash, bsp->dvertexes, sizeof(*bsp->dvertexes) * bsp->numvertexes);
+    FNV_HashBytes(&hash, bsp->dedges, sizeof(*bsp->dedges) * bsp->numedges);
+    FNV_HashBytes(&hash, bsp->dsurfedges, sizeof(*bsp->dsurfedges) * bsp->numsurfedges);
+    FNV_HashBytes(&hash, bsp->dplanes, sizeof(*bsp->dplanes) * bsp->numplanes);
+    FNV_HashBytes(&hash, bsp->dnodes, sizeof(*bsp->dnodes) * bsp->numnodes);
+    FNV_HashBytes(&hash, bsp->dmodels, sizeof(*bsp->dmodels) * bsp->nummodels);
+
+    for (int i = 0; i < bsp->numleafs; i++)
+        Hash_Value(&hash, bsp->dleafs[i].contents);
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        Hash_Value(&hash, face->firstedge);
+        Hash_Value(&hash, face->numedges);
+        Hash_Value(&hash, face->texinfo);
+        Hash_Value(&hash, Face_ContentsOrSurfaceFlags(bsp, face));
+
+        const char *texname = Face_TextureName(bsp, face);
+        FNV_HashBytes(&hash, texname, strlen(texname));
+    }
+
+    for (int i = 0; i < bsp->numtexinfo; i++) {
+        const surfflags_t &flags = extended_texinfo_flags[i];
+        Hash_Value(&hash, flags.extended);
+        Hash_Value(&hash, flags.light_alpha);
+        Hash_Value(&hash, bsp->texinfo[i].value);
+    }
+
+    for (int i = 0; i < bsp->nummodels; i++) {
+        const modelinfo_t *info = ModelInfoForModel(bsp, i);
+        Hash_Value(&hash, info->shadow.boolValue());
+        Hash_Value(&hash, info->shadowself.boolValue());
+        Hash_Value(&hash, info->shadowworldonly.boolValue());
+        Hash_Value(&hash, info->switchableshadow.boolValue());
+        Hash_Value(&hash, info->alpha.floatValue());
+    }
+
+    for (const modelinfo_t *info : tracelist)
+        Hash_Value(&hash, static_cast<int32_t>(info->model - bsp->dmodels));
+
+    Hash_Value(&hash, arghradcompat);
+
+    return hash;
+}
+
+static bool
+Embree_ReadFaceList(FILE *f, const mbsp_t *bsp, uint32_t count, std::vector<const bsp2_dface_t *> *faces)
+{
+    std::vector<int32_t> facenums(count);
+    if (count && fread(facenums.data(), sizeof(int32_t), count, f) != count)
+        return false;
+    for (int32_t facenum : facenums) {
+        if (facenum < 0 || facenum >= bsp->numfaces)
+            return false;
+        faces->push_back(BSP_GetFace(bsp, facenum));
+    }
+    return true;
+}
+
+static bool
+Embree_LoadCache(const mbsp_t *bsp, const char *filename, uint64_t key, embreegeom_t *geom)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+
+    dembreecache_t header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+        && header.version == EMBREECACHE_VERSION
+        && header.key == key
+        && Embree_ReadFaceList(f, bsp, header.numskyfaces, &geom->skyfaces)
+        && Embree_ReadFaceList(f, bsp, header.numsolidfaces, &geom->solidfaces)
+        && Embree_ReadFaceList(f, bsp, header.numfilterfaces, &geom->filterfaces);
+
+    for (uint32_t i = 0; ok && i < header.numskipwindings; i++) {
+        int32_t numpoints;
+        if (fread(&numpoints, sizeof(numpoints), 1, f) != 1
+            || numpoints < 3 || numpoints > MAX_POINTS_ON_WINDING) {
+            ok = false;
+            break;
+        }
+        winding_t *w = AllocWinding(numpoints);
+        w->numpoints = numpoints;
+        geom->skipwindings.push_back(w);
+        if (fread(w->p, sizeof(vec3_t), numpoints, f) != static_cast<size_t>(numpoints))
+            ok = false;
+    }
+    fclose(f);
+
+    if (!ok) {
+        geom->skyfaces.clear();
+        geom->solidfaces.clear();
+        geom->filterfaces.clear();
+        FreeWindings(geom->skipwindings);
+        geom->skipwindings.clear();
+    }
+    return ok;
+}
+
+static void
+Embree_WriteFaceList(FILE *f, const mbsp_t *bsp, const std::vector<const bsp2_dface_t *> &faces)
+{
+    for (const bsp2_dface_t *face : faces) {
+        const int32_t facenum = Face_GetNum(bsp, face);
+        SafeWrite(f, &facenum, sizeof(facenum));
+    }
+}
+
+static void
+Embree_SaveCache(const mbsp_t *bsp, const char *filename, uint64_t key, const embreegeom_t &geom)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        logprint("WARNING: couldn't write embree cache %s: %s\n", filename, strerror(errno));
+        return;
+    }
+
+    dembreecache_t header;
+    header.version = EMBREECACHE_VERSION;
+    header.numskyfaces = geom.skyfaces.size();
+    header.numsolidfaces = geom.solidfaces.size();
+    header.numfilterfaces = geom.filterfaces.size();
+    header.numskipwindings = geom.skipwindings.size();
+    header.key = key;
+    SafeWrite(f, &header, sizeof(header));
+
+    Embree_WriteFaceList(f, bsp, geom.skyfaces);
+    Embree_WriteFaceList(f, bsp, geom.solidfaces);
+    Embree_WriteFaceList(f, bsp, geom.filterfaces);
+
+    for (const winding_t *w : geom.skipwindings) {
+        const int32_t numpoints = w->numpoints;
+        SafeWrite(f, &numpoints, sizeof(numpoints));
+        SafeWrite(f, w->p, sizeof(vec3_t) * numpoints);
+    }
+    fclose(f);
+}
+
+static RTCBuildQuality
+Embree_BuildQuality(void)
+{
+    switch (embreequality) {
+    case 0: return RTC_BUILD_QUALITY_LOW;
+    case 1: return RTC_BUILD_QUALITY_MEDIUM;
+    default: return RTC_BUILD_QUALITY_HIGH;
+    }
+}
+
+static memcounter_t embreemem("Embree scenes");
+
+static bool
+Embree_MemoryMonitor(void *userPtr, ssize_t bytes, bool post)
+{
+    embreemem.add(bytes);
+    return true;
+}
+
+void
+Embree_TraceInit(const mbsp_t *bsp)
+{
+    bsp_static = bsp;
+    Q_assert(device == nullptr);
+    
+    embreegeom_t geom;
+    if (embreecache) {
+        char filename[1024];
+        q_snprintf(filename, sizeof(filename), "%s", mapfilename);
+        StripExtension(filename);
+        DefaultExtension(filename, ".embree");
+        
+        const uint64_t key = Embree_CacheKey(bsp);
+        if (Embree_LoadCache(bsp, filename, key, &geom)) {
+            logprint("Embree_TraceInit: using cached geometry from %s\n", filename);
+        } else {
+            Embree_ClassifyFaces(bsp, &geom);
+            Embree_SaveCache(bsp, filename, key, geom);
+        }
+    } else {
+        Embree_ClassifyFaces(bsp, &geom);
+    }
+    
+    const std::vector<const bsp2_dface_t *> &skyfaces = geom.skyfaces;
+    const std::vector<const bsp2_dface_t *> &solidfaces = geom.solidfaces;
+    const std::vector<const bsp2_dface_t *> &filterfaces = geom.filterfaces;
+    std::vector<winding_t *> &skipwindings = geom.skipwindings;
     
     device = rtcNewDevice (NULL);
     rtcSetDeviceErrorFunction(device,ErrorCallback,nullptr); //mxd. Changed from rtcDeviceSetErrorFunction to silence compiler warning...
+    rtcSetDeviceMemoryMonitorFunction(device, Embree_MemoryMonitor, nullptr);
     
     // log version
     const size_t ver_maj = rtcGetDeviceProperty (device,RTC_DEVICE_PROPERTY_VERSION_MAJOR);
@@ -714,15 +1009,19 @@ Embree_TraceInit(const mbsp_t *bsp)
              static_cast<int>(ver_maj), static_cast<int>(ver_min), static_cast<int>(ver_pat));
 
     scene = rtcNewScene(device);
-    rtcSetSceneFlags(scene,RTC_SCENE_FLAG_NONE);
-    rtcSetSceneBuildQuality(scene,RTC_BUILD_QUALITY_HIGH);
+    rtcSetSceneFlags(scene, embreecompact ? RTC_SCENE_FLAG_COMPACT : RTC_SCENE_FLAG_NONE);
+    rtcSetSceneBuildQuality(scene, Embree_BuildQuality());
     skygeom = CreateGeometry(bsp, device, scene, skyfaces);
     solidgeom = CreateGeometry(bsp, device, scene, solidfaces);
-    filtergeom = CreateGeometry(bsp, device, scene, filterfaces);
+    filtergeom = CreateGeometry(bsp, device, scene, filterfaces, true);
     CreateGeometryFromWindings(device, scene, skipwindings);
     
     rtcSetGeometryIntersectFilterFunction(rtcGetGeometry(scene,filtergeom.geomID),Embree_FilterFuncN<filtertype_t::INTERSECTION>);
     rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene,filtergeom.geomID),Embree_FilterFuncN<filtertype_t::OCCLUSION>);
+    if (occludercache) {
+        rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene,skygeom.geomID),Embree_OccluderFuncN);
+        rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene,solidgeom.geomID),Embree_OccluderFuncN);
+    }
     
     rtcCommitScene(scene);
     
@@ -877,6 +1176,44 @@ static void q_aligned_free(void *ptr)
 #endif
 }
 
+static const RTCRay &RayOf(const RTCRay &ray) { return ray; }
+static const RTCRay &RayOf(const RTCRayHit &rayhit) { return rayhit.ray; }
+
+static int RayOctant(const RTCRay &ray)
+{
+    return (ray.dir_x < 0.0f) | ((ray.dir_y < 0.0f) << 1) | ((ray.dir_z < 0.0f) << 2);
+}
+
+/*
+ * Our contexts are flagged coherent, so Embree traces consecutive stream
+ * rays as SIMD packets, as wide as the ISA it picked at startup allows.
+ * A packet only stays full down the BVH while its rays share a direction
+ * octant, so this fills `sorted` with the rays grouped by octant (keeping
+ * push order within each). Returns false, leaving `sorted` alone, if
+ * every ray is already in one octant, as sun rays always are.
+ */
+template <typename T>
+static bool SortRaysByOctant(T *rays, int numrays, std::vector<T *> &sorted)
+{
+    int starts[9] = {0};
+    for (int i = 0; i < numrays; i++) {
+        starts[RayOctant(RayOf(rays[i])) + 1]++;
+    }
+    for (int o = 0; o < 8; o++) {
+        if (starts[o + 1] == numrays)
+            return false;
+    }
+    for (int o = 1; o < 9; o++) {
+        starts[o] += starts[o - 1];
+    }
+
+    sorted.resize(numrays);
+    for (int i = 0; i < numrays; i++) {
+        sorted[starts[RayOctant(RayOf(rays[i]))]++] = &rays[i];
+    }
+    return true;
+}
+
 class raystream_embree_common_t : public virtual raystream_common_t {
 public:
     float *_rays_maxdist;
@@ -890,6 +1227,11 @@ public:
     // straight through).
     int *_ray_dynamic_styles;
     
+    // the sky or solid triangle that occluded the ray, for the occluder cache
+    struct occluder_t {
+        unsigned geomID, primID;
+    } *_ray_occluders;
+    
     int _numrays;
     int _maxrays;
 //    streamstate_t _state;
@@ -901,6 +1243,7 @@ public:
         _ray_colors { static_cast<vec3_t *>(calloc(maxRays, sizeof(vec3_t))) },
         _ray_normalcontribs { static_cast<vec3_t *>(calloc(maxRays, sizeof(vec3_t))) },
         _ray_dynamic_styles { new int[maxRays] },
+        _ray_occluders { new occluder_t[maxRays] },
         _numrays { 0 },
         _maxrays { maxRays } {}
         //,
@@ -912,6 +1255,7 @@ public:
         free(_ray_colors);
         free(_ray_normalcontribs);
         delete[] _ray_dynamic_styles;
+        delete[] _ray_occluders;
     }
     
     size_t numPushedRays() override {
@@ -949,6 +1293,7 @@ public:
 class raystream_embree_intersection_t : public raystream_embree_common_t, public raystream_intersection_t {
 public:
     RTCRayHit *_rays;
+    std::vector<RTCRayHit *> _sorted_rays;
 public:
     raystream_embree_intersection_t(int maxRays) :
     raystream_embree_common_t(maxRays),
@@ -972,6 +1317,7 @@ public:
             VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
         }
         _ray_dynamic_styles[_numrays] = 0;
+        _ray_occluders[_numrays] = { RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID };
         _numrays++;
     }
 
@@ -979,8 +1325,12 @@ public:
         if (!_numrays)
             return;
         
+        // results land in _rays either way; ray.id keeps each ray's push index
         ray_source_info ctx2(this, self);
-        rtcIntersect1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
+        if (SortRaysByOctant(_rays, _numrays, _sorted_rays))
+            rtcIntersect1Mp(scene, &ctx2, _sorted_rays.data(), _numrays);
+        else
+            rtcIntersect1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
     }
 
     void getPushedRayDir(size_t j, vec3_t out) override {
@@ -1024,9 +1374,191 @@ public:
     }
 };
 
+/* the same, for a list of rays to trace with rtcOccluded1Mp */
+static void SortRayPointersByOctant(std::vector<RTCRay *> &rays, std::vector<RTCRay *> &scratch)
+{
+    int starts[9] = {0};
+    for (const RTCRay *ray : rays) {
+        starts[RayOctant(*ray) + 1]++;
+    }
+    for (int o = 1; o < 9; o++) {
+        starts[o] += starts[o - 1];
+    }
+
+    scratch.resize(rays.size());
+    for (RTCRay *ray : rays) {
+        scratch[starts[RayOctant(*ray)]++] = ray;
+    }
+    rays.swap(scratch);
+}
+
+/*
+ * The occluder cache. Neighbouring sample points lit by the same light
+ * are mostly shadowed by the same triangle, so when a group of rays (one
+ * light's rays to one face) is traced, every OCCLUDER_PROBE_STRIDE'th ray
+ * is traced first, and the rest are tested against the sky and solid
+ * triangles that blocked those before going to Embree. A hit on one of
+ * those always occludes, whatever else is along the ray.
+ *
+ * Only hits well inside the triangle and the ray count, so rays that
+ * graze an edge are left to Embree and the result is the same as tracing
+ * everything.
+ */
+#define OCCLUDER_PROBE_STRIDE   8
+#define OCCLUDER_MIN_RAYS       (4 * OCCLUDER_PROBE_STRIDE)   // smaller groups are traced in full
+#define OCCLUDER_CACHE_SIZE     4
+#define OCCLUDER_EDGE_EPSILON   1e-3    // barycentric
+#define OCCLUDER_DIST_EPSILON   0.01    // units
+
+struct cachedoccluder_t {
+    double v0[3], e1[3], e2[3];
+};
+
+static cachedoccluder_t
+CachedOccluder(unsigned geomID, unsigned primID)
+{
+    const sceneinfo &si = Embree_SceneinfoForGeomID(geomID);
+    const int *tri = &si.triangles[3 * primID];
+    const float *v0 = &si.vertices[4 * tri[0]];
+    const float *v1 = &si.vertices[4 * tri[1]];
+    const float *v2 = &si.vertices[4 * tri[2]];
+    
+    cachedoccluder_t occluder;
+    for (int k = 0; k < 3; k++) {
+        occluder.v0[k] = v0[k];
+        occluder.e1[k] = v1[k] - v0[k];
+        occluder.e2[k] = v2[k] - v0[k];
+    }
+    return occluder;
+}
+
+static inline void
+CrossProductD(const double *a, const double *b, double *out)
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static inline double
+DotProductD(const double *a, const double *b)
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/* Moller-Trumbore, in doubles, against the interior of the triangle */
+static bool
+RayHitsOccluder(const RTCRay &ray, const cachedoccluder_t &occluder)
+{
+    const double dir[3] { ray.dir_x, ray.dir_y, ray.dir_z };
+    double p[3];
+    CrossProductD(dir, occluder.e2, p);
+    const double det = DotProductD(occluder.e1, p);
+    if (fabs(det) < 1e-12)
+        return false;
+    const double invdet = 1.0 / det;
+    
+    const double s[3] { ray.org_x - occluder.v0[0], ray.org_y - occluder.v0[1], ray.org_z - occluder.v0[2] };
+    const double u = DotProductD(s, p) * invdet;
+    if (u < OCCLUDER_EDGE_EPSILON || u > 1.0 - OCCLUDER_EDGE_EPSILON)
+        return false;
+    
+    double q[3];
+    CrossProductD(s, occluder.e1, q);
+    const double v = DotProductD(dir, q) * invdet;
+    if (v < OCCLUDER_EDGE_EPSILON || u + v > 1.0 - OCCLUDER_EDGE_EPSILON)
+        return false;
+    
+    const double t = DotProductD(occluder.e2, q) * invdet;
+    return t > ray.tnear + OCCLUDER_DIST_EPSILON && t < ray.tfar - OCCLUDER_DIST_EPSILON;
+}
+
 class raystream_embree_occlusion_t : public raystream_embree_common_t, public raystream_occlusion_t {
 public:
     RTCRay *_rays;
+    std::vector<RTCRay *> _sorted_rays;
+    std::vector<int> _groups;   // the first ray of each occluder group
+    std::vector<RTCRay *> _traced, _traced_sorted;
+    
+private:
+    void traceRays(ray_source_info *ctx, std::vector<RTCRay *> &rays) {
+        if (rays.empty())
+            return;
+        SortRayPointersByOctant(rays, _traced_sorted);
+        rtcOccluded1Mp(scene, ctx, rays.data(), rays.size());
+    }
+    
+    /* the probes of group [first, last) have been traced; tests the rest against their occluders */
+    int testCachedOccluders(int first, int last) {
+        cachedoccluder_t cache[OCCLUDER_CACHE_SIZE];
+        occluder_t cached[OCCLUDER_CACHE_SIZE];
+        int numcached = 0;
+        for (int j = first; j < last && numcached < OCCLUDER_CACHE_SIZE; j += OCCLUDER_PROBE_STRIDE) {
+            const occluder_t &occluder = _ray_occluders[j];
+            if (_rays[j].tfar >= 0.0f || occluder.geomID == RTC_INVALID_GEOMETRY_ID)
+                continue;
+            
+            int k;
+            for (k = 0; k < numcached; k++)
+                if (cached[k].geomID == occluder.geomID && cached[k].primID == occluder.primID)
+                    break;
+            if (k == numcached) {
+                cached[numcached] = occluder;
+                cache[numcached++] = CachedOccluder(occluder.geomID, occluder.primID);
+            }
+        }
+        
+        int hits = 0;
+        for (int j = first; j < last; j++) {
+            if ((j - first) % OCCLUDER_PROBE_STRIDE == 0)
+                continue;
+            
+            int k;
+            for (k = 0; k < numcached; k++)
+                if (RayHitsOccluder(_rays[j], cache[k]))
+                    break;
+            if (k == numcached) {
+                _traced.push_back(&_rays[j]);
+                continue;
+            }
+            
+            // occluded, as Embree reports it; the last hit is tried first next time
+            _rays[j].tfar = -std::numeric_limits<float>::infinity();
+            std::swap(cache[0], cache[k]);
+            hits++;
+        }
+        return hits;
+    }
+    
+    void traceWithOccluderCache(ray_source_info *ctx) {
+        const auto grouplast = [&](size_t g) { return g + 1 < _groups.size() ? _groups[g + 1] : _numrays; };
+        
+        _traced.clear();
+        for (size_t g = 0; g < _groups.size(); g++) {
+            if (grouplast(g) - _groups[g] < OCCLUDER_MIN_RAYS)
+                continue;
+            for (int j = _groups[g]; j < grouplast(g); j += OCCLUDER_PROBE_STRIDE)
+                _traced.push_back(&_rays[j]);
+        }
+        traceRays(ctx, _traced);
+        
+        _traced.clear();
+        for (int j = 0; j < _groups[0]; j++)
+            _traced.push_back(&_rays[j]);
+        int hits = 0;
+        for (size_t g = 0; g < _groups.size(); g++) {
+            if (grouplast(g) - _groups[g] < OCCLUDER_MIN_RAYS) {
+                for (int j = _groups[g]; j < grouplast(g); j++)
+                    _traced.push_back(&_rays[j]);
+                continue;
+            }
+            hits += testCachedOccluders(_groups[g], grouplast(g));
+        }
+        traceRays(ctx, _traced);
+        
+        Timing_Count("occluder cache hits", hits);
+    }
+    
 public:
     raystream_embree_occlusion_t(int maxRays) :
     raystream_embree_common_t(maxRays),
@@ -1049,6 +1581,7 @@ public:
             VectorCopy(normalcontrib, _ray_normalcontribs[_numrays]);
         }
         _ray_dynamic_styles[_numrays] = 0;
+        _ray_occluders[_numrays] = { RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID };
         _numrays++;
     }
 
@@ -1059,7 +1592,12 @@ public:
             return;
 
         ray_source_info ctx2(this, self);
-        rtcOccluded1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
+        if (!_groups.empty())
+            traceWithOccluderCache(&ctx2);
+        else if (SortRaysByOctant(_rays, _numrays, _sorted_rays))
+            rtcOccluded1Mp(scene, &ctx2, _sorted_rays.data(), _numrays);
+        else
+            rtcOccluded1M(scene, &ctx2, _rays, _numrays, sizeof(_rays[0]));
     }
 
     bool getPushedRayOccluded(size_t j) override {
@@ -1067,6 +1605,16 @@ public:
         return (_rays[j].tfar < 0.0f);
     }
 
+    void startOccluderGroup() override {
+        if (occludercache)
+            _groups.push_back(_numrays);
+    }
+
+    void clearPushedRays() override {
+        raystream_embree_common_t::clearPushedRays();
+        _groups.clear();
+    }
+
     void getPushedRayDir(size_t j, vec3_t out) override {
         Q_assert(j < _maxrays);
 
@@ -1135,3 +1683,12 @@ void AddDynamicOccluderToRay(RTCIntersectContext* context, unsigned rayIndex, in
         ctx->singleRayShadowStyle = style;
     }
 }
+
+void AddOccluderToRay(RTCIntersectContext* context, unsigned rayIndex, unsigned geomID, unsigned primID)
+{
+    ray_source_info *ctx = static_cast<ray_source_info *>(context);
+    raystream_embree_common_t *rs = ctx->raystream;
+    
+    Q_assert(rayIndex < rs->_numrays);
+    rs->_ray_occluders[rayIndex] = { geomID, primID };
+}
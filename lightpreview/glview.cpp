@@ -21,12 +21,27 @@ See file, 'COPYING', for details.
 
 #include <cstdio>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
 
+#include <QFileInfo>
 #include <QMouseEvent>
 #include <QWheelEvent>
 #include <QKeyEvent>
 #include <QTime>
 
+#include <common/bspfile.hh>
+#include <common/bsputils.hh>
+#include <common/cmdlib.hh>
+#include <light/light.hh>
+
+#define LIGHTMAP_SCALE 16       // world units per lightmap sample
+#define RELOAD_DELAY_MS 500     // light writes the .bsp then the .lit, wait for both
+
 GLView::GLView(QWidget *parent)
     : QOpenGLWidget(parent),
     m_keysPressed(0),
@@ -36,24 +51,44 @@ GLView::GLView(QWidget *parent)
     m_cameraOrigin(0, 0, 0),
     m_cameraFwd(0, 1, 0),
     m_vao(),
+    m_ibo(QOpenGLBuffer::IndexBuffer),
+    m_lightmapTexture(0),
     m_program(nullptr),
-    m_program_mvp_location(0)
+    m_program_mvp_location(0),
+    m_program_lightmap_location(0),
+    m_uploadAll(false)
 {
     setFocusPolicy(Qt::StrongFocus); // allow keyboard focus
+
+    m_reloadTimer.setSingleShot(true);
+    m_reloadTimer.setInterval(RELOAD_DELAY_MS);
+    connect(&m_reloadTimer, &QTimer::timeout, this, &GLView::reloadBSP);
+    connect(&m_watcher, &QFileSystemWatcher::fileChanged, this, [this]() { m_reloadTimer.start(); });
 }
 
 GLView::~GLView()
 {
+    // waits out a face being handed over, nothing is queued to us after this
+    SetFaceLitCallback(nullptr);
+
+    makeCurrent();
+    if (m_lightmapTexture)
+        glDeleteTextures(1, &m_lightmapTexture);
     delete m_program;
+    doneCurrent();
 }
 
 static const char *s_fragShader = R"(
 #version 330 core
 
+in vec2 lightmapCoord;
+
 out vec4 color;
 
+uniform sampler2D lightmap;
+
 void main() {
-    color = vec4(1.0, 0.5, 0.2, 1.0);
+    color = vec4(texture(lightmap, lightmapCoord).rgb, 1.0);
 }
 )";
 
@@ -61,14 +96,187 @@ static const char *s_vertShader = R"(
 #version 330 core
 
 layout (location = 0) in vec3 position;
+layout (location = 1) in vec2 lightmapCoordIn;
+
+out vec2 lightmapCoord;
 
 uniform mat4 MVP;
 
 void main() {
     gl_Position = MVP * vec4(position.x, position.y, position.z, 1.0);
+    lightmapCoord = lightmapCoordIn;
 }
 )";
 
+/*
+ * Lightmap samples for one face, as rgb: from the .lit when there's one
+ * that matches, otherwise the bsp's own lightdata (grey in Q1, rgb in Q2).
+ * Only the first style, the one that's always on.
+ */
+static void
+FaceLightmapRGB(const mbsp_t *bsp, const std::vector<uint8_t> &litdata, const bsp2_dface_t *face,
+                int numsamples, uint8_t *out)
+{
+    const bool q2 = (bsp->loadversion->game->id == GAME_QUAKE_II);
+
+    if (!Face_IsLightmapped(bsp, face)) {
+        memset(out, 255, numsamples * 3);       // sky, liquids: fullbright
+        return;
+    }
+    if (face->styles[0] == 255 || face->lightofs < 0) {
+        memset(out, 0, numsamples * 3);
+        return;
+    }
+
+    if (q2) {
+        if (face->lightofs + numsamples * 3 <= bsp->lightdatasize) {
+            memcpy(out, bsp->dlightdata + face->lightofs, numsamples * 3);
+            return;
+        }
+    } else if (!litdata.empty()) {
+        if (static_cast<size_t>(face->lightofs + numsamples) * 3 <= litdata.size()) {
+            memcpy(out, litdata.data() + face->lightofs * 3, numsamples * 3);
+            return;
+        }
+    } else if (face->lightofs + numsamples <= bsp->lightdatasize) {
+        for (int i = 0; i < numsamples; i++)
+            out[i * 3 + 0] = out[i * 3 + 1] = out[i * 3 + 2] = bsp->dlightdata[face->lightofs + i];
+        return;
+    }
+
+    memset(out, 0, numsamples * 3);
+}
+
+/* the .lit next to the bsp, without its header; empty if there isn't a usable one */
+static std::vector<uint8_t>
+LoadLitFile(const QString &bspfile)
+{
+    std::vector<uint8_t> data;
+
+    QFileInfo info(bspfile);
+    const QString litfile = info.path() + "/" + info.completeBaseName() + ".lit";
+    FILE *f = fopen(litfile.toLocal8Bit().constData(), "rb");
+    if (!f)
+        return data;
+
+    char header[8];
+    if (fread(header, sizeof(header), 1, f) == 1 && !memcmp(header, "QLIT", 4)
+        && LittleLong(*reinterpret_cast<int32_t *>(header + 4)) == 1) {
+        uint8_t buffer[8192];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            data.insert(data.end(), buffer, buffer + count);
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * Builds the whole map as one triangle list, each face fanned, with every
+ * face's lightmap packed into one atlas. The atlas is packed in shelves,
+ * tallest lightmaps first, and the face's texture coordinates are offset
+ * to its place in the atlas, half a sample in like the engines do.
+ */
+static void
+BuildMesh(const mbsp_t *bsp, const std::vector<uint8_t> &litdata, bspmesh_t *mesh)
+{
+    struct extents_t {
+        int texmins[2];
+        int size[2];
+    };
+    std::vector<extents_t> extents(bsp->numfaces);
+    int64_t totalsamples = 0;
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        const gtexinfo_t *tex = &bsp->texinfo[face->texinfo];
+        float mins[2] = { 1e30f, 1e30f }, maxs[2] = { -1e30f, -1e30f };
+
+        for (int j = 0; j < face->numedges; j++) {
+            const float *point = GetSurfaceVertexPoint(bsp, face, j);
+            for (int k = 0; k < 2; k++) {
+                const float st = point[0] * tex->vecs[k][0] + point[1] * tex->vecs[k][1]
+                    + point[2] * tex->vecs[k][2] + tex->vecs[k][3];
+                mins[k] = std::min(mins[k], st);
+                maxs[k] = std::max(maxs[k], st);
+            }
+        }
+        for (int k = 0; k < 2; k++) {
+            extents[i].texmins[k] = static_cast<int>(floor(mins[k] / LIGHTMAP_SCALE));
+            extents[i].size[k] = static_cast<int>(ceil(maxs[k] / LIGHTMAP_SCALE)) - extents[i].texmins[k] + 1;
+        }
+        totalsamples += extents[i].size[0] * extents[i].size[1];
+    }
+
+    // square-ish atlas, a power of two wide
+    mesh->atlasWidth = 256;
+    while (static_cast<int64_t>(mesh->atlasWidth) * mesh->atlasWidth < totalsamples * 5 / 4)
+        mesh->atlasWidth *= 2;
+    for (const extents_t &e : extents)
+        mesh->atlasWidth = std::max(mesh->atlasWidth, e.size[0]);
+
+    std::vector<int> order(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return extents[a].size[1] > extents[b].size[1];
+    });
+
+    mesh->faces.resize(bsp->numfaces);
+    int x = 0, y = 0, shelfheight = 0;
+    for (int i : order) {
+        const extents_t &e = extents[i];
+        if (x + e.size[0] > mesh->atlasWidth) {
+            x = 0;
+            y += shelfheight;
+            shelfheight = 0;
+        }
+        mesh->faces[i] = { e.size[0], e.size[1], x, y };
+        x += e.size[0];
+        shelfheight = std::max(shelfheight, e.size[1]);
+    }
+    mesh->atlasHeight = std::max(1, y + shelfheight);
+
+    mesh->atlas.assign(static_cast<size_t>(mesh->atlasWidth) * mesh->atlasHeight * 3, 0);
+    std::vector<uint8_t> samples;
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const facelightmap_t &lm = mesh->faces[i];
+        samples.resize(lm.width * lm.height * 3);
+        FaceLightmapRGB(bsp, litdata, &bsp->dfaces[i], lm.width * lm.height, samples.data());
+        for (int row = 0; row < lm.height; row++) {
+            memcpy(&mesh->atlas[(static_cast<size_t>(lm.atlasY + row) * mesh->atlasWidth + lm.atlasX) * 3],
+                   &samples[row * lm.width * 3], lm.width * 3);
+        }
+    }
+
+    for (int i = 0; i < bsp->numfaces; i++) {
+        const bsp2_dface_t *face = &bsp->dfaces[i];
+        const gtexinfo_t *tex = &bsp->texinfo[face->texinfo];
+        const facelightmap_t &lm = mesh->faces[i];
+        const uint32_t first = static_cast<uint32_t>(mesh->vertices.size() / 5);
+
+        for (int j = 0; j < face->numedges; j++) {
+            const float *point = GetSurfaceVertexPoint(bsp, face, j);
+            float st[2];
+            for (int k = 0; k < 2; k++) {
+                st[k] = point[0] * tex->vecs[k][0] + point[1] * tex->vecs[k][1]
+                    + point[2] * tex->vecs[k][2] + tex->vecs[k][3];
+                st[k] = st[k] / LIGHTMAP_SCALE - extents[i].texmins[k] + 0.5f;
+            }
+            mesh->vertices.insert(mesh->vertices.end(), {
+                point[0], point[1], point[2],
+                (lm.atlasX + st[0]) / mesh->atlasWidth,
+                (lm.atlasY + st[1]) / mesh->atlasHeight });
+        }
+        for (int j = 2; j < face->numedges; j++)
+            mesh->indices.insert(mesh->indices.end(), { first, first + j - 1, first + j });
+    }
+
+    const dmodelh2_t *world = &bsp->dmodels[0];
+    mesh->mins = QVector3D(world->mins[0], world->mins[1], world->mins[2]);
+    mesh->maxs = QVector3D(world->maxs[0], world->maxs[1], world->maxs[2]);
+}
+
 void GLView::initializeGL()
 {
     initializeOpenGLFunctions();
@@ -83,49 +291,232 @@ void GLView::initializeGL()
 
     m_program->bind();
     m_program_mvp_location = m_program->uniformLocation("MVP");
+    m_program_lightmap_location = m_program->uniformLocation("lightmap");
     
     m_vao.create();
     QOpenGLVertexArrayObject::Binder vaoBinder(&m_vao);
     
     m_vbo.create();
+    m_ibo.create();
+
+    glGenTextures(1, &m_lightmapTexture);
+    glBindTexture(GL_TEXTURE_2D, m_lightmapTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // a bsp loaded before the widget was shown
+    if (!m_mesh.vertices.empty())
+        m_uploadAll = true;
+}
+
+/*
+ * Loads the bsp and builds its mesh. If the faces and the atlas layout
+ * are the same as what's loaded, i.e. light has rewritten the file, only
+ * the lightmaps that changed are marked to go to the gpu; anything else
+ * sends the whole mesh.
+ */
+bool GLView::loadBSP(const QString &file)
+{
+    if (!QFileInfo(file).isFile())
+        return false;
+
+    char filename[1024];
+    q_snprintf(filename, sizeof(filename), "%s", file.toLocal8Bit().constData());
+
+    bspdata_t bspdata;
+    LoadBSPFile(filename, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    bspmesh_t mesh;
+    BuildMesh(&bspdata.data.mbsp, LoadLitFile(file), &mesh);
+
+    const bool samefile = (file == m_bspFile);
+    const bool samelayout = samefile && !m_uploadAll
+        && mesh.vertices == m_mesh.vertices
+        && mesh.indices == m_mesh.indices
+        && mesh.faces == m_mesh.faces;
+
+    if (samelayout) {
+        for (size_t i = 0; i < mesh.faces.size(); i++) {
+            const facelightmap_t &lm = mesh.faces[i];
+            for (int row = 0; row < lm.height; row++) {
+                const size_t offset = (static_cast<size_t>(lm.atlasY + row) * mesh.atlasWidth + lm.atlasX) * 3;
+                if (memcmp(&mesh.atlas[offset], &m_mesh.atlas[offset], lm.width * 3)) {
+                    m_dirtyFaces.push_back(static_cast<int>(i));
+                    break;
+                }
+            }
+        }
+        printf("%s: %d of %d lightmaps changed\n", filename, static_cast<int>(m_dirtyFaces.size()),
+               static_cast<int>(mesh.faces.size()));
+    } else {
+        m_uploadAll = true;
+        m_dirtyFaces.clear();
+    }
+
+    if (!samefile) {
+        // start in the middle of the world, looking along +y
+        m_cameraOrigin = (mesh.mins + mesh.maxs) * 0.5f;
+        m_cameraFwd = QVector3D(0, 1, 0);
+    }
+
+    m_mesh = std::move(mesh);
+
+    if (!samefile) {
+        if (!m_watcher.files().isEmpty())
+            m_watcher.removePaths(m_watcher.files());
+        m_bspFile = file;
+    }
+
+    // light replaces the files, which drops them from the watcher, so add them back every time
+    QFileInfo info(file);
+    const QStringList paths = { file, info.path() + "/" + info.completeBaseName() + ".lit" };
+    for (const QString &path : paths) {
+        if (QFileInfo(path).isFile() && !m_watcher.files().contains(path))
+            m_watcher.addPath(path);
+    }
+
+    update();
+    return true;
+}
+
+void GLView::reloadBSP()
+{
+    if (!m_bspFile.isEmpty())
+        loadBSP(m_bspFile);
+}
+
+/*
+ * light runs on its own thread, its lighting threads hand each face over
+ * as it's done. The first style's samples are copied there and queued to
+ * the gui thread, which puts them in the atlas and sends the face to the
+ * gpu on the next paint. When light writes the bsp the watcher reloads
+ * it as usual, which picks up the other styles and anything not handed
+ * over (faces lit at another -lmscale than this view's atlas).
+ */
+bool GLView::lightBSP()
+{
+    static std::atomic<bool> started { false };
+
+    if (m_bspFile.isEmpty() || started.exchange(true))
+        return false;
+
+    SetFaceLitCallback([this](int facenum, const uint8_t *styles, const uint8_t *rgb, int size) {
+        if (styles[0] == 255)
+            return;
+        int numstyles = 0;
+        while (numstyles < MAXLIGHTMAPS && styles[numstyles] != 255)
+            numstyles++;
+        if (size % numstyles)
+            return;
+
+        std::vector<uint8_t> samples(rgb, rgb + (size / numstyles) * 3);
+        QMetaObject::invokeMethod(this, [this, facenum, samples = std::move(samples)]() {
+            faceLit(facenum, samples);
+        }, Qt::QueuedConnection);
+    });
+
+    const std::string file = m_bspFile.toLocal8Bit().constData();
+    std::thread([file]() {
+        const char *argv[] = { "light", file.c_str() };
+        light_main(2, argv);
+    }).detach();
+    return true;
+}
+
+void GLView::faceLit(int facenum, const std::vector<uint8_t> &samples)
+{
+    if (facenum < 0 || facenum >= static_cast<int>(m_mesh.faces.size()))
+        return;
+
+    const facelightmap_t &lm = m_mesh.faces[facenum];
+    if (samples.size() != static_cast<size_t>(lm.width) * lm.height * 3)
+        return;     // lit at another scale than the atlas
+
+    for (int row = 0; row < lm.height; row++) {
+        memcpy(&m_mesh.atlas[(static_cast<size_t>(lm.atlasY + row) * m_mesh.atlasWidth + lm.atlasX) * 3],
+               &samples[row * lm.width * 3], lm.width * 3);
+    }
+    m_dirtyFaces.push_back(facenum);
+    update();
+}
+
+void GLView::uploadMesh()
+{
+    QOpenGLVertexArrayObject::Binder vaoBinder(&m_vao);
+
     m_vbo.bind();
-    
-    static const GLfloat g_vertex_buffer_data[] = {
-        -1.0f, 0, -1.0f,
-        1.0f, 0, -1.0f,
-        0.0f,  0, 1.0f,
-    };
-    assert(sizeof(g_vertex_buffer_data) == 36);
+    m_vbo.allocate(m_mesh.vertices.data(), static_cast<int>(m_mesh.vertices.size() * sizeof(float)));
+    m_ibo.bind();
+    m_ibo.allocate(m_mesh.indices.data(), static_cast<int>(m_mesh.indices.size() * sizeof(uint32_t)));
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0 /* attrib */, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1 /* attrib */, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 
-    m_vbo.allocate(g_vertex_buffer_data, sizeof(g_vertex_buffer_data));
+    glBindTexture(GL_TEXTURE_2D, m_lightmapTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, m_mesh.atlasWidth, m_mesh.atlasHeight, 0, GL_RGB, GL_UNSIGNED_BYTE,
+                 m_mesh.atlas.data());
+}
+
+void GLView::uploadFaceLightmap(int facenum)
+{
+    const facelightmap_t &lm = m_mesh.faces[facenum];
+    std::vector<uint8_t> samples(lm.width * lm.height * 3);
+    for (int row = 0; row < lm.height; row++) {
+        memcpy(&samples[row * lm.width * 3],
+               &m_mesh.atlas[(static_cast<size_t>(lm.atlasY + row) * m_mesh.atlasWidth + lm.atlasX) * 3],
+               lm.width * 3);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, m_lightmapTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, lm.atlasX, lm.atlasY, lm.width, lm.height, GL_RGB, GL_UNSIGNED_BYTE,
+                    samples.data());
 }
 
 void GLView::paintGL()
 {
     // draw
-    glClearColor(1, 0, 0, 1);
+    if (m_uploadAll) {
+        uploadMesh();
+        m_uploadAll = false;
+        m_dirtyFaces.clear();
+    }
+    for (int facenum : m_dirtyFaces)
+        uploadFaceLightmap(facenum);
+    m_dirtyFaces.clear();
+
+    glClearColor(0, 0, 0, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+
+    if (m_mesh.indices.empty())
+        return;
 
     m_program->bind();
     
     QMatrix4x4 modelMatrix;
     QMatrix4x4 viewMatrix;
     QMatrix4x4 projectionMatrix;
-    projectionMatrix.perspective(90, m_displayAspect, 0.1f, 100.0f);
+    projectionMatrix.perspective(90, m_displayAspect, 1.0f, 16384.0f);
     viewMatrix.lookAt(m_cameraOrigin, m_cameraOrigin + m_cameraFwd, QVector3D(0,0,1));
 
     QMatrix4x4 MVP = projectionMatrix * viewMatrix * modelMatrix;
     
     m_program->setUniformValue(m_program_mvp_location, MVP);
+    m_program->setUniformValue(m_program_lightmap_location, 0);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_lightmapTexture);
     
+    // the whole map is one draw
     QOpenGLVertexArrayObject::Binder vaoBinder(&m_vao);
-    
-    glEnableVertexAttribArray(0);
-    assert(m_vbo.bind());
-    
-    glVertexAttribPointer(0 /* attrib */, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    glDisableVertexAttribArray(0);
+    glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_mesh.indices.size()), GL_UNSIGNED_INT, (void*)0);
     
     m_program->release();
 }
@@ -207,16 +598,14 @@ void GLView::keyReleaseEvent(QKeyEvent *event)
 
 void GLView::wheelEvent(QWheelEvent *event)
 {
-    static float speed = 0.02;
+    static float speed = 0.5;
     m_cameraOrigin += m_cameraFwd * event->angleDelta().y() * speed;
     update();
 }
 
 void GLView::timerEvent(QTimerEvent *event)
 {
-    printf("key movement %s\n", QTime::currentTime().toString().toStdString().c_str());
-    
-    const float speed = 0.1;
+    const float speed = 8;
     
     if (m_keysPressed & static_cast<uint32_t>(keys_t::up))
         m_cameraOrigin += m_cameraFwd * speed;
@@ -27,9 +27,13 @@ See file, 'COPYING', for details.
 #include <QOpenGLShaderProgram>
 
 #include <QElapsedTimer>
+#include <QFileSystemWatcher>
+#include <QTimer>
 #include <QVector3D>
 #include <QMatrix4x4>
 
+#include <vector>
+
 enum class keys_t : uint32_t {
     none = 0,
     up = 1,
@@ -38,6 +42,27 @@ enum class keys_t : uint32_t {
     left = 8
 };
 
+/* where one face's lightmap sits in the atlas */
+struct facelightmap_t {
+    int width, height;
+    int atlasX, atlasY;
+
+    bool operator==(const facelightmap_t &other) const {
+        return width == other.width && height == other.height
+            && atlasX == other.atlasX && atlasY == other.atlasY;
+    }
+};
+
+/* everything the gpu needs to draw a bsp: one vertex and index buffer for all faces, one lightmap atlas */
+struct bspmesh_t {
+    std::vector<float> vertices;        // x y z s t, s t in the atlas
+    std::vector<uint32_t> indices;
+    std::vector<facelightmap_t> faces;  // one per bsp face
+    int atlasWidth = 0, atlasHeight = 0;
+    std::vector<uint8_t> atlas;         // rgb
+    QVector3D mins, maxs;               // world model bounds
+};
+
 class GLView : public QOpenGLWidget,
                protected QOpenGLFunctions
 {
@@ -58,15 +83,38 @@ private:
     
     QOpenGLVertexArrayObject m_vao;
     QOpenGLBuffer m_vbo;
+    QOpenGLBuffer m_ibo;
+    GLuint m_lightmapTexture;
     QOpenGLShaderProgram *m_program;
     
     // uniform locations
     int m_program_mvp_location;
+    int m_program_lightmap_location;
+
+    // the loaded bsp, and what of it still has to go to the gpu
+    QString m_bspFile;
+    bspmesh_t m_mesh;
+    bool m_uploadAll;
+    std::vector<int> m_dirtyFaces;
+
+    // hot reload when light rewrites the bsp
+    QFileSystemWatcher m_watcher;
+    QTimer m_reloadTimer;
     
 public:
     GLView(QWidget *parent = nullptr);
     ~GLView();
 
+    /** loads a bsp to view, and reloads it whenever the file changes */
+    bool loadBSP(const QString &file);
+
+    /**
+     * runs light on the loaded bsp in the background, showing each face's
+     * lightmap as it's done. light keeps its state in globals, so this
+     * works once per run of lightpreview; false if it can't start.
+     */
+    bool lightBSP();
+
     
 protected:
     void initializeGL() override;
@@ -76,6 +124,10 @@ protected:
 private:
     void startMovementTimer();
     void stopMovementTimer();
+    void reloadBSP();
+    void uploadMesh();
+    void uploadFaceLightmap(int facenum);
+    void faceLit(int facenum, const std::vector<uint8_t> &samples);
     
 protected:
     void mousePressEvent(QMouseEvent *event) override;
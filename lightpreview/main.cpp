@@ -28,10 +28,15 @@ int main(int argc, char *argv[])
     QSurfaceFormat fmt;
     fmt.setVersion(3, 3);
     fmt.setProfile(QSurfaceFormat::CoreProfile);
+    fmt.setDepthBufferSize(24);
     QSurfaceFormat::setDefaultFormat(fmt);
     
     MainWindow w;
     w.show();
 
+    // lightpreview map.bsp
+    if (argc > 1)
+        w.loadFile(QString::fromLocal8Bit(argv[1]));
+
     return a.exec();
 }
@@ -20,11 +20,34 @@ See file, 'COPYING', for details.
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QMessageBox>
+
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
+
+    connect(ui->actionOpen, &QAction::triggered, this, [this]() {
+        const QString file = QFileDialog::getOpenFileName(this, tr("Open BSP"), QString(), tr("BSP files (*.bsp)"));
+        if (!file.isEmpty())
+            loadFile(file);
+    });
+    connect(ui->actionLight, &QAction::triggered, this, [this]() {
+        if (!ui->glView->lightBSP())
+            QMessageBox::warning(this, tr("lightpreview"), tr("Open a bsp first; light can only run once per session"));
+    });
+}
+
+void MainWindow::loadFile(const QString &file)
+{
+    if (!ui->glView->loadBSP(file)) {
+        QMessageBox::warning(this, tr("lightpreview"), tr("Couldn't open %1").arg(file));
+        return;
+    }
+    setWindowTitle(QFileInfo(file).fileName() + " - lightpreview");
 }
 
 MainWindow::~MainWindow()
@@ -35,6 +35,8 @@ public:
     explicit MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    void loadFile(const QString &file);
+
 private:
     Ui::MainWindow *ui;
 };
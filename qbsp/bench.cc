@@ -0,0 +1,149 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Micro-benchmarks for qbsp's geometry kernels. See
+ * include/common/microbench.hh for the options.
+ */
+
+#include <qbsp/qbsp.hh>
+#include <common/microbench.hh>
+
+#include <array>
+#include <cmath>
+#include <random>
+#include <vector>
+
+/* a regular 16-gon of radius 64 in the z=0 plane, and a plane through it off-center */
+static void
+BenchWinding(winding_t *w, qbsp_plane_t *split)
+{
+    w->numpoints = 16;
+    for (int i = 0; i < w->numpoints; i++) {
+        const double angle = 2 * Q_PI * i / w->numpoints;
+        VectorSet(w->points[i], 64 * cos(angle), 64 * sin(angle), 0);
+    }
+    VectorSet(split->normal, 0.6, 0.8, 0);
+    split->dist = 10;
+    split->type = PLANE_ANYZ;
+}
+
+MICROBENCH(CalcSides)
+{
+    winding_t w;
+    qbsp_plane_t split;
+    BenchWinding(&w, &split);
+
+    vec_t dists[MAXEDGES + 1];
+    int sides[MAXEDGES + 1];
+    int counts[3];
+
+    while (state.keepRunning()) {
+        CalcSides(&w, &split, sides, dists, counts);
+        Microbench_DoNotOptimize(counts[0]);
+    }
+    state.setItemsProcessed(w.numpoints);
+}
+
+MICROBENCH(DivideWinding)
+{
+    winding_t w;
+    qbsp_plane_t split;
+    BenchWinding(&w, &split);
+
+    while (state.keepRunning()) {
+        winding_t *front, *back;
+        DivideWinding(&w, &split, &front, &back);
+        Microbench_DoNotOptimize(front);
+        FreeMem(front);
+        FreeMem(back);
+    }
+    state.setItemsProcessed(w.numpoints);
+}
+
+MICROBENCH(DivideWindingInto)
+{
+    winding_t w, front, back;
+    qbsp_plane_t split;
+    BenchWinding(&w, &split);
+
+    while (state.keepRunning()) {
+        DivideWindingInto(&w, &split, &front, &back);
+        Microbench_DoNotOptimize(front.numpoints);
+    }
+    state.setItemsProcessed(w.numpoints);
+}
+
+/* looks up planes already in the map, as nearly every brush face does */
+MICROBENCH(FindPlane)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<vec_t> coord(-1, 1), dist(-4096, 4096);
+
+    const int numplanes = 4096;
+    std::vector<std::array<vec_t, 3>> normals(numplanes);
+    std::vector<vec_t> dists(numplanes);
+    for (int i = 0; i < numplanes; i++) {
+        /* a quarter axial, like real maps */
+        if (i % 4 == 0) {
+            VectorCopy(vec3_origin, normals[i].data());
+            normals[i][i % 3] = 1;
+        } else {
+            VectorSet(normals[i].data(), coord(rng), coord(rng), coord(rng));
+            VectorNormalize(normals[i].data());
+        }
+        dists[i] = floor(dist(rng));
+
+        int side;
+        FindPlane(normals[i].data(), dists[i], &side);
+    }
+
+    int i = 0;
+    while (state.keepRunning()) {
+        int side;
+        Microbench_DoNotOptimize(FindPlane(normals[i].data(), dists[i], &side));
+        i = (i + 1) & (numplanes - 1);
+    }
+}
+
+/* welds points onto vertexes already emitted, as MakeFaceEdges does */
+MICROBENCH(GetVertex)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<vec_t> coord(-4096, 4096);
+
+    const int numverts = 16384;
+    std::vector<std::array<vec_t, 3>> verts(numverts);
+    mapentity_t entity;
+    for (int i = 0; i < numverts; i++) {
+        VectorSet(verts[i].data(), floor(coord(rng)), floor(coord(rng)), floor(coord(rng)));
+        GetVertex(&entity, verts[i].data());
+    }
+
+    int i = 0;
+    while (state.keepRunning()) {
+        Microbench_DoNotOptimize(GetVertex(&entity, verts[i].data()));
+        i = (i + 1) & (numverts - 1);
+    }
+}
+
+int main(int argc, const char **argv)
+{
+    return Microbench_Main(argc, argv);
+}
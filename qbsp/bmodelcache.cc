@@ -0,0 +1,528 @@
+/*
+    Copyright (C) 1996-1997  Id Software, Inc.
+    Copyright (C) 1997       Greg Lewis
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <qbsp/qbsp.hh>
+#include <qbsp/bmodelcache.hh>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define BMODELCACHE_MAGIC 0x31434d42     // "BMC1"
+
+typedef std::pair<uint64_t, int> cachekey_t;    // entity key, hull
+
+struct cachekey_hash {
+    std::size_t operator()(const cachekey_t &key) const noexcept {
+        return static_cast<std::size_t>(key.first ^ (static_cast<uint64_t>(key.second) * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+struct cacheentry_t {
+    std::string origin;             // set by an origin brush while loading
+    std::vector<uint8_t> tree;
+};
+
+typedef std::unordered_map<cachekey_t, cacheentry_t, cachekey_hash> cachemap_t;
+
+static uint64_t cache_options;
+static cachemap_t cache_previous;   // from the last compile
+static cachemap_t cache_current;    // this compile's, written by BModelCache_Save
+static int cache_hits, cache_misses;
+
+/*
+ * Reading and writing the trees. Planes and texinfos are stored by value
+ * and looked up again, since their numbers depend on the rest of the map.
+ */
+
+static void
+Put(std::vector<uint8_t> &out, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+template <typename T>
+static void
+Put(std::vector<uint8_t> &out, const T &value)
+{
+    Put(out, &value, sizeof(value));
+}
+
+struct reader_t {
+    const uint8_t *pos, *end;
+    bool ok = true;
+
+    bool get(void *data, size_t size) {
+        if (!ok || static_cast<size_t>(end - pos) < size)
+            return ok = false;
+        memcpy(data, pos, size);
+        pos += size;
+        return true;
+    }
+    template <typename T>
+    T get() {
+        T value {};
+        get(&value, sizeof(value));
+        return value;
+    }
+};
+
+static void
+PutPlane(std::vector<uint8_t> &out, int planenum)
+{
+    const qbsp_plane_t &plane = map.planes.at(planenum);
+    Put(out, plane.normal);
+    Put(out, plane.dist);
+}
+
+static int
+GetPlane(reader_t &in)
+{
+    vec3_t normal;
+    vec_t dist;
+    int side;
+    in.get(normal, sizeof(normal));
+    in.get(&dist, sizeof(dist));
+    if (!in.ok)
+        return PLANENUM_LEAF;
+
+    const int planenum = FindPlane(normal, dist, &side);
+    if (side)
+        in.ok = false;      // matched another plane the other way round, rebuild instead
+    return planenum;
+}
+
+static void
+PutTexinfo(std::vector<uint8_t> &out, int texinfonum)
+{
+    const mtexinfo_t &texinfo = map.mtexinfos.at(texinfonum);
+    const std::string &name = map.texinfoTextureName(texinfonum);
+
+    Put(out, texinfo.vecs);
+    Put(out, texinfo.flags);
+    Put(out, texinfo.value);
+    Put(out, static_cast<uint32_t>(name.size()));
+    Put(out, name.data(), name.size());
+}
+
+static int
+GetTexinfo(reader_t &in)
+{
+    mtexinfo_t texinfo {};
+    in.get(&texinfo.vecs, sizeof(texinfo.vecs));
+    in.get(&texinfo.flags, sizeof(texinfo.flags));
+    in.get(&texinfo.value, sizeof(texinfo.value));
+
+    std::string name(in.get<uint32_t>(), '\0');
+    in.get(&name[0], name.size());
+    if (!in.ok)
+        return 0;
+
+    /* the entity's faces use the same textures, so these are all found */
+    texinfo.miptex = FindMiptex(name.c_str());
+    return FindTexinfo(texinfo);
+}
+
+static void
+NumberFaces_r(const node_t *node, std::unordered_map<const face_t *, uint32_t> &faceids)
+{
+    if (node->planenum == PLANENUM_LEAF)
+        return;
+
+    for (const face_t *face = node->faces; face; face = face->next)
+        faceids.emplace(face, static_cast<uint32_t>(faceids.size()));
+    NumberFaces_r(node->children[0], faceids);
+    NumberFaces_r(node->children[1], faceids);
+}
+
+/* false if the tree has something that can't be stored */
+static bool
+PutNode_r(std::vector<uint8_t> &out, const node_t *node, const std::unordered_map<const face_t *, uint32_t> &faceids)
+{
+    Put(out, node->planenum == PLANENUM_LEAF);
+    Put(out, node->mins);
+    Put(out, node->maxs);
+    Put(out, node->contents);
+    Put(out, node->visleafnum);
+    Put(out, node->viscluster);
+    Put(out, node->occupied);
+    Put(out, node->detail_separator);
+
+    if (node->planenum == PLANENUM_LEAF) {
+        uint32_t count = 0;
+        while (node->markfaces && node->markfaces[count])
+            count++;
+        Put(out, count);
+        for (uint32_t i = 0; i < count; i++) {
+            const auto it = faceids.find(node->markfaces[i]);
+            if (it == faceids.end())
+                return false;
+            Put(out, it->second);
+        }
+        return true;
+    }
+
+    PutPlane(out, node->planenum);
+    Put(out, node->firstface);
+    Put(out, node->numfaces);
+
+    uint32_t count = 0;
+    for (const face_t *face = node->faces; face; face = face->next)
+        count++;
+    Put(out, count);
+
+    for (const face_t *face = node->faces; face; face = face->next) {
+        /* tjunction fragments and edges only exist once exporting starts */
+        if (face->original || face->edges)
+            return false;
+
+        PutPlane(out, face->planenum);
+        Put(out, face->planeside);
+        PutTexinfo(out, face->texinfo);
+        Put(out, face->contents);
+        Put(out, face->lmshift);
+        Put(out, face->outputnumber);
+        Put(out, face->touchesOccupiedLeaf);
+        Put(out, face->origin);
+        Put(out, face->radius);
+        Put(out, face->w.numpoints);
+        Put(out, face->w.points, sizeof(face->w.points[0]) * face->w.numpoints);
+    }
+
+    return PutNode_r(out, node->children[0], faceids) && PutNode_r(out, node->children[1], faceids);
+}
+
+struct pendingleaf_t {
+    node_t *node;
+    std::vector<uint32_t> faceids;
+};
+
+static node_t *
+GetNode_r(reader_t &in, std::vector<face_t *> &faces, std::vector<pendingleaf_t> &leafs)
+{
+    node_t *node = (node_t *)AllocMem(OTHER, sizeof(node_t), true);
+    const bool leaf = in.get<bool>();
+    in.get(node->mins, sizeof(node->mins));
+    in.get(node->maxs, sizeof(node->maxs));
+    node->contents = in.get<contentflags_t>();
+    node->visleafnum = in.get<int>();
+    node->viscluster = in.get<int>();
+    node->occupied = in.get<int>();
+    node->detail_separator = in.get<bool>();
+
+    if (leaf) {
+        node->planenum = PLANENUM_LEAF;
+        pendingleaf_t pending { node, std::vector<uint32_t>(in.get<uint32_t>()) };
+        if (in.ok)
+            in.get(pending.faceids.data(), sizeof(uint32_t) * pending.faceids.size());
+        leafs.push_back(std::move(pending));
+        return node;
+    }
+
+    node->planenum = GetPlane(in);
+    node->firstface = in.get<int>();
+    node->numfaces = in.get<int>();
+
+    const uint32_t count = in.get<uint32_t>();
+    face_t **tail = &node->faces;
+    for (uint32_t i = 0; i < count && in.ok; i++) {
+        face_t *face = (face_t *)AllocMem(OTHER, sizeof(face_t), true);
+        face->planenum = GetPlane(in);
+        face->planeside = in.get<int>();
+        face->texinfo = GetTexinfo(in);
+        in.get(face->contents, sizeof(face->contents));
+        in.get(face->lmshift, sizeof(face->lmshift));
+        face->outputnumber = in.get<int>();
+        face->touchesOccupiedLeaf = in.get<bool>();
+        in.get(face->origin, sizeof(face->origin));
+        face->radius = in.get<vec_t>();
+        face->w.numpoints = in.get<int>();
+        if (face->w.numpoints < 0 || face->w.numpoints > MAXEDGES)
+            in.ok = false;
+        else
+            in.get(face->w.points, sizeof(face->w.points[0]) * face->w.numpoints);
+
+        *tail = face;
+        tail = &face->next;
+        faces.push_back(face);
+    }
+
+    if (!in.ok) {
+        node->planenum = PLANENUM_LEAF;     // so a partial tree can be freed as a leaf
+        return node;
+    }
+    node->children[0] = GetNode_r(in, faces, leafs);
+    node->children[1] = GetNode_r(in, faces, leafs);
+    return node;
+}
+
+static void
+FreeNode_r(node_t *node)
+{
+    if (node->planenum != PLANENUM_LEAF) {
+        FreeNode_r(node->children[0]);
+        FreeNode_r(node->children[1]);
+    }
+    face_t *next;
+    for (face_t *face = node->faces; face; face = next) {
+        next = face->next;
+        FreeMem(face);
+    }
+    if (node->markfaces)
+        FreeMem(node->markfaces);
+    FreeMem(node);
+}
+
+static node_t *
+ReadTree(const std::vector<uint8_t> &tree)
+{
+    reader_t in { tree.data(), tree.data() + tree.size() };
+    std::vector<face_t *> faces;
+    std::vector<pendingleaf_t> leafs;
+
+    node_t *headnode = GetNode_r(in, faces, leafs);
+
+    /* the markfaces point at node faces anywhere in the tree, so they're linked last */
+    for (pendingleaf_t &leaf : leafs) {
+        leaf.node->markfaces = (face_t **)AllocMem(OTHER, sizeof(face_t *) * (leaf.faceids.size() + 1), true);
+        for (size_t i = 0; i < leaf.faceids.size() && in.ok; i++) {
+            if (leaf.faceids[i] >= faces.size())
+                in.ok = false;
+            else
+                leaf.node->markfaces[i] = faces[leaf.faceids[i]];
+        }
+    }
+
+    if (!in.ok || in.pos != in.end) {
+        FreeNode_r(headnode);
+        return nullptr;
+    }
+    return CompactTree(headnode);
+}
+
+/* field by field, the padding isn't initialized */
+static void
+HashFlags(uint64_t *key, const surfflags_t &flags)
+{
+    FNV_HashBytes(key, &flags.native, sizeof(flags.native));
+    FNV_HashBytes(key, &flags.extended, sizeof(flags.extended));
+    FNV_HashBytes(key, &flags.phong_angle, sizeof(flags.phong_angle));
+    FNV_HashBytes(key, &flags.minlight, sizeof(flags.minlight));
+    FNV_HashBytes(key, flags.minlight_color.data(), flags.minlight_color.size());
+    FNV_HashBytes(key, &flags.phong_angle_concave, sizeof(flags.phong_angle_concave));
+    FNV_HashBytes(key, &flags.light_alpha, sizeof(flags.light_alpha));
+}
+
+/*
+==================
+BModelCache_Key
+
+The entity's keys, its brushes with their planes and textures, and the
+entity it targets, which rotate_ entities take their origin from.
+==================
+*/
+uint64_t
+BModelCache_Key(const mapentity_t *entity)
+{
+    if (entity == pWorldEnt())
+        return 0;
+    if (options.target_game->id == GAME_QUAKE_II)
+        return 0;   // the leaf brush lists need the brushes themselves
+
+    uint64_t key = cache_options;
+    const auto hashepairs = [&key](const mapentity_t *ent) {
+        for (const epair_t *epair = ent->epairs; epair; epair = epair->next) {
+            FNV_HashBytes(&key, epair->key, strlen(epair->key) + 1);
+            FNV_HashBytes(&key, epair->value, strlen(epair->value) + 1);
+        }
+    };
+
+    hashepairs(entity);
+
+    const char *target = ValueForKey(entity, "target");
+    if (target[0]) {
+        for (const mapentity_t &other : map.entities) {
+            if (!Q_strcasecmp(ValueForKey(&other, "targetname"), target))
+                hashepairs(&other);
+        }
+    }
+
+    for (int i = 0; i < entity->nummapbrushes; i++) {
+        const mapbrush_t &mapbrush = entity->mapbrush(i);
+        FNV_HashBytes(&key, &mapbrush.contents, sizeof(mapbrush.contents));
+        FNV_HashBytes(&key, &mapbrush.format, sizeof(mapbrush.format));
+
+        for (int j = 0; j < mapbrush.numfaces; j++) {
+            const mapface_t &mapface = mapbrush.face(j);
+            const mtexinfo_t &texinfo = map.mtexinfos.at(mapface.texinfo);
+
+            FNV_HashBytes(&key, mapface.planepts, sizeof(mapface.planepts));
+            FNV_HashBytes(&key, mapface.texname.c_str(), mapface.texname.size() + 1);
+            FNV_HashBytes(&key, &texinfo.vecs, sizeof(texinfo.vecs));
+            HashFlags(&key, texinfo.flags);
+            HashFlags(&key, mapface.flags);
+            FNV_HashBytes(&key, &mapface.contents, sizeof(mapface.contents));
+            FNV_HashBytes(&key, &mapface.value, sizeof(mapface.value));
+        }
+    }
+
+    return key ? key : 1;
+}
+
+/*
+==================
+BModelCache_Find
+==================
+*/
+node_t *
+BModelCache_Find(mapentity_t *entity, int hullnum)
+{
+    const cachekey_t key { entity->cachekey, hullnum };
+    const auto it = cache_previous.find(key);
+    if (it == cache_previous.end()) {
+        cache_misses++;
+        return nullptr;
+    }
+
+    node_t *nodes = ReadTree(it->second.tree);
+    if (!nodes) {
+        cache_misses++;
+        return nullptr;
+    }
+
+    if (!it->second.origin.empty())
+        SetKeyValue(entity, "origin", it->second.origin.c_str());
+
+    cache_current[key] = it->second;
+    cache_hits++;
+    return nodes;
+}
+
+/*
+==================
+BModelCache_Add
+==================
+*/
+void
+BModelCache_Add(const mapentity_t *entity, int hullnum, const node_t *nodes)
+{
+    std::unordered_map<const face_t *, uint32_t> faceids;
+    NumberFaces_r(nodes, faceids);
+
+    cacheentry_t entry;
+    entry.origin = ValueForKey(entity, "origin");
+    if (!PutNode_r(entry.tree, nodes, faceids))
+        return;
+
+    cache_current[{ entity->cachekey, hullnum }] = std::move(entry);
+}
+
+/*
+==================
+BModelCache_Load
+==================
+*/
+void
+BModelCache_Load(const char *filename, uint64_t options)
+{
+    cache_options = options;
+    cache_previous.clear();
+    cache_current.clear();
+    cache_hits = cache_misses = 0;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return;
+
+    std::vector<uint8_t> data;
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        data.insert(data.end(), buffer, buffer + count);
+    fclose(f);
+
+    reader_t in { data.data(), data.data() + data.size() };
+    if (in.get<uint32_t>() != BMODELCACHE_MAGIC || in.get<uint64_t>() != options) {
+        Message(msgLiteral, "Incremental: %s is from other options, rebuilding every brush model\n", filename);
+        return;
+    }
+
+    const uint32_t numentries = in.get<uint32_t>();
+    for (uint32_t i = 0; i < numentries && in.ok; i++) {
+        cachekey_t key;
+        key.first = in.get<uint64_t>();
+        key.second = in.get<int32_t>();
+
+        cacheentry_t entry;
+        entry.origin.resize(in.get<uint32_t>());
+        in.get(&entry.origin[0], entry.origin.size());
+        entry.tree.resize(in.get<uint32_t>());
+        in.get(entry.tree.data(), entry.tree.size());
+
+        if (in.ok)
+            cache_previous.emplace(key, std::move(entry));
+    }
+    if (!in.ok) {
+        Message(msgLiteral, "Incremental: %s is truncated, rebuilding every brush model\n", filename);
+        cache_previous.clear();
+    }
+}
+
+/*
+==================
+BModelCache_Save
+
+Only this compile's brush models are kept, so the file doesn't grow.
+==================
+*/
+void
+BModelCache_Save(const char *filename)
+{
+    Message(msgLiteral, "Incremental: reused %d of %d brush model hulls\n", cache_hits, cache_hits + cache_misses);
+
+    std::vector<uint8_t> out;
+    Put(out, static_cast<uint32_t>(BMODELCACHE_MAGIC));
+    Put(out, cache_options);
+    Put(out, static_cast<uint32_t>(cache_current.size()));
+    for (const auto &entry : cache_current) {
+        Put(out, entry.first.first);
+        Put(out, static_cast<int32_t>(entry.first.second));
+        Put(out, static_cast<uint32_t>(entry.second.origin.size()));
+        Put(out, entry.second.origin.data(), entry.second.origin.size());
+        Put(out, static_cast<uint32_t>(entry.second.tree.size()));
+        Put(out, entry.second.tree.data(), entry.second.tree.size());
+    }
+
+    const std::string tmpfile = std::string(filename) + ".tmp";
+    FILE *f = fopen(tmpfile.c_str(), "wb");
+    if (!f) {
+        logprint("WARNING: can't write %s, the next -incremental compile rebuilds every brush model\n", filename);
+        return;
+    }
+    const bool written = (fwrite(out.data(), 1, out.size(), f) == out.size());
+    if (fclose(f) || !written || rename(tmpfile.c_str(), filename)) {
+        remove(tmpfile.c_str());
+        logprint("WARNING: can't write %s, the next -incremental compile rebuilds every brush model\n", filename);
+    }
+}
@@ -22,9 +22,14 @@
 
 #include <string.h>
 
+#include <mutex>
+#include <shared_mutex>
+
 #include <qbsp/qbsp.hh>
 #include <fmt/format.h>
 
+#include "tbb/parallel_for.h"
+
 /*
  * Beveled clipping hull can generate many extra faces
  */
@@ -49,6 +54,22 @@ typedef struct hullbrush_s {
     int linenum;
 } hullbrush_t;
 
+/*
+ * Brushes are loaded in parallel, but plane numbers depend on the order of
+ * the FindPlane calls. While a worker loads a brush, CreateBrushFaces
+ * records its faces here instead, and Brush_LoadEntity resolves them in
+ * brush order afterwards.
+ */
+typedef struct deferredface_s {
+    face_t *face;
+    vec3_t normal;
+    vec_t dist;
+    int linenum;
+    bool discard;       // first pass of a clip hull brush, freed once resolved
+} deferredface_t;
+
+static thread_local std::vector<deferredface_t> *deferred_faces = nullptr;
+
 /*
 =================
 Face_Plane
@@ -79,7 +100,7 @@ Note: this will not catch 0 area polygons
 =================
 */
 void
-CheckFace(face_t *face, const mapface_t *sourceface)
+CheckFace(face_t *face, const int linenum)
 {
     const qbsp_plane_t *plane = &map.planes[face->planenum];
     const vec_t *p1, *p2;
@@ -89,14 +110,14 @@ CheckFace(face_t *face, const mapface_t *sourceface)
 
     if (face->w.numpoints < 3) {
         if (face->w.numpoints == 2) {
-            Error("%s: line %d: too few points (2): (%f %f %f) (%f %f %f)\n", __func__, sourceface->linenum,
+            Error("%s: line %d: too few points (2): (%f %f %f) (%f %f %f)\n", __func__, linenum,
                   face->w.points[0][0], face->w.points[0][1], face->w.points[0][2],
                   face->w.points[1][0], face->w.points[1][1], face->w.points[1][2]);
         } else if (face->w.numpoints == 1) {
-            Error("%s: line %d: too few points (1): (%f %f %f)\n", __func__, sourceface->linenum,
+            Error("%s: line %d: too few points (1): (%f %f %f)\n", __func__, linenum,
                   face->w.points[0][0], face->w.points[0][1], face->w.points[0][2]);
         } else {
-            Error("%s: line %d: too few points (%d)", __func__, sourceface->linenum, face->w.numpoints);
+            Error("%s: line %d: too few points (%d)", __func__, linenum, face->w.numpoints);
         }
     }
 
@@ -110,22 +131,22 @@ CheckFace(face_t *face, const mapface_t *sourceface)
 
         for (j = 0; j < 3; j++)
             if (p1[j] > options.worldExtent || p1[j] < -options.worldExtent)
-                Error("%s: line %d: coordinate out of range (%f)", __func__, sourceface->linenum, p1[j]);
+                Error("%s: line %d: coordinate out of range (%f)", __func__, linenum, p1[j]);
 
         /* check the point is on the face plane */
         dist = DotProduct(p1, plane->normal) - plane->dist;
         if (dist < -ON_EPSILON || dist > ON_EPSILON)
-            Message(msgWarning, warnPointOffPlane, sourceface->linenum, p1[0], p1[1], p1[2], dist);
+            Message(msgWarning, warnPointOffPlane, linenum, p1[0], p1[1], p1[2], dist);
 
         /* check the edge isn't degenerate */
         VectorSubtract(p2, p1, edgevec);
         length = VectorLength(edgevec);
         if (length < ON_EPSILON) {
-            Message(msgWarning, warnDegenerateEdge, sourceface->linenum, length, p1[0], p1[1], p1[2]);
+            Message(msgWarning, warnDegenerateEdge, linenum, length, p1[0], p1[1], p1[2]);
             for (j = i + 1; j < face->w.numpoints; j++)
                 VectorCopy(face->w.points[j], face->w.points[j - 1]);
             face->w.numpoints--;
-            CheckFace(face, sourceface);
+            CheckFace(face, linenum);
             break;
         }
 
@@ -141,7 +162,7 @@ CheckFace(face_t *face, const mapface_t *sourceface)
             dist = DotProduct(face->w.points[j], edgenormal);
             if (dist > edgedist)
                 Error("%s: line %d: Found a non-convex face (error size %f, point: %f %f %f)\n",
-                      __func__, sourceface->linenum, dist - edgedist, face->w.points[j][0], face->w.points[j][1], face->w.points[j][2]);
+                      __func__, linenum, dist - edgedist, face->w.points[j][0], face->w.points[j][1], face->w.points[j][2]);
         }
     }
 }
@@ -234,17 +255,74 @@ PlaneInvEqual(const qbsp_plane_t *p1, const qbsp_plane_t *p2)
 
 /* Plane Hashing */
 
-static inline int
+// FindPlane can be called from several hulls at once. Lookups share the
+// lock, only adding a plane takes it exclusively.
+static std::shared_mutex planehash_lock;
+
+// the normal components are bucketed in 1/64ths, the dist in whole units
+#define PLANEHASH_NORMAL_SCALE 64.0
+
+/*
+ * The key packs the bucket of each absolute normal component and of the
+ * absolute dist, so a plane and its inverse share a key.
+ */
+static inline uint64_t
+plane_hash_key(const int64_t cell[4])
+{
+    return (static_cast<uint64_t>(cell[3]) << 24)
+        | (static_cast<uint64_t>(cell[0]) << 16)
+        | (static_cast<uint64_t>(cell[1]) << 8)
+        | static_cast<uint64_t>(cell[2]);
+}
+
+static inline void
+plane_hash_values(const qbsp_plane_t *p, vec_t values[4])
+{
+    for (int i = 0; i < 3; i++)
+        values[i] = fabs(p->normal[i]) * PLANEHASH_NORMAL_SCALE;
+    values[3] = fabs(p->dist);
+}
+
+static inline uint64_t
 plane_hash_fn(const qbsp_plane_t *p)
 {
-    return Q_rint(fabs(p->dist));
+    vec_t values[4];
+    int64_t cell[4];
+
+    plane_hash_values(p, values);
+    for (int i = 0; i < 4; i++)
+        cell[i] = static_cast<int64_t>(floor(values[i]));
+
+    return plane_hash_key(cell);
 }
 
+/*
+ * Files the plane under every bucket a plane within NORMAL_EPSILON and
+ * DIST_EPSILON of it can hash to, so FindPlane only looks in one.
+ */
 static void
 PlaneHash_Add(const qbsp_plane_t *p, int index)
 {
-    const int hash = plane_hash_fn(p);
-    map.planehash[hash].push_back(index);
+    const vec_t epsilon[4] = {
+        NORMAL_EPSILON * PLANEHASH_NORMAL_SCALE,
+        NORMAL_EPSILON * PLANEHASH_NORMAL_SCALE,
+        NORMAL_EPSILON * PLANEHASH_NORMAL_SCALE,
+        DIST_EPSILON
+    };
+    vec_t values[4];
+    int64_t lo[4], hi[4], cell[4];
+
+    plane_hash_values(p, values);
+    for (int i = 0; i < 4; i++) {
+        lo[i] = static_cast<int64_t>(floor(qmax(values[i] - epsilon[i], static_cast<vec_t>(0))));
+        hi[i] = static_cast<int64_t>(floor(values[i] + epsilon[i]));
+    }
+
+    for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+        for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+            for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++)
+                for (cell[3] = lo[3]; cell[3] <= hi[3]; cell[3]++)
+                    map.planehash[plane_hash_key(cell)].push_back(index);
 }
 
 /*
@@ -277,10 +355,38 @@ NewPlane(const vec3_t normal, const vec_t dist, int *side)
     return index;
 }
 
+/*
+ * PlaneHash_Find
+ * - Returns the first plane matching `plane`, or -1
+ * - The caller holds planehash_lock
+ */
+static int
+PlaneHash_Find(const uint64_t hash, const qbsp_plane_t *plane, int *side)
+{
+    const auto it = map.planehash.find(hash);
+    if (it == map.planehash.end())
+        return -1;
+
+    for (int i : it->second) {
+        const qbsp_plane_t &p = map.planes.at(i);
+        if (PlaneEqual(&p, plane)) {
+            if (side) {
+            *side = SIDE_FRONT;
+            }
+            return i;
+        } else if (side && PlaneInvEqual(&p, plane)) {
+            *side = SIDE_BACK;
+            return i;
+        }
+    }
+    return -1;
+}
+
 /*
  * FindPlane
  * - Returns a global plane number and the side that will be the front
  * - if `side` is null, only an exact match will be fetched.
+ * - thread safe
  */
 int
 FindPlane(const vec3_t normal, const vec_t dist, int *side)
@@ -289,18 +395,21 @@ FindPlane(const vec3_t normal, const vec_t dist, int *side)
     VectorCopy(normal, plane.normal);
     plane.dist = dist;
     
-    for (int i : map.planehash[plane_hash_fn(&plane)]) {
-        const qbsp_plane_t &p = map.planes.at(i);
-        if (PlaneEqual(&p, &plane)) {
-            if (side) {
-            *side = SIDE_FRONT;
-            }
-            return i;
-        } else if (side && PlaneInvEqual(&p, &plane)) {
-            *side = SIDE_BACK;
-            return i;
-        }
+    const uint64_t hash = plane_hash_fn(&plane);
+    int index;
+
+    {
+        std::shared_lock<std::shared_mutex> lck { planehash_lock };
+        index = PlaneHash_Find(hash, &plane, side);
     }
+    if (index != -1)
+        return index;
+
+    // check again, another thread may have added it since
+    std::unique_lock<std::shared_mutex> lck { planehash_lock };
+    index = PlaneHash_Find(hash, &plane, side);
+    if (index != -1)
+        return index;
     return NewPlane(plane.normal, plane.dist, side);
 }
 
@@ -481,13 +590,23 @@ CreateBrushFaces(const mapentity_t *src, hullbrush_t *hullbrush,
         VectorSubtract(point, rotate_offset, point);
         plane.dist = DotProduct(plane.normal, point);
 
-        free(w);
+        FreeMem(w);
 
         f->texinfo = hullnum > 0 ? 0 : mapface->texinfo;
-        f->planenum = FindPlane(plane.normal, plane.dist, &f->planeside);
         f->next = facelist;
         facelist = f;
-        CheckFace(f, mapface);
+        if (deferred_faces) {
+            deferredface_t deferred;
+            deferred.face = f;
+            VectorCopy(plane.normal, deferred.normal);
+            deferred.dist = plane.dist;
+            deferred.linenum = mapface->linenum;
+            deferred.discard = false;
+            deferred_faces->push_back(deferred);
+            continue;
+        }
+        f->planenum = FindPlane(plane.normal, plane.dist, &f->planeside);
+        CheckFace(f, mapface->linenum);
         UpdateFaceSphere(f);
     }
 
@@ -538,8 +657,27 @@ FreeBrushFaces(face_t *facelist)
 
     for (face = facelist; face; face = next) {
         next = face->next;
-        free(face);
+        FreeMem(face);
+    }
+}
+
+/*
+=================
+DiscardBrushFaces
+
+Frees the faces a clip hull brush was expanded from, or when loading in
+parallel, leaves them to be freed once their planes have been resolved.
+=================
+*/
+static void
+DiscardBrushFaces(face_t *facelist)
+{
+    if (!deferred_faces) {
+        FreeBrushFaces(facelist);
+        return;
     }
+    for (deferredface_t &deferred : *deferred_faces)
+        deferred.discard = true;
 }
 
 
@@ -569,7 +707,7 @@ void
 FreeBrush(brush_t *brush)
 {
     FreeBrushFaces(brush->faces);
-    free(brush);
+    FreeMem(brush);
 }
 
 /*
@@ -998,6 +1136,8 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
     }
     
     if (!facelist) {
+        if (deferred_faces)
+            return NULL;        // warned when the brush is resolved
         Message(msgWarning, warnNoBrushFaces);
         logprint("^ brush at line %d of .map file\n", hullbrush.linenum);
         return NULL;
@@ -1008,19 +1148,19 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
          if (hullnum == 1) {
             vec3_t size[2] = { {-16, -16, -36}, {16, 16, 36} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
         else    if (hullnum == 2) {
             vec3_t size[2] = { {-32, -32, -32}, {32, 32, 32} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype,  hullnum);
         }
         else    if (hullnum == 3) {
             vec3_t size[2] = { {-16, -16, -18}, {16, 16, 18} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
     }
@@ -1029,19 +1169,19 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
         if (hullnum == 1) {
             vec3_t size[2] = { {-16, -16, -32}, {16, 16, 24} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
         else    if (hullnum == 2) {
             vec3_t size[2] = { {-24, -24, -20}, {24, 24, 20} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
         else    if (hullnum == 3) {
             vec3_t size[2] = { {-16, -16, -16}, {16, 16, 12} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
         else    if (hullnum == 4) {
@@ -1049,14 +1189,14 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
             if (options.hexen2 == 1) { /*original game*/
                 vec3_t size[2] = { {-40, -40, -42}, {40, 40, 42} };
                 ExpandBrush(&hullbrush, size, facelist);
-                FreeBrushFaces(facelist);
+                DiscardBrushFaces(facelist);
                 facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype,  hullnum);
             } else
 #endif
             {   /*mission pack*/
                     vec3_t size[2] = { {-8, -8, -8}, {8, 8, 8} };
                     ExpandBrush(&hullbrush, size, facelist);
-                    FreeBrushFaces(facelist);
+                    DiscardBrushFaces(facelist);
                     facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
             }
         }
@@ -1065,14 +1205,14 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
           if (options.hexen2 == 1) { /*original game*/
             vec3_t size[2] = { {-48, -48, -50}, {48, 48, 50} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
           } else
 #endif
           {
             vec3_t size[2] = { {-28, -28, -40}, {28, 28, 40} };
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
           }
         }
@@ -1083,13 +1223,13 @@ brush_t *LoadBrush(const mapentity_t *src, const mapbrush_t *mapbrush, const con
             vec3_t size[2] = { {-16, -16, -32}, {16, 16, 24} };
 
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         } else if (hullnum == 2) {
             vec3_t size[2] = { {-32, -32, -64}, {32, 32, 24} };
 
             ExpandBrush(&hullbrush, size, facelist);
-            FreeBrushFaces(facelist);
+            DiscardBrushFaces(facelist);
             facelist = CreateBrushFaces(src, &hullbrush, rotate_offset, rottype, hullnum);
         }
     }
@@ -1191,6 +1331,70 @@ Entity_SortBrushes(mapentity_t *dst)
     }    
 }
 
+/*
+ * A map brush picked by Brush_LoadEntity, loaded in parallel and then
+ * linked into the entity in map order.
+ */
+typedef struct loadbrush_s {
+    const mapbrush_t *mapbrush;
+    contentflags_t contents;
+    int index;
+    bool boundsonly;    // hull 0 clip brush, only counts towards the model bounds
+    bool reload;        // CheckFace would have edited a winding, load it in order
+    brush_t *brush;
+    std::vector<deferredface_t> faces;
+} loadbrush_t;
+
+static bool
+WindingHasDegenerateEdge(const winding_t *w)
+{
+    vec3_t edgevec;
+
+    for (int i = 0; i < w->numpoints; i++) {
+        VectorSubtract(w->points[(i + 1) % w->numpoints], w->points[i], edgevec);
+        if (VectorLength(edgevec) < ON_EPSILON)
+            return true;
+    }
+    return false;
+}
+
+/*
+=================
+ResolveBrush
+
+Finds the planes of a brush loaded in parallel, in the same order as
+loading it serially would have, and checks its faces against them.
+=================
+*/
+static brush_t *
+ResolveBrush(loadbrush_t *load, const mapentity_t *src, const vec3_t rotate_offset, const rotation_t rottype, const int hullnum)
+{
+    if (load->reload) {
+        for (const deferredface_t &deferred : load->faces) {
+            if (deferred.discard)
+                FreeMem(deferred.face);
+        }
+        if (load->brush)
+            FreeBrush(load->brush);
+        return LoadBrush(src, load->mapbrush, load->contents, rotate_offset, rottype, hullnum);
+    }
+
+    for (const deferredface_t &deferred : load->faces) {
+        face_t *face = deferred.face;
+        face->planenum = FindPlane(deferred.normal, deferred.dist, &face->planeside);
+        CheckFace(face, deferred.linenum);
+        UpdateFaceSphere(face);
+        if (deferred.discard)
+            FreeMem(face);
+    }
+
+    if (!load->brush) {
+        Message(msgWarning, warnNoBrushFaces);
+        logprint("^ brush at line %d of .map file\n", load->mapbrush->face(0).linenum);
+    }
+    return load->brush;
+}
+
 /*
 ============
 Brush_LoadEntity
@@ -1303,6 +1507,8 @@ Brush_LoadEntity(mapentity_t *dst, const mapentity_t *src, const int hullnum)
     if (atoi(ValueForKey(src, "_omitbrushes")))
         return;
 
+    std::vector<loadbrush_t> loads;
+
     for (i = 0; i < src->nummapbrushes; i++, mapbrush++) {
         mapbrush = &src->mapbrush(i);
         contentflags_t contents = Brush_GetContents(mapbrush);
@@ -1353,12 +1559,7 @@ Brush_LoadEntity(mapentity_t *dst, const mapentity_t *src, const int hullnum)
          */
         if (contents.is_clip()) {
             if (hullnum == 0) {
-                brush_t *brush = LoadBrush(src, mapbrush, contents, rotate_offset, rottype, hullnum);
-                if (brush) {
-                    AddToBounds(dst, brush->mins);
-                    AddToBounds(dst, brush->maxs);
-                    FreeBrush(brush);
-                }
+                loads.push_back({ mapbrush, contents, i, true });
                 continue;
             }
             // for hull1, 2, etc., convert clip to CONTENTS_SOLID
@@ -1411,10 +1612,42 @@ Brush_LoadEntity(mapentity_t *dst, const mapentity_t *src, const int hullnum)
             contents.extended |= CFLAGS_ILLUSIONARY_VISBLOCKER;
         }
 
-        brush_t *brush = LoadBrush(src, mapbrush, contents, rotate_offset, rottype, hullnum);
+        loads.push_back({ mapbrush, contents, i, false });
+    }
+
+    if (options.fixRotateObjTexture) {
+        // FindTexinfo isn't threadsafe, load them in order
+        for (loadbrush_t &load : loads)
+            load.brush = LoadBrush(src, load.mapbrush, load.contents, rotate_offset, rottype, hullnum);
+    } else {
+        tbb::parallel_for(static_cast<size_t>(0), loads.size(), [&](const size_t j) {
+            loadbrush_t &load = loads[j];
+
+            deferred_faces = &load.faces;
+            load.brush = LoadBrush(src, load.mapbrush, load.contents, rotate_offset, rottype, hullnum);
+            deferred_faces = nullptr;
+
+            for (const deferredface_t &deferred : load.faces) {
+                if (WindingHasDegenerateEdge(&deferred.face->w))
+                    load.reload = true;
+            }
+        });
+        for (loadbrush_t &load : loads)
+            load.brush = ResolveBrush(&load, src, rotate_offset, rottype, hullnum);
+    }
+
+    for (loadbrush_t &load : loads) {
+        brush_t *brush = load.brush;
         if (!brush)
             continue;
 
+        if (load.boundsonly) {
+            AddToBounds(dst, brush->mins);
+            AddToBounds(dst, brush->maxs);
+            FreeBrush(brush);
+            continue;
+        }
+
         dst->numbrushes++;
         brush->lmshift = lmshift;
         
@@ -1441,7 +1674,7 @@ Brush_LoadEntity(mapentity_t *dst, const mapentity_t *src, const int hullnum)
         AddToBounds(dst, brush->mins);
         AddToBounds(dst, brush->maxs);
 
-        Message(msgPercent, i + 1, src->nummapbrushes);
+        Message(msgPercent, load.index + 1, src->nummapbrushes);
     }
 }
 
@@ -1722,7 +1955,7 @@ void SplitBrush (const brush_t *brush,
         int		side;
         
         if (w)
-            free(w);
+            FreeMem(w);
         
         side = BrushMostlyOnSide (brush, plane.normal, plane.dist);
         if (side == SIDE_FRONT)
@@ -1766,12 +1999,12 @@ void SplitBrush (const brush_t *brush,
         if (!w->numpoints)
             continue;
         
-        winding_t *cw[2];
-        DivideWinding(w, &plane, &cw[0], &cw[1]);
+        winding_t cw[2];
+        DivideWindingInto(w, &plane, &cw[0], &cw[1]);
         
         for (int j=0 ; j<2 ; j++)
         {
-            if (!cw[j])
+            if (!cw[j].numpoints)
                 continue;
             /*
              if (WindingIsTiny (cw[j]))
@@ -1782,18 +2015,13 @@ void SplitBrush (const brush_t *brush,
              */
             
             face_t *newface = CopyFace(face);
-            CopyWindingInto(&newface->w, cw[j]);
+            CopyWindingInto(&newface->w, &cw[j]);
             UpdateFaceSphere(newface);
             
             // link it into the front or back brush we are building
             newface->next = b[j]->faces;
             b[j]->faces = newface;
         }
-        
-        if (cw[0])
-            free(cw[0]);
-        if (cw[1])
-            free(cw[1]);
     }
     
     
@@ -1851,7 +2079,7 @@ void SplitBrush (const brush_t *brush,
             CopyWindingInto(&newface->w, newwinding);
             newface->planenum = planenum;
             newface->planeside = !planeside;
-            free(newwinding);
+            FreeMem(newwinding);
         } else {
             CopyWindingInto(&newface->w, midwinding);
             newface->planenum = planenum;
@@ -1884,7 +2112,7 @@ void SplitBrush (const brush_t *brush,
     *front = b[0];
     *back = b[1];
     
-    free(midwinding);
+    FreeMem(midwinding);
 }
 
 #if 0
@@ -21,8 +21,8 @@
 // csg4.c
 
 #include <qbsp/qbsp.hh>
+#include <common/octree.hh>
 
-#include <atomic>
 #include <mutex>
 
 #include "tbb/parallel_for.h"
@@ -35,10 +35,6 @@ Brushes that touch still need to be split at the cut point to make a tjunction
 
 */
 
-static std::atomic<int> brushfaces;
-static int csgfaces;
-int csgmergefaces;
-
 // acquire this for anything that can't run in parallel during CSGFaces
 std::mutex csgfaces_lock;
 
@@ -208,7 +204,52 @@ SplitFace(face_t *in, const qbsp_plane_t *split, face_t **front, face_t **back)
         Error("Internal error: numpoints > MAXEDGES (%s)", __func__);
 
     /* free the original face now that it is represented by the fragments */
-    free(in);
+    FreeMem(in);
+}
+
+/*
+=================
+FaceOutsideBrush
+
+Clips a copy of the face's winding by each of the brush's planes. The
+copies are kept on the stack, unless a winding grows close to MAXEDGES
+points and has to move to the heap.
+=================
+*/
+static bool
+FaceOutsideBrush(const face_t *face, const brush_t *brush)
+{
+    winding_t windings[2];
+    const winding_t *w = &face->w;
+    winding_t *heapw = NULL;
+    int next = 0;
+
+    for (const face_t *clipface = brush->faces; clipface; clipface = clipface->next) {
+        qbsp_plane_t clipplane = map.planes[clipface->planenum];
+        if (!clipface->planeside) {
+            VectorSubtract(vec3_origin, clipplane.normal, clipplane.normal);
+            clipplane.dist = -clipplane.dist;
+        }
+
+        if (!heapw && w->numpoints + 4 > MAXEDGES)
+            heapw = CopyWinding(w);
+
+        if (heapw) {
+            heapw = ClipWinding(heapw, &clipplane, true);
+            if (!heapw)
+                return true;
+            continue;
+        }
+
+        if (!ClipWindingInto(w, &clipplane, true, &windings[next]))
+            return true;
+        w = &windings[next];
+        next ^= 1;
+    }
+
+    if (heapw)
+        FreeMem(heapw);
+    return false;
 }
 
 /*
@@ -228,25 +269,13 @@ RemoveOutsideFaces(const brush_t *brush, face_t **inside, face_t **outside)
     *inside = NULL;
     while (face) {
         next = face->next;
-        winding_t *w = CopyWinding(&face->w);
-        for (const face_t *clipface = brush->faces; clipface; clipface = clipface->next) {
-            qbsp_plane_t clipplane = map.planes[clipface->planenum];
-            if (!clipface->planeside) {
-                VectorSubtract(vec3_origin, clipplane.normal, clipplane.normal);
-                clipplane.dist = -clipplane.dist;
-            }
-            w = ClipWinding(w, &clipplane, true);
-            if (!w)
-                break;
-        }
-        if (!w) {
+        if (FaceOutsideBrush(face, brush)) {
             /* The face is completely outside this brush */
             face->next = *outside;
             *outside = face;
         } else {
             face->next = *inside;
             *inside = face;
-            free(w);
         }
         face = next;
     }
@@ -332,12 +361,15 @@ SaveFacesToPlaneList
 Links the given list of faces into a mapping from plane number to faces.
 This plane map is later used to build up the surfaces for creating the BSP.
 
+Returns the number of faces saved.
+
 Not parallel.
 ==================
 */
-void
+static int
 SaveFacesToPlaneList(face_t *facelist, bool mirror, std::map<int, face_t *> &planefaces)
 {
+    int csgfaces = 0;
     face_t *face, *next;
 
     for (face = facelist; face; face = next) {
@@ -394,6 +426,8 @@ SaveFacesToPlaneList(face_t *facelist, bool mirror, std::map<int, face_t *> &pla
         
         csgfaces++;
     }
+
+    return csgfaces;
 }
 
 static void
@@ -403,7 +437,7 @@ FreeFaces(face_t *face)
 
     while (face) {
         next = face->next;
-        free(face);
+        FreeMem(face);
         face = next;
     }
 }
@@ -511,8 +545,6 @@ BuildSurfaces(const std::map<int, face_t *> &planefaces)
         surf->next = surfaces;
         surfaces = surf;
         surf->faces = entry->second;
-        for (const face_t *face = surf->faces; face; face = face->next)
-            csgmergefaces++;
         
         /* Calculate bounding box and flags */
         CalcSurfaceInfo(surf);
@@ -535,7 +567,6 @@ CopyBrushFaces(const brush_t *brush)
 
     facelist = NULL;
     for (face = brush->faces; face; face = face->next) {
-        brushfaces++;
         newface = (face_t *)AllocMem(OTHER, sizeof(face_t), true);
         *newface = *face;
         newface->contents[0] = options.target_game->create_empty_contents();
@@ -549,6 +580,23 @@ CopyBrushFaces(const brush_t *brush)
     return facelist;
 }
 
+/*
+==================
+BrushOctreeBounds
+
+Float bounds for the brush octree, padded so rounding can't drop a pair
+of brushes that only just touch. The exact test is still done after.
+==================
+*/
+static aabb3f
+BrushOctreeBounds(const brush_t *brush)
+{
+    const qvec3f mins(brush->mins[0], brush->mins[1], brush->mins[2]);
+    const qvec3f maxs(brush->maxs[0], brush->maxs[1], brush->maxs[2]);
+
+    return aabb3f(mins, maxs).grow(qvec3f(1, 1, 1));
+}
+
 /*
 ==================
 CSGFaces
@@ -559,11 +607,14 @@ Returns a list of surfaces containing all of the faces
 surface_t *
 CSGFaces(const mapentity_t *entity)
 {
+    timingscope_t scope("CSGFaces", entity->outputmodelnumber);
+
     Message(msgProgress, "CSGFaces");
 
-    csgfaces = 0;
-    brushfaces = 0;
-    csgmergefaces = 0;
+    // counts are local, CSGFaces can run for several hulls at once
+    int brushfaces = 0;
+    int csgfaces = 0;
+    int csgmergefaces = 0;
 
 #if 0
     logprint("CSGFaces brush order:\n");
@@ -577,12 +628,19 @@ CSGFaces(const mapentity_t *entity)
     std::vector<const brush_t*> brushvec;
     for (const brush_t* brush = entity->brushes; brush; brush = brush->next) {
         brushvec.push_back(brush);
+        brushfaces += Brush_NumFaces(brush);
     }
 
     // output vector for the parallel_for
     std::vector<face_t*> brushvec_outsides;
     brushvec_outsides.resize(brushvec.size());
 
+    // find the brushes each brush may touch, instead of testing every pair
+    std::vector<std::pair<aabb3f, int>> brushboxes;
+    for (size_t i = 0; i < brushvec.size(); ++i)
+        brushboxes.emplace_back(BrushOctreeBounds(brushvec[i]), static_cast<int>(i));
+    const octree_t<int> brushoctree = makeOctree(brushboxes);
+
     /*
      * For each brush, clip away the parts that are inside other brushes.
      * Solid brushes override non-solid brushes.
@@ -592,18 +650,21 @@ CSGFaces(const mapentity_t *entity)
      * The output of this is a face list for each brush called "outside"
      */
     tbb::parallel_for(static_cast<size_t>(0), brushvec.size(),
-                      [entity, &brushvec, &brushvec_outsides](const size_t i) {
+                      [&brushvec, &brushvec_outsides, &brushboxes, &brushoctree](const size_t i) {
         const brush_t* brush = brushvec[i];
         face_t *outside = CopyBrushFaces(brush);
-        bool overwrite = false;
-        const brush_t *clipbrush = entity->brushes;
 
-        for (; clipbrush; clipbrush = clipbrush->next) {
-            if (brush == clipbrush) {
-                /* Brushes further down the list overried earlier ones */
-                overwrite = true;
+        // sorted, so the clip brushes are visited in entity order
+        const std::vector<int> clipbrushes = brushoctree.queryTouchingBBox(brushboxes[i].first);
+
+        for (const int clipbrushnum : clipbrushes) {
+            const brush_t *clipbrush = brushvec[clipbrushnum];
+            if (brush == clipbrush)
                 continue;
-            }
+
+            /* Brushes further down the list overried earlier ones */
+            const bool overwrite = (static_cast<size_t>(clipbrushnum) > i);
+
             if (clipbrush->contents.is_empty(options.target_game)) {
                 /* Ensure hint never clips anything */
                 continue;
@@ -697,11 +758,14 @@ CSGFaces(const mapentity_t *entity)
          * If the brush is non-solid, mirror faces for the inside view
          */
         const bool mirror = options.fContentHack ? true : !brush->contents.is_solid(options.target_game);
-        SaveFacesToPlaneList(outside, mirror, planefaces);
+        csgfaces += SaveFacesToPlaneList(outside, mirror, planefaces);
     }
     surface_t *surfaces = BuildSurfaces(planefaces);
+    for (const surface_t *surf = surfaces; surf; surf = surf->next)
+        for (const face_t *face = surf->faces; face; face = face->next)
+            csgmergefaces++;
 
-    Message(msgStat, "%8d brushfaces", brushfaces.load());
+    Message(msgStat, "%8d brushfaces", brushfaces);
     Message(msgStat, "%8d csgfaces", csgfaces);
     Message(msgStat, "%8d mergedfaces", csgmergefaces);
 
@@ -128,10 +128,19 @@ const mapbrush_t &mapentity_t::mapbrush(int i) const {
     return map.brushes.at(this->firstmapbrush + i);
 }
 
+static int
+AddMiptex(const texdata_t &tex)
+{
+    const int i = map.nummiptex();
+    map.miptex.push_back(tex);
+    map.miptex_lookup[tex.name].push_back(i);
+    return i;
+}
+
 static void
 AddAnimTex(const char *name)
 {
-    int i, j, frame;
+    int i, frame;
     char framename[16], basechar = '0';
 
     frame = name[1];
@@ -156,14 +165,10 @@ AddAnimTex(const char *name)
     q_snprintf(framename, sizeof(framename), "%s", name);
     for (i = 0; i < frame; i++) {
         framename[1] = basechar + i;
-        for (j = 0; j < map.nummiptex(); j++) {
-            if (!Q_strcasecmp(framename, map.miptex.at(j).name.c_str()))
-                break;
-        }
-        if (j < map.nummiptex())
+        if (map.miptex_lookup.count(framename))
             continue;
 
-        map.miptex.push_back({ framename });
+        AddMiptex({ framename });
     }
 }
 
@@ -210,16 +215,12 @@ FindMiptex(const char *name, std::optional<extended_texinfo_t> &extended_info, b
             extended_info = extended_texinfo_t { };
         }
 
-        for (i = 0; i < map.nummiptex(); i++) {
-            const texdata_t &tex = map.miptex.at(i);
-
-            if (!Q_strcasecmp(name, tex.name.c_str())) {
-                return i;
-            }
+        const auto it = map.miptex_lookup.find(name);
+        if (it != map.miptex_lookup.end()) {
+            return it->second.front();
         }
 
-        i = map.miptex.size();
-        map.miptex.push_back({ name });
+        i = AddMiptex({ name });
     
         /* Handle animating textures carefully */
         if (name[0] == '+') {
@@ -243,19 +244,20 @@ FindMiptex(const char *name, std::optional<extended_texinfo_t> &extended_info, b
             }
         }
 
-        for (i = 0; i < map.nummiptex(); i++) {
-            const texdata_t &tex = map.miptex.at(i);
+        const auto it = map.miptex_lookup.find(name);
+        if (it != map.miptex_lookup.end()) {
+            for (const int j : it->second) {
+                const texdata_t &tex = map.miptex.at(j);
 
-            if (!Q_strcasecmp(name, tex.name.c_str()) &&
-                tex.flags == extended_info->flags &&
-                tex.value == extended_info->value) {
+                if (tex.flags == extended_info->flags &&
+                    tex.value == extended_info->value) {
 
-                return i;
+                    return j;
+                }
             }
         }
 
-        i = map.miptex.size();
-        map.miptex.push_back({ name, extended_info->flags, extended_info->value });
+        i = AddMiptex({ name, extended_info->flags, extended_info->value });
     
         /* Handle animating textures carefully */
         if (wal && wal->anim_name[0]) {
@@ -326,7 +328,7 @@ Returns a global texinfo number
 int
 FindTexinfo(const mtexinfo_t &texinfo)
 {
-    // NaN's will break mtexinfo_lookup, since they're being used as a std::map key and don't compare properly with <.
+    // NaN's will break mtexinfo_lookup, since they're being used as a hash map key and don't compare equal to themselves.
     // They should have been stripped out already in ValidateTextureProjection.
     for (int i=0;i<2;i++) {
         for (int j=0;j<4;j++) {
@@ -345,7 +347,7 @@ FindTexinfo(const mtexinfo_t &texinfo)
     map.mtexinfos.push_back(texinfo);
     map.mtexinfo_lookup[texinfo] = num_texinfo;
     
-    // catch broken < implementations in mtexinfo_t
+    // catch broken hash or == implementations in mtexinfo_t
     assert(map.mtexinfo_lookup.find(texinfo) != map.mtexinfo_lookup.end());
     
     return num_texinfo;
@@ -1363,7 +1365,7 @@ ParsePlaneDef(parser_t *parser, vec3_t planepts[3])
 
         for (j = 0; j < 3; j++) {
             ParseToken(parser, PARSE_SAMELINE);
-            planepts[i][j] = atof(parser->token);
+            planepts[i][j] = ParseFloatToken(parser);
         }
 
         ParseToken(parser, PARSE_SAMELINE);
@@ -1388,20 +1390,20 @@ ParseValve220TX(parser_t *parser, vec3_t axis[2], vec_t shift[2],
             goto parse_error;
         for (j = 0; j < 3; j++) {
             ParseToken(parser, PARSE_SAMELINE);
-            axis[i][j] = atof(parser->token);
+            axis[i][j] = ParseFloatToken(parser);
         }
         ParseToken(parser, PARSE_SAMELINE);
-        shift[i] = atof(parser->token);
+        shift[i] = ParseFloatToken(parser);
         ParseToken(parser, PARSE_SAMELINE);
         if (strcmp(parser->token, "]"))
             goto parse_error;
     }
     ParseToken(parser, PARSE_SAMELINE);
-    rotate[0] = atof(parser->token);
+    rotate[0] = ParseFloatToken(parser);
     ParseToken(parser, PARSE_SAMELINE);
-    scale[0] = atof(parser->token);
+    scale[0] = ParseFloatToken(parser);
     ParseToken(parser, PARSE_SAMELINE);
-    scale[1] = atof(parser->token);
+    scale[1] = ParseFloatToken(parser);
     return;
 
  parse_error:
@@ -1422,7 +1424,7 @@ ParseBrushPrimTX(parser_t *parser, vec3_t texMat[2])
         
         for (int j = 0; j < 3; j++) {
             ParseToken(parser, PARSE_SAMELINE);
-            texMat[i][j] = atof(parser->token);
+            texMat[i][j] = ParseFloatToken(parser);
         }
         
         ParseToken(parser, PARSE_SAMELINE);
@@ -1477,15 +1479,15 @@ ParseTextureDef(parser_t *parser, mapface_t &mapface, const mapbrush_t *brush, m
             // Read extra Q2 params
             extinfo = ParseExtendedTX(parser);
         } else {
-            shift[0] = atof(parser->token);
+            shift[0] = ParseFloatToken(parser);
             ParseToken(parser, PARSE_SAMELINE);
-            shift[1] = atof(parser->token);
+            shift[1] = ParseFloatToken(parser);
             ParseToken(parser, PARSE_SAMELINE);
-            rotate = atof(parser->token);
+            rotate = ParseFloatToken(parser);
             ParseToken(parser, PARSE_SAMELINE);
-            scale[0] = atof(parser->token);
+            scale[0] = ParseFloatToken(parser);
             ParseToken(parser, PARSE_SAMELINE);
-            scale[1] = atof(parser->token);
+            scale[1] = ParseFloatToken(parser);
             
             // Read extra Q2 params and/or QuArK subtype
             extinfo = ParseExtendedTX(parser);
@@ -1889,6 +1891,40 @@ static void TranslateMapFace(mapface_t *face, const vec3_t offset)
     face->set_texvecs(newtexvecs);
 }
 
+/*
+ * Gives the entity its own copy of the brushes in an external .map, which
+ * is only parsed the first time it's used. The parsed brushes are kept as
+ * they are, so each instance can be transformed separately.
+ */
+static void
+InstanceExternalMap(const char *filename, mapentity_t *entity)
+{
+    auto it = map.external_maps.find(filename);
+    if (it == map.external_maps.end()) {
+        const mapentity_t external_worldspawn = LoadExternalMap(filename);
+        const auto range = std::make_pair(external_worldspawn.firstmapbrush, external_worldspawn.nummapbrushes);
+        it = map.external_maps.emplace(filename, range).first;
+    }
+
+    const int firstmapbrush = it->second.first;
+    const int nummapbrushes = it->second.second;
+
+    entity->firstmapbrush = map.numbrushes();
+    entity->nummapbrushes = nummapbrushes;
+
+    for (int i = 0; i < nummapbrushes; i++) {
+        mapbrush_t brush = map.brushes.at(firstmapbrush + i);
+        const int firstface = brush.firstface;
+
+        brush.firstface = map.numfaces();
+        for (int j = 0; j < brush.numfaces; j++) {
+            mapface_t face = map.faces.at(firstface + j);
+            map.faces.push_back(std::move(face));
+        }
+        map.brushes.push_back(brush);
+    }
+}
+
 void
 ProcessExternalMapEntity(mapentity_t *entity)
 {
@@ -1906,11 +1942,7 @@ ProcessExternalMapEntity(mapentity_t *entity)
     
     Q_assert(0 == entity->nummapbrushes); // misc_external_map must be a point entity
     
-    const mapentity_t external_worldspawn = LoadExternalMap(file);
-    
-    // copy the brushes into the target
-    entity->firstmapbrush = external_worldspawn.firstmapbrush;
-    entity->nummapbrushes = external_worldspawn.nummapbrushes;
+    InstanceExternalMap(file, entity);
     
     vec3_t origin;
     GetVectorForKey(entity, "origin", origin);
@@ -2026,7 +2058,7 @@ mapentity_t LoadExternalMap(const char *filename)
     
     Message(msgStat, "LoadExternalMap: '%s': Loaded %d mapbrushes.\n", filename, dest.nummapbrushes);
     
-    free(buf);
+    FreeMem(buf);
     
     return dest;
 }
@@ -2056,7 +2088,7 @@ LoadMapFile(void)
     assert(map.entities.back().numbrushes == 0);
     map.entities.pop_back();
 
-    free(buf);
+    FreeMem(buf);
 
     // Print out warnings for entities
     if (!(rgfStartSpots & info_player_start))
@@ -2423,7 +2455,7 @@ WriteBspBrushMap(const char *name, const std::vector<const brush_t *> &list)
             
             fprintf (f, "notexture 0 0 0 1 1\n" );
             
-            free(w);
+            FreeMem(w);
         }
         fprintf (f, "}\n");
     }
@@ -22,6 +22,10 @@
 
 #include <qbsp/qbsp.hh>
 
+#include <vector>
+
+#include "tbb/parallel_for.h"
+
 #ifdef PARANOID
 static void
 CheckColinear(face_t *f)
@@ -78,6 +82,12 @@ TryMerge(face_t *f1, face_t *f2)
         f1->lmshift[1] != f2->lmshift[1])
         return NULL;
 
+    // faces with a common edge have overlapping bounding spheres
+    VectorSubtract(f1->origin, f2->origin, delta);
+    dot = f1->radius + f2->radius + 2 * EQUAL_EPSILON;
+    if (DotProduct(delta, delta) > dot * dot)
+        return NULL;
+
     // find a common edge
     p1 = p2 = NULL;             // stop compiler warning
     j = 0;                      //
@@ -185,7 +195,7 @@ MergeFaceToList(face_t *face, face_t *list)
 #endif
         newf = TryMerge(face, f);
         if (newf) {
-            free(face);
+            FreeMem(face);
             f->w.numpoints = -1;        // merged out, remove later
             face = newf;
             f = list;
@@ -213,7 +223,7 @@ FreeMergeListScraps(face_t *merged)
     for (; merged; merged = next) {
         next = merged->next;
         if (merged->w.numpoints == -1)
-            free(merged);
+            FreeMem(merged);
         else {
             merged->next = head;
             head = merged;
@@ -262,14 +272,19 @@ MergeAll(surface_t *surfhead)
 
     Message(msgProgress, "MergeAll");
 
+    // each plane's faces merge independently of the others
+    std::vector<surface_t *> surfs;
+    for (surf = surfhead; surf; surf = surf->next)
+        surfs.push_back(surf);
+
+    tbb::parallel_for(static_cast<size_t>(0), surfs.size(), [&](const size_t i) {
+        MergePlaneFaces(surfs[i]);
+    });
+
     for (surf = surfhead; surf; surf = surf->next) {
-        MergePlaneFaces(surf);
         for (f = surf->faces; f; f = f->next)
             mergefaces++;
     }
 
     Message(msgStat, "%8d mergefaces", mergefaces);
-
-    // Quick hack to let solidbsp print out progress %
-    csgmergefaces = mergefaces;
 }
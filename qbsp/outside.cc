@@ -23,9 +23,13 @@
 
 #include <vector>
 #include <set>
-#include <list>
+#include <mutex>
 #include <utility>
 
+// hulls are built concurrently, only one of them may write the leak file
+static std::mutex leakfile_lock;
+static int leakhull;
+
 /*
 ===========
 PointInLeaf
@@ -46,34 +50,53 @@ PointInLeaf(node_t *node, const vec3_t point)
     return node;
 }
 
+static std::string
+LeakFileName(const char *extension)
+{
+    return StrippedExtension(options.szBSPName) + extension;
+}
+
 static FILE *
 InitPtsFile(void)
 {
     FILE *ptsfile;
 
-    StripExtension(options.szBSPName);
-    strcat(options.szBSPName, ".pts");
-    ptsfile = fopen(options.szBSPName, "wt");
+    const std::string filename = LeakFileName(".pts");
+    ptsfile = fopen(filename.c_str(), "wt");
     if (!ptsfile)
-        Error("Failed to open %s: %s", options.szBSPName, strerror(errno));
+        Error("Failed to open %s: %s", filename.c_str(), strerror(errno));
 
     return ptsfile;
 }
 
 // new code
 
+/*
+==================
+GatherLeafs_r
+
+Collects the leafs in tree order and numbers them through visleafnum, which
+the portal file writer renumbers before using. Clears the flood state on the
+leafs and touchesOccupiedLeaf on the node faces on the way.
+==================
+*/
 static void
-ClearOccupied_r(node_t *node)
+GatherLeafs_r(node_t *node, std::vector<node_t *> *leafs)
 {
     if (node->planenum != PLANENUM_LEAF) {
-        ClearOccupied_r(node->children[0]);
-        ClearOccupied_r(node->children[1]);
+        for (face_t *face = node->faces; face; face = face->next) {
+            face->touchesOccupiedLeaf = false;
+        }
+        GatherLeafs_r(node->children[0], leafs);
+        GatherLeafs_r(node->children[1], leafs);
         return;
     }
     
     /* leaf node */
+    node->visleafnum = static_cast<int>(leafs->size());
     node->occupied = 0;
     node->occupant = nullptr;
+    leafs->push_back(node);
 }
 
 /*
@@ -87,12 +110,7 @@ from q3map
 */
 static bool Portal_Passable(const portal_t *p)
 {
-    if (p->nodes[0] == &outside_node
-        || p->nodes[1] == &outside_node) {
-        // FIXME: need this because the outside_node doesn't have PLANENUM_LEAF set
-        return false;
-    }
-    
+    // the outside node is a solid leaf, so portals to it are never passable
     Q_assert(p->nodes[0]->planenum == PLANENUM_LEAF);
     Q_assert(p->nodes[1]->planenum == PLANENUM_LEAF);
 
@@ -105,40 +123,62 @@ static bool Portal_Passable(const portal_t *p)
 
 /*
 ==================
+BFSFloodFillFromOccupiedLeafs
+
+Sets leaf->occupied to 1 + the number of passable portals to the nearest
+occupied leaf. The passable portals are flattened into per-leaf lists of
+leaf numbers first, so the flood itself only walks int arrays, one
+frontier at a time.
+
 precondition: all leafs have occupied set to 0
 ==================
 */
 static void
-BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &occupied_leafs)
+BFSFloodFillFromOccupiedLeafs(const std::vector<node_t *> &leafs, const std::vector<node_t *> &occupied_leafs)
 {
-    std::list<std::pair<node_t *, int>> queue;
+    const int numleafs = static_cast<int>(leafs.size());
+
+    std::vector<int> firstneighbour(numleafs + 1);
+    std::vector<int> neighbours;
+    for (int i = 0; i < numleafs; i++) {
+        node_t *node = leafs[i];
+
+        firstneighbour[i] = static_cast<int>(neighbours.size());
+        int side;
+        for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
+            side = (portal->nodes[0] == node);
+            
+            if (!Portal_Passable(portal))
+                continue;
+            
+            neighbours.push_back(portal->nodes[side]->visleafnum);
+        }
+    }
+    firstneighbour[numleafs] = static_cast<int>(neighbours.size());
+
+    std::vector<int> occupied(numleafs, 0);
+    std::vector<int> frontier, next;
     for (node_t *leaf : occupied_leafs) {
-        queue.push_back(std::make_pair(leaf, 1));
+        occupied[leaf->visleafnum] = 1;
+        frontier.push_back(leaf->visleafnum);
     }
     
-    while (!queue.empty()) {
-        auto pair = queue.front();
-        queue.pop_front();
-        
-        node_t *node = pair.first;
-        const int dist = pair.second;
-        
-        if (node->occupied == 0) {
-            // we haven't visited this node yet
-            node->occupied = dist;
-            
-            // push neighbouring nodes onto the back of the queue
-            int side;
-            for (portal_t *portal = node->portals; portal; portal = portal->next[!side]) {
-                side = (portal->nodes[0] == node);
-                
-                if (!Portal_Passable(portal))
-                    continue;
-                
-                node_t *neighbour = portal->nodes[side];
-                queue.push_back(std::make_pair(neighbour, dist + 1));
+    for (int dist = 2; !frontier.empty(); dist++) {
+        next.clear();
+        for (const int leafnum : frontier) {
+            for (int i = firstneighbour[leafnum]; i < firstneighbour[leafnum + 1]; i++) {
+                const int neighbour = neighbours[i];
+                if (occupied[neighbour] == 0) {
+                    occupied[neighbour] = dist;
+                    next.push_back(neighbour);
+                }
             }
         }
+        std::swap(frontier, next);
+    }
+
+    for (int i = 0; i < numleafs; i++) {
+        leafs[i]->occupied = occupied[i];
     }
 }
 
@@ -234,7 +274,7 @@ WriteLeakLine(const std::pair<std::vector<portal_t *>, node_t*> &leakline)
     }
     
     fclose(ptsfile);
-    Message(msgLiteral, "Leak file written to %s\n", options.szBSPName);
+    Message(msgLiteral, "Leak file written to %s\n", LeakFileName(".pts").c_str());
 }
 
 /*
@@ -275,124 +315,63 @@ FindOccupiedLeafs(node_t *headnode)
 
 /*
 ==================
-ResetFacesTouchingOccupiedLeafs
+FillOutLeafs
 
-Set f->touchesOccupiedLeaf=false on all faces.
+Fills the leafs not reachable from entities with solid, and deletes (by
+setting f->w.numpoints=0) the faces in solid leafs. Returns the number of
+leafs filled.
 ==================
 */
-static void
-ResetFacesTouchingOccupiedLeafs(node_t *node)
+static int
+FillOutLeafs(const std::vector<node_t *> &leafs)
 {
-    if (node->planenum == PLANENUM_LEAF) {
-        return;
-    }
-
-    for (face_t *face = node->faces; face; face = face->next) {
-        face->touchesOccupiedLeaf = false;
+    // Set f->touchesOccupiedLeaf=true on faces that are touching occupied leafs
+    for (node_t *node : leafs) {
+        if (node->occupied > 0) {
+            // This is an occupied leaf, so we need to keep all of the faces touching it.
+            for (face_t **markface = node->markfaces; *markface; markface++) {
+                (*markface)->touchesOccupiedLeaf = true;
+            }
+        }
     }
 
-    ResetFacesTouchingOccupiedLeafs(node->children[0]);
-    ResetFacesTouchingOccupiedLeafs(node->children[1]);
-}
-
-/*
-==================
-MarkFacesTouchingOccupiedLeafs
+    int outleafs = 0;
+    for (node_t *node : leafs) {
+        // skip leafs reachable from entities, don't fill sky, or count solids as outleafs
+        if (node->occupied == 0
+            && !node->contents.is_solid(options.target_game)
+            && !node->contents.is_sky(options.target_game)) {
+
+            // Now check all faces touching the leaf. If any of them are partially going into the occupied part of the map,
+            // don't fill the leaf (see comment in FillOutside).
+            bool skipFill = false;
+            for (face_t **markface = node->markfaces; *markface; markface++) {
+                if ((*markface)->touchesOccupiedLeaf) {
+                    skipFill = true;
+                    break;
+                }
+            }
 
-Set f->touchesOccupiedLeaf=true on faces that are touching occupied leafs
-==================
-*/
-static void
-MarkFacesTouchingOccupiedLeafs(node_t *node)
-{
-    if (node->planenum != PLANENUM_LEAF) {
-        MarkFacesTouchingOccupiedLeafs(node->children[0]);
-        MarkFacesTouchingOccupiedLeafs(node->children[1]);
-        return;
-    }
+            // Finally, we can fill it in as void.
+            if (!skipFill) {
+                node->contents = options.target_game->create_solid_contents();
+                outleafs++;
+            }
+        }
 
-    // visit the leaf
+        if (!node->contents.is_solid(options.target_game))
+            continue;
 
-    if (node->occupied > 0) {
-        // This is an occupied leaf, so we need to keep all of the faces touching it.
         for (face_t **markface = node->markfaces; *markface; markface++) {
-            (*markface)->touchesOccupiedLeaf = true;
+            // NOTE: This is how faces are deleted here, kind of ugly
+            (*markface)->w.numpoints = 0;
         }
-    }
-}
-
-/*
-==================
-ClearOutFaces
-
-Deletes (by setting f->w.numpoints=0) faces in solid nodes
-==================
-*/
-static void
-ClearOutFaces(node_t *node)
-{
-    if (node->planenum != PLANENUM_LEAF) {
-        ClearOutFaces(node->children[0]);
-        ClearOutFaces(node->children[1]);
-        return;
-    }
-
-    // visit the leaf
-    if (!node->contents.is_solid(options.target_game)) {
-        return;
-    }
-
-    for (face_t **markface = node->markfaces; *markface; markface++) {
-        // NOTE: This is how faces are deleted here, kind of ugly
-        (*markface)->w.numpoints = 0;
-    }
 
-    // FIXME: Shouldn't be needed here
-    node->faces = NULL;
-}
-
-static void
-OutLeafsToSolid_r(node_t *node, int *outleafs_count)
-{
-    if (node->planenum != PLANENUM_LEAF) {
-        OutLeafsToSolid_r(node->children[0], outleafs_count);
-        OutLeafsToSolid_r(node->children[1], outleafs_count);
-        return;
-    }
-    
-    // skip leafs reachable from entities
-    if (node->occupied > 0)
-        return;
-    
-    // Don't fill sky, or count solids as outleafs
-    if (node->contents.is_solid(options.target_game)
-        || node->contents.is_sky(options.target_game))
-        return;
-
-    // Now check all faces touching the leaf. If any of them are partially going into the occupied part of the map,
-    // don't fill the leaf (see comment in FillOutside).
-    bool skipFill = false;
-    for (face_t **markface = node->markfaces; *markface; markface++) {
-        if ((*markface)->touchesOccupiedLeaf) {
-            skipFill = true;
-            break;
-        }
-    }
-    if (skipFill) {
-        return;
+        // FIXME: Shouldn't be needed here
+        node->faces = NULL;
     }
 
-    // Finally, we can fill it in as void.
-    node->contents = options.target_game->create_solid_contents();
-    *outleafs_count += 1;
-}
-
-static int
-OutLeafsToSolid(node_t *node)
-{
-    int count = 0;
-    OutLeafsToSolid_r(node, &count);
-    return count;
+    return outleafs;
 }
 
 //=============================================================================
@@ -401,11 +380,14 @@ OutLeafsToSolid(node_t *node)
 ===========
 FillOutside
 
+outside_node is the one passed to PortalizeWorld.
 ===========
 */
 bool
-FillOutside(node_t *node, const int hullnum)
+FillOutside(node_t *node, node_t *outside_node, const int hullnum)
 {
+    timingscope_t scope("FillOutside", hullnum);
+
     Message(msgProgress, "FillOutside");
     
     if (options.fNofill) {
@@ -414,7 +396,8 @@ FillOutside(node_t *node, const int hullnum)
     }
     
     /* Clear the node->occupied on all leafs to 0 */
-    ClearOccupied_r(node);
+    std::vector<node_t *> leafs;
+    GatherLeafs_r(node, &leafs);
     
     const std::vector<node_t *> occupied_leafs = FindOccupiedLeafs(node);
 
@@ -423,11 +406,11 @@ FillOutside(node_t *node, const int hullnum)
         return false;
     }
 
-    BFSFloodFillFromOccupiedLeafs(occupied_leafs);
+    BFSFloodFillFromOccupiedLeafs(leafs, occupied_leafs);
 
     /* first check to see if an occupied leaf is hit */
-    const int side = (outside_node.portals->nodes[0] == &outside_node);
-    node_t *fillnode = outside_node.portals->nodes[side];
+    const int side = (outside_node->portals->nodes[0] == outside_node);
+    node_t *fillnode = outside_node->portals->nodes[side];
     
     if (fillnode->occupied > 0) {
         const auto leakline = MakeLeakLine(fillnode);
@@ -437,16 +420,19 @@ FillOutside(node_t *node, const int hullnum)
         
         const vec_t *origin = leakentity->origin;
         Message(msgWarning, warnMapLeak, ValueForKey(leakentity, "classname"), origin[0], origin[1], origin[2]);
-        if (map.leakfile)
+
+        std::unique_lock<std::mutex> lck { leakfile_lock };
+
+        /* keep the leak from the lowest hull, as a serial compile would */
+        if (map.leakfile && leakhull <= hullnum)
             return false;
         
         WriteLeakLine(leakline);
         map.leakfile = true;
+        leakhull = hullnum;
 
         /* Get rid of the .prt file since the map has a leak */
-        StripExtension(options.szBSPName);
-        strcat(options.szBSPName, ".prt");
-        remove(options.szBSPName);
+        remove(LeakFileName(".prt").c_str());
         
         if (options.fLeakTest) {
             logprint("Aborting because -leaktest was used.\n");
@@ -475,14 +461,8 @@ FillOutside(node_t *node, const int hullnum)
     // In order to avoid this scenario, we need to detect those "void-and-non-void-straddling" faces and not fill those leafs
     // in as solid. This will keep some extra faces around but keep the content types consistent.
 
-    ResetFacesTouchingOccupiedLeafs(node);
-    MarkFacesTouchingOccupiedLeafs(node);
-
-    /* now go back and fill outside with solid contents */
-    const int outleafs = OutLeafsToSolid(node);
-
-    /* remove faces from filled in leafs */
-    ClearOutFaces(node);
+    /* now go back and fill outside with solid contents, and remove faces from filled in leafs */
+    const int outleafs = FillOutLeafs(leafs);
 
     Message(msgStat, "%8d outleafs", outleafs);
     return true;
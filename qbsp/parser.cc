@@ -147,14 +147,43 @@ ParseToken(parser_t *p, int flags)
         }
         p->pos++;
     } else {
-        while (*p->pos > 32) {
-            *token_p++ = *p->pos++;
-            if (token_p > &p->token[MAXTOKEN - 1])
-                Error("line %d: Token too large", p->linenum);
-        }
+        /* find the end first, then copy the token in one go */
+        const char *end = p->pos;
+        while (*end > 32)
+            end++;
+        const size_t length = end - p->pos;
+        if (length > MAXTOKEN - 1)
+            Error("line %d: Token too large", p->linenum);
+        memcpy(token_p, p->pos, length);
+        token_p += length;
+        p->pos = end;
     }
  out:
     *token_p = 0;
 
     return true;
 }
+
+/*
+ * Plane points and texture axes in .map files are nearly always whole
+ * numbers, which are converted directly. Anything else goes through atof,
+ * so the value is always the same as atof would give.
+ */
+double
+ParseFloatToken(const parser_t *p)
+{
+    const char *c = p->token;
+    const bool negative = (*c == '-');
+    if (*c == '-' || *c == '+')
+        c++;
+
+    const char *digits = c;
+    int64_t value = 0;
+    while (*c >= '0' && *c <= '9' && c - digits < 15)
+        value = value * 10 + (*c++ - '0');
+
+    if (c == digits || *c)
+        return atof(p->token);
+
+    return negative ? -static_cast<double>(value) : static_cast<double>(value);
+}
@@ -24,8 +24,6 @@
 
 #include <fmt/format.h>
 
-node_t outside_node;    // portals outside the world face this
-
 class portal_state_t {
 public:
     int num_visportals;
@@ -54,6 +52,29 @@ WriteFloat(FILE *portalFile, vec_t v)
         fmt::print(portalFile, "{} ", v);
 }
 
+/* binary .prt values are little-endian, whatever the host */
+static void
+WriteBinaryInt(FILE *portalFile, int32_t v)
+{
+    const uint32_t u = static_cast<uint32_t>(v);
+    const uint8_t bytes[4] = { (uint8_t)u, (uint8_t)(u >> 8), (uint8_t)(u >> 16), (uint8_t)(u >> 24) };
+    fwrite(bytes, 1, sizeof(bytes), portalFile);
+}
+
+static void
+WriteBinaryDouble(FILE *portalFile, vec_t v)
+{
+    // same snapping as WriteFloat, so vis sees the same points either way
+    double d = (fabs(v - Q_rint(v)) < ZERO_EPSILON) ? Q_rint(v) : v;
+    uint64_t u;
+    uint8_t bytes[8];
+
+    memcpy(&u, &d, sizeof(u));
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (uint8_t)(u >> (8 * i));
+    fwrite(bytes, 1, sizeof(bytes), portalFile);
+}
+
 static contentflags_t
 ClusterContents(const node_t *node)
 {
@@ -100,7 +121,7 @@ PortalThru(const portal_t *p)
 }
 
 static void
-WritePortals_r(node_t *node, FILE *portalFile, bool clusters)
+WritePortals_r(node_t *node, FILE *portalFile, bool clusters, bool binary = false)
 {
     const portal_t *p, *next;
     const winding_t *w;
@@ -109,8 +130,8 @@ WritePortals_r(node_t *node, FILE *portalFile, bool clusters)
     qbsp_plane_t plane2;
 
     if (node->planenum != PLANENUM_LEAF && !node->detail_separator) {
-        WritePortals_r(node->children[0], portalFile, clusters);
-        WritePortals_r(node->children[1], portalFile, clusters);
+        WritePortals_r(node->children[0], portalFile, clusters, binary);
+        WritePortals_r(node->children[1], portalFile, clusters, binary);
         return;
     }
     if (node->contents.is_solid(options.target_game))
@@ -135,10 +156,21 @@ WritePortals_r(node_t *node, FILE *portalFile, bool clusters)
         pl = &map.planes[p->planenum];
         PlaneFromWinding(w, &plane2);
         if (DotProduct(pl->normal, plane2.normal) < 1.0 - ANGLEEPSILON)
-            fprintf(portalFile, "%d %d %d ", w->numpoints, back, front);
-        else
-            fprintf(portalFile, "%d %d %d ", w->numpoints, front, back);
+            std::swap(front, back);
 
+        if (binary) {
+            WriteBinaryInt(portalFile, w->numpoints);
+            WriteBinaryInt(portalFile, front);
+            WriteBinaryInt(portalFile, back);
+            for (i = 0; i < w->numpoints; i++) {
+                WriteBinaryDouble(portalFile, w->points[i][0]);
+                WriteBinaryDouble(portalFile, w->points[i][1]);
+                WriteBinaryDouble(portalFile, w->points[i][2]);
+            }
+            continue;
+        }
+
+        fprintf(portalFile, "%d %d %d ", w->numpoints, front, back);
         for (i = 0; i < w->numpoints; i++) {
             fprintf(portalFile, "(");
             WriteFloat(portalFile, w->points[i][0]);
@@ -176,6 +208,20 @@ WriteClusters_r(node_t *node, FILE *portalFile, int viscluster)
     return viscluster;
 }
 
+/* binary cluster map: the cluster of each visleaf, in visleafnum order */
+static void
+WriteBinaryClusters_r(const node_t *node, FILE *portalFile)
+{
+    if (node->planenum != PLANENUM_LEAF) {
+        WriteBinaryClusters_r(node->children[0], portalFile);
+        WriteBinaryClusters_r(node->children[1], portalFile);
+        return;
+    }
+    if (node->contents.is_solid(options.target_game))
+        return;
+
+    WriteBinaryInt(portalFile, node->viscluster);
+}
 
 static void
 CountPortals(const node_t *node, portal_state_t *state)
@@ -262,6 +308,26 @@ WritePortalfile(node_t *headnode, portal_state_t *state)
     if (!portalFile)
         Error("Failed to open %s: %s", options.szBSPName, strerror(errno));
     
+    /*
+     * Binary portal file for vis only. Leaf and cluster counts are both
+     * written, the cluster map only when they differ (detail in Q1).
+     */
+    if (options.fBinaryPRT && !options.fForcePRT1) {
+        const bool q2 = (options.target_game->id == GAME_QUAKE_II);
+        const bool clusters = q2 || state->uses_detail;
+
+        fprintf(portalFile, "PRTB\n");
+        WriteBinaryInt(portalFile, 1);  // version
+        WriteBinaryInt(portalFile, state->num_visleafs);
+        WriteBinaryInt(portalFile, state->num_visclusters);
+        WriteBinaryInt(portalFile, state->num_visportals);
+        WritePortals_r(headnode, portalFile, clusters, true);
+        if (!q2 && state->num_visleafs != state->num_visclusters)
+            WriteBinaryClusters_r(headnode, portalFile);
+        fclose(portalFile);
+        return;
+    }
+
     // q2 uses a PRT1 file, but with clusters.
     // (Since q2bsp natively supports clusters, we don't need PRT2.)
     if (options.target_game->id == GAME_QUAKE_II) {
@@ -367,19 +433,18 @@ RemovePortalFromNode(portal_t *portal, node_t *l)
 
 /*
 ================
-MakeHeadnodePortals
+HeadnodeBoxPlanes
 
-The created portals will face the global outside_node
+The six sides of the box around the entity that MakeHeadnodePortals
+portalizes, facing out
 ================
 */
 static void
-MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
+HeadnodeBoxPlanes(const mapentity_t *entity, qbsp_plane_t bplanes[6])
 {
     vec3_t bounds[2];
     int i, j, n;
-    portal_t *p, *portals[6];
-    qbsp_plane_t bplanes[6], *pl;
-    int side;
+    qbsp_plane_t *pl;
 
     // pad with some space so there will never be null volume leafs
     for (i = 0; i < 3; i++) {
@@ -387,17 +452,10 @@ MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
         bounds[1][i] = entity->maxs[i] + SIDESPACE;
     }
 
-    outside_node.planenum = PLANENUM_LEAF;
-    outside_node.contents = options.target_game->create_solid_contents();
-    outside_node.portals = NULL;
-
     for (i = 0; i < 3; i++)
         for (j = 0; j < 2; j++) {
             n = j * 3 + i;
 
-            p = (portal_t *)AllocMem(OTHER, sizeof(portal_t), true);
-            portals[n] = p;
-
             pl = &bplanes[n];
             memset(pl, 0, sizeof(*pl));
             if (j) {
@@ -407,13 +465,66 @@ MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
                 pl->normal[i] = 1;
                 pl->dist = bounds[j][i];
             }
+        }
+}
+
+/*
+================
+ReserveHeadnodePlanes
+
+Adds the planes PortalizeWorld will put around the entity, in the order
+it finds them. Hulls built at the same time would otherwise add their
+box planes in a race, numbering the planes differently from run to run.
+================
+*/
+void
+ReserveHeadnodePlanes(const mapentity_t *entity)
+{
+    qbsp_plane_t bplanes[6];
+    int side;
+
+    HeadnodeBoxPlanes(entity, bplanes);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 2; j++)
+            FindPlane(bplanes[j * 3 + i].normal, bplanes[j * 3 + i].dist, &side);
+}
+
+/*
+================
+MakeHeadnodePortals
+
+The created portals will face outside_node
+================
+*/
+static void
+MakeHeadnodePortals(const mapentity_t *entity, node_t *node, node_t *outside_node)
+{
+    int i, j, n;
+    portal_t *p, *portals[6];
+    qbsp_plane_t bplanes[6], *pl;
+    int side;
+
+    HeadnodeBoxPlanes(entity, bplanes);
+
+    outside_node->planenum = PLANENUM_LEAF;
+    outside_node->contents = options.target_game->create_solid_contents();
+    outside_node->portals = NULL;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 2; j++) {
+            n = j * 3 + i;
+
+            p = (portal_t *)AllocMem(OTHER, sizeof(portal_t), true);
+            portals[n] = p;
+
+            pl = &bplanes[n];
             p->planenum = FindPlane(pl->normal, pl->dist, &side);
 
             p->winding = BaseWindingForPlane(pl);
             if (side)
-                AddPortalToNodes(p, &outside_node, node);
+                AddPortalToNodes(p, outside_node, node);
             else
-                AddPortalToNodes(p, node, &outside_node);
+                AddPortalToNodes(p, node, outside_node);
         }
 
     // clip the basewindings by all the other planes
@@ -615,7 +726,7 @@ CutNodePortals_r(node_t *node, portal_state_t *state)
 
         if (!frontwinding) {
             if (backwinding)
-                free(backwinding);
+                FreeMem(backwinding);
             
             if (side == 0)
                 AddPortalToNodes(portal, back, other_node);
@@ -625,7 +736,7 @@ CutNodePortals_r(node_t *node, portal_state_t *state)
         }
         if (!backwinding) {
             if (frontwinding)
-                free(frontwinding);
+                FreeMem(frontwinding);
             
             if (side == 0)
                 AddPortalToNodes(portal, front, other_node);
@@ -638,7 +749,7 @@ CutNodePortals_r(node_t *node, portal_state_t *state)
         new_portal = (portal_t *)AllocMem(OTHER, sizeof(portal_t), true);
         *new_portal = *portal;
         new_portal->winding = backwinding;
-        free(portal->winding);
+        FreeMem(portal->winding);
         portal->winding = frontwinding;
 
         if (side == 0) {
@@ -663,12 +774,15 @@ CutNodePortals_r(node_t *node, portal_state_t *state)
 ==================
 PortalizeWorld
 
-Builds the exact polyhedrons for the nodes and leafs
+Builds the exact polyhedrons for the nodes and leafs.
+The caller owns outside_node, so hulls can be portalized concurrently.
 ==================
 */
 void
-PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum)
+PortalizeWorld(const mapentity_t *entity, node_t *headnode, node_t *outside_node, const int hullnum)
 {
+    timingscope_t scope("PortalizeWorld", entity->outputmodelnumber);
+
     Message(msgProgress, "Portalize");
 
     portal_state_t state;
@@ -676,7 +790,7 @@ PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum)
     
     state.iNodesDone = 0;
 
-    MakeHeadnodePortals(entity, headnode);
+    MakeHeadnodePortals(entity, headnode, outside_node);
     CutNodePortals_r(headnode, &state);
 
     if (hullnum <= 0) {
@@ -713,8 +827,8 @@ FreeAllPortals(node_t *node)
             nextp = p->next[1];
         RemovePortalFromNode(p, p->nodes[0]);
         RemovePortalFromNode(p, p->nodes[1]);
-        free(p->winding);
-        free(p);
+        FreeMem(p->winding);
+        FreeMem(p);
     }
     node->portals = NULL;
 }
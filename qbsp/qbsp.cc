@@ -22,13 +22,21 @@
 #include <memory>
 #include <cstring>
 #include <algorithm>
+#include <thread>
+#include <unordered_map>
 
 #include <common/log.hh>
 #include <common/aabb.hh>
+#include <common/memstats.hh>
+#include <common/threads.hh>
+#include <common/compilecache.hh>
 #include <qbsp/qbsp.hh>
 #include <qbsp/wad.hh>
+#include <qbsp/bmodelcache.hh>
 
 #include "tbb/global_control.h"
+#include "tbb/parallel_for.h"
+#include "tbb/task_group.h"
 
 static const char *IntroString =
     "---- qbsp / ericw-tools " stringify(ERICWTOOLS_VERSION) " ----\n";
@@ -41,48 +49,54 @@ bool node_t::opaque() const {
         || contents.is_solid(options.target_game);
 }
 
-// a simple tree structure used for leaf brush
-// compression.
-struct leafbrush_entry_t {
-    uint32_t offset;
-    std::map<uint32_t, leafbrush_entry_t> entries;
-};
-
+/*
+ * Leaf brush lists are deduplicated against the spans already exported
+ * for the entity: a list can reuse any span it is a prefix of. Every
+ * prefix of an exported span is hashed to the span's offset, and a hit is
+ * checked against map.exported_leafbrushes, so a hash collision only
+ * costs a missed reuse.
+ */
 // per-entity
 static struct {
     uint32_t total_brushes, total_brush_sides;
     uint32_t total_leaf_brushes, unique_leaf_brushes;
-    std::map<uint32_t, leafbrush_entry_t> leaf_entries;
+    std::unordered_map<uint64_t, uint32_t> leaf_spans;
 } brush_state;
 
 // running total
 static uint32_t brush_offset;
 
-static std::optional<uint32_t> FindLeafBrushesSpanOffset(const std::vector<uint32_t> &brushes) {
-    int32_t offset = 0;
-    const auto *map = &brush_state.leaf_entries;
-    decltype(brush_state.leaf_entries)::const_iterator it = map->find(brushes[offset]);
+static uint64_t LeafBrushesHash(uint64_t hash, uint32_t brush)
+{
+    FNV_HashBytes(&hash, &brush, sizeof(brush));
+    return hash;
+}
 
-    while (it != map->end()) {
+static std::optional<uint32_t> FindLeafBrushesSpanOffset(const std::vector<uint32_t> &brushes) {
+    uint64_t hash = FNV_HASH_INIT;
+    for (const uint32_t id : brushes)
+        hash = LeafBrushesHash(hash, id);
 
-        if (++offset == brushes.size()) {
-            return it->second.offset;
-        }
+    const auto it = brush_state.leaf_spans.find(hash);
+    if (it == brush_state.leaf_spans.end())
+        return std::nullopt;
 
-        map = &it->second.entries;
-        it = map->find(brushes[offset]);
-    }
+    if (it->second + brushes.size() > map.exported_leafbrushes.size())
+        return std::nullopt;
+    const auto span = map.exported_leafbrushes.begin() + it->second;
+    if (!std::equal(brushes.begin(), brushes.end(), span))
+        return std::nullopt;
 
-    return std::nullopt;
+    return it->second;
 }
 
 static void PopulateLeafBrushesSpan(const std::vector<uint32_t> &brushes, uint32_t offset) {
-    auto *map = &brush_state.leaf_entries;
+    uint64_t hash = FNV_HASH_INIT;
 
-    for (auto &id : brushes) {
-        auto it = map->try_emplace(id, leafbrush_entry_t { offset });
-        map = &it.first->second.entries;
-        offset++;
+    // an earlier span with the same prefix keeps it
+    for (const uint32_t id : brushes) {
+        hash = LeafBrushesHash(hash, id);
+        brush_state.leaf_spans.try_emplace(hash, offset);
     }
 }
 
@@ -126,34 +140,26 @@ static void ExportBrushList_r(const mapentity_t *entity, node_t *node, const uin
     ExportBrushList_r(entity, node->children[1], brush_offset);
 }
 
-static void ExportBrushList(const mapentity_t *entity, node_t *node, uint32_t &brush_offset)
+/*
+ * Finds the planes of b's brush sides, in the order they are exported: one
+ * per face, then any axial planes not contained in the brush, to bevel off
+ * corners.
+ */
+static std::vector<int> BrushSidePlanes(const brush_t *b)
 {
-    brush_state = { };
+    std::vector<int> planes;
 
-    for (const brush_t *b = entity->brushes; b; b = b->next)
+    for (const face_t *f = b->faces; f; f = f->next)
     {
-        dbrush_t brush { (int32_t) map.exported_brushsides.size(), 0, b->contents.native };
-
-        for (const face_t *f = b->faces; f; f = f->next)
-        {
-            int32_t planenum = f->planenum;
-            int32_t outputplanenum;
-
-            if (f->planeside) {
-                vec3_t flipped;
-                VectorCopy(map.planes[f->planenum].normal, flipped);
-                VectorInverse(flipped);
-                planenum = FindPlane(flipped, -map.planes[f->planenum].dist, nullptr);
-                outputplanenum = ExportMapPlane(planenum);
-            } else {
-                planenum = FindPlane(map.planes[f->planenum].normal, map.planes[f->planenum].dist, nullptr);
-                outputplanenum = ExportMapPlane(planenum);
-            }
-
-            map.exported_brushsides.push_back({ (uint32_t) outputplanenum, map.mtexinfos[f->texinfo].outputnum.value_or(-1) });
-            brush.numsides++;
-            brush_state.total_brush_sides++;
+        if (f->planeside) {
+            vec3_t flipped;
+            VectorCopy(map.planes[f->planenum].normal, flipped);
+            VectorInverse(flipped);
+            planes.push_back(FindPlane(flipped, -map.planes[f->planenum].dist, nullptr));
+        } else {
+            planes.push_back(FindPlane(map.planes[f->planenum].normal, map.planes[f->planenum].dist, nullptr));
         }
+    }
 
 		// add any axis planes not contained in the brush to bevel off corners
 		for (int32_t x=0 ; x<3 ; x++)
@@ -177,16 +183,74 @@ static void ExportBrushList(const mapentity_t *entity, node_t *node, uint32_t &b
 						break;
 
 				if (f == nullptr)
-				{
-                    planenum = FindPlane(normal, dist, nullptr);
-                    int32_t outputplanenum = ExportMapPlane(planenum);
-                    
-                    map.exported_brushsides.push_back({ (uint32_t) outputplanenum, map.exported_brushsides[map.exported_brushsides.size() - 1].texinfo });
-                    brush.numsides++;
-                    brush_state.total_brush_sides++;
-				}
+                    planes.push_back(FindPlane(normal, dist, nullptr));
 			}
 
+    return planes;
+}
+
+/*
+ * BrushSidePlanes may add planes. Entities are built in parallel and only
+ * exported once they all have been, so look the planes up as each entity is
+ * loaded instead; they then get the same numbers as when each entity was
+ * loaded, built and exported in turn.
+ */
+static void ReserveBrushListPlanes(const mapentity_t *entity)
+{
+    for (const brush_t *b = entity->brushes; b; b = b->next)
+        BrushSidePlanes(b);
+}
+
+/*
+ * Makes room for n more elements, growing geometrically so reserving for
+ * each entity in turn doesn't reallocate every time.
+ */
+template<typename T>
+static void ReserveMore(std::vector<T> &v, size_t n)
+{
+    if (v.size() + n > v.capacity())
+        v.reserve(std::max(v.size() + n, v.capacity() * 2));
+}
+
+static void ExportBrushList(const mapentity_t *entity, node_t *node, uint32_t &brush_offset)
+{
+    brush_state = { };
+
+    size_t numbrushes = 0, numsides = 0;
+    for (const brush_t *b = entity->brushes; b; b = b->next) {
+        numbrushes++;
+        numsides += 6; // at most one bevel per axial plane
+        for (const face_t *f = b->faces; f; f = f->next)
+            numsides++;
+    }
+    ReserveMore(map.exported_brushes, numbrushes);
+    ReserveMore(map.exported_brushsides, numsides);
+
+    for (const brush_t *b = entity->brushes; b; b = b->next)
+    {
+        dbrush_t brush { (int32_t) map.exported_brushsides.size(), 0, b->contents.native };
+        const std::vector<int> planes = BrushSidePlanes(b);
+        size_t i = 0;
+
+        for (const face_t *f = b->faces; f; f = f->next, i++)
+        {
+            const int32_t outputplanenum = ExportMapPlane(planes[i]);
+
+            map.exported_brushsides.push_back({ (uint32_t) outputplanenum, map.mtexinfos[f->texinfo].outputnum.value_or(-1) });
+            brush.numsides++;
+            brush_state.total_brush_sides++;
+        }
+
+        // the bevels reuse the last side's texinfo
+        for (; i < planes.size(); i++)
+        {
+            const int32_t outputplanenum = ExportMapPlane(planes[i]);
+
+            map.exported_brushsides.push_back({ (uint32_t) outputplanenum, map.exported_brushsides[map.exported_brushsides.size() - 1].texinfo });
+            brush.numsides++;
+            brush_state.total_brush_sides++;
+        }
+
         map.exported_brushes.push_back(brush);
         brush_state.total_brushes++;
     }
@@ -203,32 +267,40 @@ static void ExportBrushList(const mapentity_t *entity, node_t *node, uint32_t &b
 
 /*
 ===============
-ProcessEntity
+LoadEntity
+
+Loads the brushes of entity for one hull into entity->brushes.
+Returns false if the entity has no model to build.
+
+With -incremental, a brush model built by an earlier compile is
+returned in cachednodes instead, with no brushes loaded.
 ===============
 */
-static void
-ProcessEntity(mapentity_t *entity, const int hullnum)
+static bool
+LoadEntity(mapentity_t *entity, const int hullnum, node_t **cachednodes)
 {
-    int i, firstface;
-    surface_t *surfs;
-    node_t *nodes;
+    int i;
     
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity->nummapbrushes && entity != pWorldEnt())
-        return;
+        return false;
     
     /*
      * func_group and func_detail entities get their brushes added to the
      * worldspawn
      */
     if (IsWorldBrushEntity(entity))
-        return;
+        return false;
 
     // Export a blank model struct, and reserve the index (only do this once, for all hulls)
     if (entity->outputmodelnumber == -1) {
         entity->outputmodelnumber = static_cast<int>(map.exported_models.size());
         map.exported_models.push_back({});
+
+        // before the model key is added, it's the output model number
+        if (options.fIncremental)
+            entity->cachekey = BModelCache_Key(entity);
     }
 
     if (entity != pWorldEnt()) {
@@ -245,6 +317,13 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         SetKeyValue(entity, "model", mod);
     }
 
+    *cachednodes = nullptr;
+    if (entity->cachekey) {
+        *cachednodes = BModelCache_Find(entity, hullnum);
+        if (*cachednodes)
+            return true;
+    }
+
     /*
      * Init the entity
      */
@@ -264,6 +343,8 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
     /*
      * Convert the map brushes (planes) into BSP brushes (polygons)
      */
+    timingscope_t scope("Brush_LoadEntity", entity->outputmodelnumber);
+
     Message(msgProgress, "Brush_LoadEntity");
     Brush_LoadEntity(entity, entity, hullnum);
 
@@ -316,28 +397,50 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
     }
     
     Entity_SortBrushes(entity);
+    Timing_Count("brushes, all hulls", entity->numbrushes);
     
     if (!entity->brushes && hullnum) {
         PrintEntity(entity);
         Error("Entity with no valid brushes");
     }
 
+    return true;
+}
+
+/*
+===============
+BuildEntity
+
+Builds the tree from the brushes loaded by LoadEntity. source is the map
+entity, entity is a copy of it holding this hull's brushes.
+
+Nothing is exported here, so entities and hulls can be built
+concurrently and handed to ExportEntity in order afterwards.
+===============
+*/
+static node_t *
+BuildEntity(const mapentity_t *source, mapentity_t *entity, const int hullnum)
+{
+    surface_t *surfs;
+    node_t *nodes;
+    node_t outside_node {};
+
     /*
      * Take the brush_t's and clip off all overlapping and contained faces,
      * leaving a perfect skin of the model with no hidden faces
      */
     surfs = CSGFaces(entity);
     
-    if (options.fObjExport && entity == pWorldEnt() && hullnum <= 0) {
+    if (options.fObjExport && source == pWorldEnt() && hullnum <= 0) {
         ExportObj_Surfaces("post_csg", surfs);
     }
     
     if (hullnum > 0) {
         nodes = SolidBSP(entity, surfs, true);
-        if (entity == pWorldEnt() && !options.fNofill) {
+        if (source == pWorldEnt() && !options.fNofill) {
             // assume non-world bmodels are simple
-            PortalizeWorld(entity, nodes, hullnum);
-            if (FillOutside(nodes, hullnum)) {
+            PortalizeWorld(entity, nodes, &outside_node, hullnum);
+            if (FillOutside(nodes, &outside_node, hullnum)) {
                 // Free portals before regenerating new nodes
                 FreeAllPortals(nodes);
                 surfs = GatherNodeFaces(nodes);
@@ -345,9 +448,12 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
                 nodes = SolidBSP(entity, surfs, false);
                 
                 DetailToSolid(nodes);
+            } else {
+                // the portals point at outside_node
+                FreeAllPortals(nodes);
             }
         }
-        ExportClipNodes(entity, nodes, hullnum);
+        return nodes;
     } else {
         /*
          * SolidBSP generates a node tree
@@ -363,21 +469,24 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         if (options.forceGoodTree)
             nodes = SolidBSP(entity, surfs, false);
         else
-            nodes = SolidBSP(entity, surfs, entity == pWorldEnt());
+            nodes = SolidBSP(entity, surfs, source == pWorldEnt());
 
         // build all the portals in the bsp tree
         // some portals are solid polygons, and some are paths to other leafs
-        if (entity == pWorldEnt() && !options.fNofill) {
+        if (source == pWorldEnt() && !options.fNofill) {
             // assume non-world bmodels are simple
-            PortalizeWorld(entity, nodes, hullnum);
-            if (FillOutside(nodes, hullnum)) {
+            PortalizeWorld(entity, nodes, &outside_node, hullnum);
+            if (FillOutside(nodes, &outside_node, hullnum)) {
                 FreeAllPortals(nodes);
 
                 // get the remaining faces together into surfaces again
                 surfs = GatherNodeFaces(nodes);
 
                 // merge polygons
-                MergeAll(surfs);
+                {
+                    timingscope_t scope("MergeAll", entity->outputmodelnumber);
+                    MergeAll(surfs);
+                }
 
                 // make a really good tree
                 nodes = SolidBSP(entity, surfs, false);
@@ -386,22 +495,43 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
                 DetailToSolid(nodes);
                 
                 // make the real portals for vis tracing
-                PortalizeWorld(entity, nodes, hullnum);
+                PortalizeWorld(entity, nodes, &outside_node, hullnum);
 
                 TJunc(entity, nodes);
             }
             FreeAllPortals(nodes);
         }
+    }
+
+    return nodes;
+}
+
+/*
+===============
+ExportEntity
 
-        // bmodels
-        if (entity != pWorldEnt()) {
+Writes the tree from BuildEntity to the bsp and frees its nodes. Must
+be called in entity order, one entity at a time: faces, edges and
+vertexes are shared between models.
+===============
+*/
+static void
+ExportEntity(const mapentity_t *source, mapentity_t *entity, node_t *nodes, const int hullnum)
+{
+    int firstface;
+
+    if (hullnum > 0) {
+        ExportClipNodes(entity, nodes, hullnum);
+    } else {
+        // bmodels; TJunc isn't thread safe, so it runs here rather than in BuildEntity
+        if (source != pWorldEnt()) {
             TJunc(entity, nodes);
         }
         
         // convert detail leafs to solid (in case we didn't make the call above)
         DetailToSolid(nodes);
 
-        if (options.fObjExport && entity == pWorldEnt()) {
+        if (options.fObjExport && source == pWorldEnt()) {
             ExportObj_Nodes("pre_makefaceedges_plane_faces", nodes);
             ExportObj_Marksurfaces("pre_makefaceedges_marksurfaces", nodes);
         }
@@ -414,11 +544,11 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         }
 
         ExportDrawNodes(entity, nodes, firstface);
+        FreeTree(nodes);
     }
-
-    FreeBrushes(entity);
 }
 
+
 /*
 =================
 UpdateEntLump
@@ -479,38 +609,52 @@ UpdateEntLump(void)
 }
 
 
-/*
-Actually writes out the final bspx BRUSHLIST lump
-This lump replaces the clipnodes stuff for custom collision sizes.
-*/
-void BSPX_Brushes_Finalize(struct bspxbrushes_s *ctx)
+static bool
+BSPX_FaceIsAxial(const face_t *f)
 {
-    // Actually written in WriteBSPFile()
-    map.exported_bspxbrushes = std::move(ctx->lumpdata);
+        const qbsp_plane_t &plane = map.planes[f->planenum];
+        return fabs(plane.normal[0]) == 1 || fabs(plane.normal[1]) == 1 || fabs(plane.normal[2]) == 1;
 }
-void BSPX_Brushes_Init(struct bspxbrushes_s *ctx)
+
+static uint8_t *
+BSPX_WriteBytes(uint8_t *out, const void *data, size_t count)
 {
-    ctx->lumpdata.clear();
+        memcpy(out, data, count);
+        return out + count;
 }
 
-static void
-vec_push_bytes(std::vector<uint8_t>& vec, const void* data, size_t count) {
-    const uint8_t* bytes = static_cast<const uint8_t*>(data);
-
-    vec.insert(vec.end(), bytes, bytes + count);
+/*
+The size of a model's part of the BRUSHLIST lump, so the lump can be
+allocated once and each model written into its own slice of it
+*/
+size_t BSPX_Brushes_ModelSize(const brush_t *brushes)
+{
+        size_t size = sizeof(bspxbrushes_permodel);
+        for (const brush_t *b = brushes; b; b = b->next)
+        {
+                size += sizeof(bspxbrushes_perbrush);
+                for (const face_t *f = b->faces; f; f = f->next)
+                {
+                        /*skip axial*/
+                        if (!BSPX_FaceIsAxial(f))
+                                size += sizeof(bspxbrushes_perface);
+                }
+        }
+        return size;
 }
 
 /*
 WriteBrushes
-Generates a submodel's direct brush information to a separate file, so the engine doesn't need to depend upon specific hull sizes
+Generates a submodel's direct brush information to a separate file, so the engine doesn't need to depend upon specific hull sizes.
+Writes exactly BSPX_Brushes_ModelSize(brushes) bytes to out.
 */
 #define LittleLong(x) x // FIXME
 #define LittleShort(x) x // FIXME
 #define LittleFloat(x) x // FIXME
-void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *brushes)
+void BSPX_Brushes_AddModel(uint8_t *out, int modelnum, const brush_t *brushes)
 {
-        brush_t *b;
-        face_t *f;
+        const brush_t *b;
+        const face_t *f;
 
         bspxbrushes_permodel permodel;
         permodel.numbrushes = 0;
@@ -521,9 +665,7 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
                 for (f = b->faces; f; f = f->next)
                 {
                         /*skip axial*/
-                        if (fabs(map.planes[f->planenum].normal[0]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[1]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[2]) == 1)
+                        if (BSPX_FaceIsAxial(f))
                                 continue;
                         permodel.numfaces++;
                 }
@@ -533,7 +675,7 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
         permodel.modelnum = LittleLong(modelnum);
         permodel.numbrushes = LittleLong(permodel.numbrushes);
         permodel.numfaces = LittleLong(permodel.numfaces);
-        vec_push_bytes(ctx->lumpdata, &permodel, sizeof(permodel));
+        out = BSPX_WriteBytes(out, &permodel, sizeof(permodel));
 
         for (b = brushes; b; b = b->next)
         {
@@ -542,9 +684,7 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
                 for (f = b->faces; f; f = f->next)
                 {
                         /*skip axial*/
-                        if (fabs(map.planes[f->planenum].normal[0]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[1]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[2]) == 1)
+                        if (BSPX_FaceIsAxial(f))
                                 continue;
                         perbrush.numfaces++;
                 }
@@ -573,7 +713,7 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
                         if (b->contents.is_clip()) {
                             perbrush.contents = -8;
                         } else {
-                            Message(msgWarning, "Unknown contents: %i-%i. Translating to solid.", b->contents.native, b->contents.extended);
+                            logprint("WARNING: Unknown contents: %i-%i. Translating to solid.\n", b->contents.native, b->contents.extended);
                             perbrush.contents = CONTENTS_SOLID;
                         }
                         break;
@@ -581,15 +721,13 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
                 }
                 perbrush.contents = LittleShort(perbrush.contents);
                 perbrush.numfaces = LittleShort(perbrush.numfaces);
-                vec_push_bytes(ctx->lumpdata, &perbrush, sizeof(perbrush));
+                out = BSPX_WriteBytes(out, &perbrush, sizeof(perbrush));
                 
                 for (f = b->faces; f; f = f->next)
                 {
                         bspxbrushes_perface perface;
                         /*skip axial*/
-                        if (fabs(map.planes[f->planenum].normal[0]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[1]) == 1 ||
-                                fabs(map.planes[f->planenum].normal[2]) == 1)
+                        if (BSPX_FaceIsAxial(f))
                                 continue;
 
                         if (f->planeside)
@@ -607,25 +745,37 @@ void BSPX_Brushes_AddModel(struct bspxbrushes_s *ctx, int modelnum, brush_t *bru
                                 perface.dist      = map.planes[f->planenum].dist;
                         }
 
-                        vec_push_bytes(ctx->lumpdata, &perface, sizeof(perface));
+                        out = BSPX_WriteBytes(out, &perface, sizeof(perface));
                 }
         }
 }
 
-/* for generating BRUSHLIST bspx lump */
+/*
+for generating BRUSHLIST bspx lump
+
+The hull 0 brushes are gone by now, and they aren't the ones wanted
+anyway: hull 0 leaves out clip brushes and keeps func_detail_illusionary.
+So every model is loaded again as hull -1, on this thread as loading
+needs, then the models are written in parallel, each into its slice of
+one buffer sized up front. WriteBSPFile hands that buffer to the lump.
+*/
 static void BSPX_CreateBrushList(void)
 {
         mapentity_t *ent;
         int entnum;
         int modelnum;
         const char *mod;
-        struct bspxbrushes_s ctx;
+
+        struct bspxmodel_t {
+                mapentity_t *ent;
+                int modelnum;
+                size_t offset;
+        };
+        std::vector<bspxmodel_t> models;
 
         if (!options.fbspx_brushes)
                 return;
 
-        BSPX_Brushes_Init(&ctx);
-
         for (entnum = 0; entnum < map.numentities(); entnum++)
         {
                 ent = &map.entities.at(entnum);
@@ -677,11 +827,180 @@ static void BSPX_CreateBrushList(void)
                 if (!ent->brushes)
                         continue;               // non-bmodel entity
 
-                BSPX_Brushes_AddModel(&ctx, modelnum , ent->brushes);
-                FreeBrushes(ent);
+                models.push_back({ ent, modelnum, 0 });
+        }
+
+        std::vector<size_t> sizes(models.size());
+        tbb::parallel_for(static_cast<size_t>(0), models.size(), [&](const size_t i) {
+                sizes[i] = BSPX_Brushes_ModelSize(models[i].ent->brushes);
+        });
+
+        size_t lumpsize = 0;
+        for (size_t i = 0; i < models.size(); i++) {
+                models[i].offset = lumpsize;
+                lumpsize += sizes[i];
         }
+        if (!lumpsize)
+                return;
+
+        uint8_t *lumpdata = static_cast<uint8_t *>(malloc(lumpsize));
+        if (!lumpdata)
+                Error("%s: allocation of %zu bytes failed.", __func__, lumpsize);
+
+        tbb::parallel_for(static_cast<size_t>(0), models.size(), [&](const size_t i) {
+                BSPX_Brushes_AddModel(lumpdata + models[i].offset, models[i].modelnum, models[i].ent->brushes);
+        });
+
+        for (const bspxmodel_t &model : models)
+                FreeBrushes(model.ent);
+
+        // Actually written in WriteBSPFile()
+        free(map.exported_bspxbrushes);
+        map.exported_bspxbrushes = lumpdata;
+        map.exported_bspxbrushessize = lumpsize;
+}
+
+/*
+ * One entity's brushes for one hull. Loading touches the map entities,
+ * texinfos and messages, so it runs on the main thread, a hull at a time.
+ * Building the entities and hulls from these copies can then run
+ * concurrently.
+ */
+struct hullentity_t {
+    mapentity_t *source;
+    mapentity_t entity;         // copy of source owning this hull's brushes
+    bool verbose;
+    node_t *nodes;              // built by BuildHull, waiting for ExportHull
+    bool cached;                // nodes came from -incremental's cache
+};
+
+/*
+=================
+LoadHull
+
+=================
+*/
+static std::vector<hullentity_t>
+LoadHull(const int hullnum)
+{
+    timingscope_t scope("LoadHull", hullnum);
+    std::vector<hullentity_t> hull;
+
+    // for each entity in the map file that has geometry
+    for (int i = 0; i < map.numentities(); i++) {
+        mapentity_t *entity = &map.entities.at(i);
+        const bool verbose = options.fVerbose;
+
+        node_t *cachednodes;
+        if (LoadEntity(entity, hullnum, &cachednodes)) {
+            if (options.target_game->id == GAME_QUAKE_II)
+                ReserveBrushListPlanes(entity);
+
+            hull.push_back({ entity, *entity, verbose, cachednodes, cachednodes != nullptr });
+
+            // the copy owns the brushes now
+            entity->brushes = NULL;
+            entity->solid = NULL;
+            entity->sky = NULL;
+            entity->detail = NULL;
+            entity->detail_illusionary = NULL;
+            entity->detail_fence = NULL;
+            entity->liquid = NULL;
+            entity->numbrushes = 0;
+        }
+        if (!options.fAllverbose)
+            options.fVerbose = false;   // don't print rest of entities
+    }
+
+    /* PortalizeWorld's box planes, numbered now rather than in a race with other hulls */
+    if (!options.fNofill) {
+        for (const hullentity_t &hullent : hull) {
+            if (hullent.source == pWorldEnt())
+                ReserveHeadnodePlanes(&hullent.entity);
+        }
+    }
+
+    return hull;
+}
+
+/*
+=================
+BuildHull
+
+The world is built on the calling thread, which prints its stats, and
+the brush models are built alongside it as tasks.
+=================
+*/
+static void
+BuildHull(std::vector<hullentity_t> &hull, const int hullnum)
+{
+    timingscope_t scope("BuildHull", hullnum);
+
+    /* -verbose prints every entity in full, keep them apart */
+    if (options.fAllverbose) {
+        for (hullentity_t &hullent : hull) {
+            if (hullent.cached)
+                continue;
+            verbosescope_t verbose(hullent.verbose);
+            hullent.nodes = BuildEntity(hullent.source, &hullent.entity, hullnum);
+        }
+        return;
+    }
+
+    hullentity_t *world = nullptr;
+    for (hullentity_t &hullent : hull) {
+        if (hullent.source == pWorldEnt())
+            world = &hullent;
+    }
+
+    tbb::task_group group;
+    for (hullentity_t &hullent : hull) {
+        if (hullent.source == pWorldEnt() || hullent.cached)
+            continue;
+
+        hullentity_t *bmodel = &hullent;
+        group.run([bmodel, hullnum]() {
+            const bool quiet = fQuietThread;
+            fQuietThread = true;
+            {
+                verbosescope_t verbose(bmodel->verbose);
+                bmodel->nodes = BuildEntity(bmodel->source, &bmodel->entity, hullnum);
+            }
+            fQuietThread = quiet;
+        });
+    }
+
+    if (world) {
+        verbosescope_t verbose(world->verbose);
+        world->nodes = BuildEntity(world->source, &world->entity, hullnum);
+    }
 
-        BSPX_Brushes_Finalize(&ctx);
+    group.wait();
+}
+
+/*
+=================
+ExportHull
+
+=================
+*/
+static void
+ExportHull(std::vector<hullentity_t> &hull, const int hullnum)
+{
+    timingscope_t scope("ExportHull", hullnum);
+
+    for (hullentity_t &hullent : hull) {
+        if (hullent.source->cachekey && !hullent.cached)
+            BModelCache_Add(hullent.source, hullnum, hullent.nodes);
+
+        {
+            verbosescope_t verbose(hullent.verbose);
+            ExportEntity(hullent.source, &hullent.entity, hullent.nodes, hullnum);
+        }
+        FreeBrushes(&hullent.entity);
+
+        hullent.source->firstoutputfacenumber = hullent.entity.firstoutputfacenumber;
+    }
 }
 
 /*
@@ -693,18 +1012,50 @@ CreateSingleHull
 static void
 CreateSingleHull(const int hullnum)
 {
-    int i;
-    mapentity_t *entity;
-
     Message(msgLiteral, "Processing hull %d...\n", hullnum);
+    std::vector<hullentity_t> hull = LoadHull(hullnum);
+    BuildHull(hull, hullnum);
+    ExportHull(hull, hullnum);
+}
 
-    // for each entity in the map file that has geometry
-    for (i = 0; i < map.numentities(); i++) {
-        entity = &map.entities.at(i);
-        ProcessEntity(entity, hullnum);
-        if (!options.fAllverbose)
-            options.fVerbose = false;   // don't print rest of entities
+/*
+=================
+CreateHullsConcurrently
+
+Builds the clipping hulls on their own threads while this one builds
+hull 0. The clipping hulls are exported afterwards, in the same order as
+CreateSingleHull would have, so the output doesn't depend on timing.
+=================
+*/
+static void
+CreateHullsConcurrently(const std::vector<int> &hullnums)
+{
+    std::vector<std::vector<hullentity_t>> hulls;
+    Message(msgLiteral, "Processing hull %d...\n", hullnums[0]);
+    for (const int hullnum : hullnums)
+        hulls.push_back(LoadHull(hullnum));
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < hulls.size(); i++) {
+        threads.emplace_back([&hulls, &hullnums, i]() {
+            fQuietThread = true;
+            BuildHull(hulls[i], hullnums[i]);
+        });
     }
+    BuildHull(hulls[0], hullnums[0]);
+    ExportHull(hulls[0], hullnums[0]);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    /* the log reads as if the hulls were made one after another */
+    for (size_t i = 1; i < hulls.size(); i++) {
+        Message(msgLiteral, "Processing hull %d...\n", hullnums[i]);
+        ExportHull(hulls[i], hullnums[i]);
+    }
+
+    /* a clipping hull may have leaked before hull 0 wrote the .prt file */
+    if (map.leakfile)
+        remove((StrippedExtension(options.szBSPName) + ".prt").c_str());
 }
 
 /*
@@ -716,7 +1067,6 @@ CreateHulls
 static void
 CreateHulls(void)
 {
-    /* create the hulls sequentially */
     if (!options.fNoverbose)
         options.fVerbose = true;
 
@@ -726,24 +1076,35 @@ CreateHulls(void)
         return;
     }
 
-    CreateSingleHull(0);
+    std::vector<int> hullnums { 0 };
 
     /* ignore the clipping hulls altogether */
-    if (options.fNoclip)
-        return;
+    if (!options.fNoclip) {
+        hullnums.push_back(1);
+        hullnums.push_back(2);
+
+        // FIXME: use game->get_hull_count
+        if (options.target_game->id == GAME_HALF_LIFE)
+            hullnums.push_back(3);
+        else if (options.target_game->id == GAME_HEXEN_II)
+        {   /*note: h2mp doesn't use hull 2 automatically, however gamecode can explicitly set ent.hull=3 to access it*/
+            hullnums.push_back(3);
+            hullnums.push_back(4);
+            hullnums.push_back(5);
+        }
+    }
 
-    CreateSingleHull(1);
-    CreateSingleHull(2);
-
-    // FIXME: use game->get_hull_count
-    if (options.target_game->id == GAME_HALF_LIFE)
-        CreateSingleHull(3);
-    else if (options.target_game->id == GAME_HEXEN_II)
-    {   /*note: h2mp doesn't use hull 2 automatically, however gamecode can explicitly set ent.hull=3 to access it*/
-        CreateSingleHull(3);
-        CreateSingleHull(4);
-        CreateSingleHull(5);
+    /*
+     * -verbose prints every hull in full, keep them apart. Under a memory
+     * budget, don't hold every hull's brushes and trees at once.
+     */
+    if (options.fNoThreads || options.fAllverbose || hullnums.size() == 1 || membudget) {
+        for (const int hullnum : hullnums)
+            CreateSingleHull(hullnum);
+        return;
     }
+
+    CreateHullsConcurrently(hullnums);
 }
 
 static bool wadlist_tried_loading = false;
@@ -778,10 +1139,45 @@ EnsureTexturesLoaded()
         WADList_Init(defaultwad);
         if (wadlist.size())
             Message(msgLiteral, "Using default WAD: %s\n", defaultwad);
-        free(defaultwad);
+        FreeMem(defaultwad);
     }
 }
 
+/* the options as given, without the file names, for the compile cache key */
+static std::vector<std::string> cacheargs;
+
+static const std::vector<std::string> compilecacheoutputs { ".bsp", ".prt", ".pts", ".por" };
+
+/*
+ * The map, the external maps it instances, the wads its textures come
+ * from, and the options.
+ */
+static uint64_t
+CompileCacheKey(void)
+{
+    uint64_t key = CompileCache_Begin("qbsp");
+    CompileCache_HashArgs(&key, cacheargs);
+    CompileCache_HashFile(&key, "qbsp.ini");
+    CompileCache_HashFile(&key, options.szMapName);
+    for (const auto &external : map.external_maps)
+        CompileCache_HashFile(&key, external.first.c_str());
+    for (const wad_t &wad : wadlist)
+        CompileCache_HashFile(&key, wad.path.c_str());
+    return key;
+}
+
+/* everything but the entities that changes how -incremental's brush models are built */
+static uint64_t
+BModelCacheOptions(void)
+{
+    uint64_t key = CompileCache_Begin("qbsp-bmodel");
+    CompileCache_HashArgs(&key, cacheargs);
+    CompileCache_HashFile(&key, "qbsp.ini");
+    const int vecsize = sizeof(vec_t);
+    FNV_HashBytes(&key, &vecsize, sizeof(vecsize));
+    return key;
+}
+
 static const char* //mxd
 GetBaseDirName(const bspversion_t *bspver)
 {
@@ -798,7 +1194,10 @@ ProcessFile(void)
 {
     // load brushes and entities
     SetQdirFromPath(GetBaseDirName(options.target_version), options.szMapName);
-    LoadMapFile();
+    {
+        timingscope_t scope("LoadMapFile");
+        LoadMapFile();
+    }
     if (options.fConvertMapFormat) {
         ConvertMapFile();
         return;
@@ -810,18 +1209,51 @@ ProcessFile(void)
 
     // this can happen earlier if brush primitives are in use, because we need texture sizes then
     EnsureTexturesLoaded();
+
+    uint64_t cachekey = 0;
+    if (!compilecachedir.empty() && options.target_game->id == GAME_QUAKE_II) {
+        logprint("Compile cache not used, this game's textures aren't in wads\n");
+        compilecachedir.clear();
+    }
+    if (!compilecachedir.empty()) {
+        cachekey = CompileCacheKey();
+        if (CompileCache_Restore("qbsp", cachekey, StrippedExtension(options.szBSPName), compilecacheoutputs)) {
+            wadlist.clear();
+            return;
+        }
+    }
     
     // init the tables to be shared by all models
     BeginBSPFile();
 
     if (!options.fAllverbose)
         options.fVerbose = false;
-    CreateHulls();
+    const std::string bmodelcache = StrippedExtension(options.szBSPName) + ".bmc";
+    if (options.fIncremental)
+        BModelCache_Load(bmodelcache.c_str(), BModelCacheOptions());
+    {
+        timingscope_t scope("CreateHulls");
+        CreateHulls();
+    }
+    if (options.fIncremental)
+        BModelCache_Save(bmodelcache.c_str());
 
     WriteEntitiesToString();
-    WADList_Process();
-    BSPX_CreateBrushList();
-    FinishBSPFile();
+    {
+        timingscope_t scope("WADList_Process");
+        WADList_Process();
+    }
+    {
+        timingscope_t scope("BSPX_CreateBrushList");
+        BSPX_CreateBrushList();
+    }
+    {
+        timingscope_t scope("FinishBSPFile");
+        FinishBSPFile();
+    }
+
+    if (!compilecachedir.empty())
+        CompileCache_Store("qbsp", cachekey, StrippedExtension(options.szBSPName), compilecacheoutputs);
 
     wadlist.clear();
 }
@@ -870,6 +1302,7 @@ PrintOptions(void)
            "   -maxnodesize [n]Triggers simpler BSP Splitting when node exceeds size (default 1024, 0 to disable)\n"
            "   -epsilon [n]    Customize ON_EPSILON (default 0.0001)\n"
            "   -forceprt1      Create a PRT1 file for loading in editors, even if PRT2 is required to run vis.\n"
+           "   -binaryprt      Write a binary .prt file, faster for vis to load but not readable by editors\n"
            "   -objexport      Export the map file as an .OBJ model after the CSG phase\n"
            "   -omitdetail     func_detail brushes are omitted from the compile\n"
            "   -omitdetailwall          func_detail_wall brushes are omitted from the compile\n"
@@ -880,6 +1313,14 @@ PrintOptions(void)
            "   -leaktest       Make compilation fail if the map leaks\n"
            "   -contenthack    Hack to fix leaks through solids. Causes missing faces in some cases so disabled by default.\n"
            "   -nothreads      Disable multithreading\n"
+           "   -membudget [n]  Keep to n megabytes where possible: build the hulls one at a time\n"
+           "   -numanode <n>   Run on the CPUs of NUMA node n only\n"
+           "   -pinthreads     Pin each thread to a CPU of its own\n"
+           "   -timing         Log the time taken by each phase and write them to <bspname>.qbsptiming.json\n"
+           "   -timingtrace    -timing, and write a Chrome trace of the phases to <bspname>.qbsptrace.json\n"
+           "   -cachedir <dir> Reuse the output of an earlier compile of the same map, wads and options stored in dir\n"
+           "   -incremental    Reuse brush models that haven't changed since the last -incremental compile, kept in <bspname>.bmc\n"
+           "   -mergeclipnodes Store identical clipping hull subtrees once, for smaller clipnode lumps\n"
            "   sourcefile      .MAP file to process\n"
            "   destfile        .BSP file to output\n");
 
@@ -1023,6 +1464,20 @@ ParseOptions(char *szOptions)
                     Error("Invalid argument to option %s", szTok);
                 options.dxLeakDist = atoi(szTok2);
                 szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "membudget")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                Mem_SetBudget(szTok2);
+                szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "numanode")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                BindToNumaNode(atoi(szTok2));
+                szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "pinthreads")) {
+                PinThreads();
             } else if (!Q_strcasecmp(szTok, "subdivide")) {
                 szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
                 if (!szTok2)
@@ -1108,6 +1563,8 @@ ParseOptions(char *szOptions)
                 options.fForcePRT1 = true;
                 logprint("WARNING: Forcing creation of PRT1.\n");
                 logprint("         Only use this for viewing portals in a map editor.\n");
+            } else if (!Q_strcasecmp(szTok, "binaryprt")) {
+                options.fBinaryPRT = true;
             } else if (!Q_strcasecmp(szTok, "expand")) {
                 options.fTestExpand = true;
             } else if (!Q_strcasecmp(szTok, "leaktest")) {
@@ -1116,6 +1573,20 @@ ParseOptions(char *szOptions)
                 options.fContentHack = true;
             } else if (!Q_strcasecmp(szTok, "nothreads")) {
                 options.fNoThreads = true;
+            } else if (!Q_strcasecmp(szTok, "timing")) {
+                timingenabled = true;
+            } else if (!Q_strcasecmp(szTok, "timingtrace")) {
+                timingtrace = true;
+            } else if (!Q_strcasecmp(szTok, "incremental")) {
+                options.fIncremental = true;
+            } else if (!Q_strcasecmp(szTok, "mergeclipnodes")) {
+                options.fMergeClipnodes = true;
+            } else if (!Q_strcasecmp(szTok, "cachedir")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                compilecachedir = szTok2;
+                szTok = szTok2;
             } else if (!Q_strcasecmp(szTok, "?") || !Q_strcasecmp(szTok, "help"))
                 PrintOptions();
             else
@@ -1162,7 +1633,7 @@ InitQBSP(int argc, const char **argv)
         Message(msgLiteral, "Loading options from qbsp.ini\n");
         ParseOptions(szBuf);
 
-        free(szBuf);
+        FreeMem(szBuf);
     }
 
     // Concatenate command line args
@@ -1185,11 +1656,16 @@ InitQBSP(int argc, const char **argv)
     }
     szBuf[length - 1] = 0;
     ParseOptions(szBuf);
-    free(szBuf);
+    FreeMem(szBuf);
 
     if (options.szMapName[0] == 0)
         PrintOptions();
 
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], options.szMapName) && strcmp(argv[i], options.szBSPName))
+            cacheargs.push_back(argv[i]);
+    }
+
     StripExtension(options.szMapName);
     strcat(options.szMapName, ".map");
 
@@ -1254,6 +1730,7 @@ int qbsp_main(int argc, const char **argv)
     Message(msgScreen, IntroString);
 
     InitQBSP(argc, argv);
+    Timing_Start("qbsp");
 
     // disable TBB if requested
     auto tbbOptions = std::unique_ptr<tbb::global_control>();
@@ -1268,6 +1745,9 @@ int qbsp_main(int argc, const char **argv)
 
     Message(msgLiteral, "\n%5.3f seconds elapsed\n", end - start);
 
+    Mem_Report();
+    Timing_Finish(options.szBSPName);
+
 //      FreeAllMem();
 //      PrintMem();
 
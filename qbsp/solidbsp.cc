@@ -25,20 +25,39 @@
 
 #include <atomic>
 
+#include "tbb/parallel_for.h"
 #include "tbb/task_group.h"
 
-std::atomic<int> splitnodes;
+/*
+ * Subtrees with fewer surfaces than this are partitioned on the calling
+ * thread, a task costs more than it saves on them.
+ */
+#define PARALLEL_PARTITION_SURFACES 64
+
+/*
+ * ChoosePlaneFromList scores this many candidate planes at a time once a
+ * node has at least this many candidates.
+ */
+#define PARALLEL_PLANE_BLOCK 64
 
-static std::atomic<int> leaffaces;
-static std::atomic<int> nodefaces;
-static std::atomic<int> c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
-static std::atomic<int> c_illusionary_visblocker;
-static bool usemidsplit;
+std::atomic<int> splitnodes;
 
-/**
- * Total number of surfaces in the map
+/*
+ * State for one SolidBSP call. Kept out of globals so the hulls can be
+ * partitioned concurrently.
  */
-static int mapsurfaces;
+class partition_state_t {
+public:
+    bool usemidsplit;
+    bool progress;          // report progress %, false for quiet hulls
+    int mapsurfaces;        // total number of surfaces in the model
+    int mapfaces;           // total number of faces, for the progress %
+    std::atomic<int> splitnodes;
+    std::atomic<int> leaffaces;
+    std::atomic<int> nodefaces;
+    std::atomic<int> c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
+    std::atomic<int> c_illusionary_visblocker;
+};
 
 //============================================================================
 
@@ -295,7 +314,7 @@ The clipping hull BSP doesn't worry about avoiding splits
 ==================
 */
 static surface_t *
-ChooseMidPlaneFromList(surface_t *surfaces, const vec3_t mins, const vec3_t maxs)
+ChooseMidPlaneFromList(surface_t *surfaces, const vec3_t mins, const vec3_t maxs, const partition_state_t *state)
 {
     /* pick the plane that splits the least */
     vec_t bestmetric = VECT_MAX;
@@ -357,7 +376,7 @@ ChooseMidPlaneFromList(surface_t *surfaces, const vec3_t mins, const vec3_t maxs
     // TODO: investigate dropping the maxNodeSize feature (dynamically choosing
     // between ChooseMidPlaneFromList and ChoosePlaneFromList) and use Q2's
     // chopping on a uniform grid?
-    if (!usemidsplit && !bestsurface->has_struct) {
+    if (!state->usemidsplit && !bestsurface->has_struct) {
         bestsurface->detail_separator = true;
     }
     
@@ -366,88 +385,144 @@ ChooseMidPlaneFromList(surface_t *surfaces, const vec3_t mins, const vec3_t maxs
 
 
 
+/*
+==================
+CountPlaneSplits
+
+Counts the faces that surf's plane would split, giving up once there are
+more than minsplits. The early out means the count is only exact while it
+stays below minsplits. Splitting a hint face with a non-hint plane
+returns INT_MAX.
+==================
+*/
+static int
+CountPlaneSplits(const surface_t *surfaces, const surface_t *surf, const int minsplits)
+{
+    /* check whether this is a hint split */
+    bool hintsplit = false;
+    for (const face_t *face = surf->faces; face; face = face->next) {
+        if (map.mtexinfos.at(face->texinfo).flags.extended & TEX_EXFLAG_HINT)
+            hintsplit = true;
+    }
+
+    const qbsp_plane_t *plane = &map.planes[surf->planenum];
+    int splits = 0;
+
+    for (const surface_t *surf2 = surfaces; surf2; surf2 = surf2->next) {
+        if (surf2 == surf || surf2->onnode)
+            continue;
+        const qbsp_plane_t *plane2 = &map.planes[surf2->planenum];
+        if (plane->type < 3 && plane->type == plane2->type)
+            continue;
+        for (const face_t *face = surf2->faces; face; face = face->next) {
+            const surfflags_t &flags = map.mtexinfos.at(face->texinfo).flags;
+            /* Don't penalize for splitting skip faces */
+            if (flags.extended & TEX_EXFLAG_SKIP)
+                continue;
+            if (FaceSide(face, plane) == SIDE_ON) {
+                /* Never split a hint face except with a hint */
+                if (!hintsplit && (flags.extended & TEX_EXFLAG_HINT)) {
+                    splits = INT_MAX;
+                    break;
+                }
+                splits++;
+                if (splits >= minsplits)
+                    break;
+            }
+        }
+        if (splits > minsplits)
+            break;
+    }
+
+    return splits;
+}
+
 /*
 ==================
 ChoosePlaneFromList
 
 The real BSP hueristic
+
+Candidates are counted a block at a time in parallel, all against the
+best count from before the block. Then the block is walked in order, as
+the serial loop would walk it. A count is kept if the best hasn't improved
+since, or if the count is still exact. Otherwise it is recounted, so the
+chosen plane doesn't depend on the number of threads.
 ==================
 */
 static surface_t *
-ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
+ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs, const partition_state_t *state)
 {
     /* pick the plane that splits the least */
     int minsplits = INT_MAX - 1;
     vec_t bestdistribution = VECT_MAX;
     surface_t *bestsurface = nullptr;
 
+    std::vector<surface_t *> candidates;
+    std::vector<int> blocksplits;
+
     /* Two passes - exhaust all non-detail faces before details */
     for (int pass = 0; pass < 2; pass++) {
+        candidates.clear();
         for (surface_t *surf = surfaces; surf; surf = surf->next) {
             if (surf->onnode)
                 continue;
-
-            /*
-             * Check that the surface has a suitable face for the current pass
-             * and check whether this is a hint split.
-             */
-            bool hintsplit = false;
-            for (const face_t *face = surf->faces; face; face = face->next) {
-                if (map.mtexinfos.at(face->texinfo).flags.extended & TEX_EXFLAG_HINT)
-                    hintsplit = true;
-            }
-
             if( surf->has_struct && pass )
                 continue;
             if( !surf->has_struct && !pass )
                 continue;
-            
+            candidates.push_back(surf);
+        }
 
-            const qbsp_plane_t *plane = &map.planes[surf->planenum];
-            int splits = 0;
+        const size_t blocksize = (candidates.size() < PARALLEL_PLANE_BLOCK) ? 1 : PARALLEL_PLANE_BLOCK;
+        blocksplits.resize(blocksize);
 
-            for (surface_t *surf2 = surfaces; surf2; surf2 = surf2->next) {
-                if (surf2 == surf || surf2->onnode)
-                    continue;
-                const qbsp_plane_t *plane2 = &map.planes[surf2->planenum];
-                if (plane->type < 3 && plane->type == plane2->type)
-                    continue;
-                for (const face_t *face = surf2->faces; face; face = face->next) {
-                    const surfflags_t &flags = map.mtexinfos.at(face->texinfo).flags;
-                    /* Don't penalize for splitting skip faces */
-                    if (flags.extended & TEX_EXFLAG_SKIP)
+        for (size_t first = 0; first < candidates.size(); first += blocksize) {
+            const size_t count = qmin(blocksize, candidates.size() - first);
+            const int blocklimit = minsplits;
+
+            if (count == 1) {
+                blocksplits[0] = CountPlaneSplits(surfaces, candidates[first], blocklimit);
+            } else {
+                tbb::parallel_for(static_cast<size_t>(0), count,
+                                  [&](const size_t i) {
+                    blocksplits[i] = CountPlaneSplits(surfaces, candidates[first + i], blocklimit);
+                });
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                surface_t *surf = candidates[first + i];
+                const qbsp_plane_t *plane = &map.planes[surf->planenum];
+                int splits = blocksplits[i];
+
+                if (minsplits != blocklimit) {
+                    if (splits < minsplits) {
+                        /* never reached either limit, so it's exact */
+                    } else if (splits > blocklimit && splits != INT_MAX) {
+                        /* would have gone over the lower limit too */
                         continue;
-                    if (FaceSide(face, plane) == SIDE_ON) {
-                        /* Never split a hint face except with a hint */
-                        if (!hintsplit && (flags.extended & TEX_EXFLAG_HINT)) {
-                            splits = INT_MAX;
-                            break;
-                        }
-                        splits++;
-                        if (splits >= minsplits)
-                            break;
+                    } else {
+                        splits = CountPlaneSplits(surfaces, surf, minsplits);
                     }
                 }
                 if (splits > minsplits)
-                    break;
-            }
-            if (splits > minsplits)
-                continue;
+                    continue;
 
-            /*
-             * if equal numbers axial planes win, otherwise decide on spatial
-             * subdivision
-             */
-            if (splits < minsplits || (splits == minsplits && plane->type < 3)) {
-                if (plane->type < 3) {
-                    const vec_t distribution = SplitPlaneMetric(plane, mins, maxs);
-                    if (distribution > bestdistribution && splits == minsplits)
-                        continue;
-                    bestdistribution = distribution;
+                /*
+                 * if equal numbers axial planes win, otherwise decide on spatial
+                 * subdivision
+                 */
+                if (splits < minsplits || (splits == minsplits && plane->type < 3)) {
+                    if (plane->type < 3) {
+                        const vec_t distribution = SplitPlaneMetric(plane, mins, maxs);
+                        if (distribution > bestdistribution && splits == minsplits)
+                            continue;
+                        bestdistribution = distribution;
+                    }
+                    /* currently the best! */
+                    minsplits = splits;
+                    bestsurface = surf;
                 }
-                /* currently the best! */
-                minsplits = splits;
-                bestsurface = surf;
             }
         }
 
@@ -473,7 +548,7 @@ Called in parallel.
 ==================
 */
 static surface_t *
-SelectPartition(surface_t *surfaces)
+SelectPartition(surface_t *surfaces, const partition_state_t *state)
 {
     // count onnode surfaces
     int surfcount = 0;
@@ -505,7 +580,7 @@ SelectPartition(surface_t *surfaces)
         }
 
     // how much of the map are we partitioning?
-    double fractionOfMap = surfcount / (double)mapsurfaces;
+    double fractionOfMap = surfcount / (double)state->mapsurfaces;
 
     bool largenode = false;
 
@@ -524,11 +599,11 @@ SelectPartition(surface_t *surfaces)
         }
     }
 
-    if (usemidsplit || largenode) // do fast way for clipping hull
-        return ChooseMidPlaneFromList(surfaces, mins, maxs);
+    if (state->usemidsplit || largenode) // do fast way for clipping hull
+        return ChooseMidPlaneFromList(surfaces, mins, maxs, state);
 
     // do slow way to save poly splits for drawing hull
-    return ChoosePlaneFromList(surfaces, mins, maxs);
+    return ChoosePlaneFromList(surfaces, mins, maxs, state);
 }
 
 //============================================================================
@@ -627,12 +702,12 @@ DividePlane(surface_t *in, const qbsp_plane_t *split, surface_t **front,
             if (in->faces)
                 *front = in;
             else
-                free(in);
+                FreeMem(in);
 
             if (newsurf->faces)
                 *back = newsurf;
             else
-                free(newsurf);
+                FreeMem(newsurf);
 
             return;
         }
@@ -755,7 +830,7 @@ Called in parallel.
 ==================
 */
 static void
-LinkConvexFaces(surface_t *planelist, node_t *leafnode)
+LinkConvexFaces(surface_t *planelist, node_t *leafnode, partition_state_t *state)
 {
     leafnode->faces = NULL;
     leafnode->planenum = PLANENUM_LEAF;
@@ -792,26 +867,26 @@ LinkConvexFaces(surface_t *planelist, node_t *leafnode)
     leafnode->contents = contents.value_or(options.target_game->create_solid_contents()); // FIXME: Need to create CONTENTS_DETAIL sometimes?
 
     if (leafnode->contents.extended & CFLAGS_ILLUSIONARY_VISBLOCKER) {
-        c_illusionary_visblocker++;
+        state->c_illusionary_visblocker++;
     } else if (leafnode->contents.extended & CFLAGS_DETAIL_FENCE) {
-        c_detail_fence++;
+        state->c_detail_fence++;
     } else if (leafnode->contents.extended & CFLAGS_DETAIL_ILLUSIONARY) {
-        c_detail_illusionary++;
+        state->c_detail_illusionary++;
     } else if (leafnode->contents.extended & CFLAGS_DETAIL) {
-        c_detail++;
+        state->c_detail++;
     } else if (leafnode->contents.is_empty(options.target_game)) {
-        c_empty++;
+        state->c_empty++;
     } else if (leafnode->contents.is_solid(options.target_game)) {
-        c_solid++;
+        state->c_solid++;
     } else if (leafnode->contents.is_liquid(options.target_game) || leafnode->contents.is_sky(options.target_game)) {
-        c_water++;
+        state->c_water++;
     } else {
         //Error("Bad contents in face: %s (%s)", leafnode->contents.to_string(options.target_game).c_str(), __func__);
     }
 
     // write the list of the original faces to the leaf's markfaces
     // free surf and the surf->faces list.
-    leaffaces += count;
+    state->leaffaces += count;
     leafnode->markfaces = (face_t **)AllocMem(OTHER, sizeof(face_t *) * (count + 1), true);
 
     int i = 0;
@@ -823,9 +898,9 @@ LinkConvexFaces(surface_t *planelist, node_t *leafnode)
             next = f->next;
             leafnode->markfaces[i] = f->original;
             i++;
-            free(f);
+            FreeMem(f);
         }
-        free(surf);
+        FreeMem(surf);
     }
     leafnode->markfaces[i] = NULL;      // sentinal
 }
@@ -845,7 +920,7 @@ Called in parallel.
 ==================
 */
 static face_t *
-LinkNodeFaces(surface_t *surface)
+LinkNodeFaces(surface_t *surface, partition_state_t *state)
 {
     face_t *list = NULL;
 
@@ -860,7 +935,7 @@ LinkNodeFaces(surface_t *surface)
 
     // copy
     for (face_t *f = surface->faces; f; f = f->next) {
-        nodefaces++;
+        state->nodefaces++;
         face_t *newf = (face_t *)AllocMem(OTHER, sizeof(face_t), true);
         *newf = *f;
         f->original = newf;
@@ -880,22 +955,23 @@ Called in parallel.
 ==================
 */
 static void
-PartitionSurfaces(surface_t *surfaces, node_t *node)
+PartitionSurfaces(surface_t *surfaces, node_t *node, partition_state_t *state)
 {
-    surface_t *split = SelectPartition(surfaces);
+    surface_t *split = SelectPartition(surfaces, state);
     if (!split) {               // this is a leaf node
         node->planenum = PLANENUM_LEAF;
         
         // frees `surfaces` and the faces on it.
         // saves pointers to face->original in the leaf's markfaces list.
-        LinkConvexFaces(surfaces, node);
+        LinkConvexFaces(surfaces, node, state);
         return;
     }
 
-    splitnodes++;
-    Message(msgPercent, splitnodes.load(), csgmergefaces);
+    state->splitnodes++;
+    if (state->progress)
+        Message(msgPercent, state->splitnodes.load(), state->mapfaces);
 
-    node->faces = LinkNodeFaces(split);
+    node->faces = LinkNodeFaces(split, state);
     node->children[0] = (node_t *)AllocMem(OTHER, sizeof(node_t), true);
     node->children[1] = (node_t *)AllocMem(OTHER, sizeof(node_t), true);
     node->planenum = split->planenum;
@@ -908,6 +984,7 @@ PartitionSurfaces(surface_t *surfaces, node_t *node)
     // multiple surfaces, so split all the polysurfaces into front and back lists
     surface_t *frontlist = NULL;
     surface_t *backlist = NULL;
+    int numsurfs = 0;
 
     surface_t *next;
     for (surface_t *surf = surfaces; surf; surf = next) {
@@ -927,22 +1004,91 @@ PartitionSurfaces(surface_t *surfaces, node_t *node)
                 Error("Surface with no faces (%s)", __func__);
             frontfrag->next = frontlist;
             frontlist = frontfrag;
+            numsurfs++;
         }
         if (backfrag) {
             if (!backfrag->faces)
                 Error("Surface with no faces (%s)", __func__);
             backfrag->next = backlist;
             backlist = backfrag;
+            numsurfs++;
         }
     }
 
+    if (numsurfs < PARALLEL_PARTITION_SURFACES) {
+        PartitionSurfaces(frontlist, node->children[0], state);
+        PartitionSurfaces(backlist, node->children[1], state);
+        return;
+    }
+
     tbb::task_group g;
-    g.run([&](){ PartitionSurfaces(frontlist, node->children[0]); });
-    g.run([&](){ PartitionSurfaces(backlist, node->children[1]); });
+    g.run([&](){ PartitionSurfaces(frontlist, node->children[0], state); });
+    g.run([&](){ PartitionSurfaces(backlist, node->children[1], state); });
     g.wait();
 }
 
 
+static int
+CountNodes_r(const node_t *node)
+{
+    if (node->planenum == PLANENUM_LEAF)
+        return 1;
+    return 1 + CountNodes_r(node->children[0]) + CountNodes_r(node->children[1]);
+}
+
+static node_t *
+CompactNode_r(node_t *node, node_t **next)
+{
+    Q_assert(!node->portals);
+
+    node_t *copy = (*next)++;
+    *copy = *node;
+    FreeMem(node);
+
+    if (copy->planenum != PLANENUM_LEAF) {
+        copy->children[0] = CompactNode_r(copy->children[0], next);
+        copy->children[1] = CompactNode_r(copy->children[1], next);
+    }
+    return copy;
+}
+
+/*
+==================
+CompactTree
+
+The tree is built a node at a time, by many threads, so its nodes end up
+all over the heap. This moves them into one block in depth-first order,
+front child first, the order the passes over the finished tree walk it,
+and frees the old nodes. Nothing else may point at the nodes yet (no
+portals). The block belongs to the headnode: free it with FreeTree, not
+node by node.
+==================
+*/
+node_t *
+CompactTree(node_t *headnode)
+{
+    const int numnodes = CountNodes_r(headnode);
+    node_t *nodes = (node_t *)AllocMem(OTHER, sizeof(node_t) * numnodes, false);
+    node_t *next = nodes;
+
+    CompactNode_r(headnode, &next);
+    Q_assert(next == nodes + numnodes);
+    return nodes;
+}
+
+/*
+==================
+FreeTree
+
+Frees a tree's nodes, but not their faces or markfaces
+==================
+*/
+void
+FreeTree(node_t *headnode)
+{
+    FreeMem(headnode);
+}
+
 /*
 ==================
 SolidBSP
@@ -972,13 +1118,18 @@ SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit)
         headnode->children[1]->contents = options.target_game->create_empty_contents();
         headnode->children[1]->markfaces = (face_t **)AllocMem(OTHER, sizeof(face_t *), true);
 
-        return headnode;
+        return CompactTree(headnode);
     }
 
+    timingscope_t scope("SolidBSP", entity->outputmodelnumber);
+
     Message(msgProgress, "SolidBSP");
 
     node_t *headnode = (node_t *)AllocMem(OTHER, sizeof(node_t), true);
-    usemidsplit = midsplit;
+
+    partition_state_t state;
+    state.usemidsplit = midsplit;
+    state.progress = !fQuietThread;
 
     // calculate a bounding box for the entire model
     for (int i = 0; i < 3; i++) {
@@ -987,34 +1138,43 @@ SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit)
     }
 
     // recursively partition everything
-    splitnodes = 0;
-    leaffaces = 0;
-    nodefaces = 0;
-    c_solid = 0;
-    c_empty = 0;
-    c_water = 0;
-    c_detail = 0;
-    c_detail_illusionary = 0;
-    c_detail_fence = 0;
-    c_illusionary_visblocker = 0;
+    state.splitnodes = 0;
+    state.leaffaces = 0;
+    state.nodefaces = 0;
+    state.c_solid = 0;
+    state.c_empty = 0;
+    state.c_water = 0;
+    state.c_detail = 0;
+    state.c_detail_illusionary = 0;
+    state.c_detail_fence = 0;
+    state.c_illusionary_visblocker = 0;
     // count map surfaces; this is used when deciding to switch between midsplit and the expensive partitioning
-    mapsurfaces = 0;
+    state.mapsurfaces = 0;
+    state.mapfaces = 0;
     for (surface_t *surf = surfhead; surf; surf = surf->next) {
-        mapsurfaces++;
+        state.mapsurfaces++;
+        for (const face_t *f = surf->faces; f; f = f->next)
+            state.mapfaces++;
     }
 
-    PartitionSurfaces(surfhead, headnode);
+    PartitionSurfaces(surfhead, headnode, &state);
+
+    // the portal and face edge passes that follow use this for their progress %
+    if (state.progress)
+        splitnodes = state.splitnodes.load();
+
+    Timing_Count("split nodes, all hulls", state.splitnodes.load());
 
-    Message(msgStat, "%8d split nodes", splitnodes.load());
-    Message(msgStat, "%8d solid leafs", c_solid.load());
-    Message(msgStat, "%8d empty leafs", c_empty.load());
-    Message(msgStat, "%8d water leafs", c_water.load());
-    Message(msgStat, "%8d detail leafs", c_detail.load());
-    Message(msgStat, "%8d detail illusionary leafs", c_detail_illusionary.load());
-    Message(msgStat, "%8d detail fence leafs", c_detail_fence.load());
-    Message(msgStat, "%8d illusionary visblocker leafs", c_illusionary_visblocker.load());
-    Message(msgStat, "%8d leaffaces", leaffaces.load());
-    Message(msgStat, "%8d nodefaces", nodefaces.load());
+    Message(msgStat, "%8d split nodes", state.splitnodes.load());
+    Message(msgStat, "%8d solid leafs", state.c_solid.load());
+    Message(msgStat, "%8d empty leafs", state.c_empty.load());
+    Message(msgStat, "%8d water leafs", state.c_water.load());
+    Message(msgStat, "%8d detail leafs", state.c_detail.load());
+    Message(msgStat, "%8d detail illusionary leafs", state.c_detail_illusionary.load());
+    Message(msgStat, "%8d detail fence leafs", state.c_detail_fence.load());
+    Message(msgStat, "%8d illusionary visblocker leafs", state.c_illusionary_visblocker.load());
+    Message(msgStat, "%8d leaffaces", state.leaffaces.load());
+    Message(msgStat, "%8d nodefaces", state.nodefaces.load());
 
-    return headnode;
+    return CompactTree(headnode);
 }
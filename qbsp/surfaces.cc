@@ -21,7 +21,8 @@
 
 #include <qbsp/qbsp.hh>
 #include <map>
-#include <list>
+#include <array>
+#include <vector>
 
 /*
 ===============
@@ -140,7 +141,7 @@ GatherNodeFaces_r(node_t *node, std::map<int, face_t *> &planefaces)
         for (f = node->faces; f; f = next) {
             next = f->next;
             if (!f->w.numpoints) {      // face was removed outside
-                free(f);
+                FreeMem(f);
             } else {
                 f->next = planefaces[f->planenum];
                 planefaces[f->planenum] = f;
@@ -149,7 +150,6 @@ GatherNodeFaces_r(node_t *node, std::map<int, face_t *> &planefaces)
         GatherNodeFaces_r(node->children[0], planefaces);
         GatherNodeFaces_r(node->children[1], planefaces);
     }
-    free(node);
 }
 
 /*
@@ -164,6 +164,7 @@ GatherNodeFaces(node_t *headnode)
 
     std::map<int, face_t *> planefaces;
     GatherNodeFaces_r(headnode, planefaces);
+    FreeTree(headnode);
     surfaces = BuildSurfaces(planefaces);
 
     return surfaces;
@@ -172,19 +173,91 @@ GatherNodeFaces(node_t *headnode)
 //===========================================================================
 
 // This is a kludge.   Should be pEdgeFaces[2].
-static std::map<int, const face_t *> pEdgeFaces0;
-static std::map<int, const face_t *> pEdgeFaces1;
+// Indexed by edge number - firstedge, firstedge being the first edge of
+// the entity being processed.
+static std::vector<const face_t *> pEdgeFaces0;
+static std::vector<const face_t *> pEdgeFaces1;
+static int firstedge;
 
 //============================================================================
 
+/*
+ * Hash table for welding verts and edges. The buckets are a power of two
+ * array of chain heads and the entries live in one vector, so inserting
+ * doesn't allocate per entry. Chains are walked newest first.
+ */
+template <size_t N, typename V>
+class weldhash_t {
+public:
+    using key_t = std::array<int, N>;
+
+private:
+    struct entry_t {
+        key_t key;
+        V value;
+        int next;
+    };
+
+    std::vector<int> heads;
+    std::vector<entry_t> entries;
+
+    size_t bucket(const key_t &key) const {
+        uint32_t h = 2166136261u;
+        for (const int i : key) {
+            h ^= static_cast<uint32_t>(i);
+            h *= 16777619u;
+        }
+        return (h ^ (h >> 15)) & (heads.size() - 1);
+    }
+
+    void rehash(size_t numbuckets) {
+        heads.assign(numbuckets, -1);
+        // oldest first, so each chain ends up newest first again
+        for (size_t i = 0; i < entries.size(); i++) {
+            int &head = heads[bucket(entries[i].key)];
+            entries[i].next = head;
+            head = static_cast<int>(i);
+        }
+    }
+
+public:
+    weldhash_t() { clear(); }
+
+    void clear() {
+        entries.clear();
+        heads.assign(1024, -1);
+    }
+
+    void insert(const key_t &key, const V &value) {
+        if (entries.size() >= heads.size() * 2)
+            rehash(heads.size() * 2);
+
+        int &head = heads[bucket(key)];
+        entries.push_back({ key, value, head });
+        head = static_cast<int>(entries.size() - 1);
+    }
+
+    /* newest value stored under key that pred accepts, or NULL */
+    template <typename P>
+    const V *find(const key_t &key, P pred) const {
+        for (int i = heads[bucket(key)]; i != -1; i = entries[i].next) {
+            const entry_t &entry = entries[i];
+            if (entry.key == key && pred(entry.value))
+                return &entry.value;
+        }
+        return nullptr;
+    }
+};
+
 using vertidx_t = int;
 using edgeidx_t = int;
-static std::map<std::pair<vertidx_t, vertidx_t>, std::list<edgeidx_t>> hashedges;
-static std::map<std::tuple<int,int,int>, std::list<hashvert_t>> hashverts;
+static weldhash_t<2, edgeidx_t> hashedges;
+static weldhash_t<3, hashvert_t> hashverts;
 
 static void
 InitHash(void)
 {
+    firstedge = static_cast<int>(map.exported_edges.size());
     pEdgeFaces0.clear();
     pEdgeFaces1.clear();
     hashverts.clear();
@@ -194,15 +267,15 @@ InitHash(void)
 static void
 AddHashEdge(int v1, int v2, int i)
 {
-    hashedges[std::make_pair(v1, v2)].push_front(i);
+    hashedges.insert({ v1, v2 }, i);
 }
 
-static std::tuple<int,int,int>
+static weldhash_t<3, hashvert_t>::key_t
 HashVec(const vec3_t vec)
 {
-    return std::make_tuple(static_cast<int>(floor(vec[0])),
-                           static_cast<int>(floor(vec[1])),
-                           static_cast<int>(floor(vec[2])));
+    return { static_cast<int>(floor(vec[0])),
+             static_cast<int>(floor(vec[1])),
+             static_cast<int>(floor(vec[2])) };
 }
 
 static void
@@ -219,10 +292,9 @@ AddHashVert(const vec3_t vert, const int global_vert_num)
     for (int x=0; x<=1; x++) {
         for (int y=0; y<=1; y++) {
             for (int z=0; z<=1; z++) {
-                const auto h = std::make_tuple(static_cast<int>(floor(vert[0])) + x,
-                                               static_cast<int>(floor(vert[1])) + y,
-                                               static_cast<int>(floor(vert[2])) + z);
-                hashverts[h].push_front(hv);
+                hashverts.insert({ static_cast<int>(floor(vert[0])) + x,
+                                   static_cast<int>(floor(vert[1])) + y,
+                                   static_cast<int>(floor(vert[2])) + z }, hv);
             }
         }
     }
@@ -233,7 +305,7 @@ AddHashVert(const vec3_t vert, const int global_vert_num)
 GetVertex
 =============
 */
-static int
+int
 GetVertex(mapentity_t *entity, const vec3_t in)
 {
     int i;
@@ -247,18 +319,13 @@ GetVertex(mapentity_t *entity, const vec3_t in)
             vert[i] = in[i];
     }
 
-    const auto h = HashVec(vert);
-    auto it = hashverts.find(h);
-    if (it != hashverts.end()) {
-        for (hashvert_t &hv : it->second) {
-            if (fabs(hv.point[0] - vert[0]) < POINT_EPSILON &&
-                fabs(hv.point[1] - vert[1]) < POINT_EPSILON &&
-                fabs(hv.point[2] - vert[2]) < POINT_EPSILON) {
-
-                return hv.num;
-            }
-        }
-    }
+    const hashvert_t *hv = hashverts.find(HashVec(vert), [&vert](const hashvert_t &other) {
+        return fabs(other.point[0] - vert[0]) < POINT_EPSILON &&
+               fabs(other.point[1] - vert[1]) < POINT_EPSILON &&
+               fabs(other.point[2] - vert[2]) < POINT_EPSILON;
+    });
+    if (hv)
+        return hv->num;
 
     const int global_vert_num = static_cast<int>(map.exported_vertexes.size());
 
@@ -299,34 +366,28 @@ GetEdge(mapentity_t *entity, const vec3_t p1, const vec3_t p2,
     v2 = GetVertex(entity, p2);
 
     // search for an existing edge from v2->v1
-    const std::pair<int,int> edge_hash_key = std::make_pair(v2, v1);
-
-    {
-        bsp2_dedge_t *edge;
-
-        auto it = hashedges.find(edge_hash_key);
-        if (it != hashedges.end()) {
-            for (const int i : it->second) {
-                edge = &map.exported_edges.at(i);
-                if (pEdgeFaces1[i] == NULL
-                    && pEdgeFaces0[i]->contents[0].native == face->contents[0].native) {
-                    pEdgeFaces1[i] = face;
-                    return -i;
-                }
-            }
-        }
-
-        /* emit an edge */
-        i = static_cast<int>(map.exported_edges.size());
-        map.exported_edges.push_back({});
-        edge = &map.exported_edges.at(i);
-        edge->v[0] = v1;
-        edge->v[1] = v2;
+    const edgeidx_t *existing = hashedges.find({ v2, v1 }, [face](const edgeidx_t i) {
+        return pEdgeFaces1[i - firstedge] == NULL
+            && pEdgeFaces0[i - firstedge]->contents[0].native == face->contents[0].native;
+    });
+    if (existing) {
+        i = *existing;
+        pEdgeFaces1[i - firstedge] = face;
+        return -i;
     }
 
+    /* emit an edge */
+    i = static_cast<int>(map.exported_edges.size());
+    map.exported_edges.push_back({});
+    bsp2_dedge_t *edge = &map.exported_edges.at(i);
+    edge->v[0] = v1;
+    edge->v[1] = v2;
+
     AddHashEdge(v1, v2, i);
 
-    pEdgeFaces0[i] = face;
+    Q_assert(i - firstedge == static_cast<int>(pEdgeFaces0.size()));
+    pEdgeFaces0.push_back(face);
+    pEdgeFaces1.push_back(NULL);
     return i;
 }
 
@@ -418,7 +479,7 @@ EmitFace(mapentity_t *entity, face_t *face)
     for (i = 0; i < face->w.numpoints; i++) {
         map.exported_surfedges.push_back(face->edges[i]);
     }
-    free(face->edges);
+    FreeMem(face->edges);
     
     out->numedges = static_cast<int>(map.exported_surfedges.size()) - out->firstedge;
 }
@@ -493,6 +554,8 @@ MakeFaceEdges(mapentity_t *entity, node_t *headnode)
 {
     int firstface;
 
+    timingscope_t scope("MakeFaceEdges", entity->outputmodelnumber);
+
     Message(msgProgress, "MakeFaceEdges");
 
     Q_assert(entity->firstoutputfacenumber == -1);
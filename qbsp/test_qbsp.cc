@@ -3,6 +3,10 @@
 #include <qbsp/qbsp.hh>
 #include <qbsp/map.hh>
 
+#include <array>
+#include <string>
+#include <vector>
+
 // FIXME: Clear global data (planes, etc) between each test
 
 static face_t *Brush_FirstFaceWithTextureName(brush_t *brush, const char *texname) {
@@ -272,8 +276,8 @@ TEST(qbsp, SplitBrush) {
     checkCube(back);
     
     FreeBrush(brush);
-    free(front);
-    free(back);
+    FreeMem(front);
+    FreeMem(back);
 }
 
 TEST(qbsp, SplitBrushOnSide) {
@@ -398,6 +402,131 @@ TEST(qbsp, InvalidTextureProjection3) {
     EXPECT_TRUE(IsValidTextureProjection(vec3_t_to_glm(face->plane.normal), texvecs.at(0), texvecs.at(1)));
 }
 
+/* a Quake-format axial box brush, faces as TrenchBroom writes them */
+static std::string
+BoxBrush(const std::array<int, 3> &mins, const std::array<int, 3> &maxs)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "{\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "( %d %d %d ) ( %d %d %d ) ( %d %d %d ) wall 0 0 0 1 1\n"
+             "}\n",
+             mins[0], mins[1], mins[2], mins[0], mins[1] + 1, mins[2], mins[0], mins[1], mins[2] + 1,
+             mins[0], mins[1], mins[2], mins[0], mins[1], mins[2] + 1, mins[0] + 1, mins[1], mins[2],
+             mins[0], mins[1], mins[2], mins[0] + 1, mins[1], mins[2], mins[0], mins[1] + 1, mins[2],
+             maxs[0], maxs[1], maxs[2], maxs[0], maxs[1] + 1, maxs[2], maxs[0] + 1, maxs[1], maxs[2],
+             maxs[0], maxs[1], maxs[2], maxs[0] + 1, maxs[1], maxs[2], maxs[0], maxs[1], maxs[2] + 1,
+             maxs[0], maxs[1], maxs[2], maxs[0], maxs[1], maxs[2] + 1, maxs[0], maxs[1] + 1, maxs[2]);
+    return buf;
+}
+
+/* a sealed room with a row of pillars, and a func_wall made of two more */
+static void
+WriteMergeClipnodesTestMap(const char *filename)
+{
+    std::string map = "{\n\"classname\" \"worldspawn\"\n";
+    map += BoxBrush({-272, -272, -16}, {272, 272, 0});
+    map += BoxBrush({-272, -272, 256}, {272, 272, 272});
+    map += BoxBrush({-272, -272, 0}, {-256, 272, 256});
+    map += BoxBrush({256, -272, 0}, {272, 272, 256});
+    map += BoxBrush({-256, -272, 0}, {256, -256, 256});
+    map += BoxBrush({-256, 256, 0}, {256, 272, 256});
+    for (int x = -192; x <= 192; x += 96)
+        map += BoxBrush({x - 16, -16, 0}, {x + 16, 16, 256});
+    map += "}\n";
+
+    map += "{\n\"classname\" \"func_wall\"\n";
+    map += BoxBrush({-128, 128, 0}, {-96, 160, 64});
+    map += BoxBrush({96, 128, 0}, {128, 160, 64});
+    map += "}\n";
+
+    map += "{\n\"classname\" \"info_player_start\"\n\"origin\" \"0 -128 24\"\n}\n";
+
+    FILE *f = fopen(filename, "wb");
+    ASSERT_NE(nullptr, f);
+    fputs(map.c_str(), f);
+    fclose(f);
+}
+
+/* runs a whole qbsp compile of filename, then loads the bsp it wrote */
+static void
+CompileTestMap(const char *filename, const std::vector<const char *> &extraargs, bspdata_t *bspdata)
+{
+    map = mapdata_t();
+    options = options_t();
+
+    std::vector<const char *> argv {"qbsp", "-nopercent"};
+    argv.insert(argv.end(), extraargs.begin(), extraargs.end());
+    argv.push_back(filename);
+    qbsp_main(static_cast<int>(argv.size()), argv.data());
+
+    char bspname[1024];
+    snprintf(bspname, sizeof(bspname), "%s", filename);
+    StripExtension(bspname);
+    DefaultExtension(bspname, ".bsp");
+    LoadBSPFile(bspname, bspdata);
+    ConvertBSPFormat(bspdata, &bspver_generic);
+}
+
+static int
+HullPointContents(const mbsp_t *bsp, int num, const qvec3d &point)
+{
+    while (num >= 0) {
+        const bsp2_dclipnode_t *node = &bsp->dclipnodes[num];
+        const dplane_t *plane = &bsp->dplanes[node->planenum];
+        const double d = point[0] * plane->normal[0] + point[1] * plane->normal[1]
+            + point[2] * plane->normal[2] - plane->dist;
+        num = node->children[d < 0];
+    }
+    return num;
+}
+
+TEST(qbsp, MergeClipnodes) {
+    const char *mapfile = "test_mergeclipnodes.map";
+    WriteMergeClipnodesTestMap(mapfile);
+
+    bspdata_t plain {}, merged {};
+    CompileTestMap(mapfile, {}, &plain);
+    CompileTestMap(mapfile, {"-mergeclipnodes"}, &merged);
+
+    for (const char *ext : {".map", ".bsp", ".prt", ".log"}) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s", mapfile);
+        StripExtension(name);
+        DefaultExtension(name, ext);
+        remove(name);
+    }
+
+    const mbsp_t *a = &plain.data.mbsp;
+    const mbsp_t *b = &merged.data.mbsp;
+    ASSERT_EQ(2, a->nummodels);
+    ASSERT_EQ(a->nummodels, b->nummodels);
+    EXPECT_LT(b->numclipnodes, a->numclipnodes);
+
+    // the same contents everywhere in and around each model, for both clipping hulls
+    for (int m = 0; m < a->nummodels; m++) {
+        for (int hull = 1; hull <= 2; hull++) {
+            int mismatches = 0;
+            for (int x = -300; x <= 300; x += 7) {
+                for (int y = -300; y <= 300; y += 7) {
+                    for (int z = -40; z <= 300; z += 7) {
+                        const qvec3d point(x, y, z);
+                        if (HullPointContents(a, a->dmodels[m].headnode[hull], point)
+                            != HullPointContents(b, b->dmodels[m].headnode[hull], point))
+                            mismatches++;
+                    }
+                }
+            }
+            EXPECT_EQ(0, mismatches) << "model " << m << " hull " << hull;
+        }
+    }
+}
+
 TEST(mathlib, WindingArea) {
     winding_t w;
     w.numpoints = 5;
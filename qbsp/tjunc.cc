@@ -22,9 +22,15 @@
 
 #include <qbsp/qbsp.hh>
 
+#include <atomic>
+#include <vector>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
 static int numwedges, numwverts;
-static int tjuncs;
-static int tjuncfaces;
+static std::atomic<int> tjuncs;
+static std::atomic<int> tjuncfaces;
 
 static int cWVerts;
 static int cWEdges;
@@ -35,51 +41,75 @@ static wedge_t *pWEdges;
 
 //============================================================================
 
-#define NUM_HASH        1024
+/*
+ * Edges are hashed on their origin, in cells of TJUNC_ORIGIN_CELL units,
+ * and on their direction, in cells of 1 / TJUNC_DIR_CELLS. The cells are
+ * centred on whole values, so axial edges on the grid don't straddle
+ * cell boundaries. The number of buckets scales with the number of edges.
+ */
+#define TJUNC_ORIGIN_CELL       1.0
+#define TJUNC_DIR_CELLS         16.0
 
-static wedge_t *wedge_hash[NUM_HASH];
-static vec3_t hash_min, hash_scale;
+static wedge_t **wedge_hash;
+static unsigned wedge_hash_mask;
 
 static void
-InitHash(vec3_t mins, vec3_t maxs)
+InitHash(int numedges)
 {
-    vec3_t size;
-    vec_t volume;
-    vec_t scale;
-    int newsize[2];
-
-    VectorCopy(mins, hash_min);
-    VectorSubtract(maxs, mins, size);
-    memset(wedge_hash, 0, sizeof(wedge_hash));
+    unsigned numbuckets = 1024;
+    while (numbuckets < static_cast<unsigned>(numedges))
+        numbuckets <<= 1;
 
-    volume = size[0] * size[1];
-
-    scale = sqrt(volume / NUM_HASH);
-
-    newsize[0] = (int)(size[0] / scale);
-    newsize[1] = (int)(size[1] / scale);
+    wedge_hash = (wedge_t **)AllocMem(OTHER, numbuckets * sizeof(wedge_t *), true);
+    wedge_hash_mask = numbuckets - 1;
+}
 
-    hash_scale[0] = newsize[0] / size[0];
-    hash_scale[1] = newsize[1] / size[1];
-    hash_scale[2] = (vec_t)newsize[1];
+static void
+HashValues(const vec3_t origin, const vec3_t dir, vec_t values[6])
+{
+    for (int i = 0; i < 3; i++) {
+        values[i] = origin[i] / TJUNC_ORIGIN_CELL + 0.5;
+        values[i + 3] = dir[i] * TJUNC_DIR_CELLS + 0.5;
+    }
 }
 
 static unsigned
-HashVec(vec3_t vec)
+HashCell(const int cell[6])
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        h ^= static_cast<uint32_t>(cell[i]);
+        h *= 16777619u;
+    }
+    return (h ^ (h >> 15)) & wedge_hash_mask;
+}
+
+/*
+ * Chain length stats for -verbose
+ */
+static void
+PrintHashStats(void)
 {
-    unsigned h;
+    int used = 0, longest = 0;
+
+    for (unsigned i = 0; i <= wedge_hash_mask; i++) {
+        int length = 0;
+        for (const wedge_t *edge = wedge_hash[i]; edge; edge = edge->next)
+            length++;
+        if (length) {
+            used++;
+            longest = qmax(longest, length);
+        }
+    }
 
-    h = (unsigned)(hash_scale[0] * (vec[0] - hash_min[0]) * hash_scale[2] +
-                   hash_scale[1] * (vec[1] - hash_min[1]));
-    if (h >= NUM_HASH)
-        return NUM_HASH - 1;
-    return h;
+    Message(msgStat, "%8d edge hash buckets, %d used", wedge_hash_mask + 1, used);
+    Message(msgStat, "%8.2f average chain, %d longest", used ? numwedges / (double)used : 0.0, longest);
 }
 
 //============================================================================
 
 static void
-CanonicalVector(const vec3_t p1, const vec3_t p2, vec3_t vec)
+CanonicalVector(const vec3_t p1, const vec3_t p2, vec3_t vec, bool warn)
 {
     vec_t length;
 
@@ -109,19 +139,20 @@ CanonicalVector(const vec3_t p1, const vec3_t p2, vec3_t vec)
     } else
         vec[2] = 0;
 
-    Message(msgWarning, warnDegenerateEdge, length, p1[0], p1[1], p1[2]);
+    if (warn)
+        Message(msgWarning, warnDegenerateEdge, length, p1[0], p1[1], p1[2]);
 }
 
-static wedge_t *
-FindEdge(vec3_t p1, vec3_t p2, vec_t *t1, vec_t *t2)
+/*
+ * The line through p1 and p2, as a canonical direction and the point on it
+ * nearest the origin, and where p1 and p2 are along it, lowest first
+ */
+static void
+EdgeLine(const vec3_t p1, const vec3_t p2, bool warn, vec3_t origin, vec3_t edgevec, vec_t *t1, vec_t *t2)
 {
-    vec3_t origin;
-    vec3_t edgevec;
-    wedge_t *edge;
     vec_t temp;
-    int h;
 
-    CanonicalVector(p1, p2, edgevec);
+    CanonicalVector(p1, p2, edgevec, warn);
 
     *t1 = DotProduct(p1, edgevec);
     *t2 = DotProduct(p2, edgevec);
@@ -133,38 +164,102 @@ FindEdge(vec3_t p1, vec3_t p2, vec_t *t1, vec_t *t2)
         *t1 = *t2;
         *t2 = temp;
     }
+}
 
-    h = HashVec(origin);
+/*
+ * The edge on this line, or NULL. Only reads the hash, so the fixing
+ * threads can all use it at once.
+ */
+static wedge_t *
+LookupEdge(const vec3_t origin, const vec3_t edgevec)
+{
+    wedge_t *edge;
+    vec_t temp;
 
-    for (edge = wedge_hash[h]; edge; edge = edge->next) {
-        temp = edge->origin[0] - origin[0];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
-            continue;
-        temp = edge->origin[1] - origin[1];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
-            continue;
-        temp = edge->origin[2] - origin[2];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
-            continue;
+    /*
+     * Every edge within EQUAL_EPSILON is filed under one of the cells the
+     * epsilon box around this one touches, normally just the one. The
+     * newest match wins, as it did on a single chain.
+     */
+    vec_t values[6];
+    int lo[6], hi[6], cell[6];
+    wedge_t *found = NULL;
+
+    HashValues(origin, edgevec, values);
+    for (int i = 0; i < 6; i++) {
+        const vec_t epsilon = EQUAL_EPSILON * ((i < 3) ? 1.0 / TJUNC_ORIGIN_CELL : TJUNC_DIR_CELLS);
+        lo[i] = static_cast<int>(floor(values[i] - epsilon));
+        hi[i] = static_cast<int>(floor(values[i] + epsilon));
+    }
 
-        temp = edge->dir[0] - edgevec[0];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
-            continue;
-        temp = edge->dir[1] - edgevec[1];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
-            continue;
-        temp = edge->dir[2] - edgevec[2];
-        if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+    // the box is far smaller than a cell, so hi is lo or lo + 1
+    for (int corner = 0; corner < (1 << 6); corner++) {
+        int i;
+        for (i = 0; i < 6; i++) {
+            if ((corner & (1 << i)) && lo[i] == hi[i])
+                break;
+            cell[i] = lo[i] + ((corner >> i) & 1);
+        }
+        if (i < 6)
             continue;
 
-        return edge;
+        for (edge = wedge_hash[HashCell(cell)]; edge; edge = edge->next) {
+            if (edge <= found)
+                break;  // chains are newest first
+
+            temp = edge->origin[0] - origin[0];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+            temp = edge->origin[1] - origin[1];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+            temp = edge->origin[2] - origin[2];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+
+            temp = edge->dir[0] - edgevec[0];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+            temp = edge->dir[1] - edgevec[1];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+            temp = edge->dir[2] - edgevec[2];
+            if (temp < -EQUAL_EPSILON || temp > EQUAL_EPSILON)
+                continue;
+
+            found = edge;
+            break;
+        }
     }
 
+    return found;
+}
+
+static wedge_t *
+FindEdge(vec3_t p1, vec3_t p2, vec_t *t1, vec_t *t2)
+{
+    vec3_t origin;
+    vec3_t edgevec;
+    wedge_t *edge;
+    vec_t values[6];
+    int cell[6];
+
+    EdgeLine(p1, p2, true, origin, edgevec, t1, t2);
+
+    edge = LookupEdge(origin, edgevec);
+    if (edge)
+        return edge;
+
     if (numwedges >= cWEdges)
         Error("Internal error: didn't allocate enough edges for tjuncs?");
     edge = pWEdges + numwedges;
     numwedges++;
 
+    HashValues(origin, edgevec, values);
+    for (int i = 0; i < 6; i++)
+        cell[i] = static_cast<int>(floor(values[i]));
+    const unsigned h = HashCell(cell);
+
     edge->next = wedge_hash[h];
     wedge_hash[h] = edge;
 
@@ -360,6 +455,7 @@ FixFaceEdges(face_t *face, face_t *superface, face_t **facelist)
     int i, j;
     wedge_t *edge;
     wvert_t *v;
+    vec3_t origin, edgevec;
     vec_t t1, t2;
 
     *superface = *face;
@@ -368,7 +464,11 @@ FixFaceEdges(face_t *face, face_t *superface, face_t **facelist)
     for (i = 0; i < superface->w.numpoints; i++) {
         j = (i + 1) % superface->w.numpoints;
 
-        edge = FindEdge(superface->w.points[i], superface->w.points[j], &t1, &t2);
+        /* tjunc_find_r has already warned about any degenerate edges */
+        EdgeLine(superface->w.points[i], superface->w.points[j], false, origin, edgevec, &t1, &t2);
+        edge = LookupEdge(origin, edgevec);
+        if (!edge)
+            continue;   // would be a new edge, with no points to add
 
         v = edge->head.next;
         while (v->t < t1 + T_EPSILON)
@@ -434,13 +534,21 @@ tjunc_find_r(node_t *node)
 }
 
 static void
-tjunc_fix_r(node_t *node, face_t *superface)
+tjunc_nodes_r(node_t *node, std::vector<node_t *> &nodes)
 {
-    face_t *face, *next, *facelist;
-
     if (node->planenum == PLANENUM_LEAF)
         return;
 
+    nodes.push_back(node);
+    tjunc_nodes_r(node->children[0], nodes);
+    tjunc_nodes_r(node->children[1], nodes);
+}
+
+static void
+tjunc_fix(node_t *node, face_t *superface)
+{
+    face_t *face, *next, *facelist;
+
     facelist = NULL;
 
     for (face = node->faces; face; face = next) {
@@ -449,9 +557,6 @@ tjunc_fix_r(node_t *node, face_t *superface)
     }
 
     node->faces = facelist;
-
-    tjunc_fix_r(node->children[0], superface);
-    tjunc_fix_r(node->children[1], superface);
 }
 
 /*
@@ -462,9 +567,7 @@ tjunc
 void
 TJunc(const mapentity_t *entity, node_t *headnode)
 {
-    vec3_t maxs, mins;
-    face_t *superface;
-    int i, superface_bytes;
+    timingscope_t scope("TJunc", entity->outputmodelnumber);
 
     Message(msgProgress, "Tjunc");
 
@@ -481,19 +584,8 @@ TJunc(const mapentity_t *entity, node_t *headnode)
     pWVerts = (wvert_t *)AllocMem(OTHER, cWVerts * sizeof(wvert_t), true);
     pWEdges = (wedge_t *)AllocMem(OTHER, cWEdges * sizeof(wedge_t), true);
 
-    /*
-     * identify all points on common edges
-     * origin points won't allways be inside the map, so extend the hash area
-     */
-    for (i = 0; i < 3; i++) {
-        if (fabs(entity->maxs[i]) > fabs(entity->mins[i]))
-            maxs[i] = fabs(entity->maxs[i]);
-        else
-            maxs[i] = fabs(entity->mins[i]);
-    }
-    VectorSubtract(vec3_origin, maxs, mins);
-
-    InitHash(mins, maxs);
+    /* identify all points on common edges */
+    InitHash(cWEdges);
 
     numwedges = numwverts = 0;
 
@@ -501,19 +593,32 @@ TJunc(const mapentity_t *entity, node_t *headnode)
 
     Message(msgStat, "%8d world edges", numwedges);
     Message(msgStat, "%8d edge points", numwverts);
+    if (options.fAllverbose)
+        PrintHashStats();
 
-    superface_bytes = offsetof(face_t, w.points[MAX_SUPERFACE_POINTS]);
-    superface = (face_t*)AllocMem(OTHER, superface_bytes, true);
+    /*
+     * add extra vertexes on edges where needed; the edges are only read
+     * from here on, and each node's faces are fixed on their own, so the
+     * nodes are done in parallel
+     */
+    std::vector<node_t *> nodes;
+    tjunc_nodes_r(headnode, nodes);
 
-    /* add extra vertexes on edges where needed */
     tjuncs = tjuncfaces = 0;
-    tjunc_fix_r(headnode, superface);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()), [&](const tbb::blocked_range<size_t> &range) {
+        const int superface_bytes = offsetof(face_t, w.points[MAX_SUPERFACE_POINTS]);
+        face_t *superface = (face_t *)AllocMem(OTHER, superface_bytes, true);
+
+        for (size_t i = range.begin(); i != range.end(); i++)
+            tjunc_fix(nodes[i], superface);
 
-    free(superface);
+        FreeMem(superface);
+    });
 
-    free(pWVerts);
-    free(pWEdges);
+    FreeMem(pWVerts);
+    FreeMem(pWEdges);
+    FreeMem(wedge_hash);
 
-    Message(msgStat, "%8d edges added by tjunctions", tjuncs);
-    Message(msgStat, "%8d faces added by tjunctions", tjuncfaces);
+    Message(msgStat, "%8d edges added by tjunctions", tjuncs.load());
+    Message(msgStat, "%8d faces added by tjunctions", tjuncfaces.load());
 }
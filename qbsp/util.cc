@@ -26,9 +26,30 @@
 
 #include <common/threads.hh>
 #include <common/log.hh>
+#include <common/memstats.hh>
 
 #include <qbsp/qbsp.hh>
 
+#include "tbb/scalable_allocator.h"
+
+/*
+ * AllocMem's bytes, for Mem_Report. Each thread adds up its own until it
+ * has a megabyte to report, so the counter isn't touched per allocation;
+ * the peak is exact to within a megabyte a thread.
+ */
+static memcounter_t allocmem("AllocMem");
+static thread_local int64_t allocmem_pending;
+
+static void
+CountAllocMem(int64_t bytes)
+{
+    allocmem_pending += bytes;
+    if (allocmem_pending >= (1 << 20) || allocmem_pending <= -(1 << 20)) {
+        allocmem.add(allocmem_pending);
+        allocmem_pending = 0;
+    }
+}
+
 /*
 ==========
 AllocMem
@@ -58,21 +79,54 @@ AllocMem(int Type, int cElements, bool fZero)
     } else {
         cSize = cElements;
     }
-    pTemp = malloc(cSize);
+    pTemp = scalable_malloc(cSize);
     if (!pTemp)
         Error("allocation of %d bytes failed (%s)", cSize, __func__);
 
     if (fZero)
         memset(pTemp, 0, cSize);
 
+    CountAllocMem(scalable_msize(pTemp));
+
     return pTemp;
 }
 
+/*
+==========
+FreeMem
+
+Frees memory from AllocMem. The tbb allocator keeps per-thread pools of
+each size, so the face, winding and node churn doesn't contend on a lock.
+==========
+*/
+void
+FreeMem(void *pMem)
+{
+    if (pMem)
+        CountAllocMem(-static_cast<int64_t>(scalable_msize(pMem)));
+    scalable_free(pMem);
+}
+
 /* Keep track of output state */
 static bool fInPercent = false;
 
 std::mutex messageLock;
 
+thread_local bool fQuietThread = false;
+
+/* -1 to follow options.fVerbose */
+static thread_local int verboseThread = -1;
+
+verbosescope_t::verbosescope_t(bool verbose) : previous(verboseThread)
+{
+    verboseThread = verbose;
+}
+
+verbosescope_t::~verbosescope_t()
+{
+    verboseThread = previous;
+}
+
 /*
 =================
 Message
@@ -94,15 +148,18 @@ Message(int msgType, ...)
     va_start(argptr, msgType);
 
     // Exit if necessary
-    if ((msgType == msgStat || msgType == msgProgress)
-        && (!options.fVerbose || options.fNoverbose))
+    if (fQuietThread
+        && (msgType == msgStat || msgType == msgProgress || msgType == msgPercent))
+        return;
+    else if ((msgType == msgStat || msgType == msgProgress)
+        && (!(verboseThread < 0 ? options.fVerbose : verboseThread) || options.fNoverbose))
         return;
     else if (msgType == msgPercent
              && (options.fNopercent || options.fNoverbose))
         return;
 
     if (fInPercent && msgType != msgPercent) {
-        printf("\r");
+        logprint_screen("\r");
         fInPercent = false;
     }
 
@@ -171,8 +228,7 @@ Message(int msgType, ...)
 
     switch (msgType) {
     case msgScreen:
-        fprintf(stdout, "%s", szBuffer);
-        fflush(stdout);
+        logprint_screen("%s", szBuffer);
         break;
     case msgFile:
         logprint_silent("%s", szBuffer);
@@ -21,6 +21,7 @@
 
 #include <string.h>
 #include <string>
+#include <vector>
 
 #include <qbsp/qbsp.hh>
 #include <qbsp/wad.hh>
@@ -39,10 +40,9 @@ static bool
 WAD_LoadInfo(wad_t &wad, bool external)
 {
     wadinfo_t *hdr = &wad.header;
-    int i, len;
-    dmiptex_t miptex;
+    int len;
 
-    external |= options.fNoTextures;
+    wad.external = external | options.fNoTextures;
 
     len = fread(hdr, 1, sizeof(wadinfo_t), wad.file);
     if (len != sizeof(wadinfo_t))
@@ -53,22 +53,51 @@ WAD_LoadInfo(wad_t &wad, bool external)
         wad.version = 2;
     else if (!strncmp(hdr->identification, "WAD3", 4))
         wad.version = 3;
-    if (!wad.version)
+    if (!wad.version || hdr->numlumps < 0)
         return false;
 
+    /* Just the directory, the lumps are looked at once they're used */
+    std::vector<lumpinfo_t> directory(hdr->numlumps);
     fseek(wad.file, hdr->infotableofs, SEEK_SET);
-    wad.lumps.reserve(wad.header.numlumps);
+    len = fread(directory.data(), sizeof(lumpinfo_t), directory.size(), wad.file);
+    if (len != hdr->numlumps)
+        return false;
 
-    /* Get the dimensions and make a texture_t */
-    for (i = 0; i < wad.header.numlumps; i++) {
-        lumpinfo_t lump;
+    wad.lumps.reserve(hdr->numlumps);
+    for (const lumpinfo_t &lump : directory)
+        wad.lumps.insert({ lump.name, lump });
 
-        len = fread(&lump, 1, sizeof(lump), wad.file);
-        if (len != sizeof(lump))
-            return false;
+    return true;
+}
 
-        auto restore_pos = ftell(wad.file);
+/*
+==================
+WAD_LoadTextureInfo
 
+Reads the miptex header of every lump, for the texture sizes and the space
+each one takes in the bsp. Only done once one of the wad's lumps is used,
+so wads listed but never used aren't read past their directory.
+==================
+*/
+static void
+WAD_LoadTextureInfo(wad_t &wad)
+{
+    dmiptex_t miptex;
+    int len;
+
+    if (wad.texturesloaded)
+        return;
+    wad.texturesloaded = true;
+
+    std::vector<lumpinfo_t> directory(wad.header.numlumps);
+    fseek(wad.file, wad.header.infotableofs, SEEK_SET);
+    len = fread(directory.data(), sizeof(lumpinfo_t), directory.size(), wad.file);
+    if (len != wad.header.numlumps)
+        Error("Failure reading from file");
+
+    /* Get the dimensions and make a texture_t */
+    wad.lumps.clear();
+    for (lumpinfo_t &lump : directory) {
         fseek(wad.file, lump.filepos, SEEK_SET);
         len = fread(&miptex, 1, sizeof(miptex), wad.file);
 
@@ -89,7 +118,7 @@ WAD_LoadInfo(wad_t &wad, bool external)
             wad.textures.insert({ tex.name, tex });
 
             //if we're not going to embed it into the bsp, set its size now so we know how much to actually store.
-            if (external)
+            if (wad.external)
                 lump.size = lump.disksize = sizeof(dmiptex_t);
 
             //printf("Created texture_t %s %d %d\n", tex->name, tex->width, tex->height);
@@ -97,12 +126,8 @@ WAD_LoadInfo(wad_t &wad, bool external)
         else
             lump.size = 0;
 
-        fseek(wad.file, restore_pos, SEEK_SET);
-
         wad.lumps.insert({ lump.name, lump });
     }
-
-    return true;
 }
 
 static void WADList_OpenWad(const char *fpath, bool external)
@@ -110,6 +135,7 @@ static void WADList_OpenWad(const char *fpath, bool external)
     wad_t wad;
     
     wad.file = fopen(fpath, "rb");
+    wad.path = fpath;
 
     if (wad.file) {
         if (options.fVerbose)
@@ -163,13 +189,12 @@ static const lumpinfo_t *
 WADList_FindTexture(const char *name)
 {
     for (auto &wad : wadlist) {
-        auto it = wad.lumps.find(name);
-
-        if (it == wad.lumps.end()) {
+        if (!wad.lumps.count(name)) {
             continue;
         }
 
-        return &it->second;
+        WAD_LoadTextureInfo(wad);
+        return &wad.lumps.find(name)->second;
     }
 
     return NULL;
@@ -192,17 +217,18 @@ static void WAD_SanitizeName(dmiptex_t* miptex)
 }
 
 static int
-WAD_LoadLump(const wad_t &wad, const char *name, uint8_t *dest)
+WAD_LoadLump(wad_t &wad, const char *name, uint8_t *dest)
 {
     int i;
     int size;
 
-    auto it = wad.lumps.find(name);
-
-    if (it == wad.lumps.end()) {
+    if (!wad.lumps.count(name)) {
         return 0;
     }
 
+    WAD_LoadTextureInfo(wad);
+    auto it = wad.lumps.find(name);
+
     auto &lump = it->second;
 
     fseek(wad.file, lump.filepos, SEEK_SET);
@@ -356,6 +382,7 @@ WADList_Process()
 const texture_t *WADList_GetTexture(const char *name)
 {
     for (auto &wad : wadlist) {
+        WAD_LoadTextureInfo(wad);
         auto it = wad.textures.find(name);
 
         if (it == wad.textures.end()) {
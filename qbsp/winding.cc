@@ -171,6 +171,96 @@ CalcSides(const winding_t *in, const qbsp_plane_t *split, int *sides, vec_t *dis
     dists[i] = dists[0];
 }
 
+/*
+==================
+SplitWindingPoints
+
+Distributes the points of in, classified by CalcSides, to front and back
+(back may be NULL), generating the split points. Both have room for
+maxpts points.
+==================
+*/
+static void
+SplitWindingPoints(const winding_t *in, const qbsp_plane_t *split, const int *sides,
+                   const vec_t *dists, winding_t *front, winding_t *back, int maxpts)
+{
+    int i, j;
+    const vec_t *p1, *p2;
+    vec3_t mid;
+    vec_t fraction;
+
+    front->numpoints = 0;
+    if (back)
+        back->numpoints = 0;
+
+    for (i = 0; i < in->numpoints; i++) {
+        p1 = in->points[i];
+
+        if (sides[i] == SIDE_ON) {
+            if (front->numpoints == maxpts)
+                goto noclip_front;
+            VectorCopy(p1, front->points[front->numpoints]);
+            front->numpoints++;
+            if (back) {
+                if (back->numpoints == maxpts)
+                    goto noclip_back;
+                VectorCopy(p1, back->points[back->numpoints]);
+                back->numpoints++;
+            }
+            continue;
+        }
+
+        if (sides[i] == SIDE_FRONT) {
+            if (front->numpoints == maxpts)
+                goto noclip_front;
+            VectorCopy(p1, front->points[front->numpoints]);
+            front->numpoints++;
+        }
+        if (sides[i] == SIDE_BACK && back) {
+            if (back->numpoints == maxpts)
+                goto noclip_back;
+            VectorCopy(p1, back->points[back->numpoints]);
+            back->numpoints++;
+        }
+
+        if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
+            continue;
+
+        /* generate a split point */
+        p2 = in->points[(i + 1) % in->numpoints];
+
+        fraction = dists[i] / (dists[i] - dists[i + 1]);
+        for (j = 0; j < 3; j++) {
+            /* avoid round off error when possible */
+            if (split->normal[j] == 1)
+                mid[j] = split->dist;
+            else if (split->normal[j] == -1)
+                mid[j] = -split->dist;
+            else
+                mid[j] = p1[j] + fraction * (p2[j] - p1[j]);
+        }
+
+        if (front->numpoints == maxpts)
+            goto noclip_front;
+        VectorCopy(mid, front->points[front->numpoints]);
+        front->numpoints++;
+        if (back) {
+            if (back->numpoints == maxpts)
+                goto noclip_back;
+            VectorCopy(mid, back->points[back->numpoints]);
+            back->numpoints++;
+        }
+    }
+    return;
+
+ noclip_front:
+    Error("Internal error: front->numpoints > MAX (%s: %d > %d)",
+          __func__, front->numpoints, maxpts);
+ noclip_back:
+    Error("Internal error: back->numpoints > MAX (%s: %d > %d)",
+          __func__, back->numpoints, maxpts);
+}
+
 /*
 ==================
 ClipWinding
@@ -187,10 +277,6 @@ ClipWinding(winding_t *in, const qbsp_plane_t *split, bool keepon)
     vec_t dists[MAX_POINTS_ON_WINDING + 1];
     int sides[MAX_POINTS_ON_WINDING + 1];
     int counts[3];
-    vec_t fraction;
-    int i, j;
-    vec_t *p1, *p2;
-    vec3_t mid;
     winding_t *neww;
     int maxpts;
 
@@ -204,7 +290,7 @@ ClipWinding(winding_t *in, const qbsp_plane_t *split, bool keepon)
         return in;
 
     if (!counts[SIDE_FRONT]) {
-        free(in);
+        FreeMem(in);
         return NULL;
     }
 
@@ -215,52 +301,43 @@ ClipWinding(winding_t *in, const qbsp_plane_t *split, bool keepon)
     maxpts = in->numpoints + 4;
     neww = (winding_t *)AllocMem(WINDING, maxpts, true);
 
-    for (i = 0; i < in->numpoints; i++) {
-        p1 = in->points[i];
+    SplitWindingPoints(in, split, sides, dists, neww, NULL, maxpts);
+    FreeMem(in);
 
-        if (sides[i] == SIDE_ON) {
-            if (neww->numpoints == maxpts)
-                goto noclip;
-            VectorCopy(p1, neww->points[neww->numpoints]);
-            neww->numpoints++;
-            continue;
-        }
+    return neww;
+}
 
-        if (sides[i] == SIDE_FRONT) {
-            if (neww->numpoints == maxpts)
-                goto noclip;
-            VectorCopy(p1, neww->points[neww->numpoints]);
-            neww->numpoints++;
-        }
+/*
+==================
+ClipWindingInto
 
-        if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
-            continue;
+ClipWinding for temporaries: the result goes in out, which holds up to
+MAXEDGES points, and in is left alone. Returns false if nothing is left.
+==================
+*/
+bool
+ClipWindingInto(const winding_t *in, const qbsp_plane_t *split, bool keepon, winding_t *out)
+{
+    vec_t dists[MAXEDGES + 1];
+    int sides[MAXEDGES + 1];
+    int counts[3];
 
-        /* generate a split point */
-        p2 = in->points[(i + 1) % in->numpoints];
-        fraction = dists[i] / (dists[i] - dists[i + 1]);
-        for (j = 0; j < 3; j++) {
-            /* avoid round off error when possible */
-            if (split->normal[j] == 1)
-                mid[j] = split->dist;
-            else if (split->normal[j] == -1)
-                mid[j] = -split->dist;
-            else
-                mid[j] = p1[j] + fraction * (p2[j] - p1[j]);
-        }
+    if (in->numpoints > MAXEDGES)
+        Error("Internal error: in->numpoints > MAX (%s: %d > %d)",
+              __func__, in->numpoints, MAXEDGES);
+
+    CalcSides(in, split, sides, dists, counts);
 
-        if (neww->numpoints == maxpts)
-            goto noclip;
-        VectorCopy(mid, neww->points[neww->numpoints]);
-        neww->numpoints++;
+    if ((keepon && !counts[SIDE_FRONT] && !counts[SIDE_BACK]) || (counts[SIDE_FRONT] && !counts[SIDE_BACK])) {
+        CopyWindingInto(out, in);
+        return true;
     }
-    free(in);
 
-    return neww;
+    if (!counts[SIDE_FRONT])
+        return false;
 
- noclip:
-    Error("Internal error: new->numpoints > MAX (%s: %d > %d)",
-          __func__, neww->numpoints, maxpts);
+    SplitWindingPoints(in, split, sides, dists, out, NULL, MAXEDGES);
+    return true;
 }
 
 
@@ -281,11 +358,6 @@ DivideWinding(const winding_t *in, const qbsp_plane_t *split, winding_t **front,
     vec_t dists[MAX_POINTS_ON_WINDING + 1];
     int sides[MAX_POINTS_ON_WINDING + 1];
     int counts[3];
-    vec_t fraction;
-    int i, j;
-    const vec_t *p1, *p2;
-    vec3_t mid;
-    winding_t *f, *b;
     int maxpts;
 
     if (in->numpoints > MAX_POINTS_ON_WINDING)
@@ -307,71 +379,46 @@ DivideWinding(const winding_t *in, const qbsp_plane_t *split, winding_t **front,
 
     /*  can't use maxpoints = counts[0] + 2 because of fp grouping errors */
     maxpts = in->numpoints + 4;
-    *front = f = (winding_t *)AllocMem(WINDING, maxpts, true);
-    *back = b = (winding_t *)AllocMem(WINDING, maxpts, true);
+    *front = (winding_t *)AllocMem(WINDING, maxpts, true);
+    *back = (winding_t *)AllocMem(WINDING, maxpts, true);
 
-    for (i = 0; i < in->numpoints; i++) {
-        p1 = in->points[i];
+    SplitWindingPoints(in, split, sides, dists, *front, *back, maxpts);
+}
 
-        if (sides[i] == SIDE_ON) {
-            if (f->numpoints == maxpts)
-                goto noclip_front;
-            VectorCopy(p1, f->points[f->numpoints]);
-            f->numpoints++;
-            if (b->numpoints == maxpts)
-                goto noclip_back;
-            VectorCopy(p1, b->points[b->numpoints]);
-            b->numpoints++;
-            continue;
-        }
+/*
+==================
+DivideWindingInto
 
-        if (sides[i] == SIDE_FRONT) {
-            if (f->numpoints == maxpts)
-                goto noclip_front;
-            VectorCopy(p1, f->points[f->numpoints]);
-            f->numpoints++;
-        }
-        if (sides[i] == SIDE_BACK) {
-            if (b->numpoints == maxpts)
-                goto noclip_back;
-            VectorCopy(p1, b->points[b->numpoints]);
-            b->numpoints++;
-        }
+DivideWinding for temporaries: front and back each hold up to MAXEDGES
+points, and a side with nothing on it gets numpoints 0.
+==================
+*/
+void
+DivideWindingInto(const winding_t *in, const qbsp_plane_t *split, winding_t *front,
+                  winding_t *back)
+{
+    vec_t dists[MAXEDGES + 1];
+    int sides[MAXEDGES + 1];
+    int counts[3];
 
-        if (sides[i + 1] == SIDE_ON || sides[i + 1] == sides[i])
-            continue;
+    if (in->numpoints > MAXEDGES)
+        Error("Internal error: in->numpoints > MAX (%s: %d > %d)",
+              __func__, in->numpoints, MAXEDGES);
 
-        /* generate a split point */
-        p2 = in->points[(i + 1) % in->numpoints];
+    CalcSides(in, split, sides, dists, counts);
 
-        fraction = dists[i] / (dists[i] - dists[i + 1]);
-        for (j = 0; j < 3; j++) {
-            /* avoid round off error when possible */
-            if (split->normal[j] == 1)
-                mid[j] = split->dist;
-            else if (split->normal[j] == -1)
-                mid[j] = -split->dist;
-            else
-                mid[j] = p1[j] + fraction * (p2[j] - p1[j]);
-        }
+    front->numpoints = back->numpoints = 0;
 
-        if (f->numpoints == maxpts)
-            goto noclip_front;
-        VectorCopy(mid, f->points[f->numpoints]);
-        f->numpoints++;
-        if (b->numpoints == maxpts)
-            goto noclip_back;
-        VectorCopy(mid, b->points[b->numpoints]);
-        b->numpoints++;
+    if (!counts[0]) {
+        CopyWindingInto(back, in);
+        return;
+    }
+    if (!counts[1]) {
+        CopyWindingInto(front, in);
+        return;
     }
-    return;
 
- noclip_front:
-    Error("Internal error: front->numpoints > MAX (%s: %d > %d)",
-          __func__, f->numpoints, maxpts);
- noclip_back:
-    Error("Internal error: back->numpoints > MAX (%s: %d > %d)",
-          __func__, b->numpoints, maxpts);
+    SplitWindingPoints(in, split, sides, dists, front, back, MAXEDGES);
 }
 
 
@@ -459,7 +506,7 @@ void ChopWindingInPlace (winding_t **inout, const vec3_t normal, vec_t dist, vec
     
     if (!counts[0])
     {
-        free(in);
+        FreeMem(in);
         *inout = nullptr;
         return;
     }
@@ -514,7 +561,7 @@ void ChopWindingInPlace (winding_t **inout, const vec3_t normal, vec_t dist, vec
     if (f->numpoints > MAX_POINTS_ON_WINDING)
         Error ("ClipWinding: MAX_POINTS_ON_WINDING");
     
-    free(in);
+    FreeMem(in);
     
     *inout = f;
 }
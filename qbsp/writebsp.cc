@@ -124,9 +124,7 @@ ExportClipNodes(mapentity_t *entity, node_t *node)
 
     // FIXME: free more stuff?
     if (node->planenum == PLANENUM_LEAF) {
-        int contents = node->contents.native;
-        free(node);
-        return contents;
+        return node->contents.native;
     }
 
     /* emit a clipnode */
@@ -145,13 +143,65 @@ ExportClipNodes(mapentity_t *entity, node_t *node)
     for (face = node->faces; face; face = next) {
         next = face->next;
         memset(face, 0, sizeof(face_t));
-        free(face);
+        FreeMem(face);
     }
-    free(node);
 
     return nodenum;
 }
 
+/*
+==================
+ExportMergedClipNodes
+
+ExportClipNodes for -mergeclipnodes. The children are written first, so a
+node whose plane and children match a clipnode already written, by any
+hull of any model, can use that one instead, and repeated subtrees are
+only stored once. Below the headnode, a node with the same child on both
+sides doesn't need its plane and becomes the child.
+==================
+*/
+static int
+ExportMergedClipNodes(node_t *node, bool headnode, int *merged)
+{
+    face_t *face, *next;
+
+    if (node->planenum == PLANENUM_LEAF) {
+        return node->contents.native;
+    }
+
+    bsp2_dclipnode_t clipnode;
+    clipnode.planenum = ExportMapPlane(node->planenum);
+    clipnode.children[0] = ExportMergedClipNodes(node->children[0], false, merged);
+    clipnode.children[1] = ExportMergedClipNodes(node->children[1], false, merged);
+
+    for (face = node->faces; face; face = next) {
+        next = face->next;
+        memset(face, 0, sizeof(face_t));
+        FreeMem(face);
+    }
+
+    if (!headnode && clipnode.children[0] == clipnode.children[1]) {
+        (*merged)++;
+        return clipnode.children[0];
+    }
+
+    uint64_t hash = FNV_HASH_INIT;
+    FNV_HashBytes(&hash, &clipnode, sizeof(clipnode));
+
+    std::vector<int> &matches = map.clipnodehash[hash];
+    for (const int nodenum : matches) {
+        if (!memcmp(&map.exported_clipnodes[nodenum], &clipnode, sizeof(clipnode))) {
+            (*merged)++;
+            return nodenum;
+        }
+    }
+
+    const int nodenum = static_cast<int>(map.exported_clipnodes.size());
+    map.exported_clipnodes.push_back(clipnode);
+    matches.push_back(nodenum);
+    return nodenum;
+}
+
 /*
 ==================
 ExportClipNodes
@@ -167,9 +217,17 @@ accomodate new data interleaved with old.
 void
 ExportClipNodes(mapentity_t *entity, node_t *nodes, const int hullnum)
 {
+    timingscope_t scope("ExportClipNodes", entity->outputmodelnumber);
     auto *model = &map.exported_models.at(static_cast<size_t>(entity->outputmodelnumber));
 
-    model->headnode[hullnum] = ExportClipNodes(entity, nodes);
+    if (options.fMergeClipnodes) {
+        int merged = 0;
+        model->headnode[hullnum] = ExportMergedClipNodes(nodes, true, &merged);
+        Message(msgStat, "%8d clipnodes merged", merged);
+    } else {
+        model->headnode[hullnum] = ExportClipNodes(entity, nodes);
+    }
+    FreeTree(nodes);
 }
 
 //===========================================================================
@@ -292,6 +350,8 @@ ExportDrawNodes(mapentity_t *entity, node_t *headnode, int firstface)
     int i;
     dmodelh2_t *dmodel;
 
+    timingscope_t scope("ExportDrawNodes", entity->outputmodelnumber);
+
     // populate model struct (which was emitted previously)
     dmodel = &map.exported_models.at(static_cast<size_t>(entity->outputmodelnumber));
     dmodel->headnode[0] = static_cast<int>(map.exported_nodes.size());
@@ -357,7 +417,7 @@ WriteExtendedTexinfoFlags(void)
         return;
     
     // sort by output texinfo number
-    std::vector<mtexinfo_t> texinfos_sorted(map.mtexinfos);
+    std::vector<mtexinfo_t> texinfos_sorted(map.mtexinfos.begin(), map.mtexinfos.end());
     std::sort(texinfos_sorted.begin(), texinfos_sorted.end(), [](const mtexinfo_t &a, const mtexinfo_t &b) {
         return a.outputnum < b.outputnum;
     });
@@ -446,8 +506,10 @@ WriteBSPFile()
     if (map.needslmshifts) {
         BSPX_AddLump(&bspdata, "LMSHIFT", map.exported_lmshifts.data(), map.exported_lmshifts.size());
     }
-    if (!map.exported_bspxbrushes.empty()) {
-        BSPX_AddLump(&bspdata, "BRUSHLIST", map.exported_bspxbrushes.data(), map.exported_bspxbrushes.size());
+    if (map.exported_bspxbrushes) {
+        BSPX_AddLumpOwned(&bspdata, "BRUSHLIST", map.exported_bspxbrushes, map.exported_bspxbrushessize);
+        map.exported_bspxbrushes = nullptr;
+        map.exported_bspxbrushessize = 0;
     }
 
     // FIXME: temp
@@ -0,0 +1,221 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Micro-benchmarks for vis's inner loops, and the polylib clipping the
+ * other tools share. See include/common/microbench.hh for the options.
+ */
+
+#include <common/polylib.hh>
+#undef ON_EPSILON               // vis.hh has its own
+#include <vis/vis.hh>
+#include <common/microbench.hh>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+/* a regular polygon of radius r around (x, 0, 0), facing +x */
+static winding_t *
+BenchPortalWinding(vec_t x, vec_t r, int numpoints)
+{
+    winding_t *w = NewWinding(numpoints);
+    w->numpoints = numpoints;
+    for (int i = 0; i < numpoints; i++) {
+        const double angle = 2 * Q_PI * i / numpoints;
+        w->points[i][0] = x;
+        w->points[i][1] = r * cos(angle);
+        w->points[i][2] = r * sin(angle);
+    }
+    SetWindingSphere(w);
+    return w;
+}
+
+static void
+BenchInitStack(pstack_t *stack, stacklevel_t *level)
+{
+    memset(stack, 0, sizeof(*stack));
+    stack->windings = level->windings;
+    for (int i = 0; i < STACK_WINDINGS; i++)
+        stack->freewindings[i] = 1;
+}
+
+MICROBENCH(polylib_ClipWinding)
+{
+    polylib::winding_t *w = polylib::AllocWinding(16);
+    w->numpoints = 16;
+    for (int i = 0; i < 16; i++) {
+        const double angle = 2 * Q_PI * i / 16;
+        VectorSet(w->p[i], 64 * cos(angle), 64 * sin(angle), 0);
+    }
+    vec3_t normal = { 0.6, 0.8, 0 };
+    const vec_t dist = 10;
+
+    while (state.keepRunning()) {
+        polylib::winding_t *front, *back;
+        polylib::ClipWinding(w, normal, dist, &front, &back);
+        Microbench_DoNotOptimize(front);
+        free(front);
+        free(back);
+    }
+    state.setItemsProcessed(w->numpoints);
+    free(w);
+}
+
+MICROBENCH(ClipStackWinding)
+{
+    winding_t *w = BenchPortalWinding(0, 64, 8);
+    plane_t split;
+    VectorSet(split.normal, 0, 0.6, 0.8);
+    split.dist = 10;
+
+    stacklevel_t level;
+    pstack_t stack;
+    BenchInitStack(&stack, &level);
+
+    while (state.keepRunning()) {
+        winding_t *clipped = ClipStackWinding(w, &stack, &split);
+        Microbench_DoNotOptimize(clipped);
+        if (clipped)
+            FreeStackWinding(clipped, &stack);
+    }
+    state.setItemsProcessed(w->numpoints);
+    free(w);
+}
+
+/*
+ * Source, pass and target portals one behind the other, the pass portal
+ * smaller, so the seperating planes clip the target down without
+ * removing it.
+ */
+MICROBENCH(ClipToSeperators)
+{
+    winding_t *source = BenchPortalWinding(0, 32, 8);
+    winding_t *pass = BenchPortalWinding(64, 16, 8);
+    winding_t *target = BenchPortalWinding(128, 64, 8);
+    plane_t src_pl;
+    PlaneFromWinding(source, &src_pl);
+
+    stacklevel_t level;
+    pstack_t stack;
+    BenchInitStack(&stack, &level);
+
+    while (state.keepRunning()) {
+        stack.numseparators[0] = stack.numseparators[1] = 0;
+        winding_t *clipped = ClipToSeperators(source, src_pl, pass, target, 0, &stack);
+        Microbench_DoNotOptimize(clipped);
+        if (clipped)
+            FreeStackWinding(clipped, &stack);
+    }
+
+    free(source);
+    free(pass);
+    free(target);
+}
+
+/* a row for 8192 leafs, a fifth of the bytes non-zero, like a big map's pvs */
+static std::vector<uint8_t>
+BenchVisRow()
+{
+    std::mt19937 rng(1234);
+    std::vector<uint8_t> row(8192 / 8);
+    for (uint8_t &b : row)
+        b = (rng() % 5 == 0) ? static_cast<uint8_t>(rng() | 1) : 0;
+    return row;
+}
+
+MICROBENCH(CompressRow)
+{
+    const std::vector<uint8_t> row = BenchVisRow();
+    std::vector<uint8_t> out(row.size() * 2);
+    const int numbytes = static_cast<int>(row.size());
+
+    while (state.keepRunning())
+        Microbench_DoNotOptimize(CompressRow(row.data(), numbytes, out.data()));
+    state.setItemsProcessed(numbytes);
+}
+
+MICROBENCH(DecompressRow)
+{
+    const std::vector<uint8_t> row = BenchVisRow();
+    std::vector<uint8_t> compressed(row.size() * 2);
+    std::vector<uint8_t> out(row.size());
+    const int numbytes = static_cast<int>(row.size());
+    CompressRow(row.data(), numbytes, compressed.data());
+
+    while (state.keepRunning()) {
+        DecompressRow(compressed.data(), numbytes, out.data());
+        Microbench_DoNotOptimize(out[0]);
+    }
+    state.setItemsProcessed(numbytes);
+}
+
+/* leafbits for 8192 leafs, half the bits set */
+static std::vector<leafblock_t>
+BenchLeafBits(unsigned int seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<leafblock_t> bits(LeafbitsBlocks(8192));
+    for (leafblock_t &block : bits)
+        block = static_cast<leafblock_t>(rng());
+    return bits;
+}
+
+MICROBENCH(IntersectLeafBits)
+{
+    const std::vector<leafblock_t> a = BenchLeafBits(1), b = BenchLeafBits(2), seen = BenchLeafBits(3);
+    std::vector<leafblock_t> dst(a.size());
+    const int numblocks = static_cast<int>(a.size());
+
+    while (state.keepRunning())
+        Microbench_DoNotOptimize(IntersectLeafBits(dst.data(), a.data(), b.data(), seen.data(), numblocks));
+    state.setItemsProcessed(numblocks * sizeof(leafblock_t));
+}
+
+MICROBENCH(MergeLeafBits)
+{
+    const std::vector<leafblock_t> src = BenchLeafBits(1);
+    std::vector<leafblock_t> dst = BenchLeafBits(2);
+    const int numblocks = static_cast<int>(src.size());
+
+    while (state.keepRunning()) {
+        MergeLeafBits(dst.data(), src.data(), numblocks);
+        Microbench_DoNotOptimize(dst[0]);
+    }
+    state.setItemsProcessed(numblocks * sizeof(leafblock_t));
+}
+
+/* the worst case, a subset, so every block is tested */
+MICROBENCH(LeafBitsOutside)
+{
+    const std::vector<leafblock_t> b = BenchLeafBits(1);
+    std::vector<leafblock_t> a = b;
+    for (leafblock_t &block : a)
+        block &= block >> 1;
+    const int numblocks = static_cast<int>(a.size());
+
+    while (state.keepRunning())
+        Microbench_DoNotOptimize(LeafBitsOutside(a.data(), b.data(), numblocks));
+    state.setItemsProcessed(numblocks * sizeof(leafblock_t));
+}
+
+int main(int argc, const char **argv)
+{
+    return Microbench_Main(argc, argv);
+}
@@ -0,0 +1,332 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Distributed vis (-coordinator / -worker)
+ *
+ * The coordinator writes the base vis to the state file, then splits the
+ * unfinished portals into job files next to the bsp:
+ *
+ *   map.vjobs       number of jobs, present while the coordinator runs
+ *   map.vjob<n>     portal numbers of job n, waiting to be claimed
+ *   map.vjob<n>.run the same job once claimed (claiming is a rename)
+ *   map.vres<n>     vis bits for job n's portals, written by whoever ran it
+ *
+ * Workers on other machines share the directory, load the state file, and
+ * claim jobs until none are left. The coordinator claims jobs too, merges
+ * results as they appear, and reruns jobs whose worker seems to have died.
+ * Results are merged through PortalCompleted just like local portals, and
+ * the state file is checkpointed as usual, so an interrupted coordinator
+ * resumes from what was merged.
+ */
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vis/vis.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+#include <common/threads.hh>
+
+static std::string
+JobBaseName(void)
+{
+    char base[1024];
+
+    strcpy(base, sourcefile);
+    StripExtension(base);
+    return base;
+}
+
+static std::string
+ManifestName(void)
+{
+    return JobBaseName() + ".vjobs";
+}
+
+static std::string
+JobName(int jobnum)
+{
+    return JobBaseName() + ".vjob" + std::to_string(jobnum);
+}
+
+static std::string
+ClaimedJobName(int jobnum)
+{
+    return JobName(jobnum) + ".run";
+}
+
+static std::string
+ResultName(int jobnum)
+{
+    return JobBaseName() + ".vres" + std::to_string(jobnum);
+}
+
+static void
+WriteTextFile(const std::string &filename, const std::vector<int> &values)
+{
+    const std::string tmpfile = filename + ".tmp";
+    FILE *f = SafeOpenWrite(tmpfile.c_str());
+    for (const int value : values)
+        fprintf(f, "%d\n", value);
+    if (fclose(f))
+        Error("%s: error writing %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+    if (rename(tmpfile.c_str(), filename.c_str()))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile.c_str(), strerror(errno));
+}
+
+static qboolean
+ReadTextFile(const std::string &filename, std::vector<int> *values)
+{
+    FILE *f = fopen(filename.c_str(), "r");
+    int value;
+
+    if (!f)
+        return false;
+
+    values->clear();
+    while (fscanf(f, "%d", &value) == 1)
+        values->push_back(value);
+    fclose(f);
+
+    return true;
+}
+
+/*
+ * Claims a job by renaming it; only one process can win the rename.
+ */
+static qboolean
+ClaimJob(int jobnum, std::vector<int> *portalnums)
+{
+    const std::string claimed = ClaimedJobName(jobnum);
+
+    if (rename(JobName(jobnum).c_str(), claimed.c_str()))
+        return false;
+
+    /* a rename keeps the job file's mtime; append a blank line so the
+       claim's mtime says when it was claimed */
+    FILE *f = fopen(claimed.c_str(), "a");
+    if (f) {
+        fputc('\n', f);
+        fclose(f);
+    }
+
+    if (!ReadTextFile(claimed, portalnums))
+        Error("%s: can't read claimed job %s", __func__, claimed.c_str());
+
+    for (const int portalnum : *portalnums) {
+        if (portalnum < 0 || portalnum >= numportals * 2)
+            Error("%s: %s has invalid portal %d", __func__, claimed.c_str(), portalnum);
+    }
+    return true;
+}
+
+static void
+RemoveJobFiles(int numjobs)
+{
+    for (int i = 0; i < numjobs; i++) {
+        remove(JobName(i).c_str());
+        remove(ClaimedJobName(i).c_str());
+        remove(ResultName(i).c_str());
+    }
+    remove(ManifestName().c_str());
+}
+
+/*
+ * Runs the usual LeafThread loop, restricted to the job's unfinished portals.
+ */
+static void
+FlowJob(const std::vector<int> &portalnums)
+{
+    int count = 0;
+
+    for (const int portalnum : portalnums) {
+        if (portals[portalnum].status == pstat_none)
+            count++;
+    }
+    if (!count)
+        return;
+
+    QueuePortals(portalnums);
+    RunThreadsOn(0, count, LeafThread, NULL);
+}
+
+/* false if the results can't be read */
+static bool
+MergeResults(int jobnum)
+{
+    std::vector<int> loaded;
+
+    if (!LoadPortalResults(ResultName(jobnum).c_str(), &loaded))
+        return false;
+
+    for (const int portalnum : loaded)
+        PortalCompleted(&portals[portalnum]);
+    return true;
+}
+
+/*
+ * Called by CalcPortalVis in place of running the portals locally.
+ */
+void
+RunVisCoordinator(void)
+{
+    std::vector<int> remaining;
+    std::vector<std::vector<int>> jobs;
+    std::vector<int> manifest;
+
+    /* clean up after an earlier, interrupted coordinator */
+    if (ReadTextFile(ManifestName(), &manifest) && !manifest.empty())
+        RemoveJobFiles(manifest[0]);
+
+    for (int i = 0; i < numportals * 2; i++) {
+        if (portals[i].status == pstat_none)
+            remaining.push_back(i);
+    }
+    std::stable_sort(remaining.begin(), remaining.end(), [](int a, int b) {
+        return portals[a].nummightsee < portals[b].nummightsee;
+    });
+
+    for (size_t i = 0; i < remaining.size(); i += jobsize) {
+        const size_t end = std::min(remaining.size(), i + jobsize);
+        jobs.emplace_back(remaining.begin() + i, remaining.begin() + end);
+    }
+
+    const int numjobs = static_cast<int>(jobs.size());
+    logprint("Distributing %d portals as %d jobs\n", static_cast<int>(remaining.size()), numjobs);
+    if (!numjobs)
+        return;
+
+    for (int i = 0; i < numjobs; i++)
+        WriteTextFile(JobName(i), jobs[i]);
+
+    /* workers load the state file CalcPortalVis saved, and its journal */
+    WriteTextFile(ManifestName(), {numjobs});
+
+    /* claim mtimes come from the shared directory's clock, not ours */
+    const double clockoffset = I_FloatTime() - FileTime(ManifestName().c_str());
+
+    std::vector<qboolean> done(numjobs, false);
+    std::vector<int> portalnums;
+    int numdone = 0, numremote = 0;
+
+    while (numdone < numjobs) {
+        qboolean progress = false;
+
+        for (int i = 0; i < numjobs; i++) {
+            if (done[i] || FileTime(ResultName(i).c_str()) == -1)
+                continue;
+            if (!MergeResults(i)) {
+                /* put the job back, as if its claim had failed */
+                logprint("Job %d's results can't be used, queueing it again\n", i);
+                remove(ResultName(i).c_str());
+                WriteTextFile(JobName(i), jobs[i]);
+                remove(ClaimedJobName(i).c_str());
+                continue;
+            }
+            remove(ResultName(i).c_str());
+            remove(ClaimedJobName(i).c_str());
+            done[i] = true;
+            numdone++;
+            numremote++;
+            progress = true;
+        }
+
+        for (int i = 0; i < numjobs && !progress; i++) {
+            if (done[i] || !ClaimJob(i, &portalnums))
+                continue;
+            FlowJob(portalnums);
+            remove(ClaimedJobName(i).c_str());
+            done[i] = true;
+            numdone++;
+            progress = true;
+        }
+
+        const double now = I_FloatTime();
+
+        /* everything left is claimed by workers; rerun any that went quiet */
+        for (int i = 0; i < numjobs && !progress; i++) {
+            if (done[i])
+                continue;
+            const int claimtime = FileTime(ClaimedJobName(i).c_str());
+            if (claimtime == -1 || now - (claimtime + clockoffset) < jobtimeout)
+                continue;
+
+            logprint("Job %d timed out, running it locally\n", i);
+            FlowJob(jobs[i]);
+            remove(ClaimedJobName(i).c_str());
+            remove(ResultName(i).c_str());
+            done[i] = true;
+            numdone++;
+            progress = true;
+        }
+
+        if (!progress)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        if (now > statetime + stateinterval) {
+            statetime = now;
+            CheckpointVisState();
+        }
+    }
+
+    RemoveJobFiles(numjobs);
+    logprint("Merged %d of %d jobs from workers\n", numremote, numjobs);
+}
+
+/*
+ * Called by main in place of CalcVis; the coordinator writes the bsp.
+ */
+void
+RunVisWorker(void)
+{
+    std::vector<int> manifest;
+    std::vector<int> portalnums;
+    int numrun = 0;
+
+    if (!ReadTextFile(ManifestName(), &manifest)) {
+        logprint("Waiting for a coordinator to write %s...\n", ManifestName().c_str());
+        while (!ReadTextFile(ManifestName(), &manifest))
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (manifest.empty())
+        Error("%s: %s is empty", __func__, ManifestName().c_str());
+
+    if (!LoadVisState())
+        Error("%s: no usable state file %s", __func__, statefile);
+
+    const int numjobs = manifest[0];
+    StartVisStats();
+    for (int i = 0; i < numjobs; i++) {
+        if (!ClaimJob(i, &portalnums))
+            continue;
+        logprint("Running job %d (%d portals)\n", i, static_cast<int>(portalnums.size()));
+        FlowJob(portalnums);
+        SavePortalResults(ResultName(i).c_str(), portalnums);
+        numrun++;
+    }
+
+    FinishVisStats();
+    logprint("Ran %d of %d jobs\n", numrun, numjobs);
+}
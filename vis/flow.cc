@@ -1,4 +1,12 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+
 #include <common/threads.hh>
+#include <common/memstats.hh>
 #include <vis/vis.hh>
 #include <vis/leafbits.hh>
 
@@ -28,7 +36,7 @@ static int c_leafskip;
   pointer, was measurably faster
   ==============
 */
-static winding_t *
+winding_t *
 ClipToSeperators(const winding_t *source,
                  const plane_t src_pl,
                  const winding_t *pass,
@@ -130,6 +138,41 @@ ClipToSeperators(const winding_t *source,
     return target;
 }
 
+/* per-thread, because the worker pool outlives each PortalFlow call */
+static thread_local std::vector<std::unique_ptr<stacklevel_t, void (*)(stacklevel_t *)>> stack_arena;
+static memcounter_t stackmem("stack windings and leafbits");
+
+static void
+FreeStackLevel(stacklevel_t *level)
+{
+    free(level->mightsee);
+    stackmem.sub(sizeof(stacklevel_t) + level->mightseesize);
+    delete level;
+}
+
+/* the levels outlive the map they were made for, so mightsee grows with portalleafs */
+static stacklevel_t *
+GetStackLevel(int depth)
+{
+    while (static_cast<int>(stack_arena.size()) <= depth) {
+        stacklevel_t *level = new stacklevel_t;
+        level->mightsee = NULL;
+        level->mightseesize = 0;
+        stack_arena.emplace_back(level, FreeStackLevel);
+        stackmem.add(sizeof(stacklevel_t));
+    }
+
+    stacklevel_t *level = stack_arena[depth].get();
+    const size_t size = LeafbitsSize(portalleafs);
+    if (level->mightseesize < size) {
+        free(level->mightsee);
+        level->mightsee = static_cast<leafbits_t *>(malloc(size));
+        stackmem.add(size - level->mightseesize);
+        level->mightseesize = size;
+    }
+    return level;
+}
+
 static int
 CheckStack(leaf_t *leaf, threaddata_t *thread)
 {
@@ -157,7 +200,7 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     plane_t backplane;
     leaf_t *leaf;
     int i, j, err, numblocks;
-    leafblock_t *test, *might, *vis, more;
+    leafblock_t *test, *might, *vis;
 
     ++c_chains;
 
@@ -179,7 +222,7 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     // mark the leaf as visible
     if (!TestLeafBit(thread->leafvis, leafnum)) {
         SetLeafBit(thread->leafvis, leafnum);
-        thread->base->numcansee++;
+        thread->numcansee++;
     }
 
     prevstack->next = &stack;
@@ -187,13 +230,18 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     stack.next = NULL;
     stack.leaf = leaf;
     stack.portal = NULL;
+    stack.depth = prevstack->depth + 1;
+    if (stack.depth > thread->maxdepth)
+        thread->maxdepth = stack.depth;
     stack.numseparators[0] = 0;
     stack.numseparators[1] = 0;
 
+    stacklevel_t *level = GetStackLevel(stack.depth);
+    stack.windings = level->windings;
     for (i = 0; i < STACK_WINDINGS; i++)
         stack.freewindings[i] = 1;
 
-    stack.mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    stack.mightsee = level->mightsee;
     might = stack.mightsee->bits;
     vis = thread->leafvis->bits;
 
@@ -201,27 +249,26 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     for (i = 0; i < leaf->numportals; i++) {
         p = leaf->portals[i];
 
+        if (thread->branch >= 0 && prevstack == &thread->pstack_head && i != thread->branch)
+            continue;           // another task is flowing through this one
+
         if (!TestLeafBit(prevstack->mightsee, p->leaf)) {
             c_leafskip++;
             continue;           // can't possibly see it
         }
         // if the portal can't see anything we haven't allready seen, skip it
-        if (p->status == pstat_done) {
+        // (mightsee is read first; PortalCompleted clears it after marking done)
+        leafbits_t *pmight = p->mightsee;
+        if (p->status == pstat_done || !pmight) {
             c_vistest++;
             test = p->visbits->bits;
         } else {
             c_mighttest++;
-            test = p->mightsee->bits;
-        }
-
-        more = 0;
-        numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
-        for (j = 0; j < numblocks; j++) {
-            might[j] = prevstack->mightsee->bits[j] & test[j];
-            more |= (might[j] & ~vis[j]);
+            test = pmight->bits;
         }
 
-        if (!more) {
+        numblocks = LeafbitsBlocks(portalleafs);
+        if (!IntersectLeafBits(might, prevstack->mightsee->bits, test, vis, numblocks)) {
             // can't see anything new
             c_portalskip++;
             continue;
@@ -354,18 +401,62 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
         FreeStackWinding(stack.source, &stack);
         FreeStackWinding(stack.pass, &stack);
     }
-
-    free(stack.mightsee);
 }
 
 
+/*
+  ===============
+  PortalFlowBranches
+
+  Flows through each portal out of the first leaf as a separate task, so
+  idle threads can help with the last few portals. Each branch marks its own
+  copy of the visible leafs, which prunes a little less than a single pass
+  would, and the copies are merged at the end.
+  ===============
+*/
+static void
+PortalFlowBranches(portal_t *p, const threaddata_t *data, flowstats_t *stats)
+{
+    const leaf_t *leaf = &leafs[p->leaf];
+    const int numblocks = LeafbitsBlocks(portalleafs);
+    std::vector<threaddata_t> branches(leaf->numportals, *data);
+
+    for (int i = 0; i < leaf->numportals; i++) {
+        branches[i].leafvis = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        memset(branches[i].leafvis, 0, LeafbitsSize(portalleafs));
+        branches[i].branch = i;
+    }
+
+    /* isolated, so waiting here can't pick up another portal's LeafThread */
+    tbb::this_task_arena::isolate([&]() {
+        tbb::task_group group;
+        for (threaddata_t &branch : branches) {
+            threaddata_t *thread = &branch;
+            group.run([p, thread]() {
+                const int64_t clips = c_clipstackwinding;
+                RecursiveLeafFlow(p->leaf, thread, &thread->pstack_head);
+                thread->numclips = c_clipstackwinding - clips;
+            });
+        }
+        group.wait();
+    });
+
+    for (threaddata_t &branch : branches) {
+        MergeLeafBits(p->visbits->bits, branch.leafvis->bits, numblocks);
+        free(branch.leafvis);
+        stats->clips += branch.numclips;
+        stats->depth = std::max(stats->depth, branch.maxdepth);
+    }
+    p->numcansee = CountLeafBits(p->visbits->bits, numblocks);
+}
+
 /*
   ===============
   PortalFlow
   ===============
 */
 void
-PortalFlow(portal_t *p)
+PortalFlow(portal_t *p, flowstats_t *stats)
 {
     threaddata_t data;
 
@@ -374,6 +465,7 @@ PortalFlow(portal_t *p)
 
     p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
     memset(p->visbits, 0, LeafbitsSize(portalleafs));
+    CountPortalMemory(LeafbitsSize(portalleafs));
 
     memset(&data, 0, sizeof(data));
     data.leafvis = p->visbits;
@@ -383,8 +475,22 @@ PortalFlow(portal_t *p)
     data.pstack_head.source = p->winding;
     data.pstack_head.portalplane = p->plane;
     data.pstack_head.mightsee = p->mightsee;
+    data.branch = -1;
 
+    stats->clips = 0;
+    stats->depth = 0;
+
+    /* once there are fewer portals left than threads, split this one up */
+    if (numthreads > 1 && leafs[p->leaf].numportals > 1 && PortalsQueued() < numthreads) {
+        PortalFlowBranches(p, &data, stats);
+        return;
+    }
+
+    const int64_t clips = c_clipstackwinding;
     RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+    p->numcansee = data.numcansee;
+    stats->clips = c_clipstackwinding - clips;
+    stats->depth = data.maxdepth;
 }
 
 
@@ -439,6 +545,83 @@ distFromWinding(winding_t *w, portal_t *p)
 }
 
 
+/*
+ * BasePortalThread classifies every portal's winding against every other
+ * portal's plane. The windings and their bounding spheres are copied into
+ * flat coordinate arrays the compiler can vectorize over, and consecutive
+ * portals (usually neighbours in the bsp) are grouped under one bounding
+ * sphere, so a group behind the plane or beyond -visdist is skipped with a
+ * single test.
+ */
+#define BASEVIS_GROUPSIZE 16
+
+typedef struct {
+    std::vector<float> x, y, z;                 // winding points
+    std::vector<int> firstpoint;                // per portal, and one past the last
+    std::vector<float> ox, oy, oz, radius;      // winding spheres
+    std::vector<float> nx, ny, nz, dist;        // portal planes
+    std::vector<float> gx, gy, gz, gradius;     // group spheres
+} basevis_windings_t;
+
+static basevis_windings_t basevis;
+
+static inline float
+PlaneDist(const plane_t *plane, float x, float y, float z)
+{
+    return x * plane->normal[0] + y * plane->normal[1] + z * plane->normal[2] - plane->dist;
+}
+
+static void
+BuildBaseVisWindings(void)
+{
+    const int count = numportals * 2;
+    const int numgroups = (count + BASEVIS_GROUPSIZE - 1) / BASEVIS_GROUPSIZE;
+
+    basevis = {};
+    basevis.firstpoint.reserve(count + 1);
+    for (int i = 0; i < count; i++) {
+        const winding_t *w = portals[i].winding;
+        basevis.firstpoint.push_back(basevis.x.size());
+        for (int j = 0; j < w->numpoints; j++) {
+            basevis.x.push_back(w->points[j][0]);
+            basevis.y.push_back(w->points[j][1]);
+            basevis.z.push_back(w->points[j][2]);
+        }
+        basevis.ox.push_back(w->origin[0]);
+        basevis.oy.push_back(w->origin[1]);
+        basevis.oz.push_back(w->origin[2]);
+        basevis.radius.push_back(w->radius);
+        basevis.nx.push_back(portals[i].plane.normal[0]);
+        basevis.ny.push_back(portals[i].plane.normal[1]);
+        basevis.nz.push_back(portals[i].plane.normal[2]);
+        basevis.dist.push_back(portals[i].plane.dist);
+    }
+    basevis.firstpoint.push_back(basevis.x.size());
+
+    for (int g = 0; g < numgroups; g++) {
+        const int first = g * BASEVIS_GROUPSIZE;
+        const int last = std::min(first + BASEVIS_GROUPSIZE, count);
+        vec3_t center = { 0, 0, 0 };
+        for (int i = first; i < last; i++)
+            VectorAdd(center, portals[i].winding->origin, center);
+        VectorScale(center, 1.0 / (last - first), center);
+
+        /* padded, so float error can't reject a group that's just touching */
+        vec_t radius = 0;
+        for (int i = first; i < last; i++) {
+            vec3_t delta;
+            VectorSubtract(portals[i].winding->origin, center, delta);
+            const vec_t r = VectorLength(delta) + portals[i].winding->radius;
+            if (r > radius)
+                radius = r;
+        }
+        basevis.gx.push_back(center[0]);
+        basevis.gy.push_back(center[1]);
+        basevis.gz.push_back(center[2]);
+        basevis.gradius.push_back(radius + ON_EPSILON);
+    }
+}
+
 /*
   ==============
   BasePortalVis
@@ -447,11 +630,14 @@ distFromWinding(winding_t *w, portal_t *p)
 static void *
 BasePortalThread(void *dummy)
 {
-    int i, j, portalnum;
+    int i, j, g, portalnum;
     portal_t *p, *tp;
-    winding_t *w, *tw;
+    winding_t *w;
     float d;
     uint8_t *portalsee;
+    uint8_t passed[BASEVIS_GROUPSIZE];
+
+    const int numgroups = basevis.gradius.size();
 
     portalsee = static_cast<uint8_t *>(malloc(sizeof(*portalsee) * numportals * 2));
     if (!portalsee)
@@ -467,46 +653,58 @@ BasePortalThread(void *dummy)
 
         p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
         memset(p->mightsee, 0, LeafbitsSize(portalleafs));
+        CountPortalMemory(LeafbitsSize(portalleafs));
 
         memset(portalsee, 0, numportals * 2);
 
-        for (i = 0, tp = portals; i < numportals * 2; i++, tp++) {
-            tw = tp->winding;
-            if (tp == p)
+        for (g = 0; g < numgroups; g++) {
+            // Quick test - whole group at the back, or too far away?
+            const float gd = PlaneDist(&p->plane, basevis.gx[g], basevis.gy[g], basevis.gz[g]);
+            if (gd < -(basevis.gradius[g] + ON_EPSILON))
                 continue;
-
-            // Quick test - completely at the back?
-            d = DotProduct(tw->origin, p->plane.normal) - p->plane.dist;
-            if (d < -tw->radius)
+            if (visdist > 0 && fabs(gd) > basevis.gradius[g] + visdist)
                 continue;
 
-            for (j = 0; j < tw->numpoints; j++) {
-                d = DotProduct(tw->points[j], p->plane.normal) - p->plane.dist;
-                if (d > -ON_EPSILON) // ericw -- changed from > ON_EPSILON for https://github.com/ericwa/ericw-tools/issues/261
-                    break;
-            }
-            if (j == tw->numpoints)
-                continue;       // no points on front
-
-            // Quick test - completely on front?
-            d = DotProduct(w->origin, tp->plane.normal) - tp->plane.dist;
-            if (d > w->radius)
-                continue;
+            const int first = g * BASEVIS_GROUPSIZE;
+            const int last = std::min(first + BASEVIS_GROUPSIZE, numportals * 2);
 
-            for (j = 0; j < w->numpoints; j++) {
-                d = DotProduct(w->points[j], tp->plane.normal) - tp->plane.dist;
-                if (d < ON_EPSILON) // ericw -- changed from < -ON_EPSILON for https://github.com/ericwa/ericw-tools/issues/261
-                    break;
+            // Quick tests - completely at the back, or completely on front?
+            for (i = first; i < last; i++) {
+                const float back = PlaneDist(&p->plane, basevis.ox[i], basevis.oy[i], basevis.oz[i]);
+                const float front = w->origin[0] * basevis.nx[i] + w->origin[1] * basevis.ny[i]
+                                    + w->origin[2] * basevis.nz[i] - basevis.dist[i];
+                passed[i - first] = !(back < -basevis.radius[i]) & !(front > w->radius);
             }
-            if (j == w->numpoints)
-                continue;       // no points on back
 
-            if (visdist > 0) {
-                if (distFromWinding(tp->winding, p) > visdist || distFromWinding(p->winding, tp) > visdist)
+            for (i = first; i < last; i++) {
+                if (!passed[i - first] || i == portalnum)
                     continue;
-            }
+                tp = portals + i;
 
-            portalsee[i] = 1;
+                const int lastpoint = basevis.firstpoint[i + 1];
+                for (j = basevis.firstpoint[i]; j < lastpoint; j++) {
+                    d = PlaneDist(&p->plane, basevis.x[j], basevis.y[j], basevis.z[j]);
+                    if (d > -ON_EPSILON) // ericw -- changed from > ON_EPSILON for https://github.com/ericwa/ericw-tools/issues/261
+                        break;
+                }
+                if (j == lastpoint)
+                    continue;   // no points on front
+
+                for (j = 0; j < w->numpoints; j++) {
+                    d = DotProduct(w->points[j], tp->plane.normal) - tp->plane.dist;
+                    if (d < ON_EPSILON) // ericw -- changed from < -ON_EPSILON for https://github.com/ericwa/ericw-tools/issues/261
+                        break;
+                }
+                if (j == w->numpoints)
+                    continue;   // no points on back
+
+                if (visdist > 0) {
+                    if (distFromWinding(tp->winding, p) > visdist || distFromWinding(p->winding, tp) > visdist)
+                        continue;
+                }
+
+                portalsee[i] = 1;
+            }
         }
 
         p->nummightsee = 0;
@@ -527,5 +725,7 @@ BasePortalThread(void *dummy)
 void
 BasePortalVis(void)
 {
+    BuildBaseVisWindings();
     RunThreadsOn(0, numportals * 2, BasePortalThread, NULL);
+    basevis = {};
 }
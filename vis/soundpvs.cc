@@ -19,8 +19,11 @@
 
 #include <float.h>
 
+#include <vector>
+
 #include <vis/vis.hh>
 #include <common/bsputils.hh>
+#include <common/threads.hh>
 
 /*
 
@@ -64,29 +67,77 @@ SurfaceBBox(const mbsp_t *bsp, const bsp2_dface_t *surf,
 }
 
 
+/*
+ * A sound emitting surface, with the leaf it was found in.
+ */
+typedef struct {
+    int leafnum;
+    int ambient_type;
+    vec3_t mins, maxs;
+} ambientsurf_t;
+
+static int
+SurfaceAmbientType(const mbsp_t *bsp, const bsp2_dface_t *surf)
+{
+    const gtexinfo_t *info;
+    const miptex_t *miptex;
+    int ofs;
+
+    info = &bsp->texinfo[surf->texinfo];
+    ofs = bsp->dtexdata->dataofs[info->miptex];
+    miptex = (const miptex_t *)((uint8_t *)bsp->dtexdata + ofs);
+
+    if (!Q_strncasecmp(miptex->name, "sky", 3) && ambientsky)
+        return AMBIENT_SKY;
+    else if (!Q_strncasecmp(miptex->name, "*water", 6) && ambientwater)
+        return AMBIENT_WATER;
+    else if (!Q_strncasecmp(miptex->name, "*04water", 8) && ambientwater)
+        return AMBIENT_WATER;
+    else if (!Q_strncasecmp(miptex->name, "*slime", 6) && ambientslime)
+        return AMBIENT_WATER;       // AMBIENT_SLIME;
+    else if (!Q_strncasecmp(miptex->name, "*lava", 5) && ambientlava)
+        return AMBIENT_LAVA;
+
+    return -1;
+}
+
 /*
   ====================
   CalcAmbientSounds
+
+  The emitting surfaces are found once up front, grouped by leaf, so each
+  leaf only has to test its PVS bits for the few leafs that have any.
   ====================
 */
 void
 CalcAmbientSounds(mbsp_t *bsp)
 {
-    const bsp2_dface_t *surf;
-    const gtexinfo_t *info;
-    const miptex_t *miptex;
-    int i, j, k, l;
-    mleaf_t *leaf, *hit;
-    uint8_t *vis;
-    vec3_t mins, maxs;
-    float d, maxd;
-    int ambient_type;
-    int ofs;
-    float dists[NUM_AMBIENTS];
-    float vol;
+    std::vector<ambientsurf_t> surfs;
+    int i, k;
 
     for (i = 0; i < portalleafs_real; i++) {
-        leaf = &bsp->dleafs[i + 1];
+        const mleaf_t *hit = &bsp->dleafs[i + 1];
+
+        for (k = 0; k < hit->nummarksurfaces; k++) {
+            const bsp2_dface_t *surf = BSP_GetFace(bsp, bsp->dleaffaces[hit->firstmarksurface + k]);
+            ambientsurf_t ambient;
+
+            ambient.ambient_type = SurfaceAmbientType(bsp, surf);
+            if (ambient.ambient_type < 0)
+                continue;
+            ambient.leafnum = i;
+            SurfaceBBox(bsp, surf, ambient.mins, ambient.maxs);
+            surfs.push_back(ambient);
+        }
+    }
+
+    RunThreadsOn(0, portalleafs_real, 64, [&](int leafnum, int thread) {
+        mleaf_t *leaf = &bsp->dleafs[leafnum + 1];
+        const uint8_t *vis;
+        float d, maxd;
+        float dists[NUM_AMBIENTS];
+        float vol;
+        int j, l;
 
         //
         // clear ambients
@@ -95,57 +146,32 @@ CalcAmbientSounds(mbsp_t *bsp)
             dists[j] = 1020;
 
         if (portalleafs != portalleafs_real) {
-            vis = &uncompressed[clustermap[i] * leafbytes_real];
+            vis = &uncompressed[clustermap[leafnum] * leafbytes_real];
         } else {
-            vis = &uncompressed[i * leafbytes_real];
+            vis = &uncompressed[leafnum * leafbytes_real];
         }
 
-        for (j = 0; j < portalleafs_real; j++) {
+        for (const ambientsurf_t &ambient : surfs) {
+            j = ambient.leafnum;
             if (!(vis[j >> 3] & (1 << (j & 7))))
                 continue;
 
-            //
-            // check this leaf for sound textures
-            //
-            hit = &bsp->dleafs[j + 1];
-
-            for (k = 0; k < hit->nummarksurfaces; k++) {
-                surf = BSP_GetFace(bsp, bsp->dleaffaces[hit->firstmarksurface + k]);
-                info = &bsp->texinfo[surf->texinfo];
-                ofs = bsp->dtexdata->dataofs[info->miptex];
-                miptex = (const miptex_t *)((uint8_t *)bsp->dtexdata + ofs);
-
-                if (!Q_strncasecmp(miptex->name, "sky", 3) && ambientsky)
-                    ambient_type = AMBIENT_SKY;
-                else if (!Q_strncasecmp(miptex->name, "*water", 6) && ambientwater)
-                    ambient_type = AMBIENT_WATER;
-                else if (!Q_strncasecmp(miptex->name, "*04water", 8) && ambientwater)
-                    ambient_type = AMBIENT_WATER;
-                else if (!Q_strncasecmp(miptex->name, "*slime", 6) && ambientslime)
-                    ambient_type = AMBIENT_WATER;       // AMBIENT_SLIME;
-                else if (!Q_strncasecmp(miptex->name, "*lava", 5) && ambientlava)
-                    ambient_type = AMBIENT_LAVA;
+            // find distance from source leaf to polygon
+            maxd = 0;
+            for (l = 0; l < 3; l++) {
+                if (ambient.mins[l] > leaf->maxs[l])
+                    d = ambient.mins[l] - leaf->maxs[l];
+                else if (ambient.maxs[l] < leaf->mins[l])
+                    d = leaf->mins[l] - ambient.mins[l];
                 else
-                    continue;
-
-                // find distance from source leaf to polygon
-                SurfaceBBox(bsp, surf, mins, maxs);
-                maxd = 0;
-                for (l = 0; l < 3; l++) {
-                    if (mins[l] > leaf->maxs[l])
-                        d = mins[l] - leaf->maxs[l];
-                    else if (maxs[l] < leaf->mins[l])
-                        d = leaf->mins[l] - mins[l];
-                    else
-                        d = 0;
-                    if (d > maxd)
-                        maxd = d;
-                }
-
-                maxd = 0.25;
-                if (maxd < dists[ambient_type])
-                    dists[ambient_type] = maxd;
+                    d = 0;
+                if (d > maxd)
+                    maxd = d;
             }
+
+            maxd = 0.25;
+            if (maxd < dists[ambient.ambient_type])
+                dists[ambient.ambient_type] = maxd;
         }
 
         for (j = 0; j < NUM_AMBIENTS; j++) {
@@ -158,5 +184,5 @@ CalcAmbientSounds(mbsp_t *bsp)
             }
             leaf->ambient_level[j] = (uint8_t)(vol * 255);
         }
-    }
+    });
 }
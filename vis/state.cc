@@ -20,14 +20,28 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #ifdef LINUX
 #include <unistd.h>
 #endif
 
+#ifdef WIN32
+#include <windows.h>
+#endif
+
 #include <vis/vis.hh>
 #include <common/cmdlib.hh>
 
 #define VIS_STATE_VERSION ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1')
+#define VIS_RESULTS_VERSION ('T' << 24 | 'Y' << 16 | 'R' << 8 | 'W')
 
 typedef struct {
     uint32_t version;
@@ -45,6 +59,25 @@ typedef struct {
     uint32_t numcansee;
 } dportal_t;
 
+/* header of a -worker results file, followed by numresults dportalresult_t */
+typedef struct {
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+    uint32_t testlevel;
+    uint32_t numresults;
+} dvisresults_t;
+
+/*
+ * Followed by the compressed vis bits, like a state file portal. Also used
+ * for the journal records appended to the state file, which carry the
+ * packed mightsee too.
+ */
+typedef struct {
+    uint32_t portalnum;
+    dportal_t state;
+} dportalresult_t;
+
 static int
 CompressBits(uint8_t *out, const leafbits_t *in)
 {
@@ -132,6 +165,37 @@ CopyLeafBits(leafbits_t *dst, const uint8_t *src, int numleafs)
     }
 }
 
+/*
+ * Done portals only need their mightsee for PortalCompleted, so it's kept
+ * compressed in the state file format until then.
+ */
+void
+PackMightsee(portal_t *p)
+{
+    uint8_t *buffer = static_cast<uint8_t *>(malloc((portalleafs + 7) >> 3));
+    const int len = CompressBits(buffer, p->mightsee);
+
+    p->packedmight = static_cast<uint8_t *>(malloc(len));
+    memcpy(p->packedmight, buffer, len);
+    p->packedmightlen = len;
+    CountPortalMemory(len);
+
+    free(buffer);
+}
+
+void
+UnpackMightsee(const portal_t *p, leafbits_t *out)
+{
+    /* the decompressors leave the bits past the last byte alone */
+    memset(out, 0, LeafbitsSize(portalleafs));
+    if (p->packedmightlen < (portalleafs + 7) >> 3)
+        DecompressBits(out, p->packedmight);
+    else
+        CopyLeafBits(out, p->packedmight, portalleafs);
+}
+
+static void SaveVisGeometry(void);
+
 void
 SaveVisState(void)
 {
@@ -144,6 +208,13 @@ SaveVisState(void)
     FILE *outfile;
     int err;
 
+    /* the portals don't change during a run, the state file's numbering goes with them */
+    static bool geometrysaved = false;
+    if (visincremental && !geometrysaved) {
+        SaveVisGeometry();
+        geometrysaved = true;
+    }
+
     outfile = SafeOpenWrite(statetmpfile);
 
     /* Write out a header */
@@ -160,7 +231,12 @@ SaveVisState(void)
     vis = static_cast<uint8_t *>(malloc((portalleafs + 7) >> 3));
 
     for (i = 0, p = portals; i < numportals * 2; i++, p++ ) {
-        might_len = CompressBits(might, p->mightsee);
+        if (p->mightsee) {
+            might_len = CompressBits(might, p->mightsee);
+        } else {
+            might_len = p->packedmightlen;
+            memcpy(might, p->packedmight, might_len);
+        }
         if (p->status == pstat_done)
             vis_len = CompressBits(vis, p->visbits);
         else
@@ -184,12 +260,16 @@ SaveVisState(void)
     err = fclose(outfile);
     if (err)
         Error("%s: error writing new state (%s)", __func__, strerror(errno));
-    err = unlink(statefile);
-    if (err && errno != ENOENT)
-        Error("%s: error removing old state (%s)", __func__, strerror(errno));
+    /* swap the new state in atomically, which -worker relies on */
+#ifdef WIN32
+    /* rename() won't replace a file on Windows */
+    if (!MoveFileExA(statetmpfile, statefile, MOVEFILE_REPLACE_EXISTING))
+        Error("%s: error renaming state file (error %lu)", __func__, GetLastError());
+#else
     err = rename(statetmpfile, statefile);
     if (err)
         Error("%s: error renaming state file (%s)", __func__, strerror(errno));
+#endif
 }
 
 qboolean
@@ -263,18 +343,35 @@ LoadVisState(void)
         p->nummightsee = pstate.nummightsee;
         p->numcansee = pstate.numcansee;
 
+        if (pstate.might > numbytes || pstate.vis > numbytes)
+            Error("%s: state file %s is corrupt", __func__, statefile);
+
         SafeRead(infile, compressed, pstate.might);
-        p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
-        memset(p->mightsee, 0, LeafbitsSize(portalleafs));
-        if (pstate.might < numbytes)
-            DecompressBits(p->mightsee, compressed);
-        else
-            CopyLeafBits(p->mightsee, compressed, portalleafs);
+        if (p->status == pstat_done) {
+            /* already packed, see PackMightsee */
+            p->packedmight = static_cast<uint8_t *>(malloc(pstate.might));
+            memcpy(p->packedmight, compressed, pstate.might);
+            p->packedmightlen = pstate.might;
+            CountPortalMemory(pstate.might);
+        } else {
+            p->mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+            memset(p->mightsee, 0, LeafbitsSize(portalleafs));
+            if (pstate.might < numbytes)
+                DecompressBits(p->mightsee, compressed);
+            else
+                CopyLeafBits(p->mightsee, compressed, portalleafs);
+            CountPortalMemory(LeafbitsSize(portalleafs));
+        }
 
-        p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
-        memset(p->visbits, 0, LeafbitsSize(portalleafs));
-        if (pstate.vis) {
+        /* PortalFlow allocates visbits for the others */
+        if (p->status == pstat_done) {
+            p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+            memset(p->visbits, 0, LeafbitsSize(portalleafs));
+            CountPortalMemory(LeafbitsSize(portalleafs));
+        }
+        if (pstate.vis)
             SafeRead(infile, compressed, pstate.vis);
+        if (pstate.vis && p->status == pstat_done) {
             if (pstate.vis < numbytes)
                 DecompressBits(p->visbits, compressed);
             else
@@ -286,8 +383,768 @@ LoadVisState(void)
             p->status = pstat_none;
     }
 
+    /*
+     * Replay the journal. A record cut short by a crash is where it ends.
+     */
+    int numreplayed = 0;
+    dportalresult_t record;
+    uint8_t *compressed2 = static_cast<uint8_t *>(malloc(numbytes));
+    while (fread(&record, sizeof(record), 1, infile) == 1) {
+        const int portalnum = LittleLong(record.portalnum);
+        const uint32_t might_len = LittleLong(record.state.might);
+        const uint32_t vis_len = LittleLong(record.state.vis);
+        if (portalnum < 0 || portalnum >= numportals * 2
+            || might_len > numbytes || vis_len > numbytes || !might_len || !vis_len)
+            break;
+
+        /* mightsee as it was when the portal completed, then visbits */
+        if (fread(compressed, might_len, 1, infile) != 1
+            || fread(compressed2, vis_len, 1, infile) != 1)
+            break;
+
+        p = &portals[portalnum];
+        if (p->status == pstat_done)
+            continue;
+
+        if (might_len < numbytes)
+            DecompressBits(p->mightsee, compressed);
+        else
+            CopyLeafBits(p->mightsee, compressed, portalleafs);
+
+        p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        memset(p->visbits, 0, LeafbitsSize(portalleafs));
+        CountPortalMemory(LeafbitsSize(portalleafs));
+        if (vis_len < numbytes)
+            DecompressBits(p->visbits, compressed2);
+        else
+            CopyLeafBits(p->visbits, compressed2, portalleafs);
+
+        p->nummightsee = LittleLong(record.state.nummightsee);
+        p->numcansee = LittleLong(record.state.numcansee);
+
+        /* trims the neighbours' mightsee the same way the original run did */
+        PortalCompleted(p);
+        numreplayed++;
+    }
+    if (numreplayed)
+        logprint("Replayed %d completed portals from the state journal\n", numreplayed);
+
+    free(compressed2);
     free(compressed);
     fclose(infile);
 
     return true;
 }
+
+/*
+ * Writes the vis bits of the given (completed) portals for the coordinator
+ * to merge. Written to a temp file and renamed into place, so the
+ * coordinator never sees a partial file.
+ */
+void
+SavePortalResults(const char *filename, const std::vector<int> &portalnums)
+{
+    dvisresults_t header;
+    dportalresult_t result;
+    uint8_t *vis;
+    FILE *outfile;
+    int err;
+
+    char tmpfile[1024];
+    q_snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", filename);
+    outfile = SafeOpenWrite(tmpfile);
+
+    header.version = LittleLong(VIS_RESULTS_VERSION);
+    header.numportals = LittleLong(numportals);
+    header.numleafs = LittleLong(portalleafs);
+    header.testlevel = LittleLong(testlevel);
+    header.numresults = LittleLong(static_cast<uint32_t>(portalnums.size()));
+    SafeWrite(outfile, &header, sizeof(header));
+
+    vis = static_cast<uint8_t *>(malloc((portalleafs + 7) >> 3));
+
+    for (const int portalnum : portalnums) {
+        const portal_t *p = &portals[portalnum];
+        if (p->status != pstat_done)
+            Error("%s: portal %d is not done", __func__, portalnum);
+
+        const int vis_len = CompressBits(vis, p->visbits);
+
+        result.portalnum = LittleLong(portalnum);
+        result.state.status = LittleLong(p->status);
+        result.state.might = 0;
+        result.state.vis = LittleLong(vis_len);
+        result.state.nummightsee = LittleLong(p->nummightsee);
+        result.state.numcansee = LittleLong(p->numcansee);
+
+        SafeWrite(outfile, &result, sizeof(result));
+        SafeWrite(outfile, vis, vis_len);
+    }
+
+    free(vis);
+
+    err = fclose(outfile);
+    if (err)
+        Error("%s: error writing %s (%s)", __func__, tmpfile, strerror(errno));
+    err = rename(tmpfile, filename);
+    if (err)
+        Error("%s: error renaming %s (%s)", __func__, tmpfile, strerror(errno));
+}
+
+/*
+ * Whether src is a whole compressed row: it decompresses to exactly
+ * numbytes, using exactly len bytes.
+ */
+static bool
+CompressedBitsValid(const uint8_t *src, uint32_t len, int numbytes)
+{
+    uint32_t in = 0;
+    int out = 0;
+
+    while (out < numbytes) {
+        if (in >= len)
+            return false;
+        const uint8_t val = src[in++];
+        if (val != 0 && val != 0xff) {
+            out++;
+            continue;
+        }
+        if (in >= len)
+            return false;
+        const int rep = src[in++];
+        if (rep == 0 || out + rep > numbytes)
+            return false;
+        out += rep;
+    }
+    return in == len;
+}
+
+typedef struct {
+    int portalnum;
+    int numcansee;
+    std::vector<uint8_t> vis;
+} portalresult_t;
+
+/*
+ * Reads a results file written by SavePortalResults. Portals that aren't
+ * done yet get their vis bits and cansee count and are added to loaded;
+ * the caller marks them completed. Returns false, leaving the portals
+ * alone, if the file doesn't exist or can't be used: a worker killed while
+ * writing it, a different map or settings, or garbage.
+ */
+qboolean
+LoadPortalResults(const char *filename, std::vector<int> *loaded)
+{
+    dvisresults_t header;
+    dportalresult_t result;
+    FILE *infile;
+    int numbytes;
+
+    infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+
+    fseek(infile, 0, SEEK_END);
+    const long filesize = ftell(infile);
+    fseek(infile, 0, SEEK_SET);
+
+    if (fread(&header, sizeof(header), 1, infile) != 1) {
+        logprint("WARNING: %s is truncated, discarding it\n", filename);
+        fclose(infile);
+        return false;
+    }
+    if (LittleLong(header.version) != VIS_RESULTS_VERSION
+        || LittleLong(header.numportals) != static_cast<uint32_t>(numportals)
+        || LittleLong(header.numleafs) != static_cast<uint32_t>(portalleafs)
+        || LittleLong(header.testlevel) != static_cast<uint32_t>(testlevel)) {
+        logprint("WARNING: %s does not match this map and settings, discarding it\n", filename);
+        fclose(infile);
+        return false;
+    }
+
+    numbytes = (portalleafs + 7) >> 3;
+
+    /* every result is read and checked before any portal is touched */
+    const uint32_t numresults = LittleLong(header.numresults);
+    if (numresults > static_cast<uint64_t>(filesize) / sizeof(result)) {
+        logprint("WARNING: %s is corrupt, discarding it\n", filename);
+        fclose(infile);
+        return false;
+    }
+    std::vector<portalresult_t> results(numresults);
+    for (portalresult_t &r : results) {
+        if (fread(&result, sizeof(result), 1, infile) != 1) {
+            logprint("WARNING: %s is truncated, discarding it\n", filename);
+            fclose(infile);
+            return false;
+        }
+        r.portalnum = LittleLong(result.portalnum);
+        r.numcansee = LittleLong(result.state.numcansee);
+        const uint32_t vis_len = LittleLong(result.state.vis);
+        if (r.portalnum < 0 || r.portalnum >= numportals * 2 || vis_len > static_cast<uint32_t>(numbytes)) {
+            logprint("WARNING: %s is corrupt, discarding it\n", filename);
+            fclose(infile);
+            return false;
+        }
+
+        r.vis.resize(vis_len);
+        if (fread(r.vis.data(), 1, vis_len, infile) != vis_len) {
+            logprint("WARNING: %s is truncated, discarding it\n", filename);
+            fclose(infile);
+            return false;
+        }
+        if (vis_len < static_cast<uint32_t>(numbytes) && !CompressedBitsValid(r.vis.data(), vis_len, numbytes)) {
+            logprint("WARNING: %s is corrupt, discarding it\n", filename);
+            fclose(infile);
+            return false;
+        }
+    }
+    fclose(infile);
+
+    for (const portalresult_t &r : results) {
+        portal_t *p = &portals[r.portalnum];
+        if (p->status == pstat_done)
+            continue;
+
+        if (!p->visbits) {
+            p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+            CountPortalMemory(LeafbitsSize(portalleafs));
+        }
+        memset(p->visbits, 0, LeafbitsSize(portalleafs));
+        if (r.vis.size() < static_cast<size_t>(numbytes))
+            DecompressBits(p->visbits, r.vis.data());
+        else
+            CopyLeafBits(p->visbits, r.vis.data(), portalleafs);
+        p->numcansee = r.numcansee;
+
+        loaded->push_back(r.portalnum);
+    }
+
+    return true;
+}
+
+/*
+ * Checkpoint journal
+ *
+ * Rewriting the whole state file on every checkpoint would mean
+ * compressing every portal again with the lock held. Instead the full state
+ * is written once before the full vis starts, and each checkpoint appends a
+ * record for every portal completed since the previous one. A done portal's
+ * visbits and packed mightsee don't change any more, so the records are
+ * written by a background thread without holding the lock.
+ */
+static std::thread journal_thread;
+static std::mutex journal_lock;
+static std::condition_variable journal_cond;
+static std::vector<int> journal_pending;
+static bool journal_active;
+static bool journal_flush;
+static bool journal_stop;
+
+static void
+WriteJournalRecords(const std::vector<int> &portalnums)
+{
+    dportalresult_t record;
+    uint8_t *vis;
+    FILE *outfile;
+
+    outfile = fopen(statefile, "ab");
+    if (!outfile)
+        Error("%s: error opening %s (%s)", __func__, statefile, strerror(errno));
+
+    vis = static_cast<uint8_t *>(malloc((portalleafs + 7) >> 3));
+
+    for (const int portalnum : portalnums) {
+        const portal_t *p = &portals[portalnum];
+        const int vis_len = CompressBits(vis, p->visbits);
+
+        record.portalnum = LittleLong(portalnum);
+        record.state.status = LittleLong(p->status);
+        record.state.might = LittleLong(p->packedmightlen);
+        record.state.vis = LittleLong(vis_len);
+        record.state.nummightsee = LittleLong(p->nummightsee);
+        record.state.numcansee = LittleLong(p->numcansee);
+
+        SafeWrite(outfile, &record, sizeof(record));
+        SafeWrite(outfile, p->packedmight, p->packedmightlen);
+        SafeWrite(outfile, vis, vis_len);
+    }
+
+    free(vis);
+
+    if (fclose(outfile))
+        Error("%s: error writing %s (%s)", __func__, statefile, strerror(errno));
+}
+
+static void
+JournalThread(void)
+{
+    std::unique_lock<std::mutex> lock(journal_lock);
+
+    while (1) {
+        journal_cond.wait(lock, []() { return journal_flush || journal_stop; });
+
+        std::vector<int> portalnums;
+        portalnums.swap(journal_pending);
+        journal_flush = false;
+        const bool stop = journal_stop;
+
+        lock.unlock();
+        if (!portalnums.empty())
+            WriteJournalRecords(portalnums);
+        lock.lock();
+
+        if (stop && journal_pending.empty())
+            break;
+    }
+}
+
+/*
+ * Call once the full state has been saved
+ */
+void
+StartVisJournal(void)
+{
+    std::lock_guard<std::mutex> lock(journal_lock);
+
+    journal_pending.clear();
+    journal_flush = false;
+    journal_stop = false;
+    journal_active = true;
+    journal_thread = std::thread(JournalThread);
+}
+
+/*
+ * Writes out what's pending and waits for the thread to finish
+ */
+void
+StopVisJournal(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(journal_lock);
+        if (!journal_active)
+            return;
+        journal_stop = true;
+        journal_active = false;
+    }
+    journal_cond.notify_one();
+    journal_thread.join();
+}
+
+/*
+ * Called by PortalCompleted; the portal is written by the next checkpoint
+ */
+void
+JournalPortal(int portalnum)
+{
+    std::lock_guard<std::mutex> lock(journal_lock);
+
+    if (journal_active)
+        journal_pending.push_back(portalnum);
+}
+
+void
+CheckpointVisState(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(journal_lock);
+        journal_flush = true;
+    }
+    journal_cond.notify_one();
+}
+
+/*
+ * Incremental vis (-incremental)
+ *
+ * The state file's portals and leafs are numbered by the .prt it was made
+ * from, so with -incremental SaveVisState also writes that .prt's portal
+ * windings to the .vip file. When the map has been changed,
+ * LoadIncrementalVisState matches the new portals to the old ones by
+ * their windings, and a leaf to the old leaf whose portals are all the
+ * same. A portal that was done keeps its visbits if every leaf it might
+ * have seen is matched: its flow never reached the changed part of the
+ * map, and anything it could see there now it would have to see through
+ * a leaf whose portals changed. The rest are flowed again.
+ */
+#define VIS_GEOMETRY_VERSION ('T' << 24 | 'Y' << 16 | 'R' << 8 | 'G')
+
+typedef struct {
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+} dvisgeometry_t;
+
+/* followed by numpoints x, y, z, each a little endian double */
+typedef struct {
+    int32_t leafs[2];           // as in the .prt: the winding faces leafs[0]
+    int32_t numpoints;
+} dvisgeometryportal_t;
+
+static void
+WriteGeometryDouble(FILE *f, double d)
+{
+    uint64_t u;
+    uint8_t bytes[8];
+
+    memcpy(&u, &d, sizeof(u));
+    for (int i = 0; i < 8; i++)
+        bytes[i] = (u >> (8 * i)) & 0xff;
+    SafeWrite(f, bytes, sizeof(bytes));
+}
+
+static bool
+ReadGeometryDouble(FILE *f, double *d)
+{
+    uint8_t bytes[8];
+    uint64_t u = 0;
+
+    if (fread(bytes, 1, sizeof(bytes), f) != sizeof(bytes))
+        return false;
+    for (int i = 0; i < 8; i++)
+        u |= (uint64_t)bytes[i] << (8 * i);
+    memcpy(d, &u, sizeof(*d));
+    return true;
+}
+
+static void
+SaveVisGeometry(void)
+{
+    char tmpfile[1024];
+    q_snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", visgeometryfile);
+    FILE *outfile = SafeOpenWrite(tmpfile);
+
+    dvisgeometry_t header;
+    header.version = LittleLong(VIS_GEOMETRY_VERSION);
+    header.numportals = LittleLong(numportals);
+    header.numleafs = LittleLong(portalleafs);
+    SafeWrite(outfile, &header, sizeof(header));
+
+    /* the forward portal has the .prt winding and leads to leafs[1] */
+    for (int i = 0; i < numportals; i++) {
+        const portal_t *p = &portals[i * 2];
+        dvisgeometryportal_t dportal;
+        dportal.leafs[0] = LittleLong(portals[i * 2 + 1].leaf);
+        dportal.leafs[1] = LittleLong(p->leaf);
+        dportal.numpoints = LittleLong(p->winding->numpoints);
+        SafeWrite(outfile, &dportal, sizeof(dportal));
+
+        for (int j = 0; j < p->winding->numpoints; j++) {
+            for (int k = 0; k < 3; k++)
+                WriteGeometryDouble(outfile, p->winding->points[j][k]);
+        }
+    }
+
+    if (fclose(outfile))
+        Error("%s: error writing %s (%s)", __func__, tmpfile, strerror(errno));
+#ifdef WIN32
+    if (!MoveFileExA(tmpfile, visgeometryfile, MOVEFILE_REPLACE_EXISTING))
+        Error("%s: error renaming %s (error %lu)", __func__, tmpfile, GetLastError());
+#else
+    if (rename(tmpfile, visgeometryfile))
+        Error("%s: error renaming %s (%s)", __func__, tmpfile, strerror(errno));
+#endif
+}
+
+/*
+ * A winding's points to 1/8 unit, starting from the smallest, so the same
+ * portal matches however qbsp ordered its points. Reversed is the winding
+ * facing the other way.
+ */
+typedef std::vector<int64_t> windingkey_t;
+
+static windingkey_t
+WindingKey(const std::vector<std::array<double, 3>> &points, bool reversed)
+{
+    const int numpoints = static_cast<int>(points.size());
+    windingkey_t quantized;
+    for (int i = 0; i < numpoints; i++) {
+        const auto &point = points[reversed ? numpoints - 1 - i : i];
+        for (int k = 0; k < 3; k++)
+            quantized.push_back(static_cast<int64_t>(floor(point[k] * 8.0 + 0.5)));
+    }
+
+    int first = 0;
+    for (int i = 1; i < numpoints; i++) {
+        if (std::lexicographical_compare(&quantized[i * 3], &quantized[i * 3 + 3],
+                                         &quantized[first * 3], &quantized[first * 3 + 3]))
+            first = i;
+    }
+    std::rotate(quantized.begin(), quantized.begin() + first * 3, quantized.end());
+    return quantized;
+}
+
+/* the bits of a state file bitstring, as bytes, for numleafs leafs */
+static std::vector<uint8_t>
+UnpackStateBits(const uint8_t *src, uint32_t len, int numleafs)
+{
+    const int numbytes = (numleafs + 7) >> 3;
+    std::vector<uint8_t> bytes(numbytes, 0);
+
+    if (len >= static_cast<uint32_t>(numbytes)) {
+        memcpy(bytes.data(), src, numbytes);
+        return bytes;
+    }
+
+    const uint8_t *end = src + len;
+    for (int i = 0; i < numbytes && src < end; i++) {
+        const uint8_t val = *src++;
+        bytes[i] = val;
+        if (val != 0 && val != 0xff)
+            continue;
+        if (src >= end)
+            break;
+        int rep = *src++;
+        while (--rep > 0 && i + 1 < numbytes)
+            bytes[++i] = val;
+    }
+    return bytes;
+}
+
+typedef struct {
+    int leafs[2];
+    std::vector<std::array<double, 3>> points;
+} oldportal_t;
+
+typedef struct {
+    pstatus_t status;
+    std::vector<uint8_t> might, vis;
+} oldportalstate_t;
+
+static bool
+ReadVisGeometry(std::vector<oldportal_t> *oldportals, int *oldnumleafs)
+{
+    FILE *infile = fopen(visgeometryfile, "rb");
+    if (!infile) {
+        logprint("Incremental: no %s from an earlier -incremental vis, running a full vis\n", visgeometryfile);
+        return false;
+    }
+
+    dvisgeometry_t header;
+    bool ok = (fread(&header, sizeof(header), 1, infile) == 1
+               && LittleLong(header.version) == VIS_GEOMETRY_VERSION);
+    const int oldnumportals = LittleLong(header.numportals);
+    *oldnumleafs = LittleLong(header.numleafs);
+
+    for (int i = 0; ok && i < oldnumportals; i++) {
+        dvisgeometryportal_t dportal;
+        if (fread(&dportal, sizeof(dportal), 1, infile) != 1) {
+            ok = false;
+            break;
+        }
+        oldportal_t portal;
+        portal.leafs[0] = LittleLong(dportal.leafs[0]);
+        portal.leafs[1] = LittleLong(dportal.leafs[1]);
+        const int numpoints = LittleLong(dportal.numpoints);
+        if (numpoints < 0 || numpoints > MAX_WINDING
+            || portal.leafs[0] < 0 || portal.leafs[0] >= *oldnumleafs
+            || portal.leafs[1] < 0 || portal.leafs[1] >= *oldnumleafs) {
+            ok = false;
+            break;
+        }
+        portal.points.resize(numpoints);
+        for (auto &point : portal.points) {
+            for (int k = 0; k < 3; k++)
+                ok = ok && ReadGeometryDouble(infile, &point[k]);
+        }
+        oldportals->push_back(std::move(portal));
+    }
+    fclose(infile);
+
+    if (!ok)
+        logprint("Incremental: %s is corrupt, running a full vis\n", visgeometryfile);
+    return ok;
+}
+
+/* the done portals of the state file, numbered as in the .vip; the journal isn't replayed */
+static bool
+ReadOldVisState(int oldnumportals, int oldnumleafs, std::vector<oldportalstate_t> *oldstates)
+{
+    FILE *infile = fopen(statefile, "rb");
+    if (!infile)
+        infile = fopen(statetmpfile, "rb");
+    if (!infile) {
+        logprint("Incremental: no state file, running a full vis\n");
+        return false;
+    }
+
+    dvisstate_t state;
+    if (fread(&state, sizeof(state), 1, infile) != 1
+        || LittleLong(state.version) != VIS_STATE_VERSION
+        || LittleLong(state.numportals) != static_cast<uint32_t>(oldnumportals)
+        || LittleLong(state.numleafs) != static_cast<uint32_t>(oldnumleafs)) {
+        fclose(infile);
+        logprint("Incremental: %s doesn't go with %s, running a full vis\n", statefile, visgeometryfile);
+        return false;
+    }
+    if (LittleLong(state.testlevel) != static_cast<uint32_t>(testlevel)) {
+        fclose(infile);
+        logprint("Incremental: %s is from -level %d, running a full vis\n", statefile, LittleLong(state.testlevel));
+        return false;
+    }
+
+    const uint32_t numbytes = (oldnumleafs + 7) >> 3;
+    std::vector<uint8_t> compressed(numbytes);
+    oldstates->resize(oldnumportals * 2);
+
+    for (oldportalstate_t &old : *oldstates) {
+        dportal_t pstate;
+        if (fread(&pstate, sizeof(pstate), 1, infile) != 1) {
+            fclose(infile);
+            logprint("Incremental: %s is truncated, running a full vis\n", statefile);
+            return false;
+        }
+        old.status = static_cast<pstatus_t>(LittleLong(pstate.status));
+        const uint32_t might_len = LittleLong(pstate.might);
+        const uint32_t vis_len = LittleLong(pstate.vis);
+        if (might_len > numbytes || vis_len > numbytes)
+            Error("%s: state file %s is corrupt", __func__, statefile);
+
+        SafeRead(infile, compressed.data(), might_len);
+        if (old.status == pstat_done)
+            old.might = UnpackStateBits(compressed.data(), might_len, oldnumleafs);
+        SafeRead(infile, compressed.data(), vis_len);
+        if (old.status == pstat_done && vis_len)
+            old.vis = UnpackStateBits(compressed.data(), vis_len, oldnumleafs);
+        else
+            old.status = pstat_none;
+    }
+    fclose(infile);
+
+    return true;
+}
+
+/*
+ * Sets bits of the new leafs matching the old leafs set in old. Returns
+ * false if one of them isn't matched.
+ */
+static bool
+RemapLeafBits(const std::vector<uint8_t> &old, const std::vector<int> &oldleaftonew, leafbits_t *out, int *count)
+{
+    memset(out, 0, LeafbitsSize(portalleafs));
+    out->numleafs = portalleafs;
+    *count = 0;
+
+    for (size_t i = 0; i < old.size(); i++) {
+        for (int bit = 0; bit < 8 && old[i]; bit++) {
+            if (!(old[i] & (1 << bit)))
+                continue;
+            const size_t oldleaf = i * 8 + bit;
+            if (oldleaf >= oldleaftonew.size() || oldleaftonew[oldleaf] < 0)
+                return false;
+            SetLeafBit(out, oldleaftonew[oldleaf]);
+            (*count)++;
+        }
+    }
+    return true;
+}
+
+/*
+ * Call after BasePortalVis, in place of LoadVisState. Marks the portals it
+ * reuses done, like the journal replay.
+ */
+void
+LoadIncrementalVisState(void)
+{
+    std::vector<oldportal_t> oldportals;
+    std::vector<oldportalstate_t> oldstates;
+    int oldnumleafs;
+
+    if (!ReadVisGeometry(&oldportals, &oldnumleafs))
+        return;
+    if (!ReadOldVisState(static_cast<int>(oldportals.size()), oldnumleafs, &oldstates))
+        return;
+
+    /* the old file portals by winding, -1 where two have the same one */
+    std::map<windingkey_t, int> oldbywinding;
+    for (int i = 0; i < static_cast<int>(oldportals.size()); i++) {
+        const auto inserted = oldbywinding.emplace(WindingKey(oldportals[i].points, false), i);
+        if (!inserted.second)
+            inserted.first->second = -1;
+    }
+
+    /* new memory portal -> old memory portal, where the windings match */
+    std::vector<int> newtoold(numportals * 2, -1);
+    int nummatched = 0;
+    for (int i = 0; i < numportals; i++) {
+        const winding_t *w = portals[i * 2].winding;
+        std::vector<std::array<double, 3>> points(w->numpoints);
+        for (int j = 0; j < w->numpoints; j++)
+            points[j] = { w->points[j][0], w->points[j][1], w->points[j][2] };
+
+        auto it = oldbywinding.find(WindingKey(points, false));
+        if (it != oldbywinding.end() && it->second >= 0) {
+            newtoold[i * 2] = it->second * 2;
+            newtoold[i * 2 + 1] = it->second * 2 + 1;
+            nummatched++;
+            continue;
+        }
+        it = oldbywinding.find(WindingKey(points, true));
+        if (it != oldbywinding.end() && it->second >= 0) {
+            newtoold[i * 2] = it->second * 2 + 1;
+            newtoold[i * 2 + 1] = it->second * 2;
+            nummatched++;
+        }
+    }
+
+    /* the leaf an old memory portal is in, and the one it leads to */
+    const auto oldsource = [&oldportals](int k) { return oldportals[k / 2].leafs[k & 1 ? 1 : 0]; };
+    const auto olddest = [&oldportals](int k) { return oldportals[k / 2].leafs[k & 1 ? 0 : 1]; };
+
+    std::vector<int> oldleafportals(oldnumleafs, 0);
+    for (int k = 0; k < static_cast<int>(oldportals.size()) * 2; k++)
+        oldleafportals[oldsource(k)]++;
+
+    /* a leaf matches the old leaf all of its portals were in, if it had no others */
+    std::vector<int> oldleaftonew(oldnumleafs, -1);
+    int numleafsmatched = 0;
+    for (int i = 0; i < portalleafs; i++) {
+        const leaf_t *leaf = &leafs[i];
+        int oldleaf = -1;
+        for (int j = 0; j < leaf->numportals; j++) {
+            const int k = newtoold[leaf->portals[j] - portals];
+            if (k < 0 || (oldleaf >= 0 && oldsource(k) != oldleaf)) {
+                oldleaf = -1;
+                break;
+            }
+            oldleaf = oldsource(k);
+        }
+        if (oldleaf < 0 || oldleafportals[oldleaf] != leaf->numportals || oldleaftonew[oldleaf] >= 0)
+            continue;
+        oldleaftonew[oldleaf] = i;
+        numleafsmatched++;
+    }
+
+    leafbits_t *might = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    leafbits_t *vis = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    int numreused = 0;
+
+    for (int i = 0; i < numportals * 2; i++) {
+        portal_t *p = &portals[i];
+        const int k = newtoold[i];
+        if (k < 0 || oldstates[k].status != pstat_done)
+            continue;
+        if (oldleaftonew[olddest(k)] != p->leaf)
+            continue;
+
+        int nummightsee, numcansee;
+        if (!RemapLeafBits(oldstates[k].might, oldleaftonew, might, &nummightsee)
+            || !RemapLeafBits(oldstates[k].vis, oldleaftonew, vis, &numcansee))
+            continue;
+
+        memcpy(p->mightsee, might, LeafbitsSize(portalleafs));
+        p->nummightsee = nummightsee;
+        p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        memcpy(p->visbits, vis, LeafbitsSize(portalleafs));
+        CountPortalMemory(LeafbitsSize(portalleafs));
+        p->numcansee = numcansee;
+
+        PortalCompleted(p);
+        numreused++;
+    }
+
+    free(might);
+    free(vis);
+
+    logprint("Incremental: matched %d of %d portals and %d of %d leafs, reusing %d of %d portals' vis\n",
+             nummatched, numportals, numleafsmatched, portalleafs, numreused, numportals * 2);
+}
@@ -0,0 +1,221 @@
+#include "gtest/gtest.h"
+
+#include <vis/vis.hh>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+ * A row of leafs along +X, a square portal between each pair, like
+ * qbsp writes for a straight corridor. leafcluster maps each leaf to its
+ * cluster; when it isn't the identity the text file is PRT2.
+ */
+struct testportal_t {
+    int leafs[2];
+    std::vector<qvec3d> points;
+};
+
+static std::vector<testportal_t>
+CorridorPortals(const std::vector<int> &leafcluster)
+{
+    std::vector<testportal_t> result;
+
+    for (size_t i = 0; i + 1 < leafcluster.size(); i++) {
+        if (leafcluster[i] == leafcluster[i + 1])
+            continue;
+
+        const double x = 64.0 * (i + 1);
+        testportal_t p;
+        p.leafs[0] = leafcluster[i];
+        p.leafs[1] = leafcluster[i + 1];
+        p.points = {qvec3d(x, -32, -16.5), qvec3d(x, -32, 48), qvec3d(x, 32, 48), qvec3d(x, 32, -16.5)};
+        result.push_back(p);
+    }
+    return result;
+}
+
+static void
+WriteTextPortalFile(const char *name, const std::vector<int> &leafcluster)
+{
+    const std::vector<testportal_t> prtportals = CorridorPortals(leafcluster);
+    const int numleafs = static_cast<int>(leafcluster.size());
+    const int numclusters = leafcluster.back() + 1;
+
+    FILE *f = fopen(name, "wb");
+    ASSERT_NE(nullptr, f);
+    if (numclusters == numleafs)
+        fprintf(f, "%s\n%d\n%d\n", PORTALFILE, numleafs, static_cast<int>(prtportals.size()));
+    else
+        fprintf(f, "%s\n%d\n%d\n%d\n", PORTALFILE2, numleafs, numclusters, static_cast<int>(prtportals.size()));
+
+    for (const testportal_t &p : prtportals) {
+        fprintf(f, "%d %d %d ", static_cast<int>(p.points.size()), p.leafs[0], p.leafs[1]);
+        for (const qvec3d &point : p.points)
+            fprintf(f, "(%f %f %f ) ", point[0], point[1], point[2]);
+        fprintf(f, "\n");
+    }
+
+    if (numclusters != numleafs) {
+        for (int c = 0; c < numclusters; c++) {
+            for (int l = 0; l < numleafs; l++) {
+                if (leafcluster[l] == c)
+                    fprintf(f, "%d ", l);
+            }
+            fprintf(f, "-1\n");
+        }
+    }
+    fclose(f);
+}
+
+static void
+WriteBinaryInt(FILE *f, int32_t value)
+{
+    const uint32_t u = static_cast<uint32_t>(value);
+    const uint8_t bytes[4] = {static_cast<uint8_t>(u), static_cast<uint8_t>(u >> 8),
+                              static_cast<uint8_t>(u >> 16), static_cast<uint8_t>(u >> 24)};
+    fwrite(bytes, 1, sizeof(bytes), f);
+}
+
+static void
+WriteBinaryDouble(FILE *f, double value)
+{
+    uint64_t u;
+    uint8_t bytes[8];
+
+    memcpy(&u, &value, sizeof(u));
+    for (int i = 0; i < 8; i++)
+        bytes[i] = static_cast<uint8_t>(u >> (8 * i));
+    fwrite(bytes, 1, sizeof(bytes), f);
+}
+
+/* the layout qbsp -binaryprt writes, see WritePortalfile in qbsp/portals.cc */
+static void
+WriteBinaryPortalFile(const char *name, const std::vector<int> &leafcluster)
+{
+    const std::vector<testportal_t> prtportals = CorridorPortals(leafcluster);
+    const int numleafs = static_cast<int>(leafcluster.size());
+    const int numclusters = leafcluster.back() + 1;
+
+    FILE *f = fopen(name, "wb");
+    ASSERT_NE(nullptr, f);
+    fprintf(f, "%s\n", PORTALFILEBIN);
+    WriteBinaryInt(f, PORTALFILEBIN_VERSION);
+    WriteBinaryInt(f, numleafs);
+    WriteBinaryInt(f, numclusters);
+    WriteBinaryInt(f, static_cast<int>(prtportals.size()));
+
+    for (const testportal_t &p : prtportals) {
+        WriteBinaryInt(f, static_cast<int>(p.points.size()));
+        WriteBinaryInt(f, p.leafs[0]);
+        WriteBinaryInt(f, p.leafs[1]);
+        for (const qvec3d &point : p.points) {
+            for (int k = 0; k < 3; k++)
+                WriteBinaryDouble(f, point[k]);
+        }
+    }
+
+    if (numclusters != numleafs) {
+        for (int l = 0; l < numleafs; l++)
+            WriteBinaryInt(f, leafcluster[l]);
+    }
+    fclose(f);
+}
+
+/* what LoadPortals leaves in the globals, copied out so the next load can replace it */
+struct loadedportals_t {
+    int portalleafs, portalleafs_real, numportals;
+    std::vector<int> clustermap;
+    std::vector<int> portalleaf;
+    std::vector<qvec4d> portalplane;
+    std::vector<std::vector<qvec3d>> portalpoints;
+    std::vector<std::vector<int>> leafportals;
+};
+
+static loadedportals_t
+LoadAndFreePortals(const char *name)
+{
+    loadedportals_t result;
+    mbsp_t bsp {};
+    bsp.loadversion = &bspver_q1;
+
+    std::string path = name;
+    LoadPortals(&path[0], &bsp);
+
+    result.portalleafs = portalleafs;
+    result.portalleafs_real = portalleafs_real;
+    result.numportals = numportals;
+    if (portalleafs != portalleafs_real)
+        result.clustermap.assign(clustermap, clustermap + portalleafs_real);
+
+    for (int i = 0; i < numportals * 2; i++) {
+        const portal_t *p = &portals[i];
+        result.portalleaf.push_back(p->leaf);
+        result.portalplane.push_back(qvec4d(p->plane.normal[0], p->plane.normal[1], p->plane.normal[2], p->plane.dist));
+
+        std::vector<qvec3d> points;
+        for (int j = 0; j < p->winding->numpoints; j++)
+            points.push_back(qvec3d(p->winding->points[j][0], p->winding->points[j][1], p->winding->points[j][2]));
+        result.portalpoints.push_back(points);
+        free(p->winding);
+    }
+    for (int i = 0; i < portalleafs; i++) {
+        std::vector<int> portalnums;
+        for (int j = 0; j < leafs[i].numportals; j++)
+            portalnums.push_back(static_cast<int>(leafs[i].portals[j] - portals));
+        result.leafportals.push_back(portalnums);
+    }
+
+    free(portals);
+    free(leafs);
+    free(bsp.dvisdata);
+    delete[] clustermap;
+    portals = nullptr;
+    leafs = nullptr;
+    clustermap = nullptr;
+    remove(name);
+
+    return result;
+}
+
+static void
+CheckSamePortals(const loadedportals_t &text, const loadedportals_t &binary)
+{
+    EXPECT_EQ(text.portalleafs, binary.portalleafs);
+    EXPECT_EQ(text.portalleafs_real, binary.portalleafs_real);
+    ASSERT_EQ(text.numportals, binary.numportals);
+    EXPECT_EQ(text.clustermap, binary.clustermap);
+    EXPECT_EQ(text.portalleaf, binary.portalleaf);
+    EXPECT_EQ(text.portalplane, binary.portalplane);
+    EXPECT_EQ(text.portalpoints, binary.portalpoints);
+    EXPECT_EQ(text.leafportals, binary.leafportals);
+}
+
+TEST(vis, BinaryPortalFileMatchesPRT1) {
+    const std::vector<int> leafcluster {0, 1, 2, 3};
+
+    WriteTextPortalFile("test_vis_prt1.prt", leafcluster);
+    WriteBinaryPortalFile("test_vis_prtb.prt", leafcluster);
+    const loadedportals_t text = LoadAndFreePortals("test_vis_prt1.prt");
+    const loadedportals_t binary = LoadAndFreePortals("test_vis_prtb.prt");
+
+    EXPECT_EQ(4, text.portalleafs);
+    EXPECT_EQ(3, text.numportals);
+    CheckSamePortals(text, binary);
+}
+
+TEST(vis, BinaryPortalFileMatchesPRT2) {
+    // leafs 1 and 2 share a detail cluster
+    const std::vector<int> leafcluster {0, 1, 1, 2};
+
+    WriteTextPortalFile("test_vis_prt2.prt", leafcluster);
+    WriteBinaryPortalFile("test_vis_prtb.prt", leafcluster);
+    const loadedportals_t text = LoadAndFreePortals("test_vis_prt2.prt");
+    const loadedportals_t binary = LoadAndFreePortals("test_vis_prtb.prt");
+
+    EXPECT_EQ(3, text.portalleafs);
+    EXPECT_EQ(4, text.portalleafs_real);
+    EXPECT_EQ(2, text.numportals);
+    EXPECT_EQ((std::vector<int> {0, 1, 1, 2}), text.clustermap);
+    CheckSamePortals(text, binary);
+}
@@ -4,10 +4,22 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <set>
+#include <utility>
+#include <vector>
+
 #include <vis/leafbits.hh>
 #include <vis/vis.hh>
 #include <common/log.hh>
 #include <common/threads.hh>
+#include <common/timing.hh>
+#include <common/memstats.hh>
+#include <common/compilecache.hh>
 
 /*
  * If the portal file is "PRT2" format, then the leafs we are dealing with are
@@ -51,6 +63,11 @@ qboolean ambientslime = true;
 qboolean ambientlava = true;
 int visdist = 0;
 qboolean nostate = false;
+qboolean visincremental = false;
+qboolean viscoordinator = false;
+qboolean visworker = false;
+int jobsize = 64;
+int jobtimeout = 600;
 
 #if 0
 void
@@ -249,6 +266,8 @@ FreeStackWinding(winding_t *w, pstack_t *stack)
   is returned.
   ==================
 */
+thread_local int64_t c_clipstackwinding;
+
 winding_t *
 ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 {
@@ -261,6 +280,9 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
     vec3_t mid;
     winding_t *neww;
 
+    if (visstats)
+        c_clipstackwinding++;
+
     /* Fast test first */
     dot = DotProduct(in->origin, split->normal) - split->dist;
     if (dot < -in->radius) {
@@ -362,6 +384,125 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 
 //============================================================================
 
+/*
+ * Portals waiting for GetNextPortal, as (nummightsee, portalnum) with the
+ * least complex on top. UpdateMightsee pushes a new entry when it trims a
+ * queued portal, and the outdated one is skipped when it reaches the top.
+ *
+ * Guarded by ThreadLock.
+ */
+using portalqueue_entry_t = std::pair<int, int>;
+static std::priority_queue<portalqueue_entry_t, std::vector<portalqueue_entry_t>,
+                           std::greater<portalqueue_entry_t>> portalqueue;
+static std::vector<qboolean> portalinqueue;
+static int numqueued;
+
+/*
+ * PortalCompleted packs the portal's mightsee, but flows on other threads
+ * may still be reading the unpacked copy (they saw the portal before it was
+ * done). Every flow gets a ticket when it starts, and a retired mightsee is
+ * freed once all flows that started before it was retired have finished.
+ *
+ * Guarded by ThreadLock.
+ */
+static uint64_t flowticket;
+static std::multiset<uint64_t> activeflows;
+static std::vector<uint64_t> portalticket;
+static std::deque<std::pair<uint64_t, leafbits_t *>> retiredmightsee;
+
+static memcounter_t portalmem("portal mightsee and visbits");
+
+void
+CountPortalMemory(int64_t bytes)
+{
+    portalmem.add(bytes);
+}
+
+int64_t
+PortalMemoryPeak(void)
+{
+    return portalmem.highwater();
+}
+
+/* called with the lock held */
+static void
+RetireMightsee(portal_t *p)
+{
+    retiredmightsee.emplace_back(++flowticket, p->mightsee);
+    p->mightsee = NULL;
+
+    while (!retiredmightsee.empty()) {
+        if (!activeflows.empty() && *activeflows.begin() < retiredmightsee.front().first)
+            break;
+        free(retiredmightsee.front().second);
+        CountPortalMemory(-static_cast<int64_t>(LeafbitsSize(portalleafs)));
+        retiredmightsee.pop_front();
+    }
+}
+
+/*
+ * With -pinthreads, moves a portal's mightsee into memory first touched by
+ * the thread about to flow it, which is the memory it reads most, so on a
+ * NUMA machine it's local to that thread's node. Called with the lock
+ * held; the old copy is retired, other flows may be reading it.
+ */
+static void
+LocalizeMightsee(portal_t *p)
+{
+    const size_t size = LeafbitsSize(portalleafs);
+    leafbits_t *local = static_cast<leafbits_t *>(malloc(size));
+    memcpy(local, p->mightsee, size);
+    CountPortalMemory(static_cast<int64_t>(size));
+
+    RetireMightsee(p);
+    p->mightsee = local;
+}
+
+/*
+  =============
+  QueuePortals
+
+  Sets the portals GetNextPortal hands out; the ones not started yet.
+  =============
+*/
+void
+QueuePortals(const std::vector<int> &portalnums)
+{
+    ThreadLock();
+
+    portalqueue = {};
+    portalinqueue.assign(numportals * 2, false);
+    portalticket.resize(numportals * 2, 0);
+    numqueued = 0;
+    for (const int portalnum : portalnums) {
+        const portal_t *p = &portals[portalnum];
+        if (p->status != pstat_none)
+            continue;
+        portalqueue.emplace(p->nummightsee, portalnum);
+        portalinqueue[portalnum] = true;
+        numqueued++;
+    }
+
+    ThreadUnlock();
+}
+
+/*
+  =============
+  PortalsQueued
+
+  Returns how many portals haven't been handed out yet.
+  =============
+*/
+int
+PortalsQueued(void)
+{
+    ThreadLock();
+    const int count = numqueued;
+    ThreadUnlock();
+
+    return count;
+}
+
 /*
   =============
   GetNextPortal
@@ -374,24 +515,31 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 portal_t *
 GetNextPortal(void)
 {
-    int i;
-    portal_t *p, *ret;
-    unsigned min;
+    portal_t *ret;
 
     ThreadLock();
 
-    min = INT_MAX;
     ret = NULL;
+    while (!portalqueue.empty()) {
+        const portalqueue_entry_t entry = portalqueue.top();
+        portalqueue.pop();
 
-    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
-        if (p->nummightsee < min && p->status == pstat_none) {
-            min = p->nummightsee;
-            ret = p;
-        }
+        portal_t *p = &portals[entry.second];
+        if (p->status != pstat_none || p->nummightsee != entry.first)
+            continue; /* already handed out, or trimmed since queued */
+
+        ret = p;
+        break;
     }
 
     if (ret) {
         ret->status = pstat_working;
+        portalinqueue[ret - portals] = false;
+        numqueued--;
+        if (ThreadsPinned())
+            LocalizeMightsee(ret);
+        portalticket[ret - portals] = ++flowticket;
+        activeflows.insert(flowticket);
         GetThreadWork_Locked__();
     }
 
@@ -428,6 +576,8 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
             ClearLeafBit(p->mightsee, leafnum);
             p->nummightsee--;
             c_mightseeupdate++;
+            if (!portalinqueue.empty() && portalinqueue[p - portals])
+                portalqueue.emplace(p->nummightsee, static_cast<int>(p - portals));
         }
     }
 }
@@ -443,7 +593,7 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
   Called with the lock held.
   =============
 */
-static void
+void
 PortalCompleted(portal_t *completed)
 {
     int i, j, k, bit, numblocks;
@@ -452,11 +602,20 @@ PortalCompleted(portal_t *completed)
     const leaf_t *myleaf;
     const leafblock_t *might, *vis;
     leafblock_t changed;
+    /* guarded by ThreadLock; kept between maps, so grown when portalleafs is */
+    static leafbits_t *unpacked;
+    static size_t unpackedsize;
 
     ThreadLock();
 
     completed->status = pstat_done;
 
+    if (unpackedsize < LeafbitsSize(portalleafs)) {
+        free(unpacked);
+        unpackedsize = LeafbitsSize(portalleafs);
+        unpacked = static_cast<leafbits_t *>(malloc(unpackedsize));
+    }
+
     /*
      * For each portal on the leaf, check the leafs we eliminated from
      * mightsee during the full vis so far.
@@ -467,9 +626,17 @@ PortalCompleted(portal_t *completed)
         if (p->status != pstat_done)
             continue;
 
-        might = p->mightsee->bits;
+        if (p->mightsee) {
+            might = p->mightsee->bits;
+        } else {
+            UnpackMightsee(p, unpacked);
+            might = unpacked->bits;
+        }
         vis = p->visbits->bits;
-        numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
+        numblocks = LeafbitsBlocks(portalleafs);
+        if (!LeafBitsOutside(might, vis, numblocks))
+            continue;
+
         for (j = 0; j < numblocks; j++) {
             changed = might[j] & ~vis[j];
             if (!changed)
@@ -503,11 +670,20 @@ PortalCompleted(portal_t *completed)
         }
     }
 
+    const size_t portalnum = completed - portals;
+    if (portalnum < portalticket.size() && portalticket[portalnum]) {
+        activeflows.erase(activeflows.find(portalticket[portalnum]));
+        portalticket[portalnum] = 0;
+    }
+    PackMightsee(completed);
+    RetireMightsee(completed);
+    JournalPortal(static_cast<int>(portalnum));
+
     ThreadUnlock();
 }
 
 double starttime, endtime, statetime;
-static double stateinterval;
+double stateinterval;
 
 /*
   ==============
@@ -517,24 +693,31 @@ static double stateinterval;
 void *
 LeafThread(void *arg)
 {
-    double now;
+    double now, flowstart;
     portal_t *p;
+    flowstats_t flow;
 
     do {
         ThreadLock();
         /* Save state if sufficient time has elapsed */
         now = I_FloatTime();
-        if (now > statetime + stateinterval) {
+        if (!visworker && now > statetime + stateinterval) {
             statetime = now;
-            SaveVisState();
+            CheckpointVisState();
         }
         ThreadUnlock();
+        ReportVisStats();
 
         p = GetNextPortal();
         if (!p)
             break;
 
-        PortalFlow(p);
+        flowstart = I_FloatTime();
+        {
+            timingscope_t scope("PortalFlow", static_cast<int>(p - portals));
+            PortalFlow(p, &flow);
+        }
+        VisStatsPortalFlowed(p, I_FloatTime() - flowstart, &flow);
 
         PortalCompleted(p);
 
@@ -548,6 +731,33 @@ LeafThread(void *arg)
 }
 
 
+/*
+ * Each leaf's (or cluster's) row is built and compressed on the thread pool,
+ * then AppendVisRow copies them into the vismap in order, so the result
+ * doesn't depend on which thread finished first.
+ */
+typedef struct {
+    std::vector<uint8_t> compressed;
+    int numvis;
+} visrow_t;
+
+static int
+AppendVisRow(const visrow_t *row)
+{
+    uint8_t *dest;
+
+    dest = vismap_p;
+    vismap_p += row->compressed.size();
+
+    if (vismap_p > vismap_end)
+        Error("Vismap expansion overflow");
+
+    memcpy(dest, row->compressed.data(), row->compressed.size());
+
+    /* leaf 0 is a common solid */
+    return dest - vismap;
+}
+
 /*
   ===============
   LeafFlow
@@ -558,14 +768,13 @@ LeafThread(void *arg)
 int64_t totalvis;
 
 static void
-LeafFlow(int leafnum, mleaf_t *dleaf, const mbsp_t *bsp)
+LeafFlow(int leafnum, visrow_t *row, const mbsp_t *bsp)
 {
     leaf_t *leaf;
     uint8_t *outbuffer;
     uint8_t *compressed;
     int i, j, shift, len;
     int numvis;
-    uint8_t *dest;
     const portal_t *p;
 
     /*
@@ -591,54 +800,39 @@ LeafFlow(int leafnum, mleaf_t *dleaf, const mbsp_t *bsp)
     for (i = 0; i < portalleafs; i++)
         if (outbuffer[i >> 3] & (1 << (i & 3)))
             numvis++;
+    row->numvis = numvis;
 
     /*
      * compress the bit string
      */
-    if (verbose > 1)
-        logprint("leaf %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
-
     /* Allocate for worst case where RLE might grow the data (unlikely) */
     compressed = static_cast<uint8_t *>(malloc(qmax(1, portalleafs * 2 / 8)));
     len = CompressRow(outbuffer, (portalleafs + 7) >> 3, compressed);
-
-    dest = vismap_p;
-    vismap_p += len;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
-
-    /* leaf 0 is a common solid */
-    dleaf->visofs = dest - vismap;
-
-    memcpy(dest, compressed, len);
+    row->compressed.assign(compressed, compressed + len);
     free(compressed);
 }
 
 
 static void
-ClusterFlow(int clusternum, leafbits_t *buffer, const mbsp_t *bsp)
+ClusterFlow(int clusternum, leafbits_t *buffer, visrow_t *row, const mbsp_t *bsp)
 {
     leaf_t *leaf;
     uint8_t *outbuffer;
     uint8_t *compressed;
-    int i, j, len;
+    int i, len;
     int numvis, numblocks;
-    uint8_t *dest;
     const portal_t *p;
 
     /*
      * Collect visible bits from all portals into buffer
      */
     leaf = &leafs[clusternum];
-    numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
+    numblocks = LeafbitsBlocks(portalleafs);
     for (i = 0; i < leaf->numportals; i++) {
         p = leaf->portals[i];
         if (p->status != pstat_done)
             Error("portal not done");
-        for (j = 0; j < numblocks; j++)
-            buffer->bits[j] |= p->visbits->bits[j];
+        MergeLeafBits(buffer->bits, p->visbits->bits, numblocks);
     }
 
     // ericw -- this seems harmless and the fix for https://github.com/ericwa/ericw-tools/issues/261
@@ -656,11 +850,10 @@ ClusterFlow(int clusternum, leafbits_t *buffer, const mbsp_t *bsp)
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
         outbuffer = uncompressed_q2 + clusternum * leafbytes;
         for (i = 0; i < portalleafs; i++) {
-            if (TestLeafBit(buffer, i)) {
+            if (TestLeafBit(buffer, i))
                 outbuffer[i >> 3] |= (1 << (i & 7));
-                numvis++;
-            }
         }
+        numvis = CountLeafBits(buffer->bits, numblocks);
     } else {
         outbuffer = uncompressed + clusternum * leafbytes_real;
         for (i = 0; i < portalleafs_real; i++) {
@@ -670,28 +863,11 @@ ClusterFlow(int clusternum, leafbits_t *buffer, const mbsp_t *bsp)
             }
         }
     }
+    row->numvis = numvis;
 
     /*
      * compress the bit string
      */
-    if (verbose > 1)
-        logprint("cluster %4i : %4i visible\n", clusternum, numvis);
-    
-    /*
-     * increment totalvis by 
-     * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
-     */
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        // FIXME: not sure what this is supposed to be?
-        totalvis += numvis;
-    } else {
-    	for (i = 0; i < portalleafs_real; i++) {
-        	if (clustermap[i] == clusternum) {
-         	    totalvis += numvis;
-        	}
-    	}
-    }
-
     /* Allocate for worst case where RLE might grow the data (unlikely) */
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
         compressed = static_cast<uint8_t *>(malloc(portalleafs * 2 / 8));
@@ -700,26 +876,7 @@ ClusterFlow(int clusternum, leafbits_t *buffer, const mbsp_t *bsp)
         compressed = static_cast<uint8_t *>(malloc(portalleafs_real * 2 / 8));
         len = CompressRow(outbuffer, (portalleafs_real + 7) >> 3, compressed);
     }
-
-    dest = vismap_p;
-    vismap_p += len;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
-
-    /* leaf 0 is a common solid */
-    leaf->visofs = dest - vismap;
-
-    // Set pointers
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        for (i = 1; i < bsp->numleafs; i++) {
-            if (bsp->dleafs[i].cluster == clusternum) {
-                bsp->dleafs[i].visofs = leaf->visofs;
-            }
-        }
-    }
-
-    memcpy(dest, compressed, len);
+    row->compressed.assign(compressed, compressed + len);
     free(compressed);
 }
 
@@ -734,12 +891,20 @@ CalcPortalVis(const mbsp_t *bsp)
     int i, startcount;
     portal_t *p;
 
-// fastvis just uses mightsee for a very loose bound
+// fastvis just uses mightsee for a very loose bound, except where a full
+// vis in the state file has already finished the portal
     if (fastvis) {
+        startcount = 0;
         for (i = 0; i < numportals * 2; i++) {
+            if (portals[i].status == pstat_done) {
+                startcount++;
+                continue;
+            }
             portals[i].visbits = portals[i].mightsee;
             portals[i].status = pstat_done;
         }
+        if (startcount)
+            logprint("Using full vis for %d of %d portals\n", startcount, numportals * 2);
         return;
     }
 
@@ -751,9 +916,24 @@ CalcPortalVis(const mbsp_t *bsp)
         if (p->status == pstat_done)
             startcount++;
     }
-    RunThreadsOn(startcount, numportals * 2, LeafThread, NULL);
+    /* checkpoints append to this, see StartVisJournal */
+    statetime = I_FloatTime();
+    SaveVisState();
+    StartVisJournal();
+    StartVisStats();
 
+    if (viscoordinator) {
+        RunVisCoordinator();
+    } else {
+        std::vector<int> portalnums(numportals * 2);
+        std::iota(portalnums.begin(), portalnums.end(), 0);
+        QueuePortals(portalnums);
+        RunThreadsOn(startcount, numportals * 2, LeafThread, NULL);
+    }
+
+    StopVisJournal();
     SaveVisState();
+    FinishVisStats();
 
     if (verbose) {
         logprint("portalcheck: %i  portaltest: %i  portalpass: %i\n",
@@ -778,33 +958,93 @@ CalcVis(const mbsp_t *bsp)
         logprint("Loaded previous state. Resuming progress...\n");
     } else {
         logprint("Calculating Base Vis:\n");
-        BasePortalVis();
+        {
+            timingscope_t scope("BasePortalVis");
+            BasePortalVis();
+        }
+
+        /* the map changed since the state file; keep what the change couldn't reach */
+        if (visincremental) {
+            timingscope_t scope("LoadIncrementalVisState");
+            LoadIncrementalVisState();
+        }
+
+        /* a later full vis can start from this instead of redoing it */
+        if (fastvis && !nostate) {
+            statetime = I_FloatTime();
+            SaveVisState();
+        }
     }
 
     logprint("Calculating Full Vis:\n");
-    CalcPortalVis(bsp);
+    {
+        timingscope_t scope("CalcPortalVis");
+        CalcPortalVis(bsp);
+    }
 
 //
 // assemble the leaf vis lists by oring and compressing the portal lists
 //
+    std::vector<visrow_t> rows(portalleafs);
+
     if (portalleafs == portalleafs_real && bsp->loadversion->game->id != GAME_QUAKE_II) {
         // Legacy, non-detail Q1 vis codepath
         // FIXME: Should be possible to remove this and just use ClusterFlow even on Q1 maps
         // with no detail.
-        for (i = 0; i < portalleafs; i++)
-            LeafFlow(i, &bsp->dleafs[i + 1], bsp);
+        timingscope_t scope("LeafFlow");
+        RunThreadsOn(0, portalleafs, 16, [&](int leafnum, int thread) {
+            LeafFlow(leafnum, &rows[leafnum], bsp);
+        });
+        for (i = 0; i < portalleafs; i++) {
+            if (verbose > 1)
+                logprint("leaf %4i : %4i visible\n", i, rows[i].numvis);
+            totalvis += rows[i].numvis;
+            bsp->dleafs[i + 1].visofs = AppendVisRow(&rows[i]);
+        }
     } else {
-        leafbits_t *buffer;
+        std::vector<leafbits_t *> buffers(numthreads);
 
         logprint("Expanding clusters...\n");
-        buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        timingscope_t scope("ClusterFlow");
+        for (leafbits_t *&buffer : buffers)
+            buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+        RunThreadsOn(0, portalleafs, 16, [&](int clusternum, int thread) {
+            memset(buffers[thread], 0, LeafbitsSize(portalleafs));
+            ClusterFlow(clusternum, buffers[thread], &rows[clusternum], bsp);
+        });
+        for (leafbits_t *buffer : buffers)
+            free(buffer);
+
+        /* number of real leafs in each cluster */
+        std::vector<int> clusterleafs(portalleafs, 0);
+        for (i = 0; i < portalleafs_real; i++)
+            clusterleafs[clustermap[i]]++;
+
         for (i = 0; i < portalleafs; i++) {
-            memset(buffer, 0, LeafbitsSize(portalleafs));
-            ClusterFlow(i, buffer, bsp);
+            if (verbose > 1)
+                logprint("cluster %4i : %4i visible\n", i, rows[i].numvis);
+
+            /*
+             * increment totalvis by
+             * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
+             */
+            if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+                // FIXME: not sure what this is supposed to be?
+                totalvis += rows[i].numvis;
+            } else {
+                totalvis += static_cast<int64_t>(rows[i].numvis) * clusterleafs[i];
+            }
+            leafs[i].visofs = AppendVisRow(&rows[i]);
         }
-        free(buffer);
-        
+
         // Set pointers
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            for (i = 1; i < bsp->numleafs; i++) {
+                const int cluster = bsp->dleafs[i].cluster;
+                if (cluster >= 0 && cluster < portalleafs)
+                    bsp->dleafs[i].visofs = leafs[cluster].visofs;
+            }
+        }
         for (i = 0; i < portalleafs_real; i++) {
             bsp->dleafs[i + 1].visofs = leafs[clustermap[i]].visofs;
         }
@@ -1020,7 +1260,7 @@ CalcPassages(void)
 
 // ===========================================================================
 
-static void
+void
 SetWindingSphere(winding_t *w)
 {
     int i;
@@ -1044,6 +1284,32 @@ SetWindingSphere(winding_t *w)
     w->radius = max_r;
 }
 
+/* binary .prt values are little-endian, whatever the host */
+static int
+ReadBinaryInt(FILE *f)
+{
+    uint8_t bytes[4];
+
+    if (fread(bytes, 1, sizeof(bytes), f) != sizeof(bytes))
+        Error("%s: unexpected end of %s file\n", __func__, PORTALFILEBIN);
+    return (int32_t)(bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+}
+
+static double
+ReadBinaryDouble(FILE *f)
+{
+    uint8_t bytes[8];
+    uint64_t u = 0;
+    double d;
+
+    if (fread(bytes, 1, sizeof(bytes), f) != sizeof(bytes))
+        Error("%s: unexpected end of %s file\n", __func__, PORTALFILEBIN);
+    for (int i = 0; i < 8; i++)
+        u |= (uint64_t)bytes[i] << (8 * i);
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
 /*
   ============
   LoadPortals
@@ -1065,7 +1331,7 @@ LoadPortals(char *name, mbsp_t *bsp)
     if (!strcmp(name, "-"))
         f = stdin;
     else {
-        f = fopen(name, "r");
+        f = fopen(name, "rb");
         if (!f) {
             logprint("%s: couldn't read %s\n", __func__, name);
             logprint("No vising performed.\n");
@@ -1076,11 +1342,35 @@ LoadPortals(char *name, mbsp_t *bsp)
     /*
      * Parse the portal file header
      */
-    count = fscanf(f, "%79s\n", magic);
+    count = fscanf(f, "%79s", magic);
     if (count != 1)
         Error("%s: unknown header: %s\n", __func__, magic);
 
-    if (!strcmp(magic, PORTALFILE)) {
+    const bool binary = !strcmp(magic, PORTALFILEBIN);
+    if (binary) {
+        int version, numleafs, numclusters;
+
+        if (fgetc(f) != '\n')
+            Error("%s: unable to parse %s HEADER\n", __func__, PORTALFILEBIN);
+        version = ReadBinaryInt(f);
+        if (version != PORTALFILEBIN_VERSION)
+            Error("%s: unsupported %s version %d\n", __func__, PORTALFILEBIN, version);
+        numleafs = ReadBinaryInt(f);
+        numclusters = ReadBinaryInt(f);
+        numportals = ReadBinaryInt(f);
+
+        portalleafs = numclusters;
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            portalleafs_real = 0;
+            logprint("%6d clusters\n", portalleafs);
+        } else {
+            portalleafs_real = numleafs;
+            logprint("%6d leafs\n", portalleafs_real);
+            if (portalleafs != portalleafs_real)
+                logprint("%6d clusters\n", portalleafs);
+        }
+        logprint("%6d portals\n", numportals);
+    } else if (!strcmp(magic, PORTALFILE)) {
         count = fscanf(f, "%i\n%i\n", &portalleafs, &numportals);
         if (count != 2)
             Error("%s: unable to parse %s HEADER\n", __func__, PORTALFILE);
@@ -1153,7 +1443,11 @@ LoadPortals(char *name, mbsp_t *bsp)
     vismap_end = vismap + MAX_MAP_VISIBILITY;
 
     for (i = 0, p = portals; i < numportals; i++) {
-        if (fscanf(f, "%i %i %i ", &numpoints, &leafnums[0], &leafnums[1])
+        if (binary) {
+            numpoints = ReadBinaryInt(f);
+            leafnums[0] = ReadBinaryInt(f);
+            leafnums[1] = ReadBinaryInt(f);
+        } else if (fscanf(f, "%i %i %i ", &numpoints, &leafnums[0], &leafnums[1])
             != 3)
             Error("%s: reading portal %i", __func__, i);
         if (numpoints > MAX_WINDING)
@@ -1170,12 +1464,16 @@ LoadPortals(char *name, mbsp_t *bsp)
             int k;
 
             // scanf into double, then assign to vec_t
-            if (fscanf(f, "(%lf %lf %lf ) ", &v[0], &v[1], &v[2]) != 3)
+            if (binary) {
+                for (k = 0; k < 3; k++)
+                    v[k] = ReadBinaryDouble(f);
+            } else if (fscanf(f, "(%lf %lf %lf ) ", &v[0], &v[1], &v[2]) != 3)
                 Error("%s: reading portal %i", __func__, i);
             for (k = 0; k < 3; k++)
                 w->points[j][k] = (vec_t)v[k];
         }
-        fscanf(f, "\n");
+        if (!binary)
+            fscanf(f, "\n");
 
         // calc plane
         PlaneFromWinding(w, &plane);
@@ -1220,7 +1518,15 @@ LoadPortals(char *name, mbsp_t *bsp)
         clustermap = nullptr;
     } else if (portalleafs != portalleafs_real) {
         clustermap = new int[portalleafs_real];
-        if (!strcmp(magic, PORTALFILE2)) {
+        if (binary) {
+            for (i = 0; i < portalleafs_real; i++) {
+                const int clusternum = ReadBinaryInt(f);
+                if (clusternum < 0 || clusternum >= portalleafs) {
+                    Error("Invalid cluster number %d in cluster map, number of clusters: %d\n", clusternum, portalleafs);
+                }
+                clustermap[i] = clusternum;
+            }
+        } else if (!strcmp(magic, PORTALFILE2)) {
             for (i = 0; i < portalleafs; i++) {
                 while (1) {
                     int leafnum;
@@ -1263,14 +1569,15 @@ char sourcefile[1024];
 char portalfile[1024];
 char statefile[1024];
 char statetmpfile[1024];
+char visgeometryfile[1024];
 
 /*
   ===========
-  main
+  vis_main
   ===========
 */
 int
-main(int argc, char **argv)
+vis_main(int argc, char **argv)
 {
     bspdata_t bspdata;
     mbsp_t *const bsp = &bspdata.data.mbsp;
@@ -1324,6 +1631,48 @@ main(int argc, char **argv)
         } else if (!strcmp(argv[i], "-nostate")) {
             logprint("loading from state file disabled\n");
             nostate = true;
+        } else if (!strcmp(argv[i], "-incremental")) {
+            logprint("reusing the vis of portals a map change didn't reach\n");
+            visincremental = true;
+        } else if (!strcmp(argv[i], "-coordinator")) {
+            logprint("distributing work to -worker processes\n");
+            viscoordinator = true;
+        } else if (!strcmp(argv[i], "-worker")) {
+            logprint("running as a worker for a -coordinator\n");
+            visworker = true;
+        } else if (!strcmp(argv[i], "-jobsize")) {
+            jobsize = atoi(argv[i + 1]);
+            i++;
+            logprint("jobsize = %i\n", jobsize);
+        } else if (!strcmp(argv[i], "-jobtimeout")) {
+            jobtimeout = atoi(argv[i + 1]);
+            i++;
+            logprint("jobtimeout = %i\n", jobtimeout);
+        } else if (!strcmp(argv[i], "-stats")) {
+            logprint("writing throughput statistics\n");
+            visstats = true;
+        } else if (!strcmp(argv[i], "-numanode")) {
+            if (i + 1 >= argc)
+                Error("-numanode needs a node number");
+            BindToNumaNode(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "-pinthreads")) {
+            logprint("pinning threads to CPUs\n");
+            PinThreads();
+        } else if (!strcmp(argv[i], "-membudget")) {
+            Mem_SetBudget(i + 1 < argc ? argv[i + 1] : nullptr);
+            i++;
+            logprint("membudget = %s MB\n", argv[i]);
+        } else if (!strcmp(argv[i], "-timing")) {
+            logprint("timing the phases\n");
+            timingenabled = true;
+        } else if (!strcmp(argv[i], "-timingtrace")) {
+            logprint("timing the phases, with a trace\n");
+            timingtrace = true;
+        } else if (!strcmp(argv[i], "-cachedir")) {
+            if (i + 1 >= argc)
+                Error("-cachedir needs a directory");
+            compilecachedir = argv[++i];
+            logprint("compile cache in %s\n", compilecachedir.c_str());
         } else if (argv[i][0] == '-')
             Error("Unknown option \"%s\"", argv[i]);
         else
@@ -1331,31 +1680,74 @@ main(int argc, char **argv)
     }
 
     if (i != argc - 1) {
-        printf("usage: vis [-threads #] [-level 0-4] [-fast] [-v|-vv] "
-               "[-credits] bspfile\n");
+        printf("usage: vis [-threads #] [-level 0-4] [-fast] [-incremental] [-v|-vv] "
+               "[-coordinator|-worker] [-jobsize n] [-jobtimeout secs] [-stats] [-timing|-timingtrace] [-membudget mb] "
+               "[-numanode n] [-pinthreads] [-cachedir dir] [-credits] bspfile\n");
         exit(1);
     }
 
+    if (viscoordinator && visworker)
+        Error("-coordinator and -worker can't be combined");
+    if ((viscoordinator || visworker) && (nostate || fastvis))
+        Error("-coordinator and -worker need the state file, and don't work with -fast");
+    if (jobsize < 1)
+        Error("-jobsize must be at least 1");
+    if (visincremental && (nostate || visworker))
+        Error("-incremental needs the state file, and isn't for -worker");
+
     logprint("running with %d threads\n", numthreads);
     logprint("testlevel = %i\n", testlevel);
 
     stateinterval = 300; /* 5 minutes */
     starttime = statetime = I_FloatTime();
+    Timing_Start("vis");
 
     strcpy(sourcefile, argv[i]);
     StripExtension(sourcefile);
     DefaultExtension(sourcefile, ".bsp");
 
-    LoadBSPFile(sourcefile, &bspdata);
+    strcpy(portalfile, argv[i]);
+    StripExtension(portalfile);
+    strcat(portalfile, ".prt");
+
+    /* the bsp is rewritten, so the key is taken before anything else */
+    uint64_t cachekey = 0;
+    if (!compilecachedir.empty() && !visworker) {
+        cachekey = CompileCache_Begin("vis");
+        CompileCache_HashArgs(&cachekey, std::vector<std::string>(argv + 1, argv + i));
+        CompileCache_HashFile(&cachekey, sourcefile);
+        CompileCache_HashFile(&cachekey, portalfile);
+
+        if (CompileCache_Restore("vis", cachekey, StrippedExtension(sourcefile), { ".bsp" })) {
+            endtime = I_FloatTime();
+            logprint("%5.1f seconds elapsed\n", endtime - starttime);
+            Timing_Finish(sourcefile);
+            ShutdownThreadPool();
+            close_log();
+            return 0;
+        }
+    }
+
+    {
+        timingscope_t scope("LoadBSPFile");
+        LoadBSPFile(sourcefile, &bspdata);
+    }
 
     loadversion = bspdata.version;
     ConvertBSPFormat(&bspdata, &bspver_generic);
 
-    strcpy(portalfile, argv[i]);
-    StripExtension(portalfile);
-    strcat(portalfile, ".prt");
+    {
+        timingscope_t scope("LoadPortals");
+        LoadPortals(portalfile, bsp);
+    }
 
-    LoadPortals(portalfile, bsp);
+    if (membudget) {
+        /* every portal ends up with visbits, and mightsee until it's done */
+        const int64_t leafbitsbytes = static_cast<int64_t>(numportals) * 2 * 2 * LeafbitsSize(portalleafs);
+        if (leafbitsbytes > membudget)
+            logprint("WARNING: the portals' leafbits alone need up to %.0f MB, more than -membudget\n",
+                     leafbitsbytes / (1024.0 * 1024.0));
+    }
 
     strcpy(statefile, sourcefile);
     StripExtension(statefile);
@@ -1365,6 +1757,10 @@ main(int argc, char **argv)
     StripExtension(statetmpfile);
     DefaultExtension(statetmpfile, ".vi0");
 
+    strcpy(visgeometryfile, sourcefile);
+    StripExtension(visgeometryfile);
+    DefaultExtension(visgeometryfile, ".vip");
+
     if (bsp->loadversion->game->id != GAME_QUAKE_II) {
         uncompressed = static_cast<uint8_t *>(calloc(portalleafs, leafbytes_real));
     } else {
@@ -1373,10 +1769,29 @@ main(int argc, char **argv)
 
 //    CalcPassages ();
 
-    CalcVis(bsp);
+    if (visworker) {
+        RunVisWorker();
+
+        endtime = I_FloatTime();
+        logprint("%5.1f seconds elapsed\n", endtime - starttime);
+        Mem_Report();
+
+        ShutdownThreadPool();
+        close_log();
+        return 0;
+    }
+
+    {
+        timingscope_t scope("CalcVis");
+        CalcVis(bsp);
+    }
+
+    Timing_Count("c_noclip", c_noclip);
+    Timing_Count("c_chains", c_chains);
 
     logprint("c_noclip: %i\n", c_noclip);
     logprint("c_chains: %lu\n", c_chains);
+    logprint("portal mightsee/visbits peak: %.1f MB\n", PortalMemoryPeak() / (1024.0 * 1024.0));
 
     bsp->visdatasize = vismap_p - bsp->dvisdata;
     logprint("visdatasize:%i  compressed from %u\n",
@@ -1384,19 +1799,30 @@ main(int argc, char **argv)
     
     // no ambient sounds for Q2
     if (bsp->loadversion->game->id != GAME_QUAKE_II) {
+        timingscope_t scope("CalcAmbientSounds");
         CalcAmbientSounds(bsp);
     }
 
     /* Convert data format back if necessary */
     ConvertBSPFormat(&bspdata, loadversion);
 
-    WriteBSPFile(sourcefile, &bspdata);
+    {
+        timingscope_t scope("WriteBSPFile");
+        WriteBSPFile(sourcefile, &bspdata);
+    }
+
+    if (!compilecachedir.empty())
+        CompileCache_Store("vis", cachekey, StrippedExtension(sourcefile), { ".bsp" });
 
 //    unlink (portalfile);
 
     endtime = I_FloatTime();
     logprint("%5.1f seconds elapsed\n", endtime - starttime);
 
+    Mem_Report();
+    Timing_Finish(sourcefile);
+
+    ShutdownThreadPool();
     close_log();
 
     return 0;
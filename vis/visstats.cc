@@ -0,0 +1,262 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Throughput statistics (-stats)
+ *
+ * Every portal flowed in this run records its time, the number of
+ * ClipStackWinding calls and the deepest RecursiveLeafFlow level it
+ * reached. Each thread records how long it spent flowing portals. A
+ * summary with an ETA is logged every minute. At the end the slowest
+ * portals are logged, and everything is written to map.visstats.json.
+ *
+ * Flow time grows with a portal's mightsee, so the ETA weights the
+ * remaining portals by nummightsee rather than counting them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include <vis/vis.hh>
+#include <common/log.hh>
+#include <common/threads.hh>
+
+using nlohmann::json;
+
+qboolean visstats = false;
+
+#define STATS_INTERVAL 60 /* seconds between log reports */
+#define STATS_SLOWEST 10  /* portals listed in the final report */
+
+typedef struct {
+    int portalnum;
+    int mightsee, cansee;
+    double seconds;
+    int64_t clips;
+    int depth;
+} portalstats_t;
+
+typedef struct {
+    int portals;
+    double busy;
+} threadstats_t;
+
+static std::mutex stats_lock;
+static std::vector<portalstats_t> portalstats;
+static std::vector<threadstats_t> threadstats;
+static std::atomic<int> numstatsthreads;
+static thread_local int statsthread = -1;
+static double stats_starttime, stats_reporttime;
+static int64_t stats_doneweight;
+
+/* status and nummightsee change under ThreadLock, in PortalCompleted */
+static void
+GetWeights(int64_t *remaining, int *numremaining)
+{
+    *remaining = 0;
+    *numremaining = 0;
+
+    ThreadLock();
+    for (int i = 0; i < numportals * 2; i++) {
+        if (portals[i].status == pstat_done)
+            continue;
+        *remaining += portals[i].nummightsee;
+        (*numremaining)++;
+    }
+    ThreadUnlock();
+}
+
+/*
+  ==============
+  StartVisStats
+
+  Called before the portals are flowed.
+  ==============
+*/
+void
+StartVisStats(void)
+{
+    if (!visstats)
+        return;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+
+    portalstats.clear();
+    threadstats.clear();
+    stats_doneweight = 0;
+    stats_starttime = stats_reporttime = I_FloatTime();
+}
+
+/*
+  ==============
+  VisStatsPortalFlowed
+
+  Called by the thread that flowed p, once it's done.
+  ==============
+*/
+void
+VisStatsPortalFlowed(const portal_t *p, double seconds, const flowstats_t *flow)
+{
+    if (!visstats)
+        return;
+
+    if (statsthread < 0)
+        statsthread = numstatsthreads++;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+
+    portalstats_t stats;
+    stats.portalnum = static_cast<int>(p - portals);
+    stats.mightsee = p->nummightsee;
+    stats.cansee = p->numcansee;
+    stats.seconds = seconds;
+    stats.clips = flow->clips;
+    stats.depth = flow->depth;
+    portalstats.push_back(stats);
+    stats_doneweight += p->nummightsee;
+
+    if (static_cast<int>(threadstats.size()) <= statsthread)
+        threadstats.resize(statsthread + 1, {0, 0});
+    threadstats[statsthread].portals++;
+    threadstats[statsthread].busy += seconds;
+}
+
+static double
+GetETA(double elapsed, int64_t remaining)
+{
+    if (!stats_doneweight)
+        return -1;
+    return remaining * elapsed / stats_doneweight;
+}
+
+/*
+  ==============
+  ReportVisStats
+
+  Logs a one line summary if a minute has passed since the last one.
+  ==============
+*/
+void
+ReportVisStats(void)
+{
+    if (!visstats)
+        return;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+
+    const double now = I_FloatTime();
+    if (now < stats_reporttime + STATS_INTERVAL)
+        return;
+    stats_reporttime = now;
+
+    int64_t remaining, clips = 0;
+    int numremaining, depth = 0;
+    GetWeights(&remaining, &numremaining);
+    for (const portalstats_t &stats : portalstats) {
+        clips += stats.clips;
+        depth = std::max(depth, stats.depth);
+    }
+
+    const double elapsed = now - stats_starttime;
+    const double eta = GetETA(elapsed, remaining);
+    logprint("stats: %d portals flowed, %d left, %.0f clips/sec, max depth %d, ETA %s\n",
+             static_cast<int>(portalstats.size()), numremaining,
+             elapsed > 0 ? clips / elapsed : 0.0, depth,
+             eta < 0 ? "unknown" : std::to_string(static_cast<int>(eta)).append(" secs").c_str());
+}
+
+/*
+  ==============
+  FinishVisStats
+
+  Logs the slowest portals and writes the statistics file.
+  ==============
+*/
+void
+FinishVisStats(void)
+{
+    if (!visstats)
+        return;
+
+    std::lock_guard<std::mutex> lock(stats_lock);
+
+    const double elapsed = I_FloatTime() - stats_starttime;
+    std::vector<portalstats_t> slowest = portalstats;
+    std::sort(slowest.begin(), slowest.end(), [](const portalstats_t &a, const portalstats_t &b) {
+        return a.seconds > b.seconds;
+    });
+    if (slowest.size() > STATS_SLOWEST)
+        slowest.resize(STATS_SLOWEST);
+
+    logprint("stats: slowest portals:\n");
+    for (const portalstats_t &stats : slowest) {
+        const portal_t *p = &portals[stats.portalnum];
+        logprint("  portal %6d (%.0f %.0f %.0f) into leaf %d: %.2f secs, mightsee %d, cansee %d, %lld clips, depth %d\n",
+                 stats.portalnum, p->winding->origin[0], p->winding->origin[1], p->winding->origin[2],
+                 p->leaf, stats.seconds, stats.mightsee, stats.cansee,
+                 static_cast<long long>(stats.clips), stats.depth);
+    }
+
+    json j = json::object();
+    j["elapsed"] = elapsed;
+    j["numportals"] = numportals * 2;
+    j["portalleafs"] = portalleafs;
+
+    json &threads = (j.emplace("threads", json::array())).first.value();
+    for (const threadstats_t &stats : threadstats) {
+        json &thread = threads.insert(threads.end(), json::object()).value();
+        thread["portals"] = stats.portals;
+        thread["busy"] = stats.busy;
+        thread["utilization"] = elapsed > 0 ? stats.busy / elapsed : 0.0;
+    }
+
+    json &flowed = (j.emplace("portals", json::array())).first.value();
+    for (const portalstats_t &stats : portalstats) {
+        const portal_t *p = &portals[stats.portalnum];
+        json &portal = flowed.insert(flowed.end(), json::object()).value();
+        portal["portal"] = stats.portalnum;
+        portal["leaf"] = p->leaf;
+        portal["origin"] = json::array({ p->winding->origin[0], p->winding->origin[1], p->winding->origin[2] });
+        portal["mightsee"] = stats.mightsee;
+        portal["cansee"] = stats.cansee;
+        portal["seconds"] = stats.seconds;
+        portal["clips"] = stats.clips;
+        portal["depth"] = stats.depth;
+    }
+
+    char filename[1024];
+    strcpy(filename, sourcefile);
+    StripExtension(filename);
+    strcat(filename, ".visstats.json");
+
+    FILE *f = SafeOpenWrite(filename);
+    const std::string text = j.dump(2);
+    SafeWrite(f, text.c_str(), text.size());
+    fclose(f);
+
+    logprint("stats: wrote %s\n", filename);
+}